@@ -0,0 +1,353 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/batch.h"
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "receiver/receiver.h"
+#include "util/alloc.h"
+#include "util/fork.h"
+#include "util/log.h"
+#include "util/tsd.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * @file batch.c
+ *
+ * Per-thread batches of closed spans.
+ *
+ * Each thread which closes spans gets its own batch, found through a pthread
+ * key.  A batch is handed to the span receiver when it holds max_spans
+ * spans, or when a span is added more than max_age_ms after the first span
+ * in it.  Batches are also handed over when their thread exits and when the
+ * tracer is freed.  A thread which stops closing spans may leave a partial
+ * batch behind until then.
+ *
+ * A forked child discards the batches it inherited, since the parent will
+ * deliver them.
+ */
+
+/**
+ * The largest batch size we allow.
+ */
+#define HTRACE_BATCH_MAX_SIZE 1024
+
+/**
+ * One thread's batch.
+ */
+struct htrace_batch {
+    /**
+     * The batcher which owns this batch.
+     */
+    struct htrace_batcher *bat;
+
+    /**
+     * The next and previous batches in the batcher's list.  Protected by the
+     * batcher lock.
+     */
+    struct htrace_batch *next;
+    struct htrace_batch *prev;
+
+    /**
+     * Lock protecting the spans.  This is normally only taken by the owning
+     * thread, so it is rarely contended.  When both locks are needed, the
+     * batcher lock must be taken first.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * The end time of the first span in the batch.
+     */
+    uint64_t first_ms;
+
+    /**
+     * The number of spans in the batch.
+     */
+    int num_spans;
+
+    /**
+     * The spans.
+     */
+    struct htrace_span *spans[];
+};
+
+struct htrace_batcher {
+    /**
+     * The tracer.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The number of spans that fills a batch.
+     */
+    int max_spans;
+
+    /**
+     * How long a span can wait in a batch, in milliseconds.
+     */
+    uint64_t max_age_ms;
+
+    /**
+     * Each thread's struct htrace_batch.
+     */
+    struct htrace_tsd tsd;
+
+    /**
+     * Protects batches.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * All the batches.
+     */
+    struct htrace_batch *batches;
+
+    /**
+     * Discards the inherited batches in a forked child.
+     */
+    struct htrace_fork_hook fork_hook;
+};
+
+/**
+ * Give the spans in a batch to the span receiver.  This must be called with
+ * the batch lock held.
+ */
+static void htrace_batch_deliver(struct htrace_batch *batch)
+{
+    struct htrace_rcv *rcv = batch->bat->tracer->rcv;
+    int i;
+
+    if (batch->num_spans == 0) {
+        return;
+    }
+    rcv->ty->add_spans(rcv, batch->spans, batch->num_spans);
+    for (i = 0; i < batch->num_spans; i++) {
+        htrace_span_free(batch->spans[i]);
+    }
+    batch->num_spans = 0;
+}
+
+/**
+ * Called when a thread with a batch exits.
+ */
+static void htrace_batch_retire(void *data)
+{
+    struct htrace_batch *batch = data;
+    struct htrace_batcher *bat = batch->bat;
+
+    pthread_mutex_lock(&bat->lock);
+    pthread_mutex_lock(&batch->lock);
+    htrace_batch_deliver(batch);
+    pthread_mutex_unlock(&batch->lock);
+    if (batch->prev) {
+        batch->prev->next = batch->next;
+    } else {
+        bat->batches = batch->next;
+    }
+    if (batch->next) {
+        batch->next->prev = batch->prev;
+    }
+    pthread_mutex_unlock(&bat->lock);
+    pthread_mutex_destroy(&batch->lock);
+    htrace_free(batch);
+}
+
+/**
+ * Get the current thread's batch, creating it if needed.
+ *
+ * @return              The batch, or NULL on error.
+ */
+static struct htrace_batch *htrace_batch_get(struct htrace_batcher *bat)
+{
+    struct htrace_log *lg = bat->tracer->lg;
+    struct htrace_batch *batch;
+    int ret;
+
+    batch = htrace_tsd_get(&bat->tsd);
+    if (batch) {
+        return batch;
+    }
+    batch = htrace_malloc(offsetof(struct htrace_batch, spans) +
+                   (bat->max_spans * sizeof(batch->spans[0])));
+    if (!batch) {
+        htrace_log(lg, "htrace_batch_get: OOM\n");
+        return NULL;
+    }
+    ret = pthread_mutex_init(&batch->lock, NULL);
+    if (ret) {
+        htrace_log(lg, "htrace_batch_get: pthread_mutex_init "
+                   "error %d: %s\n", ret, terror(ret));
+        htrace_free(batch);
+        return NULL;
+    }
+    batch->bat = bat;
+    batch->first_ms = 0;
+    batch->num_spans = 0;
+    batch->prev = NULL;
+    ret = htrace_tsd_set(&bat->tsd, batch);
+    if (ret) {
+        htrace_log(lg, "htrace_batch_get: htrace_tsd_set "
+                   "error %d: %s\n", ret, terror(ret));
+        pthread_mutex_destroy(&batch->lock);
+        htrace_free(batch);
+        return NULL;
+    }
+    pthread_mutex_lock(&bat->lock);
+    batch->next = bat->batches;
+    if (bat->batches) {
+        bat->batches->prev = batch;
+    }
+    bat->batches = batch;
+    pthread_mutex_unlock(&bat->lock);
+    return batch;
+}
+
+static void htrace_batcher_fork_prepare(void *data)
+{
+    struct htrace_batcher *bat = data;
+
+    pthread_mutex_lock(&bat->lock);
+}
+
+static void htrace_batcher_fork_parent(void *data)
+{
+    struct htrace_batcher *bat = data;
+
+    pthread_mutex_unlock(&bat->lock);
+}
+
+static void htrace_batcher_fork_child(void *data)
+{
+    struct htrace_batcher *bat = data;
+    struct htrace_batch *batch;
+    int i;
+
+    pthread_mutex_unlock(&bat->lock);
+    for (batch = bat->batches; batch; batch = batch->next) {
+        // The thread which owned the batch may have been holding its lock.
+        pthread_mutex_init(&batch->lock, NULL);
+        for (i = 0; i < batch->num_spans; i++) {
+            htrace_span_free(batch->spans[i]);
+        }
+        batch->num_spans = 0;
+    }
+}
+
+struct htrace_batcher *htrace_batcher_create(struct htracer *tracer,
+                                             const struct htrace_conf *cnf)
+{
+    struct htrace_batcher *bat;
+    uint64_t max_spans;
+    int ret;
+
+    bat = htrace_calloc(1, sizeof(*bat));
+    if (!bat) {
+        htrace_log(tracer->lg, "htrace_batcher_create: OOM\n");
+        return NULL;
+    }
+    bat->tracer = tracer;
+    max_spans = htrace_conf_get_u64(tracer->lg, cnf, HTRACE_BATCH_SIZE_KEY);
+    if (max_spans > HTRACE_BATCH_MAX_SIZE) {
+        htrace_log(tracer->lg, "htrace_batcher_create: can't set %s to %"
+                   PRId64 ".  Using maximum value of %d instead.\n",
+                   HTRACE_BATCH_SIZE_KEY, max_spans, HTRACE_BATCH_MAX_SIZE);
+        max_spans = HTRACE_BATCH_MAX_SIZE;
+    }
+    bat->max_spans = max_spans;
+    bat->max_age_ms = htrace_conf_get_u64(tracer->lg, cnf,
+                                          HTRACE_BATCH_MAX_AGE_MS_KEY);
+    ret = htrace_tsd_init(&bat->tsd, htrace_batch_retire);
+    if (ret) {
+        htrace_log(tracer->lg, "htrace_batcher_create: htrace_tsd_init "
+                   "error %d: %s\n", ret, terror(ret));
+        htrace_free(bat);
+        return NULL;
+    }
+    ret = pthread_mutex_init(&bat->lock, NULL);
+    if (ret) {
+        htrace_log(tracer->lg, "htrace_batcher_create: pthread_mutex_init "
+                   "error %d: %s\n", ret, terror(ret));
+        htrace_tsd_destroy(&bat->tsd);
+        htrace_free(bat);
+        return NULL;
+    }
+    bat->fork_hook.prepare = htrace_batcher_fork_prepare;
+    bat->fork_hook.parent = htrace_batcher_fork_parent;
+    bat->fork_hook.child = htrace_batcher_fork_child;
+    bat->fork_hook.data = bat;
+    htrace_fork_hook_register(&bat->fork_hook);
+    htrace_log(tracer->lg, "Initialized span batching with max_spans=%d, "
+               "max_age_ms=%" PRId64 ".\n", bat->max_spans, bat->max_age_ms);
+    return bat;
+}
+
+void htrace_batcher_add_span(struct htrace_batcher *bat,
+                             struct htrace_span *span)
+{
+    struct htrace_batch *batch;
+
+    batch = htrace_batch_get(bat);
+    if (!batch) {
+        struct htrace_rcv *rcv = bat->tracer->rcv;
+        rcv->ty->add_span(rcv, span);
+        htrace_span_free(span);
+        return;
+    }
+    pthread_mutex_lock(&batch->lock);
+    if (batch->num_spans == 0) {
+        batch->first_ms = span->end_ms;
+    }
+    batch->spans[batch->num_spans++] = span;
+    if ((batch->num_spans >= bat->max_spans) ||
+            (span->end_ms >= batch->first_ms + bat->max_age_ms)) {
+        htrace_batch_deliver(batch);
+    }
+    pthread_mutex_unlock(&batch->lock);
+}
+
+void htrace_batcher_free(struct htrace_batcher *bat)
+{
+    struct htrace_batch *batch;
+
+    if (!bat) {
+        return;
+    }
+    htrace_fork_hook_unregister(&bat->fork_hook);
+    // Once this returns, no exiting thread is inside htrace_batch_retire,
+    // and the batches of the threads which are still running are ours to
+    // deliver and free.
+    htrace_tsd_destroy(&bat->tsd);
+    while ((batch = bat->batches)) {
+        bat->batches = batch->next;
+        htrace_batch_deliver(batch);
+        pthread_mutex_destroy(&batch->lock);
+        htrace_free(batch);
+    }
+    pthread_mutex_destroy(&bat->lock);
+    htrace_free(bat);
+}
+
+// vim:ts=4:sw=4:et
@@ -0,0 +1,71 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef APACHE_HTRACE_CORE_BATCH_H
+#define APACHE_HTRACE_CORE_BATCH_H
+
+/**
+ * @file batch.h
+ *
+ * Per-thread batches of closed spans.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+struct htrace_batcher;
+struct htrace_conf;
+struct htrace_span;
+struct htracer;
+
+/**
+ * Create a batcher, which collects closed spans on each thread and gives
+ * them to the span receiver's add_spans callback in batches.
+ *
+ * @param tracer        The tracer.  Its span receiver must implement
+ *                          add_spans.
+ * @param cnf           The configuration to use.  The batcher will not hold
+ *                          on to this pointer.
+ *
+ * @return              NULL on error; the batcher otherwise.  Errors are
+ *                          logged to the tracer log.
+ */
+struct htrace_batcher *htrace_batcher_create(struct htracer *tracer,
+                                             const struct htrace_conf *cnf);
+
+/**
+ * Add a closed span to the current thread's batch.  The batch is given to
+ * the span receiver once it is full or old enough.
+ *
+ * @param bat           The batcher.
+ * @param span          The span.  The batcher takes ownership of it.
+ */
+void htrace_batcher_add_span(struct htrace_batcher *bat,
+                             struct htrace_span *span);
+
+/**
+ * Give every thread's batch to the span receiver, then free the batcher.
+ * No other thread may be adding spans at the same time.
+ *
+ * @param bat           The batcher, or NULL.
+ */
+void htrace_batcher_free(struct htrace_batcher *bat);
+
+#endif
+
+// vim: ts=4:sw=4:et
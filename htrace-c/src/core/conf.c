@@ -18,6 +18,7 @@
 
 #include "core/conf.h"
 #include "core/htrace.h"
+#include "util/alloc.h"
 #include "util/htable.h"
 #include "util/log.h"
 
@@ -25,57 +26,306 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+
+/**
+ * @file conf.c
+ *
+ * HTrace configuration objects.
+ *
+ * A configuration is compiled once, when it is created, into a table of
+ * entries.  Each entry holds the configured value and the default value for a
+ * key, along with the results of parsing them as each of the types that
+ * htrace_conf_get_* can return.  After that the configuration never changes,
+ * so it can be read from any thread, and getting a typed value is a single
+ * hash table lookup.
+ */
 
 #define HTRACE_DEFAULT_CONF_KEYS (\
      HTRACE_PROB_SAMPLER_FRACTION_KEY "=0.01"\
+     ";" HTRACE_LOG_ASYNC_KEY "=true"\
+     ";" HTRACE_LOG_LEVEL_KEY "=info"\
+     ";" HTRACE_LOG_RATELIMIT_MS_KEY "=1000"\
+     ";" HTRACE_RATELIMIT_SAMPLER_RATE_KEY "=100"\
+     ";" HTRACE_ADAPTIVE_SAMPLER_MAX_FRACTION_KEY "=0.01"\
+     ";" HTRACE_ADAPTIVE_SAMPLER_MIN_FRACTION_KEY "=0.0001"\
+     ";" HTRACE_ADAPTIVE_SAMPLER_TARGET_PRESSURE_KEY "=50"\
+     ";" HTRACE_ADAPTIVE_SAMPLER_INTERVAL_MS_KEY "=500"\
+     ";" HTRACE_HASH_SAMPLER_FRACTION_KEY "=0.01"\
+     ";" HTRACE_RULES_SAMPLER_DEFAULT_FRACTION_KEY "=0.01"\
      ";" HTRACED_BUFFER_SIZE_KEY "=67108864"\
+     ";" HTRACED_BUFFER_COUNT_KEY "=2"\
+     ";" HTRACED_RPC_MAX_SIZE_KEY "=33554432"\
+     ";" HTRACED_BUFFER_FULL_POLICY_KEY "=drop-newest"\
+     ";" HTRACED_BUFFER_FULL_BLOCK_TIMEO_MS_KEY "=100"\
+     ";" HTRACED_BUFFER_PRIORITY_RESERVE_KEY "=0"\
+     ";" HTRACED_INFLIGHT_WINDOW_KEY "=1"\
+     ";" HTRACED_RETRY_BACKOFF_MIN_MS_KEY "=500"\
+     ";" HTRACED_RETRY_BACKOFF_MAX_MS_KEY "=30000"\
      ";" HTRACED_FLUSH_INTERVAL_MS_KEY "=120000"\
      ";" HTRACED_WRITE_TIMEO_MS_KEY "=60000"\
      ";" HTRACED_READ_TIMEO_MS_KEY "=60000"\
+     ";" HTRACED_SHUTDOWN_TIMEO_MS_KEY "=0"\
      ";" HTRACE_TRACER_ID "=%{tname}/%{ip}"\
      ";" HTRACED_ADDRESS_KEY "=localhost:9096"\
      ";" HTRACED_BUFFER_SEND_TRIGGER_FRACTION "=0.50"\
+     ";" HTRACED_BATCH_MAX_LATENCY_MS_KEY "=0"\
+     ";" HTRACED_THREAD_BUFFER_SIZE_KEY "=0"\
+     ";" HTRACED_THREAD_BUFFER_SHARDING_KEY "=thread"\
+     ";" HTRACED_ASYNC_SERIALIZE_KEY "=false"\
+     ";" HTRACED_ASYNC_QUEUE_MAX_KEY "=65536"\
+     ";" HTRACED_COMPRESSION_KEY "=none"\
+     ";" HTRACED_COMPRESSION_LEVEL_KEY "=1"\
+     ";" HTRACED_DICTIONARY_KEY "=false"\
+     ";" HTRACED_GROUP_BY_TRACE_KEY "=false"\
+     ";" HTRACED_SPILL_MAX_SIZE_KEY "=1073741824"\
+     ";" HTRACED_SPILL_SEGMENT_SIZE_KEY "=67108864"\
+     ";" HTRACED_TCP_NODELAY_KEY "=true"\
+     ";" HTRACED_TCP_SNDBUF_KEY "=0"\
+     ";" HTRACED_TCP_KEEPALIVE_MS_KEY "=0"\
+     ";" HTRACED_DNS_CACHE_MS_KEY "=60000"\
+     ";" HTRACED_IO_URING_KEY "=false"\
+     ";" HTRACED_TRANSPORT_KEY "=stream"\
+     ";" HTRACED_DATAGRAM_SIZE_KEY "=1400"\
+     ";" HTRACED_SHARED_KEY "=false"\
+     ";" HTRACED_SHARED_MEMORY_MAX_KEY "=0"\
+     ";" HTRACE_LOCAL_MMAP_SIZE_KEY "=268435456"\
+     ";" HTRACE_LOCAL_MMAP_REGION_SIZE_KEY "=1048576"\
+     ";" HTRACE_SHM_RCV_SIZE_KEY "=16777216"\
+     ";" HTRACE_FLIGHT_RCV_SIZE_KEY "=16777216"\
+     ";" HTRACE_FLIGHT_RCV_SIGNAL_KEY "=0"\
+     ";" HTRACE_FLIGHT_RCV_DUMP_ON_CRASH_KEY "=false"\
+     ";" HTRACE_FLIGHT_RCV_DUMP_ON_FREE_KEY "=false"\
+     ";" HTRACE_HISTOGRAM_RCV_RECEIVER_KEY "=htraced"\
+     ";" HTRACE_HISTOGRAM_RCV_INTERVAL_MS_KEY "=10000"\
+     ";" HTRACE_LOCAL_FILE_ASYNC_KEY "=false"\
+     ";" HTRACE_LOCAL_FILE_BUFFER_SIZE_KEY "=1048576"\
+     ";" HTRACE_LOCAL_FILE_FLUSH_INTERVAL_MS_KEY "=1000"\
+     ";" HTRACE_LOCAL_FILE_FDATASYNC_KEY "=none"\
+     ";" HTRACE_LOCAL_FILE_FDATASYNC_INTERVAL_MS_KEY "=1000"\
+     ";" HTRACE_LOCAL_FILE_ROTATE_SIZE_KEY "=0"\
+     ";" HTRACE_LOCAL_FILE_ROTATE_INTERVAL_MS_KEY "=0"\
+     ";" HTRACE_LOCAL_FILE_ROTATE_KEEP_KEY "=5"\
+     ";" HTRACE_LOCAL_BINFILE_BLOCK_SIZE_KEY "=1048576"\
+     ";" HTRACE_CLOCK_KEY "=realtime"\
+     ";" HTRACE_TIMESTAMP_PRECISION_KEY "=ms"\
+     ";" HTRACE_SPAN_CPU_KEY "=off"\
+     ";" HTRACE_BATCH_SIZE_KEY "=0"\
+     ";" HTRACE_BATCH_MAX_AGE_MS_KEY "=100"\
+     ";" HTRACE_TAIL_SAMPLING_KEY "=false"\
+     ";" HTRACE_TAIL_MIN_DURATION_MS_KEY "=100"\
+     ";" HTRACE_TAIL_MAX_TRACES_KEY "=1024"\
+     ";" HTRACE_TAIL_MAX_TRACE_SPANS_KEY "=512"\
+     ";" HTRACE_SELF_STATS_KEY "=false"\
+     ";" HTRACE_PRIORITY_MIN_DURATION_MS_KEY "=0"\
+     ";" HTRACE_SPAN_RECEIVER_LAZY_KEY "=false"\
     )
 
+/**
+ * The types that a configuration value can be parsed as.
+ */
+enum htrace_conf_type {
+    HTRACE_CONF_U64 = 0,
+    HTRACE_CONF_DOUBLE,
+    HTRACE_CONF_BOOL,
+    HTRACE_CONF_NUM_TYPES,
+};
+
+/**
+ * Where a configuration string came from.
+ */
+enum htrace_conf_src {
+    HTRACE_CONF_SRC_VALUE = 0,
+    HTRACE_CONF_SRC_DEFAULT,
+    HTRACE_CONF_NUM_SRCS,
+};
+
+/**
+ * Parse error codes, in addition to POSIX error codes.
+ */
+#define HTRACE_CONF_ERR_GARBAGE -1
+#define HTRACE_CONF_ERR_NOT_BOOL -2
+
+struct htrace_conf_entry {
+    /**
+     * The key.  Owned by the entry.
+     */
+    char *key;
+
+    /**
+     * The configured value and the default value, indexed by enum
+     * htrace_conf_src.  Either may be NULL.  Owned by the entry.
+     */
+    char *str[HTRACE_CONF_NUM_SRCS];
+
+    /**
+     * The result of parsing each string as each type: 0 on success, or a
+     * POSIX or HTRACE_CONF_ERR_* error code.
+     */
+    int err[HTRACE_CONF_NUM_SRCS][HTRACE_CONF_NUM_TYPES];
+
+    /**
+     * Bitmask of the types whose parse errors have already been logged.
+     * Updated atomically.
+     */
+    int reported;
+
+    /**
+     * The typed values: the configured value if it parsed, otherwise the
+     * default if that parsed, otherwise 0.
+     */
+    uint64_t u64;
+    double dbl;
+    int bln;
+};
+
+static void htrace_conf_entry_free(struct htrace_conf_entry *ent)
+{
+    int src;
+
+    htrace_free(ent->key);
+    for (src = 0; src < HTRACE_CONF_NUM_SRCS; src++) {
+        htrace_free(ent->str[src]);
+    }
+    htrace_free(ent);
+}
+
+static int skip_trailing_whitespace(const char *endptr)
+{
+    while (1) {
+        char c = *endptr;
+        if (c == '\0') {
+            return 0;
+        }
+        if (!((c == ' ') || (c == '\t'))) {
+            return HTRACE_CONF_ERR_GARBAGE;
+        }
+        endptr++;
+    }
+}
+
+static int convert_double(const char *in, double *out)
+{
+    char *endptr = NULL;
+    double ret;
+    int err;
+
+    errno = 0;
+    ret = strtod(in, &endptr);
+    if (errno) {
+        return errno;
+    }
+    err = skip_trailing_whitespace(endptr);
+    if (err) {
+        return err;
+    }
+    *out = ret;
+    return 0;
+}
+
+static int convert_u64(const char *in, uint64_t *out)
+{
+    char *endptr = NULL;
+    uint64_t ret;
+    int err;
+
+    errno = 0;
+    ret = strtoull(in, &endptr, 10);
+    if (errno) {
+        return errno;
+    }
+    err = skip_trailing_whitespace(endptr);
+    if (err) {
+        return err;
+    }
+    *out = ret;
+    return 0;
+}
+
+static int convert_bool(const char *in, int *out)
+{
+    if (strcasecmp(in, "true") == 0) {
+        *out = 1;
+        return 0;
+    }
+    if (strcasecmp(in, "false") == 0) {
+        *out = 0;
+        return 0;
+    }
+    return HTRACE_CONF_ERR_NOT_BOOL;
+}
+
+/**
+ * Parse the strings of an entry as every type, and pick the typed values.
+ * The sources are parsed in reverse order, so that the configured value
+ * overrides the default.
+ */
+static void htrace_conf_entry_compile(struct htrace_conf_entry *ent)
+{
+    int src;
+
+    for (src = HTRACE_CONF_NUM_SRCS - 1; src >= 0; src--) {
+        const char *in = ent->str[src];
+        uint64_t u64 = 0;
+        double dbl = 0;
+        int bln = 0;
+
+        if (!in) {
+            continue;
+        }
+        ent->err[src][HTRACE_CONF_U64] = convert_u64(in, &u64);
+        if (!ent->err[src][HTRACE_CONF_U64]) {
+            ent->u64 = u64;
+        }
+        ent->err[src][HTRACE_CONF_DOUBLE] = convert_double(in, &dbl);
+        if (!ent->err[src][HTRACE_CONF_DOUBLE]) {
+            ent->dbl = dbl;
+        }
+        ent->err[src][HTRACE_CONF_BOOL] = convert_bool(in, &bln);
+        if (!ent->err[src][HTRACE_CONF_BOOL]) {
+            ent->bln = bln;
+        }
+    }
+}
+
 static int parse_key_value(char *str, char **key, char **val)
 {
     char *eq = strchr(str, '=');
     if (eq) {
         *eq = '\0';
-        *val = strdup(eq + 1);
+        *val = htrace_strdup(eq + 1);
     } else {
-        *val = strdup("true");
+        *val = htrace_strdup("true");
     }
     if (!*val) {
         return ENOMEM;
     }
-    *key = strdup(str);
+    *key = htrace_strdup(str);
     if (!*key) {
-        free(*val);
+        htrace_free(*val);
         return ENOMEM;
     }
     return 0;
 }
 
-static struct htable *htable_from_str(const char *str)
+/**
+ * Add the key/value pairs in a configuration string to the entry table.
+ * If a key is given more than once, the first value wins.
+ */
+static int htrace_conf_add_str(struct htable *ht, const char *str,
+                               enum htrace_conf_src src)
 {
-    struct htable *ht;
+    struct htrace_conf_entry *ent;
     char *cstr = NULL, *saveptr = NULL, *tok;
     int ret = ENOMEM;
 
-    ht = htable_alloc(8, ht_hash_string, ht_compare_string);
-    if (!ht) {
-        goto done;
-    }
     if (!str) {
-        ret = 0;
-        goto done;
+        return 0;
     }
-    cstr = strdup(str);
+    cstr = htrace_strdup(str);
     if (!cstr) {
         goto done;
     }
-
     for (tok = strtok_r(cstr, ";", &saveptr); tok;
              tok = strtok_r(NULL, ";", &saveptr)) {
         char *key = NULL, *val = NULL;
@@ -83,19 +333,41 @@ static struct htable *htable_from_str(const char *str)
         if (ret) {
             goto done;
         }
-        ret = htable_put(ht, key, val);
+        ent = htable_get(ht, key);
+        if (ent) {
+            htrace_free(key);
+            if (ent->str[src]) {
+                htrace_free(val);
+            } else {
+                ent->str[src] = val;
+            }
+            continue;
+        }
+        ent = htrace_calloc(1, sizeof(*ent));
+        if (!ent) {
+            htrace_free(key);
+            htrace_free(val);
+            ret = ENOMEM;
+            goto done;
+        }
+        ent->key = key;
+        ent->str[src] = val;
+        ret = htable_put(ht, key, ent);
         if (ret) {
+            htrace_conf_entry_free(ent);
             goto done;
         }
     }
     ret = 0;
 done:
-    if (ret) {
-        htable_free(ht);
-        ht = NULL;
-    }
-    free(cstr);
-    return ht;
+    htrace_free(cstr);
+    return ret;
+}
+
+static void htrace_conf_entry_compile_visitor(void *ctx, void *key,
+                                              void *val)
+{
+    htrace_conf_entry_compile(val);
 }
 
 struct htrace_conf *htrace_conf_from_strs(const char *values,
@@ -103,20 +375,22 @@ struct htrace_conf *htrace_conf_from_strs(const char *values,
 {
     struct htrace_conf *cnf;
 
-    cnf = calloc(1, sizeof(*cnf));
+    cnf = htrace_calloc(1, sizeof(*cnf));
     if (!cnf) {
         return NULL;
     }
-    cnf->values = htable_from_str(values);
-    if (!cnf->values) {
+    cnf->entries = htable_alloc(64, ht_hash_string, ht_compare_string);
+    if (!cnf->entries) {
         htrace_conf_free(cnf);
         return NULL;
     }
-    cnf->defaults = htable_from_str(defaults);
-    if (!cnf->defaults) {
+    if (htrace_conf_add_str(cnf->entries, values, HTRACE_CONF_SRC_VALUE) ||
+        htrace_conf_add_str(cnf->entries, defaults,
+                            HTRACE_CONF_SRC_DEFAULT)) {
         htrace_conf_free(cnf);
         return NULL;
     }
+    htable_visit(cnf->entries, htrace_conf_entry_compile_visitor, NULL);
     return cnf;
 }
 
@@ -125,141 +399,180 @@ struct htrace_conf *htrace_conf_from_str(const char *values)
     return htrace_conf_from_strs(values, HTRACE_DEFAULT_CONF_KEYS);
 }
 
-static void htrace_tuple_free(void *ctx, void *key, void *val)
-{
-    free(key);
-    free(val);
-}
+struct htrace_conf_copy_ctx {
+    struct htable *entries;
+    int ret;
+};
 
-void htrace_conf_free(struct htrace_conf *cnf)
+static void htrace_conf_entry_copy_visitor(void *c, void *key, void *val)
 {
-    if (!cnf) {
+    struct htrace_conf_copy_ctx *ctx = c;
+    const struct htrace_conf_entry *ent = val;
+    struct htrace_conf_entry *nent;
+    int src;
+
+    if (ctx->ret) {
         return;
     }
-    if (cnf->values) {
-        htable_visit(cnf->values, htrace_tuple_free, NULL);
-        htable_free(cnf->values);
+    nent = htrace_calloc(1, sizeof(*nent));
+    if (!nent) {
+        ctx->ret = ENOMEM;
+        return;
     }
-    if (cnf->defaults) {
-        htable_visit(cnf->defaults, htrace_tuple_free, NULL);
-        htable_free(cnf->defaults);
+    nent->key = htrace_strdup(ent->key);
+    if (!nent->key) {
+        goto oom;
     }
-    free(cnf);
+    for (src = 0; src < HTRACE_CONF_NUM_SRCS; src++) {
+        if (ent->str[src]) {
+            nent->str[src] = htrace_strdup(ent->str[src]);
+            if (!nent->str[src]) {
+                goto oom;
+            }
+        }
+    }
+    htrace_conf_entry_compile(nent);
+    ctx->ret = htable_put(ctx->entries, nent->key, nent);
+    if (ctx->ret) {
+        htrace_conf_entry_free(nent);
+    }
+    return;
+
+oom:
+    htrace_conf_entry_free(nent);
+    ctx->ret = ENOMEM;
 }
 
-const char *htrace_conf_get(const struct htrace_conf *cnf, const char *key)
+struct htrace_conf *htrace_conf_copy(const struct htrace_conf *cnf)
 {
-    const char *val;
+    struct htrace_conf_copy_ctx ctx;
+    struct htrace_conf *ncnf;
 
-    val = htable_get(cnf->values, key);
-    if (val)
-        return val;
-    val = htable_get(cnf->defaults, key);
-    return val;
+    ncnf = htrace_calloc(1, sizeof(*ncnf));
+    if (!ncnf) {
+        return NULL;
+    }
+    ncnf->entries = htable_alloc(64, ht_hash_string, ht_compare_string);
+    if (!ncnf->entries) {
+        htrace_conf_free(ncnf);
+        return NULL;
+    }
+    ctx.entries = ncnf->entries;
+    ctx.ret = 0;
+    htable_visit(cnf->entries, htrace_conf_entry_copy_visitor, &ctx);
+    if (ctx.ret) {
+        htrace_conf_free(ncnf);
+        return NULL;
+    }
+    return ncnf;
 }
 
-static int convert_double(struct htrace_log *log, const char *key,
-                   const char *in, double *out)
+static void htrace_conf_entry_free_visitor(void *ctx, void *key, void *val)
 {
-    char *endptr = NULL;
-    int err;
-    double ret;
+    htrace_conf_entry_free(val);
+}
 
-    errno = 0;
-    ret = strtod(in, &endptr);
-    if (errno) {
-        err = errno;
-        htrace_log(log, "error parsing %s for %s: %d (%s)\n",
-                   in, key, err, terror(err));
-        return 0;
+void htrace_conf_free(struct htrace_conf *cnf)
+{
+    if (!cnf) {
+        return;
     }
-    while (1) {
-        char c = *endptr;
-        if (c == '\0') {
-            break;
-        }
-        if (!((c == ' ') || (c == '\t'))) {
-            htrace_log(log, "error parsing %s for %s: garbage at end "
-                       "of string.\n", in, key);
-            return 0;
-        }
-        endptr++;
+    if (cnf->entries) {
+        htable_visit(cnf->entries, htrace_conf_entry_free_visitor, NULL);
+        htable_free(cnf->entries);
     }
-    *out = ret;
-    return 1;
+    htrace_free(cnf);
 }
 
-double htrace_conf_get_double(struct htrace_log *log,
-                             const struct htrace_conf *cnf, const char *key)
+const char *htrace_conf_get(const struct htrace_conf *cnf, const char *key)
 {
-    const char *val;
-    double out = 0;
+    const struct htrace_conf_entry *ent;
 
-    val = htable_get(cnf->values, key);
-    if (val) {
-        if (convert_double(log, key, val, &out)) {
-            return out;
-        }
+    ent = htable_get(cnf->entries, key);
+    if (!ent) {
+        return NULL;
     }
-    val = htable_get(cnf->defaults, key);
-    if (val) {
-        if (convert_double(log, key, val, &out)) {
-            return out;
-        }
+    if (ent->str[HTRACE_CONF_SRC_VALUE]) {
+        return ent->str[HTRACE_CONF_SRC_VALUE];
     }
-    return 0;
+    return ent->str[HTRACE_CONF_SRC_DEFAULT];
 }
 
-static int convert_u64(struct htrace_log *log, const char *key,
-                   const char *in, uint64_t *out)
+/**
+ * Look up an entry, and log any errors from parsing it as the given type.
+ * Errors are only logged the first time that a key is read as a type.
+ *
+ * @return          The entry, or NULL if the key was not found.
+ */
+static struct htrace_conf_entry *htrace_conf_get_typed(struct htrace_log *log,
+        const struct htrace_conf *cnf, const char *key,
+        enum htrace_conf_type ty)
 {
-    char *endptr = NULL;
-    int err;
-    uint64_t ret;
+    struct htrace_conf_entry *ent;
+    int src, err, bit = 1 << ty;
 
-    errno = 0;
-    ret = strtoull(in, &endptr, 10);
-    if (errno) {
-        err = errno;
-        htrace_log(log, "error parsing %s for %s: %d (%s)\n",
-                   in, key, err, terror(err));
-        return 0;
+    ent = htable_get(cnf->entries, key);
+    if (!ent) {
+        return NULL;
     }
-    while (1) {
-        char c = *endptr;
-        if (c == '\0') {
+    if (!ent->err[HTRACE_CONF_SRC_VALUE][ty]) {
+        // Either the configured value parsed, or there was none and we got
+        // our answer from the default.
+        if (ent->str[HTRACE_CONF_SRC_VALUE] ||
+                (!ent->err[HTRACE_CONF_SRC_DEFAULT][ty])) {
+            return ent;
+        }
+    }
+    if (__atomic_fetch_or(&ent->reported, bit, __ATOMIC_RELAXED) & bit) {
+        return ent;
+    }
+    for (src = 0; src < HTRACE_CONF_NUM_SRCS; src++) {
+        if (!ent->str[src]) {
+            continue;
+        }
+        err = ent->err[src][ty];
+        if (!err) {
             break;
         }
-        if (!((c == ' ') || (c == '\t'))) {
+        if (err == HTRACE_CONF_ERR_GARBAGE) {
             htrace_log(log, "error parsing %s for %s: garbage at end "
-                       "of string.\n", in, key);
-            return 0;
+                       "of string.\n", ent->str[src], key);
+        } else if (err == HTRACE_CONF_ERR_NOT_BOOL) {
+            htrace_log(log, "error parsing %s for %s: expected true or "
+                       "false.\n", ent->str[src], key);
+        } else {
+            htrace_log(log, "error parsing %s for %s: %d (%s)\n",
+                       ent->str[src], key, err, terror(err));
         }
-        endptr++;
     }
-    *out = ret;
-    return 1;
+    return ent;
+}
+
+double htrace_conf_get_double(struct htrace_log *log,
+                             const struct htrace_conf *cnf, const char *key)
+{
+    const struct htrace_conf_entry *ent;
+
+    ent = htrace_conf_get_typed(log, cnf, key, HTRACE_CONF_DOUBLE);
+    return ent ? ent->dbl : 0;
 }
 
 uint64_t htrace_conf_get_u64(struct htrace_log *log,
                              const struct htrace_conf *cnf, const char *key)
 {
-    const char *val;
-    uint64_t out = 0;
+    const struct htrace_conf_entry *ent;
 
-    val = htable_get(cnf->values, key);
-    if (val) {
-        if (convert_u64(log, key, val, &out)) {
-            return out;
-        }
-    }
-    val = htable_get(cnf->defaults, key);
-    if (val) {
-        if (convert_u64(log, key, val, &out)) {
-            return out;
-        }
-    }
-    return 0;
+    ent = htrace_conf_get_typed(log, cnf, key, HTRACE_CONF_U64);
+    return ent ? ent->u64 : 0;
+}
+
+int htrace_conf_get_bool(struct htrace_log *log,
+                         const struct htrace_conf *cnf, const char *key)
+{
+    const struct htrace_conf_entry *ent;
+
+    ent = htrace_conf_get_typed(log, cnf, key, HTRACE_CONF_BOOL);
+    return ent ? ent->bln : 0;
 }
 
 // vim:ts=4:sw=4:et
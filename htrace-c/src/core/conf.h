@@ -32,17 +32,17 @@
 struct htable;
 struct htrace_log;
 
+/**
+ * An HTrace configuration.  Configurations are immutable once they have been
+ * created.
+ */
 struct htrace_conf {
     /**
-     * A hash table mapping keys to the values that were set.
+     * A hash table mapping keys to struct htrace_conf_entry objects, which
+     * hold the configured and default values for each key, already parsed
+     * into each type.  See conf.c.
      */
-    struct htable *values;
-
-    /**
-     * A hash table mapping keys to the default values that were set for those
-     * keys.
-     */
-    struct htable *defaults;
+    struct htable *entries;
 };
 
 /**
@@ -50,6 +50,10 @@ struct htrace_conf {
  *
  * See {@ref htrace_conf_from_str} for the format.
  *
+ * All of the values are parsed when the configuration is created, so the
+ * typed getters below don't parse anything.  Parse errors are logged the
+ * first time that a key is read as a type which it can't be parsed as.
+ *
  * The configuration object must be later freed with htrace_conf_free.
  *
  * @param str       The configuration string.
@@ -59,6 +63,18 @@ struct htrace_conf {
 struct htrace_conf *htrace_conf_from_strs(const char *values,
                                           const char *defaults);
 
+/**
+ * Copy an HTrace configuration object.
+ *
+ * This is for code which needs a configuration after the one it was given
+ * may have been freed.  The copy must be later freed with htrace_conf_free.
+ *
+ * @param cnf       The HTrace configuration object.
+ *
+ * @return          NULL on OOM; the copy otherwise.
+ */
+struct htrace_conf *htrace_conf_copy(const struct htrace_conf *cnf);
+
 /**
  * Free an HTrace configuration object.
  *
@@ -105,6 +121,23 @@ double htrace_conf_get_double(struct htrace_log *log,
 uint64_t htrace_conf_get_u64(struct htrace_log *log,
                 const struct htrace_conf *cnf, const char *key);
 
+/**
+ * Get the value of a key in a configuration as a boolean.
+ *
+ * The value must be "true" or "false", in any case.  A key given without a
+ * value is true.
+ *
+ * @param log       Log to send parse error messages to.
+ * @param cnf       The configuration.
+ * @param key       The key.
+ *
+ * @return          The value if it was found.
+ *                  The default value if it was not found.
+ *                  0 if there was no default value.
+ */
+int htrace_conf_get_bool(struct htrace_log *log,
+                const struct htrace_conf *cnf, const char *key);
+
 #endif
 
 // vim: ts=4: sw=4: et
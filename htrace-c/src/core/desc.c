@@ -0,0 +1,137 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/desc.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "util/alloc.h"
+#include "util/htable.h"
+#include "util/log.h"
+#include "util/string.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file desc.c
+ *
+ * Implementation of interned span descriptions.
+ */
+
+/**
+ * The initial capacity of an htracer's description table.
+ */
+#define HTRACE_DESC_TABLE_INITIAL_CAPACITY 32
+
+const struct htrace_desc *htrace_desc_register(struct htracer *tracer,
+                                               const char *str)
+{
+    struct htrace_desc *desc;
+    size_t len;
+    int ret;
+
+    if (!validate_json_string(tracer->lg, str)) {
+        htrace_log(tracer->lg, "htrace_desc_register(desc=%s): invalid "
+                   "description string.\n", str);
+        return NULL;
+    }
+    len = strlen(str);
+    if (len > UINT32_MAX) {
+        htrace_log(tracer->lg, "htrace_desc_register: description string "
+                   "is too long.\n");
+        return NULL;
+    }
+    pthread_mutex_lock(&tracer->desc_lock);
+    if (!tracer->descs) {
+        tracer->descs = htable_alloc(HTRACE_DESC_TABLE_INITIAL_CAPACITY,
+                                     ht_hash_string, ht_compare_string);
+        if (!tracer->descs) {
+            goto oom;
+        }
+    }
+    desc = htable_get(tracer->descs, str);
+    if (desc) {
+        pthread_mutex_unlock(&tracer->desc_lock);
+        return desc;
+    }
+    desc = htrace_malloc(sizeof(*desc));
+    if (!desc) {
+        goto oom;
+    }
+    desc->str = htrace_strdup(str);
+    if (!desc->str) {
+        htrace_free(desc);
+        goto oom;
+    }
+    desc->len = len;
+    desc->id = htable_used(tracer->descs);
+    ret = htable_put(tracer->descs, desc->str, desc);
+    if (ret) {
+        htrace_free(desc->str);
+        htrace_free(desc);
+        goto oom;
+    }
+    pthread_mutex_unlock(&tracer->desc_lock);
+    return desc;
+
+oom:
+    pthread_mutex_unlock(&tracer->desc_lock);
+    htrace_log(tracer->lg, "htrace_desc_register(desc=%s): OOM\n", str);
+    return NULL;
+}
+
+const struct htrace_desc *htrace_name_get(struct htracer *tracer,
+                                          struct htrace_name *name)
+{
+    const struct htrace_desc *desc;
+    int claimed = 0;
+
+    if (__atomic_load_n(&name->serial, __ATOMIC_ACQUIRE) == tracer->serial) {
+        return name->desc;
+    }
+    desc = htrace_desc_register(tracer, name->str);
+    // Only the first htracer to get here is cached.  Others go through the
+    // registration lookup each time.
+    if (__atomic_compare_exchange_n(&name->claimed, &claimed, 1, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        name->desc = desc;
+        __atomic_store_n(&name->serial, tracer->serial, __ATOMIC_RELEASE);
+    }
+    return desc;
+}
+
+static void htrace_desc_free_cb(void *ctx, void *key, void *val)
+{
+    struct htrace_desc *desc = val;
+
+    htrace_free(desc->str);
+    htrace_free(desc);
+}
+
+void htrace_desc_table_free(struct htable *descs)
+{
+    if (!descs) {
+        return;
+    }
+    htable_visit(descs, htrace_desc_free_cb, NULL);
+    htable_free(descs);
+}
+
+// vim:ts=4:sw=4:et
@@ -0,0 +1,83 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef APACHE_HTRACE_CORE_DESC_H
+#define APACHE_HTRACE_CORE_DESC_H
+
+#include <stdint.h> /* for uint32_t */
+
+/**
+ * @file desc.h
+ *
+ * Interned span descriptions.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+struct htable;
+struct htrace_name;
+struct htracer;
+
+/**
+ * A span description which has been registered with an htracer.
+ *
+ * Descriptions are validated once, when they are registered, and are never
+ * copied afterwards.  They remain valid until the htracer is freed.
+ */
+struct htrace_desc {
+    /**
+     * The description string.  Dynamically allocated.
+     */
+    char *str;
+
+    /**
+     * The length of str, not including the terminating NUL.
+     */
+    uint32_t len;
+
+    /**
+     * A small integer identifying this description within its htracer.
+     * Descriptions are numbered from 0 in the order they were registered.
+     */
+    uint32_t id;
+};
+
+/**
+ * Get the description which a name refers to in an htracer, registering it
+ * if need be.
+ *
+ * @param tracer        The htracer.
+ * @param name          The name.
+ *
+ * @return              The description, or NULL if the name was invalid or
+ *                          we ran out of memory.
+ */
+const struct htrace_desc *htrace_name_get(struct htracer *tracer,
+                                          struct htrace_name *name);
+
+/**
+ * Free a table of interned descriptions, and the descriptions in it.
+ *
+ * @param descs         The table, or NULL.
+ */
+void htrace_desc_table_free(struct htable *descs);
+
+#endif
+
+// vim: ts=4:sw=4:et
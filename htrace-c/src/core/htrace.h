@@ -94,24 +94,245 @@ extern  "C" {
  */
 #define HTRACE_LOG_PATH_KEY "log.path"
 
+/**
+ * Whether to write the htrace client log from a background thread.  When
+ * this is true, logging a message never blocks: the message is put on a
+ * queue, and dropped if the queue is full.  The thread is started when the
+ * first message is logged.  Defaults to true.
+ */
+#define HTRACE_LOG_ASYNC_KEY "log.async"
+
+/**
+ * The least severe messages to write to the htrace client log.
+ *
+ * Possible values:
+ * error        Only errors.
+ * warn         Errors and warnings.
+ * info         Errors, warnings, and informational messages.  The default.
+ * debug        Everything.
+ */
+#define HTRACE_LOG_LEVEL_KEY "log.level"
+
+/**
+ * The minimum number of milliseconds between two messages from the same
+ * rate-limited place in the code.  Messages which come sooner are counted,
+ * and the count is logged with the next message that gets through.  0 turns
+ * off rate limiting.  Defaults to 1000.
+ */
+#define HTRACE_LOG_RATELIMIT_MS_KEY "log.ratelimit.ms"
+
 /**
  * The span receiver implementation to use.
  *
  * Possible values:
  *   noop            The "no op" span receiver, which discards all spans.
  *   local.file      A receiver which writes spans to local files.
+ *   local.binfile   A receiver which writes spans to local files in a
+ *                   compact binary format, indexed by time and trace ID.
+ *   local.mmap      A receiver which writes spans into per-thread regions of
+ *                   a preallocated, memory-mapped local file.
  *   htraced         The htraced span receiver, which sends spans to htraced.
+ *   flight          A receiver which keeps the most recent spans in memory,
+ *                   and writes them to a file only when asked to.  See
+ *                   htracer_dump_flight_recorder.
+ *   histogram       A receiver which aggregates spans into a latency
+ *                   histogram per span description, and sends only the
+ *                   histograms on to another receiver.
+ *
+ * This can also be a comma-separated list, such as "htraced,local.binfile",
+ * to send every span to several span receivers.
  */
 #define HTRACE_SPAN_RECEIVER_KEY "span.receiver"
 
+/**
+ * If true, don't create the span receiver until the first sampled span is
+ * closed.  Until then, processes which never sample a span don't pay for the
+ * receiver's buffers, threads, or connections.  Errors in the receiver
+ * configuration are only logged once the receiver is created.  Defaults to
+ * false.
+ */
+#define HTRACE_SPAN_RECEIVER_LAZY_KEY "span.receiver.lazy"
+
 /**
  * The path which the local file span receiver should write spans to.
  */
 #define HTRACE_LOCAL_FILE_RCV_PATH_KEY "local.file.path"
 
+/**
+ * If true, the local file span receiver writes spans from a background
+ * thread.  Application threads copy their spans into per-thread staging
+ * buffers, and never touch the file themselves.  Defaults to false.
+ */
+#define HTRACE_LOCAL_FILE_ASYNC_KEY "local.file.async"
+
+/**
+ * The size in bytes of each of the two buffers which the local file span
+ * receiver's background thread writes from.  Each thread's staging buffer is
+ * 1/16th of this.  Only used in async mode.  Defaults to 1048576.
+ */
+#define HTRACE_LOCAL_FILE_BUFFER_SIZE_KEY "local.file.buffer.size"
+
+/**
+ * The longest time in milliseconds that spans sit in the staging buffers
+ * before the background thread writes them.  Only used in async mode.
+ * Defaults to 1000.
+ */
+#define HTRACE_LOCAL_FILE_FLUSH_INTERVAL_MS_KEY "local.file.flush.interval.ms"
+
+/**
+ * When the local file span receiver calls fdatasync.
+ *
+ * Possible values:
+ *   none            Never.  This is the default.
+ *   write           After every write.
+ *   interval        After a write, if local.file.fdatasync.interval.ms
+ *                   have passed since the last fdatasync.
+ */
+#define HTRACE_LOCAL_FILE_FDATASYNC_KEY "local.file.fdatasync"
+
+/**
+ * The minimum time in milliseconds between calls to fdatasync, when
+ * local.file.fdatasync is "interval".  Defaults to 1000.
+ */
+#define HTRACE_LOCAL_FILE_FDATASYNC_INTERVAL_MS_KEY \
+    "local.file.fdatasync.interval.ms"
+
+/**
+ * The size in bytes at which the local file span receiver rotates its file,
+ * or 0 to never rotate on size.  The current file is renamed to path.1, the
+ * old path.1 to path.2, and so on.  Defaults to 0.
+ */
+#define HTRACE_LOCAL_FILE_ROTATE_SIZE_KEY "local.file.rotate.size"
+
+/**
+ * The age in milliseconds at which the local file span receiver rotates its
+ * file, or 0 to never rotate on age.  Empty files are not rotated.
+ * Defaults to 0.
+ */
+#define HTRACE_LOCAL_FILE_ROTATE_INTERVAL_MS_KEY \
+    "local.file.rotate.interval.ms"
+
+/**
+ * The number of rotated files which the local file span receiver keeps.
+ * Older ones are deleted.  Defaults to 5.
+ */
+#define HTRACE_LOCAL_FILE_ROTATE_KEEP_KEY "local.file.rotate.keep"
+
+/**
+ * The path which the local binary file span receiver should write spans to.
+ * Spans are appended to any existing file.
+ */
+#define HTRACE_LOCAL_BINFILE_RCV_PATH_KEY "local.binfile.path"
+
+/**
+ * The size in bytes of the blocks of spans which the local binary file span
+ * receiver writes.  Each block is indexed by the time range and trace IDs of
+ * its spans, so smaller blocks let readers skip more of the file, at the
+ * cost of more write calls.  Defaults to 1048576.
+ */
+#define HTRACE_LOCAL_BINFILE_BLOCK_SIZE_KEY "local.binfile.block.size"
+
+/**
+ * The path which the local mmap span receiver should write spans to.  Any
+ * existing file at this path is replaced.
+ */
+#define HTRACE_LOCAL_MMAP_RCV_PATH_KEY "local.mmap.path"
+
+/**
+ * The size in bytes of the file which the local mmap span receiver
+ * preallocates.  Spans are dropped once it is full.  Defaults to 268435456.
+ */
+#define HTRACE_LOCAL_MMAP_SIZE_KEY "local.mmap.size"
+
+/**
+ * The size in bytes of the regions of the file which the local mmap span
+ * receiver hands to each thread.  A thread which fills its region claims
+ * another one.  Rounded down to a multiple of 4096.  Defaults to 1048576.
+ */
+#define HTRACE_LOCAL_MMAP_REGION_SIZE_KEY "local.mmap.region.size"
+
+/**
+ * The path of the shared memory ring which the shm span receiver should write
+ * spans to, for example a file in /dev/shm.  A local collector maps the same
+ * file to read the spans.  Any existing file at this path is replaced.
+ */
+#define HTRACE_SHM_RCV_PATH_KEY "shm.path"
+
+/**
+ * The size in bytes of the data area of the shm span receiver's ring.  When
+ * the ring is full, new spans are dropped.
+ */
+#define HTRACE_SHM_RCV_SIZE_KEY "shm.size"
+
+/**
+ * The size in bytes of the flight recorder's ring.  Once it is full, the
+ * oldest spans are overwritten.  Rounded down to a multiple of 65536.
+ * Defaults to 16777216.
+ */
+#define HTRACE_FLIGHT_RCV_SIZE_KEY "flight.size"
+
+/**
+ * The path which the flight recorder dumps its spans to on a signal, on a
+ * crash, or when it is freed.  Any existing file at this path is replaced.
+ * Dumps hold the spans in msgpack form, one after another.
+ */
+#define HTRACE_FLIGHT_RCV_PATH_KEY "flight.path"
+
+/**
+ * The number of a signal, such as 12 for SIGUSR2 on Linux, which makes the
+ * flight recorder dump its spans to flight.path.  0 means none.  Only one
+ * flight recorder in a process can handle signals.  Defaults to 0.
+ */
+#define HTRACE_FLIGHT_RCV_SIGNAL_KEY "flight.signal"
+
+/**
+ * If true, the flight recorder dumps its spans to flight.path when the
+ * process gets SIGSEGV, SIGBUS, SIGILL, SIGFPE or SIGABRT, and then hands
+ * the signal on to the previous handler.  Defaults to false.
+ */
+#define HTRACE_FLIGHT_RCV_DUMP_ON_CRASH_KEY "flight.dump.on.crash"
+
+/**
+ * If true, the flight recorder dumps its spans to flight.path when the
+ * tracer is freed.  Defaults to false.
+ */
+#define HTRACE_FLIGHT_RCV_DUMP_ON_FREE_KEY "flight.dump.on.free"
+
+/**
+ * The span receiver which the histogram span receiver sends its summaries
+ * to, such as htraced or local.file.
+ *
+ * Each summary is a span with the description of the spans it summarizes,
+ * which begins and ends with the interval it covers.  Its key/value
+ * annotations hold the histogram:
+ *   histogram.count     The number of spans.
+ *   histogram.min.us    The shortest duration, in microseconds.
+ *   histogram.max.us    The longest duration.
+ *   histogram.mean.us   The mean duration.
+ *   histogram.p50.us    The median duration, and so on for p90, p99 and
+ *                       p99.9.  These are accurate to about 6%.
+ *   histogram.buckets   The nonempty buckets, as a comma-separated list of
+ *                       "low:count", where low is the shortest duration
+ *                       which falls in the bucket.
+ *
+ * Defaults to htraced.
+ */
+#define HTRACE_HISTOGRAM_RCV_RECEIVER_KEY "histogram.receiver"
+
+/**
+ * How often the histogram span receiver sends its summaries, in
+ * milliseconds.  Defaults to 10000.
+ */
+#define HTRACE_HISTOGRAM_RCV_INTERVAL_MS_KEY "histogram.interval.ms"
+
 /**
  * The hostname and port which the htraced span receiver should send its spans
- * to.  This is in the format "hostname:port".
+ * to.  This is in the format "hostname:port".  Several htraced servers can be
+ * given as a comma-separated list, in which case spans are spread across the
+ * servers which are healthy.
+ *
+ * A node-local htraced server can be reached over a unix domain socket by
+ * giving "unix:/path/to/socket" instead of a hostname and port.
  */
 #define HTRACED_ADDRESS_KEY "htraced.address"
 
@@ -131,10 +352,194 @@ extern  "C" {
 #define HTRACED_READ_TIMEO_MS_KEY "htraced.read.timeo.ms"
 
 /**
- * The size of the circular buffer to use in the htraced receiver.
+ * How long, in milliseconds, the htraced span receiver keeps trying to send
+ * buffered spans when it is shut down, or 0 to keep trying until every
+ * buffer has been sent or has run out of tries.
+ *
+ * While the timeout runs, every buffer is sent at once, and no connect, send,
+ * or wait for a response may run past the end of it.  Whatever is still
+ * unsent after that is dropped.
+ */
+#define HTRACED_SHUTDOWN_TIMEO_MS_KEY "htraced.shutdown.timeo.ms"
+
+/**
+ * Whether to set TCP_NODELAY on connections to the htraced server, so that
+ * the end of a request is not held back waiting for earlier data to be
+ * acknowledged.
+ */
+#define HTRACED_TCP_NODELAY_KEY "htraced.tcp.nodelay"
+
+/**
+ * The socket send buffer size, in bytes, to ask for on connections to the
+ * htraced server, or 0 to use the system default.  A larger buffer helps send
+ * large batches at full speed over links with a long round trip time.
+ */
+#define HTRACED_TCP_SNDBUF_KEY "htraced.tcp.sndbuf"
+
+/**
+ * How long, in milliseconds, a connection to the htraced server can be idle
+ * before TCP keepalive probes are sent, or 0 to disable TCP keepalive.
+ */
+#define HTRACED_TCP_KEEPALIVE_MS_KEY "htraced.tcp.keepalive.ms"
+
+/**
+ * How long, in milliseconds, to keep using the addresses we looked up for an
+ * htraced server before looking them up again, or 0 to look them up every
+ * time we connect.
+ *
+ * Addresses are looked up again in the background, so a slow DNS server does
+ * not hold up sending spans.  They are also looked up again soon after we fail
+ * to connect to all of them.
+ */
+#define HTRACED_DNS_CACHE_MS_KEY "htraced.dns.cache.ms"
+
+/**
+ * Whether the htraced receiver should hand its sends to the kernel through
+ * io_uring, so that a large batch can finish sending in the background while
+ * the responses to earlier batches are read.  This needs libhtrace to have
+ * been built with io_uring support, and a kernel which has it.  Otherwise,
+ * we send with writev, as when this is false.
+ */
+#define HTRACED_IO_URING_KEY "htraced.io.uring"
+
+/**
+ * How the htraced receiver should send spans.
+ *
+ * Possible values:
+ *   stream         Send spans over a TCP or unix domain stream connection,
+ *                  and wait for htraced to acknowledge each batch.  Failed
+ *                  batches are sent again.
+ *   datagram       Pack spans into datagrams of at most htraced.datagram.size
+ *                  bytes, and send them over UDP, or a unix domain datagram
+ *                  socket, without waiting for any acknowledgement.  This
+ *                  never holds up the receiver, but spans in a lost datagram
+ *                  are gone for good.  The server must be listening for
+ *                  datagrams.  Compression and spilling are not used.
+ */
+#define HTRACED_TRANSPORT_KEY "htraced.transport"
+
+/**
+ * The largest datagram to send, in bytes, when htraced.transport is datagram.
+ * This includes the HRPC header, but not the UDP and IP headers.  The default
+ * leaves room for those within a 1500-byte Ethernet MTU.  A span which doesn't
+ * fit into one datagram is dropped.
+ */
+#define HTRACED_DATAGRAM_SIZE_KEY "htraced.datagram.size"
+
+/**
+ * The total size of the buffers to use in the htraced receiver.
  */
 #define HTRACED_BUFFER_SIZE_KEY "htraced.buffer.size"
 
+/**
+ * Whether htracers which send to the same htraced.address should share one
+ * htraced receiver, rather than each having their own buffers, transmitter
+ * thread and connections.  The first htracer to create the shared receiver
+ * decides all of its other htraced.* settings; later htracers only add their
+ * spans, tagged with their own tracer id.  Statistics and pressure are those
+ * of the shared receiver.  The receiver is shut down along with the last
+ * htracer which uses it.
+ */
+#define HTRACED_SHARED_KEY "htraced.shared"
+
+/**
+ * The most bytes of send buffers which all of the shared htraced receivers in
+ * the process may use between them, or 0 for no limit.  A shared receiver
+ * created when there is not enough of this left gets smaller buffers than
+ * htraced.buffer.size asks for, but never less than 4 MB.
+ */
+#define HTRACED_SHARED_MEMORY_MAX_KEY "htraced.shared.memory.max"
+
+/**
+ * The largest WriteSpans request the htraced receiver should send, in bytes.
+ *
+ * Buffers which hold more spans than this are sent as several requests, one
+ * straight after another.  Smaller requests are answered sooner, and a failed
+ * request takes less time to send again, but each has some overhead.  This
+ * can't be more than 33554432, the largest request htraced accepts.  A span
+ * which doesn't fit into one request is dropped.
+ */
+#define HTRACED_RPC_MAX_SIZE_KEY "htraced.rpc.max.size"
+
+/**
+ * The number of buffers to divide the htraced receiver's buffer space into.
+ *
+ * While one buffer is being sent, spans are added to the others.  Using more
+ * than two buffers lets the receiver absorb bursts of spans while a send is
+ * slow.
+ */
+#define HTRACED_BUFFER_COUNT_KEY "htraced.buffer.count"
+
+/**
+ * What the htraced receiver should do when all of its buffers are full.
+ *
+ * Possible values:
+ *   drop-newest     Drop the spans being added.
+ *   drop-oldest     Drop the oldest buffered spans which are not already
+ *                   being sent.
+ *   block           Block the thread adding spans until there is space, or
+ *                   until htraced.buffer.full.block.timeo.ms elapses.  Spans
+ *                   are dropped on timeout.
+ */
+#define HTRACED_BUFFER_FULL_POLICY_KEY "htraced.buffer.full.policy"
+
+/**
+ * The maximum number of milliseconds to block for when the htraced receiver's
+ * buffers are full and the "block" policy is in use.
+ */
+#define HTRACED_BUFFER_FULL_BLOCK_TIMEO_MS_KEY \
+    "htraced.buffer.full.block.timeo.ms"
+
+/**
+ * The fraction of the htraced receiver's buffer space to keep for
+ * high-priority spans.  Normal-priority spans are dropped once less than this
+ * much space is free, whatever htraced.buffer.full.policy says, so that
+ * high-priority spans still fit.  0 keeps nothing back.
+ *
+ * See htrace_scope_set_priority.
+ */
+#define HTRACED_BUFFER_PRIORITY_RESERVE_KEY "htraced.buffer.priority.reserve"
+
+/**
+ * How long, in milliseconds, the htraced receiver waits before using an
+ * htraced server again after the first failure to talk to it.
+ *
+ * The wait doubles with each consecutive failure, up to
+ * htraced.retry.backoff.max.ms.  A random amount of up to half of it is taken
+ * off, so that many clients don't all come back at the same moment.
+ */
+#define HTRACED_RETRY_BACKOFF_MIN_MS_KEY "htraced.retry.backoff.min.ms"
+
+/**
+ * The longest time, in milliseconds, the htraced receiver waits before using
+ * an htraced server again after failing to talk to it.
+ */
+#define HTRACED_RETRY_BACKOFF_MAX_MS_KEY "htraced.retry.backoff.max.ms"
+
+/**
+ * The maximum number of buffers the htraced receiver may have in flight to
+ * the server at once.
+ *
+ * With a value of 1, the receiver waits for each WriteSpans response before
+ * sending the next buffer.  Larger values let it send more buffers while
+ * waiting, which helps when the round trip time to htraced is long.  This is
+ * also limited by htraced.buffer.count, since one buffer must always be free
+ * to receive new spans.
+ */
+#define HTRACED_INFLIGHT_WINDOW_KEY "htraced.inflight.window"
+
+/**
+ * The longest time, in milliseconds, that the htraced span receiver should
+ * take to deliver a span to htraced, or 0 to disable adaptive batching.
+ *
+ * With adaptive batching, the receiver measures how long WriteSpans requests
+ * take and how quickly spans arrive.  It sends a buffer once it holds about
+ * as many spans as arrive during one request, or once the oldest span in it
+ * would otherwise miss this bound, whichever comes first.  The send trigger
+ * fraction becomes the most the receiver will buffer before sending.
+ */
+#define HTRACED_BATCH_MAX_LATENCY_MS_KEY "htraced.batch.max.latency.ms"
+
 /**
  * The fraction of the buffer that needs to be full to trigger the spans to be
  * sent from the htraced span receiver.
@@ -142,6 +547,115 @@ extern  "C" {
 #define HTRACED_BUFFER_SEND_TRIGGER_FRACTION \
     "htraced.buffer.send.trigger.fraction"
 
+/**
+ * The size of the per-thread staging buffer to use in the htraced receiver.
+ *
+ * When this is nonzero, each thread serializes spans into its own staging
+ * buffer, and only takes the shared receiver lock when that staging buffer
+ * needs to be copied into the shared send buffer.  This reduces lock
+ * contention when many threads are closing spans at once, at the cost of
+ * some extra memory per thread.  When this is 0, threads write directly into
+ * the shared send buffer.
+ */
+#define HTRACED_THREAD_BUFFER_SIZE_KEY "htraced.thread.buffer.size"
+
+/**
+ * How the htraced receiver shares out its staging buffers, when
+ * htraced.thread.buffer.size is nonzero.
+ *
+ * Possible values:
+ *   thread         Each thread which closes a span gets its own staging
+ *                  buffer, freed when the thread exits.
+ *   cpu            There is one staging buffer per CPU, and a thread uses the
+ *                  one for the CPU it is running on.  Memory use scales with
+ *                  the number of CPUs rather than the number of threads,
+ *                  which suits processes with thousands of threads.  Where
+ *                  sched_getcpu is unavailable, this is the same as having a
+ *                  single shared staging buffer.
+ */
+#define HTRACED_THREAD_BUFFER_SHARDING_KEY "htraced.thread.buffer.sharding"
+
+/**
+ * If true, the htraced receiver serializes spans on a background thread.
+ *
+ * Closing a span then only pushes it on to a lock-free queue, and a
+ * serializer thread encodes it into the send buffers and frees it.  This
+ * takes msgpack encoding and the receiver lock off the thread which closed
+ * the span.  When HTRACED_ASYNC_QUEUE_MAX_KEY spans are already queued,
+ * spans are serialized by the closing thread as usual.
+ */
+#define HTRACED_ASYNC_SERIALIZE_KEY "htraced.async.serialize"
+
+/**
+ * The most spans to queue for the serializer thread.  See
+ * HTRACED_ASYNC_SERIALIZE_KEY.
+ */
+#define HTRACED_ASYNC_QUEUE_MAX_KEY "htraced.async.queue.max"
+
+/**
+ * How the htraced receiver should compress the spans it sends.
+ *
+ * Possible values:
+ *   none           Send spans uncompressed.
+ *   zlib           Compress each WriteSpans request with zlib.  This needs a
+ *                  version of htraced which understands compressed requests,
+ *                  and libhtrace must have been built with zlib.  A request
+ *                  is still sent uncompressed if compressing it doesn't make
+ *                  it any smaller.
+ */
+#define HTRACED_COMPRESSION_KEY "htraced.compression"
+
+/**
+ * The zlib compression level to use, from 1 (fastest) to 9 (smallest).
+ */
+#define HTRACED_COMPRESSION_LEVEL_KEY "htraced.compression.level"
+
+/**
+ * Whether WriteSpans requests should carry a table of the distinct span
+ * descriptions in the batch and a table of the distinct trace IDs, so that
+ * each span refers to these by a small index instead of repeating them.
+ * This is done before any compression.  A batch which would not get any
+ * smaller is sent as usual.  The htraced server must be new enough to
+ * understand these tables.  Batches with tables are sent with a method ID of
+ * their own, so that an older server refuses them instead of misreading
+ * them.  They are then retried and dropped like any other batch which can't
+ * be sent.  Not supported with the datagram transport.
+ */
+#define HTRACED_DICTIONARY_KEY "htraced.dictionary"
+
+/**
+ * If true, the spans in each batch are grouped by trace before it is sent,
+ * so that htraced can store the spans of a trace together.  Spans are
+ * otherwise sent in the order they were closed, which interleaves the traces
+ * in a busy process.  The grouping is done by the transmitter thread, and
+ * needs a scratch buffer as large as a send buffer.  The order of the spans
+ * within each trace doesn't change.
+ */
+#define HTRACED_GROUP_BY_TRACE_KEY "htraced.group.by.trace"
+
+/**
+ * The directory the htraced receiver should spill span batches to when they
+ * can't be sent.
+ *
+ * Batches which fail to send while no htraced server is reachable, or which
+ * have been tried too many times, are written here instead of being dropped.
+ * They are sent again, in order, once a server is reachable.  The spill
+ * files are deleted when the receiver shuts down.  If this is not set,
+ * nothing is spilled.
+ */
+#define HTRACED_SPILL_DIR_KEY "htraced.spill.dir"
+
+/**
+ * The maximum total size of the htraced receiver's spill files.
+ */
+#define HTRACED_SPILL_MAX_SIZE_KEY "htraced.spill.max.size"
+
+/**
+ * The size of each of the htraced receiver's spill files.  This will be
+ * increased if needed so that a whole send buffer fits in one file.
+ */
+#define HTRACED_SPILL_SEGMENT_SIZE_KEY "htraced.spill.segment.size"
+
 /**
  * The process ID string to use.
  *
@@ -153,6 +667,133 @@ extern  "C" {
  */
 #define HTRACE_TRACER_ID "tracer.id"
 
+/**
+ * The clock to take span timestamps from.
+ *
+ * Possible values:
+ *   realtime        clock_gettime(CLOCK_REALTIME).  This is the default.
+ *   realtime-coarse clock_gettime(CLOCK_REALTIME_COARSE).  The cheapest
+ *                   option, but only as precise as the kernel tick, which is
+ *                   typically 1 to 4 milliseconds.
+ *   tsc             The CPU timestamp counter, calibrated against the wall
+ *                   clock when the tracer is created and re-anchored to it
+ *                   about once a second.  Only available on x86_64 CPUs with
+ *                   an invariant TSC.  Creating the tracer takes a few extra
+ *                   milliseconds to calibrate it.
+ *
+ * If the requested clock is not available, realtime is used.
+ */
+#define HTRACE_CLOCK_KEY "clock"
+
+/**
+ * The precision of span timestamps.
+ *
+ * Possible values:
+ *   ms              Milliseconds, under the "b" and "e" keys.  This is the
+ *                   default, and all htraced versions understand it.
+ *   us              Also send microseconds, under the "bu" and "eu" keys.
+ *   ns              Also send nanoseconds, under the "bn" and "en" keys.
+ *
+ * The millisecond timestamps are always sent, so servers which don't know
+ * about the precise timestamps can still use the spans.  The precise
+ * timestamps are only as good as the clock; see HTRACE_CLOCK_KEY.
+ */
+#define HTRACE_TIMESTAMP_PRECISION_KEY "timestamp.precision"
+
+/**
+ * What each span measures about the CPU use of the thread which started it.
+ *
+ * Possible values:
+ *   off             Nothing.  This is the default.
+ *   time            The thread CPU time used during the span, in
+ *                   nanoseconds, under the "cn" key.  Read with
+ *                   clock_gettime(CLOCK_THREAD_CPUTIME_ID).
+ *   rusage          The thread CPU time, at microsecond granularity, and the
+ *                   voluntary and involuntary context switches during the
+ *                   span, under the "cn", "cv" and "ci" keys.  Read with
+ *                   getrusage(RUSAGE_THREAD).  Where that isn't available,
+ *                   time is used instead.
+ *
+ * Unlike the wall clock, neither of these is served by the vDSO on Linux, so
+ * each adds two system calls, typically a few hundred nanoseconds, to every
+ * span.  A span which is detached with htrace_scope_detach, or started with
+ * htrace_start_span_from, may be closed on another thread, so it doesn't get
+ * these fields.  Servers which don't know about them ignore them.
+ */
+#define HTRACE_SPAN_CPU_KEY "span.cpu"
+
+/**
+ * The number of closed spans each thread collects before giving them to the
+ * span receiver in one call.  This amortizes the receiver's locking and
+ * wakeups across the batch; 32 is a reasonable size.  0 or 1, the default,
+ * gives each span to the receiver as soon as it is closed.  Receivers which
+ * can't take spans in batches always get them one at a time.
+ *
+ * A partial batch is given to the receiver once a span is added to it
+ * HTRACE_BATCH_MAX_AGE_MS_KEY after its first span, when the thread exits,
+ * or when the tracer is freed.
+ */
+#define HTRACE_BATCH_SIZE_KEY "batch.size"
+
+/**
+ * How long a closed span may wait in a per-thread batch, in milliseconds.
+ * See HTRACE_BATCH_SIZE_KEY.
+ */
+#define HTRACE_BATCH_MAX_AGE_MS_KEY "batch.max.age.ms"
+
+/**
+ * If true, decide whether to keep each trace after it has finished, rather
+ * than only when its root span starts.
+ *
+ * The sampler still decides which traces are created.  Closed spans are then
+ * held in memory, grouped by trace, until the local root span of the trace
+ * closes.  The whole trace is given to the span receiver if the root took at
+ * least HTRACE_TAIL_MIN_DURATION_MS_KEY, or if any of its spans has an
+ * "error" annotation; otherwise it is dropped.  Spans of a trace which close
+ * after its root follow the same decision.
+ *
+ * This is usually combined with the always sampler, so that the slow and
+ * failed traces are all seen without paying to send the rest.
+ */
+#define HTRACE_TAIL_SAMPLING_KEY "tail.sampling"
+
+/**
+ * The shortest a local root span can take for tail sampling to keep its
+ * trace, in milliseconds.
+ */
+#define HTRACE_TAIL_MIN_DURATION_MS_KEY "tail.min.duration.ms"
+
+/**
+ * The most traces which tail sampling tracks at once.  When a new trace
+ * starts and the table is full, the oldest trace is forgotten, and any spans
+ * still held for it are dropped.
+ */
+#define HTRACE_TAIL_MAX_TRACES_KEY "tail.max.traces"
+
+/**
+ * The most spans which tail sampling holds for one trace while waiting for
+ * its root to close.  Further spans of that trace are dropped.
+ */
+#define HTRACE_TAIL_MAX_TRACE_SPANS_KEY "tail.max.trace.spans"
+
+/**
+ * If true, the library measures its own cost, and reports it in the self_*
+ * fields of struct htrace_stats.  Each measured call reads the monotonic
+ * clock twice, which typically adds 50 nanoseconds or so to it, so this is
+ * off by default.
+ */
+#define HTRACE_SELF_STATS_KEY "self.stats"
+
+/**
+ * The shortest a span can take to be given high priority when it closes, in
+ * milliseconds, or 0 to go by htrace_scope_set_priority alone.  Spans with an
+ * "error" annotation always get high priority.
+ *
+ * Span receivers which run short of buffer space drop normal-priority spans
+ * first.  See HTRACED_BUFFER_PRIORITY_RESERVE_KEY.
+ */
+#define HTRACE_PRIORITY_MIN_DURATION_MS_KEY "priority.min.duration.ms"
+
 /**
  * The sampler to use.
  *
@@ -160,6 +801,14 @@ extern  "C" {
  *   never          A sampler which never fires.
  *   always         A sampler which always fires.
  *   prob           A sampler which fires with some probability.
+ *   ratelimit      A sampler which fires at most a fixed number of times per
+ *                      second.
+ *   adaptive       A sampler which fires with some probability, which it
+ *                      lowers while the span receiver is under pressure.
+ *   hash           A sampler which fires for a fixed fraction of trace IDs,
+ *                      so that every process keeps the same traces.
+ *   rules          A sampler which fires with a probability that depends on
+ *                      the span description.
  */
 #define HTRACE_SAMPLER_KEY "sampler"
 
@@ -170,15 +819,151 @@ extern  "C" {
  */
 #define HTRACE_PROB_SAMPLER_FRACTION_KEY "prob.sampler.fraction"
 
+/**
+ * For the rate-limiting sampler, the most new traces to start per second.
+ * Unlike the probability sampler, this bounds the tracing load on htraced
+ * when traffic spikes.
+ */
+#define HTRACE_RATELIMIT_SAMPLER_RATE_KEY "ratelimit.sampler.spans.per.sec"
+
+/**
+ * For the adaptive sampler, the fraction of the time to create a new span
+ * when the span receiver is keeping up.  This is also where it starts.
+ */
+#define HTRACE_ADAPTIVE_SAMPLER_MAX_FRACTION_KEY \
+    "adaptive.sampler.max.fraction"
+
+/**
+ * For the adaptive sampler, the lowest fraction it will back off to.
+ */
+#define HTRACE_ADAPTIVE_SAMPLER_MIN_FRACTION_KEY \
+    "adaptive.sampler.min.fraction"
+
+/**
+ * For the adaptive sampler, the span receiver pressure above which it
+ * samples less, from 1 to 100.  Pressure combines how full the receiver's
+ * buffers are, whether its RPC latency is rising, and whether it has dropped
+ * spans recently.
+ */
+#define HTRACE_ADAPTIVE_SAMPLER_TARGET_PRESSURE_KEY \
+    "adaptive.sampler.target.pressure"
+
+/**
+ * For the adaptive sampler, how often to check the span receiver's pressure,
+ * in milliseconds.
+ */
+#define HTRACE_ADAPTIVE_SAMPLER_INTERVAL_MS_KEY "adaptive.sampler.interval.ms"
+
+/**
+ * For the hash sampler, the fraction of trace IDs to sample.  This is a
+ * floating point number between 0.0 and 1.0, inclusive.  Processes which
+ * should agree about which traces to keep must use the same fraction.
+ */
+#define HTRACE_HASH_SAMPLER_FRACTION_KEY "hash.sampler.fraction"
+
+/**
+ * For the rules sampler, a comma-separated list of prefix:fraction rules,
+ * such as "Heartbeat:0.0001,Write:0.5".  New traces whose description starts
+ * with a prefix are sampled with its fraction.  The longest matching prefix
+ * wins.  Prefixes can't contain commas, and can be up to 255 characters
+ * long.
+ */
+#define HTRACE_RULES_SAMPLER_RULES_KEY "rules.sampler.rules"
+
+/**
+ * For the rules sampler, the fraction to sample new traces whose
+ * description matches no rule with.  A rule with an empty prefix sets this
+ * too.
+ */
+#define HTRACE_RULES_SAMPLER_DEFAULT_FRACTION_KEY \
+    "rules.sampler.default.fraction"
+
 /**
  * The length of an HTrace span ID in hexadecimal string form.
  */
 #define HTRACE_SPAN_ID_STRING_LENGTH 32
 
+/**
+ * The length of a trace context in binary form: a version byte, the 16 bytes
+ * of the span ID, most significant first, and a flags byte.
+ */
+#define HTRACE_CONTEXT_LEN 18
+
+/**
+ * The length of a trace context in base64 form, not counting the
+ * terminating NUL.
+ */
+#define HTRACE_CONTEXT_BASE64_LEN 24
+
+/**
+ * The version of the trace context encoding which we write.
+ */
+#define HTRACE_CONTEXT_VERSION 0
+
+/**
+ * The trace context flag which says that the span was sampled.
+ */
+#define HTRACE_CONTEXT_SAMPLED 0x01
+
     // Forward declarations
     struct htrace_conf;
     struct htracer;
+    struct htrace_desc;
     struct htrace_scope;
+    struct htrace_span_id;
+
+    /**
+     * The functions which the library uses to allocate memory.
+     *
+     * Every object the library allocates, down to the send buffers of the
+     * htraced receiver, comes from these functions.  Each send buffer is a
+     * single allocation of about htraced.buffer.size bytes, so an allocator
+     * can recognize the large requests and put them on huge pages.
+     */
+    struct htrace_allocator {
+        /**
+         * Allocate size bytes, like malloc.
+         */
+        void *(*malloc_fn)(size_t size, void *ctx);
+
+        /**
+         * Resize an allocation, like realloc.  ptr may be NULL.
+         */
+        void *(*realloc_fn)(void *ptr, size_t size, void *ctx);
+
+        /**
+         * Allocate size bytes aligned to align, which is a power of two
+         * and a multiple of sizeof(void*), like aligned_alloc.
+         */
+        void *(*aligned_fn)(size_t align, size_t size, void *ctx);
+
+        /**
+         * Free memory returned by any of the functions above, like free.
+         * ptr may be NULL.
+         */
+        void (*free_fn)(void *ptr, void *ctx);
+
+        /**
+         * Passed to each of the functions above.
+         */
+        void *ctx;
+    };
+
+    /**
+     * Make the library allocate memory with the given functions rather than
+     * with malloc and free.
+     *
+     * This applies to the whole process.  It must be called before any
+     * other htrace function, and not again, since memory allocated with one
+     * allocator would otherwise be freed with another.
+     *
+     * @param alloc         The allocator.  It will be copied.  NULL goes back
+     *                          to malloc and free.
+     *
+     * @return              0 on success; EINVAL if any of the functions is
+     *                          missing.
+     */
+    int htrace_set_allocator(const struct htrace_allocator *alloc);
 
     /**
      * Create an HTrace conf object from a string.
@@ -231,27 +1016,248 @@ extern  "C" {
      *
      * @param tracer        The tracer.
      *
-     * @return              The tracer name.  This string is managed by the
-     *                          tracer itself and will remain valid until the
-     *                          tracer is freed.
+     * @return              The tracer name.  This string is managed by the
+     *                          tracer itself and will remain valid until the
+     *                          tracer is freed.
+     */
+    const char *htracer_tname(const struct htracer *tracer);
+
+    /**
+     * Free an HTracer.
+     *
+     * Frees the memory and other resources associated with a Tracer.
+     * Closes the log file if there is one open.  Shuts down the span receiver
+     * if there is one active.  Attempt to flush all buffered spans.
+     *
+     * Do not call this function until all the samplers which hold a reference
+     * to this htracer have been freed.  Do not call this function if there is
+     * currently an active htrace_scope object which holds a reference to this
+     * tracer.
+     *
+     * @param tracer        The tracer to free.
+     */
+    void htracer_free(struct htracer *tracer);
+
+    /**
+     * The number of buckets in the WriteSpans latency histogram.
+     */
+#define HTRACE_STATS_LATENCY_BUCKETS 16
+
+    /**
+     * Statistics about what an htracer and its span receiver have done.
+     *
+     * Every counter starts at 0 when the htracer is created, and only goes
+     * up.  Counters which don't apply to the configured span receiver stay
+     * at 0.
+     */
+    struct htrace_stats {
+        /**
+         * The number of calls to htrace_start_span.
+         */
+        uint64_t spans_started;
+
+        /**
+         * The number of spans created by htrace_start_span, either because
+         * the sampler chose them or because they had a parent.
+         */
+        uint64_t spans_sampled;
+
+        /**
+         * The number of spans which were closed and given to the span
+         * receiver.
+         */
+        uint64_t spans_closed;
+
+        /**
+         * The number of spans not created because their description was
+         * invalid.
+         */
+        uint64_t dropped_invalid;
+
+        /**
+         * The number of spans dropped because we ran out of memory.
+         */
+        uint64_t dropped_oom;
+
+        /**
+         * The number of spans the span receiver buffered for sending.
+         */
+        uint64_t buffered;
+
+        /**
+         * The number of new spans dropped because all buffers were full.
+         */
+        uint64_t dropped_newest;
+
+        /**
+         * The number of buffered spans dropped to make room for new ones.
+         */
+        uint64_t dropped_oldest;
+
+        /**
+         * The number of times a thread blocked waiting for buffer space.
+         */
+        uint64_t blocked;
+
+        /**
+         * The number of spans dropped after blocking for buffer space timed
+         * out.
+         */
+        uint64_t dropped_timeout;
+
+        /**
+         * The number of spans dropped because they were too big for a
+         * buffer.
+         */
+        uint64_t dropped_too_large;
+
+        /**
+         * The number of spans dropped because we could not send or write
+         * them.
+         */
+        uint64_t dropped_xmit;
+
+        /**
+         * The number of normal-priority spans dropped to keep buffer space
+         * free for high-priority spans.
+         */
+        uint64_t dropped_low_priority;
+
+        /**
+         * The number of spans spilled to disk.
+         */
+        uint64_t spilled;
+
+        /**
+         * The number of spilled spans which were later sent.
+         */
+        uint64_t unspilled;
+
+        /**
+         * The number of bytes of span data serialized by the span receiver.
+         */
+        uint64_t bytes_serialized;
+
+        /**
+         * The number of bytes of span data sent successfully, before and
+         * after compression.
+         */
+        uint64_t xmit_bytes;
+        uint64_t xmit_wire_bytes;
+
+        /**
+         * The number of WriteSpans requests made, and the number of those
+         * which failed.
+         */
+        uint64_t rpcs;
+        uint64_t rpc_errors;
+
+        /**
+         * A histogram of how long WriteSpans requests took to get a response.
+         * Bucket 0 counts requests which took less than 1 ms.  Bucket i
+         * counts requests which took at least 2^(i-1) ms, but less than 2^i
+         * ms.  The last bucket also counts everything slower than that.
+         */
+        uint64_t rpc_latency_ms[HTRACE_STATS_LATENCY_BUCKETS];
+
+        /**
+         * The largest number of send buffers which were in use at once.
+         */
+        uint64_t buffers_used_max;
+
+        /**
+         * The largest number of bytes held in one send buffer.
+         */
+        uint64_t buffer_bytes_max;
+
+        /**
+         * The number of closed spans which tail sampling gave to the span
+         * receiver, and the number it dropped.
+         */
+        uint64_t tail_kept;
+        uint64_t tail_dropped;
+
+        /**
+         * The total time spent starting and closing trace scopes, in
+         * nanoseconds.  Only measured if HTRACE_SELF_STATS_KEY is set.
+         */
+        uint64_t self_start_span_ns;
+        uint64_t self_scope_close_ns;
+
+        /**
+         * The total time the span receiver spent adding spans to its
+         * buffers, in nanoseconds, including the time spent waiting for its
+         * lock.  Only measured if HTRACE_SELF_STATS_KEY is set.
+         */
+        uint64_t self_add_span_ns;
+        uint64_t self_lock_wait_ns;
+
+        /**
+         * The total time the span receiver's transmitter thread spent
+         * sending requests, or waiting for responses to them, in
+         * nanoseconds.  Only measured if HTRACE_SELF_STATS_KEY is set.
+         */
+        uint64_t self_xmit_wait_ns;
+    };
+
+    /**
+     * Get statistics about an htracer and its span receiver.
+     *
+     * This is safe to call from any thread while the tracer is in use.  The
+     * counters are read one by one, so they may not be exactly consistent
+     * with each other.
+     *
+     * @param tracer        The tracer.
+     * @param stats         (out param) The statistics.
+     */
+    void htracer_get_stats(struct htracer *tracer,
+                           struct htrace_stats *stats);
+
+    /**
+     * Apply a new configuration to a tracer, without re-creating it.
+     *
+     * This is safe to call from any thread while the tracer is in use.
+     * Buffered spans are kept, and no threads are restarted.  Keys which are
+     * not set in the new configuration go back to their defaults, as if the
+     * tracer had been created with it.
+     *
+     * Only some keys can be changed this way: prob.sampler.fraction and
+     * hash.sampler.fraction, for the samplers created for this tracer;
+     * priority.min.duration.ms; and htraced.flush.interval.ms,
+     * htraced.buffer.size, htraced.buffer.send.trigger.fraction,
+     * htraced.buffer.full.block.timeo.ms, htraced.buffer.priority.reserve
+     * and htraced.shutdown.timeo.ms.  The send buffers can be shrunk, or
+     * grown back, but never beyond the size they were created with.  They
+     * are resized as they become free.  Everything else keeps the value
+     * the tracer was created with.
+     *
+     * @param tracer        The tracer.
+     * @param cnf           The new configuration.  You may free this
+     *                          configuration object after calling this
+     *                          function.
+     *
+     * @return              0 on success; an error number otherwise.
      */
-    const char *htracer_tname(const struct htracer *tracer);
+    int htracer_update_conf(struct htracer *tracer,
+                            const struct htrace_conf *cnf);
 
     /**
-     * Free an HTracer.
+     * Write the spans held by a tracer's flight recorder to a file.
      *
-     * Frees the memory and other resources associated with a Tracer.
-     * Closes the log file if there is one open.  Shuts down the span receiver
-     * if there is one active.  Attempt to flush all buffered spans.
+     * This is safe to call from any thread while the tracer is in use.
+     * Spans which are still in a per-thread batch, or which are being added
+     * while the dump runs, may be left out.
      *
-     * Do not call this function until all the samplers which hold a reference
-     * to this htracer have been freed.  Do not call this function if there is
-     * currently an active htrace_scope object which holds a reference to this
-     * tracer.
+     * @param tracer        The tracer.
+     * @param path          The path to write to, or NULL to use
+     *                          flight.path.  Any existing file at this path
+     *                          is replaced.
      *
-     * @param tracer        The tracer to free.
+     * @return              0 on success; ENOENT if the tracer has no flight
+     *                          recorder; another error number otherwise.
      */
-    void htracer_free(struct htracer *tracer);
+    int htracer_dump_flight_recorder(struct htracer *tracer,
+                                     const char *path);
 
     /**
      * Create an htrace configuration sample from a configuration.
@@ -275,6 +1281,22 @@ extern  "C" {
     struct htrace_sampler *htrace_sampler_create(struct htracer *tracer,
                                                  struct htrace_conf *cnf);
 
+    /**
+     * Decide whether to sample a trace whose ID is already known, such as
+     * one continued from another process.
+     *
+     * With the hash sampler, every process makes the same decision for the
+     * same trace.  Other samplers decide just as they do for new traces.
+     *
+     * @param smp           The sampler.
+     * @param id            A span ID in the trace.  Only the trace ID, the
+     *                          upper 64 bits, is used.
+     *
+     * @return              1 if the trace should be sampled; 0 otherwise.
+     */
+    int htrace_sampler_next_trace(struct htrace_sampler *smp,
+                                  const struct htrace_span_id *id);
+
     /**
      * Get the name of an HTrace sampler.
      *
@@ -312,6 +1334,212 @@ extern  "C" {
     struct htrace_scope* htrace_start_span(struct htracer *tracer,
                         struct htrace_sampler *sampler, const char *desc);
 
+    /**
+     * The size of struct htrace_scope_storage, in pointers.
+     */
+#define HTRACE_SCOPE_STORAGE_WORDS 8
+
+    /**
+     * Caller-provided memory for a trace scope.
+     *
+     * The contents are private to the library.  The size is part of the ABI,
+     * and leaves room for the scope to grow.
+     */
+    struct htrace_scope_storage {
+        void *opaque[HTRACE_SCOPE_STORAGE_WORDS];
+    };
+
+    /**
+     * Start a new trace span if necessary, keeping the scope in memory
+     * provided by the caller.
+     *
+     * This is just like htrace_start_span, except that no memory is
+     * allocated for the scope.  You must still call htrace_scope_close on the
+     * returned scope, and the storage must stay valid, and must not be moved
+     * or reused, until you do.  This makes it suitable for scopes whose
+     * lifetime is lexical, with the storage on the stack.
+     *
+     * @param storage   The memory to keep the scope in.
+     * @param tracer    The htracer to use.  Must remain valid for the
+     *                      duration of the scope.
+     * @param sampler   The sampler to use, or NULL for no sampler.
+     * @param desc      The description of the trace span.  Will be
+     *                      deep-copied.
+     *
+     * @return          The trace scope, which will point into storage.  NULL
+     *                      if we ran out of memory, or if we are not tracing.
+     */
+    struct htrace_scope* htrace_start_span_inplace(
+                        struct htrace_scope_storage *storage,
+                        struct htracer *tracer,
+                        struct htrace_sampler *sampler, const char *desc);
+
+    /**
+     * Start a new trace span if necessary, keeping the scope in memory
+     * provided by the caller, with a description which need not be
+     * NUL-terminated.
+     *
+     * This is just like htrace_start_span_inplace, except that the
+     * description is given as a pointer and a length, so the caller doesn't
+     * have to make a NUL-terminated copy of it.  Embedded NUL bytes make the
+     * description invalid.
+     *
+     * @param storage   The memory to keep the scope in.
+     * @param tracer    The htracer to use.
+     * @param sampler   The sampler to use, or NULL for no sampler.
+     * @param desc      The description of the trace span.  Will be
+     *                      deep-copied.
+     * @param desc_len  The length of desc in bytes.
+     *
+     * @return          The same as htrace_start_span_inplace.
+     */
+    struct htrace_scope* htrace_start_span_inplace_len(
+                        struct htrace_scope_storage *storage,
+                        struct htracer *tracer,
+                        struct htrace_sampler *sampler, const char *desc,
+                        size_t desc_len);
+
+    /**
+     * Start a child of a given span, without using the calling thread's
+     * current scope.
+     *
+     * This is for asynchronous code, where a task may run on any thread and
+     * the thread's stack of scopes means nothing.  The new scope is not put
+     * on any thread's stack, so it doesn't become the parent of spans which
+     * are started in the usual way, and it may be closed from any thread.
+     * No sampler is consulted: the child is created whenever parent is a
+     * valid span ID.
+     *
+     * @param storage   The memory to keep the scope in, or NULL to allocate
+     *                      it.  See htrace_start_span_inplace.
+     * @param tracer    The htracer to use.
+     * @param parent    The span ID of the parent.  If it is all zeroes, the
+     *                      parent was not traced, and no span is created.
+     * @param local_parent  Nonzero if the parent span was started in this
+     *                      process.  Otherwise the new span is treated as
+     *                      the root of its trace here, as far as tail
+     *                      sampling is concerned.
+     * @param desc      The description of the trace span.  Will be
+     *                      deep-copied.
+     *
+     * @return          The trace scope.  NULL if the parent was not traced,
+     *                      the description was invalid, or we ran out of
+     *                      memory.
+     */
+    struct htrace_scope* htrace_start_span_from(
+                        struct htrace_scope_storage *storage,
+                        struct htracer *tracer,
+                        const struct htrace_span_id *parent,
+                        int local_parent, const char *desc);
+
+    /**
+     * Move a trace scope into different caller-provided memory.
+     *
+     * This is for scopes which must change address while they are open, such
+     * as the scopes of C++ htrace::Scope objects which are moved.  The scope
+     * must belong to the calling thread, but need not be the innermost one.
+     * Scopes which are not kept in caller-provided memory don't need to move,
+     * and are returned as they are.
+     *
+     * @param storage   The memory to move the scope to.
+     * @param scope     The trace scope, or NULL.
+     *
+     * @return          The scope at its new address, or NULL if scope was
+     *                      NULL.  On error, NULL is returned and the scope
+     *                      stays where it was.
+     */
+    struct htrace_scope* htrace_scope_move_inplace(
+                        struct htrace_scope_storage *storage,
+                        struct htrace_scope *scope);
+
+    /**
+     * Register a span description with an htracer.
+     *
+     * The description is validated and copied once.  Spans started with
+     * htrace_start_span_desc refer to the registered copy rather than making
+     * their own.  Registering the same string again returns the same handle.
+     *
+     * This is intended for the fixed set of span names a program uses.  The
+     * handles are not freed until the htracer is.
+     *
+     * @param tracer    The htracer to register the description with.
+     * @param desc      The description of the trace span.
+     *
+     * @return          The description handle, valid until the htracer is
+     *                      freed.  NULL if the description was invalid or we
+     *                      ran out of memory.
+     */
+    const struct htrace_desc *htrace_desc_register(struct htracer *tracer,
+                                                   const char *desc);
+
+    /**
+     * Start a new trace span if necessary, using a registered description.
+     *
+     * This is just like htrace_start_span, except that the description does
+     * not need to be validated or copied.
+     *
+     * @param tracer    The htracer to use.  Must remain valid for the
+     *                      duration of the scope.
+     * @param sampler   The sampler to use.
+     * @param desc      A description returned by htrace_desc_register for
+     *                      this tracer.  If this is NULL, no span will be
+     *                      created.
+     *
+     * @return          The trace scope.  NULL if we ran out of memory, or if
+     *                      we are not tracing.
+     */
+    struct htrace_scope* htrace_start_span_desc(struct htracer *tracer,
+                        struct htrace_sampler *sampler,
+                        const struct htrace_desc *desc);
+
+    /**
+     * A span description which is registered with an htracer the first time
+     * it is used.
+     *
+     * This is meant to be a static variable initialized with
+     * HTRACE_NAME_INIT, one for each place that starts a span with a fixed
+     * description.  After the first span, starting another with the same
+     * tracer neither validates nor copies the description, and doesn't take
+     * the lock that htrace_desc_register does.  If the name is used with
+     * more than one tracer, only the first one gets the fast path.
+     *
+     * The fields are private to the library.
+     */
+    struct htrace_name {
+        const char *str;
+        uint64_t serial;
+        const struct htrace_desc *desc;
+        int claimed;
+    };
+
+    /**
+     * Initialize a struct htrace_name.
+     *
+     * @param str       The description.  It should be a string literal,
+     *                      since the name refers to it for as long as the
+     *                      name is used.
+     */
+#define HTRACE_NAME_INIT(str) { (str), 0, NULL, 0 }
+
+    /**
+     * Start a new trace span if necessary, using a struct htrace_name as the
+     * description, and keeping the scope in memory provided by the caller.
+     *
+     * @param storage   The memory to keep the scope in.  See
+     *                      htrace_start_span_inplace.
+     * @param tracer    The htracer to use.
+     * @param sampler   The sampler to use, or NULL for no sampler.
+     * @param name      The description.  If it is not valid, no span will
+     *                      be created.
+     *
+     * @return          The same as htrace_start_span_inplace.
+     */
+    struct htrace_scope* htrace_start_span_name_inplace(
+                        struct htrace_scope_storage *storage,
+                        struct htracer *tracer,
+                        struct htrace_sampler *sampler,
+                        struct htrace_name *name);
+
     /**
      * Detach the trace span from the given trace scope.
      *
@@ -338,13 +1566,15 @@ extern  "C" {
      * Close a trace scope.
      *
      * This must be called from the same thread that the trace scope was created
-     * in.
+     * in, unless it was started with htrace_start_span_from.
      *
      * @param scope     The trace scope to close.  You may pass NULL here
      *                      with no harmful effects-- it will be ignored.
      *                      If there is a span associated with the trace scope,
      *                      it will be sent to the relevant span receiver.
-     *                      Then the scope and the span will be freed.
+     *                      Then the scope and the span will be freed.  For
+     *                      scopes started with htrace_start_span_inplace,
+     *                      the storage may be reused once this returns.
      */
     void htrace_scope_close(struct htrace_scope *scope);
 
@@ -414,6 +1644,152 @@ extern  "C" {
     void htrace_span_id_copy(struct htrace_span_id *dst,
                              const struct htrace_span_id *src);
 
+    /**
+     * Encode a trace context for sending to another process.
+     *
+     * This is a cheaper alternative to htrace_span_id_to_str for RPC
+     * systems which can carry binary metadata.  The far side decodes it with
+     * htrace_context_extract, and usually passes the span ID to
+     * htrace_start_span_from.
+     *
+     * @param id            The span ID, usually from htrace_scope_get_span_id.
+     * @param sampled       Nonzero if the span was sampled.
+     * @param buf           (out param) HTRACE_CONTEXT_LEN bytes to write the
+     *                          context to.
+     */
+    void htrace_context_inject(const struct htrace_span_id *id, int sampled,
+                               uint8_t *buf);
+
+    /**
+     * Decode a trace context made by htrace_context_inject.
+     *
+     * This doesn't allocate memory.  Flags which we don't know about are
+     * ignored.
+     *
+     * @param buf           The encoded context.
+     * @param len           The length of the encoded context.
+     * @param id            (out param) The span ID.  It will be set to the
+     *                          invalid span ID on error.
+     * @param sampled       (out param) Nonzero if the span was sampled.
+     *
+     * @return              0 on success; EINVAL if the context was too short
+     *                          or had an unknown version.
+     */
+    int htrace_context_extract(const uint8_t *buf, size_t len,
+                               struct htrace_span_id *id, int *sampled);
+
+    /**
+     * Encode a trace context in base64, for RPC systems whose metadata must
+     * be text.
+     *
+     * @param id            The span ID.
+     * @param sampled       Nonzero if the span was sampled.
+     * @param str           (out param) HTRACE_CONTEXT_BASE64_LEN + 1 bytes to
+     *                          write the NUL-terminated context to.
+     */
+    void htrace_context_inject_base64(const struct htrace_span_id *id,
+                                      int sampled, char *str);
+
+    /**
+     * Decode a trace context made by htrace_context_inject_base64.
+     *
+     * @param str           The encoded context.  Need not be NUL-terminated.
+     * @param len           The length of the encoded context.
+     * @param id            (out param) The span ID.  It will be set to the
+     *                          invalid span ID on error.
+     * @param sampled       (out param) Nonzero if the span was sampled.
+     *
+     * @return              0 on success; EINVAL if the context was not
+     *                          HTRACE_CONTEXT_BASE64_LEN characters of
+     *                          base64, or had an unknown version.
+     */
+    int htrace_context_extract_base64(const char *str, size_t len,
+                                      struct htrace_span_id *id,
+                                      int *sampled);
+
+    /**
+     * Add a key/value annotation to the span of an HTrace scope.
+     *
+     * The annotation is copied into a buffer which belongs to the span, so
+     * all of a span's annotations and events take a single allocation.
+     *
+     * @param scope     The trace scope, or NULL.
+     * @param key       The key.  Must be valid UTF-8 without double quotes,
+     *                      backslashes, or control characters.
+     * @param val       The value.  The same restrictions apply.
+     *
+     * @return          0 on success, or if there is no scope or the scope has
+     *                      no span.  EINVAL if the key or value was not
+     *                      acceptable.  ENOSPC if the span is full; each span
+     *                      can hold about 64 KB of annotations and events.
+     *                      ENOMEM on OOM.
+     */
+    int htrace_scope_add_kv(struct htrace_scope *scope, const char *key,
+                            const char *val);
+
+    /**
+     * Add a key/value annotation given as pointers and lengths to the span
+     * of an HTrace scope.
+     *
+     * The key and value need not be NUL-terminated.  Otherwise this is the
+     * same as htrace_scope_add_kv.
+     *
+     * @param scope     The trace scope, or NULL.
+     * @param key       The key.
+     * @param key_len   The length of the key in bytes.
+     * @param val       The value.
+     * @param val_len   The length of the value in bytes.
+     *
+     * @return          The same as htrace_scope_add_kv.
+     */
+    int htrace_scope_add_kv_len(struct htrace_scope *scope, const char *key,
+                                size_t key_len, const char *val,
+                                size_t val_len);
+
+    /**
+     * Add a timeline event to the span of an HTrace scope.
+     *
+     * The event is timestamped with the current time.
+     *
+     * @param scope     The trace scope, or NULL.
+     * @param msg       The event message.  Must be valid UTF-8 without double
+     *                      quotes, backslashes, or control characters.
+     *
+     * @return          The same as htrace_scope_add_kv.
+     */
+    int htrace_scope_add_event(struct htrace_scope *scope, const char *msg);
+
+    /**
+     * Add a timeline event given as a pointer and a length to the span of an
+     * HTrace scope.
+     *
+     * @param scope     The trace scope, or NULL.
+     * @param msg       The event message.  Need not be NUL-terminated.
+     * @param msg_len   The length of the message in bytes.
+     *
+     * @return          The same as htrace_scope_add_kv.
+     */
+    int htrace_scope_add_event_len(struct htrace_scope *scope,
+                                   const char *msg, size_t msg_len);
+
+    /**
+     * Add a parent to the span of an HTrace scope.
+     *
+     * This is for spans which join the work of several others, such as a
+     * batch write that merges a few upstream requests.  Adding a parent which
+     * the span already has does nothing.  Up to four parents are stored in
+     * the span itself; more take a separate allocation.
+     *
+     * @param scope     The trace scope, or NULL.
+     * @param parent    The parent span ID.
+     *
+     * @return          0 on success, or if there is no scope or the scope has
+     *                      no span.  EINVAL if the parent ID is the invalid
+     *                      span ID.  ENOMEM on OOM.
+     */
+    int htrace_scope_add_parent(struct htrace_scope *scope,
+                                const struct htrace_span_id *parent);
+
     /**
      * Get the span id of an HTrace scope.
      *
@@ -425,6 +1801,339 @@ extern  "C" {
     void htrace_scope_get_span_id(const struct htrace_scope *scope,
                                   struct htrace_span_id *id);
 
+    /**
+     * Span priorities.
+     */
+#define HTRACE_PRIORITY_NORMAL 0
+#define HTRACE_PRIORITY_HIGH 1
+
+    /**
+     * Set the priority of the span of an HTrace scope.
+     *
+     * When a span receiver runs short of buffer space, it drops
+     * normal-priority spans first, so that high-priority ones still get
+     * through.  Spans start with normal priority, and may be raised to high
+     * priority when they close; see HTRACE_PRIORITY_MIN_DURATION_MS_KEY.
+     *
+     * @param scope     The trace scope, or NULL.
+     * @param priority  HTRACE_PRIORITY_NORMAL or HTRACE_PRIORITY_HIGH.
+     */
+    void htrace_scope_set_priority(struct htrace_scope *scope, int priority);
+
+    /**
+     * Nonzero once any sampler which can start traces has been created in
+     * this process.  It never goes back to zero, since spans may outlive
+     * their samplers.
+     *
+     * Until this is set, there can't be a current span on any thread, so
+     * there is nothing to trace.  Read it with htrace_enabled rather than
+     * directly.
+     */
+    extern int htrace_g_enabled;
+
+    /**
+     * Check whether starting a span could possibly do anything.
+     *
+     * This is a single relaxed load, so it can be inlined in front of
+     * htrace_start_span and friends to make untraced code as cheap as
+     * possible.  If HTRACE_DISABLED is defined, it is the constant 0, and
+     * the compiler can drop the tracing code altogether.
+     *
+     * @return          0 if no span can be started; nonzero if one might be.
+     */
+    static inline int htrace_enabled(void)
+    {
+#ifdef HTRACE_DISABLED
+        return 0;
+#else
+        return __atomic_load_n(&htrace_g_enabled, __ATOMIC_RELAXED);
+#endif
+    }
+
+    /**
+     * Close the scope pointed to by a variable declared with HTRACE_SCOPE.
+     */
+    static inline void htrace_scope_cleanup(struct htrace_scope **scope)
+    {
+        if (*scope) {
+            htrace_scope_close(*scope);
+        }
+    }
+
+    /**
+     * Declare a trace scope which lasts until the end of the enclosing
+     * block.
+     *
+     * This declares a variable named var, of type struct htrace_scope *,
+     * which can be passed to htrace_scope_add_kv and the like.  The scope is
+     * kept on the stack, as with htrace_start_span_inplace, and closed
+     * automatically when var goes out of scope.  Do not close it yourself.
+     *
+     * When htrace_enabled returns 0, the scope is NULL and the library is
+     * not called at all.  Such calls are not counted in the spans_started
+     * statistic.  If HTRACE_DISABLED is defined, the arguments are not even
+     * evaluated.
+     *
+     * @param var       The name of the scope variable to declare.
+     * @param tracer    The htracer to use.
+     * @param sampler   The sampler to use, or NULL for no sampler.
+     * @param desc      The description of the trace span.
+     */
+#ifdef HTRACE_DISABLED
+#define HTRACE_SCOPE(var, tracer, sampler, desc) \
+    struct htrace_scope *var __attribute__((unused)) = \
+        ((void)sizeof(tracer), (void)sizeof(sampler), (void)sizeof(desc), \
+         (struct htrace_scope *)NULL)
+#else
+#define HTRACE_SCOPE(var, tracer, sampler, desc) \
+    struct htrace_scope_storage var##_htrace_storage; \
+    struct htrace_scope *var __attribute__((cleanup(htrace_scope_cleanup))) = \
+        htrace_enabled() ? htrace_start_span_inplace(&var##_htrace_storage, \
+                                (tracer), (sampler), (desc)) : NULL
+#endif
+
+    /**
+     * Like HTRACE_SCOPE, but using a description registered with
+     * htrace_desc_register.  The scope comes from the per-thread scope pool
+     * rather than the stack.
+     */
+#ifdef HTRACE_DISABLED
+#define HTRACE_SCOPE_DESC(var, tracer, sampler, desc) \
+    struct htrace_scope *var __attribute__((unused)) = \
+        ((void)sizeof(tracer), (void)sizeof(sampler), (void)sizeof(desc), \
+         (struct htrace_scope *)NULL)
+#else
+#define HTRACE_SCOPE_DESC(var, tracer, sampler, desc) \
+    struct htrace_scope *var __attribute__((cleanup(htrace_scope_cleanup))) = \
+        htrace_enabled() ? htrace_start_span_desc((tracer), (sampler), \
+                                                  (desc)) : NULL
+#endif
+
+    /**
+     * Like HTRACE_SCOPE, but with a fixed description which is registered
+     * with the tracer on first use.  desc must be a string literal.  See
+     * struct htrace_name.
+     */
+#ifdef HTRACE_DISABLED
+#define HTRACE_SCOPE_NAME(var, tracer, sampler, desc) \
+    struct htrace_scope *var __attribute__((unused)) = \
+        ((void)sizeof(tracer), (void)sizeof(sampler), (void)sizeof(desc), \
+         (struct htrace_scope *)NULL)
+#else
+#define HTRACE_SCOPE_NAME(var, tracer, sampler, desc) \
+    static struct htrace_name var##_htrace_name = HTRACE_NAME_INIT(desc); \
+    struct htrace_scope_storage var##_htrace_storage; \
+    struct htrace_scope *var __attribute__((cleanup(htrace_scope_cleanup))) = \
+        htrace_enabled() ? htrace_start_span_name_inplace( \
+                                &var##_htrace_storage, (tracer), (sampler), \
+                                &var##_htrace_name) : NULL
+#endif
+
+    /**
+     * A reader for streams of msgpack-serialized spans, such as the contents
+     * of a shm ring or of a WriteSpans request.
+     *
+     * The reader does not allocate anything per span.  The spans it returns
+     * are views which point into the buffer being read.
+     */
+    struct htrace_span_reader;
+
+    /**
+     * A span in a buffer being read by an htrace_span_reader.
+     *
+     * The strings are not NUL-terminated, and only stay valid as long as the
+     * buffer does.
+     */
+    struct htrace_span_view {
+        /**
+         * The span ID.
+         */
+        struct htrace_span_id span_id;
+
+        /**
+         * The description, and its length.
+         */
+        const char *desc;
+        uint32_t desc_len;
+
+        /**
+         * The tracer ID and its length, or NULL and 0 if there was none.
+         */
+        const char *trid;
+        uint32_t trid_len;
+
+        /**
+         * The begin and end times, in milliseconds since the epoch.
+         */
+        uint64_t begin_ms;
+        uint64_t end_ms;
+
+        /**
+         * 0 if the span only has millisecond timestamps; 1 if begin_precise
+         * and end_precise are in microseconds since the epoch; 2 if they are
+         * in nanoseconds since the epoch.
+         */
+        int ts_precision;
+        uint64_t begin_precise;
+        uint64_t end_precise;
+
+        /**
+         * 0 if the span has no CPU use fields; 1 if cpu_ns is set; 2 if the
+         * voluntary and involuntary context switch counts are set too.  See
+         * HTRACE_SPAN_CPU_KEY.
+         */
+        int cpu;
+        uint64_t cpu_ns;
+        uint64_t vol_csw;
+        uint64_t invol_csw;
+
+        /**
+         * The number of parents, annotations, and timeline events.  Use the
+         * htrace_span_view iterators to get at them.
+         */
+        uint32_t num_parents;
+        uint32_t num_kvs;
+        uint32_t num_events;
+
+        /**
+         * The serialized parents, annotations, and events.  Private.
+         */
+        const uint8_t *parents;
+        const uint8_t *kvs;
+        const uint8_t *events;
+        const uint8_t *end;
+    };
+
+    /**
+     * An iterator over the parents, annotations, or timeline events of a
+     * span view.  The fields are private.
+     */
+    struct htrace_span_view_iter {
+        const uint8_t *pos;
+        const uint8_t *end;
+        uint32_t left;
+    };
+
+    /**
+     * Create a reader over a buffer of serialized spans.
+     *
+     * @param buf       The buffer.  It is not copied, and must outlive the
+     *                      reader and the views it returns.
+     * @param len       The length of the buffer.
+     *
+     * @return          The reader, or NULL on OOM.
+     */
+    struct htrace_span_reader *htrace_span_reader_alloc(const void *buf,
+                                                        size_t len);
+
+    /**
+     * Create a reader over a file of serialized spans.  The file is mapped
+     * into memory, and unmapped when the reader is freed.
+     *
+     * @param path      The path of the file.
+     * @param err       (out param) A buffer for an error message, if we
+     *                      fail.
+     * @param err_len   The length of the err buffer.
+     *
+     * @return          The reader, or NULL on error.
+     */
+    struct htrace_span_reader *htrace_span_reader_open(const char *path,
+                                    char *err, size_t err_len);
+
+    /**
+     * Read the next span.
+     *
+     * @param rd        The reader.
+     * @param view      (out param) The span.
+     *
+     * @return          1 if a span was read; 0 at the end of the buffer;
+     *                      -1 if the next span could not be parsed.  See
+     *                      htrace_span_reader_error.
+     */
+    int htrace_span_reader_next(struct htrace_span_reader *rd,
+                                struct htrace_span_view *view);
+
+    /**
+     * Get the reason why htrace_span_reader_next failed.
+     *
+     * @param rd        The reader.
+     *
+     * @return          The error message, or the empty string if there was
+     *                      no error.  Valid until the reader is freed.
+     */
+    const char *htrace_span_reader_error(const struct htrace_span_reader *rd);
+
+    /**
+     * Get the offset in the buffer of the next span to be read.
+     *
+     * @param rd        The reader.
+     *
+     * @return          The offset.
+     */
+    size_t htrace_span_reader_offset(const struct htrace_span_reader *rd);
+
+    /**
+     * Free a span reader.
+     *
+     * @param rd        The reader, or NULL.
+     */
+    void htrace_span_reader_free(struct htrace_span_reader *rd);
+
+    /**
+     * Start iterating over the parents, annotations, or events of a span
+     * view.  Use the matching htrace_span_view_next_* function with the
+     * iterator.
+     *
+     * @param view      The span view.
+     * @param it        (out param) The iterator.
+     */
+    void htrace_span_view_parents(const struct htrace_span_view *view,
+                                  struct htrace_span_view_iter *it);
+    void htrace_span_view_kvs(const struct htrace_span_view *view,
+                              struct htrace_span_view_iter *it);
+    void htrace_span_view_events(const struct htrace_span_view *view,
+                                 struct htrace_span_view_iter *it);
+
+    /**
+     * Get the next parent of a span view.
+     *
+     * @param it        An iterator from htrace_span_view_parents.
+     * @param id        (out param) The parent's span ID.
+     *
+     * @return          1 if there was another parent; 0 otherwise.
+     */
+    int htrace_span_view_next_parent(struct htrace_span_view_iter *it,
+                                     struct htrace_span_id *id);
+
+    /**
+     * Get the next key/value annotation of a span view.
+     *
+     * @param it        An iterator from htrace_span_view_kvs.
+     * @param key       (out param) The key.
+     * @param key_len   (out param) The length of the key.
+     * @param val       (out param) The value.
+     * @param val_len   (out param) The length of the value.
+     *
+     * @return          1 if there was another annotation; 0 otherwise.
+     */
+    int htrace_span_view_next_kv(struct htrace_span_view_iter *it,
+                                 const char **key, uint32_t *key_len,
+                                 const char **val, uint32_t *val_len);
+
+    /**
+     * Get the next timeline event of a span view.
+     *
+     * @param it        An iterator from htrace_span_view_events.
+     * @param time_ms   (out param) The time of the event.
+     * @param msg       (out param) The message.
+     * @param msg_len   (out param) The length of the message.
+     *
+     * @return          1 if there was another event; 0 otherwise.
+     */
+    int htrace_span_view_next_event(struct htrace_span_view_iter *it,
+                                    uint64_t *time_ms, const char **msg,
+                                    uint32_t *msg_len);
+
 #pragma GCC visibility pop // End publicly visible symbols
 
 #ifdef __cplusplus
@@ -22,6 +22,9 @@
 #include "htrace.h"
 
 #include <string>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 /**
  * The public C++ API for the HTrace native client.
@@ -40,11 +43,17 @@
  * fine.
  *
  * C++11
- * This code should not require C++11.  We might add #ifdefs later to take
- * advantage of certain C++11 or later features if they are available.
+ * This code should not require C++11.  When it is available, Conf, Tracer,
+ * Sampler, and Scope can be moved, so they can be returned from factory
+ * functions and kept in containers.  C++17 adds std::string_view overloads
+ * wherever a string is copied into a span.  Those, and the overloads which
+ * take a pointer and a length, go straight to the length-aware C API without
+ * making a NUL-terminated copy.  HTRACE_NAME checks span descriptions at
+ * compile time.
  */
 
 namespace htrace {
+  class Context;
   class Sampler;
   class Scope;
   class Tracer;
@@ -144,6 +153,8 @@ namespace htrace {
     }
 
   private:
+    friend class Context;
+    friend class Scope;
     struct htrace_span_id id_;
   };
 
@@ -187,6 +198,14 @@ namespace htrace {
       }
     }
 
+#if __cplusplus >= 201103L
+    Conf(Conf &&other) noexcept
+      : conf_(other.conf_)
+    {
+      other.conf_ = NULL;
+    }
+#endif
+
     ~Conf() {
       htrace_conf_free(conf_);
       conf_ = NULL;
@@ -225,10 +244,43 @@ namespace htrace {
       }
     }
 
+    Tracer(const char *name, const Conf &conf)
+      : tracer_(htracer_create(name, conf.conf_))
+    {
+      if (!tracer_) {
+        throw std::bad_alloc();
+      }
+    }
+
+#if __cplusplus >= 201103L
+    Tracer(Tracer &&other) noexcept
+      : tracer_(other.tracer_)
+    {
+      other.tracer_ = NULL;
+    }
+#endif
+
     std::string Name() {
       return std::string(htracer_tname(tracer_));
     }
 
+    /**
+     * Get statistics about this Tracer and its span receiver.
+     */
+    void GetStats(struct htrace_stats *stats) {
+      htracer_get_stats(tracer_, stats);
+    }
+
+    /**
+     * Apply a new configuration to this Tracer and the Samplers created for
+     * it.  See htracer_update_conf.
+     *
+     * @return        0 on success; an error number otherwise.
+     */
+    int UpdateConf(const Conf &conf) {
+      return htracer_update_conf(tracer_, conf.conf_);
+    }
+
     /**
      * Free the Tracer.
      *
@@ -280,6 +332,14 @@ namespace htrace {
       }
     }
 
+#if __cplusplus >= 201103L
+    Sampler(Sampler &&other) noexcept
+      : smp_(other.smp_)
+    {
+      other.smp_ = NULL;
+    }
+#endif
+
     /**
      * Get a description of this Sampler.
      */
@@ -288,8 +348,10 @@ namespace htrace {
     }
 
     ~Sampler() {
-      htrace_sampler_free(smp_);
-      smp_ = NULL;
+      if (smp_) {
+        htrace_sampler_free(smp_);
+        smp_ = NULL;
+      }
     }
 
   private:
@@ -301,27 +363,260 @@ namespace htrace {
     struct htrace_sampler *smp_;
   };
 
+  /**
+   * The position of a span in its trace, which can be copied into a
+   * continuation and used to start child spans on whichever thread that
+   * runs on.
+   *
+   * A Context is a plain value.  It doesn't refer to the Scope it came
+   * from, and it can outlive that Scope.  An empty Context is not part of
+   * any trace, so spans started from it are not created.
+   */
+  class Context {
+  public:
+    Context()
+      : local_(false) {
+    }
+
+    /**
+     * Make a Context for a span started somewhere else, such as in another
+     * process.
+     */
+    explicit Context(const SpanId &id)
+      : id_(id), local_(false) {
+    }
+
+    SpanId GetSpanId() const {
+      return id_;
+    }
+
+    /**
+     * Whether the span this Context refers to was traced.  If not, spans
+     * started from the Context are not traced either.
+     */
+    bool IsSampled() const {
+      return (id_.id_.high != 0) || (id_.id_.low != 0);
+    }
+
+    /**
+     * Encode the Context for sending to another process.  See
+     * htrace_context_inject.
+     *
+     * @param buf               HTRACE_CONTEXT_LEN bytes to write to.
+     */
+    void Inject(uint8_t *buf) const {
+      htrace_context_inject(&id_.id_, IsSampled(), buf);
+    }
+
+    /**
+     * Encode the Context as base64 text.
+     */
+    std::string InjectBase64() const {
+      char str[HTRACE_CONTEXT_BASE64_LEN + 1];
+      htrace_context_inject_base64(&id_.id_, IsSampled(), str);
+      return std::string(str);
+    }
+
+    /**
+     * Decode a Context sent by another process.  A context which was not
+     * sampled there gives an empty Context.
+     *
+     * @return                  true on success; false if the context could
+     *                          not be decoded, in which case the Context is
+     *                          left empty.
+     */
+    bool Extract(const uint8_t *buf, size_t len) {
+      int sampled;
+      int ret = htrace_context_extract(buf, len, &id_.id_, &sampled);
+      local_ = false;
+      if (!sampled) {
+        id_.Clear();
+      }
+      return (ret == 0);
+    }
+
+    bool ExtractBase64(const std::string &str) {
+      int sampled;
+      int ret = htrace_context_extract_base64(str.data(), str.size(),
+                                              &id_.id_, &sampled);
+      local_ = false;
+      if (!sampled) {
+        id_.Clear();
+      }
+      return (ret == 0);
+    }
+
+  private:
+    friend class Scope;
+
+    Context(const struct htrace_span_id *id, bool local)
+      : id_(id), local_(local) {
+    }
+
+    SpanId id_;
+    bool local_;
+  };
+
+  /**
+   * A fixed span description, registered with the tracer the first time a
+   * Scope uses it.  See struct htrace_name.
+   *
+   * SpanName objects should be static, and are usually made with
+   * HTRACE_NAME.  The string must outlive the SpanName, as a literal does.
+   */
+  class SpanName {
+  public:
+#if __cplusplus >= 201103L
+    constexpr explicit SpanName(const char *str)
+      : name_{str, 0, NULL, 0} {
+    }
+
+    /**
+     * Check at compile time that a description is one that the library
+     * will accept: printable ASCII other than double quotes and
+     * backslashes, and 2- and 3-byte UTF-8 sequences.
+     *
+     * @param str     The description.
+     * @param len     The length of the description.
+     */
+    static constexpr bool Valid(const char *str, size_t len) {
+      return (len == 0) ? true :
+          Plain(str[0]) ? Valid(str + 1, len - 1) :
+          (Utf8Len(str, len) != 0) ?
+              Valid(str + Utf8Len(str, len), len - Utf8Len(str, len)) :
+          false;
+    }
+#else
+    explicit SpanName(const char *str) {
+      name_.str = str;
+      name_.serial = 0;
+      name_.desc = NULL;
+      name_.claimed = 0;
+    }
+#endif
+
+  private:
+    friend class Scope;
+    SpanName(const SpanName &other); // Can't copy
+    SpanName &operator=(const SpanName &other);
+
+#if __cplusplus >= 201103L
+    static constexpr bool Plain(char c) {
+      return (c >= 0x20) && (c <= 0x7e) && (c != '"') && (c != '\\');
+    }
+
+    static constexpr unsigned Byte(const char *str, size_t i) {
+      return static_cast<unsigned char>(str[i]);
+    }
+
+    static constexpr bool Cont(unsigned b) {
+      return (0x80 <= b) && (b <= 0xbf);
+    }
+
+    static constexpr size_t Utf8Len(const char *s, size_t len) {
+      return ((len >= 2) && (0xc2 <= Byte(s, 0)) && (Byte(s, 0) <= 0xdf) &&
+              Cont(Byte(s, 1))) ? 2 :
+          ((len >= 3) && Cont(Byte(s, 2)) && (
+              ((Byte(s, 0) == 0xe0) &&
+                  (0xa0 <= Byte(s, 1)) && (Byte(s, 1) <= 0xbf)) ||
+              (((0xe1 <= Byte(s, 0) && Byte(s, 0) <= 0xec) ||
+                  (Byte(s, 0) == 0xee) || (Byte(s, 0) == 0xef)) &&
+                  Cont(Byte(s, 1))) ||
+              ((Byte(s, 0) == 0xed) &&
+                  (0x80 <= Byte(s, 1)) && (Byte(s, 1) <= 0x9f)))) ? 3 : 0;
+    }
+#endif
+
+    struct htrace_name name_;
+  };
+
+  /**
+   * A trace scope.  The scope object itself lives inside the Scope, so
+   * creating one doesn't allocate memory for it.
+   *
+   * The constructors check htrace_enabled before calling into the library,
+   * so a Scope costs one branch when nothing can be traced, and nothing at
+   * all when HTRACE_DISABLED is defined.
+   *
+   * A moved Scope takes the open span with it; the Scope it was moved from
+   * is left empty.  Scopes must still be closed in the reverse of the order
+   * in which they were opened, wherever they have been moved to.
+   */
   class Scope {
   public:
     Scope(Tracer &tracer, const char *name)
-      : scope_(htrace_start_span(tracer.tracer_, NULL, name)) {
+      : scope_(Start(tracer.tracer_, NULL, name)) {
+    }
+
+    Scope(Tracer &tracer, const char *name, size_t len)
+      : scope_(Start(tracer.tracer_, NULL, name, len)) {
     }
 
     Scope(Tracer &tracer, const std::string &name)
-      : scope_(htrace_start_span(tracer.tracer_, NULL, name.c_str())) {
+      : scope_(Start(tracer.tracer_, NULL, name.data(), name.size())) {
     }
 
     Scope(Tracer &tracer, Sampler &smp, const char *name)
-      : scope_(htrace_start_span(tracer.tracer_, smp.smp_, name)) {
+      : scope_(Start(tracer.tracer_, smp.smp_, name)) {
+    }
+
+    Scope(Tracer &tracer, Sampler &smp, const char *name, size_t len)
+      : scope_(Start(tracer.tracer_, smp.smp_, name, len)) {
     }
 
     Scope(Tracer &tracer, Sampler &smp, const std::string &name)
-      : scope_(htrace_start_span(tracer.tracer_, smp.smp_, name.c_str())) {
+      : scope_(Start(tracer.tracer_, smp.smp_, name.data(), name.size())) {
     }
 
+    Scope(Tracer &tracer, SpanName &name)
+      : scope_(Start(tracer.tracer_, NULL, &name.name_)) {
+    }
+
+    Scope(Tracer &tracer, Sampler &smp, SpanName &name)
+      : scope_(Start(tracer.tracer_, smp.smp_, &name.name_)) {
+    }
+
+    /**
+     * Start a child of the span a Context refers to.  This neither looks at
+     * nor changes the calling thread's current scope.  The Scope may be
+     * destroyed on a different thread from the one which created it.
+     */
+    Scope(Tracer &tracer, const Context &parent, const char *name)
+      : scope_(StartFrom(tracer.tracer_, parent, name)) {
+    }
+
+    Scope(Tracer &tracer, const Context &parent, const std::string &name)
+      : scope_(StartFrom(tracer.tracer_, parent, name.c_str())) {
+    }
+
+#if __cplusplus >= 201703L
+    Scope(Tracer &tracer, std::string_view name)
+      : scope_(Start(tracer.tracer_, NULL, name.data(), name.size())) {
+    }
+
+    Scope(Tracer &tracer, Sampler &smp, std::string_view name)
+      : scope_(Start(tracer.tracer_, smp.smp_, name.data(), name.size())) {
+    }
+#endif
+
+#if __cplusplus >= 201103L
+    Scope(Scope &&other) noexcept
+      : scope_(NULL)
+    {
+      if (other.scope_) {
+        scope_ = htrace_scope_move_inplace(&storage_, other.scope_);
+        if (scope_) {
+          other.scope_ = NULL;
+        }
+      }
+    }
+#endif
+
     ~Scope() {
-      htrace_scope_close(scope_);
-      scope_ = NULL;
+      if (scope_) {
+        htrace_scope_close(scope_);
+        scope_ = NULL;
+      }
     }
 
     SpanId GetSpanId() const {
@@ -330,15 +625,123 @@ namespace htrace {
       return SpanId(&id);
     }
 
+    /**
+     * Get a Context which children of this Scope's span can be started
+     * from.  If the Scope has no span, the Context is empty.
+     */
+    Context GetContext() const {
+      htrace_span_id id;
+      htrace_scope_get_span_id(scope_, &id);
+      return Context(&id, true);
+    }
+
+    int AddKv(const char *key, const char *val) {
+      return htrace_scope_add_kv(scope_, key, val);
+    }
+
+    int AddKv(const char *key, size_t key_len,
+              const char *val, size_t val_len) {
+      return htrace_scope_add_kv_len(scope_, key, key_len, val, val_len);
+    }
+
+    int AddKv(const std::string &key, const std::string &val) {
+      return htrace_scope_add_kv_len(scope_, key.data(), key.size(),
+                                     val.data(), val.size());
+    }
+
+    int AddEvent(const char *msg) {
+      return htrace_scope_add_event(scope_, msg);
+    }
+
+    void SetPriority(int priority) {
+      htrace_scope_set_priority(scope_, priority);
+    }
+
+    int AddEvent(const char *msg, size_t len) {
+      return htrace_scope_add_event_len(scope_, msg, len);
+    }
+
+    int AddEvent(const std::string &msg) {
+      return htrace_scope_add_event_len(scope_, msg.data(), msg.size());
+    }
+
+#if __cplusplus >= 201703L
+    int AddKv(std::string_view key, std::string_view val) {
+      return htrace_scope_add_kv_len(scope_, key.data(), key.size(),
+                                     val.data(), val.size());
+    }
+
+    int AddEvent(std::string_view msg) {
+      return htrace_scope_add_event_len(scope_, msg.data(), msg.size());
+    }
+#endif
+
+    int AddParent(const SpanId &parent) {
+      return htrace_scope_add_parent(scope_, &parent.id_);
+    }
+
   private:
     friend class Tracer;
     Scope(htrace::Scope &other); // Can't copy
     Scope& operator=(Scope &scope); // Can't assign
 
+    struct htrace_scope *Start(struct htracer *tracer,
+                               struct htrace_sampler *smp, const char *name) {
+      if (!htrace_enabled()) {
+        return NULL;
+      }
+      return htrace_start_span_inplace(&storage_, tracer, smp, name);
+    }
+
+    struct htrace_scope *Start(struct htracer *tracer,
+                               struct htrace_sampler *smp, const char *name,
+                               size_t len) {
+      if (!htrace_enabled()) {
+        return NULL;
+      }
+      return htrace_start_span_inplace_len(&storage_, tracer, smp, name, len);
+    }
+
+    struct htrace_scope *StartFrom(struct htracer *tracer,
+                                   const Context &parent, const char *name) {
+      if (!parent.IsSampled()) {
+        return NULL;
+      }
+      return htrace_start_span_from(&storage_, tracer, &parent.id_.id_,
+                                    parent.local_, name);
+    }
+
+    struct htrace_scope *Start(struct htracer *tracer,
+                               struct htrace_sampler *smp,
+                               struct htrace_name *name) {
+      if (!htrace_enabled()) {
+        return NULL;
+      }
+      return htrace_start_span_name_inplace(&storage_, tracer, smp, name);
+    }
+
+    struct htrace_scope_storage storage_;
     struct htrace_scope *scope_;
   };
 }
 
+#if __cplusplus >= 201103L
+/**
+ * Get the htrace::SpanName for a string literal, checking at compile time
+ * that it is a valid description.  Each use of the macro has its own
+ * static SpanName, so it costs nothing after the first span.
+ *
+ *   htrace::Scope scope(tracer, sampler, HTRACE_NAME("ReadBlock"));
+ */
+#define HTRACE_NAME(str) \
+  ([]() -> ::htrace::SpanName & { \
+    static_assert(::htrace::SpanName::Valid(str, sizeof(str) - 1), \
+                  "invalid span description: " str); \
+    static ::htrace::SpanName name_(str); \
+    return name_; \
+  }())
+#endif
+
 #endif
 
 // vim: ts=2:sw=2:et
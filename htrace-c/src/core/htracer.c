@@ -16,27 +16,179 @@
  * limitations under the License.
  */
 
+#include "core/batch.h"
 #include "core/conf.h"
+#include "core/desc.h"
 #include "core/htrace.h"
 #include "core/htracer.h"
 #include "core/scope.h"
 #include "core/span.h"
+#include "core/tail.h"
 #include "receiver/receiver.h"
+#include "sampler/sampler.h"
+#include "util/alloc.h"
+#include "util/build.h"
 #include "util/log.h"
 #include "util/rand.h"
 #include "util/string.h"
+#include "util/time.h"
 #include "util/tracer_id.h"
 
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 
 /**
  * @file htracer.c
  *
  * Implementation of the Tracer object.
+ *
+ * Each thread's current scope is stored per tracer.  When the compiler
+ * supports __thread, each tracer is given a slot in a small per-thread array
+ * of current scopes, so finding the current scope is a single load.  Tracers
+ * created when all the slots are taken, and all tracers on platforms without
+ * __thread, use a pthread key instead.
+ *
+ * A slot is reused once its tracer is freed.  This is safe because a tracer
+ * must not be freed while any thread has an open scope on it, so every
+ * thread's entry for the slot will be NULL by then.
+ */
+
+#ifdef HAVE_IMPROVED_TLS
+/**
+ * The number of tracers which can use __thread storage at once.
+ */
+#define HTRACER_TLS_SLOTS 16
+
+static __thread struct htrace_scope *t_cur_scope[HTRACER_TLS_SLOTS];
+
+/**
+ * Protects g_tls_slots_used.
+ */
+static pthread_mutex_t g_tls_slot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * A bitmap of the slots in t_cur_scope which belong to a tracer.
+ */
+static uint32_t g_tls_slots_used;
+#endif
+
+/**
+ * The serial number of the last htracer created.
+ */
+static uint64_t g_htracer_serial;
+
+static const char * const HTRACE_TS_PRECISION_NAMES[] = {
+    "ms",
+    "us",
+    "ns",
+};
+
+static enum htrace_ts_precision htracer_get_ts_precision(
+                struct htrace_log *lg, const struct htrace_conf *cnf)
+{
+    const char *val;
+    int i;
+
+    val = htrace_conf_get(cnf, HTRACE_TIMESTAMP_PRECISION_KEY);
+    for (i = 0; i <= HTRACE_TS_PRECISION_NS; i++) {
+        if (val && !strcmp(val, HTRACE_TS_PRECISION_NAMES[i])) {
+            return i;
+        }
+    }
+    htrace_log(lg, "htracer_create: unknown value for %s: '%s'.  "
+               "Using %s instead.\n", HTRACE_TIMESTAMP_PRECISION_KEY,
+               (val ? val : "(null)"),
+               HTRACE_TS_PRECISION_NAMES[HTRACE_TS_PRECISION_MS]);
+    return HTRACE_TS_PRECISION_MS;
+}
+
+static const char * const HTRACE_SPAN_CPU_NAMES[] = {
+    "off",
+    "time",
+    "rusage",
+};
+
+static enum htrace_span_cpu htracer_get_span_cpu(
+                struct htrace_log *lg, const struct htrace_conf *cnf)
+{
+    const char *val;
+    int i;
+
+    val = htrace_conf_get(cnf, HTRACE_SPAN_CPU_KEY);
+    for (i = 0; i <= HTRACE_SPAN_CPU_RUSAGE; i++) {
+        if (val && !strcmp(val, HTRACE_SPAN_CPU_NAMES[i])) {
+            break;
+        }
+    }
+    if (i > HTRACE_SPAN_CPU_RUSAGE) {
+        htrace_log(lg, "htracer_create: unknown value for %s: '%s'.  "
+                   "Using %s instead.\n", HTRACE_SPAN_CPU_KEY,
+                   (val ? val : "(null)"),
+                   HTRACE_SPAN_CPU_NAMES[HTRACE_SPAN_CPU_OFF]);
+        return HTRACE_SPAN_CPU_OFF;
+    }
+#ifndef RUSAGE_THREAD
+    if (i == HTRACE_SPAN_CPU_RUSAGE) {
+        htrace_log(lg, "htracer_create: %s=%s is not supported on this "
+                   "platform.  Using %s instead.\n", HTRACE_SPAN_CPU_KEY,
+                   val, HTRACE_SPAN_CPU_NAMES[HTRACE_SPAN_CPU_TIME]);
+        return HTRACE_SPAN_CPU_TIME;
+    }
+#endif
+    return i;
+}
+
+/**
+ * Claim a slot in the per-thread current scope array.
+ *
+ * @return          The slot, or -1 if there are none left.
+ */
+static int htracer_tls_slot_alloc(void)
+{
+#ifdef HAVE_IMPROVED_TLS
+    int slot;
+
+    pthread_mutex_lock(&g_tls_slot_lock);
+    for (slot = 0; slot < HTRACER_TLS_SLOTS; slot++) {
+        if (!(g_tls_slots_used & (1U << slot))) {
+            g_tls_slots_used |= (1U << slot);
+            pthread_mutex_unlock(&g_tls_slot_lock);
+            return slot;
+        }
+    }
+    pthread_mutex_unlock(&g_tls_slot_lock);
+#endif
+    return -1;
+}
+
+static void htracer_tls_slot_free(int slot)
+{
+#ifdef HAVE_IMPROVED_TLS
+    pthread_mutex_lock(&g_tls_slot_lock);
+    g_tls_slots_used &= ~(1U << slot);
+    pthread_mutex_unlock(&g_tls_slot_lock);
+#endif
+}
+
+/**
+ * Set the current scope of this thread.
+ *
+ * @return          0 on success; the error code otherwise.
  */
+static int htracer_set_cur_scope(struct htracer *tracer,
+                                 struct htrace_scope *scope)
+{
+#ifdef HAVE_IMPROVED_TLS
+    if (tracer->tls_slot >= 0) {
+        t_cur_scope[tracer->tls_slot] = scope;
+        return 0;
+    }
+#endif
+    return pthread_setspecific(tracer->tls, scope);
+}
 
 struct htracer *htracer_create(const char *tname,
                                const struct htrace_conf *cnf)
@@ -44,23 +196,40 @@ struct htracer *htracer_create(const char *tname,
     struct htracer *tracer;
     int ret;
 
-    tracer = calloc(1, sizeof(*tracer));
+    tracer = htrace_calloc(1, sizeof(*tracer));
     if (!tracer) {
         return NULL;
     }
+    tracer->serial = __atomic_add_fetch(&g_htracer_serial, 1,
+                                        __ATOMIC_RELAXED);
     tracer->lg = htrace_log_alloc(cnf);
     if (!tracer->lg) {
-        free(tracer);
+        htrace_free(tracer);
         return NULL;
     }
-    ret = pthread_key_create(&tracer->tls, NULL);
+    ret = pthread_mutex_init(&tracer->desc_lock, NULL);
     if (ret) {
-        htrace_log(tracer->lg, "htracer_create: pthread_key_create "
+        htrace_log(tracer->lg, "htracer_create: pthread_mutex_init "
                    "failed: %s.\n", terror(ret));
         htrace_log_free(tracer->lg);
+        htrace_free(tracer);
         return NULL;
     }
-    tracer->tname = strdup(tname);
+    pthread_mutex_init(&tracer->smp_lock, NULL);
+    tracer->tls_slot = htracer_tls_slot_alloc();
+    if (tracer->tls_slot < 0) {
+        ret = pthread_key_create(&tracer->tls, NULL);
+        if (ret) {
+            htrace_log(tracer->lg, "htracer_create: pthread_key_create "
+                       "failed: %s.\n", terror(ret));
+            pthread_mutex_destroy(&tracer->smp_lock);
+            pthread_mutex_destroy(&tracer->desc_lock);
+            htrace_log_free(tracer->lg);
+            htrace_free(tracer);
+            return NULL;
+        }
+    }
+    tracer->tname = htrace_strdup(tname);
     if (!tracer->tname) {
         htrace_log(tracer->lg, "htracer_create: failed to "
                    "duplicate name string.\n");
@@ -88,6 +257,19 @@ struct htracer *htracer_create(const char *tname,
         htracer_free(tracer);
         return NULL;
     }
+    tracer->clk = htrace_clock_alloc(tracer->lg, cnf);
+    if (!tracer->clk) {
+        htrace_log(tracer->lg, "htracer_create: failed to "
+                   "allocate a clock.\n");
+        htracer_free(tracer);
+        return NULL;
+    }
+    tracer->ts_precision = htracer_get_ts_precision(tracer->lg, cnf);
+    tracer->span_cpu = htracer_get_span_cpu(tracer->lg, cnf);
+    tracer->self_stats = htrace_conf_get_bool(tracer->lg, cnf,
+                                              HTRACE_SELF_STATS_KEY);
+    tracer->priority_min_duration_ms = htrace_conf_get_u64(tracer->lg, cnf,
+                                        HTRACE_PRIORITY_MIN_DURATION_MS_KEY);
     tracer->rcv = htrace_rcv_create(tracer, cnf);
     if (!tracer->rcv) {
         htrace_log(tracer->lg, "htracer_create: failed to "
@@ -95,6 +277,25 @@ struct htracer *htracer_create(const char *tname,
         htracer_free(tracer);
         return NULL;
     }
+    if (tracer->rcv->ty->add_spans && (htrace_conf_get_u64(tracer->lg,
+                cnf, HTRACE_BATCH_SIZE_KEY) > 1)) {
+        tracer->batcher = htrace_batcher_create(tracer, cnf);
+        if (!tracer->batcher) {
+            htrace_log(tracer->lg, "htracer_create: failed to "
+                       "create the span batcher.\n");
+            htracer_free(tracer);
+            return NULL;
+        }
+    }
+    if (htrace_conf_get_bool(tracer->lg, cnf, HTRACE_TAIL_SAMPLING_KEY)) {
+        tracer->tail = htrace_tail_create(tracer, cnf);
+        if (!tracer->tail) {
+            htrace_log(tracer->lg, "htracer_create: failed to "
+                       "create the tail sampler.\n");
+            htracer_free(tracer);
+            return NULL;
+        }
+    }
     return tracer;
 }
 
@@ -110,20 +311,108 @@ void htracer_free(struct htracer *tracer)
     if (!tracer) {
         return;
     }
-    pthread_key_delete(tracer->tls);
+    if (tracer->tls_slot >= 0) {
+        htracer_tls_slot_free(tracer->tls_slot);
+    } else {
+        pthread_key_delete(tracer->tls);
+    }
+    htrace_tail_free(tracer->tail);
+    htrace_batcher_free(tracer->batcher);
     rcv = tracer->rcv;
     if (rcv) {
         rcv->ty->free(rcv);
     }
     random_src_free(tracer->rnd);
-    free(tracer->tname);
-    free(tracer->trid);
+    htrace_clock_free(tracer->clk);
+    htrace_desc_table_free(tracer->descs);
+    pthread_mutex_destroy(&tracer->smp_lock);
+    pthread_mutex_destroy(&tracer->desc_lock);
+    htrace_free(tracer->tname);
+    htrace_free(tracer->trid);
     htrace_log_free(tracer->lg);
-    free(tracer);
+    htrace_free(tracer);
+}
+
+void htracer_get_stats(struct htracer *tracer, struct htrace_stats *stats)
+{
+    struct htrace_rcv *rcv = tracer->rcv;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->spans_started =
+        __atomic_load_n(&tracer->ctrs.spans_started, __ATOMIC_RELAXED);
+    stats->spans_sampled =
+        __atomic_load_n(&tracer->ctrs.spans_sampled, __ATOMIC_RELAXED);
+    stats->spans_closed =
+        __atomic_load_n(&tracer->ctrs.spans_closed, __ATOMIC_RELAXED);
+    stats->dropped_invalid =
+        __atomic_load_n(&tracer->ctrs.dropped_invalid, __ATOMIC_RELAXED);
+    stats->dropped_oom =
+        __atomic_load_n(&tracer->ctrs.dropped_oom, __ATOMIC_RELAXED);
+    stats->self_start_span_ns =
+        __atomic_load_n(&tracer->ctrs.self_start_span_ns, __ATOMIC_RELAXED);
+    stats->self_scope_close_ns =
+        __atomic_load_n(&tracer->ctrs.self_scope_close_ns, __ATOMIC_RELAXED);
+    if (tracer->tail) {
+        htrace_tail_get_stats(tracer->tail, stats);
+    }
+    if (rcv->ty->get_stats) {
+        rcv->ty->get_stats(rcv, stats);
+    }
+}
+
+int htracer_update_conf(struct htracer *tracer,
+                        const struct htrace_conf *cnf)
+{
+    struct htrace_rcv *rcv = tracer->rcv;
+    int ret = 0;
+
+    __atomic_store_n(&tracer->priority_min_duration_ms,
+                     htrace_conf_get_u64(tracer->lg, cnf,
+                                HTRACE_PRIORITY_MIN_DURATION_MS_KEY),
+                     __ATOMIC_RELAXED);
+    htrace_samplers_update_conf(tracer, cnf);
+    if (rcv->ty->update_conf) {
+        ret = rcv->ty->update_conf(rcv, cnf);
+    }
+    htrace_log(tracer->lg, "htracer_update_conf: updated the configuration "
+               "of tracer %s%s.\n", tracer->tname,
+               (ret ? ", but the span receiver failed to update" : ""));
+    return ret;
+}
+
+int htracer_dump_flight_recorder(struct htracer *tracer, const char *path)
+{
+    struct htrace_rcv *rcv;
+
+    rcv = htrace_rcv_find(tracer->rcv, &g_flight_rcv_ty);
+    if (!rcv) {
+        return ENOENT;
+    }
+    return flight_rcv_dump(rcv, path);
+}
+
+void htracer_add_span(struct htracer *tracer, struct htrace_span *span)
+{
+    struct htrace_rcv *rcv = tracer->rcv;
+
+    if (rcv->ty->take_span && rcv->ty->take_span(rcv, span)) {
+        return;
+    }
+    if (tracer->batcher) {
+        htrace_batcher_add_span(tracer->batcher, span);
+        return;
+    }
+    rcv->ty->add_span(rcv, span);
+    htrace_span_free(span);
 }
 
 struct htrace_scope *htracer_cur_scope(struct htracer *tracer)
 {
+#ifdef HAVE_IMPROVED_TLS
+    if (tracer->tls_slot >= 0) {
+        return t_cur_scope[tracer->tls_slot];
+    }
+#endif
     return pthread_getspecific(tracer->tls);
 }
 
@@ -132,7 +421,7 @@ int htracer_push_scope(struct htracer *tracer, struct htrace_scope *cur,
 {
     int ret;
     next->parent = cur;
-    ret = pthread_setspecific(tracer->tls, next);
+    ret = htracer_set_cur_scope(tracer, next);
     if (ret) {
         htrace_log(tracer->lg, "htracer_push_scope: pthread_setspecific "
                    "failed: %s\n", terror(ret));
@@ -146,7 +435,7 @@ int htracer_pop_scope(struct htracer *tracer, struct htrace_scope *scope)
     struct htrace_scope *cur_scope;
     int ret;
 
-    cur_scope = pthread_getspecific(tracer->tls);
+    cur_scope = htracer_cur_scope(tracer);
     if (cur_scope != scope) {
         htrace_log(tracer->lg, "htracer_pop_scope: attempted to pop a scope "
                    "that wasn't the top of the stack.  Current top of stack: "
@@ -155,7 +444,7 @@ int htracer_pop_scope(struct htracer *tracer, struct htrace_scope *scope)
                    (scope->span ? scope->span->desc : "(detached)"));
         return EIO;
     }
-    ret = pthread_setspecific(tracer->tls, scope->parent);
+    ret = htracer_set_cur_scope(tracer, scope->parent);
     if (ret) {
         htrace_log(tracer->lg, "htracer_pop_scope: pthread_setspecific "
                    "failed: %s\n", terror(ret));
@@ -164,4 +453,32 @@ int htracer_pop_scope(struct htracer *tracer, struct htrace_scope *scope)
     return 0;
 }
 
+int htracer_replace_scope(struct htracer *tracer, struct htrace_scope *old,
+                          struct htrace_scope *next)
+{
+    struct htrace_scope *child;
+    int ret;
+
+    child = htracer_cur_scope(tracer);
+    if (child == old) {
+        ret = htracer_set_cur_scope(tracer, next);
+        if (ret) {
+            htrace_log(tracer->lg, "htracer_replace_scope: "
+                       "pthread_setspecific failed: %s\n", terror(ret));
+            return EIO;
+        }
+        return 0;
+    }
+    for (; child; child = child->parent) {
+        if (child->parent == old) {
+            child->parent = next;
+            return 0;
+        }
+    }
+    htrace_log(tracer->lg, "htracer_replace_scope: the scope for %s is not "
+               "on this thread's stack.\n",
+               (old->span ? old->span->desc : "(detached)"));
+    return EINVAL;
+}
+
 // vim:ts=4:sw=4:et
@@ -20,6 +20,7 @@
 #define APACHE_HTRACE_CORE_TRACER_H
 
 #include <pthread.h> /* for pthread_key_t */
+#include <stdint.h> /* for uint64_t */
 
 /**
  * @file tracer.h
@@ -29,16 +30,61 @@
  * This is an internal header, not intended for external use.
  */
 
+struct htable;
+struct htrace_batcher;
+struct htrace_clock;
 struct htrace_log;
 struct htrace_rcv;
+struct htrace_sampler;
+struct htrace_span;
+struct htrace_tail;
 struct random_src;
 
+/**
+ * Counters kept by the tracer itself.  These are updated with relaxed atomic
+ * operations, since they are on the hot path and nobody depends on them for
+ * ordering.
+ */
+struct htracer_counters {
+    uint64_t spans_started;
+    uint64_t spans_sampled;
+    uint64_t spans_closed;
+    uint64_t dropped_invalid;
+    uint64_t dropped_oom;
+    uint64_t self_start_span_ns;
+    uint64_t self_scope_close_ns;
+};
+
+/**
+ * Increment one of the tracer counters.
+ */
+#define HTRACER_CTR_INC(tracer, ctr) \
+    __atomic_fetch_add(&(tracer)->ctrs.ctr, 1, __ATOMIC_RELAXED)
+
+/**
+ * Add to one of the tracer counters.
+ */
+#define HTRACER_CTR_ADD(tracer, ctr, n) \
+    __atomic_fetch_add(&(tracer)->ctrs.ctr, (n), __ATOMIC_RELAXED)
+
 struct htracer {
     /**
-     * Key for thread-local data.
+     * Which slot of the per-thread current scope array this tracer uses, or
+     * -1 if it uses the tls key instead.  See htracer.c.
+     */
+    int tls_slot;
+
+    /**
+     * Key for thread-local data.  Only valid if tls_slot is -1.
      */
     pthread_key_t tls;
 
+    /**
+     * A number which no other htracer created by this process has had.
+     * Unlike the htracer's address, it is never reused.  Never 0.
+     */
+    uint64_t serial;
+
     /**
      * The htrace log to use.
      */
@@ -59,12 +105,89 @@ struct htracer {
      */
     struct random_src *rnd;
 
+    /**
+     * The clock to take span timestamps from.
+     */
+    struct htrace_clock *clk;
+
+    /**
+     * The timestamp precision of the spans we create.  An
+     * enum htrace_ts_precision.
+     */
+    int ts_precision;
+
+    /**
+     * What the spans we create measure about CPU use.  An
+     * enum htrace_span_cpu.
+     */
+    int span_cpu;
+
     /**
      * The span receiver to use.
      */
     struct htrace_rcv *rcv;
+
+    /**
+     * The tail sampling stage which closed spans go through before they
+     * reach the span receiver, or NULL if tail sampling is off.
+     */
+    struct htrace_tail *tail;
+
+    /**
+     * The per-thread span batches, or NULL if spans are given to the span
+     * receiver one at a time.
+     */
+    struct htrace_batcher *batcher;
+
+    /**
+     * Statistics counters.  See HTRACER_CTR_INC.
+     */
+    struct htracer_counters ctrs;
+
+    /**
+     * Nonzero if we should measure how long our own calls take.  See
+     * HTRACE_SELF_STATS_KEY.
+     */
+    int self_stats;
+
+    /**
+     * The shortest a span can take to get high priority, or 0.  See
+     * HTRACE_PRIORITY_MIN_DURATION_MS_KEY.  Accessed atomically, since
+     * htracer_update_conf may change it.
+     */
+    uint64_t priority_min_duration_ms;
+
+    /**
+     * Protects samplers.
+     */
+    pthread_mutex_t smp_lock;
+
+    /**
+     * The samplers created for this tracer which htracer_update_conf can
+     * update, linked through their next fields.
+     */
+    struct htrace_sampler *samplers;
+
+    /**
+     * Protects descs.
+     */
+    pthread_mutex_t desc_lock;
+
+    /**
+     * Maps description strings to the struct htrace_desc objects registered
+     * with htrace_desc_register.  NULL until the first registration.
+     */
+    struct htable *descs;
 };
 
+/**
+ * Give a closed span to the span receiver, possibly after batching it.
+ *
+ * @param tracer            The context.
+ * @param span              The span.  This function takes ownership of it.
+ */
+void htracer_add_span(struct htracer *tracer, struct htrace_span *span);
+
 /**
  * Get the current scope in a given context.
  *
@@ -96,6 +219,20 @@ int htracer_push_scope(struct htracer *tracer, struct htrace_scope *cur,
  */
 int htracer_pop_scope(struct htracer *tracer, struct htrace_scope *scope);
 
+/**
+ * Replace a scope on the current context with a copy of it which lives at a
+ * different address.
+ *
+ * @param tracer            The context.
+ * @param old               The scope to replace.  It may be anywhere on the
+ *                              stack.
+ * @param next              The copy to put in its place.
+ *
+ * @return                  0 on success; nonzero otherwise.
+ */
+int htracer_replace_scope(struct htracer *tracer, struct htrace_scope *old,
+                          struct htrace_scope *next);
+
 #endif
 
 // vim: ts=4: sw=4: et
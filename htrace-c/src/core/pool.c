@@ -0,0 +1,182 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/pool.h"
+#include "core/scope.h"
+#include "core/span.h"
+#include "util/alloc.h"
+#include "util/build.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/**
+ * @file pool.c
+ *
+ * Per-thread freelists of spans and scopes.
+ *
+ * The freelists are found through a thread-local variable when the compiler
+ * supports __thread, and through a pthread key otherwise.  The pthread key is
+ * always used to free the lists when the thread exits.  Freed objects are
+ * linked through their first word, since we never look inside them.
+ */
+
+/**
+ * A freed object on a freelist.
+ */
+struct htrace_pool_obj {
+    struct htrace_pool_obj *next;
+};
+
+/**
+ * One thread's freelists.
+ */
+struct htrace_pool {
+    struct htrace_pool_obj *head[HTRACE_POOL_NUM_TYPES];
+    int num_free[HTRACE_POOL_NUM_TYPES];
+};
+
+static const size_t HTRACE_POOL_SIZES[HTRACE_POOL_NUM_TYPES] = {
+    sizeof(struct htrace_span),
+    sizeof(struct htrace_scope),
+};
+
+static pthread_once_t g_pool_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Nonzero if g_pool_key was created.  If it couldn't be, we don't use
+ * freelists at all.
+ */
+static int g_pool_key_valid;
+
+static pthread_key_t g_pool_key;
+
+#ifdef HAVE_IMPROVED_TLS
+static __thread struct htrace_pool *t_pool;
+#endif
+
+static void htrace_pool_destroy(void *data)
+{
+    struct htrace_pool *pool = data;
+    struct htrace_pool_obj *obj;
+    int ty;
+
+    for (ty = 0; ty < HTRACE_POOL_NUM_TYPES; ty++) {
+        while (pool->head[ty]) {
+            obj = pool->head[ty];
+            pool->head[ty] = obj->next;
+            htrace_free(obj);
+        }
+    }
+    htrace_free(pool);
+#ifdef HAVE_IMPROVED_TLS
+    t_pool = NULL;
+#endif
+}
+
+static void htrace_pool_key_init(void)
+{
+    g_pool_key_valid =
+        (pthread_key_create(&g_pool_key, htrace_pool_destroy) == 0);
+}
+
+/**
+ * Delete the key when libhtrace is unloaded, so that exiting threads don't
+ * call back into unmapped code.  Their freelists are leaked.
+ */
+static void __attribute__((destructor)) htrace_pool_key_fini(void)
+{
+    if (g_pool_key_valid) {
+        pthread_key_delete(g_pool_key);
+        g_pool_key_valid = 0;
+    }
+}
+
+/**
+ * Get this thread's freelists, creating them if need be.
+ *
+ * @return              NULL if we can't use freelists on this thread.
+ */
+static struct htrace_pool *htrace_pool_get(void)
+{
+    struct htrace_pool *pool;
+
+#ifdef HAVE_IMPROVED_TLS
+    if (t_pool) {
+        return t_pool;
+    }
+#endif
+    pthread_once(&g_pool_once, htrace_pool_key_init);
+    if (!g_pool_key_valid) {
+        return NULL;
+    }
+#ifndef HAVE_IMPROVED_TLS
+    pool = pthread_getspecific(g_pool_key);
+    if (pool) {
+        return pool;
+    }
+#endif
+    pool = htrace_calloc(1, sizeof(*pool));
+    if (!pool) {
+        return NULL;
+    }
+    if (pthread_setspecific(g_pool_key, pool)) {
+        htrace_free(pool);
+        return NULL;
+    }
+#ifdef HAVE_IMPROVED_TLS
+    t_pool = pool;
+#endif
+    return pool;
+}
+
+void *htrace_pool_alloc(enum htrace_pool_type ty)
+{
+    struct htrace_pool *pool;
+    struct htrace_pool_obj *obj;
+
+    pool = htrace_pool_get();
+    if (pool && pool->head[ty]) {
+        obj = pool->head[ty];
+        pool->head[ty] = obj->next;
+        pool->num_free[ty]--;
+        return obj;
+    }
+    return htrace_malloc(HTRACE_POOL_SIZES[ty]);
+}
+
+void htrace_pool_free(enum htrace_pool_type ty, void *obj)
+{
+    struct htrace_pool *pool;
+    struct htrace_pool_obj *pobj = obj;
+
+    if (!obj) {
+        return;
+    }
+    pool = htrace_pool_get();
+    if ((!pool) || (pool->num_free[ty] >= HTRACE_POOL_MAX_FREE)) {
+        htrace_free(obj);
+        return;
+    }
+    pobj->next = pool->head[ty];
+    pool->head[ty] = pobj;
+    pool->num_free[ty]++;
+}
+
+// vim:ts=4:sw=4:et
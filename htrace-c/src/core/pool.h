@@ -0,0 +1,74 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef APACHE_HTRACE_CORE_POOL_H
+#define APACHE_HTRACE_CORE_POOL_H
+
+/**
+ * @file pool.h
+ *
+ * Per-thread freelists of spans and scopes.
+ *
+ * Starting and closing a span would otherwise cost a malloc and a free each
+ * for the span and the scope.  Instead, freed objects are kept on a list
+ * belonging to the thread which freed them, and handed out again to the next
+ * allocation on that thread.  Objects can be freed on a different thread from
+ * the one they were allocated on.  Each list is bounded, and whatever is left
+ * on it is freed when the thread exits.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+/**
+ * The kinds of object we keep freelists for.
+ */
+enum htrace_pool_type {
+    HTRACE_POOL_SPAN = 0,
+    HTRACE_POOL_SCOPE,
+    HTRACE_POOL_NUM_TYPES
+};
+
+/**
+ * The most objects of each kind to keep on one thread's freelist.
+ */
+#define HTRACE_POOL_MAX_FREE 64
+
+/**
+ * Allocate an object, reusing one from this thread's freelist if we can.
+ * The object is uninitialized.
+ *
+ * @param ty            The kind of object.
+ *
+ * @return              NULL on OOM; the object otherwise.
+ */
+void *htrace_pool_alloc(enum htrace_pool_type ty);
+
+/**
+ * Free an object, keeping it on this thread's freelist if there is room.
+ *
+ * @param ty            The kind of object.  The object must have been
+ *                          allocated with htrace_pool_alloc, or with malloc
+ *                          and the size of that kind of object.
+ * @param obj           The object, or NULL.
+ */
+void htrace_pool_free(enum htrace_pool_type ty, void *obj);
+
+#endif
+
+// vim: ts=4:sw=4:et
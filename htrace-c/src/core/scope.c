@@ -16,17 +16,22 @@
  * limitations under the License.
  */
 
+#include "core/desc.h"
 #include "core/htrace.h"
 #include "core/htracer.h"
+#include "core/pool.h"
 #include "core/scope.h"
 #include "core/span.h"
+#include "core/tail.h"
 #include "receiver/receiver.h"
 #include "sampler/sampler.h"
 #include "util/log.h"
+#include "util/probe.h"
 #include "util/rand.h"
 #include "util/string.h"
 #include "util/time.h"
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -38,44 +43,142 @@
  * Implementation of HTrace scopes.
  */
 
-struct htrace_scope* htrace_start_span(struct htracer *tracer,
-        struct htrace_sampler *sampler, const char *desc)
+/**
+ * Fail to compile if struct htrace_scope no longer fits in the storage that
+ * callers provide for htrace_start_span_inplace.
+ */
+typedef char htrace_scope_storage_too_small[
+    (sizeof(struct htrace_scope) <= sizeof(struct htrace_scope_storage)) ?
+        1 : -1];
+
+/**
+ * Release the memory for a scope.
+ */
+static void htrace_scope_release(struct htrace_scope *scope)
+{
+    if (!scope->inplace) {
+        htrace_pool_free(HTRACE_POOL_SCOPE, scope);
+    }
+}
+
+/**
+ * Ask the sampler whether to start a new trace, and pick its first span ID
+ * if so.
+ *
+ * @param tracer    The htracer to use.
+ * @param sampler   The sampler to use, or NULL.
+ * @param desc      The description of the trace span.
+ * @param desc_len  The length of desc.
+ * @param idesc     The interned description, or NULL.
+ * @param span_id   (out param) The span ID of the new trace's first span.
+ *
+ * @return          1 if a new trace should be started; 0 otherwise.
+ */
+static int htrace_sample_new_trace(struct htracer *tracer,
+        struct htrace_sampler *sampler, const char *desc, size_t desc_len,
+        const struct htrace_desc *idesc, struct htrace_span_id *span_id)
+{
+    struct htrace_span_id trace_id;
+
+    if (!sampler) {
+        return 0;
+    }
+    if (sampler->ty->next_desc) {
+        if (!sampler->ty->next_desc(sampler, desc, desc_len, idesc)) {
+            return 0;
+        }
+    } else if (sampler->ty->next_trace) {
+        // Pick the trace ID first, so that the sampler can decide from it.
+        do {
+            trace_id.high = random_u64(tracer->rnd);
+        } while (trace_id.high == 0);
+        trace_id.low = 0;
+        if (!sampler->ty->next_trace(sampler, trace_id.high)) {
+            return 0;
+        }
+        htrace_span_id_generate(span_id, tracer->rnd, &trace_id);
+        return 1;
+    } else if (!sampler->ty->next(sampler)) {
+        return 0;
+    }
+    htrace_span_id_generate(span_id, tracer->rnd, NULL);
+    return 1;
+}
+
+/**
+ * Start a new trace span if necessary.
+ *
+ * @param tracer    The htracer to use.
+ * @param sampler   The sampler to use.
+ * @param desc      The description of the trace span.  Must already have
+ *                      been validated.  Need not be NUL-terminated.
+ * @param desc_len  The length of desc.
+ * @param idesc     The interned description, or NULL if desc should be
+ *                      copied into the span.
+ * @param storage   The memory to create the scope in, or NULL to allocate it
+ *                      from the scope pool.
+ *
+ * @return          The trace scope, or NULL.
+ */
+static struct htrace_scope* htrace_start_span_impl(struct htracer *tracer,
+        struct htrace_sampler *sampler, const char *desc, size_t desc_len,
+        const struct htrace_desc *idesc, struct htrace_scope_storage *storage)
 {
     struct htrace_scope *cur_scope, *scope = NULL, *pscope;
     struct htrace_span *span = NULL;
     struct htrace_span_id span_id;
+    uint64_t begin_ns;
 
-    // Validate the description string.  This ensures that it doesn't have
-    // anything silly in it like embedded double quotes, backslashes, or control
-    // characters.
-    if (!validate_json_string(tracer->lg, desc)) {
-        htrace_log(tracer->lg, "htrace_span_alloc(desc=%s): invalid "
-                   "description string.\n", desc);
-        return NULL;
-    }
     cur_scope = htracer_cur_scope(tracer);
     if ((!cur_scope) || (!cur_scope->span)) {
-        if (!sampler->ty->next(sampler)) {
+        if (!htrace_sample_new_trace(tracer, sampler, desc, desc_len, idesc,
+                                     &span_id)) {
+            HTRACE_PROBE2(span__unsampled, desc, desc_len);
             return NULL;
         }
-        htrace_span_id_generate(&span_id, tracer->rnd, NULL);
     } else {
         htrace_span_id_generate(&span_id, tracer->rnd,
                                 &cur_scope->span->span_id);
     }
-    span = htrace_span_alloc(desc, now_ms(tracer->lg), &span_id);
+    begin_ns = htrace_clock_now_ns(tracer->clk);
+    if (idesc) {
+        span = htrace_span_alloc_interned(idesc, 0, &span_id);
+    } else {
+        span = htrace_span_alloc_len(desc, desc_len, 0, &span_id);
+    }
     if (!span) {
-        htrace_log(tracer->lg, "htrace_span_alloc(desc=%s): OOM\n", desc);
+        HTRACE_LOG_RATELIMITED(tracer->lg, HTRACE_LOG_ERROR,
+                               "htrace_span_alloc(desc=%.*s): OOM\n",
+                               (int)desc_len, desc);
+        HTRACER_CTR_INC(tracer, dropped_oom);
         return NULL;
     }
-    scope = malloc(sizeof(*scope));
-    if (!scope) {
-        htrace_span_free(span);
-        htrace_log(tracer->lg, "htrace_start_span(desc=%s): OOM\n", desc);
-        return NULL;
+    htrace_span_set_begin_ns(span, begin_ns);
+    span->ts_precision = tracer->ts_precision;
+    if (tracer->span_cpu != HTRACE_SPAN_CPU_OFF) {
+        htrace_span_cpu_begin(span, tracer->span_cpu);
+    }
+    if (storage) {
+        scope = (struct htrace_scope *)storage;
+        scope->inplace = 1;
+    } else {
+        scope = htrace_pool_alloc(HTRACE_POOL_SCOPE);
+        if (!scope) {
+            htrace_span_free(span);
+            HTRACE_LOG_RATELIMITED(tracer->lg, HTRACE_LOG_ERROR,
+                                   "htrace_start_span(desc=%.*s): OOM\n",
+                                   (int)desc_len, desc);
+            HTRACER_CTR_INC(tracer, dropped_oom);
+            return NULL;
+        }
+        scope->inplace = 0;
     }
+    HTRACER_CTR_INC(tracer, spans_sampled);
     scope->tracer = tracer;
     scope->span = span;
+    scope->unlinked = 0;
+    HTRACE_PROBE3(span__start, span->desc, span->span_id.high,
+                  span->span_id.low);
 
     // Search enclosing trace scopes for the first one that hasn't disowned
     // its trace span.
@@ -88,14 +191,255 @@ struct htrace_scope* htrace_start_span(struct htracer *tracer,
         }
         pscope = pscope->parent;
     }
+    span->local_root = (span->num_parents == 0);
     if (htracer_push_scope(tracer, cur_scope, scope) != 0) {
         htrace_span_free(span);
-        free(scope);
+        htrace_scope_release(scope);
+        return NULL;
+    }
+    return scope;
+}
+
+/**
+ * Get the time at which a call we measure for HTRACE_SELF_STATS_KEY started.
+ *
+ * @param tracer        The tracer.
+ *
+ * @return              The monotonic time in nanoseconds, or 0 if we are
+ *                          not measuring.
+ */
+static uint64_t htrace_self_start(const struct htracer *tracer)
+{
+    if (!tracer->self_stats) {
+        return 0;
+    }
+    return monotonic_now_ns(NULL);
+}
+
+/**
+ * Count the time spent starting a span, for HTRACE_SELF_STATS_KEY.
+ *
+ * @param tracer        The tracer.
+ * @param start_ns      What htrace_self_start returned.
+ * @param scope         The scope which was started, or NULL.
+ *
+ * @return              The scope.
+ */
+static struct htrace_scope *htrace_self_started(struct htracer *tracer,
+        uint64_t start_ns, struct htrace_scope *scope)
+{
+    if (start_ns) {
+        HTRACER_CTR_ADD(tracer, self_start_span_ns,
+                        monotonic_now_ns(NULL) - start_ns);
+    }
+    return scope;
+}
+
+/**
+ * Validate a description string and start a new trace span if necessary.
+ */
+static struct htrace_scope* htrace_start_span_validated(
+        struct htracer *tracer, struct htrace_sampler *sampler,
+        const char *desc, size_t desc_len,
+        struct htrace_scope_storage *storage)
+{
+    HTRACER_CTR_INC(tracer, spans_started);
+    if (!htrace_enabled()) {
+        return NULL;
+    }
+    // Validate the description string.  This ensures that it doesn't have
+    // anything silly in it like embedded double quotes, backslashes, or control
+    // characters.
+    if (!validate_json_string_len(tracer->lg, desc, desc_len)) {
+        HTRACE_LOG_RATELIMITED(tracer->lg, HTRACE_LOG_WARN,
+                "htrace_span_alloc(desc=%.*s): invalid description string.\n",
+                (int)desc_len, desc);
+        HTRACER_CTR_INC(tracer, dropped_invalid);
+        return NULL;
+    }
+    return htrace_start_span_impl(tracer, sampler, desc, desc_len,
+                                  NULL, storage);
+}
+
+struct htrace_scope* htrace_start_span(struct htracer *tracer,
+        struct htrace_sampler *sampler, const char *desc)
+{
+    uint64_t start_ns = htrace_self_start(tracer);
+
+    return htrace_self_started(tracer, start_ns,
+            htrace_start_span_validated(tracer, sampler, desc, strlen(desc),
+                                        NULL));
+}
+
+struct htrace_scope* htrace_start_span_inplace(
+        struct htrace_scope_storage *storage, struct htracer *tracer,
+        struct htrace_sampler *sampler, const char *desc)
+{
+    uint64_t start_ns = htrace_self_start(tracer);
+
+    return htrace_self_started(tracer, start_ns,
+            htrace_start_span_validated(tracer, sampler, desc, strlen(desc),
+                                        storage));
+}
+
+struct htrace_scope* htrace_start_span_inplace_len(
+        struct htrace_scope_storage *storage, struct htracer *tracer,
+        struct htrace_sampler *sampler, const char *desc, size_t desc_len)
+{
+    uint64_t start_ns = htrace_self_start(tracer);
+
+    return htrace_self_started(tracer, start_ns,
+            htrace_start_span_validated(tracer, sampler, desc, desc_len,
+                                        storage));
+}
+
+static struct htrace_scope* htrace_start_span_desc_untimed(
+        struct htracer *tracer, struct htrace_sampler *sampler,
+        const struct htrace_desc *desc)
+{
+    HTRACER_CTR_INC(tracer, spans_started);
+    // A NULL description means that htrace_desc_register failed, and has
+    // already logged why.
+    if (!desc) {
+        HTRACER_CTR_INC(tracer, dropped_invalid);
+        return NULL;
+    }
+    if (!htrace_enabled()) {
         return NULL;
     }
+    return htrace_start_span_impl(tracer, sampler, desc->str, desc->len,
+                                  desc, NULL);
+}
+
+struct htrace_scope* htrace_start_span_desc(struct htracer *tracer,
+        struct htrace_sampler *sampler, const struct htrace_desc *desc)
+{
+    uint64_t start_ns = htrace_self_start(tracer);
+
+    return htrace_self_started(tracer, start_ns,
+            htrace_start_span_desc_untimed(tracer, sampler, desc));
+}
+
+static struct htrace_scope* htrace_start_span_name_untimed(
+        struct htrace_scope_storage *storage, struct htracer *tracer,
+        struct htrace_sampler *sampler, struct htrace_name *name)
+{
+    const struct htrace_desc *desc;
+
+    HTRACER_CTR_INC(tracer, spans_started);
+    if (!htrace_enabled()) {
+        return NULL;
+    }
+    desc = htrace_name_get(tracer, name);
+    if (!desc) {
+        HTRACER_CTR_INC(tracer, dropped_invalid);
+        return NULL;
+    }
+    return htrace_start_span_impl(tracer, sampler, desc->str, desc->len,
+                                  desc, storage);
+}
+
+struct htrace_scope* htrace_start_span_name_inplace(
+        struct htrace_scope_storage *storage, struct htracer *tracer,
+        struct htrace_sampler *sampler, struct htrace_name *name)
+{
+    uint64_t start_ns = htrace_self_start(tracer);
+
+    return htrace_self_started(tracer, start_ns,
+            htrace_start_span_name_untimed(storage, tracer, sampler, name));
+}
+
+static struct htrace_scope* htrace_start_span_from_untimed(
+        struct htrace_scope_storage *storage, struct htracer *tracer,
+        const struct htrace_span_id *parent, int local_parent,
+        const char *desc)
+{
+    struct htrace_scope *scope;
+    struct htrace_span *span;
+    struct htrace_span_id span_id, zero;
+
+    HTRACER_CTR_INC(tracer, spans_started);
+    htrace_span_id_clear(&zero);
+    if (htrace_span_id_compare(parent, &zero) == 0) {
+        return NULL;
+    }
+    if (!validate_json_string(tracer->lg, desc)) {
+        HTRACE_LOG_RATELIMITED(tracer->lg, HTRACE_LOG_WARN,
+                "htrace_start_span_from(desc=%s): invalid description "
+                "string.\n", desc);
+        HTRACER_CTR_INC(tracer, dropped_invalid);
+        return NULL;
+    }
+    // As with htrace_restart_span, a span from somewhere else can have
+    // children even if no sampler has ever fired here.
+    __atomic_store_n(&htrace_g_enabled, 1, __ATOMIC_RELAXED);
+    htrace_span_id_generate(&span_id, tracer->rnd, parent);
+    span = htrace_span_alloc(desc, 0, &span_id);
+    if (!span) {
+        HTRACE_LOG_RATELIMITED(tracer->lg, HTRACE_LOG_ERROR,
+                               "htrace_start_span_from(desc=%s): OOM\n", desc);
+        HTRACER_CTR_INC(tracer, dropped_oom);
+        return NULL;
+    }
+    htrace_span_set_begin_ns(span, htrace_clock_now_ns(tracer->clk));
+    span->ts_precision = tracer->ts_precision;
+    span->parent.single = *parent;
+    span->num_parents = 1;
+    span->local_root = !local_parent;
+    if (storage) {
+        scope = (struct htrace_scope *)storage;
+        scope->inplace = 1;
+    } else {
+        scope = htrace_pool_alloc(HTRACE_POOL_SCOPE);
+        if (!scope) {
+            htrace_span_free(span);
+            HTRACE_LOG_RATELIMITED(tracer->lg, HTRACE_LOG_ERROR,
+                    "htrace_start_span_from(desc=%s): OOM\n", desc);
+            HTRACER_CTR_INC(tracer, dropped_oom);
+            return NULL;
+        }
+        scope->inplace = 0;
+    }
+    HTRACER_CTR_INC(tracer, spans_sampled);
+    scope->tracer = tracer;
+    scope->parent = NULL;
+    scope->span = span;
+    scope->unlinked = 1;
+    HTRACE_PROBE3(span__start, span->desc, span->span_id.high,
+                  span->span_id.low);
     return scope;
 }
 
+struct htrace_scope* htrace_start_span_from(
+        struct htrace_scope_storage *storage, struct htracer *tracer,
+        const struct htrace_span_id *parent, int local_parent,
+        const char *desc)
+{
+    uint64_t start_ns = htrace_self_start(tracer);
+
+    return htrace_self_started(tracer, start_ns,
+            htrace_start_span_from_untimed(storage, tracer, parent,
+                                           local_parent, desc));
+}
+
+struct htrace_scope* htrace_scope_move_inplace(
+        struct htrace_scope_storage *storage, struct htrace_scope *scope)
+{
+    struct htrace_scope *next = (struct htrace_scope *)storage;
+
+    if ((!scope) || (!scope->inplace) || (scope == next)) {
+        return scope;
+    }
+    *next = *scope;
+    if (scope->unlinked) {
+        return next;
+    }
+    if (htracer_replace_scope(scope->tracer, scope, next)) {
+        return NULL;
+    }
+    return next;
+}
+
 struct htrace_span *htrace_scope_detach(struct htrace_scope *scope)
 {
     struct htrace_span *span = scope->span;
@@ -106,6 +450,9 @@ struct htrace_span *htrace_scope_detach(struct htrace_scope *scope)
         return NULL;
     }
     scope->span = NULL;
+    // The span may be closed on another thread, where the CPU counters of
+    // this one mean nothing.
+    span->cpu = HTRACE_SPAN_CPU_OFF;
     return span;
 }
 
@@ -115,26 +462,105 @@ struct htrace_scope* htrace_restart_span(struct htracer *tracer,
     struct htrace_scope *cur_scope, *scope = NULL;
     char buf[HTRACE_SPAN_ID_STRING_LENGTH + 1];
 
-    scope = malloc(sizeof(*scope));
+    scope = htrace_pool_alloc(HTRACE_POOL_SCOPE);
     if (!scope) {
         htrace_span_id_to_str(&span->span_id, buf, sizeof(buf));
-        htrace_log(tracer->lg, "htrace_start_span(desc=%s, parent_id=%s"
-                   "): OOM\n", span->desc, buf);
+        HTRACE_LOG_RATELIMITED(tracer->lg, HTRACE_LOG_ERROR,
+                "htrace_start_span(desc=%s, parent_id=%s): OOM\n",
+                span->desc, buf);
         htrace_span_free(span);
         return NULL;
     }
+    // A span from somewhere else can have children even if no sampler has
+    // ever fired here.
+    __atomic_store_n(&htrace_g_enabled, 1, __ATOMIC_RELAXED);
     scope->tracer = tracer;
     scope->parent = NULL;
     scope->span = span;
+    scope->inplace = 0;
+    scope->unlinked = 0;
     cur_scope = htracer_cur_scope(tracer);
     if (htracer_push_scope(tracer, cur_scope, scope) != 0) {
         htrace_span_free(span);
-        free(scope);
+        htrace_scope_release(scope);
         return NULL;
     }
     return scope;
 }
 
+int htrace_scope_add_kv(struct htrace_scope *scope, const char *key,
+                        const char *val)
+{
+    if ((!scope) || (!scope->span)) {
+        return 0;
+    }
+    return htrace_scope_add_kv_len(scope, key, strlen(key), val, strlen(val));
+}
+
+int htrace_scope_add_kv_len(struct htrace_scope *scope, const char *key,
+                            size_t key_len, const char *val, size_t val_len)
+{
+    struct htracer *tracer;
+
+    if ((!scope) || (!scope->span)) {
+        return 0;
+    }
+    tracer = scope->tracer;
+    if ((!validate_json_string_len(tracer->lg, key, key_len)) ||
+            (!validate_json_string_len(tracer->lg, val, val_len))) {
+        HTRACE_LOG_RATELIMITED(tracer->lg, HTRACE_LOG_WARN,
+                "htrace_scope_add_kv(key=%.*s, val=%.*s): invalid "
+                "annotation string.\n", (int)key_len, key,
+                (int)val_len, val);
+        return EINVAL;
+    }
+    return htrace_span_add_kv_len(scope->span, key, key_len, val, val_len);
+}
+
+int htrace_scope_add_event(struct htrace_scope *scope, const char *msg)
+{
+    if ((!scope) || (!scope->span)) {
+        return 0;
+    }
+    return htrace_scope_add_event_len(scope, msg, strlen(msg));
+}
+
+int htrace_scope_add_event_len(struct htrace_scope *scope, const char *msg,
+                               size_t msg_len)
+{
+    struct htracer *tracer;
+
+    if ((!scope) || (!scope->span)) {
+        return 0;
+    }
+    tracer = scope->tracer;
+    if (!validate_json_string_len(tracer->lg, msg, msg_len)) {
+        HTRACE_LOG_RATELIMITED(tracer->lg, HTRACE_LOG_WARN,
+                "htrace_scope_add_event(msg=%.*s): invalid event string.\n",
+                (int)msg_len, msg);
+        return EINVAL;
+    }
+    return htrace_span_add_event_len(scope->span,
+            htrace_clock_now_ms(tracer->clk), msg, msg_len);
+}
+
+int htrace_scope_add_parent(struct htrace_scope *scope,
+                            const struct htrace_span_id *parent)
+{
+    struct htrace_span_id zero;
+
+    if ((!scope) || (!scope->span)) {
+        return 0;
+    }
+    htrace_span_id_clear(&zero);
+    if (htrace_span_id_compare(parent, &zero) == 0) {
+        htrace_log(scope->tracer->lg, "htrace_scope_add_parent: can't add "
+                   "the invalid span ID as a parent.\n");
+        return EINVAL;
+    }
+    return htrace_span_add_parent(scope->span, parent);
+}
+
 void htrace_scope_get_span_id(const struct htrace_scope *scope,
                               struct htrace_span_id *id)
 {
@@ -152,23 +578,68 @@ void htrace_scope_get_span_id(const struct htrace_scope *scope,
     htrace_span_id_copy(id, &span->span_id);
 }
 
+void htrace_scope_set_priority(struct htrace_scope *scope, int priority)
+{
+    if ((!scope) || (!scope->span)) {
+        return;
+    }
+    scope->span->priority = priority ? HTRACE_PRIORITY_HIGH :
+        HTRACE_PRIORITY_NORMAL;
+}
+
+/**
+ * Raise the priority of a closed span which was slow or failed.
+ */
+static void htrace_scope_close_priority(const struct htracer *tracer,
+                                        struct htrace_span *span)
+{
+    uint64_t min_ms;
+
+    if (span->priority != HTRACE_PRIORITY_NORMAL) {
+        return;
+    }
+    min_ms = __atomic_load_n(&tracer->priority_min_duration_ms,
+                             __ATOMIC_RELAXED);
+    if ((min_ms && (span->end_ms - span->begin_ms >= min_ms)) ||
+            (span->extra && htrace_span_get_kv(span, HTRACE_SPAN_ERROR_KEY))) {
+        span->priority = HTRACE_PRIORITY_HIGH;
+    }
+}
+
 void htrace_scope_close(struct htrace_scope *scope)
 {
     struct htracer *tracer;
+    uint64_t start_ns;
 
     if (!scope) {
         return;
     }
     tracer = scope->tracer;
-    if (htracer_pop_scope(tracer, scope) == 0) {
+    start_ns = htrace_self_start(tracer);
+    if (scope->unlinked || (htracer_pop_scope(tracer, scope) == 0)) {
         struct htrace_span *span = scope->span;
         if (span) {
-            struct htrace_rcv *rcv = tracer->rcv;
-            span->end_ms = now_ms(tracer->lg);
-            rcv->ty->add_span(rcv, span);
-            htrace_span_free(span);
+            htrace_span_set_end_ns(span, htrace_clock_now_ns(tracer->clk));
+            if (span->cpu != HTRACE_SPAN_CPU_OFF) {
+                htrace_span_cpu_end(span);
+            }
+            htrace_scope_close_priority(tracer, span);
+            HTRACE_PROBE4(span__close, span->desc, span->span_id.high,
+                          span->span_id.low,
+                          ((span->end_ms - span->begin_ms) * 1000000ULL) +
+                          span->end_sub_ns - span->begin_sub_ns);
+            HTRACER_CTR_INC(tracer, spans_closed);
+            if (tracer->tail) {
+                htrace_tail_add_span(tracer->tail, span);
+            } else {
+                htracer_add_span(tracer, span);
+            }
         }
-        free(scope);
+        htrace_scope_release(scope);
+    }
+    if (start_ns) {
+        HTRACER_CTR_ADD(tracer, self_scope_close_ns,
+                        monotonic_now_ns(NULL) - start_ns);
     }
 }
 
@@ -53,6 +53,18 @@ struct htrace_scope {
      * The span object associated with this scope, or NULL if there is none.
      */
     struct htrace_span *span;
+
+    /**
+     * Nonzero if this scope lives in a caller-provided htrace_scope_storage,
+     * rather than being allocated from the scope pool.
+     */
+    int inplace;
+
+    /**
+     * Nonzero if this scope was started with htrace_start_span_from, and so
+     * is not on any thread's stack of scopes.
+     */
+    int unlinked;
 };
 
 #endif
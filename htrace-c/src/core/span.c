@@ -16,21 +16,27 @@
  * limitations under the License.
  */
 
+#include "core/desc.h"
 #include "core/htrace.h"
+#include "core/pool.h"
 #include "core/span.h"
 #include "receiver/receiver.h"
 #include "sampler/sampler.h"
+#include "util/alloc.h"
 #include "util/cmp.h"
 #include "util/log.h"
 #include "util/rand.h"
 #include "util/string.h"
 #include "util/time.h"
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <time.h>
 
 /**
  * @file span.c
@@ -38,41 +44,461 @@
  * Implementation of HTrace spans.
  */
 
+static void htrace_span_init(struct htrace_span *span, uint64_t begin_ms,
+                             struct htrace_span_id *span_id)
+{
+    span->begin_ms = begin_ms;
+    span->end_ms = 0;
+    htrace_span_id_copy(&span->span_id, span_id);
+    span->trid = NULL;
+    span->num_parents = 0;
+    span->ts_precision = HTRACE_TS_PRECISION_MS;
+    span->local_root = 0;
+    span->priority = HTRACE_PRIORITY_NORMAL;
+    span->cpu = HTRACE_SPAN_CPU_OFF;
+    span->begin_sub_ns = 0;
+    span->end_sub_ns = 0;
+    htrace_span_id_clear(&span->parent.single);
+    span->extra = NULL;
+    span->next = NULL;
+}
+
 struct htrace_span *htrace_span_alloc(const char *desc,
                 uint64_t begin_ms, struct htrace_span_id *span_id)
+{
+    return htrace_span_alloc_len(desc, strlen(desc), begin_ms, span_id);
+}
+
+struct htrace_span *htrace_span_alloc_len(const char *desc, size_t desc_len,
+                uint64_t begin_ms, struct htrace_span_id *span_id)
 {
     struct htrace_span *span;
+    char *d;
 
-    span = malloc(sizeof(*span));
+    span = htrace_pool_alloc(HTRACE_POOL_SPAN);
     if (!span) {
         return NULL;
     }
-    span->desc = strdup(desc);
-    if (!span->desc) {
-        free(span);
+    if (desc_len < sizeof(span->desc_buf)) {
+        d = span->desc_buf;
+    } else {
+        d = htrace_malloc(desc_len + 1);
+        if (!d) {
+            htrace_pool_free(HTRACE_POOL_SPAN, span);
+            return NULL;
+        }
+    }
+    memcpy(d, desc, desc_len);
+    d[desc_len] = '\0';
+    span->desc = d;
+    span->interned = NULL;
+    htrace_span_init(span, begin_ms, span_id);
+    return span;
+}
+
+struct htrace_span *htrace_span_alloc_interned(const struct htrace_desc *desc,
+                uint64_t begin_ms, struct htrace_span_id *span_id)
+{
+    struct htrace_span *span;
+
+    span = htrace_pool_alloc(HTRACE_POOL_SPAN);
+    if (!span) {
         return NULL;
     }
-    span->begin_ms = begin_ms;
-    span->end_ms = 0;
-    htrace_span_id_copy(&span->span_id, span_id);
-    span->trid = NULL;
-    span->num_parents = 0;
-    htrace_span_id_clear(&span->parent.single);
-    span->parent.list = NULL;
+    span->desc = desc->str;
+    span->interned = desc;
+    htrace_span_init(span, begin_ms, span_id);
     return span;
 }
 
+void htrace_span_set_begin_ns(struct htrace_span *span, uint64_t ns)
+{
+    span->begin_ms = ns / 1000000ULL;
+    span->begin_sub_ns = ns % 1000000ULL;
+}
+
+void htrace_span_set_end_ns(struct htrace_span *span, uint64_t ns)
+{
+    span->end_ms = ns / 1000000ULL;
+    span->end_sub_ns = ns % 1000000ULL;
+}
+
+/**
+ * Sample the CPU use of the calling thread.
+ *
+ * @param cpu               What to sample.  An enum htrace_span_cpu.
+ * @param cpu_ns            (out param) The thread's CPU time in nanoseconds.
+ * @param vol_csw           (out param) The thread's voluntary context
+ *                              switches.  Only set for
+ *                              HTRACE_SPAN_CPU_RUSAGE.
+ * @param invol_csw         (out param) The thread's involuntary context
+ *                              switches.  Only set for
+ *                              HTRACE_SPAN_CPU_RUSAGE.
+ *
+ * @return                  1 on success; 0 if the sample couldn't be taken.
+ */
+static int span_cpu_sample(int cpu, uint64_t *cpu_ns, uint32_t *vol_csw,
+                           uint32_t *invol_csw)
+{
+    struct timespec ts;
+#ifdef RUSAGE_THREAD
+    struct rusage ru;
+
+    if (cpu == HTRACE_SPAN_CPU_RUSAGE) {
+        if (getrusage(RUSAGE_THREAD, &ru)) {
+            return 0;
+        }
+        *cpu_ns = (((uint64_t)ru.ru_utime.tv_sec +
+                    (uint64_t)ru.ru_stime.tv_sec) * 1000000000ULL) +
+            (((uint64_t)ru.ru_utime.tv_usec +
+              (uint64_t)ru.ru_stime.tv_usec) * 1000ULL);
+        *vol_csw = ru.ru_nvcsw;
+        *invol_csw = ru.ru_nivcsw;
+        return 1;
+    }
+#endif
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)) {
+        return 0;
+    }
+    *cpu_ns = ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+    return 1;
+}
+
+void htrace_span_cpu_begin(struct htrace_span *span, int cpu)
+{
+    span->vol_csw = 0;
+    span->invol_csw = 0;
+    if (span_cpu_sample(cpu, &span->cpu_ns, &span->vol_csw,
+                        &span->invol_csw)) {
+        span->cpu = cpu;
+    }
+}
+
+void htrace_span_cpu_end(struct htrace_span *span)
+{
+    uint64_t cpu_ns;
+    uint32_t vol_csw = 0, invol_csw = 0;
+
+    if ((!span_cpu_sample(span->cpu, &cpu_ns, &vol_csw, &invol_csw)) ||
+            (cpu_ns < span->cpu_ns)) {
+        span->cpu = HTRACE_SPAN_CPU_OFF;
+        return;
+    }
+    span->cpu_ns = cpu_ns - span->cpu_ns;
+    span->vol_csw = vol_csw - span->vol_csw;
+    span->invol_csw = invol_csw - span->invol_csw;
+}
+
+#define SPAN_EXTRA_KV 1
+#define SPAN_EXTRA_EVENT 2
+
+/**
+ * The initial size of the buffer in a struct htrace_span_extra.
+ */
+#define SPAN_EXTRA_INITIAL_CAP 256
+
+/**
+ * A decoded record from a struct htrace_span_extra.
+ */
+struct span_extra_rec {
+    int type;
+    const char *key; // The key, or the event message.
+    uint16_t key_len;
+    const char *val; // The value, for key/value records.
+    uint16_t val_len;
+    uint64_t time_ms; // The time, for event records.
+};
+
+/**
+ * Make room for another record in a span's extra data.
+ *
+ * @param span          The span.
+ * @param len           The length of the record.
+ * @param err           (out param) ENOSPC or ENOMEM, if we failed.
+ *
+ * @return              Where to write the record, or NULL on error.
+ */
+static char *span_extra_reserve(struct htrace_span *span, size_t len,
+                                int *err)
+{
+    struct htrace_span_extra *extra = span->extra, *nextra;
+    size_t used = 0, cap = 0, ncap;
+
+    if (extra) {
+        used = extra->len;
+        cap = extra->cap;
+    }
+    if (sizeof(*extra) + used + len > HTRACE_SPAN_EXTRA_MAX_LEN) {
+        *err = ENOSPC;
+        return NULL;
+    }
+    if (used + len > cap) {
+        ncap = cap ? cap : SPAN_EXTRA_INITIAL_CAP;
+        while (used + len > ncap) {
+            ncap *= 2;
+        }
+        if (sizeof(*extra) + ncap > HTRACE_SPAN_EXTRA_MAX_LEN) {
+            ncap = HTRACE_SPAN_EXTRA_MAX_LEN - sizeof(*extra);
+        }
+        nextra = htrace_realloc(extra, sizeof(*extra) + ncap);
+        if (!nextra) {
+            *err = ENOMEM;
+            return NULL;
+        }
+        if (!extra) {
+            nextra->len = 0;
+            nextra->num_kvs = 0;
+            nextra->num_events = 0;
+        }
+        nextra->cap = ncap;
+        span->extra = extra = nextra;
+    }
+    return extra->buf + extra->len;
+}
+
+int htrace_span_add_kv(struct htrace_span *span, const char *key,
+                       const char *val)
+{
+    return htrace_span_add_kv_len(span, key, strlen(key), val, strlen(val));
+}
+
+int htrace_span_add_kv_len(struct htrace_span *span, const char *key,
+                           size_t key_len, const char *val, size_t val_len)
+{
+    uint16_t len16;
+    char *p;
+    int err;
+
+    if ((key_len > UINT16_MAX) || (val_len > UINT16_MAX)) {
+        return ENOSPC;
+    }
+    p = span_extra_reserve(span, 1 + 2 + 2 + key_len + 1 + val_len + 1, &err);
+    if (!p) {
+        return err;
+    }
+    *p++ = SPAN_EXTRA_KV;
+    len16 = key_len;
+    memcpy(p, &len16, sizeof(len16));
+    p += sizeof(len16);
+    len16 = val_len;
+    memcpy(p, &len16, sizeof(len16));
+    p += sizeof(len16);
+    memcpy(p, key, key_len);
+    p += key_len;
+    *p++ = '\0';
+    memcpy(p, val, val_len);
+    p += val_len;
+    *p++ = '\0';
+    span->extra->len = p - span->extra->buf;
+    span->extra->num_kvs++;
+    return 0;
+}
+
+int htrace_span_add_event(struct htrace_span *span, uint64_t time_ms,
+                          const char *msg)
+{
+    return htrace_span_add_event_len(span, time_ms, msg, strlen(msg));
+}
+
+int htrace_span_add_event_len(struct htrace_span *span, uint64_t time_ms,
+                              const char *msg, size_t msg_len)
+{
+    uint16_t len16;
+    char *p;
+    int err;
+
+    if (msg_len > UINT16_MAX) {
+        return ENOSPC;
+    }
+    p = span_extra_reserve(span, 1 + 8 + 2 + msg_len + 1, &err);
+    if (!p) {
+        return err;
+    }
+    *p++ = SPAN_EXTRA_EVENT;
+    memcpy(p, &time_ms, sizeof(time_ms));
+    p += sizeof(time_ms);
+    len16 = msg_len;
+    memcpy(p, &len16, sizeof(len16));
+    p += sizeof(len16);
+    memcpy(p, msg, msg_len);
+    p += msg_len;
+    *p++ = '\0';
+    span->extra->len = p - span->extra->buf;
+    span->extra->num_events++;
+    return 0;
+}
+
+/**
+ * Decode a record from a span's extra data.
+ *
+ * @param p             The start of the record.
+ * @param rec           (out param) The decoded record.
+ *
+ * @return              The start of the next record.
+ */
+static const char *span_extra_read(const char *p, struct span_extra_rec *rec)
+{
+    rec->type = *p++;
+    if (rec->type == SPAN_EXTRA_KV) {
+        memcpy(&rec->key_len, p, sizeof(rec->key_len));
+        p += sizeof(rec->key_len);
+        memcpy(&rec->val_len, p, sizeof(rec->val_len));
+        p += sizeof(rec->val_len);
+        rec->key = p;
+        p += rec->key_len + 1;
+        rec->val = p;
+        p += rec->val_len + 1;
+    } else {
+        memcpy(&rec->time_ms, p, sizeof(rec->time_ms));
+        p += sizeof(rec->time_ms);
+        memcpy(&rec->key_len, p, sizeof(rec->key_len));
+        p += sizeof(rec->key_len);
+        rec->key = p;
+        p += rec->key_len + 1;
+    }
+    return p;
+}
+
+const char *htrace_span_get_kv(const struct htrace_span *span,
+                               const char *key)
+{
+    const struct htrace_span_extra *extra = span->extra;
+    struct span_extra_rec rec;
+    const char *p, *end, *val = NULL;
+
+    if (!extra) {
+        return NULL;
+    }
+    end = extra->buf + extra->len;
+    for (p = extra->buf; p < end; ) {
+        p = span_extra_read(p, &rec);
+        if ((rec.type == SPAN_EXTRA_KV) && (!strcmp(rec.key, key))) {
+            val = rec.val;
+        }
+    }
+    return val;
+}
+
+/**
+ * Get a span timestamp at the span's timestamp precision.
+ *
+ * @param span              The span.
+ * @param ms                The timestamp in milliseconds.
+ * @param sub_ns            The nanoseconds past ms.
+ *
+ * @return                  The timestamp, in microseconds or nanoseconds.
+ */
+static uint64_t span_precise_ts(const struct htrace_span *span,
+                                uint64_t ms, uint32_t sub_ns)
+{
+    if (span->ts_precision == HTRACE_TS_PRECISION_US) {
+        return (ms * 1000ULL) + (sub_ns / 1000U);
+    }
+    return (ms * 1000000ULL) + sub_ns;
+}
+
+/**
+ * The keys for the precise begin and end times, indexed by
+ * enum htrace_ts_precision.
+ */
+static const char * const SPAN_PRECISE_BEGIN_KEYS[] = { NULL, "bu", "bn" };
+static const char * const SPAN_PRECISE_END_KEYS[] = { NULL, "eu", "en" };
+
+/**
+ * Get the number of CPU use fields which a span serializes.
+ */
+static int span_cpu_num_fields(const struct htrace_span *span)
+{
+    if (span->cpu == HTRACE_SPAN_CPU_OFF) {
+        return 0;
+    }
+    return (span->cpu == HTRACE_SPAN_CPU_RUSAGE) ? 3 : 1;
+}
+
 void htrace_span_free(struct htrace_span *span)
 {
     if (!span) {
         return;
     }
-    free(span->desc);
-    free(span->trid);
-    if (span->num_parents > 1) {
-        free(span->parent.list);
+    if ((!span->interned) && (span->desc != span->desc_buf)) {
+        htrace_free(span->desc);
+    }
+    htrace_free(span->trid);
+    if (span->num_parents > HTRACE_SPAN_INLINE_PARENTS) {
+        htrace_free(span->parent.list);
+    }
+    htrace_free(span->extra);
+    htrace_pool_free(HTRACE_POOL_SPAN, span);
+}
+
+int htrace_span_add_parent(struct htrace_span *span,
+                           const struct htrace_span_id *parent)
+{
+    struct htrace_span_id *ids = HTRACE_SPAN_PARENTS(span), *nlist;
+    int i, num_parents = span->num_parents;
+
+    for (i = 0; i < num_parents; i++) {
+        if (htrace_span_id_compare(ids + i, parent) == 0) {
+            return 0;
+        }
+    }
+    if (num_parents < HTRACE_SPAN_INLINE_PARENTS) {
+        htrace_span_id_copy(span->parent.inl + num_parents, parent);
+    } else if (num_parents == HTRACE_SPAN_INLINE_PARENTS) {
+        // Move the inline parents out to a dynamic allocation.
+        nlist = htrace_malloc(sizeof(struct htrace_span_id) *
+                              (num_parents + 1));
+        if (!nlist) {
+            return ENOMEM;
+        }
+        memcpy(nlist, span->parent.inl,
+               sizeof(struct htrace_span_id) * num_parents);
+        htrace_span_id_copy(nlist + num_parents, parent);
+        span->parent.list = nlist;
+    } else {
+        nlist = htrace_realloc(span->parent.list,
+                        sizeof(struct htrace_span_id) * (num_parents + 1));
+        if (!nlist) {
+            return ENOMEM;
+        }
+        htrace_span_id_copy(nlist + num_parents, parent);
+        span->parent.list = nlist;
+    }
+    span->num_parents = num_parents + 1;
+    return 0;
+}
+
+/**
+ * Sorting networks for the inline parent arrays, indexed by the number of
+ * parents.  Each entry is a list of index pairs to compare and exchange,
+ * terminated by a pair of zeroes.
+ */
+static const uint8_t
+    PARENT_SORT_NETWORKS[HTRACE_SPAN_INLINE_PARENTS + 1][6][2] = {
+    { { 0, 0 } },
+    { { 0, 0 } },
+    { { 0, 1 }, { 0, 0 } },
+    { { 1, 2 }, { 0, 2 }, { 0, 1 }, { 0, 0 } },
+    { { 0, 1 }, { 2, 3 }, { 0, 2 }, { 1, 3 }, { 1, 2 }, { 0, 0 } },
+};
+
+/**
+ * Sort a small array of span IDs with the sorting network for its length.
+ */
+static void htrace_span_id_sort_small(struct htrace_span_id *ids, int num)
+{
+    const uint8_t (*net)[2] = PARENT_SORT_NETWORKS[num];
+    struct htrace_span_id tmp;
+    int i;
+
+    for (i = 0; net[i][0] != net[i][1]; i++) {
+        struct htrace_span_id *a = ids + net[i][0], *b = ids + net[i][1];
+        if (htrace_span_id_compare(a, b) > 0) {
+            tmp = *a;
+            *a = *b;
+            *b = tmp;
+        }
     }
-    free(span);
 }
 
 typedef int (*qsort_fn_t)(const void *, const void *);
@@ -80,40 +506,93 @@ typedef int (*qsort_fn_t)(const void *, const void *);
 void htrace_span_sort_and_dedupe_parents(struct htrace_span *span)
 {
     int i, j, num_parents = span->num_parents;
-    struct htrace_span_id prev;
+    struct htrace_span_id *ids, *nlist;
 
     if (num_parents <= 1) {
         return;
     }
-    qsort(span->parent.list, num_parents, sizeof(struct htrace_span_id),
-          (qsort_fn_t)htrace_span_id_compare);
-    prev = span->parent.list[0];
-    htrace_span_id_copy(&prev, &span->parent.list[0]);
+    ids = HTRACE_SPAN_PARENTS(span);
+    if (num_parents <= HTRACE_SPAN_INLINE_PARENTS) {
+        htrace_span_id_sort_small(ids, num_parents);
+    } else {
+        qsort(ids, num_parents, sizeof(struct htrace_span_id),
+              (qsort_fn_t)htrace_span_id_compare);
+    }
     j = 1;
     for (i = 1; i < num_parents; i++) {
-        if (htrace_span_id_compare(&prev, span->parent.list + i) != 0) {
-            htrace_span_id_copy(&prev, span->parent.list + i);
-            htrace_span_id_copy(span->parent.list + j, span->parent.list + i);
+        if (htrace_span_id_compare(ids + j - 1, ids + i) != 0) {
+            htrace_span_id_copy(ids + j, ids + i);
             j++;
         }
     }
     span->num_parents = j;
-    if (j == 1) {
-        // After deduplication, there is now only one entry.  Switch to the
-        // optimized no-malloc representation for 1 entry.
-        free(span->parent.list);
-        span->parent.single = prev;
+    if (num_parents <= HTRACE_SPAN_INLINE_PARENTS) {
+        return;
+    }
+    if (j <= HTRACE_SPAN_INLINE_PARENTS) {
+        // After deduplication, the parents fit in the span again.  Switch
+        // back to the no-malloc representation.
+        memcpy(span->parent.inl, ids, sizeof(struct htrace_span_id) * j);
+        htrace_free(ids);
     } else if (j != num_parents) {
         // After deduplication, there are now fewer entries.  Use realloc to
         // shrink the size of our dynamic allocation if possible.
-        struct htrace_span_id *nlist =
-            realloc(span->parent.list, sizeof(struct htrace_span_id) * j);
+        nlist = htrace_realloc(ids, sizeof(struct htrace_span_id) * j);
         if (nlist) {
             span->parent.list = nlist;
         }
     }
 }
 
+/**
+ * Write the key/value annotations and timeline events of a span as JSON.
+ *
+ * @param extra             The span's extra data.
+ * @param buf               (inout) Where to write, or NULL.
+ * @param max               (inout) The number of bytes left in buf.
+ *
+ * @return                  The number of bytes this takes up.
+ */
+static int span_json_sprintf_extra(const struct htrace_span_extra *extra,
+                                   char **buf, int *max)
+{
+    struct span_extra_rec rec;
+    const char *p, *end = extra->buf + extra->len;
+    const char *prefix;
+    int ret = 0;
+
+    // As with the description, the strings were validated when they were
+    // added, so they don't need escaping.
+    if (extra->num_kvs) {
+        ret += fwdprintf(buf, max, ",\"n\":{");
+        prefix = "";
+        for (p = extra->buf; p < end; ) {
+            p = span_extra_read(p, &rec);
+            if (rec.type == SPAN_EXTRA_KV) {
+                ret += fwdprintf(buf, max, "%s\"%s\":\"%s\"",
+                                 prefix, rec.key, rec.val);
+                prefix = ",";
+            }
+        }
+        ret += fwdprintf(buf, max, "}");
+    }
+    if (extra->num_events) {
+        ret += fwdprintf(buf, max, ",\"t\":[");
+        prefix = "";
+        for (p = extra->buf; p < end; ) {
+            p = span_extra_read(p, &rec);
+            if (rec.type == SPAN_EXTRA_EVENT) {
+                ret += fwdprintf(buf, max, "%s{\"t\":%" PRIu64
+                                 ",\"m\":\"%s\"}", prefix,
+                                 rec.time_ms, rec.key);
+                prefix = ",";
+            }
+        }
+        ret += fwdprintf(buf, max, "]");
+    }
+    return ret;
+}
+
 /**
  * Translate the span to a JSON string.
  *
@@ -144,6 +623,20 @@ static int span_json_sprintf_impl(const struct htrace_span *span,
     ret += fwdprintf(&buf, &max, "{\"a\":\"%s\",\"b\":%" PRId64
                  ",\"e\":%" PRId64",", sbuf, span->begin_ms,
                  span->end_ms);
+    if (span->ts_precision != HTRACE_TS_PRECISION_MS) {
+        ret += fwdprintf(&buf, &max, "\"%s\":%" PRIu64 ",\"%s\":%" PRIu64
+                 ",", SPAN_PRECISE_BEGIN_KEYS[span->ts_precision],
+                 span_precise_ts(span, span->begin_ms, span->begin_sub_ns),
+                 SPAN_PRECISE_END_KEYS[span->ts_precision],
+                 span_precise_ts(span, span->end_ms, span->end_sub_ns));
+    }
+    if (span->cpu != HTRACE_SPAN_CPU_OFF) {
+        ret += fwdprintf(&buf, &max, "\"cn\":%" PRIu64 ",", span->cpu_ns);
+    }
+    if (span->cpu == HTRACE_SPAN_CPU_RUSAGE) {
+        ret += fwdprintf(&buf, &max, "\"cv\":%" PRIu32 ",\"ci\":%" PRIu32
+                 ",", span->vol_csw, span->invol_csw);
+    }
     if (span->desc[0]) {
         ret += fwdprintf(&buf, &max, "\"d\":\"%s\",", span->desc);
     }
@@ -157,14 +650,18 @@ static int span_json_sprintf_impl(const struct htrace_span *span,
         htrace_span_id_to_str(&span->parent.single, sbuf, sizeof(sbuf));
         ret += fwdprintf(&buf, &max, "\"p\":[\"%s\"]", sbuf);
     } else if (num_parents > 1) {
+        const struct htrace_span_id *ids = HTRACE_SPAN_PARENTS(span);
         ret += fwdprintf(&buf, &max, "\"p\":[");
         for (i = 0; i < num_parents; i++) {
-            htrace_span_id_to_str(span->parent.list + i, sbuf, sizeof(sbuf));
+            htrace_span_id_to_str(ids + i, sbuf, sizeof(sbuf));
             ret += fwdprintf(&buf, &max, "%s\"%s\"", prefix, sbuf);
             prefix = ",";
         }
         ret += fwdprintf(&buf, &max, "]");
     }
+    if (span->extra) {
+        ret += span_json_sprintf_extra(span->extra, &buf, &max);
+    }
     ret += fwdprintf(&buf, &max, "}");
     // Add one to 'ret' to take into account the terminating null that we
     // need to write.
@@ -181,6 +678,302 @@ void span_json_sprintf(const struct htrace_span *span, int max, void *buf)
     span_json_sprintf_impl(span, max, buf);
 }
 
+/*
+ * The streaming JSON writer.  This produces exactly the same text as
+ * span_json_sprintf, without any printf-family calls, so the two must be
+ * changed together.
+ */
+
+/**
+ * The longest decimal representation of a 64-bit integer, with its sign.
+ */
+#define JSON_INT_MAX_LEN 20
+
+/**
+ * The JSON for a span ID, with its quotes.
+ */
+#define JSON_ID_LEN (HTRACE_SPAN_ID_STRING_LENGTH + 2)
+
+/**
+ * Every number below 100 as two decimal digits.
+ */
+static const char DEC_PAIRS[] =
+    "00010203040506070809" "10111213141516171819"
+    "20212223242526272829" "30313233343536373839"
+    "40414243444546474849" "50515253545556575859"
+    "60616263646566676869" "70717273747576777879"
+    "80818283848586878889" "90919293949596979899";
+
+static inline char *json_put_raw(char *p, const char *str, size_t len)
+{
+    memcpy(p, str, len);
+    return p + len;
+}
+
+/**
+ * Append a constant string.
+ */
+#define JSON_PUT_LIT(p, lit) json_put_raw(p, lit, sizeof(lit) - 1)
+
+static char *json_put_u64(char *p, uint64_t val)
+{
+    char tmp[JSON_INT_MAX_LEN];
+    char *t = tmp + sizeof(tmp);
+
+    // Work from the end, two digits at a time.
+    while (val >= 100) {
+        t -= 2;
+        memcpy(t, DEC_PAIRS + (2 * (val % 100)), 2);
+        val /= 100;
+    }
+    if (val >= 10) {
+        t -= 2;
+        memcpy(t, DEC_PAIRS + (2 * val), 2);
+    } else {
+        *--t = '0' + val;
+    }
+    return json_put_raw(p, t, (tmp + sizeof(tmp)) - t);
+}
+
+static char *json_put_i64(char *p, int64_t val)
+{
+    if (val < 0) {
+        *p++ = '-';
+        return json_put_u64(p, -(uint64_t)val);
+    }
+    return json_put_u64(p, val);
+}
+
+/**
+ * Append a quoted string.  The strings in a span were validated when they
+ * were added, so they don't need escaping.
+ */
+static inline char *json_put_str(char *p, const char *str, size_t len)
+{
+    *p++ = '"';
+    p = json_put_raw(p, str, len);
+    *p++ = '"';
+    return p;
+}
+
+static inline char *json_put_id(char *p, const struct htrace_span_id *id)
+{
+    char sbuf[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+
+    htrace_span_id_to_str(id, sbuf, sizeof(sbuf));
+    return json_put_str(p, sbuf, HTRACE_SPAN_ID_STRING_LENGTH);
+}
+
+size_t span_json_max_size(const struct htrace_span *span)
+{
+    const struct htrace_span_extra *extra = span->extra;
+    size_t size;
+
+    // {"a":ID,"b":N,"e":N, and "d":"",
+    size = 5 + JSON_ID_LEN + 5 + JSON_INT_MAX_LEN + 5 + JSON_INT_MAX_LEN +
+        1 + 7 + strlen(span->desc);
+    if (span->ts_precision != HTRACE_TS_PRECISION_MS) {
+        // "bu":N,"eu":N,
+        size += 2 * (6 + JSON_INT_MAX_LEN);
+    }
+    // "cn":N,"cv":N,"ci":N,
+    size += span_cpu_num_fields(span) * (6 + JSON_INT_MAX_LEN);
+    if (span->trid) {
+        // "r":"",
+        size += 7 + strlen(span->trid);
+    }
+    // "p":[ID,...]}
+    size += 6 + (span->num_parents * (JSON_ID_LEN + 1)) + 1;
+    if (extra) {
+        // A key/value record has five bytes of type and lengths, and two NUL
+        // terminators, which is more than the ,"":"" around it in JSON.  An
+        // event record has eleven bytes of type, time and length, and a NUL
+        // terminator, where JSON has ,{"t":N,"m":""}.
+        size += extra->len + (extra->num_events * (13 + JSON_INT_MAX_LEN));
+        // ,"n":{} and ,"t":[]
+        size += 14;
+    }
+    return size;
+}
+
+/**
+ * Write the key/value annotations and timeline events of a span as JSON.
+ * See span_json_sprintf_extra.
+ */
+static char *span_json_write_extra(const struct htrace_span_extra *extra,
+                                   char *p)
+{
+    struct span_extra_rec rec;
+    const char *r, *end = extra->buf + extra->len;
+    int first;
+
+    if (extra->num_kvs) {
+        p = JSON_PUT_LIT(p, ",\"n\":{");
+        first = 1;
+        for (r = extra->buf; r < end; ) {
+            r = span_extra_read(r, &rec);
+            if (rec.type == SPAN_EXTRA_KV) {
+                if (!first) {
+                    *p++ = ',';
+                }
+                first = 0;
+                p = json_put_str(p, rec.key, rec.key_len);
+                *p++ = ':';
+                p = json_put_str(p, rec.val, rec.val_len);
+            }
+        }
+        *p++ = '}';
+    }
+    if (extra->num_events) {
+        p = JSON_PUT_LIT(p, ",\"t\":[");
+        first = 1;
+        for (r = extra->buf; r < end; ) {
+            r = span_extra_read(r, &rec);
+            if (rec.type == SPAN_EXTRA_EVENT) {
+                if (!first) {
+                    *p++ = ',';
+                }
+                first = 0;
+                p = JSON_PUT_LIT(p, "{\"t\":");
+                p = json_put_u64(p, rec.time_ms);
+                p = JSON_PUT_LIT(p, ",\"m\":");
+                p = json_put_str(p, rec.key, rec.key_len);
+                *p++ = '}';
+            }
+        }
+        *p++ = ']';
+    }
+    return p;
+}
+
+size_t span_json_write(const struct htrace_span *span, char *buf)
+{
+    const struct htrace_span_id *ids;
+    char *p = buf;
+    int i, num_parents;
+
+    p = JSON_PUT_LIT(p, "{\"a\":");
+    p = json_put_id(p, &span->span_id);
+    p = JSON_PUT_LIT(p, ",\"b\":");
+    p = json_put_i64(p, span->begin_ms);
+    p = JSON_PUT_LIT(p, ",\"e\":");
+    p = json_put_i64(p, span->end_ms);
+    *p++ = ',';
+    if (span->ts_precision != HTRACE_TS_PRECISION_MS) {
+        *p++ = '"';
+        p = json_put_raw(p, SPAN_PRECISE_BEGIN_KEYS[span->ts_precision], 2);
+        p = JSON_PUT_LIT(p, "\":");
+        p = json_put_u64(p, span_precise_ts(span, span->begin_ms,
+                                            span->begin_sub_ns));
+        p = JSON_PUT_LIT(p, ",\"");
+        p = json_put_raw(p, SPAN_PRECISE_END_KEYS[span->ts_precision], 2);
+        p = JSON_PUT_LIT(p, "\":");
+        p = json_put_u64(p, span_precise_ts(span, span->end_ms,
+                                            span->end_sub_ns));
+        *p++ = ',';
+    }
+    if (span->cpu != HTRACE_SPAN_CPU_OFF) {
+        p = JSON_PUT_LIT(p, "\"cn\":");
+        p = json_put_u64(p, span->cpu_ns);
+        *p++ = ',';
+    }
+    if (span->cpu == HTRACE_SPAN_CPU_RUSAGE) {
+        p = JSON_PUT_LIT(p, "\"cv\":");
+        p = json_put_u64(p, span->vol_csw);
+        p = JSON_PUT_LIT(p, ",\"ci\":");
+        p = json_put_u64(p, span->invol_csw);
+        *p++ = ',';
+    }
+    if (span->desc[0]) {
+        p = JSON_PUT_LIT(p, "\"d\":");
+        p = json_put_str(p, span->desc, strlen(span->desc));
+        *p++ = ',';
+    }
+    if (span->trid) {
+        p = JSON_PUT_LIT(p, "\"r\":");
+        p = json_put_str(p, span->trid, strlen(span->trid));
+        *p++ = ',';
+    }
+    p = JSON_PUT_LIT(p, "\"p\":[");
+    num_parents = span->num_parents;
+    ids = HTRACE_SPAN_PARENTS(span);
+    for (i = 0; i < num_parents; i++) {
+        if (i > 0) {
+            *p++ = ',';
+        }
+        p = json_put_id(p, ids + i);
+    }
+    *p++ = ']';
+    if (span->extra) {
+        p = span_json_write_extra(span->extra, p);
+    }
+    *p++ = '}';
+    return p - buf;
+}
+
+/**
+ * Write the key/value annotations and timeline events of a span as msgpack.
+ * The key/value annotations go in a map under "n", and the events in an array
+ * of {"t": time, "m": message} maps under "t".
+ */
+static int span_write_msgpack_extra(const struct htrace_span_extra *extra,
+                                    cmp_ctx_t *ctx)
+{
+    struct span_extra_rec rec;
+    const char *p, *end = extra->buf + extra->len;
+
+    if (extra->num_kvs) {
+        if (!cmp_write_fixstr(ctx, "n", 1)) {
+            return 0;
+        }
+        if (!cmp_write_map16(ctx, extra->num_kvs)) {
+            return 0;
+        }
+        for (p = extra->buf; p < end; ) {
+            p = span_extra_read(p, &rec);
+            if (rec.type != SPAN_EXTRA_KV) {
+                continue;
+            }
+            if (!cmp_write_str16(ctx, rec.key, rec.key_len)) {
+                return 0;
+            }
+            if (!cmp_write_str16(ctx, rec.val, rec.val_len)) {
+                return 0;
+            }
+        }
+    }
+    if (extra->num_events) {
+        if (!cmp_write_fixstr(ctx, "t", 1)) {
+            return 0;
+        }
+        if (!cmp_write_array16(ctx, extra->num_events)) {
+            return 0;
+        }
+        for (p = extra->buf; p < end; ) {
+            p = span_extra_read(p, &rec);
+            if (rec.type != SPAN_EXTRA_EVENT) {
+                continue;
+            }
+            if (!cmp_write_fixmap(ctx, 2)) {
+                return 0;
+            }
+            if (!cmp_write_fixstr(ctx, "t", 1)) {
+                return 0;
+            }
+            if (!cmp_write_u64(ctx, rec.time_ms)) {
+                return 0;
+            }
+            if (!cmp_write_fixstr(ctx, "m", 1)) {
+                return 0;
+            }
+            if (!cmp_write_str16(ctx, rec.key, rec.key_len)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
 int span_write_msgpack(const struct htrace_span *span, cmp_ctx_t *ctx)
 {
     int i, num_parents;
@@ -191,12 +984,24 @@ int span_write_msgpack(const struct htrace_span *span, cmp_ctx_t *ctx)
         1; // span_id
 
     num_parents = span->num_parents;
+    if (span->ts_precision != HTRACE_TS_PRECISION_MS) {
+        map_size += 2;
+    }
+    map_size += span_cpu_num_fields(span);
     if (span->trid) {
         map_size++;
     }
     if (num_parents > 0) {
         map_size++;
     }
+    if (span->extra) {
+        if (span->extra->num_kvs) {
+            map_size++;
+        }
+        if (span->extra->num_events) {
+            map_size++;
+        }
+    }
     if (!cmp_write_map16(ctx, map_size)) {
         return 0;
     }
@@ -224,6 +1029,46 @@ int span_write_msgpack(const struct htrace_span *span, cmp_ctx_t *ctx)
     if (!cmp_write_u64(ctx, span->end_ms)) {
         return 0;
     }
+    if (span->ts_precision != HTRACE_TS_PRECISION_MS) {
+        if (!cmp_write_fixstr(ctx, SPAN_PRECISE_BEGIN_KEYS[span->ts_precision],
+                              2)) {
+            return 0;
+        }
+        if (!cmp_write_u64(ctx, span_precise_ts(span, span->begin_ms,
+                                                span->begin_sub_ns))) {
+            return 0;
+        }
+        if (!cmp_write_fixstr(ctx, SPAN_PRECISE_END_KEYS[span->ts_precision],
+                              2)) {
+            return 0;
+        }
+        if (!cmp_write_u64(ctx, span_precise_ts(span, span->end_ms,
+                                                span->end_sub_ns))) {
+            return 0;
+        }
+    }
+    if (span->cpu != HTRACE_SPAN_CPU_OFF) {
+        if (!cmp_write_fixstr(ctx, "cn", 2)) {
+            return 0;
+        }
+        if (!cmp_write_u64(ctx, span->cpu_ns)) {
+            return 0;
+        }
+    }
+    if (span->cpu == HTRACE_SPAN_CPU_RUSAGE) {
+        if (!cmp_write_fixstr(ctx, "cv", 2)) {
+            return 0;
+        }
+        if (!cmp_write_u64(ctx, span->vol_csw)) {
+            return 0;
+        }
+        if (!cmp_write_fixstr(ctx, "ci", 2)) {
+            return 0;
+        }
+        if (!cmp_write_u64(ctx, span->invol_csw)) {
+            return 0;
+        }
+    }
     if (span->trid) {
         if (!cmp_write_fixstr(ctx, "r", 1)) {
             return 0;
@@ -239,19 +1084,242 @@ int span_write_msgpack(const struct htrace_span *span, cmp_ctx_t *ctx)
         if (!cmp_write_array16(ctx, num_parents)) {
             return 0;
         }
-        if (num_parents == 1) {
-            if (!htrace_span_id_write_msgpack(&span->parent.single, ctx)) {
+        for (i = 0; i < num_parents; i++) {
+            if (!htrace_span_id_write_msgpack(HTRACE_SPAN_PARENTS(span) + i,
+                                              ctx)) {
                 return 0;
             }
-        } else {
-            for (i = 0; i < num_parents; i++) {
-                if (!htrace_span_id_write_msgpack(span->parent.list + i, ctx)) {
-                    return 0;
-                }
-            }
+        }
+    }
+    if (span->extra) {
+        if (!span_write_msgpack_extra(span->extra, ctx)) {
+            return 0;
         }
     }
     return 1;
 }
 
+/*
+ * The direct msgpack encoder.  This produces exactly the same bytes as
+ * span_write_msgpack, so the two must be changed together.  Each field has
+ * the same encoding every time: keys are fixstrs, strings are str16s,
+ * numbers are u64s, span IDs are 16-byte bin8s, and the map and arrays have
+ * 16-bit lengths.
+ */
+#define MSGPACK_KEY_LEN(klen) (1 + (klen))
+#define MSGPACK_STR16_LEN(slen) (3 + (slen))
+#define MSGPACK_U64_LEN 9
+#define MSGPACK_ID_LEN (2 + HTRACE_SPAN_ID_NUM_BYTES)
+#define MSGPACK_HDR16_LEN 3
+
+/*
+ * The records in span->extra are almost the same size as their msgpack
+ * encodings.  A key/value record has a type byte, two 2-byte lengths and two
+ * NUL terminators, where msgpack has two 3-byte str16 headers: one byte less.
+ * An event record has a type byte, an 8-byte time, a 2-byte length and a
+ * NUL terminator, where msgpack has a fixmap, two keys, a u64 and a str16
+ * header: five bytes more.
+ */
+#define MSGPACK_KV_SHRINK 1
+#define MSGPACK_EVENT_GROWTH 5
+
+static inline uint8_t *msgpack_put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
+}
+
+static inline uint8_t *msgpack_put_be64(uint8_t *p, uint64_t v)
+{
+    p[0] = v >> 56;
+    p[1] = v >> 48;
+    p[2] = v >> 40;
+    p[3] = v >> 32;
+    p[4] = v >> 24;
+    p[5] = v >> 16;
+    p[6] = v >> 8;
+    p[7] = v;
+    return p + 8;
+}
+
+static inline uint8_t *msgpack_put_key(uint8_t *p, const char *key,
+                                       uint8_t klen)
+{
+    *p++ = 0xa0 | klen;
+    memcpy(p, key, klen);
+    return p + klen;
+}
+
+static inline uint8_t *msgpack_put_str16(uint8_t *p, const char *str,
+                                         uint16_t slen)
+{
+    *p++ = 0xda;
+    p = msgpack_put_be16(p, slen);
+    memcpy(p, str, slen);
+    return p + slen;
+}
+
+static inline uint8_t *msgpack_put_u64(uint8_t *p, uint64_t v)
+{
+    *p++ = 0xcf;
+    return msgpack_put_be64(p, v);
+}
+
+static inline uint8_t *msgpack_put_id(uint8_t *p,
+                                      const struct htrace_span_id *id)
+{
+    *p++ = 0xc4;
+    *p++ = HTRACE_SPAN_ID_NUM_BYTES;
+    p = msgpack_put_be64(p, id->high);
+    return msgpack_put_be64(p, id->low);
+}
+
+uint64_t span_msgpack_size(const struct htrace_span *span)
+{
+    uint64_t size;
+    const struct htrace_span_extra *extra = span->extra;
+
+    // The str16 lengths are truncated just as cmp_write_str16 truncates them.
+    size = MSGPACK_HDR16_LEN +
+        MSGPACK_KEY_LEN(1) + MSGPACK_ID_LEN +
+        MSGPACK_KEY_LEN(1) + MSGPACK_STR16_LEN((uint16_t)strlen(span->desc)) +
+        2 * (MSGPACK_KEY_LEN(1) + MSGPACK_U64_LEN);
+    if (span->ts_precision != HTRACE_TS_PRECISION_MS) {
+        size += 2 * (MSGPACK_KEY_LEN(2) + MSGPACK_U64_LEN);
+    }
+    size += span_cpu_num_fields(span) * (MSGPACK_KEY_LEN(2) + MSGPACK_U64_LEN);
+    if (span->trid) {
+        size += MSGPACK_KEY_LEN(1) +
+            MSGPACK_STR16_LEN((uint16_t)strlen(span->trid));
+    }
+    if (span->num_parents > 0) {
+        size += MSGPACK_KEY_LEN(1) + MSGPACK_HDR16_LEN +
+            ((uint64_t)span->num_parents * MSGPACK_ID_LEN);
+    }
+    if (extra) {
+        size += extra->len - (extra->num_kvs * MSGPACK_KV_SHRINK) +
+            (extra->num_events * MSGPACK_EVENT_GROWTH);
+        if (extra->num_kvs) {
+            size += MSGPACK_KEY_LEN(1) + MSGPACK_HDR16_LEN;
+        }
+        if (extra->num_events) {
+            size += MSGPACK_KEY_LEN(1) + MSGPACK_HDR16_LEN;
+        }
+    }
+    return size;
+}
+
+/**
+ * Encode the key/value annotations and timeline events of a span.  See
+ * span_write_msgpack_extra.
+ */
+static uint8_t *span_msgpack_encode_extra(
+        const struct htrace_span_extra *extra, uint8_t *p)
+{
+    struct span_extra_rec rec;
+    const char *r, *end = extra->buf + extra->len;
+
+    if (extra->num_kvs) {
+        p = msgpack_put_key(p, "n", 1);
+        *p++ = 0xde;
+        p = msgpack_put_be16(p, extra->num_kvs);
+        for (r = extra->buf; r < end; ) {
+            r = span_extra_read(r, &rec);
+            if (rec.type == SPAN_EXTRA_KV) {
+                p = msgpack_put_str16(p, rec.key, rec.key_len);
+                p = msgpack_put_str16(p, rec.val, rec.val_len);
+            }
+        }
+    }
+    if (extra->num_events) {
+        p = msgpack_put_key(p, "t", 1);
+        *p++ = 0xdc;
+        p = msgpack_put_be16(p, extra->num_events);
+        for (r = extra->buf; r < end; ) {
+            r = span_extra_read(r, &rec);
+            if (rec.type == SPAN_EXTRA_EVENT) {
+                *p++ = 0x82;
+                p = msgpack_put_key(p, "t", 1);
+                p = msgpack_put_u64(p, rec.time_ms);
+                p = msgpack_put_key(p, "m", 1);
+                p = msgpack_put_str16(p, rec.key, rec.key_len);
+            }
+        }
+    }
+    return p;
+}
+
+uint64_t span_msgpack_encode(const struct htrace_span *span, uint8_t *buf)
+{
+    const struct htrace_span_id *parents;
+    uint8_t *p = buf;
+    uint16_t map_size = 4;
+    int i, num_parents = span->num_parents;
+
+    if (span->ts_precision != HTRACE_TS_PRECISION_MS) {
+        map_size += 2;
+    }
+    map_size += span_cpu_num_fields(span);
+    if (span->trid) {
+        map_size++;
+    }
+    if (num_parents > 0) {
+        map_size++;
+    }
+    if (span->extra) {
+        if (span->extra->num_kvs) {
+            map_size++;
+        }
+        if (span->extra->num_events) {
+            map_size++;
+        }
+    }
+    *p++ = 0xde;
+    p = msgpack_put_be16(p, map_size);
+    p = msgpack_put_key(p, "a", 1);
+    p = msgpack_put_id(p, &span->span_id);
+    p = msgpack_put_key(p, "d", 1);
+    p = msgpack_put_str16(p, span->desc, strlen(span->desc));
+    p = msgpack_put_key(p, "b", 1);
+    p = msgpack_put_u64(p, span->begin_ms);
+    p = msgpack_put_key(p, "e", 1);
+    p = msgpack_put_u64(p, span->end_ms);
+    if (span->ts_precision != HTRACE_TS_PRECISION_MS) {
+        p = msgpack_put_key(p, SPAN_PRECISE_BEGIN_KEYS[span->ts_precision], 2);
+        p = msgpack_put_u64(p, span_precise_ts(span, span->begin_ms,
+                                               span->begin_sub_ns));
+        p = msgpack_put_key(p, SPAN_PRECISE_END_KEYS[span->ts_precision], 2);
+        p = msgpack_put_u64(p, span_precise_ts(span, span->end_ms,
+                                               span->end_sub_ns));
+    }
+    if (span->cpu != HTRACE_SPAN_CPU_OFF) {
+        p = msgpack_put_key(p, "cn", 2);
+        p = msgpack_put_u64(p, span->cpu_ns);
+    }
+    if (span->cpu == HTRACE_SPAN_CPU_RUSAGE) {
+        p = msgpack_put_key(p, "cv", 2);
+        p = msgpack_put_u64(p, span->vol_csw);
+        p = msgpack_put_key(p, "ci", 2);
+        p = msgpack_put_u64(p, span->invol_csw);
+    }
+    if (span->trid) {
+        p = msgpack_put_key(p, "r", 1);
+        p = msgpack_put_str16(p, span->trid, strlen(span->trid));
+    }
+    if (num_parents > 0) {
+        parents = HTRACE_SPAN_PARENTS(span);
+        p = msgpack_put_key(p, "p", 1);
+        *p++ = 0xdc;
+        p = msgpack_put_be16(p, num_parents);
+        for (i = 0; i < num_parents; i++) {
+            p = msgpack_put_id(p, parents + i);
+        }
+    }
+    if (span->extra) {
+        p = span_msgpack_encode_extra(span->extra, p);
+    }
+    return p - buf;
+}
+
 // vim:ts=4:sw=4:et
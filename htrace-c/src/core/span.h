@@ -30,18 +30,117 @@
 #include "core/htrace.h" /* for struct span_id */
 #include "core/span_id.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
 struct cmp_ctx_s;
 struct htracer;
 
+/**
+ * The size of the inline description buffer in each span.  This brings
+ * struct htrace_span to 192 bytes on LP64 platforms.
+ */
+#define HTRACE_SPAN_DESC_BUF_LEN 24
+
+/**
+ * The most parents which a span can hold without a separate allocation.
+ */
+#define HTRACE_SPAN_INLINE_PARENTS 4
+
+/**
+ * Get the array of parent IDs of a span.  There are span->num_parents of
+ * them.
+ */
+#define HTRACE_SPAN_PARENTS(span) \
+    (((span)->num_parents > HTRACE_SPAN_INLINE_PARENTS) ? \
+        (span)->parent.list : (span)->parent.inl)
+
+/**
+ * The most bytes of key/value annotations and timeline events which a span
+ * can hold, including their bookkeeping.
+ */
+#define HTRACE_SPAN_EXTRA_MAX_LEN 65536
+
+/**
+ * The annotation key which marks a span as having failed.
+ */
+#define HTRACE_SPAN_ERROR_KEY "error"
+
+/**
+ * The key/value annotations and timeline events of a span.
+ *
+ * These are kept as a sequence of records in a single allocation, which is
+ * grown as needed.  Each record starts with a one-byte type.  A key/value
+ * record follows that with the 16-bit key and value lengths, then the
+ * NUL-terminated key and value.  An event record follows it with the 64-bit
+ * time in milliseconds and the 16-bit message length, then the NUL-terminated
+ * message.  Numbers are in host byte order and are not aligned.
+ */
+struct htrace_span_extra {
+    /**
+     * The number of bytes of buf in use.
+     */
+    uint32_t len;
+
+    /**
+     * The number of bytes allocated for buf.
+     */
+    uint32_t cap;
+
+    /**
+     * The number of key/value records.
+     */
+    uint16_t num_kvs;
+
+    /**
+     * The number of event records.
+     */
+    uint16_t num_events;
+
+    /**
+     * The records.
+     */
+    char buf[];
+};
+
+/**
+ * The precision of the timestamps we send for a span.
+ *
+ * Every span has begin and end times in milliseconds, under the "b" and "e"
+ * keys.  Spans with a higher precision also have them in microseconds, under
+ * "bu" and "eu", or in nanoseconds, under "bn" and "en".  Older servers
+ * ignore the extra keys.
+ */
+enum htrace_ts_precision {
+    HTRACE_TS_PRECISION_MS = 0,
+    HTRACE_TS_PRECISION_US,
+    HTRACE_TS_PRECISION_NS,
+};
+
+/**
+ * What a span measures about the CPU use of the thread which started it.
+ * See HTRACE_SPAN_CPU_KEY.
+ */
+enum htrace_span_cpu {
+    HTRACE_SPAN_CPU_OFF = 0,
+    HTRACE_SPAN_CPU_TIME,
+    HTRACE_SPAN_CPU_RUSAGE,
+};
+
 struct htrace_span {
     /**
      * The name of this trace scope.
-     * Dynamically allocated.  Will never be NULL.
+     * Points to desc_buf, to the string of the interned description, or to a
+     * dynamic allocation.  Will never be NULL.
      */
     char *desc;
 
+    /**
+     * The interned description this span was started with, or NULL if desc
+     * is not interned.
+     */
+    const struct htrace_desc *interned;
+
     /**
      * The beginning time in wall-clock milliseconds.
      */
@@ -68,23 +167,97 @@ struct htrace_span {
      */
     int num_parents;
 
+    /**
+     * The timestamp precision to serialize this span with.  An
+     * enum htrace_ts_precision.
+     */
+    uint8_t ts_precision;
+
+    /**
+     * Nonzero if this span had no parent in this process when it was
+     * started, so that it is the root of its trace here.
+     */
+    uint8_t local_root;
+
+    /**
+     * The priority of the span.  HTRACE_PRIORITY_NORMAL or
+     * HTRACE_PRIORITY_HIGH.
+     */
+    uint8_t priority;
+
+    /**
+     * What the span measures about CPU use.  An enum htrace_span_cpu.
+     */
+    uint8_t cpu;
+
+    /**
+     * The number of nanoseconds past begin_ms that the span began.
+     */
+    uint32_t begin_sub_ns;
+
+    /**
+     * The number of nanoseconds past end_ms that the span ended.
+     */
+    uint32_t end_sub_ns;
+
+    /**
+     * The thread CPU time used during the span, in nanoseconds.  While the
+     * span is open, this is the thread's CPU time when it began.  Only valid
+     * if cpu is not HTRACE_SPAN_CPU_OFF.
+     */
+    uint64_t cpu_ns;
+
+    /**
+     * The number of voluntary and involuntary context switches during the
+     * span.  While the span is open, these are the thread's totals when it
+     * began.  Only valid if cpu is HTRACE_SPAN_CPU_RUSAGE.
+     */
+    uint32_t vol_csw;
+    uint32_t invol_csw;
+
     union {
         /**
-         * If there is 1 parent, this is the parent ID.
+         * If there is 1 parent, this is the parent ID.  The same as inl[0].
          */
         struct htrace_span_id single;
 
         /**
-         * If there are multiple parents, this is a pointer to a dynamically
-         * allocated array of parent IDs.
+         * If there are no more than HTRACE_SPAN_INLINE_PARENTS parents, these
+         * are the parent IDs.
+         */
+        struct htrace_span_id inl[HTRACE_SPAN_INLINE_PARENTS];
+
+        /**
+         * If there are more than HTRACE_SPAN_INLINE_PARENTS parents, this is
+         * a pointer to a dynamically allocated array of parent IDs.
          */
         struct htrace_span_id *list;
     } parent;
+
+    /**
+     * The key/value annotations and timeline events, or NULL if there are
+     * none.  Dynamically allocated.
+     */
+    struct htrace_span_extra *extra;
+
+    /**
+     * Links closed spans into a queue.  Only used by span receivers which
+     * have taken ownership of the span through take_span.
+     */
+    struct htrace_span *next;
+
+    /**
+     * Storage for short descriptions, so that they don't need their own
+     * allocation.
+     */
+    char desc_buf[HTRACE_SPAN_DESC_BUF_LEN];
 };
 
 /**
  * Allocate an htrace span.
  *
+ * Spans are allocated from the calling thread's span pool.
+ *
  * @param desc          The span name to use.  Will be deep-copied.
  * @param begin_ms      The value to use for begin_ms.
  * @param span_id       The span ID to use.
@@ -94,6 +267,122 @@ struct htrace_span {
 struct htrace_span *htrace_span_alloc(const char *desc,
                 uint64_t begin_ms, struct htrace_span_id *span_id);
 
+/**
+ * Allocate an htrace span, with a description which need not be
+ * NUL-terminated.
+ *
+ * @param desc          The span name to use.  Will be deep-copied.
+ * @param desc_len      The length of the span name.
+ * @param begin_ms      The value to use for begin_ms.
+ * @param span_id       The span ID to use.
+ *
+ * @return              NULL on OOM; the span otherwise.
+ */
+struct htrace_span *htrace_span_alloc_len(const char *desc, size_t desc_len,
+                uint64_t begin_ms, struct htrace_span_id *span_id);
+
+/**
+ * Allocate an htrace span with an interned description.
+ *
+ * @param desc          The interned description.  Will not be copied.
+ * @param begin_ms      The value to use for begin_ms.
+ * @param span_id       The span ID to use.
+ *
+ * @return              NULL on OOM; the span otherwise.
+ */
+struct htrace_span *htrace_span_alloc_interned(const struct htrace_desc *desc,
+                uint64_t begin_ms, struct htrace_span_id *span_id);
+
+/**
+ * Set the beginning time of a span.
+ *
+ * @param span          The span.
+ * @param ns            The beginning time in wall-clock nanoseconds.
+ */
+void htrace_span_set_begin_ns(struct htrace_span *span, uint64_t ns);
+
+/**
+ * Set the end time of a span.
+ *
+ * @param span          The span.
+ * @param ns            The end time in wall-clock nanoseconds.
+ */
+void htrace_span_set_end_ns(struct htrace_span *span, uint64_t ns);
+
+/**
+ * Start measuring the CPU use of the calling thread for a span.
+ *
+ * @param span          The span.
+ * @param cpu           What to measure.  An enum htrace_span_cpu other
+ *                          than HTRACE_SPAN_CPU_OFF.
+ */
+void htrace_span_cpu_begin(struct htrace_span *span, int cpu);
+
+/**
+ * Finish measuring the CPU use of the calling thread for a span.  If the
+ * measurement can't be taken, the span is left without one.
+ *
+ * @param span          The span.  Its cpu field must not be
+ *                          HTRACE_SPAN_CPU_OFF.
+ */
+void htrace_span_cpu_end(struct htrace_span *span);
+
+/**
+ * Add a key/value annotation to a span.
+ *
+ * The strings are not validated; see htrace_scope_add_kv for that.
+ *
+ * @param span          The span.
+ * @param key           The key.  Will be deep-copied.
+ * @param val           The value.  Will be deep-copied.
+ *
+ * @return              0 on success; ENOSPC if the span can't hold any more
+ *                          annotations; ENOMEM on OOM.
+ */
+int htrace_span_add_kv(struct htrace_span *span, const char *key,
+                       const char *val);
+
+/**
+ * Add a key/value annotation to a span, as htrace_span_add_kv does, with
+ * strings which need not be NUL-terminated.
+ */
+int htrace_span_add_kv_len(struct htrace_span *span, const char *key,
+                           size_t key_len, const char *val, size_t val_len);
+
+/**
+ * Add a timeline event to a span.
+ *
+ * The message is not validated; see htrace_scope_add_event for that.
+ *
+ * @param span          The span.
+ * @param time_ms       The time of the event in wall-clock milliseconds.
+ * @param msg           The message.  Will be deep-copied.
+ *
+ * @return              0 on success; ENOSPC if the span can't hold any more
+ *                          annotations; ENOMEM on OOM.
+ */
+int htrace_span_add_event(struct htrace_span *span, uint64_t time_ms,
+                          const char *msg);
+
+/**
+ * Add a timeline event to a span, as htrace_span_add_event does, with a
+ * message which need not be NUL-terminated.
+ */
+int htrace_span_add_event_len(struct htrace_span *span, uint64_t time_ms,
+                              const char *msg, size_t msg_len);
+
+/**
+ * Find the value of a key/value annotation on a span.
+ *
+ * @param span          The span.
+ * @param key           The key.
+ *
+ * @return              The value most recently added for the key, or NULL
+ *                          if there is none.
+ */
+const char *htrace_span_get_kv(const struct htrace_span *span,
+                               const char *key);
+
 /**
  * Free the memory associated with an htrace span.
  *
@@ -101,9 +390,25 @@ struct htrace_span *htrace_span_alloc(const char *desc,
  */
 void htrace_span_free(struct htrace_span *span);
 
+/**
+ * Add a parent to a span.
+ *
+ * Nothing is done if the span already has this parent.
+ *
+ * @param span          The span.
+ * @param parent        The parent ID.
+ *
+ * @return              0 on success; ENOMEM on OOM.
+ */
+int htrace_span_add_parent(struct htrace_span *span,
+                           const struct htrace_span_id *parent);
+
 /**
  * Sort and deduplicate the parents array within the span.
  *
+ * If no more than HTRACE_SPAN_INLINE_PARENTS parents are left, they are moved
+ * back into the span.
+ *
  * @param span          The span to process.
  */
 void htrace_span_sort_and_dedupe_parents(struct htrace_span *span);
@@ -127,6 +432,31 @@ int span_json_size(const struct htrace_span *span);
  */
 void span_json_sprintf(const struct htrace_span *span, int max, void *buf);
 
+/**
+ * Get an upper bound on the number of bytes span_json_write will write.
+ *
+ * This is computed without formatting the span.
+ *
+ * @param span          The span.
+ *
+ * @return              The maximum size in bytes.
+ */
+size_t span_json_max_size(const struct htrace_span *span);
+
+/**
+ * Write a span as JSON directly into a buffer.
+ *
+ * The text is the same as span_json_sprintf's, but no terminating NUL is
+ * written, and no printf-family functions are used.
+ *
+ * @param span          The span.
+ * @param buf           The buffer.  Must have at least span_json_max_size
+ *                          bytes available.
+ *
+ * @return              The number of bytes written.
+ */
+size_t span_json_write(const struct htrace_span *span, char *buf);
+
 /**
  * Write a span to the provided CMP context.
  *
@@ -137,6 +467,31 @@ void span_json_sprintf(const struct htrace_span *span, int max, void *buf);
  */
 int span_write_msgpack(const struct htrace_span *span, struct cmp_ctx_s *ctx);
 
+/**
+ * Get the number of bytes that span_write_msgpack would write for a span.
+ *
+ * This is computed without serializing the span.
+ *
+ * @param span          The span.
+ *
+ * @return              The serialized size in bytes.
+ */
+uint64_t span_msgpack_size(const struct htrace_span *span);
+
+/**
+ * Serialize a span as msgpack directly into a buffer.
+ *
+ * The output is byte-for-byte the same as span_write_msgpack's, but it is
+ * written with plain stores instead of through a CMP context.
+ *
+ * @param span          The span.
+ * @param buf           The buffer.  Must have at least span_msgpack_size
+ *                          bytes available.
+ *
+ * @return              The number of bytes written.
+ */
+uint64_t span_msgpack_encode(const struct htrace_span *span, uint8_t *buf);
+
 #endif
 
 // vim: ts=4:sw=4:et
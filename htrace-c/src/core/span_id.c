@@ -43,40 +43,75 @@
 
 const struct htrace_span_id INVALID_SPAN_ID;
 
-static uint64_t parse_hex_range(const char *str, int start, int end,
-                                char *err, size_t err_len)
+/**
+ * Every byte value as two lowercase hex digits.  Byte b is at 2 * b.
+ */
+#define HEX_PAIR_ROW(h) \
+    h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" \
+    h "8" h "9" h "a" h "b" h "c" h "d" h "e" h "f"
+
+static const char HEX_PAIRS[] =
+    HEX_PAIR_ROW("0") HEX_PAIR_ROW("1") HEX_PAIR_ROW("2") HEX_PAIR_ROW("3")
+    HEX_PAIR_ROW("4") HEX_PAIR_ROW("5") HEX_PAIR_ROW("6") HEX_PAIR_ROW("7")
+    HEX_PAIR_ROW("8") HEX_PAIR_ROW("9") HEX_PAIR_ROW("a") HEX_PAIR_ROW("b")
+    HEX_PAIR_ROW("c") HEX_PAIR_ROW("d") HEX_PAIR_ROW("e") HEX_PAIR_ROW("f");
+
+/**
+ * Flags the entries of HEX_VALUES which are hex digits.
+ */
+#define HEX_VALID 0x10
+
+/**
+ * The value of each hex digit, or'ed with HEX_VALID.  Other characters are
+ * 0.
+ */
+static const uint8_t HEX_VALUES[256] = {
+    ['0'] = HEX_VALID | 0x0, ['1'] = HEX_VALID | 0x1,
+    ['2'] = HEX_VALID | 0x2, ['3'] = HEX_VALID | 0x3,
+    ['4'] = HEX_VALID | 0x4, ['5'] = HEX_VALID | 0x5,
+    ['6'] = HEX_VALID | 0x6, ['7'] = HEX_VALID | 0x7,
+    ['8'] = HEX_VALID | 0x8, ['9'] = HEX_VALID | 0x9,
+    ['a'] = HEX_VALID | 0xa, ['b'] = HEX_VALID | 0xb,
+    ['c'] = HEX_VALID | 0xc, ['d'] = HEX_VALID | 0xd,
+    ['e'] = HEX_VALID | 0xe, ['f'] = HEX_VALID | 0xf,
+    ['A'] = HEX_VALID | 0xa, ['B'] = HEX_VALID | 0xb,
+    ['C'] = HEX_VALID | 0xc, ['D'] = HEX_VALID | 0xd,
+    ['E'] = HEX_VALID | 0xe, ['F'] = HEX_VALID | 0xf,
+};
+
+/**
+ * Parse 16 hex digits.
+ *
+ * @param str           The digits.
+ * @param out           (out param) The value.
+ *
+ * @return              1 on success; 0 if any character was not a hex digit.
+ */
+static int parse_hex64(const char *str, uint64_t *out)
 {
-    char *endptr = NULL;
-    uint64_t ret;
-    char substr[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    const uint8_t *p = (const uint8_t *)str;
+    uint64_t val = 0;
+    uint8_t valid = HEX_VALID;
+    int i;
 
-    err[0] = '\0';
-    if (end - start >= HTRACE_SPAN_ID_STRING_LENGTH) {
-        snprintf(err, err_len, "parse_hex_range buffer too short.");
-        return 0;
-    }
-    memcpy(substr, str + start, end - start);
-    substr[end - start] = '\0';
-    errno = 0;
-    ret = strtoull(substr, &endptr, 16);
-    if (errno) {
-        int e = errno;
-        snprintf(err, err_len, "parse_hex_range error: %s", terror(e));
-        return 0;
+    // Check validity once at the end, so that the loop has no branches.
+    for (i = 0; i < 16; i++) {
+        uint8_t v = HEX_VALUES[p[i]];
+        valid &= v;
+        val = (val << 4) | (v & 0xf);
     }
-    while (1) {
-        char c = *endptr;
-        if (c == '\0') {
-            break;
-        }
-        if ((c != ' ') || (c != '\t')) {
-            snprintf(err, err_len, "parse_hex_range error: garbage at end "
-                     "of string.");
-            return 0;
-        }
-        endptr++;
+    *out = val;
+    return valid != 0;
+}
+
+static void write_hex64(char *str, uint64_t val)
+{
+    int shift;
+
+    for (shift = 56; shift >= 0; shift -= 8) {
+        memcpy(str, HEX_PAIRS + (2 * ((val >> shift) & 0xff)), 2);
+        str += 2;
     }
-    return ret;
 }
 
 void htrace_span_id_parse(struct htrace_span_id *id, const char *str,
@@ -85,26 +120,15 @@ void htrace_span_id_parse(struct htrace_span_id *id, const char *str,
     size_t len;
 
     err[0] = '\0';
-    len = strlen(str);
+    len = strnlen(str, HTRACE_SPAN_ID_STRING_LENGTH);
     if (len < HTRACE_SPAN_ID_STRING_LENGTH) {
         snprintf(err, err_len, "too short: must be %d characters.",
                  HTRACE_SPAN_ID_STRING_LENGTH);
         return;
     }
-    id->high = (parse_hex_range(str, 0, 8, err, err_len) << 32);
-    if (err[0]) {
-        return;
-    }
-    id->high |= (parse_hex_range(str, 8, 16, err, err_len));
-    if (err[0]) {
-        return;
-    }
-    id->low = (parse_hex_range(str, 16, 24, err, err_len) << 32);
-    if (err[0]) {
-        return;
-    }
-    id->low |= (parse_hex_range(str, 24, 32, err, err_len));
-    if (err[0]) {
+    if ((!parse_hex64(str, &id->high)) || (!parse_hex64(str + 16, &id->low))) {
+        snprintf(err, err_len, "invalid span ID: only hex digits are "
+                 "allowed.");
         return;
     }
 }
@@ -112,13 +136,16 @@ void htrace_span_id_parse(struct htrace_span_id *id, const char *str,
 int htrace_span_id_to_str(const struct htrace_span_id *id,
                           char *str, size_t len)
 {
-    int res = snprintf(str, len,
-        "%08"PRIx32"%08"PRIx32"%08"PRIx32"%08"PRIx32,
-        (uint32_t)(0xffffffffUL & (id->high >> 32)),
-        (uint32_t)(0xffffffffUL & id->high),
-        (uint32_t)(0xffffffffUL & (id->low >> 32)),
-        (uint32_t)(0xffffffffUL & id->low));
-    return (res == HTRACE_SPAN_ID_STRING_LENGTH);
+    if (len < HTRACE_SPAN_ID_STRING_LENGTH + 1) {
+        if (len > 0) {
+            str[0] = '\0';
+        }
+        return 0;
+    }
+    write_hex64(str, id->high);
+    write_hex64(str + 16, id->low);
+    str[HTRACE_SPAN_ID_STRING_LENGTH] = '\0';
+    return 1;
 }
 
 void htrace_span_id_copy(struct htrace_span_id *dst,
@@ -127,26 +154,40 @@ void htrace_span_id_copy(struct htrace_span_id *dst,
     memmove(dst, src, sizeof(*dst));
 }
 
+/**
+ * Write a span ID as 16 bytes, most significant first.
+ */
+static void span_id_to_bytes(const struct htrace_span_id *id, uint8_t *buf)
+{
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        buf[i] = (id->high >> (56 - (8 * i))) & 0xff;
+        buf[8 + i] = (id->low >> (56 - (8 * i))) & 0xff;
+    }
+}
+
+/**
+ * Read a span ID written by span_id_to_bytes.
+ */
+static void span_id_from_bytes(struct htrace_span_id *id, const uint8_t *buf)
+{
+    int i;
+
+    id->high = 0;
+    id->low = 0;
+    for (i = 0; i < 8; i++) {
+        id->high = (id->high << 8) | buf[i];
+        id->low = (id->low << 8) | buf[8 + i];
+    }
+}
+
 int htrace_span_id_write_msgpack(const struct htrace_span_id *id,
                                  struct cmp_ctx_s *ctx)
 {
     uint8_t buf[HTRACE_SPAN_ID_NUM_BYTES];
-    buf[0] = (id->high >> 56) & 0xff;
-    buf[1] = (id->high >> 48) & 0xff;
-    buf[2] = (id->high >> 40) & 0xff;
-    buf[3] = (id->high >> 32) & 0xff;
-    buf[4] = (id->high >> 24) & 0xff;
-    buf[5] = (id->high >> 16) & 0xff;
-    buf[6] = (id->high >> 8) & 0xff;
-    buf[7] = (id->high >> 0) & 0xff;
-    buf[8] = (id->low >> 56) & 0xff;
-    buf[9] = (id->low >> 48) & 0xff;
-    buf[10] = (id->low >> 40) & 0xff;
-    buf[11] = (id->low >> 32) & 0xff;
-    buf[12] = (id->low >> 24) & 0xff;
-    buf[13] = (id->low >> 16) & 0xff;
-    buf[14] = (id->low >> 8) & 0xff;
-    buf[15] = (id->low >> 0) & 0xff;
+
+    span_id_to_bytes(id, buf);
     return cmp_write_bin(ctx, buf, HTRACE_SPAN_ID_NUM_BYTES);
 }
 
@@ -162,27 +203,115 @@ int htrace_span_id_read_msgpack(struct htrace_span_id *id,
     if (size != HTRACE_SPAN_ID_NUM_BYTES) {
         return 0;
     }
-    id->high =
-        (((uint64_t)buf[0]) << 56) |
-        (((uint64_t)buf[1]) << 48) |
-        (((uint64_t)buf[2]) << 40) |
-        (((uint64_t)buf[3]) << 32) |
-        (((uint64_t)buf[4]) << 24) |
-        (((uint64_t)buf[5]) << 16) |
-        (((uint64_t)buf[6]) << 8) |
-        (((uint64_t)buf[7]) << 0);
-    id->low =
-        (((uint64_t)buf[8]) << 56) |
-        (((uint64_t)buf[9]) << 48) |
-        (((uint64_t)buf[10]) << 40) |
-        (((uint64_t)buf[11]) << 32) |
-        (((uint64_t)buf[12]) << 24) |
-        (((uint64_t)buf[13]) << 16) |
-        (((uint64_t)buf[14]) << 8) |
-        (((uint64_t)buf[15]) << 0);
+    span_id_from_bytes(id, buf);
     return 1;
 }
 
+void htrace_context_inject(const struct htrace_span_id *id, int sampled,
+                           uint8_t *buf)
+{
+    buf[0] = HTRACE_CONTEXT_VERSION;
+    span_id_to_bytes(id, buf + 1);
+    buf[1 + HTRACE_SPAN_ID_NUM_BYTES] = sampled ? HTRACE_CONTEXT_SAMPLED : 0;
+}
+
+int htrace_context_extract(const uint8_t *buf, size_t len,
+                           struct htrace_span_id *id, int *sampled)
+{
+    if ((len < HTRACE_CONTEXT_LEN) || (buf[0] != HTRACE_CONTEXT_VERSION)) {
+        htrace_span_id_clear(id);
+        *sampled = 0;
+        return EINVAL;
+    }
+    span_id_from_bytes(id, buf + 1);
+    *sampled = !!(buf[1 + HTRACE_SPAN_ID_NUM_BYTES] & HTRACE_CONTEXT_SAMPLED);
+    return 0;
+}
+
+static const char BASE64_CHARS[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * Flags the entries of BASE64_VALUES which are base64 digits.
+ */
+#define BASE64_VALID 0x40
+
+#define BASE64_RANGE(c, v) \
+    [(c) + 0] = BASE64_VALID | ((v) + 0), [(c) + 1] = BASE64_VALID | ((v) + 1)
+
+/**
+ * The value of each base64 digit, or'ed with BASE64_VALID.  Other characters
+ * are 0.
+ */
+static const uint8_t BASE64_VALUES[256] = {
+    BASE64_RANGE('A', 0), BASE64_RANGE('C', 2), BASE64_RANGE('E', 4),
+    BASE64_RANGE('G', 6), BASE64_RANGE('I', 8), BASE64_RANGE('K', 10),
+    BASE64_RANGE('M', 12), BASE64_RANGE('O', 14), BASE64_RANGE('Q', 16),
+    BASE64_RANGE('S', 18), BASE64_RANGE('U', 20), BASE64_RANGE('W', 22),
+    BASE64_RANGE('Y', 24),
+    BASE64_RANGE('a', 26), BASE64_RANGE('c', 28), BASE64_RANGE('e', 30),
+    BASE64_RANGE('g', 32), BASE64_RANGE('i', 34), BASE64_RANGE('k', 36),
+    BASE64_RANGE('m', 38), BASE64_RANGE('o', 40), BASE64_RANGE('q', 42),
+    BASE64_RANGE('s', 44), BASE64_RANGE('u', 46), BASE64_RANGE('w', 48),
+    BASE64_RANGE('y', 50),
+    BASE64_RANGE('0', 52), BASE64_RANGE('2', 54), BASE64_RANGE('4', 56),
+    BASE64_RANGE('6', 58), BASE64_RANGE('8', 60),
+    ['+'] = BASE64_VALID | 62, ['/'] = BASE64_VALID | 63,
+};
+
+void htrace_context_inject_base64(const struct htrace_span_id *id,
+                                  int sampled, char *str)
+{
+    uint8_t buf[HTRACE_CONTEXT_LEN];
+    uint32_t bits;
+    int i;
+
+    // HTRACE_CONTEXT_LEN is a multiple of 3, so there is never any padding.
+    htrace_context_inject(id, sampled, buf);
+    for (i = 0; i < HTRACE_CONTEXT_LEN; i += 3) {
+        bits = (buf[i] << 16) | (buf[i + 1] << 8) | buf[i + 2];
+        *str++ = BASE64_CHARS[(bits >> 18) & 0x3f];
+        *str++ = BASE64_CHARS[(bits >> 12) & 0x3f];
+        *str++ = BASE64_CHARS[(bits >> 6) & 0x3f];
+        *str++ = BASE64_CHARS[bits & 0x3f];
+    }
+    *str = '\0';
+}
+
+int htrace_context_extract_base64(const char *str, size_t len,
+                                  struct htrace_span_id *id, int *sampled)
+{
+    const uint8_t *p = (const uint8_t *)str;
+    uint8_t buf[HTRACE_CONTEXT_LEN], *b = buf;
+    uint8_t valid = BASE64_VALID, v;
+    uint32_t bits = 0;
+    int i;
+
+    if (len != HTRACE_CONTEXT_BASE64_LEN) {
+        htrace_span_id_clear(id);
+        *sampled = 0;
+        return EINVAL;
+    }
+    // As in parse_hex64, check validity once at the end.
+    for (i = 0; i < HTRACE_CONTEXT_BASE64_LEN; i++) {
+        v = BASE64_VALUES[p[i]];
+        valid &= v;
+        bits = (bits << 6) | (v & 0x3f);
+        if ((i & 3) == 3) {
+            *b++ = (bits >> 16) & 0xff;
+            *b++ = (bits >> 8) & 0xff;
+            *b++ = bits & 0xff;
+            bits = 0;
+        }
+    }
+    if (!valid) {
+        htrace_span_id_clear(id);
+        *sampled = 0;
+        return EINVAL;
+    }
+    return htrace_context_extract(buf, sizeof(buf), id, sampled);
+}
+
 void htrace_span_id_generate(struct htrace_span_id *id, struct random_src *rnd,
                              const struct htrace_span_id *parent)
 {
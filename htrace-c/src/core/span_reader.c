@@ -0,0 +1,768 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/htrace.h"
+#include "util/alloc.h"
+#include "util/log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @file span_reader.c
+ *
+ * A zero-copy reader for streams of msgpack-serialized spans.
+ *
+ * Spans are maps from short keys to values, as written by span_write_msgpack
+ * and span_msgpack_encode.  We accept any msgpack encoding of each value,
+ * not just the ones which we write, and skip keys which we don't know about.
+ * Each span is fully validated before htrace_span_reader_next returns it, so
+ * that the iterators don't need to report errors.
+ */
+
+/**
+ * How deeply nested the values we skip over may be.
+ */
+#define SPAN_READER_MAX_DEPTH 16
+
+struct htrace_span_reader {
+    /**
+     * The buffer we are reading.
+     */
+    const uint8_t *buf;
+
+    /**
+     * The length of the buffer.
+     */
+    size_t len;
+
+    /**
+     * The offset of the next span.
+     */
+    size_t off;
+
+    /**
+     * Nonzero if buf was mapped by htrace_span_reader_open.
+     */
+    int mapped;
+
+    /**
+     * The last error message.
+     */
+    char err[256];
+};
+
+/**
+ * A position in a buffer.  Reads fail rather than going past end.
+ */
+struct span_cursor {
+    const uint8_t *pos;
+    const uint8_t *end;
+};
+
+static int cur_get(struct span_cursor *cur, size_t len, const uint8_t **out)
+{
+    if ((size_t)(cur->end - cur->pos) < len) {
+        return 0;
+    }
+    *out = cur->pos;
+    cur->pos += len;
+    return 1;
+}
+
+static uint64_t be_read(const uint8_t *p, int len)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/**
+ * Read a msgpack length of the given number of bytes.
+ */
+static int cur_len(struct span_cursor *cur, int nbytes, uint32_t *len)
+{
+    const uint8_t *p;
+
+    if (!cur_get(cur, nbytes, &p)) {
+        return 0;
+    }
+    *len = be_read(p, nbytes);
+    return 1;
+}
+
+static int cur_map(struct span_cursor *cur, uint32_t *size)
+{
+    const uint8_t *p;
+
+    if (!cur_get(cur, 1, &p)) {
+        return 0;
+    }
+    if ((p[0] & 0xf0) == 0x80) {
+        *size = p[0] & 0x0f;
+        return 1;
+    } else if (p[0] == 0xde) {
+        return cur_len(cur, 2, size);
+    } else if (p[0] == 0xdf) {
+        return cur_len(cur, 4, size);
+    }
+    return 0;
+}
+
+static int cur_array(struct span_cursor *cur, uint32_t *size)
+{
+    const uint8_t *p;
+
+    if (!cur_get(cur, 1, &p)) {
+        return 0;
+    }
+    if ((p[0] & 0xf0) == 0x90) {
+        *size = p[0] & 0x0f;
+        return 1;
+    } else if (p[0] == 0xdc) {
+        return cur_len(cur, 2, size);
+    } else if (p[0] == 0xdd) {
+        return cur_len(cur, 4, size);
+    }
+    return 0;
+}
+
+static int cur_str(struct span_cursor *cur, const char **str, uint32_t *len)
+{
+    const uint8_t *p;
+
+    if (!cur_get(cur, 1, &p)) {
+        return 0;
+    }
+    if ((p[0] & 0xe0) == 0xa0) {
+        *len = p[0] & 0x1f;
+    } else if (p[0] == 0xd9) {
+        if (!cur_len(cur, 1, len)) {
+            return 0;
+        }
+    } else if (p[0] == 0xda) {
+        if (!cur_len(cur, 2, len)) {
+            return 0;
+        }
+    } else if (p[0] == 0xdb) {
+        if (!cur_len(cur, 4, len)) {
+            return 0;
+        }
+    } else {
+        return 0;
+    }
+    return cur_get(cur, *len, (const uint8_t **)str);
+}
+
+static int cur_u64(struct span_cursor *cur, uint64_t *val)
+{
+    const uint8_t *p;
+    int nbytes;
+
+    if (!cur_get(cur, 1, &p)) {
+        return 0;
+    }
+    if (p[0] < 0x80) {
+        *val = p[0];
+        return 1;
+    }
+    switch (p[0]) {
+    case 0xcc:
+        nbytes = 1;
+        break;
+    case 0xcd:
+        nbytes = 2;
+        break;
+    case 0xce:
+        nbytes = 4;
+        break;
+    case 0xcf:
+        nbytes = 8;
+        break;
+    default:
+        return 0;
+    }
+    if (!cur_get(cur, nbytes, &p)) {
+        return 0;
+    }
+    *val = be_read(p, nbytes);
+    return 1;
+}
+
+static int cur_id(struct span_cursor *cur, struct htrace_span_id *id)
+{
+    const uint8_t *p;
+    uint32_t len;
+
+    if (!cur_get(cur, 1, &p)) {
+        return 0;
+    }
+    switch (p[0]) {
+    case 0xc4:
+        if (!cur_len(cur, 1, &len)) {
+            return 0;
+        }
+        break;
+    case 0xc5:
+        if (!cur_len(cur, 2, &len)) {
+            return 0;
+        }
+        break;
+    case 0xc6:
+        if (!cur_len(cur, 4, &len)) {
+            return 0;
+        }
+        break;
+    default:
+        return 0;
+    }
+    if ((len != 16) || (!cur_get(cur, 16, &p))) {
+        return 0;
+    }
+    id->high = be_read(p, 8);
+    id->low = be_read(p + 8, 8);
+    return 1;
+}
+
+/**
+ * Skip over any msgpack value.
+ */
+static int cur_skip(struct span_cursor *cur, int depth)
+{
+    const uint8_t *p;
+    uint32_t len, i;
+    uint8_t b;
+
+    if ((depth > SPAN_READER_MAX_DEPTH) || (!cur_get(cur, 1, &p))) {
+        return 0;
+    }
+    b = p[0];
+    if ((b < 0x80) || (b >= 0xe0) || (b == 0xc0) || (b == 0xc2) ||
+            (b == 0xc3)) {
+        return 1;
+    }
+    if ((b & 0xe0) == 0xa0) {
+        return cur_get(cur, b & 0x1f, &p);
+    }
+    if (((b & 0xf0) == 0x80) || ((b & 0xf0) == 0x90) ||
+            (b == 0xdc) || (b == 0xdd) || (b == 0xde) || (b == 0xdf)) {
+        cur->pos--;
+        if ((b & 0xf0) == 0x80 || (b == 0xde) || (b == 0xdf)) {
+            if (!cur_map(cur, &len)) {
+                return 0;
+            }
+            // Skip both the keys and the values.
+            if (len > UINT32_MAX / 2) {
+                return 0;
+            }
+            len *= 2;
+        } else if (!cur_array(cur, &len)) {
+            return 0;
+        }
+        for (i = 0; i < len; i++) {
+            if (!cur_skip(cur, depth + 1)) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    switch (b) {
+    case 0xcc:
+    case 0xd0:
+        return cur_get(cur, 1, &p);
+    case 0xcd:
+    case 0xd1:
+        return cur_get(cur, 2, &p);
+    case 0xca:
+    case 0xce:
+    case 0xd2:
+        return cur_get(cur, 4, &p);
+    case 0xcb:
+    case 0xcf:
+    case 0xd3:
+        return cur_get(cur, 8, &p);
+    case 0xd4:
+        return cur_get(cur, 2, &p);
+    case 0xd5:
+        return cur_get(cur, 3, &p);
+    case 0xd6:
+        return cur_get(cur, 5, &p);
+    case 0xd7:
+        return cur_get(cur, 9, &p);
+    case 0xd8:
+        return cur_get(cur, 17, &p);
+    case 0xc4:
+    case 0xd9:
+        return cur_len(cur, 1, &len) && cur_get(cur, len, &p);
+    case 0xc5:
+    case 0xda:
+        return cur_len(cur, 2, &len) && cur_get(cur, len, &p);
+    case 0xc6:
+    case 0xdb:
+        return cur_len(cur, 4, &len) && cur_get(cur, len, &p);
+    case 0xc7:
+        return cur_len(cur, 1, &len) && cur_get(cur, len + 1, &p);
+    case 0xc8:
+        return cur_len(cur, 2, &len) && cur_get(cur, len + 1, &p);
+    case 0xc9:
+        return cur_len(cur, 4, &len) && cur_get(cur, (size_t)len + 1, &p);
+    default:
+        return 0;
+    }
+}
+
+static int span_reader_fail(struct htrace_span_reader *rd, const char *fmt,
+                            ...) __attribute__((format(printf, 2, 3)));
+
+static int span_reader_fail(struct htrace_span_reader *rd, const char *fmt,
+                            ...)
+{
+    va_list ap;
+    int len;
+
+    len = snprintf(rd->err, sizeof(rd->err), "offset %zu: ", rd->off);
+    if ((len > 0) && ((size_t)len < sizeof(rd->err))) {
+        va_start(ap, fmt);
+        vsnprintf(rd->err + len, sizeof(rd->err) - len, fmt, ap);
+        va_end(ap);
+    }
+    return -1;
+}
+
+static int span_reader_parents(struct span_cursor *cur,
+                               struct htrace_span_view *view)
+{
+    struct htrace_span_id id;
+    uint32_t i;
+
+    if (!cur_array(cur, &view->num_parents)) {
+        return 0;
+    }
+    view->parents = cur->pos;
+    for (i = 0; i < view->num_parents; i++) {
+        if (!cur_id(cur, &id)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int span_reader_kvs(struct span_cursor *cur,
+                           struct htrace_span_view *view)
+{
+    const char *str;
+    uint32_t i, len;
+
+    if (!cur_map(cur, &view->num_kvs)) {
+        return 0;
+    }
+    view->kvs = cur->pos;
+    for (i = 0; i < view->num_kvs; i++) {
+        if ((!cur_str(cur, &str, &len)) || (!cur_str(cur, &str, &len))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Read one timeline event, which is a map with a time and a message.
+ */
+static int cur_event(struct span_cursor *cur, uint64_t *time_ms,
+                     const char **msg, uint32_t *msg_len)
+{
+    const char *key;
+    uint32_t i, num, klen;
+    int have_time = 0, have_msg = 0;
+
+    if (!cur_map(cur, &num)) {
+        return 0;
+    }
+    for (i = 0; i < num; i++) {
+        if (!cur_str(cur, &key, &klen)) {
+            return 0;
+        }
+        if ((klen == 1) && (key[0] == 't')) {
+            if (!cur_u64(cur, time_ms)) {
+                return 0;
+            }
+            have_time = 1;
+        } else if ((klen == 1) && (key[0] == 'm')) {
+            if (!cur_str(cur, msg, msg_len)) {
+                return 0;
+            }
+            have_msg = 1;
+        } else if (!cur_skip(cur, 1)) {
+            return 0;
+        }
+    }
+    return have_time && have_msg;
+}
+
+static int span_reader_events(struct span_cursor *cur,
+                              struct htrace_span_view *view)
+{
+    const char *msg;
+    uint32_t i, len;
+    uint64_t time_ms;
+
+    if (!cur_array(cur, &view->num_events)) {
+        return 0;
+    }
+    view->events = cur->pos;
+    for (i = 0; i < view->num_events; i++) {
+        if (!cur_event(cur, &time_ms, &msg, &len)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Read a precise timestamp, if the key is one of "bu", "bn", "eu", or "en".
+ *
+ * @return          1 if the key was a precise timestamp key and the value
+ *                      was read; 0 if the key was something else; -1 on
+ *                      error.
+ */
+static int span_reader_precise(struct span_cursor *cur, const char *key,
+                               struct htrace_span_view *view)
+{
+    int precision;
+    uint64_t *out;
+
+    if (key[0] == 'b') {
+        out = &view->begin_precise;
+    } else if (key[0] == 'e') {
+        out = &view->end_precise;
+    } else {
+        return 0;
+    }
+    if (key[1] == 'u') {
+        precision = 1;
+    } else if (key[1] == 'n') {
+        precision = 2;
+    } else {
+        return 0;
+    }
+    if (!cur_u64(cur, out)) {
+        return -1;
+    }
+    view->ts_precision = precision;
+    return 1;
+}
+
+/**
+ * Read a CPU use field, if the key is one of "cn", "cv", or "ci".
+ *
+ * @return          1 if the key was a CPU use key and the value was read; 0
+ *                      if the key was something else; -1 on error.
+ */
+static int span_reader_cpu(struct span_cursor *cur, const char *key,
+                           struct htrace_span_view *view)
+{
+    int cpu;
+    uint64_t *out;
+
+    if (key[0] != 'c') {
+        return 0;
+    }
+    if (key[1] == 'n') {
+        out = &view->cpu_ns;
+        cpu = 1;
+    } else if (key[1] == 'v') {
+        out = &view->vol_csw;
+        cpu = 2;
+    } else if (key[1] == 'i') {
+        out = &view->invol_csw;
+        cpu = 2;
+    } else {
+        return 0;
+    }
+    if (!cur_u64(cur, out)) {
+        return -1;
+    }
+    if (view->cpu < cpu) {
+        view->cpu = cpu;
+    }
+    return 1;
+}
+
+int htrace_span_reader_next(struct htrace_span_reader *rd,
+                            struct htrace_span_view *view)
+{
+    struct span_cursor cur;
+    const char *key;
+    uint32_t i, num_keys, klen;
+    int have_id = 0, ret;
+
+    if (rd->off >= rd->len) {
+        return 0;
+    }
+    cur.pos = rd->buf + rd->off;
+    cur.end = rd->buf + rd->len;
+    memset(view, 0, sizeof(*view));
+    view->desc = "";
+    if (!cur_map(&cur, &num_keys)) {
+        return span_reader_fail(rd, "expected a span map.");
+    }
+    for (i = 0; i < num_keys; i++) {
+        if (!cur_str(&cur, &key, &klen)) {
+            return span_reader_fail(rd, "failed to read key %d.", i);
+        }
+        if (klen == 2) {
+            ret = span_reader_precise(&cur, key, view);
+            if (ret < 0) {
+                return span_reader_fail(rd, "bad precise timestamp.");
+            } else if (ret > 0) {
+                continue;
+            }
+            ret = span_reader_cpu(&cur, key, view);
+            if (ret < 0) {
+                return span_reader_fail(rd, "bad CPU use field.");
+            } else if (ret > 0) {
+                continue;
+            }
+        }
+        if (klen != 1) {
+            if (!cur_skip(&cur, 1)) {
+                return span_reader_fail(rd, "bad value for key %.*s.",
+                                        (int)klen, key);
+            }
+            continue;
+        }
+        switch (key[0]) {
+        case 'a':
+            if (!cur_id(&cur, &view->span_id)) {
+                return span_reader_fail(rd, "bad span ID.");
+            }
+            have_id = 1;
+            break;
+        case 'd':
+            if (!cur_str(&cur, &view->desc, &view->desc_len)) {
+                return span_reader_fail(rd, "bad description.");
+            }
+            break;
+        case 'b':
+            if (!cur_u64(&cur, &view->begin_ms)) {
+                return span_reader_fail(rd, "bad begin time.");
+            }
+            break;
+        case 'e':
+            if (!cur_u64(&cur, &view->end_ms)) {
+                return span_reader_fail(rd, "bad end time.");
+            }
+            break;
+        case 'r':
+            if (!cur_str(&cur, &view->trid, &view->trid_len)) {
+                return span_reader_fail(rd, "bad tracer ID.");
+            }
+            break;
+        case 'p':
+            if (!span_reader_parents(&cur, view)) {
+                return span_reader_fail(rd, "bad parents.");
+            }
+            break;
+        case 'n':
+            if (!span_reader_kvs(&cur, view)) {
+                return span_reader_fail(rd, "bad annotations.");
+            }
+            break;
+        case 't':
+            if (!span_reader_events(&cur, view)) {
+                return span_reader_fail(rd, "bad timeline events.");
+            }
+            break;
+        default:
+            if (!cur_skip(&cur, 1)) {
+                return span_reader_fail(rd, "bad value for key %c.", key[0]);
+            }
+            break;
+        }
+    }
+    if (!have_id) {
+        return span_reader_fail(rd, "span has no span ID.");
+    }
+    view->end = cur.pos;
+    rd->off = cur.pos - rd->buf;
+    rd->err[0] = '\0';
+    return 1;
+}
+
+struct htrace_span_reader *htrace_span_reader_alloc(const void *buf,
+                                                    size_t len)
+{
+    struct htrace_span_reader *rd;
+
+    rd = htrace_calloc(1, sizeof(*rd));
+    if (!rd) {
+        return NULL;
+    }
+    rd->buf = buf;
+    rd->len = len;
+    return rd;
+}
+
+struct htrace_span_reader *htrace_span_reader_open(const char *path,
+                                char *err, size_t err_len)
+{
+    struct htrace_span_reader *rd;
+    struct stat st;
+    void *buf = NULL;
+    int fd, res;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        res = errno;
+        snprintf(err, err_len, "open(%s) failed: error %d (%s)",
+                 path, res, terror(res));
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        res = errno;
+        snprintf(err, err_len, "fstat(%s) failed: error %d (%s)",
+                 path, res, terror(res));
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size > 0) {
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED) {
+            res = errno;
+            snprintf(err, err_len, "mmap(%s) failed: error %d (%s)",
+                     path, res, terror(res));
+            close(fd);
+            return NULL;
+        }
+    }
+    close(fd);
+    rd = htrace_span_reader_alloc(buf, st.st_size);
+    if (!rd) {
+        snprintf(err, err_len, "htrace_span_reader_open(%s): OOM", path);
+        if (buf) {
+            munmap(buf, st.st_size);
+        }
+        return NULL;
+    }
+    rd->mapped = (buf != NULL);
+    return rd;
+}
+
+const char *htrace_span_reader_error(const struct htrace_span_reader *rd)
+{
+    return rd->err;
+}
+
+size_t htrace_span_reader_offset(const struct htrace_span_reader *rd)
+{
+    return rd->off;
+}
+
+void htrace_span_reader_free(struct htrace_span_reader *rd)
+{
+    if (!rd) {
+        return;
+    }
+    if (rd->mapped) {
+        munmap((void *)rd->buf, rd->len);
+    }
+    htrace_free(rd);
+}
+
+static void span_view_iter_init(struct htrace_span_view_iter *it,
+        const struct htrace_span_view *view, const uint8_t *pos, uint32_t num)
+{
+    it->pos = pos;
+    it->end = view->end;
+    it->left = pos ? num : 0;
+}
+
+void htrace_span_view_parents(const struct htrace_span_view *view,
+                              struct htrace_span_view_iter *it)
+{
+    span_view_iter_init(it, view, view->parents, view->num_parents);
+}
+
+void htrace_span_view_kvs(const struct htrace_span_view *view,
+                          struct htrace_span_view_iter *it)
+{
+    span_view_iter_init(it, view, view->kvs, view->num_kvs);
+}
+
+void htrace_span_view_events(const struct htrace_span_view *view,
+                             struct htrace_span_view_iter *it)
+{
+    span_view_iter_init(it, view, view->events, view->num_events);
+}
+
+int htrace_span_view_next_parent(struct htrace_span_view_iter *it,
+                                 struct htrace_span_id *id)
+{
+    struct span_cursor cur = { it->pos, it->end };
+
+    if ((it->left == 0) || (!cur_id(&cur, id))) {
+        return 0;
+    }
+    it->pos = cur.pos;
+    it->left--;
+    return 1;
+}
+
+int htrace_span_view_next_kv(struct htrace_span_view_iter *it,
+                             const char **key, uint32_t *key_len,
+                             const char **val, uint32_t *val_len)
+{
+    struct span_cursor cur = { it->pos, it->end };
+
+    if ((it->left == 0) || (!cur_str(&cur, key, key_len)) ||
+            (!cur_str(&cur, val, val_len))) {
+        return 0;
+    }
+    it->pos = cur.pos;
+    it->left--;
+    return 1;
+}
+
+int htrace_span_view_next_event(struct htrace_span_view_iter *it,
+                                uint64_t *time_ms, const char **msg,
+                                uint32_t *msg_len)
+{
+    struct span_cursor cur = { it->pos, it->end };
+
+    if ((it->left == 0) || (!cur_event(&cur, time_ms, msg, msg_len))) {
+        return 0;
+    }
+    it->pos = cur.pos;
+    it->left--;
+    return 1;
+}
+
+// vim:ts=4:sw=4:et
@@ -0,0 +1,404 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "core/tail.h"
+#include "util/alloc.h"
+#include "util/htable.h"
+#include "util/log.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * @file tail.c
+ *
+ * Tail-based sampling of whole traces.
+ *
+ * Closed spans are grouped by the high half of their span ID, which is
+ * shared by every span in a trace.  When the local root of a trace closes,
+ * we decide whether the trace is interesting, and then either give all of
+ * its spans to the span receiver or free them.  The decision is remembered
+ * until the trace is evicted, so that spans which close after the root (for
+ * example, in other threads) are handled the same way.  Traces are evicted
+ * oldest first once there are max_traces of them.
+ */
+
+/**
+ * The number of span pointers we first allocate for a trace.
+ */
+#define HTRACE_TAIL_INITIAL_SPANS 8
+
+enum htrace_tail_verdict {
+    HTRACE_TAIL_PENDING = 0,
+    HTRACE_TAIL_KEEP,
+    HTRACE_TAIL_DROP,
+};
+
+/**
+ * A trace that we are tracking.
+ */
+struct htrace_tail_trace {
+    /**
+     * The trace ID.  This is also the key in the traces table.
+     */
+    uint64_t id;
+
+    /**
+     * The next older and newer traces, in the order they were first seen.
+     */
+    struct htrace_tail_trace *older;
+    struct htrace_tail_trace *newer;
+
+    /**
+     * An enum htrace_tail_verdict.
+     */
+    int verdict;
+
+    /**
+     * Nonzero if one of the spans has an error annotation.
+     */
+    int error;
+
+    /**
+     * The spans we are holding while the verdict is pending.
+     */
+    struct htrace_span **spans;
+    uint32_t num_spans;
+    uint32_t max_spans;
+};
+
+struct htrace_tail {
+    /**
+     * The tracer.  We give kept spans to its span receiver.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The shortest local root duration which makes a trace interesting.
+     */
+    uint64_t min_duration_ms;
+
+    /**
+     * The most traces we track.
+     */
+    uint32_t max_traces;
+
+    /**
+     * The most spans we hold for one pending trace.
+     */
+    uint32_t max_trace_spans;
+
+    /**
+     * Protects everything below.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Maps trace IDs to struct htrace_tail_trace objects.
+     */
+    struct htable *traces;
+
+    /**
+     * The oldest and newest traces.
+     */
+    struct htrace_tail_trace *oldest;
+    struct htrace_tail_trace *newest;
+
+    /**
+     * Statistics.
+     */
+    uint64_t kept;
+    uint64_t dropped;
+};
+
+static uint32_t htrace_tail_hash_id(const void *key, uint32_t capacity)
+{
+    uint64_t id = *(const uint64_t *)key;
+
+    return (uint32_t)((id ^ (id >> 32)) % capacity);
+}
+
+static int htrace_tail_compare_id(const void *a, const void *b)
+{
+    return *(const uint64_t *)a == *(const uint64_t *)b;
+}
+
+struct htrace_tail *htrace_tail_create(struct htracer *tracer,
+                                       const struct htrace_conf *cnf)
+{
+    struct htrace_tail *tail;
+    uint64_t val;
+
+    tail = htrace_calloc(1, sizeof(*tail));
+    if (!tail) {
+        htrace_log(tracer->lg, "htrace_tail_create: OOM\n");
+        return NULL;
+    }
+    tail->tracer = tracer;
+    tail->min_duration_ms = htrace_conf_get_u64(tracer->lg, cnf,
+                                    HTRACE_TAIL_MIN_DURATION_MS_KEY);
+    val = htrace_conf_get_u64(tracer->lg, cnf, HTRACE_TAIL_MAX_TRACES_KEY);
+    if (val < 1) {
+        val = 1;
+    } else if (val > UINT32_MAX / 2) {
+        val = UINT32_MAX / 2;
+    }
+    tail->max_traces = val;
+    val = htrace_conf_get_u64(tracer->lg, cnf,
+                              HTRACE_TAIL_MAX_TRACE_SPANS_KEY);
+    if (val > UINT32_MAX / 2) {
+        val = UINT32_MAX / 2;
+    }
+    tail->max_trace_spans = val;
+    tail->traces = htable_alloc(tail->max_traces * 2, htrace_tail_hash_id,
+                                htrace_tail_compare_id);
+    if (!tail->traces) {
+        htrace_log(tracer->lg, "htrace_tail_create: OOM\n");
+        htrace_free(tail);
+        return NULL;
+    }
+    pthread_mutex_init(&tail->lock, NULL);
+    htrace_log(tracer->lg, "Initialized tail sampling with min_duration_ms="
+               "%" PRId64 ", max_traces=%" PRId32 ", max_trace_spans=%"
+               PRId32 ".\n", tail->min_duration_ms, tail->max_traces,
+               tail->max_trace_spans);
+    return tail;
+}
+
+/**
+ * Free the spans held for a trace.  This must be called with the lock held.
+ */
+static void htrace_tail_drop_spans(struct htrace_tail *tail,
+                                   struct htrace_tail_trace *trace)
+{
+    uint32_t i;
+
+    for (i = 0; i < trace->num_spans; i++) {
+        htrace_span_free(trace->spans[i]);
+    }
+    tail->dropped += trace->num_spans;
+    htrace_free(trace->spans);
+    trace->spans = NULL;
+    trace->num_spans = 0;
+    trace->max_spans = 0;
+}
+
+/**
+ * Remove a trace from the table and free it, dropping any spans we are still
+ * holding for it.  This must be called with the lock held.
+ */
+static void htrace_tail_evict(struct htrace_tail *tail,
+                              struct htrace_tail_trace *trace)
+{
+    void *key, *val;
+
+    htable_pop(tail->traces, &trace->id, &key, &val);
+    if (trace->older) {
+        trace->older->newer = trace->newer;
+    } else {
+        tail->oldest = trace->newer;
+    }
+    if (trace->newer) {
+        trace->newer->older = trace->older;
+    } else {
+        tail->newest = trace->older;
+    }
+    htrace_tail_drop_spans(tail, trace);
+    htrace_free(trace);
+}
+
+/**
+ * Find the trace with the given ID, or start tracking it.  This must be
+ * called with the lock held.
+ *
+ * @return              NULL on OOM; the trace otherwise.
+ */
+static struct htrace_tail_trace *htrace_tail_get_trace(
+        struct htrace_tail *tail, uint64_t id)
+{
+    struct htrace_tail_trace *trace;
+
+    trace = htable_get(tail->traces, &id);
+    if (trace) {
+        return trace;
+    }
+    if (htable_used(tail->traces) >= tail->max_traces) {
+        htrace_tail_evict(tail, tail->oldest);
+    }
+    trace = htrace_calloc(1, sizeof(*trace));
+    if (!trace) {
+        return NULL;
+    }
+    trace->id = id;
+    if (htable_put(tail->traces, &trace->id, trace)) {
+        htrace_free(trace);
+        return NULL;
+    }
+    trace->older = tail->newest;
+    if (tail->newest) {
+        tail->newest->newer = trace;
+    } else {
+        tail->oldest = trace;
+    }
+    tail->newest = trace;
+    return trace;
+}
+
+/**
+ * Hold a span of a pending trace.  This must be called with the lock held.
+ *
+ * @return              0 on success; nonzero if the span must be dropped.
+ */
+static int htrace_tail_hold(struct htrace_tail *tail,
+                            struct htrace_tail_trace *trace,
+                            struct htrace_span *span)
+{
+    if (trace->num_spans >= trace->max_spans) {
+        struct htrace_span **spans;
+        uint32_t max_spans;
+
+        if (trace->num_spans >= tail->max_trace_spans) {
+            return 1;
+        }
+        max_spans = trace->max_spans ?
+            (trace->max_spans * 2) : HTRACE_TAIL_INITIAL_SPANS;
+        if (max_spans > tail->max_trace_spans) {
+            max_spans = tail->max_trace_spans;
+        }
+        spans = htrace_realloc(trace->spans, max_spans * sizeof(spans[0]));
+        if (!spans) {
+            return 1;
+        }
+        trace->spans = spans;
+        trace->max_spans = max_spans;
+    }
+    trace->spans[trace->num_spans++] = span;
+    return 0;
+}
+
+static void htrace_tail_forward(struct htrace_tail *tail,
+                                struct htrace_span *span)
+{
+    htracer_add_span(tail->tracer, span);
+}
+
+void htrace_tail_add_span(struct htrace_tail *tail, struct htrace_span *span)
+{
+    struct htrace_tail_trace *trace;
+    struct htrace_span **spans;
+    uint32_t i, num_spans;
+    int keep;
+
+    pthread_mutex_lock(&tail->lock);
+    trace = htrace_tail_get_trace(tail, span->span_id.high);
+    if (!trace) {
+        tail->dropped++;
+        pthread_mutex_unlock(&tail->lock);
+        HTRACE_LOG_RATELIMITED(tail->tracer->lg, HTRACE_LOG_ERROR,
+                               "htrace_tail_add_span: OOM\n");
+        htrace_span_free(span);
+        return;
+    }
+    if (trace->verdict == HTRACE_TAIL_KEEP) {
+        tail->kept++;
+        pthread_mutex_unlock(&tail->lock);
+        htrace_tail_forward(tail, span);
+        return;
+    }
+    if (trace->verdict == HTRACE_TAIL_DROP) {
+        tail->dropped++;
+        pthread_mutex_unlock(&tail->lock);
+        htrace_span_free(span);
+        return;
+    }
+    if (span->extra && htrace_span_get_kv(span, HTRACE_SPAN_ERROR_KEY)) {
+        trace->error = 1;
+    }
+    if (!span->local_root) {
+        if (htrace_tail_hold(tail, trace, span)) {
+            tail->dropped++;
+            pthread_mutex_unlock(&tail->lock);
+            htrace_span_free(span);
+            return;
+        }
+        pthread_mutex_unlock(&tail->lock);
+        return;
+    }
+    // The local root closed, so decide the fate of the whole trace.  We pass
+    // the spans on after dropping the lock, so that a slow span receiver
+    // doesn't hold up other threads closing spans.
+    keep = trace->error ||
+        ((span->end_ms - span->begin_ms) >= tail->min_duration_ms);
+    spans = trace->spans;
+    num_spans = trace->num_spans;
+    trace->spans = NULL;
+    trace->num_spans = 0;
+    trace->max_spans = 0;
+    if (keep) {
+        trace->verdict = HTRACE_TAIL_KEEP;
+        tail->kept += num_spans + 1;
+    } else {
+        trace->verdict = HTRACE_TAIL_DROP;
+        tail->dropped += num_spans + 1;
+    }
+    pthread_mutex_unlock(&tail->lock);
+    for (i = 0; i < num_spans; i++) {
+        if (keep) {
+            htrace_tail_forward(tail, spans[i]);
+        } else {
+            htrace_span_free(spans[i]);
+        }
+    }
+    htrace_free(spans);
+    if (keep) {
+        htrace_tail_forward(tail, span);
+    } else {
+        htrace_span_free(span);
+    }
+}
+
+void htrace_tail_get_stats(struct htrace_tail *tail,
+                           struct htrace_stats *stats)
+{
+    pthread_mutex_lock(&tail->lock);
+    stats->tail_kept = tail->kept;
+    stats->tail_dropped = tail->dropped;
+    pthread_mutex_unlock(&tail->lock);
+}
+
+void htrace_tail_free(struct htrace_tail *tail)
+{
+    if (!tail) {
+        return;
+    }
+    while (tail->oldest) {
+        htrace_tail_evict(tail, tail->oldest);
+    }
+    htable_free(tail->traces);
+    pthread_mutex_destroy(&tail->lock);
+    htrace_free(tail);
+}
+
+// vim:ts=4:sw=4:et
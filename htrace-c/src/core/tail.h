@@ -0,0 +1,79 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef APACHE_HTRACE_CORE_TAIL_H
+#define APACHE_HTRACE_CORE_TAIL_H
+
+/**
+ * @file tail.h
+ *
+ * Tail-based sampling of whole traces.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+struct htrace_conf;
+struct htrace_span;
+struct htrace_stats;
+struct htrace_tail;
+struct htracer;
+
+/**
+ * Create a tail sampling stage.
+ *
+ * @param tracer        The tracer.  Spans which are kept are given to its
+ *                          span receiver.
+ * @param cnf           The configuration to use.  The tail sampling stage
+ *                          will not hold on to this pointer.
+ *
+ * @return              NULL on OOM; the tail sampling stage otherwise.
+ */
+struct htrace_tail *htrace_tail_create(struct htracer *tracer,
+                                       const struct htrace_conf *cnf);
+
+/**
+ * Give a closed span to the tail sampling stage.
+ *
+ * @param tail          The tail sampling stage.
+ * @param span          The span.  The tail sampling stage takes ownership of
+ *                          it, and will either pass it to the span receiver
+ *                          or free it.
+ */
+void htrace_tail_add_span(struct htrace_tail *tail, struct htrace_span *span);
+
+/**
+ * Fill in the tail sampling statistics.
+ *
+ * @param tail          The tail sampling stage.
+ * @param stats         The statistics to fill in.
+ */
+void htrace_tail_get_stats(struct htrace_tail *tail,
+                           struct htrace_stats *stats);
+
+/**
+ * Free a tail sampling stage.  Spans held for traces which are still
+ * waiting for their root to close are dropped.
+ *
+ * @param tail          The tail sampling stage, or NULL.
+ */
+void htrace_tail_free(struct htrace_tail *tail);
+
+#endif
+
+// vim: ts=4:sw=4:et
@@ -0,0 +1,411 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "receiver/receiver.h"
+#include "util/alloc.h"
+#include "util/log.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file fanout.c
+ *
+ * A span receiver that hands every span to several other span receivers.
+ *
+ * It is used when span.receiver is a comma-separated list.  Children which
+ * can take serialized spans (see htrace_rcv_ty#add_msgpack) share a single
+ * msgpack encoding of each batch.  The others get the spans themselves.
+ * Each child keeps its own buffers, so a child which falls behind drops
+ * spans according to its own policy.  However, a child which blocks, such as
+ * htraced with htraced.buffer.full.policy=block, holds up the ones after it.
+ *
+ * Children never take ownership of spans, since every child needs to see
+ * them.
+ */
+
+/**
+ * The maximum number of span receivers in a fanout.
+ */
+#define FANOUT_MAX_CHILDREN 8
+
+/**
+ * The size of the buffer on the stack which batches are serialized into.
+ * Batches which might not fit get a buffer from malloc instead.
+ */
+#define FANOUT_STACK_BUF_LEN 8192
+
+/**
+ * The number of span lengths which fit on the stack.
+ */
+#define FANOUT_STACK_LENS 64
+
+struct fanout_rcv {
+    struct htrace_rcv base;
+
+    /**
+     * The htracer object associated with this receiver.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The child span receivers.
+     */
+    struct htrace_rcv *children[FANOUT_MAX_CHILDREN];
+    int num_children;
+
+    /**
+     * The number of children with an add_msgpack callback.
+     */
+    int num_msgpack;
+};
+
+static void fanout_rcv_free(struct htrace_rcv *r);
+
+static struct htrace_rcv *fanout_rcv_create(struct htracer *tracer,
+                                            const struct htrace_conf *conf)
+{
+    struct fanout_rcv *rcv;
+    const struct htrace_rcv_ty *ty;
+    struct htrace_rcv *child;
+    char *names, *name, *saveptr = NULL;
+    size_t len;
+
+    rcv = htrace_calloc(1, sizeof(*rcv));
+    if (!rcv) {
+        htrace_log(tracer->lg, "fanout_rcv_create: OOM while "
+                   "allocating fanout_rcv.\n");
+        return NULL;
+    }
+    rcv->base.ty = &g_fanout_rcv_ty;
+    rcv->tracer = tracer;
+    names = htrace_strdup(htrace_conf_get(conf, HTRACE_SPAN_RECEIVER_KEY));
+    if (!names) {
+        htrace_log(tracer->lg, "fanout_rcv_create: OOM while "
+                   "copying %s.\n", HTRACE_SPAN_RECEIVER_KEY);
+        goto error;
+    }
+    for (name = strtok_r(names, ",", &saveptr); name;
+             name = strtok_r(NULL, ",", &saveptr)) {
+        name += strspn(name, " \t");
+        len = strlen(name);
+        while ((len > 0) && strchr(" \t", name[len - 1])) {
+            name[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        ty = htrace_rcv_ty_find(name);
+        if (!ty) {
+            htrace_log(tracer->lg, "fanout_rcv_create: unknown span "
+                       "receiver type '%s' in %s.\n", name,
+                       HTRACE_SPAN_RECEIVER_KEY);
+            goto error;
+        }
+        if (rcv->num_children == FANOUT_MAX_CHILDREN) {
+            htrace_log(tracer->lg, "fanout_rcv_create: too many span "
+                       "receivers in %s.  The maximum is %d.\n",
+                       HTRACE_SPAN_RECEIVER_KEY, FANOUT_MAX_CHILDREN);
+            goto error;
+        }
+        child = ty->create(tracer, conf);
+        if (!child) {
+            htrace_log(tracer->lg, "fanout_rcv_create: failed to create "
+                       "the %s span receiver.\n", name);
+            goto error;
+        }
+        rcv->children[rcv->num_children++] = child;
+        if (ty->add_msgpack) {
+            rcv->num_msgpack++;
+        }
+    }
+    htrace_free(names);
+    htrace_log(tracer->lg, "Initialized fanout receiver with %d span "
+               "receivers.\n", rcv->num_children);
+    return (struct htrace_rcv*)rcv;
+
+error:
+    htrace_free(names);
+    fanout_rcv_free((struct htrace_rcv*)rcv);
+    return NULL;
+}
+
+/**
+ * Serialize a batch of spans once, and give the result to every child which
+ * can take it.
+ *
+ * @param rcv           The fanout receiver.
+ * @param spans         The spans.
+ * @param num_spans     The number of spans.
+ *
+ * @return              1 on success; 0 if we ran out of memory.
+ */
+static int fanout_add_msgpack(struct fanout_rcv *rcv,
+                              struct htrace_span **spans, int num_spans)
+{
+    uint8_t stack_buf[FANOUT_STACK_BUF_LEN], *buf = stack_buf, *p;
+    uint64_t stack_lens[FANOUT_STACK_LENS], *lens = stack_lens;
+    uint64_t total = 0;
+    struct htrace_rcv *child;
+    int i, ret = 0;
+
+    if (num_spans > FANOUT_STACK_LENS) {
+        lens = htrace_malloc(sizeof(*lens) * num_spans);
+        if (!lens) {
+            return 0;
+        }
+    }
+    for (i = 0; i < num_spans; i++) {
+        spans[i]->trid = rcv->tracer->trid;
+        lens[i] = span_msgpack_size(spans[i]);
+        total += lens[i];
+    }
+    if (total > sizeof(stack_buf)) {
+        buf = htrace_malloc(total);
+        if (!buf) {
+            goto done;
+        }
+    }
+    p = buf;
+    for (i = 0; i < num_spans; i++) {
+        p += span_msgpack_encode(spans[i], p);
+        spans[i]->trid = NULL;
+    }
+    for (i = 0; i < rcv->num_children; i++) {
+        child = rcv->children[i];
+        if (child->ty->add_msgpack) {
+            child->ty->add_msgpack(child, spans, buf, lens, num_spans);
+        }
+    }
+    ret = 1;
+
+done:
+    for (i = 0; i < num_spans; i++) {
+        spans[i]->trid = NULL;
+    }
+    if (buf != stack_buf) {
+        htrace_free(buf);
+    }
+    if (lens != stack_lens) {
+        htrace_free(lens);
+    }
+    return ret;
+}
+
+static void fanout_rcv_add_spans(struct htrace_rcv *r,
+                                 struct htrace_span **spans, int num_spans)
+{
+    struct fanout_rcv *rcv = (struct fanout_rcv *)r;
+    struct htrace_rcv *child;
+    int i, j, encoded = 0;
+
+    // With only one child that takes msgpack, it is cheaper for that child
+    // to serialize straight into its own buffers.
+    if (rcv->num_msgpack > 1) {
+        encoded = fanout_add_msgpack(rcv, spans, num_spans);
+    }
+    for (i = 0; i < rcv->num_children; i++) {
+        child = rcv->children[i];
+        if (encoded && child->ty->add_msgpack) {
+            continue;
+        }
+        if (child->ty->add_spans) {
+            child->ty->add_spans(child, spans, num_spans);
+        } else {
+            for (j = 0; j < num_spans; j++) {
+                child->ty->add_span(child, spans[j]);
+            }
+        }
+    }
+}
+
+static void fanout_rcv_add_span(struct htrace_rcv *r,
+                                struct htrace_span *span)
+{
+    fanout_rcv_add_spans(r, &span, 1);
+}
+
+static void fanout_rcv_flush(struct htrace_rcv *r)
+{
+    struct fanout_rcv *rcv = (struct fanout_rcv *)r;
+    int i;
+
+    for (i = 0; i < rcv->num_children; i++) {
+        rcv->children[i]->ty->flush(rcv->children[i]);
+    }
+}
+
+static void fanout_rcv_free(struct htrace_rcv *r)
+{
+    struct fanout_rcv *rcv = (struct fanout_rcv *)r;
+    int i;
+
+    if (!rcv) {
+        return;
+    }
+    for (i = 0; i < rcv->num_children; i++) {
+        rcv->children[i]->ty->free(rcv->children[i]);
+    }
+    htrace_free(rcv);
+}
+
+#define FANOUT_STATS_ADD(stats, cstats, field) \
+    (stats)->field += (cstats)->field
+
+#define FANOUT_STATS_MAX(stats, cstats, field) \
+    do { \
+        if ((cstats)->field > (stats)->field) { \
+            (stats)->field = (cstats)->field; \
+        } \
+    } while (0)
+
+/**
+ * The receiver statistics are the sums of the children's, except for the
+ * high-water marks, which are the largest of the children's.
+ */
+static void fanout_rcv_get_stats(struct htrace_rcv *r,
+                                 struct htrace_stats *stats)
+{
+    struct fanout_rcv *rcv = (struct fanout_rcv *)r;
+    struct htrace_rcv *child;
+    struct htrace_stats cstats;
+    int i, j;
+
+    for (i = 0; i < rcv->num_children; i++) {
+        child = rcv->children[i];
+        if (!child->ty->get_stats) {
+            continue;
+        }
+        memset(&cstats, 0, sizeof(cstats));
+        child->ty->get_stats(child, &cstats);
+        FANOUT_STATS_ADD(stats, &cstats, dropped_oom);
+        FANOUT_STATS_ADD(stats, &cstats, buffered);
+        FANOUT_STATS_ADD(stats, &cstats, dropped_newest);
+        FANOUT_STATS_ADD(stats, &cstats, dropped_oldest);
+        FANOUT_STATS_ADD(stats, &cstats, blocked);
+        FANOUT_STATS_ADD(stats, &cstats, dropped_timeout);
+        FANOUT_STATS_ADD(stats, &cstats, dropped_too_large);
+        FANOUT_STATS_ADD(stats, &cstats, dropped_xmit);
+        FANOUT_STATS_ADD(stats, &cstats, dropped_low_priority);
+        FANOUT_STATS_ADD(stats, &cstats, spilled);
+        FANOUT_STATS_ADD(stats, &cstats, unspilled);
+        FANOUT_STATS_ADD(stats, &cstats, bytes_serialized);
+        FANOUT_STATS_ADD(stats, &cstats, xmit_bytes);
+        FANOUT_STATS_ADD(stats, &cstats, xmit_wire_bytes);
+        FANOUT_STATS_ADD(stats, &cstats, rpcs);
+        FANOUT_STATS_ADD(stats, &cstats, rpc_errors);
+        for (j = 0; j < HTRACE_STATS_LATENCY_BUCKETS; j++) {
+            FANOUT_STATS_ADD(stats, &cstats, rpc_latency_ms[j]);
+        }
+        FANOUT_STATS_MAX(stats, &cstats, buffers_used_max);
+        FANOUT_STATS_MAX(stats, &cstats, buffer_bytes_max);
+        FANOUT_STATS_ADD(stats, &cstats, self_add_span_ns);
+        FANOUT_STATS_ADD(stats, &cstats, self_lock_wait_ns);
+        FANOUT_STATS_ADD(stats, &cstats, self_xmit_wait_ns);
+    }
+}
+
+/**
+ * The pressure on a fanout is the pressure on its most loaded child.
+ */
+static int fanout_rcv_get_pressure(struct htrace_rcv *r)
+{
+    struct fanout_rcv *rcv = (struct fanout_rcv *)r;
+    struct htrace_rcv *child;
+    int i, pressure, max = 0;
+
+    for (i = 0; i < rcv->num_children; i++) {
+        child = rcv->children[i];
+        if (child->ty->get_pressure) {
+            pressure = child->ty->get_pressure(child);
+            if (pressure > max) {
+                max = pressure;
+            }
+        }
+    }
+    return max;
+}
+
+static int fanout_rcv_update_conf(struct htrace_rcv *r,
+                                  const struct htrace_conf *conf)
+{
+    struct fanout_rcv *rcv = (struct fanout_rcv *)r;
+    struct htrace_rcv *child;
+    int i, err, ret = 0;
+
+    for (i = 0; i < rcv->num_children; i++) {
+        child = rcv->children[i];
+        if (child->ty->update_conf) {
+            err = child->ty->update_conf(child, conf);
+            if (err && !ret) {
+                ret = err;
+            }
+        }
+    }
+    return ret;
+}
+
+struct htrace_rcv *htrace_rcv_find(struct htrace_rcv *r,
+                                   const struct htrace_rcv_ty *ty)
+{
+    struct fanout_rcv *rcv;
+    int i;
+
+    if (r->ty == ty) {
+        return r;
+    }
+    if (r->ty == &g_lazy_rcv_ty) {
+        r = lazy_rcv_child(r);
+        if (!r) {
+            return NULL;
+        }
+        return htrace_rcv_find(r, ty);
+    }
+    if (r->ty != &g_fanout_rcv_ty) {
+        return NULL;
+    }
+    rcv = (struct fanout_rcv *)r;
+    for (i = 0; i < rcv->num_children; i++) {
+        if (rcv->children[i]->ty == ty) {
+            return rcv->children[i];
+        }
+    }
+    return NULL;
+}
+
+const struct htrace_rcv_ty g_fanout_rcv_ty = {
+    "fanout",
+    fanout_rcv_create,
+    fanout_rcv_add_span,
+    fanout_rcv_add_spans,
+    NULL,
+    fanout_rcv_flush,
+    fanout_rcv_free,
+    fanout_rcv_get_stats,
+    fanout_rcv_get_pressure,
+    NULL,
+    fanout_rcv_update_conf,
+};
+
+// vim:ts=4:sw=4:et
@@ -0,0 +1,899 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "receiver/receiver.h"
+#include "util/alloc.h"
+#include "util/log.h"
+#include "util/tsd.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @file flight.c
+ *
+ * A span receiver that keeps the most recent spans in a fixed-size ring in
+ * memory, and writes them to a file only when asked to: by
+ * htracer_dump_flight_recorder, by a signal, from a crash handler, or when
+ * it is freed.
+ *
+ * The ring is divided into blocks of FLIGHT_BLOCK_LEN bytes.  Like the
+ * regions of the local mmap receiver, each thread claims a block of its own
+ * and fills it with spans in msgpack form, one after another, without any
+ * lock or system call.  After each batch it publishes the number of bytes of
+ * whole spans in the block.  When the block is full, the thread releases it
+ * and claims the next one round the ring, which overwrites the oldest spans.
+ * Blocks which another thread still holds are skipped.
+ *
+ * Each block has a state word holding its sequence number, which counts the
+ * claims since the ring was created, and whether a thread holds it.  A dump
+ * reads the state of each block, copies its published spans, and then reads
+ * the state again.  If the block was claimed again in the meantime, the copy
+ * may be a mixture of old and new spans, so it is left out.  The dump only
+ * uses async-signal-safe functions, so that it can run from a signal
+ * handler.
+ *
+ * Dumps hold the spans in msgpack form, one after another, which is the
+ * form that htrace_span_reader_open reads.
+ */
+
+/**
+ * The length of a block of the ring.
+ */
+#define FLIGHT_BLOCK_LEN 16384ULL
+
+#define FLIGHT_RCV_SIZE_MIN (64ULL * FLIGHT_BLOCK_LEN)
+
+#define FLIGHT_RCV_SIZE_MAX 0x100000000ULL
+
+/**
+ * The bit of a block state which is set while a thread holds the block.
+ */
+#define FLIGHT_BLOCK_BUSY 0x1ULL
+
+/**
+ * Get the sequence number from a block state.  0 means the block was never
+ * claimed.
+ */
+#define FLIGHT_BLOCK_SEQ(state) ((state) >> 1)
+
+/**
+ * The signals which the crash handler catches.
+ */
+static const int FLIGHT_CRASH_SIGNALS[] = {
+    SIGSEGV,
+    SIGBUS,
+    SIGILL,
+    SIGFPE,
+    SIGABRT,
+};
+
+#define FLIGHT_NUM_CRASH_SIGNALS \
+    (int)(sizeof(FLIGHT_CRASH_SIGNALS) / sizeof(FLIGHT_CRASH_SIGNALS[0]))
+
+/**
+ * The state of a block of the ring.
+ */
+struct flight_block {
+    /**
+     * The sequence number of the block, shifted left by 1, or'ed with
+     * FLIGHT_BLOCK_BUSY while a thread holds the block.
+     */
+    uint64_t state;
+
+    /**
+     * The number of bytes of whole spans at the start of the block.
+     */
+    uint64_t committed;
+} __attribute__((aligned(64)));
+
+struct flight_rcv;
+
+/**
+ * A thread's entry in the flight recorder.
+ */
+struct flight_tblock {
+    /**
+     * Links in the list of all entries.
+     */
+    struct flight_tblock *next;
+    struct flight_tblock *prev;
+
+    /**
+     * The receiver which owns this entry.
+     */
+    struct flight_rcv *rcv;
+
+    /**
+     * The block this thread holds, or NULL if it holds none.
+     */
+    struct flight_block *blk;
+
+    /**
+     * The data of the block.
+     */
+    uint8_t *data;
+
+    /**
+     * The number of bytes of spans in the block.
+     */
+    uint64_t off;
+};
+
+struct flight_rcv {
+    struct htrace_rcv base;
+
+    /**
+     * The htracer object associated with this receiver.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The ring.
+     */
+    uint8_t *ring;
+
+    /**
+     * The length of the ring, and the number of blocks in it.
+     */
+    uint64_t ring_len;
+    uint64_t num_blocks;
+
+    /**
+     * The state of each block.
+     */
+    struct flight_block *blocks;
+
+    /**
+     * The number of blocks claimed since the ring was created.
+     */
+    uint64_t num_claims __attribute__((aligned(64)));
+
+    /**
+     * Each thread's entry.
+     */
+    struct htrace_tsd tsd;
+
+    /**
+     * Nonzero if tsd was initialized.
+     */
+    int tsd_valid;
+
+    /**
+     * Lock protecting the list of per-thread entries.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * All the per-thread entries.  Protected by the lock.
+     */
+    struct flight_tblock *tblocks;
+
+    /**
+     * Statistics.  These are updated with relaxed atomic operations.
+     */
+    uint64_t buffered __attribute__((aligned(64)));
+    uint64_t bytes_serialized;
+    uint64_t dropped_newest;
+    uint64_t dropped_too_large;
+    uint64_t dropped_oom;
+
+    /**
+     * The path to dump to on a signal, a crash, or when we are freed, or
+     * NULL.  Dynamically allocated.
+     */
+    char *path;
+
+    /**
+     * Nonzero if we should dump when we are freed.
+     */
+    int dump_on_free;
+
+    /**
+     * The signal which makes us dump, or 0.
+     */
+    int signal;
+
+    /**
+     * Nonzero if we installed the crash handlers.
+     */
+    int crash_handlers;
+
+    /**
+     * The signal dispositions we replaced.
+     */
+    struct sigaction old_signal_action;
+    struct sigaction old_crash_actions[FLIGHT_NUM_CRASH_SIGNALS];
+
+    /**
+     * A block-sized buffer for dumps from signal handlers, which can't call
+     * malloc.
+     */
+    uint8_t *sig_scratch;
+
+    /**
+     * Nonzero while a signal handler is using sig_scratch.
+     */
+    int sig_dumping;
+};
+
+/**
+ * The flight recorder which handles signals.  Only one can at a time.
+ */
+static struct flight_rcv *g_flight_sig_rcv;
+
+static uint64_t flight_rcv_get_size(struct htrace_log *lg,
+                                    const struct htrace_conf *conf)
+{
+    uint64_t size;
+
+    size = htrace_conf_get_u64(lg, conf, HTRACE_FLIGHT_RCV_SIZE_KEY);
+    if (size < FLIGHT_RCV_SIZE_MIN) {
+        htrace_log(lg, "flight_rcv_create: can't set %s to %" PRId64
+                   ".  Using minimum value of %" PRId64 " instead.\n",
+                   HTRACE_FLIGHT_RCV_SIZE_KEY, size,
+                   (uint64_t)FLIGHT_RCV_SIZE_MIN);
+        size = FLIGHT_RCV_SIZE_MIN;
+    } else if (size > FLIGHT_RCV_SIZE_MAX) {
+        htrace_log(lg, "flight_rcv_create: can't set %s to %" PRId64
+                   ".  Using maximum value of %" PRId64 " instead.\n",
+                   HTRACE_FLIGHT_RCV_SIZE_KEY, size,
+                   (uint64_t)FLIGHT_RCV_SIZE_MAX);
+        size = FLIGHT_RCV_SIZE_MAX;
+    }
+    return size & ~(FLIGHT_BLOCK_LEN - 1);
+}
+
+/**
+ * Write a whole buffer to a file descriptor.  Async-signal-safe.
+ *
+ * @return              0 on success; the error number otherwise.
+ */
+static int flight_write_fully(int fd, const uint8_t *buf, uint64_t len)
+{
+    ssize_t res;
+
+    while (len > 0) {
+        res = write(fd, buf, len);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/**
+ * Copy spans out of a block.  Async-signal-safe.
+ *
+ * The block may be claimed again and overwritten while we copy it.  The
+ * caller notices that afterwards and throws the copy away, so the race is
+ * harmless.  That is why this function is excluded from ThreadSanitizer, and
+ * why it copies a word at a time through a volatile pointer rather than
+ * calling memcpy, which ThreadSanitizer intercepts.
+ *
+ * @param dst           Where to copy to.  Must have room for len bytes,
+ *                          rounded up to a multiple of 8.
+ * @param src           The block data.  Must be 8-byte aligned.
+ * @param len           The number of bytes to copy.
+ */
+__attribute__((no_sanitize_thread))
+static void flight_copy_block(uint8_t *dst, const uint8_t *src, uint64_t len)
+{
+    const volatile uint64_t *s = (const volatile uint64_t *)src;
+    uint64_t i, w;
+
+    for (i = 0; i < len; i += sizeof(w)) {
+        w = *s++;
+        memcpy(dst + i, &w, sizeof(w));
+    }
+}
+
+/**
+ * Write the spans in the ring to a file descriptor.  Async-signal-safe.
+ *
+ * @param rcv           The flight recorder.
+ * @param fd            The file descriptor.
+ * @param scratch       A buffer of FLIGHT_BLOCK_LEN bytes.
+ *
+ * @return              0 on success; the error number otherwise.
+ */
+static int flight_rcv_dump_fd(struct flight_rcv *rcv, int fd,
+                              uint8_t *scratch)
+{
+    uint64_t first, i, state, len;
+    struct flight_block *blk;
+    int ret;
+
+    // Start with the block which is next to be claimed, which is roughly
+    // the oldest one.
+    first = __atomic_load_n(&rcv->num_claims, __ATOMIC_RELAXED);
+    for (i = 0; i < rcv->num_blocks; i++) {
+        blk = &rcv->blocks[(first + i) % rcv->num_blocks];
+        state = __atomic_load_n(&blk->state, __ATOMIC_ACQUIRE);
+        if (FLIGHT_BLOCK_SEQ(state) == 0) {
+            continue;
+        }
+        len = __atomic_load_n(&blk->committed, __ATOMIC_ACQUIRE);
+        if (len > FLIGHT_BLOCK_LEN) {
+            continue;
+        }
+        flight_copy_block(scratch, rcv->ring +
+            (((first + i) % rcv->num_blocks) * FLIGHT_BLOCK_LEN), len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (FLIGHT_BLOCK_SEQ(__atomic_load_n(&blk->state, __ATOMIC_RELAXED))
+                != FLIGHT_BLOCK_SEQ(state)) {
+            continue;
+        }
+        ret = flight_write_fully(fd, scratch, len);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write the spans in the ring to a file.  Async-signal-safe.
+ *
+ * @param rcv           The flight recorder.
+ * @param path          The path of the file.  Any existing file is replaced.
+ * @param scratch       A buffer of FLIGHT_BLOCK_LEN bytes.
+ *
+ * @return              0 on success; the error number otherwise.
+ */
+static int flight_rcv_dump_path(struct flight_rcv *rcv, const char *path,
+                                uint8_t *scratch)
+{
+    int fd, ret;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return errno;
+    }
+    ret = flight_rcv_dump_fd(rcv, fd, scratch);
+    if (close(fd) && !ret) {
+        ret = errno;
+    }
+    return ret;
+}
+
+/**
+ * Dump from a signal handler, unless another signal handler is already
+ * dumping.
+ */
+static void flight_rcv_signal_dump(struct flight_rcv *rcv)
+{
+    int err = errno;
+
+    if (__atomic_exchange_n(&rcv->sig_dumping, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    flight_rcv_dump_path(rcv, rcv->path, rcv->sig_scratch);
+    __atomic_store_n(&rcv->sig_dumping, 0, __ATOMIC_RELEASE);
+    errno = err;
+}
+
+static void flight_rcv_on_signal(int sig)
+{
+    struct flight_rcv *rcv;
+
+    rcv = __atomic_load_n(&g_flight_sig_rcv, __ATOMIC_ACQUIRE);
+    if (rcv) {
+        flight_rcv_signal_dump(rcv);
+    }
+}
+
+static void flight_rcv_on_crash(int sig)
+{
+    struct flight_rcv *rcv;
+    int i;
+
+    rcv = __atomic_load_n(&g_flight_sig_rcv, __ATOMIC_ACQUIRE);
+    if (!rcv) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+    flight_rcv_signal_dump(rcv);
+    // Hand the signal to whoever had it before us.  It is blocked until we
+    // return.  If it came from a faulting instruction, the instruction will
+    // fault again anyway.
+    for (i = 0; i < FLIGHT_NUM_CRASH_SIGNALS; i++) {
+        if (FLIGHT_CRASH_SIGNALS[i] == sig) {
+            sigaction(sig, &rcv->old_crash_actions[i], NULL);
+        }
+    }
+    raise(sig);
+}
+
+/**
+ * Install our signal handlers, if any are configured.
+ *
+ * @return              1 on success; 0 otherwise.
+ */
+static int flight_rcv_install_handlers(struct flight_rcv *rcv)
+{
+    struct htrace_log *lg = rcv->tracer->lg;
+    struct flight_rcv *expected = NULL;
+    struct sigaction act;
+    int i, e;
+
+    if ((!rcv->signal) && (!rcv->crash_handlers)) {
+        return 1;
+    }
+    if (!rcv->path) {
+        htrace_log(lg, "flight_rcv_create: you must set %s in order to dump "
+                   "on a signal or a crash.\n", HTRACE_FLIGHT_RCV_PATH_KEY);
+        return 0;
+    }
+    rcv->sig_scratch = htrace_malloc(FLIGHT_BLOCK_LEN);
+    if (!rcv->sig_scratch) {
+        htrace_log(lg, "flight_rcv_create: OOM while allocating the "
+                   "signal handler buffer.\n");
+        return 0;
+    }
+    if (!__atomic_compare_exchange_n(&g_flight_sig_rcv, &expected, rcv, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        htrace_log(lg, "flight_rcv_create: another flight recorder already "
+                   "handles signals.\n");
+        return 0;
+    }
+    memset(&act, 0, sizeof(act));
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART;
+    if (rcv->signal) {
+        act.sa_handler = flight_rcv_on_signal;
+        if (sigaction(rcv->signal, &act, &rcv->old_signal_action) < 0) {
+            e = errno;
+            htrace_log(lg, "flight_rcv_create: sigaction(%d) failed: "
+                       "error %d (%s)\n", rcv->signal, e, terror(e));
+            rcv->signal = 0;
+            rcv->crash_handlers = 0;
+            return 0;
+        }
+    }
+    if (rcv->crash_handlers) {
+        act.sa_handler = flight_rcv_on_crash;
+        for (i = 0; i < FLIGHT_NUM_CRASH_SIGNALS; i++) {
+            sigaction(FLIGHT_CRASH_SIGNALS[i], &act,
+                      &rcv->old_crash_actions[i]);
+        }
+    }
+    return 1;
+}
+
+/**
+ * Put back the signal handlers we replaced.
+ */
+static void flight_rcv_remove_handlers(struct flight_rcv *rcv)
+{
+    int i;
+
+    if (__atomic_load_n(&g_flight_sig_rcv, __ATOMIC_ACQUIRE) != rcv) {
+        return;
+    }
+    if (rcv->signal) {
+        sigaction(rcv->signal, &rcv->old_signal_action, NULL);
+    }
+    if (rcv->crash_handlers) {
+        for (i = 0; i < FLIGHT_NUM_CRASH_SIGNALS; i++) {
+            sigaction(FLIGHT_CRASH_SIGNALS[i], &rcv->old_crash_actions[i],
+                      NULL);
+        }
+    }
+    __atomic_store_n(&g_flight_sig_rcv, NULL, __ATOMIC_RELEASE);
+}
+
+/**
+ * Get the current thread's entry, creating it if need be.
+ *
+ * @param rcv           The flight recorder.
+ *
+ * @return              The entry, or NULL on OOM.
+ */
+static struct flight_tblock *flight_tblock_get(struct flight_rcv *rcv)
+{
+    struct flight_tblock *tb;
+
+    tb = htrace_tsd_get(&rcv->tsd);
+    if (tb) {
+        return tb;
+    }
+    tb = htrace_calloc(1, sizeof(*tb));
+    if (!tb) {
+        return NULL;
+    }
+    tb->rcv = rcv;
+    if (htrace_tsd_set(&rcv->tsd, tb)) {
+        htrace_free(tb);
+        return NULL;
+    }
+    pthread_mutex_lock(&rcv->lock);
+    tb->next = rcv->tblocks;
+    if (rcv->tblocks) {
+        rcv->tblocks->prev = tb;
+    }
+    rcv->tblocks = tb;
+    pthread_mutex_unlock(&rcv->lock);
+    return tb;
+}
+
+/**
+ * Release the block the current thread holds, if any.
+ */
+static void flight_release(struct flight_tblock *tb)
+{
+    uint64_t state;
+
+    if (!tb->blk) {
+        return;
+    }
+    state = __atomic_load_n(&tb->blk->state, __ATOMIC_RELAXED);
+    __atomic_store_n(&tb->blk->state, state & ~FLIGHT_BLOCK_BUSY,
+                     __ATOMIC_RELEASE);
+    tb->blk = NULL;
+}
+
+/**
+ * Release the block the current thread holds, and claim the next free one.
+ *
+ * @param rcv           The flight recorder.
+ * @param tb            The current thread's entry.
+ *
+ * @return              1 on success; 0 if other threads hold every block.
+ */
+static int flight_claim(struct flight_rcv *rcv, struct flight_tblock *tb)
+{
+    uint64_t i, claim, state, idx;
+    struct flight_block *blk;
+
+    flight_release(tb);
+    for (i = 0; i < rcv->num_blocks; i++) {
+        claim = __atomic_fetch_add(&rcv->num_claims, 1, __ATOMIC_RELAXED);
+        idx = claim % rcv->num_blocks;
+        blk = &rcv->blocks[idx];
+        state = __atomic_load_n(&blk->state, __ATOMIC_RELAXED);
+        if (state & FLIGHT_BLOCK_BUSY) {
+            continue;
+        }
+        if (!__atomic_compare_exchange_n(&blk->state, &state,
+                    ((claim + 1) << 1) | FLIGHT_BLOCK_BUSY, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        __atomic_store_n(&blk->committed, 0, __ATOMIC_RELAXED);
+        // Make sure that a dump which sees any of the spans we are about to
+        // write also sees the new sequence number.  See flight_rcv_dump_fd.
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        tb->blk = blk;
+        tb->data = rcv->ring + (idx * FLIGHT_BLOCK_LEN);
+        tb->off = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Called when a thread with an entry exits.
+ */
+static void flight_tblock_retire(void *data)
+{
+    struct flight_tblock *tb = data;
+    struct flight_rcv *rcv = tb->rcv;
+
+    flight_release(tb);
+    pthread_mutex_lock(&rcv->lock);
+    if (tb->prev) {
+        tb->prev->next = tb->next;
+    } else {
+        rcv->tblocks = tb->next;
+    }
+    if (tb->next) {
+        tb->next->prev = tb->prev;
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    htrace_free(tb);
+}
+
+static void flight_rcv_free(struct htrace_rcv *r);
+
+static struct htrace_rcv *flight_rcv_create(struct htracer *tracer,
+                                            const struct htrace_conf *conf)
+{
+    struct flight_rcv *rcv;
+    const char *path;
+    int ret;
+
+    rcv = htrace_calloc(1, sizeof(*rcv));
+    if (!rcv) {
+        htrace_log(tracer->lg, "flight_rcv_create: OOM while "
+                   "allocating flight_rcv.\n");
+        return NULL;
+    }
+    rcv->base.ty = &g_flight_rcv_ty;
+    rcv->tracer = tracer;
+    ret = pthread_mutex_init(&rcv->lock, NULL);
+    if (ret) {
+        htrace_log(tracer->lg, "flight_rcv_create: pthread_mutex_init "
+                   "error %d: %s\n", ret, terror(ret));
+        htrace_free(rcv);
+        return NULL;
+    }
+    ret = htrace_tsd_init(&rcv->tsd, flight_tblock_retire);
+    if (ret) {
+        htrace_log(tracer->lg, "flight_rcv_create: htrace_tsd_init "
+                   "error %d: %s\n", ret, terror(ret));
+        goto error;
+    }
+    rcv->tsd_valid = 1;
+    rcv->ring_len = flight_rcv_get_size(tracer->lg, conf);
+    rcv->num_blocks = rcv->ring_len / FLIGHT_BLOCK_LEN;
+    rcv->ring = htrace_malloc(rcv->ring_len);
+    rcv->blocks = htrace_calloc(rcv->num_blocks, sizeof(rcv->blocks[0]));
+    if ((!rcv->ring) || (!rcv->blocks)) {
+        htrace_log(tracer->lg, "flight_rcv_create: OOM while allocating a "
+                   "ring of %" PRId64 " bytes.\n", rcv->ring_len);
+        goto error;
+    }
+    path = htrace_conf_get(conf, HTRACE_FLIGHT_RCV_PATH_KEY);
+    if (path && path[0]) {
+        rcv->path = htrace_strdup(path);
+        if (!rcv->path) {
+            htrace_log(tracer->lg, "flight_rcv_create: OOM while "
+                       "copying the path.\n");
+            goto error;
+        }
+    }
+    rcv->dump_on_free = htrace_conf_get_bool(tracer->lg, conf,
+                HTRACE_FLIGHT_RCV_DUMP_ON_FREE_KEY);
+    rcv->signal = htrace_conf_get_u64(tracer->lg, conf,
+                HTRACE_FLIGHT_RCV_SIGNAL_KEY);
+    rcv->crash_handlers = htrace_conf_get_bool(tracer->lg, conf,
+                HTRACE_FLIGHT_RCV_DUMP_ON_CRASH_KEY);
+    if (!flight_rcv_install_handlers(rcv)) {
+        goto error;
+    }
+    htrace_log(tracer->lg, "Initialized flight recorder with size=%" PRId64
+               ", path=%s.\n", rcv->ring_len,
+               (rcv->path ? rcv->path : "(none)"));
+    return (struct htrace_rcv*)rcv;
+
+error:
+    rcv->dump_on_free = 0;
+    flight_rcv_free((struct htrace_rcv*)rcv);
+    return NULL;
+}
+
+/**
+ * Add several spans to the current thread's block.
+ *
+ * @param rcv           The flight recorder.
+ * @param spans         The spans.
+ * @param buf           The spans in msgpack form, one after another, or NULL
+ *                          to serialize them here.
+ * @param lens          The serialized length of each span.  Ignored if buf
+ *                          is NULL.
+ * @param num_spans     The number of spans.
+ */
+static void flight_rcv_add_batch(struct flight_rcv *rcv,
+                                 struct htrace_span **spans,
+                                 const uint8_t *buf, const uint64_t *lens,
+                                 int num_spans)
+{
+    struct flight_tblock *tb;
+    uint64_t len, bytes = 0, added = 0, busy = 0, too_large = 0;
+    uint8_t *data;
+    int i;
+
+    tb = flight_tblock_get(rcv);
+    if (!tb) {
+        __atomic_fetch_add(&rcv->dropped_oom, num_spans, __ATOMIC_RELAXED);
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                               "flight_rcv_add_spans: OOM\n");
+        return;
+    }
+    for (i = 0; i < num_spans; i++) {
+        spans[i]->trid = rcv->tracer->trid;
+        len = buf ? lens[i] : span_msgpack_size(spans[i]);
+        if (len > FLIGHT_BLOCK_LEN) {
+            too_large++;
+        } else if ((!tb->blk) || (tb->off + len > FLIGHT_BLOCK_LEN)) {
+            // Publish what we have before moving on to a new block.
+            if (tb->blk) {
+                __atomic_store_n(&tb->blk->committed, tb->off,
+                                 __ATOMIC_RELEASE);
+            }
+            if (!flight_claim(rcv, tb)) {
+                busy++;
+            }
+        }
+        if ((len <= FLIGHT_BLOCK_LEN) && tb->blk &&
+                (tb->off + len <= FLIGHT_BLOCK_LEN)) {
+            data = tb->data + tb->off;
+            if (buf) {
+                memcpy(data, buf, len);
+            } else {
+                span_msgpack_encode(spans[i], data);
+            }
+            tb->off += len;
+            bytes += len;
+            added++;
+        }
+        spans[i]->trid = NULL;
+        if (buf) {
+            buf += len;
+        }
+    }
+    if (tb->blk) {
+        __atomic_store_n(&tb->blk->committed, tb->off, __ATOMIC_RELEASE);
+    }
+    __atomic_fetch_add(&rcv->buffered, added, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&rcv->bytes_serialized, bytes, __ATOMIC_RELAXED);
+    if (busy) {
+        __atomic_fetch_add(&rcv->dropped_newest, busy, __ATOMIC_RELAXED);
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_WARN,
+                "flight_rcv_add_spans: other threads hold every block of "
+                "the ring.  Dropping spans.\n");
+    }
+    if (too_large) {
+        __atomic_fetch_add(&rcv->dropped_too_large, too_large,
+                           __ATOMIC_RELAXED);
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_WARN,
+                "flight_rcv_add_spans: a span does not fit in a block of "
+                "%" PRId64 " bytes.  Dropping it.\n",
+                (uint64_t)FLIGHT_BLOCK_LEN);
+    }
+}
+
+static void flight_rcv_add_spans(struct htrace_rcv *r,
+                                 struct htrace_span **spans, int num_spans)
+{
+    flight_rcv_add_batch((struct flight_rcv *)r, spans, NULL, NULL,
+                         num_spans);
+}
+
+static void flight_rcv_add_msgpack(struct htrace_rcv *r,
+                                   struct htrace_span **spans,
+                                   const uint8_t *buf, const uint64_t *lens,
+                                   int num_spans)
+{
+    flight_rcv_add_batch((struct flight_rcv *)r, spans, buf, lens,
+                         num_spans);
+}
+
+static void flight_rcv_add_span(struct htrace_rcv *r,
+                                struct htrace_span *span)
+{
+    flight_rcv_add_spans(r, &span, 1);
+}
+
+static void flight_rcv_flush(struct htrace_rcv *r)
+{
+    // Spans stay in memory until they are dumped.
+}
+
+int flight_rcv_dump(struct htrace_rcv *r, const char *path)
+{
+    struct flight_rcv *rcv = (struct flight_rcv *)r;
+    uint8_t *scratch;
+    int ret;
+
+    if (!path) {
+        path = rcv->path;
+        if (!path) {
+            return EINVAL;
+        }
+    }
+    scratch = htrace_malloc(FLIGHT_BLOCK_LEN);
+    if (!scratch) {
+        return ENOMEM;
+    }
+    ret = flight_rcv_dump_path(rcv, path, scratch);
+    htrace_free(scratch);
+    return ret;
+}
+
+static void flight_rcv_free(struct htrace_rcv *r)
+{
+    struct flight_rcv *rcv = (struct flight_rcv *)r;
+    struct flight_tblock *tb;
+    struct htrace_log *lg;
+    int ret;
+
+    if (!rcv) {
+        return;
+    }
+    lg = rcv->tracer->lg;
+    // An exiting thread releases its block from flight_tblock_retire.  Wait
+    // for those, so that the final dump sees every block which is no longer
+    // being written.
+    if (rcv->tsd_valid) {
+        htrace_tsd_destroy(&rcv->tsd);
+    }
+    flight_rcv_remove_handlers(rcv);
+    if (rcv->dump_on_free && rcv->path) {
+        ret = flight_rcv_dump(r, NULL);
+        if (ret) {
+            htrace_log(lg, "flight_rcv_free: failed to dump to %s: "
+                       "error %d (%s)\n", rcv->path, ret, terror(ret));
+        }
+    }
+    htrace_log(lg, "Shutting down flight recorder: buffered=%" PRId64
+               ", dropped_newest=%" PRId64 "\n", rcv->buffered,
+               rcv->dropped_newest);
+    // The entries which are left belong to threads which are still running.
+    while ((tb = rcv->tblocks)) {
+        rcv->tblocks = tb->next;
+        htrace_free(tb);
+    }
+    pthread_mutex_destroy(&rcv->lock);
+    htrace_free(rcv->sig_scratch);
+    htrace_free(rcv->path);
+    htrace_free(rcv->blocks);
+    htrace_free(rcv->ring);
+    htrace_free(rcv);
+}
+
+static void flight_rcv_get_stats(struct htrace_rcv *r,
+                                 struct htrace_stats *stats)
+{
+    struct flight_rcv *rcv = (struct flight_rcv *)r;
+
+    stats->buffered = __atomic_load_n(&rcv->buffered, __ATOMIC_RELAXED);
+    stats->dropped_newest =
+        __atomic_load_n(&rcv->dropped_newest, __ATOMIC_RELAXED);
+    stats->dropped_too_large =
+        __atomic_load_n(&rcv->dropped_too_large, __ATOMIC_RELAXED);
+    stats->dropped_oom +=
+        __atomic_load_n(&rcv->dropped_oom, __ATOMIC_RELAXED);
+    stats->bytes_serialized =
+        __atomic_load_n(&rcv->bytes_serialized, __ATOMIC_RELAXED);
+}
+
+const struct htrace_rcv_ty g_flight_rcv_ty = {
+    "flight",
+    flight_rcv_create,
+    flight_rcv_add_span,
+    flight_rcv_add_spans,
+    NULL,
+    flight_rcv_flush,
+    flight_rcv_free,
+    flight_rcv_get_stats,
+    NULL,
+    flight_rcv_add_msgpack,
+    NULL,
+};
+
+// vim:ts=4:sw=4:et
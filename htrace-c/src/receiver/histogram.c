@@ -0,0 +1,880 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "core/span_id.h"
+#include "receiver/receiver.h"
+#include "util/alloc.h"
+#include "util/htable.h"
+#include "util/log.h"
+#include "util/time.h"
+#include "util/tsd.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file histogram.c
+ *
+ * A span receiver that aggregates spans into latency histograms, one per
+ * span description, and sends only the histograms on.
+ *
+ * Each thread adds its spans to a shard of its own, which maps descriptions
+ * to histograms.  The shard has a lock, but only the flusher thread ever
+ * contends for it.  Every histogram.interval.ms, the flusher thread swaps
+ * every shard for an empty one, merges the histograms it took, and gives one
+ * summary span per description to the span receiver named by
+ * histogram.receiver.  A summary span has the description of the spans it
+ * summarizes, begins and ends with the interval, and carries the histogram
+ * in its key/value annotations.  See HTRACE_HISTOGRAM_RCV_RECEIVER_KEY.
+ *
+ * The histograms are log-linear, like HDR histograms: each power of 2 of
+ * microseconds is divided into HISTOGRAM_SUB_BUCKETS buckets of equal width,
+ * so that every bucket is within about 6% of the values in it.
+ */
+
+/**
+ * The number of buckets each power of 2 is divided into, and its log.
+ */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+/**
+ * The largest duration we track, in microseconds.  Longer spans are counted
+ * in the last bucket.
+ */
+#define HISTOGRAM_MAX_US ((1ULL << 40) - 1)
+
+/**
+ * The number of buckets in a histogram.
+ */
+#define HISTOGRAM_NUM_BUCKETS \
+    ((40 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+#define HISTOGRAM_INTERVAL_MS_MIN 100
+
+#define HISTOGRAM_INTERVAL_MS_MAX 86400000
+
+/**
+ * The initial capacity of the description tables.
+ */
+#define HISTOGRAM_HTABLE_CAPACITY 16
+
+/**
+ * The percentiles we put in summary spans, in tenths of a percent.
+ */
+static const int HISTOGRAM_PERMILLES[] = { 500, 900, 990, 999 };
+
+#define HISTOGRAM_NUM_PERMILLES \
+    (int)(sizeof(HISTOGRAM_PERMILLES) / sizeof(HISTOGRAM_PERMILLES[0]))
+
+/**
+ * The histogram of one span description.
+ */
+struct histogram_entry {
+    /**
+     * The number of spans, and the sum, minimum and maximum of their
+     * durations in microseconds.
+     */
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t min_us;
+    uint64_t max_us;
+
+    /**
+     * The number of spans in each bucket.
+     */
+    uint64_t buckets[HISTOGRAM_NUM_BUCKETS];
+
+    /**
+     * The span description.  Also the key of the entry in its table.
+     */
+    char desc[0];
+};
+
+struct histogram_rcv;
+
+/**
+ * A thread's shard of the histograms.
+ */
+struct histogram_shard {
+    /**
+     * Links in the list of all shards.  Protected by the receiver lock.
+     */
+    struct histogram_shard *next;
+    struct histogram_shard *prev;
+
+    /**
+     * The receiver which owns this shard.
+     */
+    struct histogram_rcv *rcv;
+
+    /**
+     * Protects descs.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Maps span descriptions to struct histogram_entry objects.
+     */
+    struct htable *descs;
+};
+
+struct histogram_rcv {
+    struct htrace_rcv base;
+
+    /**
+     * The htracer object associated with this receiver.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The span receiver which gets the summary spans.
+     */
+    struct htrace_rcv *child;
+
+    /**
+     * How often to send the summary spans.
+     */
+    uint64_t interval_ms;
+
+    /**
+     * Each thread's shard.
+     */
+    struct htrace_tsd tsd;
+
+    /**
+     * Nonzero if tsd was initialized.
+     */
+    int tsd_valid;
+
+    /**
+     * Protects everything below, except the statistics.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * All the per-thread shards.
+     */
+    struct histogram_shard *shards;
+
+    /**
+     * The histograms taken from the shards, or NULL if there are none yet.
+     */
+    struct htable *merged;
+
+    /**
+     * The wall-clock time in milliseconds when the current interval began.
+     */
+    uint64_t begin_ms;
+
+    /**
+     * The flusher thread, and whether it was started.
+     */
+    pthread_t flusher;
+    int flusher_valid;
+
+    /**
+     * Signalled to wake the flusher thread at shutdown.
+     */
+    pthread_cond_t cond;
+
+    /**
+     * Nonzero when the flusher thread should exit.
+     */
+    int shutdown;
+
+    /**
+     * Statistics.  These are updated with relaxed atomic operations.
+     */
+    uint64_t buffered;
+    uint64_t dropped_oom;
+};
+
+/**
+ * Get the bucket of a duration.
+ *
+ * @param us            The duration in microseconds.
+ *
+ * @return              The bucket index.
+ */
+static int histogram_bucket(uint64_t us)
+{
+    int e;
+
+    if (us > HISTOGRAM_MAX_US) {
+        us = HISTOGRAM_MAX_US;
+    }
+    if (us < HISTOGRAM_SUB_BUCKETS) {
+        return us;
+    }
+    e = 63 - __builtin_clzll(us);
+    return ((e - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS) +
+        ((us >> (e - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/**
+ * Get the smallest duration in a bucket.
+ *
+ * @param idx           The bucket index.
+ *
+ * @return              The smallest duration in microseconds.
+ */
+static uint64_t histogram_bucket_low(int idx)
+{
+    int e;
+
+    if (idx < HISTOGRAM_SUB_BUCKETS) {
+        return idx;
+    }
+    e = (idx / HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_SUB_BITS - 1;
+    return ((uint64_t)(HISTOGRAM_SUB_BUCKETS +
+                       (idx % HISTOGRAM_SUB_BUCKETS))) <<
+        (e - HISTOGRAM_SUB_BITS);
+}
+
+/**
+ * Get the largest duration in a bucket.
+ *
+ * @param idx           The bucket index.
+ *
+ * @return              The largest duration in microseconds.
+ */
+static uint64_t histogram_bucket_high(int idx)
+{
+    if (idx + 1 >= HISTOGRAM_NUM_BUCKETS) {
+        return HISTOGRAM_MAX_US;
+    }
+    return histogram_bucket_low(idx + 1) - 1;
+}
+
+/**
+ * Get the duration of a span in microseconds.
+ */
+static uint64_t histogram_span_us(const struct htrace_span *span)
+{
+    int64_t ns;
+
+    if (span->end_ms < span->begin_ms) {
+        return 0;
+    }
+    ns = ((int64_t)(span->end_ms - span->begin_ms) * 1000000LL) +
+        (int64_t)span->end_sub_ns - (int64_t)span->begin_sub_ns;
+    return (ns < 0) ? 0 : (uint64_t)(ns / 1000);
+}
+
+static void histogram_entry_add(struct histogram_entry *he, uint64_t us)
+{
+    if ((he->count == 0) || (us < he->min_us)) {
+        he->min_us = us;
+    }
+    if (us > he->max_us) {
+        he->max_us = us;
+    }
+    he->count++;
+    he->sum_us += us;
+    he->buckets[histogram_bucket(us)]++;
+}
+
+static void histogram_entry_merge(struct histogram_entry *dst,
+                                  const struct histogram_entry *src)
+{
+    int i;
+
+    if ((dst->count == 0) || (src->min_us < dst->min_us)) {
+        dst->min_us = src->min_us;
+    }
+    if (src->max_us > dst->max_us) {
+        dst->max_us = src->max_us;
+    }
+    dst->count += src->count;
+    dst->sum_us += src->sum_us;
+    for (i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+/**
+ * Get the duration below which a given fraction of the spans fall.
+ *
+ * @param he            The histogram.  Must not be empty.
+ * @param permille      The fraction, in tenths of a percent.
+ *
+ * @return              The largest duration in the bucket holding that
+ *                          span, clamped to the range of the histogram.
+ */
+static uint64_t histogram_entry_percentile(const struct histogram_entry *he,
+                                           int permille)
+{
+    uint64_t target, seen = 0, val;
+    int i;
+
+    target = ((he->count * permille) + 999) / 1000;
+    if (target == 0) {
+        target = 1;
+    }
+    for (i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        seen += he->buckets[i];
+        if (seen >= target) {
+            break;
+        }
+    }
+    val = histogram_bucket_high(i);
+    if (val < he->min_us) {
+        return he->min_us;
+    } else if (val > he->max_us) {
+        return he->max_us;
+    }
+    return val;
+}
+
+static void histogram_entry_free(void *ctx, void *key, void *val)
+{
+    htrace_free(val);
+}
+
+static struct htable *histogram_htable_alloc(void)
+{
+    return htable_alloc(HISTOGRAM_HTABLE_CAPACITY, ht_hash_string,
+                        ht_compare_string);
+}
+
+static void histogram_merge_visitor(void *ctx, void *key, void *val)
+{
+    struct histogram_rcv *rcv = ctx;
+    struct histogram_entry *src = val, *dst;
+
+    if (!rcv->merged) {
+        rcv->merged = histogram_htable_alloc();
+    }
+    if (rcv->merged) {
+        dst = htable_get(rcv->merged, src->desc);
+        if (dst) {
+            histogram_entry_merge(dst, src);
+            htrace_free(src);
+            return;
+        }
+        if (htable_put(rcv->merged, src->desc, src) == 0) {
+            return;
+        }
+    }
+    __atomic_fetch_add(&rcv->dropped_oom, src->count, __ATOMIC_RELAXED);
+    htrace_free(src);
+}
+
+/**
+ * Merge a table of histograms into the merged table.  Called with the
+ * receiver lock held.
+ *
+ * @param rcv           The histogram receiver.
+ * @param descs         The table.  This function frees it, along with the
+ *                          entries which it does not move to the merged
+ *                          table.
+ */
+static void histogram_merge_table(struct histogram_rcv *rcv,
+                                  struct htable *descs)
+{
+    if (!descs) {
+        return;
+    }
+    htable_visit(descs, histogram_merge_visitor, rcv);
+    htable_free(descs);
+}
+
+/**
+ * Called when a thread with a shard exits.  Its histograms are merged, to be
+ * sent with the rest at the end of the interval.
+ */
+static void histogram_shard_retire(void *data)
+{
+    struct histogram_shard *shard = data;
+    struct histogram_rcv *rcv = shard->rcv;
+
+    pthread_mutex_lock(&rcv->lock);
+    if (shard->prev) {
+        shard->prev->next = shard->next;
+    } else {
+        rcv->shards = shard->next;
+    }
+    if (shard->next) {
+        shard->next->prev = shard->prev;
+    }
+    histogram_merge_table(rcv, shard->descs);
+    pthread_mutex_unlock(&rcv->lock);
+    pthread_mutex_destroy(&shard->lock);
+    htrace_free(shard);
+}
+
+/**
+ * Get the current thread's shard, creating it if need be.
+ *
+ * @param rcv           The histogram receiver.
+ *
+ * @return              The shard, or NULL on OOM.
+ */
+static struct histogram_shard *histogram_shard_get(struct histogram_rcv *rcv)
+{
+    struct histogram_shard *shard;
+
+    shard = htrace_tsd_get(&rcv->tsd);
+    if (shard) {
+        return shard;
+    }
+    shard = htrace_calloc(1, sizeof(*shard));
+    if (!shard) {
+        return NULL;
+    }
+    shard->rcv = rcv;
+    if (pthread_mutex_init(&shard->lock, NULL)) {
+        htrace_free(shard);
+        return NULL;
+    }
+    if (htrace_tsd_set(&rcv->tsd, shard)) {
+        pthread_mutex_destroy(&shard->lock);
+        htrace_free(shard);
+        return NULL;
+    }
+    pthread_mutex_lock(&rcv->lock);
+    shard->next = rcv->shards;
+    if (rcv->shards) {
+        rcv->shards->prev = shard;
+    }
+    rcv->shards = shard;
+    pthread_mutex_unlock(&rcv->lock);
+    return shard;
+}
+
+/**
+ * Build the summary span of a histogram.
+ *
+ * @param rcv           The histogram receiver.
+ * @param he            The histogram.
+ * @param end_ms        The end of the interval.
+ *
+ * @return              The span, or NULL on OOM.
+ */
+static struct htrace_span *histogram_summarize(struct histogram_rcv *rcv,
+                    const struct histogram_entry *he, uint64_t end_ms)
+{
+    struct htrace_span_id span_id;
+    struct htrace_span *span;
+    char key[32], val[64], *buckets;
+    size_t off = 0;
+    int i, ret = 0;
+
+    htrace_span_id_generate(&span_id, rcv->tracer->rnd, NULL);
+    span = htrace_span_alloc(he->desc, rcv->begin_ms, &span_id);
+    if (!span) {
+        return NULL;
+    }
+    span->end_ms = end_ms;
+    snprintf(val, sizeof(val), "%" PRIu64, he->count);
+    ret |= htrace_span_add_kv(span, "histogram.count", val);
+    snprintf(val, sizeof(val), "%" PRIu64, he->min_us);
+    ret |= htrace_span_add_kv(span, "histogram.min.us", val);
+    snprintf(val, sizeof(val), "%" PRIu64, he->max_us);
+    ret |= htrace_span_add_kv(span, "histogram.max.us", val);
+    snprintf(val, sizeof(val), "%" PRIu64, he->sum_us / he->count);
+    ret |= htrace_span_add_kv(span, "histogram.mean.us", val);
+    for (i = 0; i < HISTOGRAM_NUM_PERMILLES; i++) {
+        if (HISTOGRAM_PERMILLES[i] % 10) {
+            snprintf(key, sizeof(key), "histogram.p%d.%d.us",
+                     HISTOGRAM_PERMILLES[i] / 10, HISTOGRAM_PERMILLES[i] % 10);
+        } else {
+            snprintf(key, sizeof(key), "histogram.p%d.us",
+                     HISTOGRAM_PERMILLES[i] / 10);
+        }
+        snprintf(val, sizeof(val), "%" PRIu64,
+                 histogram_entry_percentile(he, HISTOGRAM_PERMILLES[i]));
+        ret |= htrace_span_add_kv(span, key, val);
+    }
+    // Each nonempty bucket is "low:count", where low is the smallest
+    // duration in the bucket in microseconds.
+    buckets = htrace_malloc((HISTOGRAM_NUM_BUCKETS * 42) + 1);
+    if (!buckets) {
+        htrace_span_free(span);
+        return NULL;
+    }
+    buckets[0] = '\0';
+    for (i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        if (he->buckets[i]) {
+            off += sprintf(buckets + off, "%s%" PRIu64 ":%" PRIu64,
+                           (off ? "," : ""), histogram_bucket_low(i),
+                           he->buckets[i]);
+        }
+    }
+    ret |= htrace_span_add_kv(span, "histogram.buckets", buckets);
+    htrace_free(buckets);
+    if (ret) {
+        htrace_span_free(span);
+        return NULL;
+    }
+    return span;
+}
+
+struct histogram_emit_ctx {
+    struct histogram_rcv *rcv;
+    uint64_t end_ms;
+};
+
+static void histogram_emit_visitor(void *c, void *key, void *val)
+{
+    struct histogram_emit_ctx *ctx = c;
+    struct histogram_rcv *rcv = ctx->rcv;
+    struct histogram_entry *he = val;
+    struct htrace_span *span;
+
+    span = histogram_summarize(rcv, he, ctx->end_ms);
+    if (span) {
+        rcv->child->ty->add_span(rcv->child, span);
+        htrace_span_free(span);
+    } else {
+        __atomic_fetch_add(&rcv->dropped_oom, he->count, __ATOMIC_RELAXED);
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                "histogram_emit: OOM while building the summary of '%s'\n",
+                he->desc);
+    }
+    htrace_free(he);
+}
+
+/**
+ * Take the histograms from every shard, and send their summaries to the
+ * child span receiver.  Called with the receiver lock held.
+ *
+ * @param rcv           The histogram receiver.
+ */
+static void histogram_emit(struct histogram_rcv *rcv)
+{
+    struct histogram_emit_ctx ctx;
+    struct histogram_shard *shard;
+    struct htable *descs, *taken;
+
+    for (shard = rcv->shards; shard; shard = shard->next) {
+        descs = histogram_htable_alloc();
+        if (!descs) {
+            // Leave this shard's histograms for the next interval.
+            continue;
+        }
+        pthread_mutex_lock(&shard->lock);
+        if ((!shard->descs) || (htable_used(shard->descs) == 0)) {
+            pthread_mutex_unlock(&shard->lock);
+            htable_free(descs);
+            continue;
+        }
+        taken = shard->descs;
+        shard->descs = descs;
+        pthread_mutex_unlock(&shard->lock);
+        histogram_merge_table(rcv, taken);
+    }
+    ctx.rcv = rcv;
+    ctx.end_ms = now_ms(rcv->tracer->lg);
+    if (rcv->merged) {
+        htable_visit(rcv->merged, histogram_emit_visitor, &ctx);
+        htable_free(rcv->merged);
+        rcv->merged = NULL;
+    }
+    rcv->begin_ms = ctx.end_ms;
+    rcv->child->ty->flush(rcv->child);
+}
+
+/**
+ * The flusher thread.  It sends the summaries every interval.
+ */
+static void *histogram_flusher(void *data)
+{
+    struct histogram_rcv *rcv = data;
+    struct timespec deadline;
+    int ret;
+
+    pthread_mutex_lock(&rcv->lock);
+    while (!rcv->shutdown) {
+        // Note that pthread_cond_timedwait uses the realtime clock.
+        ms_to_timespec(rcv->begin_ms + rcv->interval_ms, &deadline);
+        ret = pthread_cond_timedwait(&rcv->cond, &rcv->lock, &deadline);
+        if (rcv->shutdown) {
+            break;
+        }
+        if (ret == ETIMEDOUT) {
+            histogram_emit(rcv);
+        } else if (ret) {
+            htrace_log(rcv->tracer->lg, "histogram_flusher: "
+                       "pthread_cond_timedwait error: %d (%s)\n",
+                       ret, terror(ret));
+            histogram_emit(rcv);
+        }
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    return NULL;
+}
+
+static uint64_t histogram_get_interval_ms(struct htrace_log *lg,
+                                          const struct htrace_conf *conf)
+{
+    uint64_t val;
+
+    val = htrace_conf_get_u64(lg, conf, HTRACE_HISTOGRAM_RCV_INTERVAL_MS_KEY);
+    if (val < HISTOGRAM_INTERVAL_MS_MIN) {
+        htrace_log(lg, "histogram_rcv_create: can't set %s to %" PRId64
+                   ".  Using minimum value of %d instead.\n",
+                   HTRACE_HISTOGRAM_RCV_INTERVAL_MS_KEY, val,
+                   HISTOGRAM_INTERVAL_MS_MIN);
+        return HISTOGRAM_INTERVAL_MS_MIN;
+    } else if (val > HISTOGRAM_INTERVAL_MS_MAX) {
+        htrace_log(lg, "histogram_rcv_create: can't set %s to %" PRId64
+                   ".  Using maximum value of %d instead.\n",
+                   HTRACE_HISTOGRAM_RCV_INTERVAL_MS_KEY, val,
+                   HISTOGRAM_INTERVAL_MS_MAX);
+        return HISTOGRAM_INTERVAL_MS_MAX;
+    }
+    return val;
+}
+
+static void histogram_rcv_free(struct htrace_rcv *r);
+
+static struct htrace_rcv *histogram_rcv_create(struct htracer *tracer,
+                                            const struct htrace_conf *conf)
+{
+    struct histogram_rcv *rcv;
+    const struct htrace_rcv_ty *ty;
+    const char *name;
+    int ret;
+
+    rcv = htrace_calloc(1, sizeof(*rcv));
+    if (!rcv) {
+        htrace_log(tracer->lg, "histogram_rcv_create: OOM while "
+                   "allocating histogram_rcv.\n");
+        return NULL;
+    }
+    rcv->base.ty = &g_histogram_rcv_ty;
+    rcv->tracer = tracer;
+    ret = pthread_mutex_init(&rcv->lock, NULL);
+    if (ret) {
+        htrace_log(tracer->lg, "histogram_rcv_create: pthread_mutex_init "
+                   "error %d: %s\n", ret, terror(ret));
+        htrace_free(rcv);
+        return NULL;
+    }
+    ret = pthread_cond_init(&rcv->cond, NULL);
+    if (ret) {
+        htrace_log(tracer->lg, "histogram_rcv_create: pthread_cond_init "
+                   "error %d: %s\n", ret, terror(ret));
+        pthread_mutex_destroy(&rcv->lock);
+        htrace_free(rcv);
+        return NULL;
+    }
+    ret = htrace_tsd_init(&rcv->tsd, histogram_shard_retire);
+    if (ret) {
+        htrace_log(tracer->lg, "histogram_rcv_create: htrace_tsd_init "
+                   "error %d: %s\n", ret, terror(ret));
+        goto error;
+    }
+    rcv->tsd_valid = 1;
+    rcv->interval_ms = histogram_get_interval_ms(tracer->lg, conf);
+    name = htrace_conf_get(conf, HTRACE_HISTOGRAM_RCV_RECEIVER_KEY);
+    ty = name ? htrace_rcv_ty_find(name) : NULL;
+    if ((!ty) || (ty == &g_histogram_rcv_ty)) {
+        htrace_log(tracer->lg, "histogram_rcv_create: invalid span "
+                   "receiver type '%s' in %s.\n", (name ? name : "(null)"),
+                   HTRACE_HISTOGRAM_RCV_RECEIVER_KEY);
+        goto error;
+    }
+    rcv->child = ty->create(tracer, conf);
+    if (!rcv->child) {
+        htrace_log(tracer->lg, "histogram_rcv_create: failed to create "
+                   "the %s span receiver.\n", name);
+        goto error;
+    }
+    rcv->begin_ms = now_ms(tracer->lg);
+    ret = pthread_create(&rcv->flusher, NULL, histogram_flusher, rcv);
+    if (ret) {
+        htrace_log(tracer->lg, "histogram_rcv_create: pthread_create "
+                   "error %d: %s\n", ret, terror(ret));
+        goto error;
+    }
+    rcv->flusher_valid = 1;
+    htrace_log(tracer->lg, "Initialized histogram receiver with "
+               "interval_ms=%" PRId64 ", sending summaries to %s.\n",
+               rcv->interval_ms, name);
+    return (struct htrace_rcv*)rcv;
+
+error:
+    histogram_rcv_free((struct htrace_rcv*)rcv);
+    return NULL;
+}
+
+static void histogram_rcv_add_spans(struct htrace_rcv *r,
+                                    struct htrace_span **spans,
+                                    int num_spans)
+{
+    struct histogram_rcv *rcv = (struct histogram_rcv *)r;
+    struct histogram_shard *shard;
+    struct histogram_entry *he;
+    uint64_t added = 0, oom = 0;
+    size_t len;
+    int i;
+
+    shard = histogram_shard_get(rcv);
+    if (!shard) {
+        __atomic_fetch_add(&rcv->dropped_oom, num_spans, __ATOMIC_RELAXED);
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                               "histogram_rcv_add_spans: OOM\n");
+        return;
+    }
+    pthread_mutex_lock(&shard->lock);
+    if (!shard->descs) {
+        shard->descs = histogram_htable_alloc();
+    }
+    for (i = 0; i < num_spans; i++) {
+        he = shard->descs ? htable_get(shard->descs, spans[i]->desc) : NULL;
+        if ((!he) && shard->descs) {
+            len = strlen(spans[i]->desc) + 1;
+            he = htrace_calloc(1, sizeof(*he) + len);
+            if (he) {
+                memcpy(he->desc, spans[i]->desc, len);
+                if (htable_put(shard->descs, he->desc, he)) {
+                    htrace_free(he);
+                    he = NULL;
+                }
+            }
+        }
+        if (!he) {
+            oom++;
+            continue;
+        }
+        histogram_entry_add(he, histogram_span_us(spans[i]));
+        added++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_fetch_add(&rcv->buffered, added, __ATOMIC_RELAXED);
+    if (oom) {
+        __atomic_fetch_add(&rcv->dropped_oom, oom, __ATOMIC_RELAXED);
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                               "histogram_rcv_add_spans: OOM\n");
+    }
+}
+
+static void histogram_rcv_add_span(struct htrace_rcv *r,
+                                   struct htrace_span *span)
+{
+    histogram_rcv_add_spans(r, &span, 1);
+}
+
+static void histogram_rcv_flush(struct htrace_rcv *r)
+{
+    struct histogram_rcv *rcv = (struct histogram_rcv *)r;
+
+    pthread_mutex_lock(&rcv->lock);
+    histogram_emit(rcv);
+    pthread_mutex_unlock(&rcv->lock);
+}
+
+static void histogram_rcv_free(struct htrace_rcv *r)
+{
+    struct histogram_rcv *rcv = (struct histogram_rcv *)r;
+    struct histogram_shard *shard;
+    struct htrace_log *lg;
+    int ret;
+
+    if (!rcv) {
+        return;
+    }
+    lg = rcv->tracer->lg;
+    // Let the threads which are exiting merge their shards first, so that
+    // their spans make it into the final summaries.
+    if (rcv->tsd_valid) {
+        htrace_tsd_destroy(&rcv->tsd);
+    }
+    if (rcv->flusher_valid) {
+        pthread_mutex_lock(&rcv->lock);
+        rcv->shutdown = 1;
+        pthread_cond_signal(&rcv->cond);
+        pthread_mutex_unlock(&rcv->lock);
+        ret = pthread_join(rcv->flusher, NULL);
+        if (ret) {
+            htrace_log(lg, "histogram_rcv_free: pthread_join "
+                       "error %d: %s\n", ret, terror(ret));
+        }
+    }
+    if (rcv->child) {
+        pthread_mutex_lock(&rcv->lock);
+        histogram_emit(rcv);
+        pthread_mutex_unlock(&rcv->lock);
+    }
+    htrace_log(lg, "Shutting down histogram receiver: buffered=%" PRId64
+               ", dropped_oom=%" PRId64 "\n", rcv->buffered,
+               rcv->dropped_oom);
+    // The shards which are left belong to threads which are still running.
+    while ((shard = rcv->shards)) {
+        rcv->shards = shard->next;
+        if (shard->descs) {
+            htable_visit(shard->descs, histogram_entry_free, NULL);
+            htable_free(shard->descs);
+        }
+        pthread_mutex_destroy(&shard->lock);
+        htrace_free(shard);
+    }
+    if (rcv->merged) {
+        htable_visit(rcv->merged, histogram_entry_free, NULL);
+        htable_free(rcv->merged);
+    }
+    if (rcv->child) {
+        rcv->child->ty->free(rcv->child);
+    }
+    pthread_cond_destroy(&rcv->cond);
+    pthread_mutex_destroy(&rcv->lock);
+    htrace_free(rcv);
+}
+
+static void histogram_rcv_get_stats(struct htrace_rcv *r,
+                                    struct htrace_stats *stats)
+{
+    struct histogram_rcv *rcv = (struct histogram_rcv *)r;
+
+    // The child's statistics are about the summary spans.
+    if (rcv->child->ty->get_stats) {
+        rcv->child->ty->get_stats(rcv->child, stats);
+    }
+    stats->buffered = __atomic_load_n(&rcv->buffered, __ATOMIC_RELAXED);
+    stats->dropped_oom +=
+        __atomic_load_n(&rcv->dropped_oom, __ATOMIC_RELAXED);
+}
+
+const struct htrace_rcv_ty g_histogram_rcv_ty = {
+    "histogram",
+    histogram_rcv_create,
+    histogram_rcv_add_span,
+    histogram_rcv_add_spans,
+    NULL,
+    histogram_rcv_flush,
+    histogram_rcv_free,
+    histogram_rcv_get_stats,
+    NULL,
+    NULL,
+    NULL,
+};
+
+// vim:ts=4:sw=4:et
@@ -17,15 +17,22 @@
  */
 
 #include "receiver/hrpc.h"
+#include "util/alloc.h"
+#include "util/build.h"
+#include "util/cmp.h"
+#include "util/cmp_util.h"
 #include "util/log.h"
 #include "util/string.h"
 #include "util/time.h"
+#include "util/uring.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -33,8 +40,14 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
 #if defined(__OpenBSD__)
 #include <sys/types.h>
 #define be16toh(x) betoh16(x)
@@ -50,33 +63,163 @@
  * @file hrpc.c
  *
  * Implements sending messages via HRPC.
+ *
+ * Each request carries a sequence number, which the server echoes back in the
+ * response.  This lets callers keep several requests outstanding on one
+ * connection, and match up the responses as they arrive.  The server may
+ * answer requests in any order.
+ *
+ * Sockets are non-blocking.  Connecting and sending wait for the socket with
+ * poll, up to a deadline set by the write timeout.  Responses are read
+ * piece by piece as data arrives, so that a server which sends half a
+ * response and then stalls can't hold up a thread waiting on several
+ * connections.
+ *
+ * Looked-up addresses are cached, so that reconnecting does not have to wait
+ * for DNS.  The owner of the client can refresh the cache from another thread
+ * with hrpc_client_resolve.
+ *
+ * Endpoints of the form unix:/path use a unix domain socket instead of TCP.
+ * The framing is the same.
+ *
+ * In datagram mode, each request goes in a datagram of its own, with the same
+ * header as on a stream.  The server sends nothing back.
+ *
+ * When libhtrace is built with io_uring support, sends can be handed to the
+ * kernel through an io_uring of the client's own, and finish in the
+ * background while the caller waits for responses to earlier requests.  At
+ * most one send is in progress per client.  Responses are still read with
+ * plain non-blocking reads, since they are small.
  */
 
 #define HRPC_MAGIC 0x43525448U
 
 #define MAX_HRPC_ERROR_LENGTH (4 * 1024 * 1024)
 
+/**
+ * The most datagrams we hand to the kernel in one system call.
+ */
+#define HRPC_DGRAM_BATCH 64
+
+/**
+ * The number of entries in each client's io_uring.  We only ever have one
+ * send in progress.
+ */
+#define HRPC_URING_ENTRIES 4
+
+#ifndef HAVE_SENDMMSG
+/**
+ * Without sendmmsg, we send the batch one sendmsg at a time.
+ */
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#endif
+
 #define MAX_HRPC_BODY_LENGTH (64 * 1024 * 1024)
 
 #define DEFAULT_HTRACED_HRPC_PORT 9075
 
-#define ADDR_STR_MAX (2 + INET6_ADDRSTRLEN + sizeof(":65536"))
+#define UNIX_ENDPOINT_PREFIX "unix:"
 
-struct hrpc_client {
+#define TCP_ADDR_STR_MAX (2 + INET6_ADDRSTRLEN + sizeof(":65536"))
+
+#define UNIX_ADDR_STR_MAX (sizeof(UNIX_ENDPOINT_PREFIX) + \
+                           sizeof(((struct sockaddr_un *)0)->sun_path))
+
+#define ADDR_STR_MAX ((TCP_ADDR_STR_MAX > UNIX_ADDR_STR_MAX) ? \
+                      TCP_ADDR_STR_MAX : UNIX_ADDR_STR_MAX)
+
+/**
+ * How long to wait before looking up a host again, after a failed lookup.
+ */
+#define HRPC_RESOLVE_RETRY_MS 1000ULL
+
+struct hrpc_resp_header {
+    uint64_t seq;
+    uint32_t method_id;
+    uint32_t err_length;
+    uint32_t length;
+} __attribute__((packed,aligned(4)));
+
+/**
+ * The part of a response we are reading.
+ */
+enum hrpc_resp_phase {
+    HRPC_RESP_HEADER = 0,
+    HRPC_RESP_ERROR,
+    HRPC_RESP_BODY,
+};
+
+/**
+ * A partly read response.
+ */
+struct hrpc_resp_state {
     /**
-     * The HTrace log object.
+     * The part of the response we are reading.
      */
-    struct htrace_log *lg;
+    enum hrpc_resp_phase phase;
 
     /**
-     * The tcp write timeout in milliseconds.
+     * The number of bytes of the current part we have read.
      */
-    uint64_t write_timeo_ms;
+    size_t off;
 
     /**
-     * The tcp read timeout in milliseconds.
+     * The response header.
      */
-    uint64_t read_timeo_ms;
+    struct hrpc_resp_header hdr;
+};
+
+struct hrpc_req_header {
+    uint32_t magic;
+    uint32_t method_id;
+    uint64_t seq;
+    uint32_t length;
+} __attribute__((packed,aligned(4)));
+
+/**
+ * A receive buffer which is reused from one response to the next.
+ */
+struct hrpc_resp_buf {
+    /**
+     * The buffer, or NULL if we have not needed one yet.  Malloced.
+     */
+    char *buf;
+
+    /**
+     * The size of the buffer.
+     */
+    size_t cap;
+};
+
+/**
+ * A looked-up list of addresses, shared between the client and the threads
+ * connecting to it.
+ */
+struct hrpc_addrs {
+    /**
+     * The number of references.  Protected by the client's addr_lock.
+     */
+    int refs;
+
+    /**
+     * The addresses, with the port filled in.  Freed with freeaddrinfo.
+     */
+    struct addrinfo *list;
+};
+
+struct hrpc_client {
+    /**
+     * The HTrace log object.
+     */
+    struct htrace_log *lg;
+
+    /**
+     * The client options.
+     */
+    struct hrpc_client_opts opts;
 
     /**
      * The hostname or IP address.  Malloced.
@@ -93,6 +236,12 @@ struct hrpc_client {
      */
     char *endpoint;
 
+    /**
+     * The address of the unix domain socket, for unix: endpoints.  For TCP
+     * endpoints, unix_addr.sun_family is 0.
+     */
+    struct sockaddr_un unix_addr;
+
     /**
      * Socket of current open connection, or -1 if there is no currently open
      * connection.
@@ -108,139 +257,804 @@ struct hrpc_client {
      * The remote IP address.
      */
     char addr_str[ADDR_STR_MAX];
-};
 
-struct hrpc_req_header {
-    uint32_t magic;
-    uint32_t method_id;
-    uint64_t seq;
-    uint32_t length;
-} __attribute__((packed,aligned(4)));
+    /**
+     * The response we are in the middle of reading.
+     */
+    struct hrpc_resp_state rs;
 
-struct hrpc_resp_header {
-    uint64_t seq;
-    uint32_t method_id;
-    uint32_t err_length;
-    uint32_t length;
-} __attribute__((packed,aligned(4)));
+    /**
+     * The buffer we read error strings into.
+     */
+    struct hrpc_resp_buf err_buf;
+
+    /**
+     * The buffer we read response bodies into.
+     */
+    struct hrpc_resp_buf body_buf;
+
+    /**
+     * Lock protecting addrs and addrs_expire_ms.
+     */
+    pthread_mutex_t addr_lock;
+
+    /**
+     * The cached addresses of the host, or NULL if we have not looked them
+     * up yet.  Only used when opts.dns_cache_ms is nonzero.  We hold one
+     * reference, and each thread connecting to them holds another.
+     */
+    struct hrpc_addrs *addrs;
+
+    /**
+     * The monotonic-clock time at which addrs should be looked up again.
+     */
+    uint64_t addrs_expire_ms;
+
+    /**
+     * The monotonic-clock time by which every operation must finish, or 0 if
+     * there is none.  See hrpc_client_set_deadline.
+     */
+    uint64_t deadline_ms;
+
+#ifdef HAVE_IO_URING
+    /**
+     * The io_uring we submit sends to, or NULL if we send with writev.
+     */
+    struct uring *ring;
+
+    /**
+     * Nonzero while the kernel is carrying out a send for us.
+     */
+    int send_pending;
+
+    /**
+     * Nonzero if the last send failed after we submitted it.
+     */
+    int send_failed;
+
+    /**
+     * The time by which the send in progress must finish.
+     */
+    uint64_t send_deadline_ms;
+
+    /**
+     * The message for the send in progress.  The iovecs are advanced as
+     * parts of the message are sent.
+     */
+    struct msghdr send_msg;
+    struct iovec send_iov[3];
+
+    /**
+     * The header of the send in progress.
+     */
+    struct hrpc_req_header send_hdr;
+#endif
+};
 
 
 static int hrpc_client_open_conn(struct hrpc_client *hcli);
+static void hrpc_fill_req_header(struct hrpc_client *hcli,
+                    struct hrpc_req_header *hdr, uint32_t method_id,
+                    size_t len, uint64_t *seq);
+static int hrpc_lookup(struct hrpc_client *hcli, struct addrinfo **list);
+static void hrpc_addrs_unref(struct hrpc_client *hcli,
+                             struct hrpc_addrs *addrs);
+static int set_port(struct hrpc_client *hcli, struct sockaddr *addr,
+                    int ai_family);
+static int parse_unix_endpoint(struct hrpc_client *hcli, const char *path);
 static int try_connect(struct hrpc_client *hcli, struct addrinfo *p);
-static int set_socket_read_and_write_timeout(struct hrpc_client *hcli,
-                                             int sock);
+static int hrpc_wait_fd(struct hrpc_client *hcli, int fd, short events,
+                        uint64_t deadline_ms);
+static uint64_t hrpc_deadline_ms(const struct hrpc_client *hcli,
+                                 uint64_t timeo_ms);
 static int hrpc_client_send_req(struct hrpc_client *hcli, uint32_t method_id,
                     const void *buf1, size_t buf1_len,
-                    const void *buf2, size_t buf2_len, uint64_t *seq);
+                    const void *buf2, size_t buf2_len, uint64_t *seq,
+                    int async);
+#ifdef HAVE_IO_URING
+static int hrpc_uring_reap(struct hrpc_client *hcli);
+static void hrpc_uring_cancel(struct hrpc_client *hcli);
+#endif
 static int hrpc_client_rcv_resp(struct hrpc_client *hcli, uint32_t method_id,
-                       uint64_t seq, char **err, void **resp,
+                       uint64_t *seq, const char **err, const void **resp,
                        size_t *resp_len);
 
 struct hrpc_client *hrpc_client_alloc(struct htrace_log *lg,
-                uint64_t write_timeo_ms, uint64_t read_timeo_ms,
-                const char *endpoint)
+                const struct hrpc_client_opts *opts, const char *endpoint)
 {
     struct hrpc_client *hcli;
+    int ret;
 
-    hcli = calloc(1, sizeof(*hcli));
+    hcli = htrace_calloc(1, sizeof(*hcli));
     if (!hcli) {
         htrace_log(lg, "Failed to allocate memory for the HRPC client.\n");
         goto error;
     }
     hcli->lg = lg;
-    hcli->write_timeo_ms = write_timeo_ms;
-    hcli->read_timeo_ms = read_timeo_ms;
+    hcli->opts = *opts;
     hcli->sock = -1;
-    hcli->endpoint = strdup(endpoint);
+    hcli->endpoint = htrace_strdup(endpoint);
     if (!hcli->endpoint) {
         htrace_log(lg, "Failed to allocate memory for the endpoint string.\n");
-        goto error;
+        goto error_free_hcli;
     }
-    if (!parse_endpoint(lg, endpoint, DEFAULT_HTRACED_HRPC_PORT,
+    if (strncmp(endpoint, UNIX_ENDPOINT_PREFIX,
+                strlen(UNIX_ENDPOINT_PREFIX)) == 0) {
+        if (!parse_unix_endpoint(hcli,
+                    endpoint + strlen(UNIX_ENDPOINT_PREFIX))) {
+            goto error_free_hcli;
+        }
+    } else if (!parse_endpoint(lg, endpoint, DEFAULT_HTRACED_HRPC_PORT,
                    &hcli->host, &hcli->port)) {
-        goto error;
+        goto error_free_hcli;
+    }
+    ret = pthread_mutex_init(&hcli->addr_lock, NULL);
+    if (ret) {
+        htrace_log(lg, "hrpc_client_alloc: pthread_mutex_init error %d: %s\n",
+                   ret, terror(ret));
+        goto error_free_hcli;
+    }
+#ifdef HAVE_IO_URING
+    if (opts->io_uring && (!opts->datagram)) {
+        hcli->ring = uring_create(lg, HRPC_URING_ENTRIES);
+        if (!hcli->ring) {
+            htrace_log(lg, "hrpc_client_alloc(%s): io_uring is not "
+                       "available.  Sending with writev instead.\n",
+                       endpoint);
+        }
+    }
+#endif
+    return hcli;
+
+error_free_hcli:
+    htrace_free(hcli->host);
+    htrace_free(hcli->endpoint);
+    htrace_free(hcli);
+error:
+    return NULL;
+}
+
+void hrpc_client_free(struct hrpc_client *hcli)
+{
+    if (!hcli) {
+        return;
+    }
+    hrpc_client_close(hcli);
+#ifdef HAVE_IO_URING
+    uring_free(hcli->ring);
+#endif
+    if (hcli->addrs) {
+        hrpc_addrs_unref(hcli, hcli->addrs);
+    }
+    pthread_mutex_destroy(&hcli->addr_lock);
+    htrace_free(hcli->err_buf.buf);
+    htrace_free(hcli->body_buf.buf);
+    htrace_free(hcli->host);
+    htrace_free(hcli->endpoint);
+    htrace_free(hcli);
+}
+
+int hrpc_client_call(struct hrpc_client *hcli, uint32_t method_id,
+                    const void *buf1, size_t buf1_len,
+                    const void *buf2, size_t buf2_len,
+                    const char **err, const void **resp, size_t *resp_len)
+{
+    uint64_t seq, resp_seq, deadline_ms;
+    int ret;
+
+    if (!hrpc_client_send(hcli, method_id, buf1, buf1_len,
+                          buf2, buf2_len, &seq)) {
+        return 0;
+    }
+    deadline_ms = hrpc_deadline_ms(hcli, hcli->opts.read_timeo_ms);
+    while (1) {
+        ret = hrpc_client_recv(hcli, method_id, &resp_seq, err, resp,
+                               resp_len);
+        if (ret != HRPC_RECV_AGAIN) {
+            break;
+        }
+        if (!hrpc_wait_fd(hcli, hcli->sock, POLLIN, deadline_ms)) {
+            hrpc_client_close(hcli);
+            return 0;
+        }
+    }
+    if (!ret) {
+        return 0;
+    }
+    if (resp_seq != seq) {
+        htrace_log(hcli->lg, "hrpc_client_call(%s): expected sequence "
+                   "ID 0x%"PRIx64", but got sequence ID 0x%"PRIx64".\n",
+                   hcli->addr_str, seq, resp_seq);
+        *err = NULL;
+        *resp = NULL;
+        *resp_len = 0;
+        hrpc_client_close(hcli);
+        return 0;
+    }
+    return 1;
+}
+
+static int hrpc_client_send_common(struct hrpc_client *hcli,
+                    uint32_t method_id, const void *buf1, size_t buf1_len,
+                    const void *buf2, size_t buf2_len, uint64_t *seq,
+                    int async)
+{
+    if (hcli->sock < 0) {
+        if (!hrpc_client_open_conn(hcli)) {
+            return 0;
+        }
+        htrace_log(hcli->lg, "hrpc_client_send(%s): successfully opened "
+                   "connection\n", hcli->addr_str);
+    }
+    if (!hrpc_client_send_req(hcli, method_id,
+                              buf1, buf1_len, buf2, buf2_len, seq, async)) {
+        hrpc_client_close(hcli);
+        return 0;
+    }
+    return 1;
+}
+
+int hrpc_client_send(struct hrpc_client *hcli, uint32_t method_id,
+                     const void *buf1, size_t buf1_len,
+                     const void *buf2, size_t buf2_len, uint64_t *seq)
+{
+    return hrpc_client_send_common(hcli, method_id, buf1, buf1_len,
+                                   buf2, buf2_len, seq, 0);
+}
+
+int hrpc_client_send_async(struct hrpc_client *hcli, uint32_t method_id,
+                           const void *buf1, size_t buf1_len,
+                           const void *buf2, size_t buf2_len, uint64_t *seq)
+{
+    return hrpc_client_send_common(hcli, method_id, buf1, buf1_len,
+                                   buf2, buf2_len, seq, 1);
+}
+
+static void hrpc_fill_req_header(struct hrpc_client *hcli,
+                    struct hrpc_req_header *hdr, uint32_t method_id,
+                    size_t len, uint64_t *seq)
+{
+    hdr->magic = htole64(HRPC_MAGIC);
+    hdr->method_id = htole32(method_id);
+    *seq = hcli->seq++;
+    hdr->seq = htole64(*seq);
+    hdr->length = htole32(len);
+}
+
+/**
+ * Send some datagrams which have their headers and iovecs filled in.
+ *
+ * @return      The number of datagrams the kernel took, or -1 on error.
+ */
+static int hrpc_send_dgram_batch(struct hrpc_client *hcli,
+                                 struct mmsghdr *msgs, int num)
+{
+    int i = 0;
+
+    while (i < num) {
+#ifdef HAVE_SENDMMSG
+        int res = sendmmsg(hcli->sock, msgs + i, num - i, MSG_DONTWAIT);
+#else
+        int res = sendmsg(hcli->sock, &msgs[i].msg_hdr, MSG_DONTWAIT);
+        if (res >= 0) {
+            res = 1;
+        }
+#endif
+        if (res < 0) {
+            int e = errno;
+            if (e == EINTR) {
+                continue;
+            }
+            if ((e == EAGAIN) || (e == EWOULDBLOCK) || (e == ENOBUFS) ||
+                    (e == ECONNREFUSED)) {
+                // The socket buffer is full, or nobody is listening right
+                // now.  We don't wait for acknowledgements, so we don't wait
+                // here either.  The rest of the batch is dropped.
+                return i;
+            }
+            htrace_log(hcli->lg, "hrpc_send_dgram_batch(%s): error "
+                       "%d: %s\n", hcli->addr_str, e, terror(e));
+            return -1;
+        }
+        i += res;
+    }
+    return i;
+}
+
+int hrpc_client_send_dgrams(struct hrpc_client *hcli, uint32_t method_id,
+                            const struct hrpc_dgram *dgrams, int num_dgrams)
+{
+    struct hrpc_req_header hdrs[HRPC_DGRAM_BATCH];
+    struct iovec iovs[HRPC_DGRAM_BATCH][3];
+    struct mmsghdr msgs[HRPC_DGRAM_BATCH];
+    int i, num, sent, total = 0;
+    uint64_t seq;
+
+    if (hcli->sock < 0) {
+        if (!hrpc_client_open_conn(hcli)) {
+            return -1;
+        }
+        htrace_log(hcli->lg, "hrpc_client_send_dgrams(%s): successfully "
+                   "opened socket\n", hcli->addr_str);
+    }
+    memset(msgs, 0, sizeof(msgs));
+    while (num_dgrams > 0) {
+        num = num_dgrams;
+        if (num > HRPC_DGRAM_BATCH) {
+            num = HRPC_DGRAM_BATCH;
+        }
+        for (i = 0; i < num; i++) {
+            hrpc_fill_req_header(hcli, &hdrs[i], method_id,
+                        dgrams[i].buf1_len + dgrams[i].buf2_len, &seq);
+            iovs[i][0].iov_base = &hdrs[i];
+            iovs[i][0].iov_len = sizeof(hdrs[i]);
+            iovs[i][1].iov_base = (void*)dgrams[i].buf1;
+            iovs[i][1].iov_len = dgrams[i].buf1_len;
+            iovs[i][2].iov_base = (void*)dgrams[i].buf2;
+            iovs[i][2].iov_len = dgrams[i].buf2_len;
+            msgs[i].msg_hdr.msg_iov = iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 3;
+        }
+        sent = hrpc_send_dgram_batch(hcli, msgs, num);
+        if (sent < 0) {
+            hrpc_client_close(hcli);
+            return -1;
+        }
+        total += sent;
+        if (sent < num) {
+            break;
+        }
+        dgrams += num;
+        num_dgrams -= num;
+    }
+    return total;
+}
+
+int hrpc_client_poll(struct hrpc_client **hclis, int *ready, int num_hcli,
+                     int wake_fd, uint64_t timeo_ms)
+{
+    struct pollfd pfd[(2 * HRPC_POLL_MAX_CLIENTS) + 1];
+    int idx[2 * HRPC_POLL_MAX_CLIENTS];
+    int e, i, res, nsock = 0, nfds, ret = 0;
+#ifdef HAVE_IO_URING
+    struct hrpc_client *hcli;
+    uint64_t now = 0;
+    int nring = 0;
+#endif
+
+    if (num_hcli > HRPC_POLL_MAX_CLIENTS) {
+        return -1;
+    }
+    for (i = 0; i < num_hcli; i++) {
+        ready[i] = 0;
+        if (hclis[i]->sock < 0) {
+            continue;
+        }
+        pfd[nsock].fd = hclis[i]->sock;
+        pfd[nsock].events = POLLIN;
+        pfd[nsock].revents = 0;
+        idx[nsock] = i;
+        nsock++;
+    }
+    nfds = nsock;
+#ifdef HAVE_IO_URING
+    // Wait for sends in progress to finish, too, and don't wait past their
+    // deadlines.
+    for (i = 0; i < num_hcli; i++) {
+        hcli = hclis[i];
+        if ((hcli->sock < 0) || (!hcli->send_pending)) {
+            continue;
+        }
+        if (!now) {
+            now = monotonic_now_ms(hcli->lg);
+        }
+        if (hcli->send_deadline_ms <= now) {
+            timeo_ms = 0;
+        } else if (hcli->send_deadline_ms - now < timeo_ms) {
+            timeo_ms = hcli->send_deadline_ms - now;
+        }
+        pfd[nfds].fd = uring_fd(hcli->ring);
+        pfd[nfds].events = POLLIN;
+        pfd[nfds].revents = 0;
+        idx[nfds] = i;
+        nfds++;
+        nring++;
+    }
+#endif
+    if (wake_fd >= 0) {
+        pfd[nfds].fd = wake_fd;
+        pfd[nfds].events = POLLIN;
+        pfd[nfds].revents = 0;
+        nfds++;
+    }
+    if (nfds == 0) {
+        return -1;
+    }
+    if (timeo_ms > 0x7fffffffULL) {
+        timeo_ms = 0x7fffffffULL;
+    }
+    do {
+        res = poll(pfd, nfds, (int)timeo_ms);
+        e = errno;
+    } while ((res < 0) && (e == EINTR));
+    if (res < 0) {
+        if (num_hcli > 0) {
+            htrace_log(hclis[0]->lg, "hrpc_client_poll: poll error %d (%s)\n",
+                       e, terror(e));
+        }
+        return -1;
+    }
+    for (i = 0; i < nsock; i++) {
+        if (pfd[i].revents) {
+            // Errors and hangups are reported as readable, so that the caller
+            // finds out about them when it tries to read the response.
+            ready[idx[i]] = 1;
+            ret |= HRPC_POLL_READABLE;
+        }
+    }
+#ifdef HAVE_IO_URING
+    for (i = nsock; i < nsock + nring; i++) {
+        hcli = hclis[idx[i]];
+        if (pfd[i].revents) {
+            hrpc_uring_reap(hcli);
+        }
+        if (hcli->send_pending &&
+                (monotonic_now_ms(hcli->lg) >= hcli->send_deadline_ms)) {
+            htrace_log(hcli->lg, "hrpc_client_poll(%s): timed out "
+                       "sending a request.\n", hcli->addr_str);
+            hcli->send_failed = 1;
+        }
+        if (hcli->send_failed) {
+            // Let the caller find out from hrpc_client_recv.
+            ready[idx[i]] = 1;
+            ret |= HRPC_POLL_READABLE;
+        }
+    }
+    nsock += nring;
+#endif
+    if ((nfds > nsock) && pfd[nsock].revents) {
+        ret |= HRPC_POLL_WOKEN;
+    }
+    return ret;
+}
+
+int hrpc_client_recv(struct hrpc_client *hcli, uint32_t method_id,
+                     uint64_t *seq, const char **err, const void **resp,
+                     size_t *resp_len)
+{
+    int ret;
+
+    *err = NULL;
+    *resp = NULL;
+    *resp_len = 0;
+    if (hcli->sock < 0) {
+        return 0;
+    }
+#ifdef HAVE_IO_URING
+    if (hcli->send_pending) {
+        hrpc_uring_reap(hcli);
+    }
+    if (hcli->send_failed) {
+        hrpc_client_close(hcli);
+        return 0;
+    }
+#endif
+    ret = hrpc_client_rcv_resp(hcli, method_id, seq, err, resp, resp_len);
+    if (!ret) {
+        hrpc_client_close(hcli);
+    }
+    return ret;
+}
+
+void hrpc_client_close(struct hrpc_client *hcli)
+{
+#ifdef HAVE_IO_URING
+    hrpc_uring_cancel(hcli);
+#endif
+    if (hcli->sock >= 0) {
+        close(hcli->sock);
+        hcli->sock = -1;
+    }
+    memset(&hcli->rs, 0, sizeof(hcli->rs));
+}
+
+void hrpc_client_forked(struct hrpc_client *hcli)
+{
+    // A thread which no longer exists may have been holding the lock.
+    pthread_mutex_init(&hcli->addr_lock, NULL);
+#ifdef HAVE_IO_URING
+    // The ring is shared with the parent, so we need one of our own.
+    if (hcli->ring) {
+        uring_free(hcli->ring);
+        hcli->ring = uring_create(hcli->lg, HRPC_URING_ENTRIES);
+        if (!hcli->ring) {
+            htrace_log(hcli->lg, "hrpc_client_forked(%s): failed to "
+                       "create an io_uring.  Sending with writev "
+                       "instead.\n", hcli->endpoint);
+        }
+    }
+    hcli->send_pending = 0;
+    hcli->send_failed = 0;
+#endif
+    if (hcli->sock >= 0) {
+        close(hcli->sock);
+        hcli->sock = -1;
+    }
+    memset(&hcli->rs, 0, sizeof(hcli->rs));
+}
+
+void hrpc_client_set_deadline(struct hrpc_client *hcli, uint64_t deadline_ms)
+{
+    hcli->deadline_ms = deadline_ms;
+}
+
+/**
+ * Compute the deadline for an operation, which is the given timeout from now,
+ * or the client's deadline if that comes first.
+ *
+ * @param hcli              The HRPC client.
+ * @param timeo_ms          The timeout for the operation.
+ *
+ * @return                  The monotonic-clock time to give up at.
+ */
+static uint64_t hrpc_deadline_ms(const struct hrpc_client *hcli,
+                                 uint64_t timeo_ms)
+{
+    uint64_t deadline_ms = monotonic_now_ms(hcli->lg) + timeo_ms;
+
+    if (hcli->deadline_ms && (hcli->deadline_ms < deadline_ms)) {
+        return hcli->deadline_ms;
+    }
+    return deadline_ms;
+}
+
+/**
+ * Wait for a socket to become ready.
+ *
+ * @param hcli              The HRPC client.
+ * @param fd                The socket.
+ * @param events            The poll events to wait for.
+ * @param deadline_ms       The monotonic-clock time to give up at.
+ *
+ * @return                  1 if the socket is ready; 0 on timeout or error.
+ */
+static int hrpc_wait_fd(struct hrpc_client *hcli, int fd, short events,
+                        uint64_t deadline_ms)
+{
+    struct pollfd pfd;
+    uint64_t now;
+    int e, res;
+
+    while (1) {
+        now = monotonic_now_ms(hcli->lg);
+        if (now >= deadline_ms) {
+            htrace_log(hcli->lg, "hrpc_wait_fd(%s): timed out.\n",
+                       hcli->addr_str);
+            return 0;
+        }
+        pfd.fd = fd;
+        pfd.events = events;
+        pfd.revents = 0;
+        res = poll(&pfd, 1, (int)(deadline_ms - now));
+        if (res > 0) {
+            // On errors and hangups, the next operation on the socket will
+            // tell the caller what went wrong.
+            return 1;
+        }
+        if (res < 0) {
+            e = errno;
+            if (e != EINTR) {
+                htrace_log(hcli->lg, "hrpc_wait_fd(%s): poll error %d "
+                           "(%s)\n", hcli->addr_str, e, terror(e));
+                return 0;
+            }
+        }
+    }
+}
+
+/**
+ * Set up the address of a unix domain socket endpoint.
+ *
+ * @param hcli              The HRPC client.
+ * @param path              The path of the socket.
+ *
+ * @return                  0 on failure, 1 on success.
+ */
+static int parse_unix_endpoint(struct hrpc_client *hcli, const char *path)
+{
+    if (path[0] == '\0') {
+        htrace_log(hcli->lg, "parse_unix_endpoint: no socket path given in "
+                   "%s\n", hcli->endpoint);
+        return 0;
     }
-    return hcli;
-
-error:
-    if (hcli) {
-        free(hcli->host);
-        free(hcli->endpoint);
-        free(hcli);
+    if (strlen(path) >= sizeof(hcli->unix_addr.sun_path)) {
+        htrace_log(hcli->lg, "parse_unix_endpoint: the socket path in %s is "
+                   "too long.  The maximum length is %d.\n", hcli->endpoint,
+                   (int)sizeof(hcli->unix_addr.sun_path) - 1);
+        return 0;
     }
-    return NULL;
+    hcli->host = htrace_strdup(path);
+    if (!hcli->host) {
+        htrace_log(hcli->lg, "parse_unix_endpoint: OOM.\n");
+        return 0;
+    }
+    hcli->unix_addr.sun_family = AF_UNIX;
+    strcpy(hcli->unix_addr.sun_path, path);
+    return 1;
 }
 
-void hrpc_client_free(struct hrpc_client *hcli)
+/**
+ * Drop a reference to a list of addresses, and free it if that was the last
+ * one.
+ *
+ * @param hcli              The HRPC client.
+ * @param addrs             The addresses.
+ */
+static void hrpc_addrs_unref(struct hrpc_client *hcli,
+                             struct hrpc_addrs *addrs)
 {
-    if (!hcli) {
-        return;
-    }
-    if (hcli->sock >= 0) {
-        close(hcli->sock);
-        hcli->sock = -1;
+    int refs;
+
+    pthread_mutex_lock(&hcli->addr_lock);
+    refs = --addrs->refs;
+    pthread_mutex_unlock(&hcli->addr_lock);
+    if (refs == 0) {
+        freeaddrinfo(addrs->list);
+        htrace_free(addrs);
     }
-    free(hcli->host);
-    free(hcli->endpoint);
-    free(hcli);
 }
 
-int hrpc_client_call(struct hrpc_client *hcli, uint32_t method_id,
-                    const void *buf1, size_t buf1_len,
-                    const void *buf2, size_t buf2_len,
-                    char **err, void **resp, size_t *resp_len)
+int hrpc_client_resolve(struct hrpc_client *hcli)
 {
-    uint64_t seq;
+    struct addrinfo *list = NULL;
+    struct hrpc_addrs *addrs = NULL, *old = NULL;
+    uint64_t now, retry_ms;
+    int ret;
 
-    if (hcli->sock < 0) {
-        if (!hrpc_client_open_conn(hcli)) {
-            goto error;
+    if (hcli->unix_addr.sun_family == AF_UNIX) {
+        // There is nothing to look up.
+        return 1;
+    }
+
+    // Look up the host without holding the lock, so that a slow DNS server
+    // doesn't hold up connecting to the addresses we already have.
+    ret = hrpc_lookup(hcli, &list);
+    if (ret) {
+        addrs = htrace_malloc(sizeof(*addrs));
+        if (!addrs) {
+            htrace_log(hcli->lg, "hrpc_client_resolve(%s): OOM.\n",
+                       hcli->host);
+            freeaddrinfo(list);
+            ret = 0;
+        } else {
+            addrs->refs = 1;
+            addrs->list = list;
         }
-        htrace_log(hcli->lg, "hrpc_client_call: successfully opened connection\n");
-    } else {
-        htrace_log(hcli->lg, "hrpc_client_call: connection was already open\n");
     }
-    if (!hrpc_client_send_req(hcli, method_id,
-                              buf1, buf1_len, buf2, buf2_len, &seq)) {
-        goto error;
+    now = monotonic_now_ms(hcli->lg);
+    pthread_mutex_lock(&hcli->addr_lock);
+    if (ret) {
+        old = hcli->addrs;
+        hcli->addrs = addrs;
+        hcli->addrs_expire_ms = now + hcli->opts.dns_cache_ms;
+    } else {
+        retry_ms = HRPC_RESOLVE_RETRY_MS;
+        if (retry_ms > hcli->opts.dns_cache_ms) {
+            retry_ms = hcli->opts.dns_cache_ms;
+        }
+        hcli->addrs_expire_ms = now + retry_ms;
     }
-    htrace_log(hcli->lg, "hrpc_client_call: waiting for response\n");
-    if (!hrpc_client_rcv_resp(hcli, method_id, seq, err, resp, resp_len)) {
-        goto error;
+    pthread_mutex_unlock(&hcli->addr_lock);
+    if (old) {
+        hrpc_addrs_unref(hcli, old);
     }
-    return 1;
+    return ret;
+}
 
-error:
-    if (hcli->sock >= 0) {
-        close(hcli->sock);
-        hcli->sock = -1;
+uint64_t hrpc_client_resolve_due_ms(struct hrpc_client *hcli, uint64_t now)
+{
+    uint64_t expire;
+
+    if ((!hcli->opts.dns_cache_ms) ||
+            (hcli->unix_addr.sun_family == AF_UNIX)) {
+        return UINT64_MAX;
     }
-    return 0;
+    pthread_mutex_lock(&hcli->addr_lock);
+    expire = hcli->addrs_expire_ms;
+    pthread_mutex_unlock(&hcli->addr_lock);
+    return (expire > now) ? (expire - now) : 0;
 }
 
-static int hrpc_client_open_conn(struct hrpc_client *hcli)
+/**
+ * Look up the addresses of the host, and fill in the port.
+ *
+ * @param hcli              The HRPC client.
+ * @param list              (out param) The addresses.  Must be freed with
+ *                              freeaddrinfo.
+ *
+ * @return                  0 on failure, 1 on success.
+ */
+static int hrpc_lookup(struct hrpc_client *hcli, struct addrinfo **list)
 {
-    int res, sock = -1;
-    struct addrinfo hints, *list, *info;
+    struct addrinfo hints, *info;
+    int res;
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    res = getaddrinfo(hcli->host, NULL, &hints, &list);
+    hints.ai_socktype = hcli->opts.datagram ? SOCK_DGRAM : SOCK_STREAM;
+    res = getaddrinfo(hcli->host, NULL, &hints, list);
     if (res) {
-        htrace_log(hcli->lg, "hrpc_client_open_conn: "
-                   "getaddrinfo(%s) error %d: %s\n",
+        htrace_log(hcli->lg, "hrpc_lookup: getaddrinfo(%s) error %d: %s\n",
                    hcli->host, res, gai_strerror(res));
         return 0;
     }
+    for (info = *list; info; info = info->ai_next) {
+        set_port(hcli, info->ai_addr, info->ai_family);
+    }
+    return 1;
+}
+
+static int try_connect_list(struct hrpc_client *hcli, struct addrinfo *list)
+{
+    struct addrinfo *info;
+    int sock;
+
     for (info = list; info; info = info->ai_next) {
         sock = try_connect(hcli, info);
         if (sock >= 0) {
-            break;
+            return sock;
+        }
+    }
+    return -1;
+}
+
+static int hrpc_client_open_conn(struct hrpc_client *hcli)
+{
+    struct addrinfo *list, unix_info;
+    struct hrpc_addrs *addrs;
+    int sock;
+
+    if (hcli->unix_addr.sun_family == AF_UNIX) {
+        memset(&unix_info, 0, sizeof(unix_info));
+        unix_info.ai_family = AF_UNIX;
+        unix_info.ai_socktype =
+            hcli->opts.datagram ? SOCK_DGRAM : SOCK_STREAM;
+        unix_info.ai_addr = (struct sockaddr *)&hcli->unix_addr;
+        unix_info.ai_addrlen = sizeof(hcli->unix_addr);
+        sock = try_connect(hcli, &unix_info);
+    } else if (!hcli->opts.dns_cache_ms) {
+        if (!hrpc_lookup(hcli, &list)) {
+            return 0;
+        }
+        sock = try_connect_list(hcli, list);
+        freeaddrinfo(list);
+    } else {
+        pthread_mutex_lock(&hcli->addr_lock);
+        if (!hcli->addrs) {
+            // We have never looked up the host successfully, so we have to
+            // wait for the lookup here.
+            pthread_mutex_unlock(&hcli->addr_lock);
+            if (!hrpc_client_resolve(hcli)) {
+                return 0;
+            }
+            pthread_mutex_lock(&hcli->addr_lock);
         }
+        // Connecting can take a while, so hold a reference to the addresses
+        // rather than the lock.  The addresses may be a little out of date,
+        // but that's better than waiting for DNS.
+        addrs = hcli->addrs;
+        addrs->refs++;
+        pthread_mutex_unlock(&hcli->addr_lock);
+        sock = try_connect_list(hcli, addrs->list);
+        if (sock < 0) {
+            // Maybe the host has moved.  Look it up again soon.
+            pthread_mutex_lock(&hcli->addr_lock);
+            hcli->addrs_expire_ms = 0;
+            pthread_mutex_unlock(&hcli->addr_lock);
+        }
+        hrpc_addrs_unref(hcli, addrs);
     }
-    freeaddrinfo(list);
-    if (!info) {
+    if (sock < 0) {
         htrace_log(hcli->lg, "hrpc_client_open_conn(%s): failed to connect.\n",
                    hcli->host);
         return 0;
@@ -264,27 +1078,73 @@ static int set_port(struct hrpc_client *hcli, struct sockaddr *addr,
         return 1;
     }
     default:
-        htrace_log(hcli->lg, "try_connect(%s): set_port %d failed: unknown "
-                   "ai_family %d\n", hcli->addr_str, hcli->port, ai_family);
+        htrace_log(hcli->lg, "hrpc_lookup(%s): set_port %d failed: unknown "
+                   "ai_family %d\n", hcli->host, hcli->port, ai_family);
         return 0;
     }
 }
 
+static void set_sock_opt(struct hrpc_client *hcli, int sock, int level,
+                         int name, const char *name_str, int val)
+{
+    int e;
+
+    if (setsockopt(sock, level, name, &val, sizeof(val)) < 0) {
+        // These options only affect performance, so keep going.
+        e = errno;
+        htrace_log(hcli->lg, "try_connect(%s): setsockopt(%s=%d) failed: "
+                   "error %d (%s)\n", hcli->addr_str, name_str, val, e,
+                   terror(e));
+    }
+}
+
+static void set_sock_opts(struct hrpc_client *hcli, int sock, int family)
+{
+    int keepalive_s;
+
+    if (hcli->opts.tcp_sndbuf) {
+        set_sock_opt(hcli, sock, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF",
+                     hcli->opts.tcp_sndbuf);
+    }
+    if ((family == AF_UNIX) || hcli->opts.datagram) {
+        // The other options only make sense for TCP.
+        return;
+    }
+    if (hcli->opts.tcp_nodelay) {
+        set_sock_opt(hcli, sock, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+    }
+    if (hcli->opts.tcp_keepalive_ms) {
+        set_sock_opt(hcli, sock, SOL_SOCKET, SO_KEEPALIVE, "SO_KEEPALIVE", 1);
+        // TCP keepalive times are in whole seconds.
+        keepalive_s = (hcli->opts.tcp_keepalive_ms + 999) / 1000;
+#ifdef TCP_KEEPIDLE
+        set_sock_opt(hcli, sock, IPPROTO_TCP, TCP_KEEPIDLE, "TCP_KEEPIDLE",
+                     keepalive_s);
+#endif
+#ifdef TCP_KEEPINTVL
+        set_sock_opt(hcli, sock, IPPROTO_TCP, TCP_KEEPINTVL, "TCP_KEEPINTVL",
+                     keepalive_s);
+#endif
+    }
+}
+
 static int try_connect(struct hrpc_client *hcli, struct addrinfo *p)
 {
-    int e, sock = -1;
+    int e, flags, sock = -1;
+    socklen_t e_len;
     char ip[INET6_ADDRSTRLEN];
 
-    e = getnameinfo(p->ai_addr, p->ai_addrlen,
-                ip, sizeof(ip), 0, 0, NI_NUMERICHOST);
-    if (e) {
-        htrace_log(hcli->lg, "try_connect: getnameinfo failed.  error "
-                   "%d: %s\n", e, gai_strerror(e));
-        return 0;
-    }
-    snprintf(hcli->addr_str, ADDR_STR_MAX, "%s:%d", ip, hcli->port);
-    if (!set_port(hcli, p->ai_addr, p->ai_family)) {
-        goto error;
+    if (p->ai_family == AF_UNIX) {
+        snprintf(hcli->addr_str, ADDR_STR_MAX, "%s", hcli->endpoint);
+    } else {
+        e = getnameinfo(p->ai_addr, p->ai_addrlen,
+                    ip, sizeof(ip), 0, 0, NI_NUMERICHOST);
+        if (e) {
+            htrace_log(hcli->lg, "try_connect: getnameinfo failed.  error "
+                       "%d: %s\n", e, gai_strerror(e));
+            return -1;
+        }
+        snprintf(hcli->addr_str, ADDR_STR_MAX, "%s:%d", ip, hcli->port);
     }
     sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
     if (sock < 0) {
@@ -299,14 +1159,36 @@ static int try_connect(struct hrpc_client *hcli, struct addrinfo *p)
                    "failed: error %d (%s)\n", hcli->addr_str, e, terror(e));
         goto error;
     }
-    if (!set_socket_read_and_write_timeout(hcli, sock)) {
+    flags = fcntl(sock, F_GETFL);
+    if ((flags < 0) || (fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        e = errno;
+        htrace_log(hcli->lg, "try_connect(%s): fcntl(O_NONBLOCK) "
+                   "failed: error %d (%s)\n", hcli->addr_str, e, terror(e));
         goto error;
     }
+    set_sock_opts(hcli, sock, p->ai_family);
     if (connect(sock, p->ai_addr, p->ai_addrlen) < 0) {
         e = errno;
-        htrace_log(hcli->lg, "try_connect(%s): connect "
-                   "failed: error %d (%s)\n", hcli->addr_str, e, terror(e));
-        goto error;
+        if (e != EINPROGRESS) {
+            htrace_log(hcli->lg, "try_connect(%s): connect "
+                       "failed: error %d (%s)\n", hcli->addr_str, e,
+                       terror(e));
+            goto error;
+        }
+        if (!hrpc_wait_fd(hcli, sock, POLLOUT,
+                hrpc_deadline_ms(hcli, hcli->opts.write_timeo_ms))) {
+            goto error;
+        }
+        e_len = sizeof(e);
+        if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &e, &e_len) < 0) {
+            e = errno;
+        }
+        if (e) {
+            htrace_log(hcli->lg, "try_connect(%s): connect "
+                       "failed: error %d (%s)\n", hcli->addr_str, e,
+                       terror(e));
+            goto error;
+        }
     }
     return sock;
 
@@ -317,43 +1199,190 @@ error:
     return -1;
 }
 
-static int set_socket_read_and_write_timeout(struct hrpc_client *hcli,
-                                             int sock)
+#ifdef HAVE_IO_URING
+/**
+ * Submit the rest of the send in progress to the io_uring.
+ *
+ * @return      1 on success; 0 on failure.
+ */
+static int hrpc_uring_submit_send(struct hrpc_client *hcli)
 {
-    struct timeval tv;
+    struct io_uring_sqe *sqe;
+    int e;
 
-    ms_to_timeval(hcli->read_timeo_ms, &tv);
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        int e = errno;
-        htrace_log(hcli->lg, "setsockopt(%d, SO_RCVTIMEO, %"PRId64") failed: "
-                  "error %d (%s)\n", sock, hcli->read_timeo_ms, e, terror(e));
-        return 0;
+    sqe = uring_get_sqe(hcli->ring);
+    if (!sqe) {
+        // This can't happen, since we only have one send at a time.
+        htrace_log(hcli->lg, "hrpc_uring_submit_send(%s): the submission "
+                   "queue is full.\n", hcli->addr_str);
+        goto error;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = hcli->sock;
+    sqe->addr = (uintptr_t)&hcli->send_msg;
+    sqe->len = 1;
+    // Ask the kernel to keep going until everything is sent.  Kernels which
+    // don't understand MSG_WAITALL here just complete with a short send.
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    e = uring_submit(hcli->ring, 0);
+    if (e) {
+        htrace_log(hcli->lg, "hrpc_uring_submit_send(%s): io_uring_enter "
+                   "error %d: %s\n", hcli->addr_str, e, terror(e));
+        goto error;
+    }
+    hcli->send_pending = 1;
+    return 1;
+
+error:
+    hcli->send_pending = 0;
+    hcli->send_failed = 1;
+    return 0;
+}
+
+/**
+ * Handle the completion of the send in progress, if it has completed.  If only
+ * part of the message was sent, the rest is submitted again.
+ *
+ * @return      0 if the send failed; 1 otherwise.
+ */
+static int hrpc_uring_reap(struct hrpc_client *hcli)
+{
+    struct msghdr *msg = &hcli->send_msg;
+    uint64_t user_data;
+    int32_t res;
+    size_t amt;
+
+    while (hcli->send_pending &&
+            uring_peek_cqe(hcli->ring, &user_data, &res)) {
+        hcli->send_pending = 0;
+        if (res < 0) {
+            if ((res == -EINTR) || (res == -EAGAIN)) {
+                if (!hrpc_uring_submit_send(hcli)) {
+                    return 0;
+                }
+                continue;
+            }
+            htrace_log(hcli->lg, "hrpc_uring_reap(%s): sendmsg error "
+                       "%d: %s\n", hcli->addr_str, -res, terror(-res));
+            hcli->send_failed = 1;
+            return 0;
+        }
+        // Skip past whatever was sent.  A short send can end in the middle
+        // of any of the buffers.
+        amt = res;
+        while ((msg->msg_iovlen > 0) && (amt >= msg->msg_iov[0].iov_len)) {
+            amt -= msg->msg_iov[0].iov_len;
+            msg->msg_iov++;
+            msg->msg_iovlen--;
+        }
+        if (msg->msg_iovlen > 0) {
+            msg->msg_iov[0].iov_base = ((char*)msg->msg_iov[0].iov_base) + amt;
+            msg->msg_iov[0].iov_len -= amt;
+            if (!hrpc_uring_submit_send(hcli)) {
+                return 0;
+            }
+        }
+    }
+    return !hcli->send_failed;
+}
+
+/**
+ * Wait for the send in progress to finish.
+ *
+ * @return      1 if it finished successfully; 0 otherwise.
+ */
+static int hrpc_uring_wait_send(struct hrpc_client *hcli, uint64_t deadline_ms)
+{
+    while (1) {
+        if (!hrpc_uring_reap(hcli)) {
+            return 0;
+        }
+        if (!hcli->send_pending) {
+            return 1;
+        }
+        if (!hrpc_wait_fd(hcli, uring_fd(hcli->ring), POLLIN, deadline_ms)) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Stop the send in progress, if there is one, and wait for the kernel to be
+ * done with the buffers.
+ */
+static void hrpc_uring_cancel(struct hrpc_client *hcli)
+{
+    int e;
+
+    if (hcli->send_pending) {
+        // Shutting down the socket makes the send fail straight away.
+        shutdown(hcli->sock, SHUT_RDWR);
+        while (hcli->send_pending) {
+            e = uring_submit(hcli->ring, 1);
+            if (e) {
+                htrace_log(hcli->lg, "hrpc_uring_cancel(%s): io_uring_enter "
+                           "error %d: %s\n", hcli->addr_str, e, terror(e));
+                break;
+            }
+            hrpc_uring_reap(hcli);
+        }
     }
+    hcli->send_pending = 0;
+    hcli->send_failed = 0;
+}
+
+static int hrpc_uring_send_req(struct hrpc_client *hcli, uint32_t method_id,
+                    const void *buf1, size_t buf1_len,
+                    const void *buf2, size_t buf2_len, uint64_t *seq,
+                    int async)
+{
+    uint64_t deadline_ms;
 
-    ms_to_timeval(hcli->write_timeo_ms, &tv);
-    if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
-        int e = errno;
-        htrace_log(hcli->lg, "setsockopt(%d, SO_SNDTIMEO, %"PRId64") failed: "
-                  "error %d (%s)\n", sock, hcli->write_timeo_ms, e, terror(e));
+    deadline_ms = hrpc_deadline_ms(hcli, hcli->opts.write_timeo_ms);
+    if (!hrpc_uring_wait_send(hcli, deadline_ms)) {
+        return 0;
+    }
+    hrpc_fill_req_header(hcli, &hcli->send_hdr, method_id,
+                         buf1_len + buf2_len, seq);
+    hcli->send_iov[0].iov_base = &hcli->send_hdr;
+    hcli->send_iov[0].iov_len = sizeof(hcli->send_hdr);
+    hcli->send_iov[1].iov_base = (void*)buf1;
+    hcli->send_iov[1].iov_len = buf1_len;
+    hcli->send_iov[2].iov_base = (void*)buf2;
+    hcli->send_iov[2].iov_len = buf2_len;
+    memset(&hcli->send_msg, 0, sizeof(hcli->send_msg));
+    hcli->send_msg.msg_iov = hcli->send_iov;
+    hcli->send_msg.msg_iovlen = 3;
+    hcli->send_deadline_ms = deadline_ms;
+    if (!hrpc_uring_submit_send(hcli)) {
         return 0;
     }
+    if (!async) {
+        return hrpc_uring_wait_send(hcli, deadline_ms);
+    }
     return 1;
 }
+#endif
 
 static int hrpc_client_send_req(struct hrpc_client *hcli, uint32_t method_id,
                     const void *buf1, size_t buf1_len,
-                    const void *buf2, size_t buf2_len, uint64_t *seq)
+                    const void *buf2, size_t buf2_len, uint64_t *seq,
+                    int async)
 {
+#ifdef HAVE_IO_URING
+    if (hcli->ring) {
+        return hrpc_uring_send_req(hcli, method_id, buf1, buf1_len,
+                                   buf2, buf2_len, seq, async);
+    }
+#endif
     // We use writev (scatter/gather I/O) here in order to avoid sending
     // multiple packets when TCP_NODELAY is turned on.
     struct hrpc_req_header hdr;
     struct iovec iov[3];
+    int i = 0, niov = sizeof(iov)/sizeof(iov[0]);
+    uint64_t deadline_ms;
 
-    hdr.magic = htole64(HRPC_MAGIC);
-    hdr.method_id = htole32(method_id);
-    *seq = hcli->seq++;
-    hdr.seq = htole64(*seq);
-    hdr.length = htole32(buf1_len + buf2_len);
+    hrpc_fill_req_header(hcli, &hdr, method_id, buf1_len + buf2_len, seq);
     iov[0].iov_base = &hdr;
     iov[0].iov_len = sizeof(hdr);
     iov[1].iov_base = (void*)buf1;
@@ -361,155 +1390,203 @@ static int hrpc_client_send_req(struct hrpc_client *hcli, uint32_t method_id,
     iov[2].iov_base = (void*)buf2;
     iov[2].iov_len = buf2_len;
 
+    deadline_ms = hrpc_deadline_ms(hcli, hcli->opts.write_timeo_ms);
     while (1) {
-        ssize_t res = writev(hcli->sock, iov, sizeof(iov)/sizeof(iov[0]));
-        int i;
+        ssize_t res = writev(hcli->sock, iov + i, niov - i);
         if (res < 0) {
             int e = errno;
             if (e == EINTR) {
                 continue;
             }
+            if ((e == EAGAIN) || (e == EWOULDBLOCK)) {
+                if (!hrpc_wait_fd(hcli, hcli->sock, POLLOUT, deadline_ms)) {
+                    return 0;
+                }
+                continue;
+            }
             htrace_log(hcli->lg, "hrpc_client_send_req: writev error: "
                        "error %d: %s\n", e, terror(e));
             return 0;
         }
-        i = 0;
-        while (res > 0) {
-            if (iov[i].iov_len < res) {
-                res -= iov[i].iov_len;
-                iov[i].iov_len = 0;
-            } else {
-                iov[i].iov_len -= res;
-                res = 0;
-            }
-            if (++i >= (sizeof(iov)/sizeof(iov[0]))) {
-                if (res == 0) {
-                    return 1;
-                }
-                htrace_log(hcli->lg, "hrpc_client_send_req: unexpectedly "
-                           "large writev return.\n");
-                return 0;
-            }
+        // Skip past whatever was written.  A short write can end in the
+        // middle of any of the buffers.
+        while ((i < niov) && (res >= (ssize_t)iov[i].iov_len)) {
+            res -= iov[i].iov_len;
+            i++;
+        }
+        if (i >= niov) {
+            return 1;
         }
+        iov[i].iov_base = ((char*)iov[i].iov_base) + res;
+        iov[i].iov_len -= res;
     }
 }
 
-static int safe_read(int fd, void *buf, size_t amt)
+/**
+ * Read part of a response, without blocking.
+ *
+ * @param hcli              The HRPC client.
+ * @param what              A description of the part, for log messages.
+ * @param buf               The buffer to read the part into.
+ * @param len               The length of the part.
+ *
+ * @return                  1 if we have the whole part; HRPC_RECV_AGAIN if
+ *                              we need to wait for more data; 0 on error.
+ */
+static int hrpc_read_part(struct hrpc_client *hcli, const char *what,
+                          void *buf, size_t len)
 {
-    uint8_t *b = buf;
-    int e, res, nread = 0;
+    ssize_t res;
+    int e;
 
-    while (1) {
-        res = read(fd, b + nread, amt - nread);
-        if (res <= 0) {
-            if (res == 0) {
-                return nread;
-            }
+    while (hcli->rs.off < len) {
+        res = read(hcli->sock, ((char*)buf) + hcli->rs.off,
+                   len - hcli->rs.off);
+        if (res < 0) {
             e = errno;
             if (e == EINTR) {
                 continue;
             }
-            return -e;
+            if ((e == EAGAIN) || (e == EWOULDBLOCK)) {
+                return HRPC_RECV_AGAIN;
+            }
+            htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): error reading "
+                       "%s: %d (%s)\n", hcli->addr_str, what, e, terror(e));
+            return 0;
         }
-        nread += res;
-        if (nread >= amt) {
-            return nread;
+        if (res == 0) {
+            htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): unexpected EOF "
+                       "reading %s.\n", hcli->addr_str, what);
+            return 0;
         }
+        hcli->rs.off += res;
     }
+    hcli->rs.off = 0;
+    return 1;
 }
 
-static int hrpc_client_rcv_resp(struct hrpc_client *hcli, uint32_t method_id,
-                                uint64_t seq, char **err_out, void **resp_out,
-                                size_t *resp_len)
+/**
+ * Make sure that a receive buffer can hold a given number of bytes.
+ *
+ * @param hcli              The HRPC client.
+ * @param rb                The receive buffer.
+ * @param len               The number of bytes.
+ * @param what              What the buffer is for, for log messages.
+ *
+ * @return                  0 on OOM, 1 on success.
+ */
+static int hrpc_resp_buf_reserve(struct hrpc_client *hcli,
+                                 struct hrpc_resp_buf *rb, size_t len,
+                                 const char *what)
 {
-    int res;
-    struct hrpc_resp_header hdr;
-    uint64_t resp_seq;
-    uint32_t resp_method_id, err_length, length;
-    char *err = NULL, *resp = NULL;
+    char *buf;
 
-    res = safe_read(hcli->sock, &hdr, sizeof(hdr));
-    if (res < 0) {
-        htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): error reading "
-                   "response header: %d (%s)\n", hcli->addr_str, -res,
-                   terror(-res));
-        goto error;
-    }
-    if (res != sizeof(hdr)) {
-        htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): unexpected EOF "
-                   "reading response header.\n", hcli->addr_str);
-        goto error;
-    }
-    resp_seq = le64toh(hdr.seq);
-    if (resp_seq != seq) {
-        htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): expected sequence "
-                   "ID 0x%"PRIx64", but got sequence ID 0x%"PRId64".\n",
-                   hcli->addr_str, seq, resp_seq);
-        goto error;
-    }
-    resp_method_id = le32toh(hdr.method_id);
-    if (resp_method_id != method_id) {
-        htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): expected method "
-                   "ID 0x%"PRIx32", but got method ID 0x%"PRId32".\n",
-                   hcli->addr_str, method_id, resp_method_id);
-        goto error;
+    if (len <= rb->cap) {
+        return 1;
     }
-    err_length = le32toh(hdr.err_length);
-    if (err_length > MAX_HRPC_ERROR_LENGTH) {
-        htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): error length was "
-                   "%"PRId32", but the maximum error length is %"PRId32".",
-                   hcli->addr_str, err_length, MAX_HRPC_ERROR_LENGTH);
-        goto error;
+    buf = htrace_realloc(rb->buf, len);
+    if (!buf) {
+        htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): OOM allocating "
+                   "%" PRIu64 " bytes for the %s.\n", hcli->addr_str,
+                   (uint64_t)len, what);
+        return 0;
     }
-    if (err_length > 0) {
-        err = malloc(err_length + 1);
-        res = safe_read(hcli->sock, err, err_length);
-        if (res < 0) {
-            htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): error reading "
-                       "error string: %d (%s)\n", hcli->addr_str, -res,
-                       terror(-res));
-            goto error;
+    rb->buf = buf;
+    rb->cap = len;
+    return 1;
+}
+
+static int hrpc_client_rcv_resp(struct hrpc_client *hcli, uint32_t method_id,
+                                uint64_t *seq, const char **err_out,
+                                const void **resp_out, size_t *resp_len)
+{
+    struct hrpc_resp_state *rs = &hcli->rs;
+    uint32_t resp_method_id, err_length, length;
+    int res;
+
+    if (rs->phase == HRPC_RESP_HEADER) {
+        res = hrpc_read_part(hcli, "response header", &rs->hdr,
+                             sizeof(rs->hdr));
+        if (res != 1) {
+            return res;
         }
-        if (res != err_length) {
-            htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): unexpected EOF "
-                       "reading error string.\n", hcli->addr_str);
-            goto error;
+        resp_method_id = le32toh(rs->hdr.method_id);
+        if (resp_method_id != method_id) {
+            htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): expected method "
+                       "ID 0x%"PRIx32", but got method ID 0x%"PRId32".\n",
+                       hcli->addr_str, method_id, resp_method_id);
+            return 0;
         }
-        err[err_length] = '\0';
-    }
-    length = le32toh(hdr.length);
-    if (length > MAX_HRPC_BODY_LENGTH) {
-        htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): body length was "
-                   "%"PRId32", but the maximum body length is %"PRId32".",
-                   hcli->addr_str, length, MAX_HRPC_BODY_LENGTH);
-        goto error;
-    }
-    if (length > 0) {
-        resp = malloc(length);
-        res = safe_read(hcli->sock, resp, length);
-        if (res < 0) {
-            htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): error reading "
-                       "body: %d (%s)\n", hcli->addr_str, -res, terror(-res));
-            goto error;
+        err_length = le32toh(rs->hdr.err_length);
+        if (err_length > MAX_HRPC_ERROR_LENGTH) {
+            htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): error length was "
+                       "%"PRId32", but the maximum error length is %"PRId32".",
+                       hcli->addr_str, err_length, MAX_HRPC_ERROR_LENGTH);
+            return 0;
         }
-        if (res != length) {
-            htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): unexpected EOF "
-                       "reading body.\n", hcli->addr_str);
-            goto error;
+        length = le32toh(rs->hdr.length);
+        if (length > MAX_HRPC_BODY_LENGTH) {
+            htrace_log(hcli->lg, "hrpc_client_rcv_resp(%s): body length was "
+                       "%"PRId32", but the maximum body length is %"PRId32".",
+                       hcli->addr_str, length, MAX_HRPC_BODY_LENGTH);
+            return 0;
+        }
+        if (err_length > 0) {
+            if (!hrpc_resp_buf_reserve(hcli, &hcli->err_buf, err_length + 1,
+                                       "error string")) {
+                return 0;
+            }
+            hcli->err_buf.buf[err_length] = '\0';
+        }
+        if (!hrpc_resp_buf_reserve(hcli, &hcli->body_buf, length, "body")) {
+            return 0;
+        }
+        rs->phase = HRPC_RESP_ERROR;
+    }
+    err_length = le32toh(rs->hdr.err_length);
+    length = le32toh(rs->hdr.length);
+    if (rs->phase == HRPC_RESP_ERROR) {
+        res = hrpc_read_part(hcli, "error string", hcli->err_buf.buf,
+                             err_length);
+        if (res != 1) {
+            return res;
         }
+        rs->phase = HRPC_RESP_BODY;
+    }
+    res = hrpc_read_part(hcli, "body", hcli->body_buf.buf, length);
+    if (res != 1) {
+        return res;
     }
-    *err_out = err;
-    *resp_out = resp;
+    *seq = le64toh(rs->hdr.seq);
+    *err_out = err_length ? hcli->err_buf.buf : NULL;
+    *resp_out = length ? hcli->body_buf.buf : NULL;
     *resp_len = length;
+    memset(rs, 0, sizeof(*rs));
     return 1;
+}
 
-error:
-    free(err);
-    free(resp);
-    *err_out = NULL;
-    *resp_out = NULL;
-    *resp_len = 0;
-    return 0;
+int hrpc_write_spans_prequel(const char *trid, uint64_t num_spans,
+                             uint8_t *prequel)
+{
+    struct cmp_bcopy_ctx bctx;
+    struct cmp_ctx_s *ctx =  (struct cmp_ctx_s *)&bctx;
+    cmp_bcopy_ctx_init(&bctx, prequel, MAX_WRITESPANS_PREQUEL_LEN);
+    if (!cmp_write_fixmap(ctx, 2)) {
+        return -1;
+    }
+    if (!cmp_write_fixstr(ctx, DEFAULT_TRID_STR, DEFAULT_TRID_STR_LEN)) {
+        return -1;
+    }
+    if (!cmp_write_str(ctx, trid, strlen(trid))) {
+        return -1;
+    }
+    if (!cmp_write_fixstr(ctx, NUM_SPANS_STR, NUM_SPANS_STR_LEN)) {
+        return -1;
+    }
+    if (!cmp_write_uint(ctx, num_spans)) {
+        return -1;
+    }
+    return bctx.off;
 }
 
 const char *hrpc_client_get_endpoint(struct hrpc_client *hcli)
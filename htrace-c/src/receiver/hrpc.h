@@ -32,21 +32,140 @@
 
 #define METHOD_ID_WRITE_SPANS 0x1
 
+/**
+ * A WriteSpans request whose body is compressed with zlib.  The response is
+ * the same as for METHOD_ID_WRITE_SPANS, and carries that method ID.
+ */
+#define METHOD_ID_WRITE_SPANS_ZLIB 0x2
+
+/**
+ * A WriteSpans request whose prequel carries the tables of
+ * htraced_dict_encode, and whose spans refer to them.  It has its own method
+ * ID so that a server which doesn't know about the tables rejects it, rather
+ * than storing spans without their descriptions.  The response is the same
+ * as for METHOD_ID_WRITE_SPANS, and carries that method ID.
+ */
+#define METHOD_ID_WRITE_SPANS_DICT 0x3
+
+/**
+ * A METHOD_ID_WRITE_SPANS_DICT request whose body is compressed with zlib.
+ */
+#define METHOD_ID_WRITE_SPANS_DICT_ZLIB 0x4
+
+/**
+ * The maximum length of the prequel in a WriteSpans message.
+ */
+#define MAX_WRITESPANS_PREQUEL_LEN 1024
+
+/**
+ * The WriteSpansReq fields which go in the prequel.
+ */
+#define DEFAULT_TRID_STR            "DefaultTrid"
+#define DEFAULT_TRID_STR_LEN        (sizeof(DEFAULT_TRID_STR) - 1)
+#define NUM_SPANS_STR               "NumSpans"
+#define NUM_SPANS_STR_LEN           (sizeof(NUM_SPANS_STR) - 1)
+
+/**
+ * Returned by hrpc_client_poll when a response is ready to be read.
+ */
+#define HRPC_POLL_READABLE 0x1
+
+/**
+ * Returned by hrpc_client_poll when the wakeup file descriptor is readable.
+ */
+#define HRPC_POLL_WOKEN 0x2
+
+/**
+ * The maximum number of clients hrpc_client_poll can wait on at once.
+ */
+#define HRPC_POLL_MAX_CLIENTS 16
+
+/**
+ * Returned by hrpc_client_recv when only part of the response has arrived.
+ */
+#define HRPC_RECV_AGAIN (-1)
+
+/**
+ * The length of the header which goes in front of every HRPC request.
+ */
+#define HRPC_REQ_HEADER_LEN 20
+
 struct htrace_log;
 
+/**
+ * Options for an HRPC client.
+ */
+struct hrpc_client_opts {
+    /**
+     * The longest time to spend connecting, or sending one request.
+     */
+    uint64_t write_timeo_ms;
+
+    /**
+     * The longest time hrpc_client_call waits for a response.
+     */
+    uint64_t read_timeo_ms;
+
+    /**
+     * Nonzero if we should set TCP_NODELAY on our sockets.
+     */
+    int tcp_nodelay;
+
+    /**
+     * The socket send buffer size to ask for, or 0 for the system default.
+     */
+    int tcp_sndbuf;
+
+    /**
+     * The idle time before TCP keepalive probes are sent, or 0 to leave
+     * keepalive off.
+     */
+    uint64_t tcp_keepalive_ms;
+
+    /**
+     * How long looked-up addresses stay fresh, or 0 to look up the host
+     * every time we connect.
+     */
+    uint64_t dns_cache_ms;
+
+    /**
+     * Nonzero if we should use datagram sockets instead of stream sockets.
+     * Requests must then be sent with hrpc_client_send_dgrams, and no
+     * responses come back.
+     */
+    int datagram;
+
+    /**
+     * Nonzero if we should submit sends through io_uring, when libhtrace was
+     * built with io_uring support and the kernel has it.
+     */
+    int io_uring;
+};
+
+/**
+ * One datagram to send with hrpc_client_send_dgrams.  The body of the request
+ * is the two buffers, one after the other.
+ */
+struct hrpc_dgram {
+    const void *buf1;
+    size_t buf1_len;
+    const void *buf2;
+    size_t buf2_len;
+};
+
 /**
  * Create an HRPC client.
  *
  * @param lg                The log object to use for the HRPC client.
- * @param write_timeo_ms    The TCP write timeout to use.
- * @param read_timeo_ms     The TCP read timeout to use.
- * @param hostpost          The hostname and port, separated by a colon.
+ * @param opts              The options to use.  They will be copied.
+ * @param hostpost          The hostname and port, separated by a colon, or
+ *                              "unix:" followed by the path of a unix domain
+ *                              socket.
  *
  * @param                   NULL on OOM; the hrpc_client otherwise.
  */
 struct hrpc_client *hrpc_client_alloc(struct htrace_log *lg,
-                uint64_t write_timeo_ms, uint64_t read_timeo_ms,
-                const char *endpoint);
+                const struct hrpc_client_opts *opts, const char *endpoint);
 
 /**
  * Free the HRPC client.
@@ -64,19 +183,228 @@ void hrpc_client_free(struct hrpc_client *hcli);
  * @param buf1_len          The size of the first buffer to send.
  * @param buf2              The second buffer to send.
  * @param buf2_len          The size of the second buffer to send.
- * @param err               (out param) Will be set to a malloced
- *                              NULL-terminated string if the server returned an
- *                              error response.  NULL otherwise.
+ * @param err               (out param) Will be set to a NULL-terminated
+ *                              string if the server returned an error
+ *                              response.  NULL otherwise.
  * @param resp              (out param) The response body.  Will be set to the
  *                              response body if the function returns nonzero.
  * @param resp_len          (out param) The length of the response body.
  *
+ * The error string and response body belong to the client, as with
+ * hrpc_client_recv.
+ *
  * @return                  0 on failure, 1 on success.
  */
 int hrpc_client_call(struct hrpc_client *hcli, uint32_t method_id,
                      const void *buf1, size_t buf1_len,
                      const void *buf2, size_t buf2_len,
-                     char **err, void **resp, size_t *resp_len);
+                     const char **err, const void **resp, size_t *resp_len);
+
+/**
+ * Send a request using the HRPC client, without waiting for the response.
+ *
+ * A connection will be opened if there isn't one already.  Several requests
+ * can be outstanding at once.  Their responses can be read with
+ * hrpc_client_recv, and matched up with the requests by sequence ID.
+ *
+ * @param hcli              The HRPC client.
+ * @param method_id         The method ID to use.
+ * @param buf1              The first buffer to send.
+ * @param buf1_len          The size of the first buffer to send.
+ * @param buf2              The second buffer to send.
+ * @param buf2_len          The size of the second buffer to send.
+ * @param seq               (out param) The sequence ID of the request.
+ *
+ * @return                  0 on failure, 1 on success.  On failure, the
+ *                              connection is closed, and any outstanding
+ *                              requests will get no response.
+ */
+int hrpc_client_send(struct hrpc_client *hcli, uint32_t method_id,
+                     const void *buf1, size_t buf1_len,
+                     const void *buf2, size_t buf2_len, uint64_t *seq);
+
+/**
+ * Send several requests as datagrams, without waiting for any response.
+ *
+ * Each datagram carries one whole request, with its own header and sequence
+ * ID.  The client must have been created with the datagram option.  The
+ * datagrams are sent in as few system calls as we can manage.
+ *
+ * There are no acknowledgements, so a datagram which doesn't reach the server
+ * is simply lost.  Datagrams which the kernel has no room for are counted as
+ * not sent, rather than waited for.
+ *
+ * @param hcli              The HRPC client.
+ * @param method_id         The method ID to use.
+ * @param dgrams            The datagrams to send.
+ * @param num_dgrams        The number of datagrams to send.
+ *
+ * @return                  The number of datagrams sent, or -1 on failure.
+ *                              On failure, the connection is closed.
+ */
+int hrpc_client_send_dgrams(struct hrpc_client *hcli, uint32_t method_id,
+                            const struct hrpc_dgram *dgrams, int num_dgrams);
+
+/**
+ * Send a request using the HRPC client, without waiting for it to be sent.
+ *
+ * This is like hrpc_client_send, except that when the client uses io_uring,
+ * the kernel may still be sending the request after we return.  The buffers
+ * must stay valid until the response has been received, or the connection
+ * has been closed.  The next send on the same client waits for this one to
+ * finish.  Without io_uring, this function is the same as hrpc_client_send.
+ *
+ * @param hcli              The HRPC client.
+ * @param method_id         The method ID to use.
+ * @param buf1              The first buffer to send.
+ * @param buf1_len          The size of the first buffer to send.
+ * @param buf2              The second buffer to send.
+ * @param buf2_len          The size of the second buffer to send.
+ * @param seq               (out param) The sequence ID of the request.
+ *
+ * @return                  0 on failure, 1 on success.  On failure, the
+ *                              connection is closed, and any outstanding
+ *                              requests will get no response.  If the send
+ *                              fails later, hrpc_client_poll reports the
+ *                              client as ready, and hrpc_client_recv fails.
+ */
+int hrpc_client_send_async(struct hrpc_client *hcli, uint32_t method_id,
+                           const void *buf1, size_t buf1_len,
+                           const void *buf2, size_t buf2_len, uint64_t *seq);
+
+/**
+ * Wait for a response to be ready on the connection of any of several HRPC
+ * clients.
+ *
+ * @param hclis             The HRPC clients.  Clients which have no open
+ *                              connection are skipped.
+ * @param ready             (out param) An array of num_hcli entries.  Entry i
+ *                              will be set to 1 if a response is ready on
+ *                              hclis[i], and 0 otherwise.
+ * @param num_hcli          The number of HRPC clients.  This must not be more
+ *                              than HRPC_POLL_MAX_CLIENTS.
+ * @param wake_fd           A file descriptor which another thread can make
+ *                              readable to interrupt the wait, or -1.
+ * @param timeo_ms          The maximum time to wait.
+ *
+ * Clients which have an asynchronous send in progress are waited on as
+ * well, so that we may return 0 early when a send finishes.
+ *
+ * @return                  A combination of HRPC_POLL_READABLE and
+ *                              HRPC_POLL_WOKEN; 0 on timeout; or -1 on error,
+ *                              or if there is nothing to wait for.
+ */
+int hrpc_client_poll(struct hrpc_client **hclis, int *ready, int num_hcli,
+                     int wake_fd, uint64_t timeo_ms);
+
+/**
+ * Read the next response from the HRPC client's connection, without
+ * blocking.
+ *
+ * If only part of the response has arrived, we keep what we have read, and
+ * return HRPC_RECV_AGAIN.  The caller can wait with hrpc_client_poll, and
+ * then call this function again to read the rest.
+ *
+ * The error string and response body are read into buffers which belong to
+ * the client, and are reused for later responses, so that receiving does not
+ * allocate memory once the buffers are big enough.  They stay valid until the
+ * next call to hrpc_client_recv, hrpc_client_call, or hrpc_client_close.
+ *
+ * @param hcli              The HRPC client.
+ * @param method_id         The method ID we expect.
+ * @param seq               (out param) The sequence ID of the request this
+ *                              is a response to.
+ * @param err               (out param) Will be set to a NULL-terminated
+ *                              string if the server returned an error
+ *                              response.  NULL otherwise.
+ * @param resp              (out param) The response body, or NULL if it was
+ *                              empty.
+ * @param resp_len          (out param) The length of the response body.
+ *
+ * @return                  0 on failure, 1 on success, or HRPC_RECV_AGAIN.
+ *                              On failure, the connection is closed, and any
+ *                              outstanding requests will get no response.
+ */
+int hrpc_client_recv(struct hrpc_client *hcli, uint32_t method_id,
+                     uint64_t *seq, const char **err, const void **resp,
+                     size_t *resp_len);
+
+/**
+ * Close the HRPC client's connection, if it is open.  Any outstanding
+ * requests will get no response.  The next send will open a new connection.
+ *
+ * @param hcli              The HRPC client.
+ */
+void hrpc_client_close(struct hrpc_client *hcli);
+
+/**
+ * Set a deadline for every connect, send and wait on an HRPC client.  The
+ * usual timeouts still apply, but nothing waits past the deadline.
+ *
+ * @param hcli              The HRPC client.
+ * @param deadline_ms       The monotonic-clock time to give up at, or 0 for
+ *                              no deadline.
+ */
+void hrpc_client_set_deadline(struct hrpc_client *hcli, uint64_t deadline_ms);
+
+/**
+ * Reset an HRPC client which was inherited across fork.  The parent process
+ * still owns the connection, so we close our copy of the socket without
+ * shutting it down or waiting for sends in progress.  The next send will
+ * open a new connection.
+ *
+ * This must be called before any other thread uses the client in the child.
+ *
+ * @param hcli              The HRPC client.
+ */
+void hrpc_client_forked(struct hrpc_client *hcli);
+
+/**
+ * Look up the addresses of the HRPC client's host, and cache them.
+ *
+ * This may block for a long time if DNS is slow, so it should be called from
+ * a thread which is not sending requests.  It is safe to call this function
+ * while another thread is using the client.  If the lookup fails, we keep
+ * using the addresses we had before.
+ *
+ * @param hcli              The HRPC client.
+ *
+ * @return                  0 on failure, 1 on success.
+ */
+int hrpc_client_resolve(struct hrpc_client *hcli);
+
+/**
+ * Find out how long it will be before the HRPC client's cached addresses
+ * should be looked up again.
+ *
+ * It is safe to call this function while another thread is using the client.
+ *
+ * @param hcli              The HRPC client.
+ * @param now               The current monotonic time in milliseconds.
+ *
+ * @return                  0 if the addresses should be looked up now;
+ *                              UINT64_MAX if the cache is disabled; the time
+ *                              to wait in milliseconds otherwise.
+ */
+uint64_t hrpc_client_resolve_due_ms(struct hrpc_client *hcli, uint64_t now);
+
+/**
+ * Write the prequel of a WriteSpans request.
+ *
+ * The body of a WriteSpans request is a msgpack map holding the
+ * WriteSpansReq fields other than the spans, followed by the spans
+ * themselves, one after another.
+ *
+ * @param trid              The default tracer ID, for spans which have none.
+ * @param num_spans         The number of spans which follow the prequel.
+ * @param prequel           (out param) A buffer of at least
+ *                              MAX_WRITESPANS_PREQUEL_LEN bytes.
+ *
+ * @return                  The length of the prequel, or -1 if it didn't
+ *                              fit.
+ */
+int hrpc_write_spans_prequel(const char *trid, uint64_t num_spans,
+                             uint8_t *prequel);
 
 /**
  * Get the endpoint for this HRPC client.
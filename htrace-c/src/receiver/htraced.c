@@ -21,22 +21,39 @@
 #include "core/htracer.h"
 #include "core/span.h"
 #include "receiver/hrpc.h"
+#include "receiver/htraced_dict.h"
+#include "receiver/htraced_fork.h"
+#include "receiver/htraced_int.h"
+#include "receiver/htraced_update.h"
 #include "receiver/receiver.h"
+#include "receiver/spill.h"
 #include "test/test.h"
+#include "util/alloc.h"
+#include "util/build.h"
 #include "util/cmp.h"
 #include "util/cmp_util.h"
+#include "util/fork.h"
 #include "util/log.h"
+#include "util/probe.h"
+#include "util/rand.h"
 #include "util/string.h"
 #include "util/time.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 /**
  * @file htraced.c
@@ -53,200 +70,454 @@
  *
  * Spans are serialized immediately when they are added to the buffer.  This is
  * one of the advantages of msgpack-- it has a good streaming interface.  We do
- * not need to keep around the span objects after htraced_rcv_add_span.
+ * not need to keep around the span objects after htraced_rcv_add_span.  Each
+ * span is serialized only once: we reserve all of the remaining space in the
+ * buffer, write the span there, and commit only the bytes that were used.  If
+ * the span didn't fit, nothing is committed, and we try again once there is
+ * more space.
+ *
+ * The htraced receiver keeps a ring of equally sized buffers around internally
+ * (two by default.)  While we are writing spans to one buffer, we can be
+ * sending the data from another buffer over the wire.  Full buffers which are
+ * waiting to be sent are queued in ring order, so having more than two
+ * buffers lets us absorb bursts while a send is slow.  The intention here is
+ * to avoid copies as much as possible.  In general, what we send over the wire
+ * is exactly what is in the buffer, except that we have to add a short
+ * "prequel" to it containing the other WriteSpansReq fields.
+ *
+ * A buffer which is bigger than htraced.rpc.max.size is sent as several
+ * WriteSpans requests, one straight after another, each with its own prequel
+ * and each holding whole spans.  Their sequence IDs are consecutive, so the
+ * buffer only needs to remember the first and the last.  The buffer is done
+ * once every request has been answered, and is sent again in full if any of
+ * them failed.  This keeps the size of the buffers independent of the size
+ * of the requests.
+ *
+ * Several buffers can be in flight at once.  Each WriteSpans request carries a
+ * sequence number, and the transmitter thread matches responses back to their
+ * buffers as they arrive, so that throughput over a high-latency link is not
+ * limited to one buffer per round trip.  While requests are outstanding, the
+ * transmitter thread waits for the socket to become readable, or for a writer
+ * to wake it up through a pipe because another buffer is ready to send.
+ * Failed buffers are sent again, up to HTRACED_MAX_SEND_TRIES times.  Buffers
+ * are always freed in ring order, even though their responses may not be.
+ *
+ * htraced.address may list several htraced endpoints, and we keep one
+ * connection to each.  Each buffer is sent to the healthy connection with the
+ * fewest requests outstanding, taking turns when there is a tie.  Each extra
+ * endpoint gives a buffer one more try, so that a single dead node cannot use
+ * up all of its tries.
+ *
+ * Each connection has a circuit breaker.  When a connection fails, the breaker
+ * opens, and the endpoint is not used again until a backoff period is over.
+ * The backoff period doubles with each consecutive failure, up to a limit, and
+ * is randomized so that clients which lost the same server don't all come
+ * back at the same moment.  Once the backoff period is over, the breaker is
+ * half-open: we send a single request to probe the endpoint, and close the
+ * breaker again if it succeeds.  Everything that was in flight on a failed
+ * connection is sent again on the other connections straight away.  When no
+ * connection can be used, buffers which need to be sent wait in the ring,
+ * the transmitter thread sleeps until the first backoff period is over, and
+ * new spans keep going into the free buffers.  While shutting down, we don't
+ * wait for backoff periods to end.
+ *
+ * When every buffer is full, we apply the configured overflow policy: drop the
+ * new spans, drop the oldest buffered spans which are not already being sent,
+ * or block the adding thread until a buffer frees up or a timeout elapses.
+ *
+ * Optionally, each thread can also have a small staging buffer of its own.
+ * Spans are serialized into the staging buffer without taking the shared
+ * receiver lock, and the staging buffer is copied into the active send buffer
+ * in one go when it fills up, or when the transmitter thread sweeps it.  This
+ * turns one contended lock acquisition per span into one per staging buffer.
  *
- * The htraced receiver keeps two equally sized buffers around internally.
- * While we are writing spans to one buffer, we can be sending the data from the
- * other buffer over the wire.  The intention here is to avoid copies as much as
- * possible.  In general, what we send over the wire is exactly what is in the
- * buffer, except that we have to add a short "prequel" to it containing the
- * other WriteSpansReq fields.
+ * Optionally, buffers which can't be sent can be spilled to disk, rather than
+ * being dropped.  A failed buffer is spilled as soon as no endpoint is
+ * healthy, or once it has used up its tries, which frees up its slot in the
+ * ring for new spans.  Spilled batches are sent again in order, one at a
+ * time, whenever a healthy endpoint has room in the in-flight window which no
+ * buffer in the ring needs.  See spill.c for the on-disk format.
+ *
+ * Optionally, each WriteSpans request can be compressed with zlib before it is
+ * sent.  Span data is very repetitive, so this usually saves a lot of
+ * bandwidth.  Compressed requests use their own method ID, so that htraced
+ * can tell them apart.  The transmitter thread compresses the prequel and the
+ * buffer into a scratch buffer of its own, so this doesn't hold up writers.
+ *
+ * Optionally, spans can be sent as datagrams instead of over a stream.  Each
+ * buffer is cut into WriteSpans requests small enough to fit into one
+ * datagram, each with its own prequel, and they are sent in batches without
+ * waiting for any response.  This costs nothing when htraced is slow or down,
+ * but spans are lost whenever a datagram is.  Spans which don't fit into a
+ * datagram are dropped.  Compression and spilling are never used in datagram
+ * mode.
+ *
+ * The receiver's state is defined in htraced_int.h.  Dictionary encoding and
+ * grouping by trace are in htraced_dict.c, and restarting in a forked child
+ * is in htraced_fork.c.  Applying a new configuration is in htraced_update.c.
  *
  * Note that we may change the serialization in the future if we discover better
  * alternatives.  Sending spans over HTTP as JSON will always be supported
  * as a fallback.
  */
 
-/**
- * The maximum length of the message we will send to the server.
- * This must be the same or shorter than MAX_HRPC_BODY_LENGTH in rpc.go.
- */
-#define MAX_HRPC_LEN (32ULL * 1024ULL * 1024ULL)
+static int should_xmit(struct htraced_rcv *rcv, uint64_t now);
+static struct htraced_sbuf *htraced_next_to_send(struct htraced_rcv *rcv,
+                                                 uint64_t now);
+static void htraced_xmit_send(struct htraced_rcv *rcv,
+                              struct htraced_sbuf *sbuf, uint64_t now);
+static void htraced_xmit_wait(struct htraced_rcv *rcv, uint64_t now);
+static int htraced_have_usable_conn(const struct htraced_rcv *rcv,
+                                    uint64_t now);
+static uint64_t htraced_next_retry_ms(const struct htraced_rcv *rcv,
+                                      uint64_t now);
+static uint64_t htraced_next_batch_ms(const struct htraced_rcv *rcv,
+                                      uint64_t now);
+static int htraced_sbufs_spilling(const struct htraced_rcv *rcv);
+static void htraced_spill_sbufs(struct htraced_rcv *rcv, uint64_t now);
+static void htraced_unspill_send(struct htraced_rcv *rcv, uint64_t now);
+static uint64_t htraced_idle_wait_ms(const struct htraced_rcv *rcv,
+                                     uint64_t now);
 
 /**
- * The maximum length of the prequel in a WriteSpans message.
+ * Get the time at which a call we measure for HTRACE_SELF_STATS_KEY started.
+ *
+ * @param rcv           The htraced receiver.
+ *
+ * @return              The monotonic time in nanoseconds, or 0 if we are
+ *                          not measuring.
  */
-#define MAX_WRITESPANS_PREQUEL_LEN 1024
+static uint64_t htraced_self_start(const struct htraced_rcv *rcv)
+{
+    if (!rcv->self_stats) {
+        return 0;
+    }
+    return monotonic_now_ns(NULL);
+}
 
 /**
- * The maximum length of the span data in a WriteSpans message.
+ * Add the time since a measured call started to a self-instrumentation
+ * counter.
+ *
+ * @param rcv           The htraced receiver.
+ * @param ctr           The counter.
+ * @param start_ns      What htraced_self_start returned.
  */
-#define MAX_SPAN_DATA_LEN (MAX_HRPC_LEN - MAX_WRITESPANS_PREQUEL_LEN)
+static void htraced_self_add(struct htraced_rcv *rcv, uint64_t *ctr,
+                             uint64_t start_ns)
+{
+    if (start_ns) {
+        __atomic_fetch_add(ctr, monotonic_now_ns(rcv->lg) - start_ns,
+                           __ATOMIC_RELAXED);
+    }
+}
 
 /**
- * The minimum total buffer size to allow.
+ * Take the receiver lock on behalf of a thread adding spans, counting how
+ * long we waited for it.  We only read the clock if the lock is contended.
  *
- * This should allow at least a few spans to be buffered.
+ * @param rcv           The htraced receiver.
  */
-#define HTRACED_MIN_BUFFER_SIZE (4ULL * 1024ULL * 1024ULL)
+static void htraced_rcv_lock(struct htraced_rcv *rcv)
+{
+    uint64_t start_ns;
+
+    if (!rcv->self_stats) {
+        pthread_mutex_lock(&rcv->lock);
+        return;
+    }
+    if (pthread_mutex_trylock(&rcv->lock) == 0) {
+        return;
+    }
+    start_ns = monotonic_now_ns(rcv->lg);
+    pthread_mutex_lock(&rcv->lock);
+    htraced_self_add(rcv, &rcv->self_lock_wait_ns, start_ns);
+}
 
 /**
- * The maximum total buffer size to allow.
+ * Wake up the transmitter thread.
+ * This function must be called with the lock held.
  */
-#define HTRACED_MAX_BUFFER_SIZE (2ULL * MAX_SPAN_DATA_LEN)
+void htraced_wake_xmit(struct htraced_rcv *rcv)
+{
+    char b = 0;
+
+    pthread_cond_signal(&rcv->bg_cond);
+    if (rcv->xmit_polling && !rcv->xmit_woken) {
+        rcv->xmit_woken = 1;
+        if (write(rcv->wake_fd[1], &b, 1) < 0) {
+            // The pipe is non-blocking, and we only write to it once before
+            // it is drained, so this should not happen.
+            rcv->xmit_woken = 0;
+        }
+    }
+}
 
 /**
- * The minimum number of milliseconds to allow for flush_interval_ms.
+ * Add a sample to a moving average.  The first sample is used as it is.
  */
-#define HTRACED_FLUSH_INTERVAL_MS_MIN 30000LL
+static double htraced_ewma(double avg, double sample)
+{
+    if (avg <= 0) {
+        return sample;
+    }
+    return avg + (HTRACED_BATCH_EWMA_WEIGHT * (sample - avg));
+}
 
 /**
- * The maximum number of milliseconds to allow for flush_interval_ms.
- * This is mainly to avoid overflow.
+ * Count the latency of a WriteSpans request in the latency histogram.
+ * This function must be called with the lock held.
  */
-#define HTRACED_FLUSH_INTERVAL_MS_MAX 86400000LL
+static void htraced_count_latency(struct htraced_rcv *rcv, uint64_t ms)
+{
+    int bucket = 0;
+
+    while ((ms > 0) && (bucket < HTRACE_STATS_LATENCY_BUCKETS - 1)) {
+        ms >>= 1;
+        bucket++;
+    }
+    rcv->ctrs.rpc_latency_ms[bucket]++;
+    rcv->pressure_fast_ms = htraced_ewma(rcv->pressure_fast_ms, ms);
+    if (rcv->pressure_slow_ms <= 0) {
+        rcv->pressure_slow_ms = ms;
+    } else {
+        rcv->pressure_slow_ms += HTRACED_PRESSURE_SLOW_EWMA_WEIGHT *
+            (ms - rcv->pressure_slow_ms);
+    }
+}
 
 /**
- * The minimum number of milliseconds to allow for tcp write timeouts.
+ * Pick the send threshold and the batch deadline from the observed RPC
+ * latency and span arrival rate.
+ * This function must be called with the lock held.
+ *
+ * A span waits for the batch deadline and then for the RPC, so the deadline
+ * is whatever is left of the latency bound after the RPC latency.  Sending
+ * is only worthwhile once a buffer holds about as much data as arrives
+ * during one RPC, divided among the requests we may have in flight: smaller
+ * batches would not let the transmitter keep up, and bigger ones would only
+ * add delay.
  */
-#define HTRACED_WRITE_TIMEO_MS_MIN 50LL
+void htraced_batch_adapt(struct htraced_rcv *rcv)
+{
+    double threshold;
+
+    if (rcv->rpc_latency_ms + HTRACED_BATCH_DEADLINE_MS_MIN <
+            rcv->batch_max_latency_ms) {
+        rcv->batch_deadline_ms =
+            rcv->batch_max_latency_ms - (uint64_t)rcv->rpc_latency_ms;
+    } else {
+        rcv->batch_deadline_ms = HTRACED_BATCH_DEADLINE_MS_MIN;
+    }
+    threshold = rcv->arrival_rate * rcv->rpc_latency_ms / rcv->inflight_window;
+    if (threshold >= rcv->max_send_threshold) {
+        rcv->send_threshold = rcv->max_send_threshold;
+    } else if (threshold <= HTRACED_BATCH_THRESHOLD_MIN) {
+        rcv->send_threshold = HTRACED_BATCH_THRESHOLD_MIN;
+        if (rcv->send_threshold > rcv->max_send_threshold) {
+            rcv->send_threshold = rcv->max_send_threshold;
+        }
+    } else {
+        rcv->send_threshold = threshold;
+    }
+}
 
 /**
- * The minimum number of milliseconds to allow for tcp read timeouts.
+ * Note that span data was written to the active buffer, and wake up the
+ * transmitter thread if it should do something about it.
+ * This function must be called with the lock held.
+ *
+ * @param rcv           The htraced receiver.
+ * @param prev_off      The offset of the active buffer before the write.
  */
-#define HTRACED_READ_TIMEO_MS_MIN 50LL
+static void htraced_active_written(struct htraced_rcv *rcv, uint64_t prev_off)
+{
+    struct htraced_sbuf *sbuf = rcv->sbuf[rcv->active_buf];
+
+    rcv->ctrs.bytes_serialized += sbuf->off - prev_off;
+    if (sbuf->off > rcv->ctrs.buffer_bytes_max) {
+        rcv->ctrs.buffer_bytes_max = sbuf->off;
+    }
+    if (sbuf->off > rcv->send_threshold) {
+        htraced_wake_xmit(rcv);
+    } else if (rcv->batch_max_latency_ms && (prev_off == 0)) {
+        // Start the clock on the batch deadline.  The transmitter has to know
+        // about it, since it may be sleeping until much later.
+        rcv->active_start_ms = monotonic_now_ms(rcv->lg);
+        htraced_wake_xmit(rcv);
+    }
+}
+
+static int htraced_sbufs_empty(struct htraced_rcv *rcv)
+{
+    int i;
+    for (i = 0; i < rcv->num_bufs; i++) {
+        if (rcv->sbuf[i]->off) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
 /**
- * The maximum number of times we will try to add a span to the circular buffer
- * before giving up.
+ * Get the number of send buffers which are not free.
+ * This function must be called with the lock held.
  */
-#define HTRACED_MAX_ADD_TRIES 3
+int htraced_sbufs_used(const struct htraced_rcv *rcv)
+{
+    return ((rcv->active_buf - rcv->xmit_head + rcv->num_bufs) %
+            rcv->num_bufs) + 1;
+}
 
 /**
- * The maximum number of times to try to send some spans to the htraced daemon
- * before giving up.
+ * Give a free send buffer the length which the send buffers should have.
+ * This function must be called with the lock held.
+ *
+ * If we can't, the buffer keeps its old length until the next time it is
+ * free.
+ *
+ * @param rcv           The htraced receiver.
+ * @param idx           The index of the buffer in the ring.
  */
-#define HTRACED_MAX_SEND_TRIES 3
+void htraced_sbuf_resize(struct htraced_rcv *rcv, int idx)
+{
+    struct htraced_sbuf *sbuf = rcv->sbuf[idx];
+
+    if (sbuf->len == rcv->buf_len) {
+        return;
+    }
+    sbuf = htrace_realloc(sbuf,
+                offsetof(struct htraced_sbuf, buf) + rcv->buf_len);
+    if (!sbuf) {
+        htrace_log(rcv->lg, "htraced_sbuf_resize: OOM while resizing a send "
+                   "buffer to %" PRId64 " bytes.\n", rcv->buf_len);
+        return;
+    }
+    sbuf->len = rcv->buf_len;
+    rcv->sbuf[idx] = sbuf;
+}
 
 /**
- * The number of milliseconds to sleep after failing to send some spans to the
- * htraced daemon.
+ * Queue the active buffer for sending, and move on to the next free buffer.
+ * This function must be called with the lock held.
+ *
+ * @param rcv           The htraced receiver.
+ *
+ * @return              1 on success; 0 if there were no free buffers.
  */
-#define HTRACED_SEND_RETRY_SLEEP_MS 5000
+static int htraced_sbufs_advance(struct htraced_rcv *rcv)
+{
+    struct htraced_sbuf *sbuf = rcv->sbuf[rcv->active_buf];
+    uint64_t elapsed;
+
+    if (htraced_sbufs_used(rcv) >= rcv->num_bufs) {
+        return 0;
+    }
+    if (rcv->batch_max_latency_ms && (sbuf->off > 0)) {
+        elapsed = monotonic_now_ms(rcv->lg) - rcv->active_start_ms;
+        if (elapsed < 1) {
+            elapsed = 1;
+        }
+        rcv->arrival_rate = htraced_ewma(rcv->arrival_rate,
+                                         (double)sbuf->off / elapsed);
+        htraced_batch_adapt(rcv);
+    }
+    rcv->active_buf = (rcv->active_buf + 1) % rcv->num_bufs;
+    htraced_sbuf_resize(rcv, rcv->active_buf);
+    if (htraced_sbufs_used(rcv) > rcv->ctrs.buffers_used_max) {
+        rcv->ctrs.buffers_used_max = htraced_sbufs_used(rcv);
+    }
+    htraced_wake_xmit(rcv);
+    return 1;
+}
 
 /**
- * The number of buffers used by htraced.
+ * Discard the oldest buffered spans which have not been sent, and reuse their
+ * buffer as the active buffer.
+ * This function must be called with the lock held, and only when all of the
+ * buffers are in use.
+ *
+ * @param rcv           The htraced receiver.
  */
-#define HTRACED_NUM_BUFS 2
+static void htraced_sbufs_drop_oldest(struct htraced_rcv *rcv)
+{
+    struct htraced_sbuf *victim;
+    int idx, next;
+
+    idx = (rcv->xmit_head + rcv->num_sent) % rcv->num_bufs;
+    victim = rcv->sbuf[idx];
+    rcv->ctrs.dropped_oldest += victim->num_spans;
+    victim->off = 0;
+    victim->num_spans = 0;
+    // Shift the buffers queued after the victim back by one slot, so that they
+    // are still sent in order, and put the victim in the active slot.
+    while (idx != rcv->active_buf) {
+        next = (idx + 1) % rcv->num_bufs;
+        rcv->sbuf[idx] = rcv->sbuf[next];
+        idx = next;
+    }
+    rcv->sbuf[idx] = victim;
+}
 
 /**
- * An HTraced send buffer.
+ * Count spans which are being dropped because all buffers are full.
+ * This function must be called with the lock held.
  */
-struct htraced_sbuf {
-    /**
-     * Current offset within the buffer.
-     */
-    uint64_t off;
-
-    /**
-     * Length of the buffer.
-     */
-    uint64_t len;
-
-    /**
-     * The number of spans in the buffer.
-     */
-    uint64_t num_spans;
-
-    /**
-     * The buffer data.  This field actually has size 'len,' not size 1.
-     */
-    char buf[1];
-};
+static void htraced_count_dropped(struct htraced_rcv *rcv, uint64_t num_spans)
+{
+    if (rcv->full_policy == HTRACED_FULL_BLOCK) {
+        rcv->ctrs.dropped_timeout += num_spans;
+    } else {
+        rcv->ctrs.dropped_newest += num_spans;
+    }
+}
 
-/*
- * A span receiver that writes spans to htraced.
+/**
+ * Make room for new data which did not fit into the active buffer.
+ * This function must be called with the lock held.  If the overflow policy
+ * is HTRACED_FULL_BLOCK, the lock may be released while waiting.
+ *
+ * @param rcv           The htraced receiver.
+ *
+ * @return              1 if the caller should try again with the active
+ *                          buffer; 0 if it should drop its spans.
  */
-struct htraced_rcv {
-    struct htrace_rcv base;
-
-    /**
-     * Nonzero if the receiver should shut down.
-     */
-    int shutdown;
-
-    /**
-     * The htracer object associated with this receciver.
-     */
-    struct htracer *tracer;
-
-    /**
-     * Buffered span data becomes eligible to be sent even if there isn't much
-     * in the buffer after this timeout elapses.
-     */
-    uint64_t flush_interval_ms;
-
-    /**
-     * The maximum number of bytes we will buffer before waking the sending
-     * thread.  We may sometimes send slightly more than this amount if the
-     * thread takes a while to wake up.
-     */
-    uint64_t send_threshold;
-
-    /**
-     * The HRPC client.
-     */
-    struct hrpc_client *hcli;
-
-    /**
-     * The monotonic-clock time at which we last did a send operation.
-     */
-    uint64_t last_send_ms;
-
-    /**
-     * The index of the active buffer.
-     */
-    int active_buf;
-
-    /**
-     * The two send buffers.
-     */
-    struct htraced_sbuf *sbuf[HTRACED_NUM_BUFS];
-
-    /**
-     * Lock protecting the buffers from concurrent writes.
-     */
-    pthread_mutex_t lock;
-
-    /**
-     * Condition variable used to wake up the background thread.
-     */
-    pthread_cond_t bg_cond;
-
-    /**
-     * Condition variable used to wake up flushing threads.
-     */
-    pthread_cond_t flush_cond;
-
-    /**
-     * Background transmitter thread.
-     */
-    pthread_t xmit_thread;
-};
-
-void* run_htraced_xmit_manager(void *data);
-static int should_xmit(struct htraced_rcv *rcv, uint64_t now);
-static void htraced_xmit(struct htraced_rcv *rcv, uint64_t now);
-
-static int htraced_sbufs_empty(struct htraced_rcv *rcv)
+static int htraced_sbufs_make_room(struct htraced_rcv *rcv)
 {
-    int i;
-    for (i = 0; i < HTRACED_NUM_BUFS; i++) {
-        if (rcv->sbuf[i]->off) {
-            return 0;
+    struct htrace_log *lg = rcv->lg;
+    struct timespec deadline;
+    int ret;
+
+    if (htraced_sbufs_advance(rcv)) {
+        return 1;
+    }
+    htraced_wake_xmit(rcv);
+    switch (rcv->full_policy) {
+    case HTRACED_FULL_DROP_OLDEST:
+        htraced_sbufs_drop_oldest(rcv);
+        return 1;
+    case HTRACED_FULL_BLOCK:
+        rcv->ctrs.blocked++;
+        ms_to_timespec(now_ms(lg) + rcv->block_timeo_ms, &deadline);
+        while (!rcv->shutdown) {
+            ret = pthread_cond_timedwait(&rcv->flush_cond, &rcv->lock,
+                                         &deadline);
+            if (htraced_sbufs_advance(rcv)) {
+                return 1;
+            }
+            if (ret == ETIMEDOUT) {
+                break;
+            } else if (ret) {
+                htrace_log(lg, "htraced_sbufs_make_room: "
+                           "pthread_cond_timedwait error: %d (%s)\n",
+                           ret, terror(ret));
+                break;
+            }
         }
+        return 0;
+    default:
+        return 0;
     }
-    return 1;
 }
 
 static struct htraced_sbuf *htraced_sbuf_alloc(uint64_t len)
@@ -256,19 +527,19 @@ static struct htraced_sbuf *htraced_sbuf_alloc(uint64_t len)
     // The final field of the htraced_sbuf structure is declared as having size
     // 1, but really it has size 'len'.  This avoids a pointer dereference when
     // accessing data in the sbuf.
-    sbuf = malloc(offsetof(struct htraced_sbuf, buf) + len);
+    sbuf = htrace_malloc(offsetof(struct htraced_sbuf, buf) + len);
     if (!sbuf) {
         return NULL;
     }
-    sbuf->off = 0;
+    // The new buffer starts out unsent, with no tries.
+    memset(sbuf, 0, offsetof(struct htraced_sbuf, buf));
     sbuf->len = len;
-    sbuf->num_spans = 0;
     return sbuf;
 }
 
 static void htraced_sbuf_free(struct htraced_sbuf *sbuf)
 {
-    free(sbuf);
+    htrace_free(sbuf);
 }
 
 static uint64_t htraced_sbuf_remaining(const struct htraced_sbuf *sbuf)
@@ -276,400 +547,2820 @@ static uint64_t htraced_sbuf_remaining(const struct htraced_sbuf *sbuf)
     return sbuf->len - sbuf->off;
 }
 
-static uint64_t htraced_get_bounded_u64(struct htrace_log *lg,
-                const struct htrace_conf *cnf, const char *prop,
-                uint64_t min, uint64_t max)
+/**
+ * Determine whether a normal-priority span or batch of spans should be
+ * dropped to keep buffer space for high-priority spans.
+ * This function must be called with the lock held.
+ *
+ * @param rcv           The htraced receiver.
+ * @param len           The number of bytes to be added.
+ *
+ * @return              1 if the data should be dropped.
+ */
+static int htraced_sbufs_reserved(const struct htraced_rcv *rcv, uint64_t len)
 {
-    uint64_t val = htrace_conf_get_u64(lg, cnf, prop);
-    if (val < min) {
-        htrace_log(lg, "htraced_rcv_create: can't set %s to %"PRId64
-                   ".  Using minimum value of %"PRId64 " instead.\n",
-                   prop, val, min);
-        return min;
-    } else if (val > max) {
-        htrace_log(lg, "htraced_rcv_create: can't set %s to %"PRId64
-                   ".  Using maximum value of %"PRId64 " instead.\n",
-                   prop, val, max);
-        return max;
+    const struct htraced_sbuf *sbuf = rcv->sbuf[rcv->active_buf];
+    uint64_t free_bytes;
+
+    if (!rcv->priority_reserve) {
+        return 0;
     }
-    return val;
+    free_bytes = htraced_sbuf_remaining(sbuf) +
+        (rcv->num_bufs - htraced_sbufs_used(rcv)) * sbuf->len;
+    return free_bytes < rcv->priority_reserve + len;
 }
 
-static double htraced_get_bounded_double(struct htrace_log *lg,
-                const struct htrace_conf *cnf, const char *prop,
-                double min, double max)
+/**
+ * Serialize a span into a buffer, if there is enough space.
+ *
+ * @param sbuf          The buffer.
+ * @param span          The span.
+ *
+ * @return              1 if the span was added; 0 if it did not fit.  If the
+ *                          span did not fit, the buffer is unchanged.
+ */
+static int htraced_sbuf_add_span(struct htraced_sbuf *sbuf,
+                                 struct htrace_span *span)
 {
-    double val = htrace_conf_get_double(lg, cnf, prop);
-    if (val < min) {
-        htrace_log(lg, "htraced_rcv_create: can't set %s to %g"
-                   ".  Using minimum value of %g instead.\n",
-                   prop, val, min);
-        return min;
-    } else if (val > max) {
-        htrace_log(lg, "htraced_rcv_create: can't set %s to %g"
-                   ".  Using maximum value of %g instead.\n",
-                   prop, val, max);
-        return max;
+    uint64_t len = span_msgpack_size(span);
+
+    if (len > htraced_sbuf_remaining(sbuf)) {
+        return 0;
     }
-    return val;
+    sbuf->off += span_msgpack_encode(span,
+                                     (uint8_t *)(sbuf->buf + sbuf->off));
+    sbuf->num_spans++;
+    return 1;
 }
 
-static struct htrace_rcv *htraced_rcv_create(struct htracer *tracer,
-                                             const struct htrace_conf *conf)
+/**
+ * Copy the contents of a staging buffer into the active send buffer.
+ * This function must be called with both the receiver lock and the staging
+ * buffer lock held.
+ *
+ * @param rcv           The htraced receiver.
+ * @param tbuf          The staging buffer.
+ *
+ * @return              1 if the staging buffer is now empty; 0 if there was
+ *                          not enough space in the active send buffer.
+ */
+static int htraced_tbuf_drain(struct htraced_rcv *rcv,
+                              struct htraced_tbuf *tbuf)
 {
-    struct htraced_rcv *rcv;
-    const char *endpoint;
-    int i, ret;
-    uint64_t write_timeo_ms, read_timeo_ms, buf_len;
-    double send_fraction;
+    struct htraced_sbuf *sbuf = rcv->sbuf[rcv->active_buf];
+    uint64_t prev_off = sbuf->off;
 
-    endpoint = htrace_conf_get(conf, HTRACED_ADDRESS_KEY);
-    if (!endpoint) {
-        htrace_log(tracer->lg, "htraced_rcv_create: no value found for %s. "
-                   "You must set this configuration key to the "
-                   "hostname:port identifying the htraced server.\n",
-                   HTRACED_ADDRESS_KEY);
-        goto error;
+    if (tbuf->sb.off == 0) {
+        return 1;
     }
-    rcv = calloc(1, sizeof(*rcv));
-    if (!rcv) {
-        htrace_log(tracer->lg, "htraced_rcv_create: OOM while "
-                   "allocating htraced_rcv.\n");
-        goto error;
+    // Staging buffers only hold normal-priority spans.
+    if (htraced_sbufs_reserved(rcv, tbuf->sb.off)) {
+        rcv->ctrs.dropped_low_priority += tbuf->sb.num_spans;
+        tbuf->sb.off = 0;
+        tbuf->sb.num_spans = 0;
+        htraced_wake_xmit(rcv);
+        return 1;
     }
-    rcv->base.ty = &g_htraced_rcv_ty;
-    rcv->shutdown = 0;
-    rcv->tracer = tracer;
+    if (htraced_sbuf_remaining(sbuf) < tbuf->sb.off) {
+        return 0;
+    }
+    memcpy(sbuf->buf + sbuf->off, tbuf->sb.buf, tbuf->sb.off);
+    sbuf->off += tbuf->sb.off;
+    sbuf->num_spans += tbuf->sb.num_spans;
+    rcv->ctrs.buffered += tbuf->sb.num_spans;
+    tbuf->sb.off = 0;
+    tbuf->sb.num_spans = 0;
+    htraced_active_written(rcv, prev_off);
+    return 1;
+}
 
-    rcv->flush_interval_ms = htraced_get_bounded_u64(tracer->lg, conf,
-                HTRACED_FLUSH_INTERVAL_MS_KEY, HTRACED_FLUSH_INTERVAL_MS_MIN,
-                HTRACED_FLUSH_INTERVAL_MS_MAX);
-    write_timeo_ms = htraced_get_bounded_u64(tracer->lg, conf,
+/**
+ * Copy the contents of all staging buffers into the active send buffer.
+ * This function must be called with the receiver lock held.
+ *
+ * @param rcv           The htraced receiver.
+ *
+ * @return              1 if all staging buffers are now empty; 0 otherwise.
+ */
+static int htraced_tbufs_sweep(struct htraced_rcv *rcv)
+{
+    struct htraced_tbuf *tbuf;
+    int drained;
+
+    for (tbuf = rcv->tbufs; tbuf; tbuf = tbuf->next) {
+        pthread_mutex_lock(&tbuf->lock);
+        drained = htraced_tbuf_drain(rcv, tbuf);
+        if (!drained && htraced_sbufs_advance(rcv)) {
+            drained = htraced_tbuf_drain(rcv, tbuf);
+        }
+        pthread_mutex_unlock(&tbuf->lock);
+        if (!drained) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Move the contents of the current thread's staging buffer into the shared
+ * send buffers, making room if needed.
+ * This function must be called with the receiver lock held, and without the
+ * staging buffer lock held.  It may release and re-take the receiver lock.
+ *
+ * @param rcv           The htraced receiver.
+ * @param tbuf          The current thread's staging buffer.
+ *
+ * @return              1 if the staging buffer was drained; 0 if its
+ *                          contents had to be dropped.
+ */
+static int htraced_tbuf_flush(struct htraced_rcv *rcv,
+                              struct htraced_tbuf *tbuf)
+{
+    while (1) {
+        pthread_mutex_lock(&tbuf->lock);
+        if (htraced_tbuf_drain(rcv, tbuf)) {
+            pthread_mutex_unlock(&tbuf->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&tbuf->lock);
+        // We can't hold the staging buffer lock here, since the transmitter
+        // thread may need it to make progress while we wait.  A staging
+        // buffer always fits into an empty send buffer, so however much other
+        // threads on the same CPU add in the meantime, making room lets us
+        // drain it.
+        if (!htraced_sbufs_make_room(rcv)) {
+            break;
+        }
+    }
+    pthread_mutex_lock(&tbuf->lock);
+    htraced_count_dropped(rcv, tbuf->sb.num_spans);
+    tbuf->sb.off = 0;
+    tbuf->sb.num_spans = 0;
+    pthread_mutex_unlock(&tbuf->lock);
+    return 0;
+}
+
+/**
+ * Called when a thread with a staging buffer exits.
+ */
+static void htraced_tbuf_retire(void *data)
+{
+    struct htraced_tbuf *tbuf = data;
+    struct htraced_rcv *rcv = tbuf->rcv;
+
+    pthread_mutex_lock(&rcv->lock);
+    htraced_tbuf_flush(rcv, tbuf);
+    if (tbuf->prev) {
+        tbuf->prev->next = tbuf->next;
+    } else {
+        rcv->tbufs = tbuf->next;
+    }
+    if (tbuf->next) {
+        tbuf->next->prev = tbuf->prev;
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    pthread_mutex_destroy(&tbuf->lock);
+    htrace_free(tbuf);
+}
+
+/**
+ * Allocate an empty staging buffer.  The caller must put it on the list of
+ * staging buffers.
+ *
+ * @param rcv           The htraced receiver.
+ *
+ * @return              The staging buffer, or NULL on error.
+ */
+static struct htraced_tbuf *htraced_tbuf_alloc(struct htraced_rcv *rcv)
+{
+    struct htrace_log *lg = rcv->lg;
+    struct htraced_tbuf *tbuf;
+    int ret;
+
+    tbuf = htrace_malloc(offsetof(struct htraced_tbuf, sb.buf) +
+                         rcv->tbuf_len);
+    if (!tbuf) {
+        htrace_log(lg, "htraced_tbuf_alloc: OOM while allocating a staging "
+                   "buffer of length %" PRId64 ".\n", rcv->tbuf_len);
+        return NULL;
+    }
+    ret = pthread_mutex_init(&tbuf->lock, NULL);
+    if (ret) {
+        htrace_log(lg, "htraced_tbuf_alloc: pthread_mutex_init "
+                   "error %d: %s\n", ret, terror(ret));
+        htrace_free(tbuf);
+        return NULL;
+    }
+    tbuf->rcv = rcv;
+    tbuf->sb.off = 0;
+    tbuf->sb.len = rcv->tbuf_len;
+    tbuf->sb.num_spans = 0;
+    tbuf->prev = NULL;
+    tbuf->next = NULL;
+    return tbuf;
+}
+
+/**
+ * Free all staging buffers.  The transmitter thread must not be running.
+ *
+ * @param rcv           The htraced receiver.
+ */
+static void htraced_tbufs_free(struct htraced_rcv *rcv)
+{
+    struct htraced_tbuf *tbuf;
+
+    while ((tbuf = rcv->tbufs)) {
+        rcv->tbufs = tbuf->next;
+        pthread_mutex_destroy(&tbuf->lock);
+        htrace_free(tbuf);
+    }
+    htrace_free(rcv->cbufs);
+    rcv->cbufs = NULL;
+}
+
+/**
+ * Create the per-CPU staging buffers.
+ *
+ * @param rcv           The htraced receiver.
+ *
+ * @return              1 on success; 0 on error.
+ */
+static int htraced_cbufs_create(struct htraced_rcv *rcv)
+{
+    struct htraced_tbuf *tbuf;
+    long num_cpus = 1;
+    int i;
+
+#ifdef HAVE_SCHED_GETCPU
+    num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (num_cpus < 1) {
+        num_cpus = 1;
+    } else if (num_cpus > HTRACED_MAX_CPU_BUFFERS) {
+        num_cpus = HTRACED_MAX_CPU_BUFFERS;
+    }
+#endif
+    rcv->cbufs = htrace_calloc(num_cpus, sizeof(rcv->cbufs[0]));
+    if (!rcv->cbufs) {
+        htrace_log(rcv->lg, "htraced_cbufs_create: OOM while allocating "
+                   "%ld per-CPU staging buffers.\n", num_cpus);
+        return 0;
+    }
+    rcv->num_cbufs = num_cpus;
+    for (i = 0; i < rcv->num_cbufs; i++) {
+        tbuf = htraced_tbuf_alloc(rcv);
+        if (!tbuf) {
+            htraced_tbufs_free(rcv);
+            return 0;
+        }
+        tbuf->next = rcv->tbufs;
+        if (rcv->tbufs) {
+            rcv->tbufs->prev = tbuf;
+        }
+        rcv->tbufs = tbuf;
+        rcv->cbufs[i] = tbuf;
+    }
+    return 1;
+}
+
+/**
+ * Get the staging buffer for the CPU the current thread is running on.  The
+ * thread may have moved to another CPU by the time it takes the staging
+ * buffer lock, which only costs a little contention.
+ *
+ * @param rcv           The htraced receiver.
+ *
+ * @return              The staging buffer.
+ */
+static struct htraced_tbuf *htraced_cbuf_get(struct htraced_rcv *rcv)
+{
+#ifdef HAVE_SCHED_GETCPU
+    int cpu = sched_getcpu();
+
+    if (cpu >= 0) {
+        return rcv->cbufs[cpu % rcv->num_cbufs];
+    }
+#endif
+    return rcv->cbufs[0];
+}
+
+/**
+ * Get the current thread's staging buffer, creating it if needed.
+ *
+ * @param rcv           The htraced receiver.
+ *
+ * @return              The staging buffer, or NULL on error.
+ */
+static struct htraced_tbuf *htraced_tbuf_get(struct htraced_rcv *rcv)
+{
+    struct htrace_log *lg = rcv->lg;
+    struct htraced_tbuf *tbuf;
+    int ret;
+
+    if (rcv->sharding == HTRACED_SHARD_CPU) {
+        return htraced_cbuf_get(rcv);
+    }
+    tbuf = htrace_tsd_get(&rcv->tbuf_tsd);
+    if (tbuf) {
+        return tbuf;
+    }
+    tbuf = htraced_tbuf_alloc(rcv);
+    if (!tbuf) {
+        return NULL;
+    }
+    ret = htrace_tsd_set(&rcv->tbuf_tsd, tbuf);
+    if (ret) {
+        htrace_log(lg, "htraced_tbuf_get: htrace_tsd_set "
+                   "error %d: %s\n", ret, terror(ret));
+        pthread_mutex_destroy(&tbuf->lock);
+        htrace_free(tbuf);
+        return NULL;
+    }
+    pthread_mutex_lock(&rcv->lock);
+    tbuf->next = rcv->tbufs;
+    if (rcv->tbufs) {
+        rcv->tbufs->prev = tbuf;
+    }
+    rcv->tbufs = tbuf;
+    pthread_mutex_unlock(&rcv->lock);
+    return tbuf;
+}
+
+uint64_t htraced_get_bounded_u64(struct htrace_log *lg,
+                const struct htrace_conf *cnf, const char *prop,
+                uint64_t min, uint64_t max)
+{
+    uint64_t val = htrace_conf_get_u64(lg, cnf, prop);
+    if (val < min) {
+        htrace_log(lg, "htraced_rcv_create: can't set %s to %"PRId64
+                   ".  Using minimum value of %"PRId64 " instead.\n",
+                   prop, val, min);
+        return min;
+    } else if (val > max) {
+        htrace_log(lg, "htraced_rcv_create: can't set %s to %"PRId64
+                   ".  Using maximum value of %"PRId64 " instead.\n",
+                   prop, val, max);
+        return max;
+    }
+    return val;
+}
+
+double htraced_get_bounded_double(struct htrace_log *lg,
+                const struct htrace_conf *cnf, const char *prop,
+                double min, double max)
+{
+    double val = htrace_conf_get_double(lg, cnf, prop);
+    if (val < min) {
+        htrace_log(lg, "htraced_rcv_create: can't set %s to %g"
+                   ".  Using minimum value of %g instead.\n",
+                   prop, val, min);
+        return min;
+    } else if (val > max) {
+        htrace_log(lg, "htraced_rcv_create: can't set %s to %g"
+                   ".  Using maximum value of %g instead.\n",
+                   prop, val, max);
+        return max;
+    }
+    return val;
+}
+
+static const char * const HTRACED_FULL_POLICY_NAMES[] = {
+    "drop-newest",
+    "drop-oldest",
+    "block",
+};
+
+static enum htraced_full_policy htraced_get_full_policy(
+                struct htrace_log *lg, const struct htrace_conf *cnf)
+{
+    const char *val;
+    int i;
+
+    val = htrace_conf_get(cnf, HTRACED_BUFFER_FULL_POLICY_KEY);
+    for (i = 0; i <= HTRACED_FULL_BLOCK; i++) {
+        if (val && !strcmp(val, HTRACED_FULL_POLICY_NAMES[i])) {
+            return i;
+        }
+    }
+    htrace_log(lg, "htraced_rcv_create: unknown value for %s: '%s'.  "
+               "Using %s instead.\n", HTRACED_BUFFER_FULL_POLICY_KEY,
+               (val ? val : "(null)"),
+               HTRACED_FULL_POLICY_NAMES[HTRACED_FULL_DROP_NEWEST]);
+    return HTRACED_FULL_DROP_NEWEST;
+}
+
+static const char * const HTRACED_SHARDING_NAMES[] = {
+    "thread",
+    "cpu",
+};
+
+static enum htraced_sharding htraced_get_sharding(
+                struct htrace_log *lg, const struct htrace_conf *cnf)
+{
+    const char *val;
+    int i;
+
+    val = htrace_conf_get(cnf, HTRACED_THREAD_BUFFER_SHARDING_KEY);
+    for (i = 0; i <= HTRACED_SHARD_CPU; i++) {
+        if (val && !strcmp(val, HTRACED_SHARDING_NAMES[i])) {
+            return i;
+        }
+    }
+    htrace_log(lg, "htraced_rcv_create: unknown value for %s: '%s'.  "
+               "Using %s instead.\n", HTRACED_THREAD_BUFFER_SHARDING_KEY,
+               (val ? val : "(null)"),
+               HTRACED_SHARDING_NAMES[HTRACED_SHARD_THREAD]);
+    return HTRACED_SHARD_THREAD;
+}
+
+static const char * const HTRACED_COMPRESSION_NAMES[] = {
+    "none",
+    "zlib",
+};
+
+static enum htraced_compression htraced_get_compression(
+                struct htrace_log *lg, const struct htrace_conf *cnf)
+{
+    const char *val;
+    int i;
+
+    val = htrace_conf_get(cnf, HTRACED_COMPRESSION_KEY);
+    for (i = 0; i <= HTRACED_COMPRESS_ZLIB; i++) {
+        if (val && !strcmp(val, HTRACED_COMPRESSION_NAMES[i])) {
+#ifndef HAVE_ZLIB
+            if (i == HTRACED_COMPRESS_ZLIB) {
+                htrace_log(lg, "htraced_rcv_create: %s is set to zlib, but "
+                           "libhtrace was built without zlib.  Sending spans "
+                           "uncompressed.\n", HTRACED_COMPRESSION_KEY);
+                return HTRACED_COMPRESS_NONE;
+            }
+#endif
+            return i;
+        }
+    }
+    htrace_log(lg, "htraced_rcv_create: unknown value for %s: '%s'.  "
+               "Using %s instead.\n", HTRACED_COMPRESSION_KEY,
+               (val ? val : "(null)"),
+               HTRACED_COMPRESSION_NAMES[HTRACED_COMPRESS_NONE]);
+    return HTRACED_COMPRESS_NONE;
+}
+
+static const char * const HTRACED_TRANSPORT_NAMES[] = {
+    "stream",
+    "datagram",
+};
+
+static enum htraced_transport htraced_get_transport(
+                struct htrace_log *lg, const struct htrace_conf *cnf)
+{
+    const char *val;
+    int i;
+
+    val = htrace_conf_get(cnf, HTRACED_TRANSPORT_KEY);
+    for (i = 0; i <= HTRACED_TRANSPORT_DATAGRAM; i++) {
+        if (val && !strcmp(val, HTRACED_TRANSPORT_NAMES[i])) {
+            return i;
+        }
+    }
+    htrace_log(lg, "htraced_rcv_create: unknown value for %s: '%s'.  "
+               "Using %s instead.\n", HTRACED_TRANSPORT_KEY,
+               (val ? val : "(null)"),
+               HTRACED_TRANSPORT_NAMES[HTRACED_TRANSPORT_STREAM]);
+    return HTRACED_TRANSPORT_STREAM;
+}
+
+#ifdef HAVE_ZLIB
+/**
+ * Allocate memory for zlib with the library allocator.
+ */
+static voidpf htraced_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    return htrace_calloc(items, size);
+}
+
+static void htraced_zfree(voidpf opaque, voidpf addr)
+{
+    htrace_free(addr);
+}
+#endif
+
+/**
+ * Set up compression, if it is enabled.
+ *
+ * @return      1 on success; 0 on failure.
+ */
+static int htraced_compress_init(struct htraced_rcv *rcv,
+                                 const struct htrace_conf *conf,
+                                 uint64_t buf_len)
+{
+#ifdef HAVE_ZLIB
+    struct htrace_log *lg = rcv->lg;
+    int level, ret;
+
+    if (rcv->compression != HTRACED_COMPRESS_ZLIB) {
+        return 1;
+    }
+    level = htraced_get_bounded_u64(lg, conf, HTRACED_COMPRESSION_LEVEL_KEY,
+                                    Z_BEST_SPEED, Z_BEST_COMPRESSION);
+    rcv->zstrm.zalloc = htraced_zalloc;
+    rcv->zstrm.zfree = htraced_zfree;
+    rcv->zstrm.opaque = Z_NULL;
+    ret = deflateInit(&rcv->zstrm, level);
+    if (ret != Z_OK) {
+        htrace_log(lg, "htraced_rcv_create: deflateInit failed with error "
+                   "%d.\n", ret);
+        return 0;
+    }
+    rcv->zbuf_len = deflateBound(&rcv->zstrm,
+                                 MAX_WRITESPANS_PREQUEL_LEN + buf_len);
+    rcv->zbuf = htrace_malloc(rcv->zbuf_len);
+    if (!rcv->zbuf) {
+        htrace_log(lg, "htraced_rcv_create: OOM while allocating the "
+                   "compression buffer.\n");
+        deflateEnd(&rcv->zstrm);
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+static void htraced_compress_free(struct htraced_rcv *rcv)
+{
+#ifdef HAVE_ZLIB
+    if (rcv->zbuf) {
+        deflateEnd(&rcv->zstrm);
+        htrace_free(rcv->zbuf);
+        rcv->zbuf = NULL;
+    }
+#endif
+}
+
+/**
+ * Compress a WriteSpans request into the scratch buffer.
+ * This is only called by the transmitter thread.
+ *
+ * @return      The length of the compressed request, or 0 if the request
+ *                  should be sent uncompressed.
+ */
+static uint64_t htraced_compress(struct htraced_rcv *rcv,
+                                 const uint8_t *prequel, int prequel_len,
+                                 const char *data, uint64_t len)
+{
+#ifdef HAVE_ZLIB
+    z_stream *strm = &rcv->zstrm;
+    int ret;
+
+    if (!rcv->zbuf) {
+        return 0;
+    }
+    if (deflateReset(strm) != Z_OK) {
+        return 0;
+    }
+    strm->next_out = rcv->zbuf;
+    strm->avail_out = rcv->zbuf_len;
+    strm->next_in = (Bytef*)prequel;
+    strm->avail_in = prequel_len;
+    ret = deflate(strm, Z_NO_FLUSH);
+    if ((ret != Z_OK) || (strm->avail_in != 0)) {
+        return 0;
+    }
+    strm->next_in = (Bytef*)data;
+    strm->avail_in = len;
+    ret = deflate(strm, Z_FINISH);
+    if (ret != Z_STREAM_END) {
+        return 0;
+    }
+    if (strm->total_out >= prequel_len + len) {
+        // Compression didn't help.
+        return 0;
+    }
+    return strm->total_out;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Open the spill queue, if spilling is enabled.
+ *
+ * @return      1 on success; 0 on failure.
+ */
+static int htraced_spill_open(struct htraced_rcv *rcv,
+                              const struct htrace_conf *conf, uint64_t buf_len)
+{
+    struct htrace_log *lg = rcv->lg;
+    const char *dir;
+    uint64_t seg_size, max_size;
+
+    dir = htrace_conf_get(conf, HTRACED_SPILL_DIR_KEY);
+    if ((!dir) || (!dir[0])) {
+        return 1;
+    }
+    // A whole send buffer has to fit into one segment.
+    seg_size = htraced_get_bounded_u64(lg, conf,
+                HTRACED_SPILL_SEGMENT_SIZE_KEY,
+                buf_len + SPILL_RECORD_OVERHEAD + 8, 0x7fffffffffffffffULL);
+    max_size = htraced_get_bounded_u64(lg, conf,
+                HTRACED_SPILL_MAX_SIZE_KEY, seg_size, 0x7fffffffffffffffULL);
+    rcv->spill = spill_log_open(lg, dir, seg_size, max_size);
+    if (!rcv->spill) {
+        return 0;
+    }
+    htrace_log(lg, "htraced_rcv_create: spilling to %s, seg_size=%" PRId64
+               ", max_size=%" PRId64 ".\n", dir, seg_size, max_size);
+    return 1;
+}
+
+int htraced_open_wake_pipe(struct htrace_log *lg, int *fds)
+{
+    int e, i;
+
+    if (pipe(fds) < 0) {
+        e = errno;
+        htrace_log(lg, "htraced_rcv_create: pipe error %d: %s\n",
+                   e, terror(e));
+        return 0;
+    }
+    for (i = 0; i < 2; i++) {
+        if ((fcntl(fds[i], F_SETFD, FD_CLOEXEC) < 0) ||
+                (fcntl(fds[i], F_SETFL, O_NONBLOCK) < 0)) {
+            e = errno;
+            htrace_log(lg, "htraced_rcv_create: fcntl error %d: %s\n",
+                       e, terror(e));
+            close(fds[0]);
+            close(fds[1]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Free the connections to the htraced endpoints.
+ */
+static void htraced_conns_free(struct htraced_rcv *rcv)
+{
+    int i;
+
+    for (i = 0; i < rcv->num_conns; i++) {
+        hrpc_client_free(rcv->conns[i].hcli);
+    }
+    htrace_free(rcv->conns);
+    rcv->conns = NULL;
+    rcv->num_conns = 0;
+}
+
+/**
+ * Set up a connection for each htraced endpoint in rcv->address.  The
+ * endpoints are separated by commas.  The connections are opened lazily.
+ *
+ * @return      1 on success; 0 on failure.
+ */
+static int htraced_conns_alloc(struct htraced_rcv *rcv,
+                               const struct hrpc_client_opts *opts)
+{
+    struct htrace_log *lg = rcv->lg;
+    struct hrpc_client *hcli;
+    char *str, *tok, *saveptr = NULL;
+    const char *c;
+    int num = 1;
+
+    for (c = rcv->address; *c; c++) {
+        if (*c == ',') {
+            num++;
+        }
+    }
+    if (num > HTRACED_MAX_ENDPOINTS) {
+        htrace_log(lg, "htraced_conns_alloc: too many endpoints in %s.  The "
+                   "maximum is %d.\n", rcv->address, HTRACED_MAX_ENDPOINTS);
+        return 0;
+    }
+    rcv->conns = htrace_calloc(num, sizeof(rcv->conns[0]));
+    str = htrace_strdup(rcv->address);
+    if (!rcv->conns || !str) {
+        htrace_log(lg, "htraced_conns_alloc: OOM.\n");
+        goto error;
+    }
+    for (tok = strtok_r(str, ", ", &saveptr); tok;
+             tok = strtok_r(NULL, ", ", &saveptr)) {
+        hcli = hrpc_client_alloc(lg, opts, tok);
+        if (!hcli) {
+            goto error;
+        }
+        rcv->conns[rcv->num_conns++].hcli = hcli;
+    }
+    if (rcv->num_conns == 0) {
+        htrace_log(lg, "htraced_conns_alloc: no endpoints found in %s.\n",
+                   rcv->address);
+        goto error;
+    }
+    htrace_free(str);
+    return 1;
+
+error:
+    htraced_conns_free(rcv);
+    htrace_free(str);
+    return 0;
+}
+
+/**
+ * Tell the resolver thread to exit, and wait for it.
+ */
+void htraced_stop_resolver(struct htraced_rcv *rcv)
+{
+    int ret;
+
+    pthread_mutex_lock(&rcv->lock);
+    rcv->shutdown = 1;
+    pthread_cond_signal(&rcv->resolve_cond);
+    pthread_mutex_unlock(&rcv->lock);
+    ret = pthread_join(rcv->resolve_thread, NULL);
+    if (ret) {
+        htrace_log(rcv->lg, "htraced_stop_resolver: pthread_join "
+                   "error %d: %s\n", ret, terror(ret));
+    }
+}
+
+void htraced_stop_serializer(struct htraced_rcv *rcv)
+{
+    int ret;
+
+    pthread_mutex_lock(&rcv->aq_lock);
+    rcv->aq_shutdown = 1;
+    pthread_cond_signal(&rcv->aq_cond);
+    pthread_mutex_unlock(&rcv->aq_lock);
+    ret = pthread_join(rcv->aq_thread, NULL);
+    if (ret) {
+        htrace_log(rcv->lg, "htraced_stop_serializer: pthread_join "
+                   "error %d: %s\n", ret, terror(ret));
+    }
+    pthread_cond_destroy(&rcv->aq_cond);
+    pthread_mutex_destroy(&rcv->aq_lock);
+}
+
+/**
+ * Create an htraced receiver.
+ *
+ * @param lg            The log to use.  Must outlive the receiver.
+ * @param trid          The default tracer id.  Must outlive the receiver.
+ * @param rnd           The random source.  Must outlive the receiver.
+ * @param conf          The configuration.
+ * @param buf_max       If nonzero, the most bytes the send buffers may use
+ *                          in total.
+ *
+ * @return              The receiver, or NULL on error.
+ */
+static struct htraced_rcv *htraced_rcv_alloc(struct htrace_log *lg,
+                const char *trid, struct random_src *rnd,
+                const struct htrace_conf *conf, uint64_t buf_max)
+{
+    struct htraced_rcv *rcv;
+    const char *endpoint;
+    int i, ret;
+    uint64_t buf_len;
+    double send_fraction;
+    struct hrpc_client_opts opts;
+
+    endpoint = htrace_conf_get(conf, HTRACED_ADDRESS_KEY);
+    if (!endpoint) {
+        htrace_log(lg, "htraced_rcv_create: no value found for %s. "
+                   "You must set this configuration key to the "
+                   "hostname:port identifying the htraced server, or a "
+                   "comma-separated list of them.\n",
+                   HTRACED_ADDRESS_KEY);
+        goto error;
+    }
+    rcv = htrace_calloc(1, sizeof(*rcv));
+    if (!rcv) {
+        htrace_log(lg, "htraced_rcv_create: OOM while "
+                   "allocating htraced_rcv.\n");
+        goto error;
+    }
+    rcv->base.ty = &g_htraced_rcv_ty;
+    rcv->shutdown = 0;
+    rcv->lg = lg;
+    rcv->trid = trid;
+    rcv->rnd = rnd;
+
+    rcv->flush_interval_ms = htraced_get_bounded_u64(lg, conf,
+                HTRACED_FLUSH_INTERVAL_MS_KEY, HTRACED_FLUSH_INTERVAL_MS_MIN,
+                HTRACED_FLUSH_INTERVAL_MS_MAX);
+    memset(&opts, 0, sizeof(opts));
+    opts.write_timeo_ms = htraced_get_bounded_u64(lg, conf,
                 HTRACED_WRITE_TIMEO_MS_KEY, HTRACED_WRITE_TIMEO_MS_MIN,
                 0x7fffffffffffffffULL);
-    read_timeo_ms = htraced_get_bounded_u64(tracer->lg, conf,
+    opts.read_timeo_ms = htraced_get_bounded_u64(lg, conf,
                 HTRACED_READ_TIMEO_MS_KEY, HTRACED_READ_TIMEO_MS_MIN,
                 0x7fffffffffffffffULL);
-    rcv->hcli = hrpc_client_alloc(tracer->lg, write_timeo_ms,
-                                  read_timeo_ms, endpoint);
-    if (!rcv->hcli) {
+    rcv->read_timeo_ms = opts.read_timeo_ms;
+    rcv->shutdown_timeo_ms = htrace_conf_get_u64(lg, conf,
+                HTRACED_SHUTDOWN_TIMEO_MS_KEY);
+    opts.tcp_nodelay = htrace_conf_get_bool(lg, conf,
+                HTRACED_TCP_NODELAY_KEY);
+    opts.tcp_sndbuf = htraced_get_bounded_u64(lg, conf,
+                HTRACED_TCP_SNDBUF_KEY, 0, HTRACED_TCP_SNDBUF_MAX);
+    opts.tcp_keepalive_ms = htrace_conf_get_u64(lg, conf,
+                HTRACED_TCP_KEEPALIVE_MS_KEY);
+    if (opts.tcp_keepalive_ms) {
+        opts.tcp_keepalive_ms = htraced_get_bounded_u64(lg, conf,
+                    HTRACED_TCP_KEEPALIVE_MS_KEY, HTRACED_TCP_KEEPALIVE_MS_MIN,
+                    HTRACED_TCP_KEEPALIVE_MS_MAX);
+    }
+    opts.dns_cache_ms = htrace_conf_get_u64(lg, conf,
+                HTRACED_DNS_CACHE_MS_KEY);
+    if (opts.dns_cache_ms) {
+        opts.dns_cache_ms = htraced_get_bounded_u64(lg, conf,
+                    HTRACED_DNS_CACHE_MS_KEY, HTRACED_DNS_CACHE_MS_MIN,
+                    HTRACED_DNS_CACHE_MS_MAX);
+    }
+    rcv->dns_cache_ms = opts.dns_cache_ms;
+    opts.io_uring = htrace_conf_get_bool(lg, conf,
+                HTRACED_IO_URING_KEY);
+#ifndef HAVE_IO_URING
+    if (opts.io_uring) {
+        htrace_log(lg, "htraced_rcv_create: %s is set, but libhtrace "
+                   "was built without io_uring.  Sending with writev.\n",
+                   HTRACED_IO_URING_KEY);
+        opts.io_uring = 0;
+    }
+#endif
+    rcv->transport = htraced_get_transport(lg, conf);
+    if (rcv->transport == HTRACED_TRANSPORT_DATAGRAM) {
+        opts.datagram = 1;
+        rcv->dgram_size = htraced_get_bounded_u64(lg, conf,
+                    HTRACED_DATAGRAM_SIZE_KEY, HTRACED_DATAGRAM_SIZE_MIN,
+                    HTRACED_DATAGRAM_SIZE_MAX);
+    }
+    rcv->address = htrace_strdup(endpoint);
+    if (!rcv->address) {
+        htrace_log(lg, "htraced_rcv_create: OOM while "
+                   "copying the htraced address.\n");
         goto error_free_rcv;
     }
-    buf_len = htraced_get_bounded_u64(tracer->lg, conf,
-                HTRACED_BUFFER_SIZE_KEY, HTRACED_MIN_BUFFER_SIZE,
-                HTRACED_MAX_BUFFER_SIZE) / 2;
-    for (i = 0; i < HTRACED_NUM_BUFS; i++) {
-        rcv->sbuf[i] = htraced_sbuf_alloc(buf_len);
-        if (!rcv->sbuf[i]) {
-            htrace_log(tracer->lg, "htraced_rcv_create: htraced_sbuf_alloc("
-                       "buf_len=%"PRId64") failed: OOM.\n", buf_len);
-            goto error_free_bufs;
+    if (!htraced_conns_alloc(rcv, &opts)) {
+        goto error_free_address;
+    }
+    rcv->max_tries = HTRACED_MAX_SEND_TRIES + rcv->num_conns - 1;
+    rcv->retry_min_ms = htraced_get_bounded_u64(lg, conf,
+                HTRACED_RETRY_BACKOFF_MIN_MS_KEY, 1,
+                HTRACED_RETRY_BACKOFF_MS_MAX);
+    rcv->retry_max_ms = htraced_get_bounded_u64(lg, conf,
+                HTRACED_RETRY_BACKOFF_MAX_MS_KEY, rcv->retry_min_ms,
+                HTRACED_RETRY_BACKOFF_MS_MAX);
+    rcv->num_bufs = htraced_get_bounded_u64(lg, conf,
+                HTRACED_BUFFER_COUNT_KEY, HTRACED_MIN_BUFFER_COUNT,
+                HTRACED_MAX_BUFFER_COUNT);
+    rcv->full_policy = htraced_get_full_policy(lg, conf);
+    rcv->inflight_window = htraced_get_bounded_u64(lg, conf,
+                HTRACED_INFLIGHT_WINDOW_KEY, 1, HTRACED_MAX_BUFFER_COUNT);
+    rcv->block_timeo_ms = htraced_get_bounded_u64(lg, conf,
+                HTRACED_BUFFER_FULL_BLOCK_TIMEO_MS_KEY, 0,
+                HTRACED_BLOCK_TIMEO_MS_MAX);
+    buf_len = htraced_get_bounded_u64(lg, conf,
+                HTRACED_BUFFER_SIZE_KEY, HTRACED_MIN_BUFFER_SIZE,
+                HTRACED_MAX_BUFFER_SIZE);
+    if (buf_max && (buf_len > buf_max)) {
+        if (buf_max < HTRACED_MIN_BUFFER_SIZE) {
+            buf_max = HTRACED_MIN_BUFFER_SIZE;
+        }
+        htrace_log(lg, "htraced_rcv_create: not enough of %s is left for "
+                   "%" PRId64 " bytes of send buffers.  Using %" PRId64
+                   " bytes instead.\n", HTRACED_SHARED_MEMORY_MAX_KEY,
+                   buf_len, buf_max);
+        buf_len = buf_max;
+    }
+    rcv->buf_total = buf_len;
+    buf_len /= rcv->num_bufs;
+    rcv->buf_len = buf_len;
+    rcv->buf_cap = buf_len;
+    rcv->rpc_max_len = htraced_get_bounded_u64(lg, conf,
+                HTRACED_RPC_MAX_SIZE_KEY, HTRACED_RPC_MAX_SIZE_MIN,
+                MAX_HRPC_LEN) - MAX_WRITESPANS_PREQUEL_LEN;
+    rcv->sbuf = htrace_calloc(rcv->num_bufs, sizeof(rcv->sbuf[0]));
+    if (!rcv->sbuf) {
+        htrace_log(lg, "htraced_rcv_create: OOM while "
+                   "allocating the buffer ring.\n");
+        goto error_free_conns;
+    }
+    for (i = 0; i < rcv->num_bufs; i++) {
+        rcv->sbuf[i] = htraced_sbuf_alloc(buf_len);
+        if (!rcv->sbuf[i]) {
+            htrace_log(lg, "htraced_rcv_create: htraced_sbuf_alloc("
+                       "buf_len=%"PRId64") failed: OOM.\n", buf_len);
+            goto error_free_bufs;
+        }
+    }
+    rcv->priority_reserve = rcv->buf_total * htraced_get_bounded_double(lg,
+                conf, HTRACED_BUFFER_PRIORITY_RESERVE_KEY, 0.0, 0.9);
+    send_fraction = htraced_get_bounded_double(lg, conf,
+                HTRACED_BUFFER_SEND_TRIGGER_FRACTION, 0.1, 1.0);
+    rcv->send_threshold = buf_len * send_fraction;
+    if (rcv->send_threshold > buf_len) {
+        rcv->send_threshold = buf_len;
+    }
+    rcv->max_send_threshold = rcv->send_threshold;
+    rcv->batch_max_latency_ms = htrace_conf_get_u64(lg, conf,
+                                        HTRACED_BATCH_MAX_LATENCY_MS_KEY);
+    if (rcv->batch_max_latency_ms) {
+        rcv->batch_max_latency_ms = htraced_get_bounded_u64(lg, conf,
+                    HTRACED_BATCH_MAX_LATENCY_MS_KEY,
+                    HTRACED_BATCH_MAX_LATENCY_MS_MIN,
+                    HTRACED_FLUSH_INTERVAL_MS_MAX);
+        htraced_batch_adapt(rcv);
+    }
+    rcv->compression = htraced_get_compression(lg, conf);
+    if (rcv->transport == HTRACED_TRANSPORT_DATAGRAM) {
+        // Datagrams are too small to be worth compressing, and nothing comes
+        // back to tell us that a batch needs to be spilled.
+        if (rcv->compression != HTRACED_COMPRESS_NONE) {
+            htrace_log(lg, "htraced_rcv_create: %s is not supported "
+                       "with the datagram transport.  Sending spans "
+                       "uncompressed.\n", HTRACED_COMPRESSION_KEY);
+            rcv->compression = HTRACED_COMPRESS_NONE;
+        }
+        if (htrace_conf_get(conf, HTRACED_SPILL_DIR_KEY) &&
+                htrace_conf_get(conf, HTRACED_SPILL_DIR_KEY)[0]) {
+            htrace_log(lg, "htraced_rcv_create: %s is not supported "
+                       "with the datagram transport.  Not spilling.\n",
+                       HTRACED_SPILL_DIR_KEY);
+        }
+    }
+    // We only ever compress one request at a time.
+    if (!htraced_compress_init(rcv, conf, (buf_len < rcv->rpc_max_len) ?
+                                buf_len : rcv->rpc_max_len)) {
+        goto error_free_bufs;
+    }
+    if (htrace_conf_get_bool(lg, conf, HTRACED_DICTIONARY_KEY)) {
+        if (rcv->transport == HTRACED_TRANSPORT_DATAGRAM) {
+            htrace_log(lg, "htraced_rcv_create: %s is not supported with "
+                       "the datagram transport.\n", HTRACED_DICTIONARY_KEY);
+        } else {
+            rcv->dbuf_len = MAX_WRITESPANS_PREQUEL_LEN +
+                ((buf_len < rcv->rpc_max_len) ? buf_len : rcv->rpc_max_len);
+            rcv->dbuf = htrace_malloc(rcv->dbuf_len);
+            if (!rcv->dbuf) {
+                htrace_log(lg, "htraced_rcv_create: OOM while allocating "
+                           "the dictionary encoding buffer.\n");
+                goto error_free_compress;
+            }
+        }
+    }
+    if (htrace_conf_get_bool(lg, conf, HTRACED_GROUP_BY_TRACE_KEY)) {
+        rcv->gbuf_len = buf_len;
+        rcv->gbuf = htrace_malloc(rcv->gbuf_len);
+        if (!rcv->gbuf) {
+            htrace_log(lg, "htraced_rcv_create: OOM while allocating "
+                       "the trace grouping buffer.\n");
+            goto error_free_compress;
+        }
+    }
+    if ((rcv->transport != HTRACED_TRANSPORT_DATAGRAM) &&
+            (!htraced_spill_open(rcv, conf, buf_len))) {
+        goto error_free_compress;
+    }
+    rcv->last_send_ms = monotonic_now_ms(lg);
+    rcv->self_stats = htrace_conf_get_bool(lg, conf, HTRACE_SELF_STATS_KEY);
+    rcv->tbuf_len = htrace_conf_get_u64(lg, conf,
+                                        HTRACED_THREAD_BUFFER_SIZE_KEY);
+    if (rcv->tbuf_len) {
+        rcv->tbuf_len = htraced_get_bounded_u64(lg, conf,
+                    HTRACED_THREAD_BUFFER_SIZE_KEY,
+                    HTRACED_MIN_THREAD_BUFFER_SIZE,
+                    buf_len / HTRACED_MAX_THREAD_BUFFER_DIVISOR);
+        rcv->sharding = htraced_get_sharding(lg, conf);
+        if (rcv->sharding == HTRACED_SHARD_CPU) {
+            if (!htraced_cbufs_create(rcv)) {
+                goto error_free_spill;
+            }
+        } else {
+            ret = htrace_tsd_init(&rcv->tbuf_tsd, htraced_tbuf_retire);
+            if (ret) {
+                htrace_log(lg, "htraced_rcv_create: htrace_tsd_init "
+                           "error %d: %s\n", ret, terror(ret));
+                goto error_free_spill;
+            }
+        }
+    }
+    ret = pthread_mutex_init(&rcv->lock, NULL);
+    if (ret) {
+        htrace_log(lg, "htraced_rcv_create: pthread_mutex_init "
+                   "error %d: %s\n", ret, terror(ret));
+        goto error_free_key;
+    }
+    ret = pthread_cond_init(&rcv->bg_cond, NULL);
+    if (ret) {
+        htrace_log(lg, "htraced_rcv_create: pthread_cond_init("
+                   "bg_cond) error %d: %s\n", ret, terror(ret));
+        goto error_free_lock;
+    }
+    ret = pthread_cond_init(&rcv->flush_cond, NULL);
+    if (ret) {
+        htrace_log(lg, "htraced_rcv_create: pthread_cond_init("
+                   "flush_cond) error %d: %s\n", ret, terror(ret));
+        goto error_free_bg_cond;
+    }
+    ret = pthread_cond_init(&rcv->resolve_cond, NULL);
+    if (ret) {
+        htrace_log(lg, "htraced_rcv_create: pthread_cond_init("
+                   "resolve_cond) error %d: %s\n", ret, terror(ret));
+        goto error_free_flush_cond;
+    }
+    if (!htraced_open_wake_pipe(lg, rcv->wake_fd)) {
+        goto error_free_resolve_cond;
+    }
+    if (rcv->dns_cache_ms) {
+        ret = pthread_create(&rcv->resolve_thread, NULL,
+                             run_htraced_resolver, rcv);
+        if (ret) {
+            htrace_log(lg, "htraced_rcv_create: failed to create "
+                       "resolver thread: error %d: %s\n", ret, terror(ret));
+            goto error_close_pipe;
+        }
+    }
+    rcv->async = htrace_conf_get_bool(lg, conf,
+                                      HTRACED_ASYNC_SERIALIZE_KEY);
+    if (rcv->async) {
+        rcv->aq_max = htraced_get_bounded_u64(lg, conf,
+                    HTRACED_ASYNC_QUEUE_MAX_KEY, 1, UINT32_MAX);
+        ret = pthread_mutex_init(&rcv->aq_lock, NULL);
+        if (ret) {
+            htrace_log(lg, "htraced_rcv_create: pthread_mutex_init("
+                       "aq_lock) error %d: %s\n", ret, terror(ret));
+            goto error_stop_resolver;
+        }
+        ret = pthread_cond_init(&rcv->aq_cond, NULL);
+        if (ret) {
+            htrace_log(lg, "htraced_rcv_create: pthread_cond_init("
+                       "aq_cond) error %d: %s\n", ret, terror(ret));
+            pthread_mutex_destroy(&rcv->aq_lock);
+            goto error_stop_resolver;
+        }
+        ret = pthread_create(&rcv->aq_thread, NULL,
+                             run_htraced_serializer, rcv);
+        if (ret) {
+            htrace_log(lg, "htraced_rcv_create: failed to create "
+                       "serializer thread: error %d: %s\n", ret, terror(ret));
+            pthread_cond_destroy(&rcv->aq_cond);
+            pthread_mutex_destroy(&rcv->aq_lock);
+            goto error_stop_resolver;
+        }
+    }
+    ret = pthread_create(&rcv->xmit_thread, NULL, run_htraced_xmit_manager, rcv);
+    if (ret) {
+        htrace_log(lg, "htraced_rcv_create: failed to create xmit thread: "
+                   "error %d: %s\n", ret, terror(ret));
+        goto error_stop_serializer;
+    }
+    pthread_mutex_init(&rcv->fork_lock, NULL);
+    rcv->fork_hook.prepare = htraced_fork_prepare;
+    rcv->fork_hook.parent = htraced_fork_parent;
+    rcv->fork_hook.child = htraced_fork_child;
+    rcv->fork_hook.data = rcv;
+    htrace_fork_hook_register(&rcv->fork_hook);
+    htrace_log(lg, "Initialized htraced receiver for %s"
+                ", num_conns=%d, retry_min_ms=%" PRId64
+                ", retry_max_ms=%" PRId64
+                ", flush_interval_ms=%" PRId64 ", send_threshold=%" PRId64
+                ", write_timeo_ms=%" PRId64 ", read_timeo_ms=%" PRId64
+                ", shutdown_timeo_ms=%" PRId64
+                ", buf_len=%" PRId64 ", num_bufs=%d, full_policy=%s"
+                ", priority_reserve=%" PRId64
+                ", inflight_window=%d, tbuf_len=%" PRId64
+                ", tbuf_sharding=%s"
+                ", async=%d, aq_max=%" PRId64
+                ", compression=%s, spill=%s, batch_max_latency_ms=%" PRId64
+                ", tcp_nodelay=%d, tcp_sndbuf=%d, tcp_keepalive_ms=%" PRId64
+                ", dns_cache_ms=%" PRId64 ", transport=%s"
+                ", dgram_size=%" PRId64 ", io_uring=%d"
+                ", rpc_max_len=%" PRId64 ", dictionary=%d"
+                ", group_by_trace=%d.\n",
+                rcv->address, rcv->num_conns, rcv->retry_min_ms,
+                rcv->retry_max_ms,
+                rcv->flush_interval_ms, rcv->send_threshold,
+                opts.write_timeo_ms, opts.read_timeo_ms,
+                rcv->shutdown_timeo_ms, buf_len,
+                rcv->num_bufs,
+                HTRACED_FULL_POLICY_NAMES[rcv->full_policy],
+                rcv->priority_reserve,
+                rcv->inflight_window, rcv->tbuf_len,
+                HTRACED_SHARDING_NAMES[rcv->sharding],
+                rcv->async, rcv->aq_max,
+                HTRACED_COMPRESSION_NAMES[rcv->compression],
+                (rcv->spill ? "on" : "off"), rcv->batch_max_latency_ms,
+                opts.tcp_nodelay, opts.tcp_sndbuf, opts.tcp_keepalive_ms,
+                opts.dns_cache_ms, HTRACED_TRANSPORT_NAMES[rcv->transport],
+                rcv->dgram_size, opts.io_uring, rcv->rpc_max_len,
+                (rcv->dbuf != NULL), (rcv->gbuf != NULL));
+    return rcv;
+
+error_stop_serializer:
+    if (rcv->async) {
+        htraced_stop_serializer(rcv);
+    }
+error_stop_resolver:
+    if (rcv->dns_cache_ms) {
+        htraced_stop_resolver(rcv);
+    }
+error_close_pipe:
+    close(rcv->wake_fd[0]);
+    close(rcv->wake_fd[1]);
+error_free_resolve_cond:
+    pthread_cond_destroy(&rcv->resolve_cond);
+error_free_flush_cond:
+    pthread_cond_destroy(&rcv->flush_cond);
+error_free_bg_cond:
+    pthread_cond_destroy(&rcv->bg_cond);
+error_free_lock:
+    pthread_mutex_destroy(&rcv->lock);
+error_free_key:
+    if (rcv->cbufs) {
+        htraced_tbufs_free(rcv);
+    } else if (rcv->tbuf_len) {
+        htrace_tsd_destroy(&rcv->tbuf_tsd);
+    }
+error_free_spill:
+    spill_log_close(rcv->spill);
+error_free_compress:
+    htrace_free(rcv->gbuf);
+    htrace_free(rcv->dbuf);
+    htraced_compress_free(rcv);
+error_free_bufs:
+    for (i = 0; i < rcv->num_bufs; i++) {
+        htraced_sbuf_free(rcv->sbuf[i]);
+    }
+    htrace_free(rcv->sbuf);
+error_free_conns:
+    htraced_conns_free(rcv);
+error_free_address:
+    htrace_free(rcv->address);
+error_free_rcv:
+    htrace_free(rcv);
+error:
+    return NULL;
+}
+
+/**
+ * Start the shutdown timeout.
+ * This function must be called with the lock held.
+ */
+static void htraced_shutdown_begin(struct htraced_rcv *rcv, uint64_t now)
+{
+    int i;
+
+    rcv->shutdown_deadline_ms = now + rcv->shutdown_timeo_ms;
+    for (i = 0; i < rcv->num_conns; i++) {
+        hrpc_client_set_deadline(rcv->conns[i].hcli,
+                                 rcv->shutdown_deadline_ms);
+    }
+    // Nothing new is coming, so send every buffer at once, along with a
+    // spilled batch.
+    rcv->inflight_window = rcv->num_bufs + 1;
+}
+
+/**
+ * Give up on whatever is still buffered when the shutdown timeout expires.
+ * Spilled spans are counted when the receiver is freed.
+ * This function must be called with the lock held.
+ */
+static void htraced_shutdown_expired(struct htraced_rcv *rcv)
+{
+    struct htraced_sbuf *sbuf;
+    uint64_t num_spans = 0;
+    int i;
+
+    htraced_tbufs_sweep(rcv);
+    for (i = 0; i < rcv->num_bufs; i++) {
+        sbuf = rcv->sbuf[i];
+        if (sbuf->state != HTRACED_SBUF_DONE) {
+            num_spans += sbuf->num_spans;
+        }
+    }
+    for (i = 0; i < rcv->num_conns; i++) {
+        if (rcv->conns[i].num_inflight > 0) {
+            hrpc_client_close(rcv->conns[i].hcli);
+        }
+    }
+    rcv->ctrs.dropped_xmit += num_spans;
+    htrace_log(rcv->lg, "run_htraced_xmit_manager: the shutdown timeout of "
+               "%" PRId64 " ms expired.  Dropping %" PRId64 " unsent "
+               "spans.\n", rcv->shutdown_timeo_ms, num_spans);
+}
+
+void* run_htraced_xmit_manager(void *data)
+{
+    struct htraced_rcv *rcv = data;
+    struct htrace_log *lg = rcv->lg;
+    struct htraced_sbuf *sbuf;
+    uint64_t now, wakeup;
+    struct timespec wakeup_ts;
+    int ret;
+
+    pthread_mutex_lock(&rcv->lock);
+    while (1) {
+        now = monotonic_now_ms(lg);
+        if (rcv->shutdown && rcv->shutdown_timeo_ms) {
+            if (!rcv->shutdown_deadline_ms) {
+                htraced_shutdown_begin(rcv, now);
+            } else if (now >= rcv->shutdown_deadline_ms) {
+                htraced_shutdown_expired(rcv);
+                break;
+            }
+        }
+        htraced_tbufs_sweep(rcv);
+        if (rcv->spill) {
+            htraced_spill_sbufs(rcv, now);
+        }
+        while ((sbuf = htraced_next_to_send(rcv, now))) {
+            htraced_xmit_send(rcv, sbuf, now);
+            htraced_tbufs_sweep(rcv);
+        }
+        htraced_unspill_send(rcv, now);
+        if (rcv->num_inflight > 0) {
+            htraced_xmit_wait(rcv, now);
+            continue;
+        }
+        if (rcv->spill && htraced_sbufs_spilling(rcv)) {
+            continue;
+        }
+        if (rcv->shutdown) {
+            // Try to send whatever was spilled, unless htraced looks down.
+            if (htraced_tbufs_sweep(rcv) && htraced_sbufs_empty(rcv) &&
+                    ((!rcv->spill) || (spill_log_count(rcv->spill) == 0) ||
+                     (!htraced_have_usable_conn(rcv, now)))) {
+                break;
+            }
+            continue;
+        }
+        // Wait for one of a few things to happen:
+        // * Shutdown
+        // * The wakeup timer to elapse, leading us to check if we should send
+        //      because of send_timeo_ms.
+        // * A writer to signal that we should wake up because enough bytes are
+        //      buffered.
+        // Note that pthread_cond_timedwait uses the realtime clock.
+        wakeup = now_ms(lg) + htraced_idle_wait_ms(rcv, now);
+        ms_to_timespec(wakeup, &wakeup_ts);
+        ret = pthread_cond_timedwait(&rcv->bg_cond, &rcv->lock, &wakeup_ts);
+        if ((ret != 0) && (ret != ETIMEDOUT)) {
+            htrace_log(lg, "run_htraced_xmit_manager: pthread_cond_timedwait "
+                       "error: %d (%s)\n", ret, terror(ret));
+        }
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    htrace_log(lg, "run_htraced_xmit_manager: shutting down the transmission "
+               "manager thread.\n");
+    return NULL;
+}
+
+/**
+ * Look up the addresses of the htraced endpoints in the background, whenever
+ * they go stale.  This keeps the transmitter thread from waiting for DNS
+ * when it reconnects.
+ */
+void *run_htraced_resolver(void *data)
+{
+    struct htraced_rcv *rcv = data;
+    struct htrace_log *lg = rcv->lg;
+    struct hrpc_client *hcli;
+    uint64_t due, wait_ms;
+    struct timespec wakeup_ts;
+    int i, ret;
+
+    pthread_mutex_lock(&rcv->lock);
+    while (!rcv->shutdown) {
+        rcv->resolve_wake = 0;
+        // Don't hold the lock while looking up addresses, since that can
+        // take a long time.
+        pthread_mutex_unlock(&rcv->lock);
+        wait_ms = rcv->dns_cache_ms;
+        for (i = 0; i < rcv->num_conns; i++) {
+            hcli = rcv->conns[i].hcli;
+            due = hrpc_client_resolve_due_ms(hcli, monotonic_now_ms(lg));
+            if (due == 0) {
+                hrpc_client_resolve(hcli);
+                due = hrpc_client_resolve_due_ms(hcli, monotonic_now_ms(lg));
+            }
+            if (due < wait_ms) {
+                wait_ms = due;
+            }
+        }
+        pthread_mutex_lock(&rcv->lock);
+        if (rcv->shutdown || rcv->resolve_wake) {
+            continue;
+        }
+        // Note that pthread_cond_timedwait uses the realtime clock.
+        ms_to_timespec(now_ms(lg) + wait_ms, &wakeup_ts);
+        ret = pthread_cond_timedwait(&rcv->resolve_cond, &rcv->lock,
+                                     &wakeup_ts);
+        if ((ret != 0) && (ret != ETIMEDOUT)) {
+            htrace_log(lg, "run_htraced_resolver: pthread_cond_timedwait "
+                       "error: %d (%s)\n", ret, terror(ret));
+        }
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    return NULL;
+}
+
+/**
+ * Determine whether any buffer is waiting to be spilled.
+ * This function must be called with the lock held.
+ */
+static int htraced_sbufs_spilling(const struct htraced_rcv *rcv)
+{
+    int i;
+
+    for (i = 0; i < rcv->num_sent; i++) {
+        if (rcv->sbuf[(rcv->xmit_head + i) % rcv->num_bufs]->state ==
+                HTRACED_SBUF_SPILL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Determine how long it will be until the batch deadline of the active
+ * buffer.
+ * This function must be called with the lock held.
+ *
+ * @return      The number of milliseconds, or UINT64_MAX if there is no
+ *                  batch deadline.
+ */
+static uint64_t htraced_next_batch_ms(const struct htraced_rcv *rcv,
+                                      uint64_t now)
+{
+    uint64_t due;
+
+    if ((!rcv->batch_max_latency_ms) ||
+            (rcv->sbuf[rcv->active_buf]->off == 0)) {
+        return UINT64_MAX;
+    }
+    due = rcv->active_start_ms + rcv->batch_deadline_ms;
+    return (due > now) ? (due - now) : 0;
+}
+
+/**
+ * Determine how long the transmitter thread can sleep for when there is
+ * nothing to send.  We wake up again when a backoff period is over, since
+ * there may be buffers or spilled batches waiting for it, and when the
+ * active buffer reaches its batch deadline.
+ * This function must be called with the lock held.
+ */
+static uint64_t htraced_idle_wait_ms(const struct htraced_rcv *rcv,
+                                     uint64_t now)
+{
+    uint64_t wait_ms = rcv->flush_interval_ms / 2, next_ms;
+
+    next_ms = htraced_next_retry_ms(rcv, now);
+    if (next_ms < wait_ms) {
+        wait_ms = next_ms;
+    }
+    next_ms = htraced_next_batch_ms(rcv, now);
+    if (next_ms < wait_ms) {
+        wait_ms = next_ms;
+    }
+    return wait_ms;
+}
+
+/**
+ * Determine if the xmit manager should send the active buffer.
+ * This function must be called with the lock held.
+ *
+ * @param rcv           The htraced receiver.
+ * @param now           The current time in milliseconds.
+ *
+ * @return              nonzero if we should send now.
+ */
+static int should_xmit(struct htraced_rcv *rcv, uint64_t now)
+{
+    uint64_t off = rcv->sbuf[rcv->active_buf]->off;
+
+    if (off > rcv->send_threshold) {
+        // We have buffered a lot of bytes, so let's send.
+        return 1;
+    }
+    if (off > 0) {
+        if (rcv->shutdown) {
+            // We are shutting down, so send everything.
+            return 1;
+        }
+        if (now - rcv->last_send_ms > rcv->flush_interval_ms) {
+            // It's been too long since the last transmission, so let's send.
+            return 1;
+        }
+        if (rcv->batch_max_latency_ms &&
+                (now - rcv->active_start_ms >= rcv->batch_deadline_ms)) {
+            // The oldest span has waited as long as it can.
+            return 1;
+        }
+    }
+    return 0; // Let's wait.
+}
+
+/**
+ * Pick the next buffer to send.
+ * This function must be called with the lock held.
+ *
+ * @param rcv           The htraced receiver.
+ * @param now           The current time in milliseconds.
+ *
+ * @return              The buffer to send, or NULL if we should not send
+ *                          anything right now.
+ */
+static struct htraced_sbuf *htraced_next_to_send(struct htraced_rcv *rcv,
+                                                 uint64_t now)
+{
+    struct htraced_sbuf *sbuf;
+    int i, idx;
+
+    if (rcv->num_inflight >= rcv->inflight_window) {
+        return NULL;
+    }
+    if ((!rcv->shutdown) && (!htraced_have_usable_conn(rcv, now))) {
+        // Leave the buffers where they are until a backoff period is over.
+        return NULL;
+    }
+    // Buffers which need to be sent again go first.
+    for (i = 0; i < rcv->num_sent; i++) {
+        sbuf = rcv->sbuf[(rcv->xmit_head + i) % rcv->num_bufs];
+        if (sbuf->state == HTRACED_SBUF_UNSENT) {
+            return sbuf;
+        }
+    }
+    // The active buffer is never part of the sent region, so this is either a
+    // full buffer waiting to be sent, or the active buffer.
+    idx = (rcv->xmit_head + rcv->num_sent) % rcv->num_bufs;
+    if (idx == rcv->active_buf) {
+        if (!should_xmit(rcv, now)) {
+            return NULL;
+        }
+        if (!htraced_sbufs_advance(rcv)) {
+            // Every other buffer is in flight.
+            return NULL;
+        }
+    }
+    rcv->num_sent++;
+    return rcv->sbuf[idx];
+}
+
+/**
+ * Free the buffers at the head of the ring which are done.
+ * This function must be called with the lock held.
+ */
+static void htraced_retire_sent(struct htraced_rcv *rcv, uint64_t now)
+{
+    struct htraced_sbuf *sbuf;
+    int retired = 0;
+
+    while (rcv->num_sent > 0) {
+        sbuf = rcv->sbuf[rcv->xmit_head];
+        if (sbuf->state != HTRACED_SBUF_DONE) {
+            break;
+        }
+        sbuf->off = 0;
+        sbuf->num_spans = 0;
+        sbuf->state = HTRACED_SBUF_UNSENT;
+        sbuf->tries = 0;
+        rcv->xmit_head = (rcv->xmit_head + 1) % rcv->num_bufs;
+        rcv->num_sent--;
+        retired = 1;
+    }
+    if (retired) {
+        rcv->last_send_ms = now;
+        pthread_cond_broadcast(&rcv->flush_cond);
+    }
+}
+
+/**
+ * Determine whether we can send a new request on a connection.  While the
+ * circuit breaker is open, we can't.  While it is half-open, we can only have
+ * one request in flight.
+ */
+static int htraced_conn_usable(const struct htraced_conn *conn, uint64_t now)
+{
+    if (conn->failures == 0) {
+        return 1;
+    }
+    return (conn->down_until_ms <= now) && (conn->num_inflight == 0);
+}
+
+/**
+ * Determine whether we can send a new request on any connection.
+ * This function must be called with the lock held.
+ */
+static int htraced_have_usable_conn(const struct htraced_rcv *rcv,
+                                    uint64_t now)
+{
+    int i;
+
+    for (i = 0; i < rcv->num_conns; i++) {
+        if (htraced_conn_usable(&rcv->conns[i], now)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Determine how long it will be until the next backoff period is over.
+ * This function must be called with the lock held.
+ *
+ * @return      The number of milliseconds, or UINT64_MAX if no backoff
+ *                  period is running.
+ */
+static uint64_t htraced_next_retry_ms(const struct htraced_rcv *rcv,
+                                      uint64_t now)
+{
+    uint64_t wait_ms = UINT64_MAX;
+    const struct htraced_conn *conn;
+    int i;
+
+    for (i = 0; i < rcv->num_conns; i++) {
+        conn = &rcv->conns[i];
+        if ((conn->failures > 0) && (conn->down_until_ms > now) &&
+                (conn->down_until_ms - now < wait_ms)) {
+            wait_ms = conn->down_until_ms - now;
+        }
+    }
+    return wait_ms;
+}
+
+/**
+ * Compute the backoff period to use after a number of consecutive failures.
+ * The period doubles with each failure, up to retry_max_ms, and then a random
+ * amount of up to half of it is taken off.
+ */
+static uint64_t htraced_backoff_ms(struct htraced_rcv *rcv, int failures)
+{
+    uint64_t backoff = rcv->retry_min_ms;
+    int i;
+
+    for (i = 1; (i < failures) && (backoff < rcv->retry_max_ms); i++) {
+        backoff *= 2;
+    }
+    if (backoff > rcv->retry_max_ms) {
+        backoff = rcv->retry_max_ms;
+    }
+    return backoff - (random_u32(rcv->rnd) % (backoff / 2 + 1));
+}
+
+/**
+ * Handle a failed attempt to send a buffer.
+ * This function must be called with the lock held.
+ */
+static void htraced_xmit_failed(struct htraced_rcv *rcv,
+                                struct htraced_sbuf *sbuf, uint64_t now)
+{
+    struct htraced_conn *conn = &rcv->conns[sbuf->conn];
+    int retry;
+
+    rcv->num_inflight--;
+    conn->num_inflight--;
+    rcv->ctrs.rpc_errors++;
+    sbuf->tries++;
+    retry = (sbuf->tries < rcv->max_tries);
+    if (rcv->spill && ((!retry) || (!htraced_have_usable_conn(rcv, now)))) {
+        htrace_log(rcv->lg, "htraced_xmit(%s) failed on try %d.  "
+                   "Spilling to disk.\n",
+                   hrpc_client_get_endpoint(conn->hcli), sbuf->tries);
+        sbuf->state = HTRACED_SBUF_SPILL;
+        return;
+    }
+    htrace_log(rcv->lg, "htraced_xmit(%s) failed on try %d.  %s\n",
+               hrpc_client_get_endpoint(conn->hcli), sbuf->tries,
+               (retry ? "Retrying." : "Giving up."));
+    if (retry) {
+        sbuf->state = HTRACED_SBUF_UNSENT;
+    } else {
+        rcv->ctrs.dropped_xmit += sbuf->num_spans;
+        sbuf->state = HTRACED_SBUF_DONE;
+    }
+}
+
+/**
+ * Handle the loss of the request for the oldest spilled batch.  The batch
+ * stays in the spill queue, and will be sent again later.
+ * This function must be called with the lock held.
+ */
+static void htraced_unspill_failed(struct htraced_rcv *rcv)
+{
+    rcv->ctrs.rpc_errors++;
+    rcv->spill_inflight = 0;
+    rcv->num_inflight--;
+    rcv->conns[rcv->spill_conn].num_inflight--;
+}
+
+/**
+ * Handle the loss of a connection.  All buffers which were in flight on it
+ * have to be sent again, and we avoid the endpoint for a while, so that they
+ * go to another endpoint if there is one.
+ * This function must be called with the lock held.
+ */
+static void htraced_conn_failed(struct htraced_rcv *rcv, int ci, uint64_t now)
+{
+    struct htraced_conn *conn = &rcv->conns[ci];
+    struct htraced_sbuf *sbuf;
+    uint64_t backoff;
+    int i;
+
+    hrpc_client_close(conn->hcli);
+    conn->failures++;
+    backoff = htraced_backoff_ms(rcv, conn->failures);
+    conn->down_until_ms = now + backoff;
+    if (rcv->dns_cache_ms) {
+        // If we couldn't connect, the endpoint's addresses have been marked
+        // stale.  Have the resolver look them up again.
+        rcv->resolve_wake = 1;
+        pthread_cond_signal(&rcv->resolve_cond);
+    }
+    htrace_log(rcv->lg, "htraced_conn_failed(%s): %d consecutive "
+               "failure(s).  Not using this endpoint for %" PRId64 " ms.\n",
+               hrpc_client_get_endpoint(conn->hcli), conn->failures, backoff);
+    for (i = 0; i < rcv->num_sent; i++) {
+        sbuf = rcv->sbuf[(rcv->xmit_head + i) % rcv->num_bufs];
+        if ((sbuf->state == HTRACED_SBUF_INFLIGHT) && (sbuf->conn == ci)) {
+            htraced_xmit_failed(rcv, sbuf, now);
+        }
+    }
+    if (rcv->spill_inflight && (rcv->spill_conn == ci)) {
+        htraced_unspill_failed(rcv);
+    }
+    htraced_retire_sent(rcv, now);
+}
+
+/**
+ * Write the buffers which are waiting to be spilled to the spill queue.
+ * This function must be called with the lock held.  It will be released
+ * while writing.
+ */
+static void htraced_spill_sbufs(struct htraced_rcv *rcv, uint64_t now)
+{
+    struct htraced_sbuf *sbuf;
+    int i, success, found = 0;
+
+    for (i = 0; i < rcv->num_sent; i++) {
+        sbuf = rcv->sbuf[(rcv->xmit_head + i) % rcv->num_bufs];
+        if (sbuf->state != HTRACED_SBUF_SPILL) {
+            continue;
+        }
+        found = 1;
+        // Nobody else touches buffers which the transmitter has taken.
+        pthread_mutex_unlock(&rcv->lock);
+        success = spill_log_append(rcv->spill, sbuf->buf, sbuf->off,
+                                   sbuf->num_spans);
+        pthread_mutex_lock(&rcv->lock);
+        if (success) {
+            rcv->ctrs.spilled += sbuf->num_spans;
+            rcv->spill_spans += sbuf->num_spans;
+            sbuf->state = HTRACED_SBUF_DONE;
+        } else if (sbuf->tries < rcv->max_tries) {
+            htrace_log(rcv->lg, "htraced_spill_sbufs: failed to spill "
+                       "%" PRId64 " spans.  The spill queue may be full.  "
+                       "Retrying.\n", sbuf->num_spans);
+            sbuf->state = HTRACED_SBUF_UNSENT;
+        } else {
+            htrace_log(rcv->lg, "htraced_spill_sbufs: failed to spill "
+                       "%" PRId64 " spans.  The spill queue may be full.  "
+                       "Giving up.\n", sbuf->num_spans);
+            rcv->ctrs.dropped_xmit += sbuf->num_spans;
+            sbuf->state = HTRACED_SBUF_DONE;
+        }
+    }
+    if (found) {
+        htraced_retire_sent(rcv, now);
+    }
+}
+
+/**
+ * Choose the connection to send the next buffer on.  This is the usable
+ * connection with the fewest buffers in flight.  Ties are broken round-robin.
+ * This function must be called with the lock held.
+ *
+ * @return      The index of the connection, or -1 if no connection is usable
+ *                  right now.  While shutting down, we always pick one.
+ */
+static int htraced_pick_conn(struct htraced_rcv *rcv, uint64_t now)
+{
+    struct htraced_conn *conn;
+    int i, n, best = -1;
+
+    for (n = 0; n < rcv->num_conns; n++) {
+        i = (rcv->next_conn + n) % rcv->num_conns;
+        conn = &rcv->conns[i];
+        if (!htraced_conn_usable(conn, now)) {
+            continue;
+        }
+        if ((best < 0) ||
+                (conn->num_inflight < rcv->conns[best].num_inflight)) {
+            best = i;
+        }
+    }
+    if (best < 0) {
+        if (!rcv->shutdown) {
+            return -1;
+        }
+        // We are shutting down, so we can't wait for the backoff periods to
+        // end.  Try the endpoint which is due to be retried first.
+        best = 0;
+        for (i = 1; i < rcv->num_conns; i++) {
+            if (rcv->conns[i].down_until_ms <
+                    rcv->conns[best].down_until_ms) {
+                best = i;
+            }
+        }
+    }
+    rcv->next_conn = (best + 1) % rcv->num_conns;
+    return best;
+}
+
+/**
+ * Send a WriteSpans request for some span data, without waiting for the
+ * response.
+ * This function must be called without the lock held.
+ *
+ * @param rcv           The htraced receiver.
+ * @param conn          The connection to send on.
+ * @param data          The serialized spans.
+ * @param len           The length of the serialized spans.
+ * @param num_spans     The number of spans.
+ * @param seq           (out param) The sequence ID of the request.
+ * @param wire_len      (out param) The number of bytes we sent, not counting
+ *                          the HRPC header.
+ *
+ * @return              1 on success; 0 if the connection failed; -1 if we
+ *                          could not build the request.
+ */
+static int htraced_xmit_data(struct htraced_rcv *rcv,
+                             struct htraced_conn *conn, const char *data,
+                             uint64_t len, uint64_t num_spans, uint64_t *seq,
+                             uint64_t *wire_len)
+{
+    struct htrace_log *lg = rcv->lg;
+    uint8_t *prequel;
+    int prequel_len, success;
+    uint64_t zlen, dlen, start_ns;
+
+    prequel = conn->prequel[conn->next_prequel];
+    conn->next_prequel = !conn->next_prequel;
+    prequel_len = hrpc_write_spans_prequel(rcv->trid, num_spans, prequel);
+    if (prequel_len < 0) {
+        htrace_log(lg, "htraced_xmit_data: hrpc_write_spans_prequel "
+                   "failed.\n");
+        return -1;
+    }
+    dlen = htraced_dict_encode(rcv->trid, data, len, num_spans, rcv->dbuf,
+                               rcv->dbuf_len, prequel_len + len);
+    if (dlen > 0) {
+        zlen = htraced_compress(rcv, rcv->dbuf, dlen, NULL, 0);
+    } else {
+        zlen = htraced_compress(rcv, prequel, prequel_len, data, len);
+    }
+    start_ns = htraced_self_start(rcv);
+    if (zlen > 0) {
+        // The compression buffer is reused for the next request, so we have
+        // to wait for this one to be sent.
+        success = hrpc_client_send(conn->hcli, (dlen > 0) ?
+                        METHOD_ID_WRITE_SPANS_DICT_ZLIB :
+                        METHOD_ID_WRITE_SPANS_ZLIB,
+                        rcv->zbuf, zlen, NULL, 0, seq);
+        *wire_len = zlen;
+    } else if (dlen > 0) {
+        // Like the compression buffer, the dictionary encoding buffer is
+        // reused for the next request.
+        success = hrpc_client_send(conn->hcli, METHOD_ID_WRITE_SPANS_DICT,
+                        rcv->dbuf, dlen, NULL, 0, seq);
+        *wire_len = dlen;
+    } else {
+        // The data stays put until the response arrives, so the send can
+        // finish in the background.
+        success = hrpc_client_send_async(conn->hcli, METHOD_ID_WRITE_SPANS,
+                        prequel, prequel_len, data, len, seq);
+        *wire_len = prequel_len + len;
+    }
+    htraced_self_add(rcv, &rcv->self_xmit_wait_ns, start_ns);
+    if (!success) {
+        htrace_log(lg, "htraced_xmit_data: hrpc_client_send(%s) failed.\n",
+                   hrpc_client_get_endpoint(conn->hcli));
+    }
+    return success;
+}
+
+/**
+ * What happened when we sent some span data with htraced_xmit_chunks.
+ */
+struct htraced_xmit_res {
+    /**
+     * The sequence IDs of the first and last requests we sent.
+     */
+    uint64_t seq;
+    uint64_t last_seq;
+
+    /**
+     * The number of requests we sent.
+     */
+    uint64_t num_chunks;
+
+    /**
+     * The number of bytes we sent, not counting the HRPC headers.
+     */
+    uint64_t wire_len;
+
+    /**
+     * The number of spans we skipped because they didn't fit into a request.
+     */
+    uint64_t too_large;
+};
+
+static int htraced_xmit_chunk(struct htraced_rcv *rcv,
+                              struct htraced_conn *conn, const char *data,
+                              uint64_t len, uint64_t num_spans,
+                              struct htraced_xmit_res *res)
+{
+    uint64_t seq = 0, wire_len = 0;
+    int ret;
+
+    ret = htraced_xmit_data(rcv, conn, data, len, num_spans, &seq, &wire_len);
+    if (ret <= 0) {
+        if ((ret < 0) && (res->num_chunks > 0)) {
+            // We can't take back the requests we have already sent.  Close
+            // the connection, so that their responses don't turn up later.
+            hrpc_client_close(conn->hcli);
+            return 0;
+        }
+        return ret;
+    }
+    if (res->num_chunks == 0) {
+        res->seq = seq;
+    }
+    res->last_seq = seq;
+    res->num_chunks++;
+    res->wire_len += wire_len;
+    return 1;
+}
+
+/**
+ * Send some span data as WriteSpans requests of at most rpc_max_len bytes of
+ * span data each, without waiting for the responses.  Spans are never split
+ * across requests.  All of the requests are sent on one connection, one
+ * straight after another, so their sequence IDs are consecutive.
+ * This function must be called without the lock held.
+ *
+ * @param rcv           The htraced receiver.
+ * @param conn          The connection to send on.
+ * @param data          The serialized spans.
+ * @param len           The length of the serialized spans.
+ * @param num_spans     The number of spans.
+ * @param res           (out param) What we sent.
+ *
+ * @return              1 on success; 0 if the connection failed; -1 if we
+ *                          could not build the first request.  On success,
+ *                          res->num_chunks may be 0 if every span was too
+ *                          large to send.
+ */
+static int htraced_xmit_chunks(struct htraced_rcv *rcv,
+                               struct htraced_conn *conn, const char *data,
+                               uint64_t len, uint64_t num_spans,
+                               struct htraced_xmit_res *res)
+{
+    struct cmp_bcopy_ctx bctx;
+    uint64_t start, span_start, n = 0;
+    int ret;
+
+    memset(res, 0, sizeof(*res));
+    if (len <= rcv->rpc_max_len) {
+        return htraced_xmit_chunk(rcv, conn, data, len, num_spans, res);
+    }
+    cmp_bcopy_ctx_init(&bctx, (void*)data, len);
+    start = 0;
+    while (bctx.off < len) {
+        span_start = bctx.off;
+        if (!cmp_bcopy_skip_object(&bctx)) {
+            // This should never happen, since we wrote the data ourselves.
+            htrace_log(rcv->lg, "htraced_xmit_chunks: failed to parse "
+                       "span data at offset %" PRId64 ".  Not sending the "
+                       "rest.\n", span_start);
+            bctx.off = span_start;
+            break;
+        }
+        if ((bctx.off - span_start > rcv->rpc_max_len) ||
+                (bctx.off - start > rcv->rpc_max_len)) {
+            if (n > 0) {
+                ret = htraced_xmit_chunk(rcv, conn, data + start,
+                                         span_start - start, n, res);
+                if (ret <= 0) {
+                    return ret;
+                }
+            }
+            start = span_start;
+            n = 0;
+            if (bctx.off - span_start > rcv->rpc_max_len) {
+                res->too_large++;
+                start = bctx.off;
+                continue;
+            }
+        }
+        n++;
+    }
+    if (n > 0) {
+        return htraced_xmit_chunk(rcv, conn, data + start, bctx.off - start,
+                                  n, res);
+    }
+    return 1;
+}
+
+/**
+ * Count the spans which didn't fit into a request.  We only count them the
+ * first time we send a batch, since they are skipped every time.
+ * This function must be called with the lock held.
+ */
+static void htraced_count_too_large(struct htraced_rcv *rcv,
+                                    const struct htraced_xmit_res *res,
+                                    int tries, uint64_t *num_spans)
+{
+    if ((res->too_large == 0) || (tries > 0)) {
+        return;
+    }
+    htrace_log(rcv->lg, "htraced_xmit: dropped %" PRId64 " spans "
+               "which did not fit into a %" PRId64 "-byte request.\n",
+               res->too_large, rcv->rpc_max_len);
+    rcv->ctrs.dropped_too_large += res->too_large;
+    *num_spans -= res->too_large;
+}
+
+/**
+ * Handle an answered request for a buffer which is in flight.  The buffer is
+ * done once all of its requests have been answered.
+ * This function must be called with the lock held.
+ */
+static void htraced_sbuf_chunk_done(struct htraced_rcv *rcv,
+                                    struct htraced_sbuf *sbuf,
+                                    const char *err, uint64_t now)
+{
+    struct htraced_conn *conn = &rcv->conns[sbuf->conn];
+
+    if (err) {
+        sbuf->chunk_err = 1;
+    }
+    if (sbuf->chunks_left > 0) {
+        sbuf->chunks_left--;
+    }
+    if (sbuf->chunks_left > 0) {
+        return;
+    }
+    if (sbuf->chunk_err) {
+        htraced_xmit_failed(rcv, sbuf, now);
+        return;
+    }
+    rcv->num_inflight--;
+    conn->num_inflight--;
+    if (rcv->batch_max_latency_ms) {
+        rcv->rpc_latency_ms = htraced_ewma(rcv->rpc_latency_ms,
+                                           now - sbuf->send_ms);
+        htraced_batch_adapt(rcv);
+    }
+    rcv->ctrs.xmit_bytes += sbuf->off;
+    rcv->ctrs.xmit_wire_bytes += sbuf->wire_len;
+    sbuf->state = HTRACED_SBUF_DONE;
+}
+
+/**
+ * Pick a connection for a new request, and count the request as in flight.
+ * This function must be called with the lock held.
+ */
+static int htraced_start_xmit(struct htraced_rcv *rcv, uint64_t now)
+{
+    struct htraced_conn *conn;
+    int ci;
+
+    ci = htraced_pick_conn(rcv, now);
+    conn = &rcv->conns[ci];
+    rcv->ctrs.rpcs++;
+    rcv->num_inflight++;
+    if (conn->num_inflight++ == 0) {
+        conn->wait_start_ms = now;
+    }
+    return ci;
+}
+
+/**
+ * A batch of datagrams being built by htraced_xmit_send_dgrams, and what
+ * happened to the datagrams we have sent so far.
+ */
+struct htraced_dgram_batch {
+    /**
+     * The connection to send on.
+     */
+    struct htraced_conn *conn;
+
+    /**
+     * The datagrams built so far.
+     */
+    struct hrpc_dgram dgrams[HTRACED_DGRAM_BATCH];
+
+    /**
+     * The number of spans in each datagram.
+     */
+    uint64_t num_spans[HTRACED_DGRAM_BATCH];
+
+    /**
+     * The prequel of each datagram.
+     */
+    uint8_t prequels[HTRACED_DGRAM_BATCH][MAX_WRITESPANS_PREQUEL_LEN];
+
+    /**
+     * The number of datagrams built so far.
+     */
+    int num;
+
+    /**
+     * Nonzero if the connection has failed.
+     */
+    int failed;
+
+    /**
+     * The number of datagrams sent.
+     */
+    uint64_t sent;
+
+    /**
+     * The number of bytes of span data sent.
+     */
+    uint64_t bytes;
+
+    /**
+     * The number of bytes sent, including the prequels.
+     */
+    uint64_t wire_bytes;
+
+    /**
+     * The number of spans sent.
+     */
+    uint64_t sent_spans;
+};
+
+/**
+ * Send the datagrams in a batch, and empty it.
+ * This function must be called without the lock held.
+ */
+static void htraced_dgram_flush(struct htraced_rcv *rcv,
+                                struct htraced_dgram_batch *batch)
+{
+    int i, sent = 0;
+
+    if (!batch->failed) {
+        sent = hrpc_client_send_dgrams(batch->conn->hcli,
+                    METHOD_ID_WRITE_SPANS, batch->dgrams, batch->num);
+        if (sent < 0) {
+            htrace_log(rcv->lg, "htraced_dgram_flush: "
+                       "hrpc_client_send_dgrams(%s) failed.\n",
+                       hrpc_client_get_endpoint(batch->conn->hcli));
+            batch->failed = 1;
+            sent = 0;
         }
     }
-    send_fraction = htraced_get_bounded_double(tracer->lg, conf,
-                HTRACED_BUFFER_SEND_TRIGGER_FRACTION, 0.1, 1.0);
-    rcv->send_threshold = buf_len * send_fraction;
-    if (rcv->send_threshold > buf_len) {
-        rcv->send_threshold = buf_len;
+    // Whatever wasn't sent is dropped.  There is no response telling us
+    // whether to try again.
+    for (i = 0; i < sent; i++) {
+        batch->sent++;
+        batch->sent_spans += batch->num_spans[i];
+        batch->bytes += batch->dgrams[i].buf2_len;
+        batch->wire_bytes += batch->dgrams[i].buf1_len +
+            batch->dgrams[i].buf2_len;
     }
-    rcv->last_send_ms = monotonic_now_ms(tracer->lg);
-    ret = pthread_mutex_init(&rcv->lock, NULL);
-    if (ret) {
-        htrace_log(tracer->lg, "htraced_rcv_create: pthread_mutex_init "
-                   "error %d: %s\n", ret, terror(ret));
-        goto error_free_bufs;
+    batch->num = 0;
+}
+
+/**
+ * Add a datagram holding some whole spans to a batch, sending the batch if it
+ * is full.
+ * This function must be called without the lock held.
+ */
+static void htraced_dgram_add(struct htraced_rcv *rcv,
+                              struct htraced_dgram_batch *batch,
+                              const char *data, uint64_t len,
+                              uint64_t num_spans)
+{
+    struct hrpc_dgram *dgram = &batch->dgrams[batch->num];
+    int prequel_len;
+
+    prequel_len = hrpc_write_spans_prequel(rcv->trid, num_spans,
+                                           batch->prequels[batch->num]);
+    if (prequel_len < 0) {
+        return;
     }
-    ret = pthread_cond_init(&rcv->bg_cond, NULL);
-    if (ret) {
-        htrace_log(tracer->lg, "htraced_rcv_create: pthread_cond_init("
-                   "bg_cond) error %d: %s\n", ret, terror(ret));
-        goto error_free_lock;
+    dgram->buf1 = batch->prequels[batch->num];
+    dgram->buf1_len = prequel_len;
+    dgram->buf2 = data;
+    dgram->buf2_len = len;
+    batch->num_spans[batch->num] = num_spans;
+    if (++batch->num == HTRACED_DGRAM_BATCH) {
+        htraced_dgram_flush(rcv, batch);
     }
-    ret = pthread_cond_init(&rcv->flush_cond, NULL);
-    if (ret) {
-        htrace_log(tracer->lg, "htraced_rcv_create: pthread_cond_init("
-                   "flush_cond) error %d: %s\n", ret, terror(ret));
-        goto error_free_bg_cond;
+}
+
+/**
+ * Send a buffer to htraced as datagrams.  Spans are never split across
+ * datagrams.
+ * This function must be called with the lock held.  It will be released
+ * while doing network I/O.
+ */
+static void htraced_xmit_send_dgrams(struct htraced_rcv *rcv,
+                                     struct htraced_sbuf *sbuf, uint64_t now)
+{
+    struct htrace_log *lg = rcv->lg;
+    struct htraced_dgram_batch batch;
+    struct cmp_bcopy_ctx bctx;
+    uint8_t prequel[MAX_WRITESPANS_PREQUEL_LEN];
+    uint64_t budget, start, span_start, num_spans = 0, too_large = 0;
+    int ci, prequel_len;
+
+    ci = htraced_pick_conn(rcv, now);
+    sbuf->state = HTRACED_SBUF_INFLIGHT;
+    sbuf->conn = ci;
+    sbuf->send_ms = now;
+    pthread_mutex_unlock(&rcv->lock);
+    htraced_group_by_trace(sbuf->buf, sbuf->off, sbuf->num_spans,
+                           rcv->gbuf, rcv->gbuf_len);
+    batch.conn = &rcv->conns[ci];
+    batch.num = 0;
+    batch.failed = 0;
+    batch.sent = batch.sent_spans = batch.bytes = batch.wire_bytes = 0;
+    // No datagram holds more spans than the whole buffer, so its prequel is
+    // never longer than this one.
+    prequel_len = hrpc_write_spans_prequel(rcv->trid, sbuf->num_spans,
+                                           prequel);
+    if ((prequel_len < 0) ||
+            (HRPC_REQ_HEADER_LEN + prequel_len >= rcv->dgram_size)) {
+        htrace_log(lg, "htraced_xmit_send_dgrams: no room for spans in a "
+                   "%" PRId64 "-byte datagram.\n", rcv->dgram_size);
+        budget = 0;
+    } else {
+        budget = rcv->dgram_size - HRPC_REQ_HEADER_LEN - prequel_len;
     }
-    ret = pthread_create(&rcv->xmit_thread, NULL, run_htraced_xmit_manager, rcv);
-    if (ret) {
-        htrace_log(tracer->lg, "htraced_rcv_create: failed to create xmit thread: "
-                   "error %d: %s\n", ret, terror(ret));
-        goto error_free_flush_cond;
+    cmp_bcopy_ctx_init(&bctx, sbuf->buf, sbuf->off);
+    start = 0;
+    while (bctx.off < sbuf->off) {
+        span_start = bctx.off;
+        if (!cmp_bcopy_skip_object(&bctx)) {
+            // This should never happen, since we wrote the buffer ourselves.
+            htrace_log(lg, "htraced_xmit_send_dgrams: failed to parse the "
+                       "send buffer at offset %" PRId64 ".\n", span_start);
+            bctx.off = sbuf->off;
+            break;
+        }
+        if (bctx.off - span_start > budget) {
+            too_large++;
+            if (num_spans > 0) {
+                htraced_dgram_add(rcv, &batch, sbuf->buf + start,
+                                  span_start - start, num_spans);
+            }
+            start = bctx.off;
+            num_spans = 0;
+            continue;
+        }
+        if (bctx.off - start > budget) {
+            htraced_dgram_add(rcv, &batch, sbuf->buf + start,
+                              span_start - start, num_spans);
+            start = span_start;
+            num_spans = 0;
+        }
+        num_spans++;
     }
-    htrace_log(tracer->lg, "Initialized htraced receiver for %s"
-                ", flush_interval_ms=%" PRId64 ", send_threshold=%" PRId64
-                ", write_timeo_ms=%" PRId64 ", read_timeo_ms=%" PRId64
-                ", buf_len=%" PRId64 ".\n", hrpc_client_get_endpoint(rcv->hcli),
-                rcv->flush_interval_ms, rcv->send_threshold,
-                write_timeo_ms, read_timeo_ms, buf_len);
-    return (struct htrace_rcv*)rcv;
+    if (num_spans > 0) {
+        htraced_dgram_add(rcv, &batch, sbuf->buf + start,
+                          bctx.off - start, num_spans);
+    }
+    if (batch.num > 0) {
+        htraced_dgram_flush(rcv, &batch);
+    }
+    pthread_mutex_lock(&rcv->lock);
+    if (too_large > 0) {
+        htrace_log(lg, "htraced_xmit_send_dgrams: dropped %" PRId64 " spans "
+                   "which were too large for a %" PRId64 "-byte datagram.\n",
+                   too_large, rcv->dgram_size);
+    }
+    rcv->ctrs.rpcs += batch.sent;
+    rcv->ctrs.xmit_bytes += batch.bytes;
+    rcv->ctrs.xmit_wire_bytes += batch.wire_bytes;
+    rcv->ctrs.dropped_xmit += sbuf->num_spans - batch.sent_spans;
+    sbuf->state = HTRACED_SBUF_DONE;
+    if (batch.failed) {
+        rcv->ctrs.rpc_errors++;
+        htraced_conn_failed(rcv, ci, monotonic_now_ms(lg));
+    } else {
+        batch.conn->failures = 0;
+        batch.conn->down_until_ms = 0;
+        htraced_retire_sent(rcv, monotonic_now_ms(lg));
+    }
+}
 
-error_free_flush_cond:
-    pthread_cond_destroy(&rcv->flush_cond);
-error_free_bg_cond:
-    pthread_cond_destroy(&rcv->bg_cond);
-error_free_lock:
-    pthread_mutex_destroy(&rcv->lock);
-error_free_bufs:
-    for (i = 0; i < HTRACED_NUM_BUFS; i++) {
-        htraced_sbuf_free(rcv->sbuf[i]);
+/**
+ * Send a buffer to htraced, without waiting for the response.
+ * This function must be called with the lock held.  It will be released
+ * while doing network I/O, so that we don't block threads adding spans.
+ * Nobody else writes to the buffer once the transmitter has taken it, so we
+ * can use it without the lock.
+ */
+static void htraced_xmit_send(struct htraced_rcv *rcv,
+                              struct htraced_sbuf *sbuf, uint64_t now)
+{
+    struct htrace_log *lg = rcv->lg;
+    struct htraced_xmit_res res;
+    int ci, ret;
+
+    HTRACE_PROBE2(htraced__xmit, sbuf->num_spans, sbuf->off);
+    if (rcv->transport == HTRACED_TRANSPORT_DATAGRAM) {
+        htraced_xmit_send_dgrams(rcv, sbuf, now);
+        return;
+    }
+    ci = htraced_start_xmit(rcv, now);
+    sbuf->state = HTRACED_SBUF_INFLIGHT;
+    sbuf->conn = ci;
+    sbuf->send_ms = now;
+    pthread_mutex_unlock(&rcv->lock);
+    if (sbuf->tries == 0) {
+        htraced_group_by_trace(sbuf->buf, sbuf->off, sbuf->num_spans,
+                               rcv->gbuf, rcv->gbuf_len);
+    }
+    ret = htraced_xmit_chunks(rcv, &rcv->conns[ci], sbuf->buf, sbuf->off,
+                              sbuf->num_spans, &res);
+    pthread_mutex_lock(&rcv->lock);
+    htraced_count_too_large(rcv, &res, sbuf->tries, &sbuf->num_spans);
+    if (ret > 0) {
+        // htraced_start_xmit counted one request already.
+        rcv->ctrs.rpcs += res.num_chunks;
+        rcv->ctrs.rpcs--;
+        sbuf->seq = res.seq;
+        sbuf->last_seq = res.last_seq;
+        sbuf->chunks_left = res.num_chunks;
+        sbuf->chunk_err = 0;
+        sbuf->wire_len = res.wire_len;
+        if (res.num_chunks == 0) {
+            // There was nothing we could send.
+            htraced_sbuf_chunk_done(rcv, sbuf, NULL, now);
+            htraced_retire_sent(rcv, now);
+        }
+    } else if (ret < 0) {
+        htraced_xmit_failed(rcv, sbuf, now);
+        htraced_retire_sent(rcv, monotonic_now_ms(lg));
+    } else {
+        // The connection was closed, so anything else in flight on it is
+        // lost too.
+        htraced_conn_failed(rcv, ci, monotonic_now_ms(lg));
     }
-    hrpc_client_free(rcv->hcli);
-error_free_rcv:
-    free(rcv);
-error:
-    return NULL;
 }
 
-void* run_htraced_xmit_manager(void *data)
+/**
+ * Handle the response to the request for the oldest spilled batch.
+ * This function must be called with the lock held.
+ */
+static void htraced_unspill_done(struct htraced_rcv *rcv, const char *err)
 {
-    struct htraced_rcv *rcv = data;
-    struct htrace_log *lg = rcv->tracer->lg;
-    uint64_t now, wakeup;
-    struct timespec wakeup_ts;
+    const void *data;
+    uint64_t len, num_spans;
+
+    rcv->spill_inflight = 0;
+    rcv->num_inflight--;
+    rcv->conns[rcv->spill_conn].num_inflight--;
+    spill_log_peek(rcv->spill, &data, &len, &num_spans);
+    if (err) {
+        rcv->ctrs.rpc_errors++;
+        rcv->spill_tries++;
+        if (rcv->spill_tries < rcv->max_tries) {
+            return;
+        }
+        htrace_log(rcv->lg, "htraced_unspill_done: giving up on "
+                   "%" PRId64 " spilled spans.\n", num_spans);
+        rcv->ctrs.dropped_xmit += num_spans;
+    } else {
+        rcv->ctrs.unspilled += num_spans;
+        rcv->ctrs.xmit_bytes += len;
+        rcv->ctrs.xmit_wire_bytes += rcv->spill_wire_len;
+    }
+    rcv->spill_tries = 0;
+    rcv->spill_spans -= num_spans;
+    spill_log_pop(rcv->spill);
+}
+
+/**
+ * Send the oldest spilled batch to htraced, if there is one and there is
+ * room for it.  Only one spilled batch is in flight at once.
+ * This function must be called with the lock held.  It will be released
+ * while doing network I/O.
+ */
+static void htraced_unspill_send(struct htraced_rcv *rcv, uint64_t now)
+{
+    struct htrace_log *lg = rcv->lg;
+    struct htraced_xmit_res res;
+    const void *data;
+    uint64_t len, num_spans;
     int ret;
 
+    if ((!rcv->spill) || rcv->spill_inflight ||
+            (rcv->num_inflight >= rcv->inflight_window)) {
+        return;
+    }
+    if (!htraced_have_usable_conn(rcv, now)) {
+        return;
+    }
+    if (!spill_log_peek(rcv->spill, &data, &len, &num_spans)) {
+        return;
+    }
+    rcv->spill_conn = htraced_start_xmit(rcv, now);
+    rcv->spill_inflight = 1;
+    rcv->spill_send_ms = now;
+    pthread_mutex_unlock(&rcv->lock);
+    ret = htraced_xmit_chunks(rcv, &rcv->conns[rcv->spill_conn], data, len,
+                              num_spans, &res);
     pthread_mutex_lock(&rcv->lock);
-    while (1) {
-        now = monotonic_now_ms(lg);
-        while (should_xmit(rcv, now)) {
-            htraced_xmit(rcv, now);
+    htraced_count_too_large(rcv, &res, rcv->spill_tries, &num_spans);
+    if (ret > 0) {
+        rcv->ctrs.rpcs += res.num_chunks;
+        rcv->ctrs.rpcs--;
+        rcv->spill_seq = res.seq;
+        rcv->spill_last_seq = res.last_seq;
+        rcv->spill_chunks_left = res.num_chunks;
+        rcv->spill_chunk_err = 0;
+        rcv->spill_wire_len = res.wire_len;
+        if (res.num_chunks == 0) {
+            htraced_unspill_done(rcv, NULL);
         }
-        if (rcv->shutdown) {
-            while (!htraced_sbufs_empty(rcv)) {
-                htraced_xmit(rcv, now);
-            }
+    } else if (ret < 0) {
+        // The batch can never be sent, so don't try again.
+        rcv->spill_tries = rcv->max_tries;
+        htraced_unspill_done(rcv, "unable to build the request");
+    } else {
+        htraced_conn_failed(rcv, rcv->spill_conn, monotonic_now_ms(lg));
+    }
+}
+
+/**
+ * Read one response from an htraced connection, and handle it.
+ * This function must be called with the lock held.  It will be released
+ * while doing network I/O.
+ *
+ * @return      1 if we handled a response, and the connection is still open;
+ *                  0 otherwise.
+ */
+static int htraced_xmit_recv(struct htraced_rcv *rcv, int ci, uint64_t now)
+{
+    struct htrace_log *lg = rcv->lg;
+    struct htraced_conn *conn = &rcv->conns[ci];
+    struct htraced_sbuf *sbuf = NULL;
+    const char *err = NULL;
+    const void *resp = NULL;
+    size_t resp_len = 0;
+    uint64_t seq = 0;
+    int i, ret, spilled = 0;
+
+    // The error string and response body belong to the HRPC client, and stay
+    // valid until we next receive on this connection.
+    pthread_mutex_unlock(&rcv->lock);
+    ret = hrpc_client_recv(conn->hcli, METHOD_ID_WRITE_SPANS, &seq,
+                           &err, &resp, &resp_len);
+    pthread_mutex_lock(&rcv->lock);
+    if (ret == HRPC_RECV_AGAIN) {
+        // The rest of the response hasn't arrived yet.
+        return 0;
+    }
+    if (!ret) {
+        htrace_log(lg, "htraced_xmit_recv: hrpc_client_recv(%s) failed.\n",
+                   hrpc_client_get_endpoint(conn->hcli));
+        htraced_conn_failed(rcv, ci, now);
+        return 0;
+    }
+    for (i = 0; i < rcv->num_sent; i++) {
+        sbuf = rcv->sbuf[(rcv->xmit_head + i) % rcv->num_bufs];
+        if ((sbuf->state == HTRACED_SBUF_INFLIGHT) && (sbuf->conn == ci) &&
+                (sbuf->seq <= seq) && (seq <= sbuf->last_seq)) {
             break;
         }
-        // Wait for one of a few things to happen:
-        // * Shutdown
-        // * The wakeup timer to elapse, leading us to check if we should send
-        //      because of send_timeo_ms.
-        // * A writer to signal that we should wake up because enough bytes are
-        //      buffered.
-        wakeup = now + (rcv->flush_interval_ms / 2);
-        ms_to_timespec(wakeup, &wakeup_ts);
-        ret = pthread_cond_timedwait(&rcv->bg_cond, &rcv->lock, &wakeup_ts);
-        if ((ret != 0) && (ret != ETIMEDOUT)) {
-            htrace_log(lg, "run_htraced_xmit_manager: pthread_cond_timedwait "
-                       "error: %d (%s)\n", ret, terror(ret));
+        sbuf = NULL;
+    }
+    if ((!sbuf) && rcv->spill_inflight && (rcv->spill_conn == ci) &&
+            (rcv->spill_seq <= seq) && (seq <= rcv->spill_last_seq)) {
+        spilled = 1;
+    }
+    if ((!sbuf) && (!spilled)) {
+        htrace_log(lg, "htraced_xmit_recv(%s): got a response for unknown "
+                   "sequence ID 0x%"PRIx64".\n",
+                   hrpc_client_get_endpoint(conn->hcli), seq);
+        htraced_conn_failed(rcv, ci, now);
+        ret = 0;
+    } else {
+        // The endpoint is talking to us, so close the circuit breaker.
+        conn->failures = 0;
+        conn->down_until_ms = 0;
+        conn->wait_start_ms = now;
+        htraced_count_latency(rcv, now - (spilled ? rcv->spill_send_ms :
+                                          sbuf->send_ms));
+        if (err) {
+            htrace_log(lg, "htraced_xmit_recv(%s): server returned error: "
+                       "%s\n", hrpc_client_get_endpoint(conn->hcli), err);
+        }
+        if (spilled) {
+            if (err) {
+                rcv->spill_chunk_err = 1;
+            }
+            if (--rcv->spill_chunks_left == 0) {
+                htraced_unspill_done(rcv, rcv->spill_chunk_err ?
+                                     "a request failed" : NULL);
+            }
+        } else {
+            htraced_sbuf_chunk_done(rcv, sbuf, err, now);
+        }
+    }
+    htraced_retire_sent(rcv, now);
+    return ret;
+}
+
+/**
+ * Wait for a response from any htraced connection, or for a writer to wake us
+ * up because there is another buffer to send.  Connections which have not
+ * answered within the read timeout are considered dead.
+ * This function must be called with the lock held.  It will be released
+ * while waiting.
+ */
+static void htraced_xmit_wait(struct htraced_rcv *rcv, uint64_t now)
+{
+    struct htrace_log *lg = rcv->lg;
+    struct hrpc_client *hclis[HTRACED_MAX_ENDPOINTS];
+    int ready[HTRACED_MAX_ENDPOINTS];
+    struct htraced_conn *conn;
+    uint64_t timeo_ms = rcv->read_timeo_ms, elapsed, start_ns = 0;
+    char b[16];
+    int i, ret, inflight = 0;
+
+    for (i = 0; i < rcv->num_conns; i++) {
+        conn = &rcv->conns[i];
+        hclis[i] = conn->hcli;
+        if (conn->num_inflight > 0) {
+            inflight = 1;
+            elapsed = now - conn->wait_start_ms;
+            if (elapsed >= rcv->read_timeo_ms) {
+                timeo_ms = 0;
+            } else if (rcv->read_timeo_ms - elapsed < timeo_ms) {
+                timeo_ms = rcv->read_timeo_ms - elapsed;
+            }
+        }
+    }
+    // Wake up when a backoff period is over, so that we can use the endpoint
+    // again, and when the active buffer is due to be sent.
+    if (htraced_next_retry_ms(rcv, now) < timeo_ms) {
+        timeo_ms = htraced_next_retry_ms(rcv, now);
+    }
+    if (htraced_next_batch_ms(rcv, now) < timeo_ms) {
+        timeo_ms = htraced_next_batch_ms(rcv, now);
+    }
+    if (rcv->shutdown_deadline_ms) {
+        if (rcv->shutdown_deadline_ms <= now) {
+            timeo_ms = 0;
+        } else if (rcv->shutdown_deadline_ms - now < timeo_ms) {
+            timeo_ms = rcv->shutdown_deadline_ms - now;
         }
     }
+    rcv->xmit_polling = 1;
     pthread_mutex_unlock(&rcv->lock);
-    htrace_log(lg, "run_htraced_xmit_manager: shutting down the transmission "
-               "manager thread.\n");
-    return NULL;
+    if (inflight) {
+        // Only count the time spent waiting for the server, not the time
+        // spent idle.
+        start_ns = htraced_self_start(rcv);
+    }
+    ret = hrpc_client_poll(hclis, ready, rcv->num_conns, rcv->wake_fd[0],
+                           timeo_ms);
+    htraced_self_add(rcv, &rcv->self_xmit_wait_ns, start_ns);
+    pthread_mutex_lock(&rcv->lock);
+    rcv->xmit_polling = 0;
+    if (rcv->xmit_woken) {
+        while (read(rcv->wake_fd[0], b, sizeof(b)) > 0) {
+            ;
+        }
+        rcv->xmit_woken = 0;
+    }
+    now = monotonic_now_ms(lg);
+    for (i = 0; i < rcv->num_conns; i++) {
+        conn = &rcv->conns[i];
+        if (ret < 0) {
+            if (conn->num_inflight > 0) {
+                htraced_conn_failed(rcv, i, now);
+            }
+        } else if (ready[i]) {
+            if (conn->num_inflight > 0) {
+                // Several responses may have arrived at once.
+                while (htraced_xmit_recv(rcv, i, now) &&
+                       (conn->num_inflight > 0)) {
+                    ;
+                }
+            } else {
+                // The server closed an idle connection.
+                hrpc_client_close(conn->hcli);
+            }
+        } else if ((conn->num_inflight > 0) &&
+                   (now - conn->wait_start_ms >= rcv->read_timeo_ms)) {
+            htrace_log(lg, "htraced_xmit_wait(%s): timed out after %"PRId64
+                       " ms waiting for a response.\n",
+                       hrpc_client_get_endpoint(conn->hcli),
+                       rcv->read_timeo_ms);
+            htraced_conn_failed(rcv, i, now);
+        }
+    }
 }
 
 /**
- * Determine if the xmit manager should send.
- * This function must be called with the lock held.
+ * Add a span to the current thread's staging buffer.
  *
  * @param rcv           The htraced receiver.
- * @param now           The current time in milliseconds.
+ * @param span          The span to add.
  *
- * @return              nonzero if we should send now.
+ * @return              1 if the span was handled; 0 if the caller should add
+ *                          it directly to the shared send buffer instead.
  */
-static int should_xmit(struct htraced_rcv *rcv, uint64_t now)
+static int htraced_tbuf_add_span(struct htraced_rcv *rcv,
+                                 struct htrace_span *span)
+{
+    struct htraced_tbuf *tbuf;
+    int ret;
+
+    tbuf = htraced_tbuf_get(rcv);
+    if (!tbuf) {
+        return 0;
+    }
+    pthread_mutex_lock(&tbuf->lock);
+    if (htraced_sbuf_add_span(&tbuf->sb, span)) {
+        pthread_mutex_unlock(&tbuf->lock);
+        return 1;
+    }
+    if (tbuf->sb.off == 0) {
+        // The span is too big for the staging buffer.
+        pthread_mutex_unlock(&tbuf->lock);
+        return 0;
+    }
+    // Move the staged spans into the shared send buffer.  We must drop the
+    // staging buffer lock first in order to respect the lock ordering.
+    // If the overflow policy drops spans, the staged spans are dropped, and we
+    // start over with an empty staging buffer.
+    pthread_mutex_unlock(&tbuf->lock);
+    htraced_rcv_lock(rcv);
+    htraced_tbuf_flush(rcv, tbuf);
+    pthread_mutex_unlock(&rcv->lock);
+    pthread_mutex_lock(&tbuf->lock);
+    ret = htraced_sbuf_add_span(&tbuf->sb, span);
+    pthread_mutex_unlock(&tbuf->lock);
+    return ret;
+}
+
+/**
+ * Serialize a span into the active send buffer, making room if needed.
+ * This function must be called with the receiver lock held.  It may release
+ * and re-take the receiver lock.
+ *
+ * @param rcv           The htraced receiver.
+ * @param span          The span to add.
+ *
+ * @return              0 if the span was added or dropped because the
+ *                          buffers were full; the buffer size if the span
+ *                          was dropped because it can never fit.
+ */
+static uint64_t htraced_add_span_locked(struct htraced_rcv *rcv,
+                                        struct htrace_span *span)
+{
+    struct htraced_sbuf *sbuf;
+    uint64_t prev_off;
+
+    if ((span->priority == HTRACE_PRIORITY_NORMAL) &&
+            htraced_sbufs_reserved(rcv, span_msgpack_size(span))) {
+        rcv->ctrs.dropped_low_priority++;
+        htraced_wake_xmit(rcv);
+        return 0;
+    }
+    while (1) {
+        sbuf = rcv->sbuf[rcv->active_buf];
+        prev_off = sbuf->off;
+        if (htraced_sbuf_add_span(sbuf, span)) {
+            rcv->ctrs.buffered++;
+            break;
+        }
+        if (sbuf->off == 0) {
+            rcv->ctrs.dropped_too_large++;
+            return sbuf->len;
+        }
+        if (!htraced_sbufs_make_room(rcv)) {
+            htraced_count_dropped(rcv, 1);
+            return 0;
+        }
+    }
+    htraced_active_written(rcv, prev_off);
+    return 0;
+}
+
+static void htraced_rcv_add_span(struct htrace_rcv *r,
+                                 struct htrace_span *span)
+{
+    struct htraced_rcv *rcv = (struct htraced_rcv *)r;
+    uint64_t len, start_ns;
+
+    HTRACE_PROBE3(htraced__add__span, span->desc, span->span_id.high,
+                  span->span_id.low);
+    if (!htraced_fork_restart(rcv)) {
+        pthread_mutex_lock(&rcv->lock);
+        rcv->ctrs.dropped_xmit++;
+        pthread_mutex_unlock(&rcv->lock);
+        return;
+    }
+    start_ns = htraced_self_start(rcv);
+    // High-priority spans skip the staging buffers, which are dropped whole
+    // when buffer space runs short.
+    if (rcv->tbuf_len && (span->priority == HTRACE_PRIORITY_NORMAL) &&
+            htraced_tbuf_add_span(rcv, span)) {
+        htraced_self_add(rcv, &rcv->self_add_span_ns, start_ns);
+        return;
+    }
+
+    // Try to serialize the span into the current buffer.
+    htraced_rcv_lock(rcv);
+    len = htraced_add_span_locked(rcv, span);
+    pthread_mutex_unlock(&rcv->lock);
+    htraced_self_add(rcv, &rcv->self_add_span_ns, start_ns);
+    if (len) {
+        HTRACE_LOG_RATELIMITED(rcv->lg, HTRACE_LOG_WARN,
+                "htraced_rcv_add_span: span does not fit in an empty "
+                "buffer of %" PRId64 " bytes.  Dropping it.\n", len);
+    }
+}
+
+static void htraced_rcv_add_spans(struct htrace_rcv *r,
+                                  struct htrace_span **spans, int num_spans)
 {
-    uint64_t off = rcv->sbuf[rcv->active_buf]->off;
+    struct htraced_rcv *rcv = (struct htraced_rcv *)r;
+    uint64_t len, too_large = 0, start_ns;
+    int i;
 
-    if (off > rcv->send_threshold) {
-        // We have buffered a lot of bytes, so let's send.
-        return 1;
+    if (!htraced_fork_restart(rcv)) {
+        pthread_mutex_lock(&rcv->lock);
+        rcv->ctrs.dropped_xmit += num_spans;
+        pthread_mutex_unlock(&rcv->lock);
+        return;
     }
-    if (now - rcv->last_send_ms > rcv->flush_interval_ms) {
-        // It's been too long since the last transmission, so let's send.
-        if (off > 0) {
-            return 1;
+    if (rcv->tbuf_len) {
+        // The staging buffers already avoid the receiver lock.
+        for (i = 0; i < num_spans; i++) {
+            htraced_rcv_add_span(r, spans[i]);
         }
+        return;
+    }
+    start_ns = htraced_self_start(rcv);
+    htraced_rcv_lock(rcv);
+    for (i = 0; i < num_spans; i++) {
+        HTRACE_PROBE3(htraced__add__span, spans[i]->desc,
+                      spans[i]->span_id.high, spans[i]->span_id.low);
+        len = htraced_add_span_locked(rcv, spans[i]);
+        if (len) {
+            too_large = len;
+        }
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    htraced_self_add(rcv, &rcv->self_add_span_ns, start_ns);
+    if (too_large) {
+        HTRACE_LOG_RATELIMITED(rcv->lg, HTRACE_LOG_WARN,
+                "htraced_rcv_add_spans: span does not fit in an empty "
+                "buffer of %" PRId64 " bytes.  Dropping it.\n", too_large);
     }
-    return 0; // Let's wait.
 }
 
-#define DEFAULT_TRID_STR        "DefaultTrid"
-#define DEFAULT_TRID_STR_LEN    (sizeof(DEFAULT_TRID_STR) - 1)
-#define NUM_SPANS_STR               "NumSpans"
-#define NUM_SPANS_STR_LEN           (sizeof(NUM_SPANS_STR) - 1)
-
-/**
- * Write the prequel to the WriteSpans message.
- */
-static int add_writespans_prequel(struct htraced_rcv *rcv,
-                                  struct htraced_sbuf *sbuf, uint8_t *prequel)
+static int htraced_rcv_take_span(struct htrace_rcv *r,
+                                 struct htrace_span *span)
 {
-    struct cmp_bcopy_ctx bctx;
-    struct cmp_ctx_s *ctx =  (struct cmp_ctx_s *)&bctx;
-    cmp_bcopy_ctx_init(&bctx, prequel, MAX_WRITESPANS_PREQUEL_LEN);
-    if (!cmp_write_fixmap(ctx, 2)) {
-        return -1;
-    }
-    if (!cmp_write_fixstr(ctx, DEFAULT_TRID_STR, DEFAULT_TRID_STR_LEN)) {
-        return -1;
-    }
-    if (!cmp_write_str(ctx, rcv->tracer->trid, strlen(rcv->tracer->trid))) {
-        return -1;
+    struct htraced_rcv *rcv = (struct htraced_rcv *)r;
+    struct htrace_span *head;
+
+    if ((!rcv->async) || (!htraced_fork_restart(rcv))) {
+        return 0;
     }
-    if (!cmp_write_fixstr(ctx, NUM_SPANS_STR, NUM_SPANS_STR_LEN)) {
-        return -1;
+    if (__atomic_load_n(&rcv->aq_len, __ATOMIC_RELAXED) >= rcv->aq_max) {
+        // The serializer is falling behind, so do the work here instead.
+        return 0;
     }
-    if (!cmp_write_uint(ctx, sbuf->num_spans)) {
-        return -1;
+    __atomic_fetch_add(&rcv->aq_len, 1, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&rcv->aq_head, __ATOMIC_RELAXED);
+    do {
+        span->next = head;
+    } while (!__atomic_compare_exchange_n(&rcv->aq_head, &head, span, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    // Only wake the serializer if it is waiting.  It sets aq_waiting before
+    // it checks the queue for the last time, so either it sees our span or we
+    // see the flag.
+    if (__atomic_load_n(&rcv->aq_waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&rcv->aq_lock);
+        pthread_cond_signal(&rcv->aq_cond);
+        pthread_mutex_unlock(&rcv->aq_lock);
     }
-    return bctx.off;
+    return 1;
 }
 
 /**
- * Send all the spans which we have buffered.
+ * Serialize and free all of the spans in the serializer queue.
+ *
+ * This is normally called by the serializer thread, but it is safe to call
+ * from any thread.
  *
  * @param rcv           The htraced receiver.
- * @param sbuf          The span buffer to send.
  *
- * @return              1 on success; 0 otherwise.
+ * @return              The number of spans handled.
  */
-static int htraced_xmit_impl(struct htraced_rcv *rcv, struct htraced_sbuf *sbuf)
+static uint64_t htraced_aq_drain(struct htraced_rcv *rcv)
 {
-    struct htrace_log *lg = rcv->tracer->lg;
-    uint8_t prequel[MAX_WRITESPANS_PREQUEL_LEN];
-    int prequel_len, ret;
-    char *err = NULL, *resp = NULL;
-    size_t resp_len = 0;
+    struct htrace_span *span, *next, *list = NULL;
+    uint64_t len, too_large = 0, num_spans = 0;
 
-    prequel_len = add_writespans_prequel(rcv, sbuf, prequel);
-    if (prequel_len < 0) {
-        htrace_log(lg, "htrace_xmit_impl: add_writespans_prequel failed.\n");
-        ret = 0;
-        goto done;
+    span = __atomic_exchange_n(&rcv->aq_head, NULL, __ATOMIC_ACQUIRE);
+    if (!span) {
+        return 0;
     }
-    ret = hrpc_client_call(rcv->hcli, METHOD_ID_WRITE_SPANS,
-                    prequel, prequel_len, sbuf->buf, sbuf->off,
-                    &err, (void**)&resp, &resp_len);
-    if (!ret) {
-        htrace_log(lg, "htrace_xmit_impl: hrpc_client_call failed.\n");
-        goto done;
-    } else if (err) {
-        htrace_log(lg, "htrace_xmit_impl: server returned error: %s\n", err);
-        ret = 0;
-        goto done;
+    // The queue is newest first.  Reverse it so that spans are sent in the
+    // order they were closed.
+    while (span) {
+        next = span->next;
+        span->next = list;
+        list = span;
+        span = next;
     }
-    ret = 1;
-done:
-    free(err);
-    free(resp);
-    return ret;
+    pthread_mutex_lock(&rcv->lock);
+    for (span = list; span; span = span->next) {
+        len = htraced_add_span_locked(rcv, span);
+        if (len) {
+            too_large = len;
+        }
+        num_spans++;
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    for (span = list; span; span = next) {
+        next = span->next;
+        htrace_span_free(span);
+    }
+    __atomic_fetch_sub(&rcv->aq_len, num_spans, __ATOMIC_RELAXED);
+    if (too_large) {
+        htrace_log(rcv->lg, "htraced_aq_drain: span does not "
+                   "fit in an empty buffer of %" PRId64 " bytes.  "
+                   "Dropping it.\n", too_large);
+    }
+    return num_spans;
 }
 
-static void htraced_xmit(struct htraced_rcv *rcv, uint64_t now)
+void *run_htraced_serializer(void *data)
 {
-    int tries = 0;
-    struct htraced_sbuf *sbuf;
-
-    // Flip to the other buffer.
-    sbuf = rcv->sbuf[rcv->active_buf];
-    rcv->active_buf = !rcv->active_buf;
+    struct htraced_rcv *rcv = data;
+    int shutdown;
 
-    // Release the lock while doing network I/O, so that we don't block threads
-    // adding spans.
-    pthread_mutex_unlock(&rcv->lock);
     while (1) {
-        int retry, success = htraced_xmit_impl(rcv, sbuf);
-        if (success) {
-            break;
+        while (htraced_aq_drain(rcv)) {
+            ;
         }
-        tries++;
-        retry = (tries < HTRACED_MAX_SEND_TRIES);
-        htrace_log(rcv->tracer->lg, "htraced_xmit(%s) failed on try %d.  %s\n",
-                   hrpc_client_get_endpoint(rcv->hcli), tries,
-                   (retry ? "Retrying after a delay." : "Giving up."));
-        if (!retry) {
-            break;
+        pthread_mutex_lock(&rcv->aq_lock);
+        __atomic_store_n(&rcv->aq_waiting, 1, __ATOMIC_SEQ_CST);
+        while ((!__atomic_load_n(&rcv->aq_head, __ATOMIC_SEQ_CST)) &&
+                (!rcv->aq_shutdown)) {
+            pthread_cond_wait(&rcv->aq_cond, &rcv->aq_lock);
         }
-    }
-    sbuf->off = 0;
-    sbuf->num_spans = 0;
-    pthread_mutex_lock(&rcv->lock);
-    rcv->last_send_ms = now;
-    pthread_cond_broadcast(&rcv->flush_cond);
-}
-
-static void htraced_rcv_add_span(struct htrace_rcv *r,
-                                 struct htrace_span *span)
-{
-    int tries, retry;
-    uint64_t rem, off;
-    struct htraced_rcv *rcv = (struct htraced_rcv *)r;
-    struct htraced_sbuf *sbuf;
-    struct htrace_log *lg = rcv->tracer->lg;
-    struct cmp_counter_ctx cctx;
-    struct cmp_bcopy_ctx bctx;
-    uint64_t msgpack_len;
-
-    // Determine the length of the span when serialized to msgpack.
-    cmp_counter_ctx_init(&cctx);
-    if (!span_write_msgpack(span, (cmp_ctx_t*)&cctx)) {
-        htrace_log(lg, "htraced_rcv_add_span: span_write_msgpack failed.\n");
-        return;
-    }
-    msgpack_len = cctx.count;
-
-    // Try to get enough space in the current buffer.
-    tries = 0;
-    do {
-        pthread_mutex_lock(&rcv->lock);
-        sbuf = rcv->sbuf[rcv->active_buf];
-        rem = htraced_sbuf_remaining(sbuf);
-        if (rem < msgpack_len) {
-            pthread_cond_signal(&rcv->bg_cond);
-            pthread_mutex_unlock(&rcv->lock);
-            tries++;
-            retry = tries < HTRACED_MAX_ADD_TRIES;
-            htrace_log(lg, "htraced_rcv_add_span: not enough space in the "
-                           "current buffer.  Have %" PRId64 ", need %"
-                           PRId64 ".  %s...\n", rem, msgpack_len,
-                           (retry ? "Retrying" : "Giving up"));
-            if (retry) {
-                pthread_yield();
-                continue;
-            }
-            pthread_mutex_unlock(&rcv->lock);
-            return;
+        __atomic_store_n(&rcv->aq_waiting, 0, __ATOMIC_RELAXED);
+        shutdown = rcv->aq_shutdown;
+        pthread_mutex_unlock(&rcv->aq_lock);
+        if (shutdown) {
+            // Serialize whatever was queued before we were told to stop.
+            htraced_aq_drain(rcv);
+            return NULL;
         }
-    } while (0);
-    // OK, now we have the lock, and we know that there is enough space in the
-    // current buffer.
-    off = sbuf->off;
-    cmp_bcopy_ctx_init(&bctx, sbuf->buf + off, msgpack_len);
-    bctx.base.write = cmp_bcopy_write_nocheck_fn;
-    span_write_msgpack(span, (cmp_ctx_t*)&bctx);
-    off += msgpack_len;
-    sbuf->off = off;
-    sbuf->num_spans++;
-    if (off > rcv->send_threshold) {
-        pthread_cond_signal(&rcv->bg_cond);
     }
-    pthread_mutex_unlock(&rcv->lock);
 }
 
 static void htraced_rcv_flush(struct htrace_rcv *r)
 {
     struct htraced_rcv *rcv = (struct htraced_rcv *)r;
     uint64_t now;
+    int woken = 0;
 
-    // Note: This assumes that we only flush one buffer at once, and
-    // that we flush buffers in order.  If we revisit those assumptions we'll
-    // need to change this.
+    // Note: This assumes that we flush buffers in order.  If we revisit that
+    // assumption we'll need to change this.
     // The SpanReceiver flush is only used for testing anyway.
+    if (!htraced_fork_restart(rcv)) {
+        return;
+    }
+    if (rcv->async) {
+        htraced_aq_drain(rcv);
+    }
     pthread_mutex_lock(&rcv->lock);
-    now = monotonic_now_ms(rcv->tracer->lg);
+    now = monotonic_now_ms(rcv->lg);
     while (1) {
-        if (rcv->last_send_ms >= now) {
+        if (htraced_tbufs_sweep(rcv) && htraced_sbufs_empty(rcv)) {
             break;
         }
-        if (htraced_sbufs_empty(rcv)) {
+        // A send which happened in the same millisecond as the flush began,
+        // but before we woke the transmitter, doesn't count.
+        if (woken && (rcv->last_send_ms >= now) &&
+                (rcv->xmit_head == rcv->active_buf)) {
             break;
         }
+        woken = 1;
         rcv->last_send_ms = 0;
+        htraced_wake_xmit(rcv);
         pthread_cond_wait(&rcv->flush_cond, &rcv->lock);
     }
     pthread_mutex_unlock(&rcv->lock);
@@ -684,27 +3375,96 @@ static void htraced_rcv_free(struct htrace_rcv *r)
     if (!rcv) {
         return;
     }
-    lg = rcv->tracer->lg;
+    lg = rcv->lg;
+    htrace_fork_hook_unregister(&rcv->fork_hook);
     htrace_log(lg, "Shutting down htraced receiver for %s\n",
-               hrpc_client_get_endpoint(rcv->hcli));
-    pthread_mutex_lock(&rcv->lock);
-    rcv->shutdown = 1;
-    pthread_cond_signal(&rcv->bg_cond);
-    pthread_mutex_unlock(&rcv->lock);
-    ret = pthread_join(rcv->xmit_thread, NULL);
-    if (ret) {
-        htrace_log(lg, "htraced_rcv_free: pthread_join "
-                   "error %d: %s\n", ret, terror(ret));
+               rcv->address);
+    if (rcv->tbuf_len && (rcv->sharding == HTRACED_SHARD_THREAD)) {
+        // Wait for any thread which is exiting to hand back its staging
+        // buffer.  That may need the transmitter thread to make room, so do
+        // it before stopping it.  The staging buffers of the threads which
+        // are still running are ours after this.
+        htrace_tsd_destroy(&rcv->tbuf_tsd);
+    }
+    if (__atomic_load_n(&rcv->forked, __ATOMIC_ACQUIRE)) {
+        // We forked, and never used the receiver in the child, so none of
+        // our threads are running.  Let go of what belongs to the parent
+        // without sending anything.
+        if (!rcv->fork_reset) {
+            htraced_fork_reset(rcv);
+        }
+        if (rcv->async) {
+            pthread_cond_destroy(&rcv->aq_cond);
+            pthread_mutex_destroy(&rcv->aq_lock);
+        }
+    } else {
+        if (rcv->async) {
+            // Serialize the queued spans before the transmitter sends its
+            // last buffers.
+            htraced_stop_serializer(rcv);
+        }
+        pthread_mutex_lock(&rcv->lock);
+        rcv->shutdown = 1;
+        htraced_wake_xmit(rcv);
+        pthread_mutex_unlock(&rcv->lock);
+        ret = pthread_join(rcv->xmit_thread, NULL);
+        if (ret) {
+            htrace_log(lg, "htraced_rcv_free: pthread_join "
+                       "error %d: %s\n", ret, terror(ret));
+        }
+        if (rcv->dns_cache_ms) {
+            htraced_stop_resolver(rcv);
+        }
     }
-    for (i = 0; i < HTRACED_NUM_BUFS; i++) {
+    if (rcv->tbuf_len) {
+        // The transmitter thread has already sent whatever the staging
+        // buffers contained.
+        htraced_tbufs_free(rcv);
+    }
+    if (rcv->spill_spans) {
+        htrace_log(lg, "htraced_rcv_free: discarding %" PRId64 " spilled "
+                   "spans which were never sent.\n", rcv->spill_spans);
+        rcv->ctrs.dropped_xmit += rcv->spill_spans;
+    }
+    htrace_log(lg, "htraced_rcv_free: buffered=%" PRId64
+               ", dropped_newest=%" PRId64 ", dropped_oldest=%" PRId64
+               ", blocked=%" PRId64 ", dropped_timeout=%" PRId64
+               ", dropped_too_large=%" PRId64 ", dropped_xmit=%" PRId64
+               ", dropped_low_priority=%" PRId64
+               ", spilled=%" PRId64 ", unspilled=%" PRId64
+               ", xmit_bytes=%" PRId64 ", xmit_wire_bytes=%" PRId64 "\n",
+               rcv->ctrs.buffered, rcv->ctrs.dropped_newest,
+               rcv->ctrs.dropped_oldest, rcv->ctrs.blocked,
+               rcv->ctrs.dropped_timeout, rcv->ctrs.dropped_too_large,
+               rcv->ctrs.dropped_xmit, rcv->ctrs.dropped_low_priority,
+               rcv->ctrs.spilled,
+               rcv->ctrs.unspilled, rcv->ctrs.xmit_bytes,
+               rcv->ctrs.xmit_wire_bytes);
+    if (rcv->batch_max_latency_ms) {
+        htrace_log(lg, "htraced_rcv_free: adaptive batching ended with "
+                   "send_threshold=%" PRId64 ", batch_deadline_ms=%" PRId64
+                   ", rpc_latency_ms=%.1f, arrival_rate=%.1f bytes/ms\n",
+                   rcv->send_threshold, rcv->batch_deadline_ms,
+                   rcv->rpc_latency_ms, rcv->arrival_rate);
+    }
+    close(rcv->wake_fd[0]);
+    close(rcv->wake_fd[1]);
+    for (i = 0; i < rcv->num_bufs; i++) {
         htraced_sbuf_free(rcv->sbuf[i]);
     }
-    hrpc_client_free(rcv->hcli);
+    htrace_free(rcv->sbuf);
+    spill_log_close(rcv->spill);
+    htrace_free(rcv->gbuf);
+    htrace_free(rcv->dbuf);
+    htraced_compress_free(rcv);
+    htraced_conns_free(rcv);
+    htrace_free(rcv->address);
     ret = pthread_mutex_destroy(&rcv->lock);
     if (ret) {
         htrace_log(lg, "htraced_rcv_free: pthread_mutex_destroy "
                    "error %d: %s\n", ret, terror(ret));
     }
+    pthread_mutex_destroy(&rcv->fork_lock);
     ret = pthread_cond_destroy(&rcv->bg_cond);
     if (ret) {
         htrace_log(lg, "htraced_rcv_free: pthread_cond_destroy(bg_cond) "
@@ -715,15 +3475,436 @@ static void htraced_rcv_free(struct htrace_rcv *r)
         htrace_log(lg, "htraced_rcv_free: pthread_cond_destroy(flush_cond) "
                    "error %d: %s\n", ret, terror(ret));
     }
-    free(rcv);
+    ret = pthread_cond_destroy(&rcv->resolve_cond);
+    if (ret) {
+        htrace_log(lg, "htraced_rcv_free: pthread_cond_destroy(resolve_cond) "
+                   "error %d: %s\n", ret, terror(ret));
+    }
+    htrace_free(rcv);
+}
+
+static void htraced_rcv_get_stats(struct htrace_rcv *r,
+                                  struct htrace_stats *stats)
+{
+    struct htraced_rcv *rcv = (struct htraced_rcv *)r;
+    int i;
+
+    // In a forked child, the counters are the parent's until we reset them.
+    htraced_fork_restart(rcv);
+    pthread_mutex_lock(&rcv->lock);
+    stats->buffered = rcv->ctrs.buffered;
+    stats->dropped_newest = rcv->ctrs.dropped_newest;
+    stats->dropped_oldest = rcv->ctrs.dropped_oldest;
+    stats->blocked = rcv->ctrs.blocked;
+    stats->dropped_timeout = rcv->ctrs.dropped_timeout;
+    stats->dropped_too_large = rcv->ctrs.dropped_too_large;
+    stats->dropped_xmit = rcv->ctrs.dropped_xmit;
+    stats->dropped_low_priority = rcv->ctrs.dropped_low_priority;
+    stats->spilled = rcv->ctrs.spilled;
+    stats->unspilled = rcv->ctrs.unspilled;
+    stats->bytes_serialized = rcv->ctrs.bytes_serialized;
+    stats->xmit_bytes = rcv->ctrs.xmit_bytes;
+    stats->xmit_wire_bytes = rcv->ctrs.xmit_wire_bytes;
+    stats->rpcs = rcv->ctrs.rpcs;
+    stats->rpc_errors = rcv->ctrs.rpc_errors;
+    for (i = 0; i < HTRACE_STATS_LATENCY_BUCKETS; i++) {
+        stats->rpc_latency_ms[i] = rcv->ctrs.rpc_latency_ms[i];
+    }
+    stats->buffers_used_max = rcv->ctrs.buffers_used_max;
+    stats->buffer_bytes_max = rcv->ctrs.buffer_bytes_max;
+    pthread_mutex_unlock(&rcv->lock);
+    stats->self_add_span_ns =
+        __atomic_load_n(&rcv->self_add_span_ns, __ATOMIC_RELAXED);
+    stats->self_lock_wait_ns =
+        __atomic_load_n(&rcv->self_lock_wait_ns, __ATOMIC_RELAXED);
+    stats->self_xmit_wait_ns =
+        __atomic_load_n(&rcv->self_xmit_wait_ns, __ATOMIC_RELAXED);
+}
+
+/**
+ * The pressure on the htraced receiver is the highest of three measures: how
+ * full the send buffers and the serializer queue are, how far the WriteSpans
+ * latency has risen above its long-term average, and whether any span was
+ * dropped or had to wait for buffer space since we were last asked.
+ */
+static int htraced_rcv_get_pressure(struct htrace_rcv *r)
+{
+    struct htraced_rcv *rcv = (struct htraced_rcv *)r;
+    uint64_t used = 0, total = 0, dropped;
+    double rise;
+    int i, pressure, p;
+
+    htraced_fork_restart(rcv);
+    pthread_mutex_lock(&rcv->lock);
+    for (i = 0; i < rcv->num_bufs; i++) {
+        used += rcv->sbuf[i]->off;
+        total += rcv->sbuf[i]->len;
+    }
+    pressure = total ? ((used * HTRACE_RCV_PRESSURE_MAX) / total) : 0;
+    if (rcv->async) {
+        p = (__atomic_load_n(&rcv->aq_len, __ATOMIC_RELAXED) *
+                HTRACE_RCV_PRESSURE_MAX) / rcv->aq_max;
+        if (p > HTRACE_RCV_PRESSURE_MAX) {
+            p = HTRACE_RCV_PRESSURE_MAX;
+        }
+        if (p > pressure) {
+            pressure = p;
+        }
+    }
+    rise = rcv->pressure_fast_ms - rcv->pressure_slow_ms;
+    if ((rcv->pressure_slow_ms > 0) &&
+            (rise > HTRACED_PRESSURE_LATENCY_MIN_MS)) {
+        // A latency twice the long-term average counts as full pressure.
+        rise = (rise * HTRACE_RCV_PRESSURE_MAX) / rcv->pressure_slow_ms;
+        if (rise > pressure) {
+            pressure = (rise < HTRACE_RCV_PRESSURE_MAX) ?
+                (int)rise : HTRACE_RCV_PRESSURE_MAX;
+        }
+    }
+    dropped = rcv->ctrs.dropped_newest + rcv->ctrs.dropped_oldest +
+        rcv->ctrs.dropped_timeout + rcv->ctrs.dropped_xmit +
+        rcv->ctrs.dropped_low_priority + rcv->ctrs.blocked;
+    if (dropped != rcv->pressure_dropped) {
+        rcv->pressure_dropped = dropped;
+        pressure = HTRACE_RCV_PRESSURE_MAX;
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    return pressure;
+}
+
+/**
+ * An htraced receiver shared by all of the htracers which send to the same
+ * address with htraced.shared set.
+ */
+struct htraced_shared {
+    struct htraced_shared *next;
+
+    /**
+     * The number of htraced_client objects using this entry.
+     */
+    int refs;
+
+    /**
+     * The receiver.  Its log, tracer id and random source are the ones below,
+     * rather than those of any one htracer, since it may outlive the htracer
+     * which created it.
+     */
+    struct htraced_rcv *rcv;
+
+    struct htrace_log *lg;
+
+    char *trid;
+
+    struct random_src *rnd;
+};
+
+/**
+ * Protects g_htraced_shared and g_htraced_shared_bytes.
+ */
+static pthread_mutex_t g_htraced_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The shared htraced receivers.
+ */
+static struct htraced_shared *g_htraced_shared;
+
+/**
+ * The total size of the send buffers of the shared htraced receivers.
+ */
+static uint64_t g_htraced_shared_bytes;
+
+/**
+ * One htracer's handle on a shared htraced receiver.
+ */
+struct htraced_client {
+    struct htrace_rcv base;
+
+    struct htracer *tracer;
+
+    struct htraced_shared *shared;
+
+    /**
+     * Nonzero if the htracer's tracer id is not the shared receiver's
+     * DefaultTrid, so that each span must carry it.
+     */
+    int own_trid;
+};
+
+static void htraced_client_add_span(struct htrace_rcv *r,
+                                    struct htrace_span *span)
+{
+    struct htraced_client *client = (struct htraced_client *)r;
+    struct htrace_rcv *srcv = &client->shared->rcv->base;
+
+    if ((!client->own_trid) || span->trid) {
+        htraced_rcv_add_span(srcv, span);
+        return;
+    }
+    // The span is serialized before htraced_rcv_add_span returns, so it can
+    // borrow the tracer id.
+    span->trid = client->tracer->trid;
+    htraced_rcv_add_span(srcv, span);
+    span->trid = NULL;
+}
+
+static void htraced_client_add_spans(struct htrace_rcv *r,
+                                     struct htrace_span **spans,
+                                     int num_spans)
+{
+    struct htraced_client *client = (struct htraced_client *)r;
+    struct htrace_rcv *srcv = &client->shared->rcv->base;
+    int i;
+
+    if (!client->own_trid) {
+        htraced_rcv_add_spans(srcv, spans, num_spans);
+        return;
+    }
+    for (i = 0; i < num_spans; i++) {
+        if (!spans[i]->trid) {
+            spans[i]->trid = client->tracer->trid;
+        }
+    }
+    htraced_rcv_add_spans(srcv, spans, num_spans);
+    for (i = 0; i < num_spans; i++) {
+        if (spans[i]->trid == client->tracer->trid) {
+            spans[i]->trid = NULL;
+        }
+    }
+}
+
+static int htraced_client_take_span(struct htrace_rcv *r,
+                                    struct htrace_span *span)
+{
+    struct htraced_client *client = (struct htraced_client *)r;
+    struct htrace_rcv *srcv = &client->shared->rcv->base;
+
+    if ((!client->own_trid) || span->trid) {
+        return htraced_rcv_take_span(srcv, span);
+    }
+    // A queued span may outlive the htracer, so it needs its own copy of the
+    // tracer id.
+    span->trid = htrace_strdup(client->tracer->trid);
+    if (!span->trid) {
+        return 0;
+    }
+    if (!htraced_rcv_take_span(srcv, span)) {
+        htrace_free(span->trid);
+        span->trid = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+static void htraced_client_flush(struct htrace_rcv *r)
+{
+    struct htraced_client *client = (struct htraced_client *)r;
+
+    htraced_rcv_flush(&client->shared->rcv->base);
+}
+
+static void htraced_client_get_stats(struct htrace_rcv *r,
+                                     struct htrace_stats *stats)
+{
+    struct htraced_client *client = (struct htraced_client *)r;
+
+    htraced_rcv_get_stats(&client->shared->rcv->base, stats);
+}
+
+static int htraced_client_get_pressure(struct htrace_rcv *r)
+{
+    struct htraced_client *client = (struct htraced_client *)r;
+
+    return htraced_rcv_get_pressure(&client->shared->rcv->base);
+}
+
+/**
+ * Apply a new configuration to the shared htraced receiver.  Every htracer
+ * which shares it sees the new settings.
+ */
+static int htraced_client_update_conf(struct htrace_rcv *r,
+                                      const struct htrace_conf *conf)
+{
+    struct htraced_client *client = (struct htraced_client *)r;
+    struct htraced_rcv *rcv = client->shared->rcv;
+    uint64_t mem_max, others, buf_max = 0;
+    int ret;
+
+    pthread_mutex_lock(&g_htraced_shared_lock);
+    others = g_htraced_shared_bytes - rcv->buf_total;
+    mem_max = htrace_conf_get_u64(client->tracer->lg, conf,
+                                  HTRACED_SHARED_MEMORY_MAX_KEY);
+    if (mem_max) {
+        buf_max = (mem_max > others) ? (mem_max - others) : 1;
+    }
+    ret = htraced_rcv_update(rcv, conf, buf_max);
+    g_htraced_shared_bytes = others + rcv->buf_total;
+    pthread_mutex_unlock(&g_htraced_shared_lock);
+    return ret;
+}
+
+static void htraced_shared_free(struct htraced_shared *shared)
+{
+    if (shared->rcv) {
+        htraced_rcv_free(&shared->rcv->base);
+    }
+    random_src_free(shared->rnd);
+    htrace_free(shared->trid);
+    htrace_log_free(shared->lg);
+    htrace_free(shared);
+}
+
+static void htraced_client_free(struct htrace_rcv *r)
+{
+    struct htraced_client *client = (struct htraced_client *)r;
+    struct htraced_shared *shared = client->shared, **prev;
+
+    pthread_mutex_lock(&g_htraced_shared_lock);
+    if (--shared->refs > 0) {
+        shared = NULL;
+    } else {
+        for (prev = &g_htraced_shared; *prev != shared;
+                prev = &(*prev)->next) {
+            ;
+        }
+        *prev = shared->next;
+        g_htraced_shared_bytes -= shared->rcv->buf_total;
+    }
+    pthread_mutex_unlock(&g_htraced_shared_lock);
+    if (shared) {
+        htraced_shared_free(shared);
+    }
+    htrace_free(client);
+}
+
+static const struct htrace_rcv_ty g_htraced_client_ty = {
+    "htraced",
+    NULL,
+    htraced_client_add_span,
+    htraced_client_add_spans,
+    htraced_client_take_span,
+    htraced_client_flush,
+    htraced_client_free,
+    htraced_client_get_stats,
+    htraced_client_get_pressure,
+    NULL,
+    htraced_client_update_conf,
+};
+
+/**
+ * Find or create the shared htraced receiver for an address.
+ * This function must be called with g_htraced_shared_lock held.
+ *
+ * @param tracer        The htracer.  If we create the receiver, its tracer
+ *                          id becomes the receiver's DefaultTrid.
+ * @param conf          The configuration.
+ * @param endpoint      The htraced address.
+ *
+ * @return              The shared receiver, with a reference taken, or NULL
+ *                          on error.
+ */
+static struct htraced_shared *htraced_shared_get(struct htracer *tracer,
+        const struct htrace_conf *conf, const char *endpoint)
+{
+    struct htraced_shared *shared;
+    uint64_t mem_max, buf_max = 0;
+
+    for (shared = g_htraced_shared; shared; shared = shared->next) {
+        if (strcmp(shared->rcv->address, endpoint) == 0) {
+            shared->refs++;
+            return shared;
+        }
+    }
+    mem_max = htrace_conf_get_u64(tracer->lg, conf,
+                                  HTRACED_SHARED_MEMORY_MAX_KEY);
+    if (mem_max) {
+        // A budget which is already used up still gets the smallest buffers.
+        buf_max = (mem_max > g_htraced_shared_bytes) ?
+            (mem_max - g_htraced_shared_bytes) : 1;
+    }
+    shared = htrace_calloc(1, sizeof(*shared));
+    if (!shared) {
+        goto oom;
+    }
+    shared->lg = htrace_log_alloc(conf);
+    if (!shared->lg) {
+        goto oom;
+    }
+    shared->trid = htrace_strdup(tracer->trid);
+    if (!shared->trid) {
+        goto oom;
+    }
+    shared->rnd = random_src_alloc(shared->lg);
+    if (!shared->rnd) {
+        goto error;
+    }
+    shared->rcv = htraced_rcv_alloc(shared->lg, shared->trid, shared->rnd,
+                                    conf, buf_max);
+    if (!shared->rcv) {
+        goto error;
+    }
+    g_htraced_shared_bytes += shared->rcv->buf_total;
+    shared->refs = 1;
+    shared->next = g_htraced_shared;
+    g_htraced_shared = shared;
+    return shared;
+
+oom:
+    htrace_log(tracer->lg, "htraced_rcv_create: OOM while allocating the "
+               "shared htraced receiver.\n");
+error:
+    if (shared) {
+        htraced_shared_free(shared);
+    }
+    return NULL;
+}
+
+static struct htrace_rcv *htraced_rcv_create(struct htracer *tracer,
+                                             const struct htrace_conf *conf)
+{
+    struct htraced_client *client;
+    const char *endpoint;
+    int refs;
+
+    endpoint = htrace_conf_get(conf, HTRACED_ADDRESS_KEY);
+    if ((!endpoint) ||
+            (!htrace_conf_get_bool(tracer->lg, conf, HTRACED_SHARED_KEY))) {
+        return (struct htrace_rcv *)htraced_rcv_alloc(tracer->lg,
+                    tracer->trid, tracer->rnd, conf, 0);
+    }
+    client = htrace_calloc(1, sizeof(*client));
+    if (!client) {
+        htrace_log(tracer->lg, "htraced_rcv_create: OOM while "
+                   "allocating htraced_client.\n");
+        return NULL;
+    }
+    client->base.ty = &g_htraced_client_ty;
+    client->tracer = tracer;
+    pthread_mutex_lock(&g_htraced_shared_lock);
+    client->shared = htraced_shared_get(tracer, conf, endpoint);
+    refs = client->shared ? client->shared->refs : 0;
+    pthread_mutex_unlock(&g_htraced_shared_lock);
+    if (!client->shared) {
+        htrace_free(client);
+        return NULL;
+    }
+    client->own_trid = (strcmp(tracer->trid, client->shared->trid) != 0);
+    htrace_log(tracer->lg, "Using the shared htraced receiver for %s, "
+               "refs=%d, own_trid=%d.\n", endpoint, refs, client->own_trid);
+    return (struct htrace_rcv *)client;
 }
 
 const struct htrace_rcv_ty g_htraced_rcv_ty = {
     "htraced",
     htraced_rcv_create,
     htraced_rcv_add_span,
+    htraced_rcv_add_spans,
+    htraced_rcv_take_span,
     htraced_rcv_flush,
     htraced_rcv_free,
+    htraced_rcv_get_stats,
+    htraced_rcv_get_pressure,
+    NULL,
+    htraced_rcv_update_conf,
 };
 
 // vim:ts=4:sw=4:et
@@ -0,0 +1,399 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/span_id.h"
+#include "receiver/hrpc.h"
+#include "receiver/htraced_dict.h"
+#include "util/alloc.h"
+#include "util/cmp.h"
+#include "util/cmp_util.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @file htraced_dict.c
+ *
+ * Implements dictionary encoding and grouping by trace for the htraced
+ * receiver.  Both are only used by the transmitter thread.
+ */
+
+#define DESCS_STR                   "Descs"
+#define DESCS_STR_LEN               (sizeof(DESCS_STR) - 1)
+#define TRACE_IDS_STR               "TraceIds"
+#define TRACE_IDS_STR_LEN           (sizeof(TRACE_IDS_STR) - 1)
+
+/**
+ * A table of the distinct byte strings seen in a WriteSpans request, for
+ * dictionary encoding.  The strings point into the send buffer.
+ */
+struct htraced_dict {
+    /**
+     * Open-addressed hash slots.  Each holds an index into ents plus one, or
+     * 0 if the slot is empty.
+     */
+    uint32_t *slots;
+
+    /**
+     * The number of slots, minus one.  The number of slots is a power of two
+     * at least twice the number of spans.
+     */
+    uint32_t mask;
+
+    /**
+     * The strings in the table, in the order they were first seen.
+     */
+    struct htraced_dict_ent {
+        const char *str;
+        uint32_t len;
+    } *ents;
+
+    uint32_t num_ents;
+};
+
+static int htraced_dict_init(struct htraced_dict *dict, uint64_t num_spans)
+{
+    uint64_t num_slots = 2;
+
+    while (num_slots < 2 * num_spans) {
+        num_slots <<= 1;
+    }
+    if (num_slots > UINT32_MAX) {
+        return 0;
+    }
+    dict->mask = num_slots - 1;
+    dict->num_ents = 0;
+    dict->slots = htrace_calloc(num_slots, sizeof(dict->slots[0]));
+    dict->ents = htrace_malloc(num_spans * sizeof(dict->ents[0]));
+    if ((!dict->slots) || (!dict->ents)) {
+        htrace_free(dict->slots);
+        htrace_free(dict->ents);
+        return 0;
+    }
+    return 1;
+}
+
+static void htraced_dict_free(struct htraced_dict *dict)
+{
+    htrace_free(dict->slots);
+    htrace_free(dict->ents);
+}
+
+/**
+ * Find a string in a table, adding it if it isn't there yet.
+ *
+ * @return              The index of the string in the table.
+ */
+static uint32_t htraced_dict_get(struct htraced_dict *dict, const char *str,
+                                 uint32_t len)
+{
+    struct htraced_dict_ent *ent;
+    uint32_t i, hash = 2166136261U;
+
+    // FNV-1a.
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)str[i]) * 16777619U;
+    }
+    for (i = hash & dict->mask; dict->slots[i]; i = (i + 1) & dict->mask) {
+        ent = &dict->ents[dict->slots[i] - 1];
+        if ((ent->len == len) && (memcmp(ent->str, str, len) == 0)) {
+            return dict->slots[i] - 1;
+        }
+    }
+    ent = &dict->ents[dict->num_ents];
+    ent->str = str;
+    ent->len = len;
+    dict->slots[i] = ++dict->num_ents;
+    return dict->num_ents - 1;
+}
+
+/**
+ * Read the key of the next field of a serialized span.
+ *
+ * @return              1 on success; 0 if the span could not be parsed.
+ */
+static int htraced_dict_read_key(struct cmp_bcopy_ctx *in,
+                                 const char **key, uint32_t *key_len)
+{
+    if (!cmp_read_str_size(&in->base, key_len)) {
+        return 0;
+    }
+    if (*key_len > in->len - in->off) {
+        return 0;
+    }
+    *key = ((const char *)in->base.buf) + in->off;
+    in->off += *key_len;
+    return 1;
+}
+
+/**
+ * Read the value of a span field we replace with a table index: either the
+ * description string, or the span ID, whose first 8 bytes are the trace ID.
+ *
+ * @return              1 on success; 0 if the span could not be parsed.
+ */
+static int htraced_dict_read_val(struct cmp_bcopy_ctx *in, char key,
+                                 const char **val, uint32_t *val_len)
+{
+    if (key == 'd') {
+        if (!cmp_read_str_size(&in->base, val_len)) {
+            return 0;
+        }
+    } else {
+        if ((!cmp_read_bin_size(&in->base, val_len)) ||
+                (*val_len != HTRACE_SPAN_ID_NUM_BYTES)) {
+            return 0;
+        }
+    }
+    if (*val_len > in->len - in->off) {
+        return 0;
+    }
+    *val = ((const char *)in->base.buf) + in->off;
+    in->off += *val_len;
+    return 1;
+}
+
+static uint64_t htraced_dict_be64(const char *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        v = (v << 8) | (uint8_t)p[i];
+    }
+    return v;
+}
+
+/**
+ * Make one pass over the serialized spans.  On the first pass, this fills in
+ * the tables.  On the second, it also writes each span to the output, with
+ * its description replaced by a "D" index into the description table, and
+ * its span ID replaced by a "T" index into the trace ID table and an "L" low
+ * word.  Other fields are copied as they are.
+ *
+ * @return              1 on success; 0 if the spans could not be parsed or
+ *                          the output was full.
+ */
+static int htraced_dict_pass(const char *data, uint64_t len,
+                             uint64_t num_spans, struct htraced_dict *descs,
+                             struct htraced_dict *trids,
+                             struct cmp_ctx_s *out)
+{
+    struct cmp_bcopy_ctx in;
+    const char *key, *val;
+    uint32_t i, map_size, key_len, val_len, idx;
+    uint64_t start, n = 0;
+    int num_descs, num_ids;
+
+    cmp_bcopy_ctx_init(&in, (void *)data, len);
+    while (in.off < len) {
+        if ((++n > num_spans) || (!cmp_read_map(&in.base, &map_size))) {
+            return 0;
+        }
+        num_descs = num_ids = 0;
+        // The span ID becomes two fields.
+        if (out && (!cmp_write_map(out, map_size + 1))) {
+            return 0;
+        }
+        for (i = 0; i < map_size; i++) {
+            start = in.off;
+            if (!htraced_dict_read_key(&in, &key, &key_len)) {
+                return 0;
+            }
+            if ((key_len != 1) || ((key[0] != 'd') && (key[0] != 'a'))) {
+                if (!cmp_bcopy_skip_object(&in)) {
+                    return 0;
+                }
+                if (out && (!out->write(out, data + start, in.off - start))) {
+                    return 0;
+                }
+                continue;
+            }
+            if (!htraced_dict_read_val(&in, key[0], &val, &val_len)) {
+                return 0;
+            }
+            // Each span adds at most one string to each table, so the
+            // tables never hold more strings than there are spans.
+            if ((key[0] == 'd') ? (num_descs++ > 0) : (num_ids++ > 0)) {
+                return 0;
+            }
+            if (key[0] == 'd') {
+                idx = htraced_dict_get(descs, val, val_len);
+                if (out && ((!cmp_write_fixstr(out, "D", 1)) ||
+                            (!cmp_write_uint(out, idx)))) {
+                    return 0;
+                }
+            } else {
+                idx = htraced_dict_get(trids, val, 8);
+                if (out && ((!cmp_write_fixstr(out, "T", 1)) ||
+                            (!cmp_write_uint(out, idx)) ||
+                            (!cmp_write_fixstr(out, "L", 1)) ||
+                            (!cmp_write_uint(out,
+                                    htraced_dict_be64(val + 8))))) {
+                    return 0;
+                }
+            }
+        }
+        if (num_ids != 1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+uint64_t htraced_dict_encode(const char *trid, const char *data,
+                             uint64_t len, uint64_t num_spans,
+                             uint8_t *out, uint64_t out_len, uint64_t max_len)
+{
+    struct htraced_dict descs, trids;
+    struct cmp_bcopy_ctx bctx;
+    struct cmp_ctx_s *ctx = (struct cmp_ctx_s *)&bctx;
+    uint64_t ret = 0;
+    uint32_t i;
+
+    if ((!out) || (num_spans == 0)) {
+        return 0;
+    }
+    if (!htraced_dict_init(&descs, num_spans)) {
+        return 0;
+    }
+    if (!htraced_dict_init(&trids, num_spans)) {
+        htraced_dict_free(&descs);
+        return 0;
+    }
+    if (!htraced_dict_pass(data, len, num_spans, &descs, &trids, NULL)) {
+        goto done;
+    }
+    cmp_bcopy_ctx_init(&bctx, out, (max_len < out_len) ? max_len : out_len);
+    if ((!cmp_write_fixmap(ctx, 4)) ||
+            (!cmp_write_fixstr(ctx, DEFAULT_TRID_STR, DEFAULT_TRID_STR_LEN)) ||
+            (!cmp_write_str(ctx, trid, strlen(trid))) ||
+            (!cmp_write_fixstr(ctx, NUM_SPANS_STR, NUM_SPANS_STR_LEN)) ||
+            (!cmp_write_uint(ctx, num_spans)) ||
+            (!cmp_write_fixstr(ctx, DESCS_STR, DESCS_STR_LEN)) ||
+            (!cmp_write_array(ctx, descs.num_ents))) {
+        goto done;
+    }
+    for (i = 0; i < descs.num_ents; i++) {
+        if (!cmp_write_str(ctx, descs.ents[i].str, descs.ents[i].len)) {
+            goto done;
+        }
+    }
+    if ((!cmp_write_fixstr(ctx, TRACE_IDS_STR, TRACE_IDS_STR_LEN)) ||
+            (!cmp_write_array(ctx, trids.num_ents))) {
+        goto done;
+    }
+    for (i = 0; i < trids.num_ents; i++) {
+        if (!cmp_write_uint(ctx, htraced_dict_be64(trids.ents[i].str))) {
+            goto done;
+        }
+    }
+    if (!htraced_dict_pass(data, len, num_spans, &descs, &trids, ctx)) {
+        goto done;
+    }
+    if (bctx.off < max_len) {
+        ret = bctx.off;
+    }
+done:
+    htraced_dict_free(&descs);
+    htraced_dict_free(&trids);
+    return ret;
+}
+
+void htraced_group_by_trace(char *buf, uint64_t used, uint64_t num_spans,
+                            char *scratch, uint64_t scratch_len)
+{
+    struct htraced_dict trids;
+    struct cmp_bcopy_ctx in;
+    const char *key, *val;
+    uint32_t i, map_size, key_len, val_len, *idxs;
+    uint64_t n = 0, j, len, total, *offs, *pos = NULL;
+    int num_ids;
+
+    if ((!scratch) || (num_spans < 2) || (used > scratch_len)) {
+        return;
+    }
+    if (!htraced_dict_init(&trids, num_spans)) {
+        return;
+    }
+    offs = htrace_malloc((num_spans + 1) * sizeof(offs[0]));
+    idxs = htrace_malloc(num_spans * sizeof(idxs[0]));
+    if ((!offs) || (!idxs)) {
+        goto done;
+    }
+    cmp_bcopy_ctx_init(&in, buf, used);
+    while (in.off < used) {
+        offs[n] = in.off;
+        if ((n >= num_spans) || (!cmp_read_map(&in.base, &map_size))) {
+            goto done;
+        }
+        num_ids = 0;
+        for (i = 0; i < map_size; i++) {
+            if (!htraced_dict_read_key(&in, &key, &key_len)) {
+                goto done;
+            }
+            if ((key_len != 1) || (key[0] != 'a')) {
+                if (!cmp_bcopy_skip_object(&in)) {
+                    goto done;
+                }
+                continue;
+            }
+            if ((num_ids++ > 0) ||
+                    (!htraced_dict_read_val(&in, 'a', &val, &val_len))) {
+                goto done;
+            }
+            idxs[n] = htraced_dict_get(&trids, val, 8);
+        }
+        if (num_ids != 1) {
+            goto done;
+        }
+        n++;
+    }
+    offs[n] = used;
+    if ((trids.num_ents < 2) || (trids.num_ents == n)) {
+        // Every span is already next to the other spans of its trace.
+        goto done;
+    }
+    // Find where each trace starts in the grouped buffer.
+    pos = htrace_calloc(trids.num_ents, sizeof(pos[0]));
+    if (!pos) {
+        goto done;
+    }
+    for (j = 0; j < n; j++) {
+        pos[idxs[j]] += offs[j + 1] - offs[j];
+    }
+    total = 0;
+    for (i = 0; i < trids.num_ents; i++) {
+        len = pos[i];
+        pos[i] = total;
+        total += len;
+    }
+    for (j = 0; j < n; j++) {
+        len = offs[j + 1] - offs[j];
+        memcpy(scratch + pos[idxs[j]], buf + offs[j], len);
+        pos[idxs[j]] += len;
+    }
+    memcpy(buf, scratch, used);
+done:
+    htrace_free(pos);
+    htrace_free(idxs);
+    htrace_free(offs);
+    htraced_dict_free(&trids);
+}
+
+// vim:ts=4:sw=4:et
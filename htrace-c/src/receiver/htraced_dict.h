@@ -0,0 +1,81 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_RECEIVER_HTRACED_DICT
+#define APACHE_HTRACE_RECEIVER_HTRACED_DICT
+
+/**
+ * @file htraced_dict.h
+ *
+ * Rewrites batches of serialized spans before the htraced receiver sends
+ * them: dictionary encoding of WriteSpans requests, and grouping the spans
+ * of each trace together.
+ *
+ * None of these functions keep any state between calls, or do any locking.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stdint.h>
+
+/**
+ * Dictionary-encode a WriteSpans request.  The prequel gets a table of the
+ * distinct descriptions in the request, and a table of the distinct trace
+ * IDs, which are the high words of the span IDs.  Spans refer to these by
+ * index, rather than repeating them.  The encoded request must be sent as
+ * METHOD_ID_WRITE_SPANS_DICT.
+ *
+ * @param trid          The default tracer ID to put in the prequel.
+ * @param data          The serialized spans.
+ * @param len           The length of the serialized spans.
+ * @param num_spans     The number of spans.
+ * @param out           The buffer to write the encoded request to, or NULL
+ *                          if dictionary encoding is off.
+ * @param out_len       The length of out.
+ * @param max_len       The length of the request without the tables.  We
+ *                          don't use the tables unless they make the
+ *                          request shorter than this.
+ *
+ * @return              The length of the encoded request, prequel included,
+ *                          or 0 if the request should be sent as it is.
+ */
+uint64_t htraced_dict_encode(const char *trid, const char *data,
+                             uint64_t len, uint64_t num_spans,
+                             uint8_t *out, uint64_t out_len, uint64_t max_len);
+
+/**
+ * Group serialized spans by trace, so that htraced gets the spans of each
+ * trace next to each other, rather than in the order they were closed.  The
+ * traces keep the order in which their first spans appear, and the spans of
+ * each trace keep their order too.  This is a bucket sort on the trace ID,
+ * which is the high word of the span ID.  A buffer which can't be parsed, or
+ * which we run out of memory for, is left as it is.
+ *
+ * @param buf           The serialized spans.  They are rearranged in place.
+ * @param used          The length of the serialized spans.
+ * @param num_spans     The number of spans.
+ * @param scratch       A scratch buffer, or NULL if grouping is off.
+ * @param scratch_len   The length of the scratch buffer.  Buffers longer
+ *                          than this are left as they are.
+ */
+void htraced_group_by_trace(char *buf, uint64_t used, uint64_t num_spans,
+                            char *scratch, uint64_t scratch_len);
+
+#endif
+
+// vim: ts=4:sw=4:et
@@ -0,0 +1,244 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/span.h"
+#include "receiver/hrpc.h"
+#include "receiver/htraced_fork.h"
+#include "receiver/htraced_int.h"
+#include "receiver/spill.h"
+#include "util/alloc.h"
+#include "util/log.h"
+#include "util/time.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @file htraced_fork.c
+ *
+ * Restarts the htraced receiver in a forked child.
+ */
+
+void htraced_fork_prepare(void *data)
+{
+    struct htraced_rcv *rcv = data;
+
+    pthread_mutex_lock(&rcv->lock);
+}
+
+void htraced_fork_parent(void *data)
+{
+    struct htraced_rcv *rcv = data;
+
+    pthread_mutex_unlock(&rcv->lock);
+}
+
+/**
+ * Make the receiver's locks usable in a forked child.  Our threads are gone,
+ * and any lock they held stays locked, so we initialize the locks and
+ * condition variables again.  Everything else is left until the receiver is
+ * next used; see htraced_fork_restart.
+ */
+void htraced_fork_child(void *data)
+{
+    struct htraced_rcv *rcv = data;
+    struct htraced_tbuf *tbuf;
+
+    pthread_mutex_unlock(&rcv->lock);
+    pthread_mutex_init(&rcv->fork_lock, NULL);
+    pthread_cond_init(&rcv->bg_cond, NULL);
+    pthread_cond_init(&rcv->flush_cond, NULL);
+    pthread_cond_init(&rcv->resolve_cond, NULL);
+    if (rcv->async) {
+        pthread_mutex_init(&rcv->aq_lock, NULL);
+        pthread_cond_init(&rcv->aq_cond, NULL);
+    }
+    for (tbuf = rcv->tbufs; tbuf; tbuf = tbuf->next) {
+        pthread_mutex_init(&tbuf->lock, NULL);
+    }
+    rcv->fork_tbuf = NULL;
+    if (rcv->tbuf_len && (rcv->sharding == HTRACED_SHARD_THREAD)) {
+        rcv->fork_tbuf = htrace_tsd_get(&rcv->tbuf_tsd);
+    }
+    __atomic_store_n(&rcv->forked, 1, __ATOMIC_RELEASE);
+}
+
+int htraced_fork_reset(struct htraced_rcv *rcv)
+{
+    struct htraced_tbuf *tbuf, *next;
+    struct htrace_span *span;
+    uint64_t len;
+    int i;
+
+    for (i = 0; i < rcv->num_bufs; i++) {
+        len = rcv->sbuf[i]->len;
+        memset(rcv->sbuf[i], 0, offsetof(struct htraced_sbuf, buf));
+        rcv->sbuf[i]->len = len;
+    }
+    rcv->active_buf = 0;
+    rcv->xmit_head = 0;
+    rcv->num_sent = 0;
+    rcv->num_inflight = 0;
+    rcv->active_start_ms = 0;
+    rcv->last_send_ms = monotonic_now_ms(rcv->lg);
+    memset(&rcv->ctrs, 0, sizeof(rcv->ctrs));
+    rcv->self_add_span_ns = 0;
+    rcv->self_lock_wait_ns = 0;
+    rcv->self_xmit_wait_ns = 0;
+    rcv->pressure_dropped = 0;
+    // The staging buffers of the threads which didn't fork will never be
+    // used again.
+    for (tbuf = rcv->tbufs; tbuf; tbuf = next) {
+        next = tbuf->next;
+        if ((rcv->sharding == HTRACED_SHARD_THREAD) &&
+                (tbuf != rcv->fork_tbuf)) {
+            pthread_mutex_destroy(&tbuf->lock);
+            htrace_free(tbuf);
+            continue;
+        }
+        tbuf->sb.off = 0;
+        tbuf->sb.num_spans = 0;
+    }
+    if (rcv->sharding == HTRACED_SHARD_THREAD) {
+        rcv->tbufs = rcv->fork_tbuf;
+        if (rcv->fork_tbuf) {
+            rcv->fork_tbuf->next = NULL;
+            rcv->fork_tbuf->prev = NULL;
+        }
+    }
+    if (rcv->async) {
+        span = __atomic_exchange_n(&rcv->aq_head, NULL, __ATOMIC_ACQUIRE);
+        while (span) {
+            struct htrace_span *snext = span->next;
+            htrace_span_free(span);
+            span = snext;
+        }
+        rcv->aq_len = 0;
+        rcv->aq_waiting = 0;
+        rcv->aq_shutdown = 0;
+    }
+    for (i = 0; i < rcv->num_conns; i++) {
+        hrpc_client_forked(rcv->conns[i].hcli);
+        rcv->conns[i].num_inflight = 0;
+        rcv->conns[i].failures = 0;
+        rcv->conns[i].down_until_ms = 0;
+        rcv->conns[i].wait_start_ms = 0;
+    }
+    if (rcv->spill) {
+        htrace_log(rcv->lg, "htraced_fork_reset: the spill queue belongs "
+                   "to the parent process.  Turning spilling off.\n");
+        spill_log_abandon(rcv->spill);
+        rcv->spill = NULL;
+        rcv->spill_spans = 0;
+        rcv->spill_inflight = 0;
+    }
+    close(rcv->wake_fd[0]);
+    close(rcv->wake_fd[1]);
+    rcv->xmit_polling = 0;
+    rcv->xmit_woken = 0;
+    if (!htraced_open_wake_pipe(rcv->lg, rcv->wake_fd)) {
+        rcv->wake_fd[0] = -1;
+        rcv->wake_fd[1] = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Start the receiver's threads again in a forked child.
+ *
+ * @param rcv           The htraced receiver.
+ *
+ * @return              1 on success; 0 if no threads could be started.
+ */
+static int htraced_fork_start_threads(struct htraced_rcv *rcv)
+{
+    struct htrace_log *lg = rcv->lg;
+    int ret;
+
+    if (rcv->dns_cache_ms) {
+        ret = pthread_create(&rcv->resolve_thread, NULL,
+                             run_htraced_resolver, rcv);
+        if (ret) {
+            htrace_log(lg, "htraced_fork_start_threads: failed to create "
+                       "resolver thread: error %d: %s\n", ret, terror(ret));
+            return 0;
+        }
+    }
+    if (rcv->async) {
+        ret = pthread_create(&rcv->aq_thread, NULL,
+                             run_htraced_serializer, rcv);
+        if (ret) {
+            htrace_log(lg, "htraced_fork_start_threads: failed to create "
+                       "serializer thread: error %d: %s\n", ret, terror(ret));
+            goto error_stop_resolver;
+        }
+    }
+    ret = pthread_create(&rcv->xmit_thread, NULL, run_htraced_xmit_manager,
+                         rcv);
+    if (ret) {
+        htrace_log(lg, "htraced_fork_start_threads: failed to create xmit "
+                   "thread: error %d: %s\n", ret, terror(ret));
+        goto error_stop_serializer;
+    }
+    return 1;
+
+error_stop_serializer:
+    if (rcv->async) {
+        htraced_stop_serializer(rcv);
+        pthread_mutex_init(&rcv->aq_lock, NULL);
+        pthread_cond_init(&rcv->aq_cond, NULL);
+        rcv->aq_shutdown = 0;
+    }
+error_stop_resolver:
+    if (rcv->dns_cache_ms) {
+        htraced_stop_resolver(rcv);
+        rcv->shutdown = 0;
+    }
+    return 0;
+}
+
+int htraced_fork_restart(struct htraced_rcv *rcv)
+{
+    int running;
+
+    if (!__atomic_load_n(&rcv->forked, __ATOMIC_ACQUIRE)) {
+        return 1;
+    }
+    pthread_mutex_lock(&rcv->fork_lock);
+    if (__atomic_load_n(&rcv->forked, __ATOMIC_ACQUIRE)) {
+        if (!rcv->fork_reset) {
+            rcv->fork_reset = htraced_fork_reset(rcv);
+        }
+        if (rcv->fork_reset && htraced_fork_start_threads(rcv)) {
+            htrace_log(rcv->lg, "htraced_fork_restart: restarted the "
+                       "htraced receiver in forked child %lld.\n",
+                       (long long)getpid());
+            rcv->fork_reset = 0;
+            __atomic_store_n(&rcv->forked, 0, __ATOMIC_RELEASE);
+        }
+    }
+    running = !__atomic_load_n(&rcv->forked, __ATOMIC_ACQUIRE);
+    pthread_mutex_unlock(&rcv->fork_lock);
+    return running;
+}
+
+// vim:ts=4:sw=4:et
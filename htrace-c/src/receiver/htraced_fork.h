@@ -0,0 +1,70 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_RECEIVER_HTRACED_FORK
+#define APACHE_HTRACE_RECEIVER_HTRACED_FORK
+
+/**
+ * @file htraced_fork.h
+ *
+ * Keeps the htraced receiver working across fork.
+ *
+ * The fork hooks only make the receiver's locks usable in the child.  The
+ * child's threads are started again, and the state it inherited from its
+ * parent is thrown away, the first time the receiver is used after fork.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+struct htraced_rcv;
+
+/**
+ * The fork hooks of the htraced receiver.  Each takes the receiver.
+ */
+void htraced_fork_prepare(void *data);
+void htraced_fork_parent(void *data);
+void htraced_fork_child(void *data);
+
+/**
+ * Throw away the state which a forked child inherited from its parent.  The
+ * parent will send whatever was buffered, and it still owns the connections,
+ * the wakeup pipe, and the spill files.  None of our threads may be running.
+ *
+ * @param rcv           The htraced receiver.
+ *
+ * @return              1 on success; 0 if we couldn't make a new wakeup
+ *                          pipe.
+ */
+int htraced_fork_reset(struct htraced_rcv *rcv);
+
+/**
+ * In a forked child, reset the receiver and start its threads again, the
+ * first time it is used.  If that fails, we try again next time.
+ *
+ * This is cheap when we haven't forked.
+ *
+ * @param rcv           The htraced receiver.
+ *
+ * @return              1 if the receiver's threads are running; 0 if they
+ *                          could not be restarted.
+ */
+int htraced_fork_restart(struct htraced_rcv *rcv);
+
+#endif
+
+// vim: ts=4:sw=4:et
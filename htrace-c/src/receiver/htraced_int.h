@@ -0,0 +1,1157 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_RECEIVER_HTRACED_INT
+#define APACHE_HTRACE_RECEIVER_HTRACED_INT
+
+/**
+ * @file htraced_int.h
+ *
+ * The state of the htraced receiver, shared between htraced.c and the files
+ * which implement parts of it.  See htraced.c for how the receiver works.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include "core/htrace.h"
+#include "receiver/hrpc.h"
+#include "receiver/receiver.h"
+#include "util/build.h"
+#include "util/fork.h"
+#include "util/tsd.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+struct htrace_conf;
+struct htrace_log;
+struct htrace_span;
+struct random_src;
+struct spill_log;
+
+/**
+ * The maximum length of the message we will send to the server.
+ * This must be the same or shorter than MAX_HRPC_BODY_LENGTH in rpc.go.
+ */
+#define MAX_HRPC_LEN (32ULL * 1024ULL * 1024ULL)
+
+/**
+ * The smallest maximum WriteSpans request size to allow.
+ */
+#define HTRACED_RPC_MAX_SIZE_MIN (64ULL * 1024ULL)
+
+/**
+ * The minimum total buffer size to allow.
+ *
+ * This should allow at least a few spans to be buffered.
+ */
+#define HTRACED_MIN_BUFFER_SIZE (4ULL * 1024ULL * 1024ULL)
+
+/**
+ * The maximum total buffer size to allow.  Buffers are split into requests
+ * of at most MAX_HRPC_LEN bytes, so this is only a sanity check.
+ */
+#define HTRACED_MAX_BUFFER_SIZE (4ULL * 1024ULL * 1024ULL * 1024ULL)
+
+/**
+ * The minimum number of milliseconds to allow for flush_interval_ms.
+ */
+#define HTRACED_FLUSH_INTERVAL_MS_MIN 30000LL
+
+/**
+ * The maximum number of milliseconds to allow for flush_interval_ms.
+ * This is mainly to avoid overflow.
+ */
+#define HTRACED_FLUSH_INTERVAL_MS_MAX 86400000LL
+
+/**
+ * The minimum number of milliseconds to allow for batch_max_latency_ms, when
+ * adaptive batching is enabled.
+ */
+#define HTRACED_BATCH_MAX_LATENCY_MS_MIN 10ULL
+
+/**
+ * The shortest time to hold spans for when batching adaptively.
+ */
+#define HTRACED_BATCH_DEADLINE_MS_MIN 1ULL
+
+/**
+ * The smallest send threshold to use when batching adaptively.
+ */
+#define HTRACED_BATCH_THRESHOLD_MIN 4096ULL
+
+/**
+ * The weight given to each new sample in the moving averages of the RPC
+ * latency and the span arrival rate.
+ */
+#define HTRACED_BATCH_EWMA_WEIGHT 0.25
+
+/**
+ * The weight given to each new sample in the slow moving average of the RPC
+ * latency which get_pressure compares the fast one against.
+ */
+#define HTRACED_PRESSURE_SLOW_EWMA_WEIGHT 0.03125
+
+/**
+ * How far the fast moving average of the RPC latency must be above the slow
+ * one, in milliseconds, before we count it as pressure.  This keeps jitter
+ * on fast links from looking like a problem.
+ */
+#define HTRACED_PRESSURE_LATENCY_MIN_MS 10.0
+
+/**
+ * The minimum number of milliseconds to allow for tcp write timeouts.
+ */
+#define HTRACED_WRITE_TIMEO_MS_MIN 50LL
+
+/**
+ * The minimum number of milliseconds to allow for tcp read timeouts.
+ */
+#define HTRACED_READ_TIMEO_MS_MIN 50LL
+
+/**
+ * The maximum socket send buffer size to allow.
+ */
+#define HTRACED_TCP_SNDBUF_MAX 0x40000000ULL
+
+/**
+ * The minimum and maximum TCP keepalive times to allow, in milliseconds.
+ */
+#define HTRACED_TCP_KEEPALIVE_MS_MIN 1000ULL
+#define HTRACED_TCP_KEEPALIVE_MS_MAX 86400000ULL
+
+/**
+ * The minimum and maximum times to cache looked-up addresses for, in
+ * milliseconds.
+ */
+#define HTRACED_DNS_CACHE_MS_MIN 1000ULL
+#define HTRACED_DNS_CACHE_MS_MAX 86400000ULL
+
+/**
+ * The minimum and maximum datagram sizes to allow.  65507 is the largest
+ * payload which fits into a UDP datagram over IPv4.
+ */
+#define HTRACED_DATAGRAM_SIZE_MIN 512ULL
+#define HTRACED_DATAGRAM_SIZE_MAX 65507ULL
+
+/**
+ * The most datagrams we build before handing them to the HRPC client.
+ */
+#define HTRACED_DGRAM_BATCH 32
+
+/**
+ * The maximum number of times to try to send some spans to the htraced daemon
+ * before giving up.
+ */
+#define HTRACED_MAX_SEND_TRIES 3
+
+/**
+ * The maximum number of htraced endpoints to allow.
+ */
+#define HTRACED_MAX_ENDPOINTS HRPC_POLL_MAX_CLIENTS
+
+/**
+ * The maximum number of milliseconds to allow for the retry backoff period.
+ */
+#define HTRACED_RETRY_BACKOFF_MS_MAX 3600000ULL
+
+/**
+ * The minimum number of send buffers to allow.
+ */
+#define HTRACED_MIN_BUFFER_COUNT 2ULL
+
+/**
+ * The maximum number of send buffers to allow.
+ */
+#define HTRACED_MAX_BUFFER_COUNT 64ULL
+
+/**
+ * The maximum number of milliseconds to allow for the block timeout.
+ */
+#define HTRACED_BLOCK_TIMEO_MS_MAX 60000ULL
+
+/**
+ * The state of a send buffer which has been handed to the transmitter.
+ */
+enum htraced_sbuf_state {
+    /**
+     * The buffer has not been sent yet, or must be sent again.
+     */
+    HTRACED_SBUF_UNSENT = 0,
+
+    /**
+     * The buffer has been sent, and we are waiting for the response.
+     */
+    HTRACED_SBUF_INFLIGHT,
+
+    /**
+     * The buffer could not be sent, and is waiting to be spilled to disk.
+     */
+    HTRACED_SBUF_SPILL,
+
+    /**
+     * The buffer is finished with, and can be freed.
+     */
+    HTRACED_SBUF_DONE
+};
+
+/**
+ * What to do when all send buffers are full.
+ */
+enum htraced_full_policy {
+    /**
+     * Drop the spans being added.
+     */
+    HTRACED_FULL_DROP_NEWEST = 0,
+
+    /**
+     * Drop the oldest buffered spans which are not already being sent.
+     */
+    HTRACED_FULL_DROP_OLDEST,
+
+    /**
+     * Block the adding thread until there is space, or until a timeout
+     * elapses.  Spans are dropped on timeout.
+     */
+    HTRACED_FULL_BLOCK
+};
+
+/**
+ * How to compress WriteSpans requests.
+ */
+enum htraced_compression {
+    /**
+     * Don't compress.
+     */
+    HTRACED_COMPRESS_NONE = 0,
+
+    /**
+     * Compress with zlib.
+     */
+    HTRACED_COMPRESS_ZLIB
+};
+
+/**
+ * How to send WriteSpans requests.
+ */
+enum htraced_transport {
+    /**
+     * Send each buffer as one request over a stream connection, and wait for
+     * the response.
+     */
+    HTRACED_TRANSPORT_STREAM = 0,
+
+    /**
+     * Send requests as datagrams, and don't wait for any response.
+     */
+    HTRACED_TRANSPORT_DATAGRAM
+};
+
+/**
+ * How staging buffers are shared out.
+ */
+enum htraced_sharding {
+    /**
+     * Each thread has its own staging buffer.
+     */
+    HTRACED_SHARD_THREAD = 0,
+
+    /**
+     * Each CPU has its own staging buffer.
+     */
+    HTRACED_SHARD_CPU
+};
+
+/**
+ * Counters describing what happened to the spans given to the receiver, and
+ * how much data we sent for them.
+ */
+struct htraced_rcv_counters {
+    /**
+     * The number of spans that were put into a send buffer.
+     */
+    uint64_t buffered;
+
+    /**
+     * The number of new spans dropped because all buffers were full.
+     */
+    uint64_t dropped_newest;
+
+    /**
+     * The number of buffered spans dropped to make room for new ones.
+     */
+    uint64_t dropped_oldest;
+
+    /**
+     * The number of times a thread blocked waiting for buffer space.
+     */
+    uint64_t blocked;
+
+    /**
+     * The number of spans dropped after blocking timed out.
+     */
+    uint64_t dropped_timeout;
+
+    /**
+     * The number of spans dropped because they were too big for a buffer.
+     */
+    uint64_t dropped_too_large;
+
+    /**
+     * The number of spans dropped because we could not send them.
+     */
+    uint64_t dropped_xmit;
+
+    /**
+     * The number of normal-priority spans dropped to keep buffer space for
+     * high-priority ones.
+     */
+    uint64_t dropped_low_priority;
+
+    /**
+     * The number of spans spilled to disk.
+     */
+    uint64_t spilled;
+
+    /**
+     * The number of spilled spans which were later sent successfully.
+     */
+    uint64_t unspilled;
+
+    /**
+     * The number of bytes of span data we sent successfully, before
+     * compression.
+     */
+    uint64_t xmit_bytes;
+
+    /**
+     * The number of bytes of span data we sent successfully, after
+     * compression.
+     */
+    uint64_t xmit_wire_bytes;
+
+    /**
+     * The number of bytes of span data written to the send buffers.
+     */
+    uint64_t bytes_serialized;
+
+    /**
+     * The number of WriteSpans requests we made.
+     */
+    uint64_t rpcs;
+
+    /**
+     * The number of WriteSpans requests which failed.
+     */
+    uint64_t rpc_errors;
+
+    /**
+     * The WriteSpans latency histogram.  See struct htrace_stats.
+     */
+    uint64_t rpc_latency_ms[HTRACE_STATS_LATENCY_BUCKETS];
+
+    /**
+     * The largest number of send buffers in use at once.
+     */
+    uint64_t buffers_used_max;
+
+    /**
+     * The largest number of bytes held in one send buffer.
+     */
+    uint64_t buffer_bytes_max;
+};
+
+/**
+ * The minimum per-thread staging buffer size to allow, when staging buffers
+ * are enabled.
+ */
+#define HTRACED_MIN_THREAD_BUFFER_SIZE (4ULL * 1024ULL)
+
+/**
+ * The maximum per-thread staging buffer size to allow, as a fraction of the
+ * size of a send buffer.  The staging buffer must always fit into an empty
+ * send buffer.
+ */
+#define HTRACED_MAX_THREAD_BUFFER_DIVISOR 8ULL
+
+/**
+ * The most per-CPU staging buffers to create, however many CPUs there are.
+ */
+#define HTRACED_MAX_CPU_BUFFERS 4096
+
+/**
+ * An HTraced send buffer.
+ */
+struct htraced_sbuf {
+    /**
+     * Current offset within the buffer.
+     */
+    uint64_t off;
+
+    /**
+     * Length of the buffer.
+     */
+    uint64_t len;
+
+    /**
+     * The number of spans in the buffer.
+     */
+    uint64_t num_spans;
+
+    /**
+     * The state of the buffer, once the transmitter has taken it.
+     */
+    enum htraced_sbuf_state state;
+
+    /**
+     * The number of times we have tried to send this buffer.
+     */
+    int tries;
+
+    /**
+     * The sequence ID of the first request for the buffer, if the buffer is
+     * in flight.
+     */
+    uint64_t seq;
+
+    /**
+     * The sequence ID of the last request for the buffer, if the buffer is in
+     * flight.
+     */
+    uint64_t last_seq;
+
+    /**
+     * The number of requests for the buffer which haven't been answered yet.
+     */
+    uint64_t chunks_left;
+
+    /**
+     * Nonzero if htraced returned an error for any request for the buffer.
+     */
+    int chunk_err;
+
+    /**
+     * The index of the connection the buffer is in flight on.
+     */
+    int conn;
+
+    /**
+     * The number of bytes we put on the wire for the buffer when it was last
+     * sent.
+     */
+    uint64_t wire_len;
+
+    /**
+     * The monotonic-clock time at which the buffer was last sent.
+     */
+    uint64_t send_ms;
+
+    /**
+     * The buffer data.  This field actually has size 'len,' not size 1.
+     */
+    char buf[1];
+};
+
+/**
+ * A connection to one htraced endpoint.  Only used by the transmitter thread.
+ */
+struct htraced_conn {
+    /**
+     * The HRPC client.
+     */
+    struct hrpc_client *hcli;
+
+    /**
+     * The number of buffers in flight on this connection.
+     */
+    int num_inflight;
+
+    /**
+     * The monotonic-clock time at which we started waiting for the next
+     * response on this connection.
+     */
+    uint64_t wait_start_ms;
+
+    /**
+     * The number of consecutive failures on this connection.  While this is
+     * nonzero, the circuit breaker is open or half-open.
+     */
+    int failures;
+
+    /**
+     * The monotonic-clock time at which the backoff period ends, when the
+     * circuit breaker is open.
+     */
+    uint64_t down_until_ms;
+
+    /**
+     * Space for the prequels of the requests we send.  With io_uring, the
+     * kernel may still be sending one request while we build the next, so
+     * we take turns between two.
+     */
+    uint8_t prequel[2][MAX_WRITESPANS_PREQUEL_LEN];
+
+    /**
+     * The index of the prequel to use for the next request.
+     */
+    int next_prequel;
+};
+
+struct htraced_rcv;
+
+/**
+ * A per-thread or per-CPU staging buffer.
+ */
+struct htraced_tbuf {
+    /**
+     * The receiver which owns this staging buffer.
+     */
+    struct htraced_rcv *rcv;
+
+    /**
+     * The next and previous staging buffers in the receiver's list.
+     * Protected by the receiver lock.
+     */
+    struct htraced_tbuf *next;
+    struct htraced_tbuf *prev;
+
+    /**
+     * Lock protecting the buffer contents.  This is normally only taken by the
+     * owning thread, or by threads running on the owning CPU, so it is rarely
+     * contended.  When both locks are needed, the receiver lock must be taken
+     * first.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * The buffer itself.  This must be the last field, since the buffer data
+     * is variable-length.
+     */
+    struct htraced_sbuf sb;
+};
+
+/*
+ * A span receiver that writes spans to htraced.
+ */
+struct htraced_rcv {
+    struct htrace_rcv base;
+
+    /**
+     * Nonzero if the receiver should shut down.
+     */
+    int shutdown;
+
+    /**
+     * The log to use.  This belongs to the htracer, or to the shared
+     * transmitter entry if this receiver is shared between htracers.
+     */
+    struct htrace_log *lg;
+
+    /**
+     * The tracer id we send as the DefaultTrid of each WriteSpans request.
+     */
+    const char *trid;
+
+    /**
+     * The random source used to jitter retry backoffs.
+     */
+    struct random_src *rnd;
+
+    /**
+     * Buffered span data becomes eligible to be sent even if there isn't much
+     * in the buffer after this timeout elapses.
+     */
+    uint64_t flush_interval_ms;
+
+    /**
+     * The maximum number of bytes we will buffer before waking the sending
+     * thread.  We may sometimes send slightly more than this amount if the
+     * thread takes a while to wake up.  When batching adaptively, this
+     * changes over time.
+     */
+    uint64_t send_threshold;
+
+    /**
+     * The configured send threshold.  When batching adaptively, this is the
+     * largest send threshold we will use.
+     */
+    uint64_t max_send_threshold;
+
+    /**
+     * The longest time a span should wait in the active buffer and in
+     * flight, or 0 if adaptive batching is disabled.
+     */
+    uint64_t batch_max_latency_ms;
+
+    /**
+     * When batching adaptively, the time after which we send the active
+     * buffer even if the send threshold has not been reached, measured from
+     * the first span written to it.
+     */
+    uint64_t batch_deadline_ms;
+
+    /**
+     * The monotonic-clock time at which the first span was written to the
+     * active buffer.  Only tracked when batching adaptively.
+     */
+    uint64_t active_start_ms;
+
+    /**
+     * The moving average of the time between sending a buffer and getting
+     * the response, in milliseconds.
+     */
+    double rpc_latency_ms;
+
+    /**
+     * The moving average of the rate at which span data arrives, in bytes per
+     * millisecond.
+     */
+    double arrival_rate;
+
+    /**
+     * The htraced endpoints we send to, as a malloced, comma-separated list.
+     */
+    char *address;
+
+    /**
+     * The connections to the htraced endpoints.
+     */
+    struct htraced_conn *conns;
+
+    /**
+     * The number of connections.
+     */
+    int num_conns;
+
+    /**
+     * The connection to start looking at when choosing where to send the next
+     * buffer.
+     */
+    int next_conn;
+
+    /**
+     * The number of times to try sending a buffer before giving up.
+     */
+    int max_tries;
+
+    /**
+     * The backoff period after the first failure on a connection.
+     */
+    uint64_t retry_min_ms;
+
+    /**
+     * The longest backoff period to use.
+     */
+    uint64_t retry_max_ms;
+
+    /**
+     * The monotonic-clock time at which we last did a send operation.
+     */
+    uint64_t last_send_ms;
+
+    /**
+     * The number of send buffers.
+     */
+    int num_bufs;
+
+    /**
+     * The total size of the send buffers, in bytes.
+     */
+    uint64_t buf_total;
+
+    /**
+     * The length which the send buffers should have.  A buffer of another
+     * length is reallocated when it is free.  See htraced_sbuf_resize.
+     */
+    uint64_t buf_len;
+
+    /**
+     * The length which each send buffer had when the receiver was created.
+     * Buffers never grow past this, since the compression, dictionary and
+     * spill buffers are sized for it.
+     */
+    uint64_t buf_cap;
+
+    /**
+     * The index of the active buffer, which new spans are written to.
+     */
+    int active_buf;
+
+    /**
+     * The index of the oldest buffer which is not free.  The buffers from
+     * xmit_head up to active_buf, in ring order, are either being sent,
+     * waiting to be sent, or being filled.  The rest are free.
+     */
+    int xmit_head;
+
+    /**
+     * The number of buffers, starting at xmit_head, which the transmitter
+     * has taken.  These buffers are never written to.
+     */
+    int num_sent;
+
+    /**
+     * The number of buffers which are in flight.
+     */
+    int num_inflight;
+
+    /**
+     * The maximum number of buffers to keep in flight.
+     */
+    int inflight_window;
+
+    /**
+     * The TCP read timeout.  If we are waiting for responses on a connection
+     * and none arrive for this long, the connection is considered dead.
+     */
+    uint64_t read_timeo_ms;
+
+    /**
+     * How long to keep trying to send buffered spans once we are shut down,
+     * or 0 for no limit.
+     */
+    uint64_t shutdown_timeo_ms;
+
+    /**
+     * The monotonic-clock time at which we give up on sending buffered
+     * spans, or 0 if there is no shutdown timeout or shutdown hasn't begun.
+     * Only used by the transmitter thread.
+     */
+    uint64_t shutdown_deadline_ms;
+
+    /**
+     * A pipe used to wake the transmitter thread while it waits for
+     * responses.  wake_fd[0] is the read end.
+     */
+    int wake_fd[2];
+
+    /**
+     * Nonzero while the transmitter thread is waiting for responses.
+     */
+    int xmit_polling;
+
+    /**
+     * Nonzero if the wakeup pipe has been written to since the transmitter
+     * thread last drained it.
+     */
+    int xmit_woken;
+
+    /**
+     * The ring of send buffers.
+     */
+    struct htraced_sbuf **sbuf;
+
+    /**
+     * What to do when all of the send buffers are full.
+     */
+    enum htraced_full_policy full_policy;
+
+    /**
+     * How long to block for, when using HTRACED_FULL_BLOCK.
+     */
+    uint64_t block_timeo_ms;
+
+    /**
+     * The number of bytes of buffer space to keep for high-priority spans.
+     * See HTRACED_BUFFER_PRIORITY_RESERVE_KEY.
+     */
+    uint64_t priority_reserve;
+
+    /**
+     * Span counters.  Protected by the lock.
+     */
+    struct htraced_rcv_counters ctrs;
+
+    /**
+     * Nonzero if we should measure how long our own calls take.  See
+     * HTRACE_SELF_STATS_KEY.
+     */
+    int self_stats;
+
+    /**
+     * The self-instrumentation counters, in nanoseconds.  Since they are
+     * partly measured outside the lock, they are updated with relaxed atomic
+     * operations rather than protected by it.
+     */
+    uint64_t self_add_span_ns;
+    uint64_t self_lock_wait_ns;
+    uint64_t self_xmit_wait_ns;
+
+    /**
+     * Lock protecting the buffers from concurrent writes.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Condition variable used to wake up the background thread.
+     */
+    pthread_cond_t bg_cond;
+
+    /**
+     * Condition variable used to wake up flushing threads, and threads waiting
+     * for buffer space.  Signalled whenever a send completes.
+     */
+    pthread_cond_t flush_cond;
+
+    /**
+     * Background transmitter thread.
+     */
+    pthread_t xmit_thread;
+
+    /**
+     * How long to cache the addresses of the htraced endpoints, or 0 if they
+     * are looked up on every connect.
+     */
+    uint64_t dns_cache_ms;
+
+    /**
+     * Condition variable used to wake up the resolver thread.
+     */
+    pthread_cond_t resolve_cond;
+
+    /**
+     * Nonzero if the resolver thread should check for stale addresses
+     * without waiting.  Protected by the lock.
+     */
+    int resolve_wake;
+
+    /**
+     * Background thread which looks up the addresses of the htraced
+     * endpoints.  Only running when dns_cache_ms is nonzero.
+     */
+    pthread_t resolve_thread;
+
+    /**
+     * The length of each per-thread staging buffer, or 0 if staging buffers
+     * are disabled.
+     */
+    uint64_t tbuf_len;
+
+    /**
+     * How the staging buffers are shared out.
+     */
+    enum htraced_sharding sharding;
+
+    /**
+     * The thread-specific data holding the current thread's staging buffer.
+     * Only valid when tbuf_len is nonzero and sharding is
+     * HTRACED_SHARD_THREAD.
+     */
+    struct htrace_tsd tbuf_tsd;
+
+    /**
+     * The per-CPU staging buffers, indexed by CPU.  Only valid when tbuf_len
+     * is nonzero and sharding is HTRACED_SHARD_CPU.  These are also on the
+     * list of all staging buffers.
+     */
+    struct htraced_tbuf **cbufs;
+
+    /**
+     * The number of per-CPU staging buffers.
+     */
+    int num_cbufs;
+
+    /**
+     * The list of all staging buffers.  Protected by the receiver lock.
+     */
+    struct htraced_tbuf *tbufs;
+
+    /**
+     * Nonzero if closed spans are queued for the serializer thread.
+     */
+    int async;
+
+    /**
+     * The most spans to queue for the serializer thread.
+     */
+    uint64_t aq_max;
+
+    /**
+     * The queue of spans waiting for the serializer thread, newest first,
+     * linked through their next pointers.  Updated with atomic operations.
+     */
+    struct htrace_span *aq_head;
+
+    /**
+     * The number of spans in the queue.  Updated with atomic operations.
+     */
+    uint64_t aq_len;
+
+    /**
+     * Nonzero while the serializer thread is waiting for spans.  Updated
+     * with atomic operations.
+     */
+    int aq_waiting;
+
+    /**
+     * Nonzero when the serializer thread should exit.  Protected by
+     * aq_lock.
+     */
+    int aq_shutdown;
+
+    /**
+     * Lock and condition variable used to wake the serializer thread.
+     */
+    pthread_mutex_t aq_lock;
+    pthread_cond_t aq_cond;
+
+    /**
+     * The serializer thread.  Only running when async is nonzero.
+     */
+    pthread_t aq_thread;
+
+    /**
+     * Fast and slow moving averages of the WriteSpans latency, in
+     * milliseconds.  When the fast one runs ahead of the slow one, latency is
+     * rising.  Protected by the lock.
+     */
+    double pressure_fast_ms;
+    double pressure_slow_ms;
+
+    /**
+     * The number of dropped or blocked spans the last time get_pressure was
+     * called.  Protected by the lock.
+     */
+    uint64_t pressure_dropped;
+
+    /**
+     * How to compress WriteSpans requests.
+     */
+    enum htraced_compression compression;
+
+    /**
+     * How to send WriteSpans requests.
+     */
+    enum htraced_transport transport;
+
+    /**
+     * The most span data to put into one WriteSpans request.
+     */
+    uint64_t rpc_max_len;
+
+    /**
+     * The largest datagram to send, in bytes.  Only used when transport is
+     * HTRACED_TRANSPORT_DATAGRAM.
+     */
+    uint64_t dgram_size;
+
+#ifdef HAVE_ZLIB
+    /**
+     * The zlib stream used for compression.  Only used by the transmitter
+     * thread, and only valid when compression is HTRACED_COMPRESS_ZLIB.
+     */
+    z_stream zstrm;
+#endif
+
+    /**
+     * The spill queue, or NULL if spilling is off.  Only used by the
+     * transmitter thread, once the receiver has been created.
+     */
+    struct spill_log *spill;
+
+    /**
+     * The number of spans in the spill queue.
+     */
+    uint64_t spill_spans;
+
+    /**
+     * Nonzero if the oldest spilled batch is in flight.
+     */
+    int spill_inflight;
+
+    /**
+     * The connection the oldest spilled batch is in flight on.
+     */
+    int spill_conn;
+
+    /**
+     * The sequence IDs of the first and last requests for the oldest spilled
+     * batch.
+     */
+    uint64_t spill_seq;
+    uint64_t spill_last_seq;
+
+    /**
+     * The number of requests for the oldest spilled batch which haven't been
+     * answered yet.
+     */
+    uint64_t spill_chunks_left;
+
+    /**
+     * Nonzero if htraced returned an error for any request for the oldest
+     * spilled batch.
+     */
+    int spill_chunk_err;
+
+    /**
+     * The number of times the server has rejected the oldest spilled batch.
+     */
+    int spill_tries;
+
+    /**
+     * The number of bytes we sent for the oldest spilled batch.
+     */
+    uint64_t spill_wire_len;
+
+    /**
+     * The monotonic-clock time at which we sent the oldest spilled batch.
+     */
+    uint64_t spill_send_ms;
+
+    /**
+     * The scratch buffer we compress requests into, or NULL if compression
+     * is off.  Only used by the transmitter thread.
+     */
+    uint8_t *zbuf;
+
+    /**
+     * The length of zbuf.
+     */
+    uint64_t zbuf_len;
+
+    /**
+     * The scratch buffer we dictionary-encode requests into, or NULL if
+     * htraced.dictionary is off.  Only used by the transmitter thread.
+     */
+    uint8_t *dbuf;
+
+    /**
+     * The length of dbuf.
+     */
+    uint64_t dbuf_len;
+
+    /**
+     * The scratch buffer we group the spans of a send buffer by trace in, or
+     * NULL if htraced.group.by.trace is off.  Only used by the transmitter
+     * thread.
+     */
+    char *gbuf;
+
+    /**
+     * The length of gbuf.
+     */
+    uint64_t gbuf_len;
+
+    /**
+     * Resets the receiver in a forked child.
+     */
+    struct htrace_fork_hook fork_hook;
+
+    /**
+     * Nonzero if we are in a forked child and haven't restarted our threads
+     * yet.  Read with acquire semantics, so that the restart is visible to
+     * whoever sees it cleared.
+     */
+    int forked;
+
+    /**
+     * Serializes restarting after fork.
+     */
+    pthread_mutex_t fork_lock;
+
+    /**
+     * The staging buffer of the thread which forked, which is the only
+     * staging buffer still in use in the child.
+     */
+    struct htraced_tbuf *fork_tbuf;
+
+    /**
+     * Nonzero if htraced_fork_reset has run in this child, but the threads
+     * haven't been started yet.  Protected by fork_lock.
+     */
+    int fork_reset;
+};
+
+/**
+ * Get a numeric configuration value, clamped to [min, max].
+ */
+uint64_t htraced_get_bounded_u64(struct htrace_log *lg,
+                const struct htrace_conf *cnf, const char *prop,
+                uint64_t min, uint64_t max);
+double htraced_get_bounded_double(struct htrace_log *lg,
+                const struct htrace_conf *cnf, const char *prop,
+                double min, double max);
+
+/**
+ * Wake up the transmitter thread.
+ * This function must be called with the lock held.
+ */
+void htraced_wake_xmit(struct htraced_rcv *rcv);
+
+/**
+ * Pick the send threshold and the batch deadline from the observed RPC
+ * latency and span arrival rate.
+ * This function must be called with the lock held.
+ */
+void htraced_batch_adapt(struct htraced_rcv *rcv);
+
+/**
+ * Get the number of send buffers which are not free.
+ * This function must be called with the lock held.
+ */
+int htraced_sbufs_used(const struct htraced_rcv *rcv);
+
+/**
+ * Give a free send buffer the length which the send buffers should have.
+ * This function must be called with the lock held.
+ */
+void htraced_sbuf_resize(struct htraced_rcv *rcv, int idx);
+
+/**
+ * Open the pipe which writers use to wake up the transmitter thread.
+ *
+ * @param lg            The log to use.
+ * @param fds           (out param) The read and write ends of the pipe.
+ *
+ * @return              1 on success; 0 on error.
+ */
+int htraced_open_wake_pipe(struct htrace_log *lg, int *fds);
+
+/**
+ * The transmitter thread.
+ */
+void* run_htraced_xmit_manager(void *data);
+
+/**
+ * The resolver thread.  Only started when dns_cache_ms is nonzero.
+ */
+void *run_htraced_resolver(void *data);
+
+/**
+ * The serializer thread.  Only started when async is nonzero.
+ */
+void *run_htraced_serializer(void *data);
+
+/**
+ * Tell the resolver thread to exit, and wait for it.
+ */
+void htraced_stop_resolver(struct htraced_rcv *rcv);
+
+/**
+ * Tell the serializer thread to exit, wait for it, and destroy the lock and
+ * condition variable of the serializer queue.
+ */
+void htraced_stop_serializer(struct htraced_rcv *rcv);
+
+#endif
+
+// vim: ts=4:sw=4:et
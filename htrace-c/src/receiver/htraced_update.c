@@ -0,0 +1,142 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "receiver/htraced_fork.h"
+#include "receiver/htraced_int.h"
+#include "receiver/htraced_update.h"
+#include "util/log.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * @file htraced_update.c
+ *
+ * Implements htracer_update_conf for the htraced receiver.
+ *
+ * Only the settings which can change without re-creating the receiver are
+ * updated: the flush interval, the timeouts, the size of the send buffers,
+ * and the thresholds which depend on it.
+ */
+
+int htraced_rcv_update(struct htraced_rcv *rcv,
+                const struct htrace_conf *conf, uint64_t buf_max)
+{
+    struct htrace_log *lg = rcv->lg;
+    uint64_t flush_interval_ms, block_timeo_ms, shutdown_timeo_ms;
+    uint64_t buf_total, buf_len, buf_min;
+    double send_fraction, reserve;
+    int i;
+
+    if (htraced_get_bounded_u64(lg, conf, HTRACED_BUFFER_COUNT_KEY,
+                HTRACED_MIN_BUFFER_COUNT, HTRACED_MAX_BUFFER_COUNT) !=
+            (uint64_t)rcv->num_bufs) {
+        htrace_log(lg, "htraced_rcv_update_conf: %s can't be changed "
+                   "without re-creating the tracer.  Keeping %d send "
+                   "buffers.\n", HTRACED_BUFFER_COUNT_KEY, rcv->num_bufs);
+    }
+    flush_interval_ms = htraced_get_bounded_u64(lg, conf,
+                HTRACED_FLUSH_INTERVAL_MS_KEY, HTRACED_FLUSH_INTERVAL_MS_MIN,
+                HTRACED_FLUSH_INTERVAL_MS_MAX);
+    block_timeo_ms = htraced_get_bounded_u64(lg, conf,
+                HTRACED_BUFFER_FULL_BLOCK_TIMEO_MS_KEY, 0,
+                HTRACED_BLOCK_TIMEO_MS_MAX);
+    shutdown_timeo_ms = htrace_conf_get_u64(lg, conf,
+                HTRACED_SHUTDOWN_TIMEO_MS_KEY);
+    buf_total = htraced_get_bounded_u64(lg, conf,
+                HTRACED_BUFFER_SIZE_KEY, HTRACED_MIN_BUFFER_SIZE,
+                HTRACED_MAX_BUFFER_SIZE);
+    if (buf_max && (buf_total > buf_max)) {
+        if (buf_max < HTRACED_MIN_BUFFER_SIZE) {
+            buf_max = HTRACED_MIN_BUFFER_SIZE;
+        }
+        htrace_log(lg, "htraced_rcv_update_conf: not enough of %s is left "
+                   "for %" PRId64 " bytes of send buffers.  Using %" PRId64
+                   " bytes instead.\n", HTRACED_SHARED_MEMORY_MAX_KEY,
+                   buf_total, buf_max);
+        buf_total = buf_max;
+    }
+    buf_len = buf_total / rcv->num_bufs;
+    // The thread buffers must still fit into the send buffers several times
+    // over.
+    buf_min = rcv->tbuf_len * HTRACED_MAX_THREAD_BUFFER_DIVISOR;
+    if (buf_len > rcv->buf_cap) {
+        htrace_log(lg, "htraced_rcv_update_conf: the send buffers can't "
+                   "grow past the %" PRId64 " bytes they were created "
+                   "with.\n", rcv->buf_cap * rcv->num_bufs);
+        buf_len = rcv->buf_cap;
+        buf_total = buf_len * rcv->num_bufs;
+    } else if (buf_len < buf_min) {
+        htrace_log(lg, "htraced_rcv_update_conf: the send buffers can't "
+                   "shrink below %" PRId64 " bytes with %s=%" PRId64 ".\n",
+                   buf_min * rcv->num_bufs, HTRACED_THREAD_BUFFER_SIZE_KEY,
+                   rcv->tbuf_len);
+        buf_len = buf_min;
+        buf_total = buf_len * rcv->num_bufs;
+    }
+    reserve = htraced_get_bounded_double(lg, conf,
+                HTRACED_BUFFER_PRIORITY_RESERVE_KEY, 0.0, 0.9);
+    send_fraction = htraced_get_bounded_double(lg, conf,
+                HTRACED_BUFFER_SEND_TRIGGER_FRACTION, 0.1, 1.0);
+
+    htraced_fork_restart(rcv);
+    pthread_mutex_lock(&rcv->lock);
+    rcv->flush_interval_ms = flush_interval_ms;
+    rcv->block_timeo_ms = block_timeo_ms;
+    rcv->shutdown_timeo_ms = shutdown_timeo_ms;
+    rcv->buf_total = buf_total;
+    rcv->buf_len = buf_len;
+    rcv->priority_reserve = buf_total * reserve;
+    rcv->max_send_threshold = buf_len * send_fraction;
+    if (rcv->max_send_threshold > buf_len) {
+        rcv->max_send_threshold = buf_len;
+    }
+    if (rcv->batch_max_latency_ms) {
+        htraced_batch_adapt(rcv);
+    } else {
+        rcv->send_threshold = rcv->max_send_threshold;
+    }
+    for (i = htraced_sbufs_used(rcv); i < rcv->num_bufs; i++) {
+        htraced_sbuf_resize(rcv, (rcv->xmit_head + i) % rcv->num_bufs);
+    }
+    if (rcv->sbuf[rcv->active_buf]->off == 0) {
+        htraced_sbuf_resize(rcv, rcv->active_buf);
+    }
+    // The transmitter may be sleeping for the old flush interval.
+    htraced_wake_xmit(rcv);
+    pthread_mutex_unlock(&rcv->lock);
+    htrace_log(lg, "Updated htraced receiver for %s"
+                ", flush_interval_ms=%" PRId64 ", send_threshold=%" PRId64
+                ", block_timeo_ms=%" PRId64 ", shutdown_timeo_ms=%" PRId64
+                ", buf_len=%" PRId64 ", priority_reserve=%" PRId64 ".\n",
+                rcv->address, flush_interval_ms, rcv->max_send_threshold,
+                block_timeo_ms, shutdown_timeo_ms, buf_len,
+                (uint64_t)(buf_total * reserve));
+    return 0;
+}
+
+int htraced_rcv_update_conf(struct htrace_rcv *r,
+                            const struct htrace_conf *conf)
+{
+    return htraced_rcv_update((struct htraced_rcv *)r, conf, 0);
+}
+
+// vim:ts=4:sw=4:et
@@ -0,0 +1,61 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_RECEIVER_HTRACED_UPDATE
+#define APACHE_HTRACE_RECEIVER_HTRACED_UPDATE
+
+/**
+ * @file htraced_update.h
+ *
+ * Applies a new configuration to a running htraced receiver.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stdint.h>
+
+struct htrace_conf;
+struct htrace_rcv;
+struct htraced_rcv;
+
+/**
+ * Apply a new configuration to an htraced receiver.
+ *
+ * The send buffers which are free are resized right away.  The others are
+ * resized when they become the active buffer again.
+ *
+ * @param rcv           The htraced receiver.
+ * @param conf          The new configuration.
+ * @param buf_max       If nonzero, the most bytes the send buffers may use
+ *                          in total.
+ *
+ * @return              0 on success; an error number otherwise.
+ */
+int htraced_rcv_update(struct htraced_rcv *rcv,
+                const struct htrace_conf *conf, uint64_t buf_max);
+
+/**
+ * The update_conf callback of an htraced receiver which is not shared
+ * between htracers.
+ */
+int htraced_rcv_update_conf(struct htrace_rcv *r,
+                            const struct htrace_conf *conf);
+
+#endif
+
+// vim: ts=4:sw=4:et
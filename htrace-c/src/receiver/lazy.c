@@ -0,0 +1,247 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "receiver/receiver.h"
+#include "util/alloc.h"
+#include "util/log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * A span receiver which creates the configured span receiver when it is
+ * given its first span, and hands everything on to it after that.
+ *
+ * See HTRACE_SPAN_RECEIVER_LAZY_KEY.
+ */
+struct lazy_rcv {
+    struct htrace_rcv base;
+
+    /**
+     * The HTrace context.
+     */
+    struct htracer *tracer;
+
+    /**
+     * A copy of the configuration to create the child with.  Freed once the
+     * child has been created.  Replaced by lazy_rcv_update_conf until then.
+     * Protected by lock.
+     */
+    struct htrace_conf *conf;
+
+    /**
+     * Serializes creating the child.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * The child span receiver, or NULL if it hasn't been created yet.  Set
+     * only once, under the lock; read with acquire semantics.
+     */
+    struct htrace_rcv *child;
+};
+
+static struct htrace_rcv *lazy_rcv_create(struct htracer *tracer,
+                                          const struct htrace_conf *conf)
+{
+    struct lazy_rcv *rcv;
+
+    rcv = htrace_calloc(1, sizeof(*rcv));
+    if (!rcv) {
+        htrace_log(tracer->lg, "lazy_rcv_create: OOM while allocating "
+                   "lazy_rcv.\n");
+        return NULL;
+    }
+    rcv->base.ty = &g_lazy_rcv_ty;
+    rcv->tracer = tracer;
+    rcv->conf = htrace_conf_copy(conf);
+    if (!rcv->conf) {
+        htrace_log(tracer->lg, "lazy_rcv_create: OOM while copying the "
+                   "configuration.\n");
+        htrace_free(rcv);
+        return NULL;
+    }
+    pthread_mutex_init(&rcv->lock, NULL);
+    htrace_log(tracer->lg, "Deferring span receiver creation until the "
+               "first span.\n");
+    return (struct htrace_rcv *)rcv;
+}
+
+/**
+ * Get the child span receiver, creating it if this is the first call.
+ *
+ * If the child can't be created, we fall back to the no-op receiver rather
+ * than trying again for every span.
+ */
+static struct htrace_rcv *lazy_rcv_get(struct lazy_rcv *rcv)
+{
+    struct htrace_rcv *child;
+
+    child = __atomic_load_n(&rcv->child, __ATOMIC_ACQUIRE);
+    if (child) {
+        return child;
+    }
+    pthread_mutex_lock(&rcv->lock);
+    child = rcv->child;
+    if (!child) {
+        child = htrace_rcv_create_eager(rcv->tracer, rcv->conf);
+        if (!child) {
+            htrace_log(rcv->tracer->lg, "lazy_rcv_get: failed to create "
+                       "the span receiver.  Discarding spans.\n");
+            child = g_noop_rcv_ty.create(rcv->tracer, rcv->conf);
+        }
+        htrace_conf_free(rcv->conf);
+        rcv->conf = NULL;
+        __atomic_store_n(&rcv->child, child, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    return child;
+}
+
+/**
+ * Get the child span receiver if it has been created.
+ */
+static struct htrace_rcv *lazy_rcv_peek(struct lazy_rcv *rcv)
+{
+    return __atomic_load_n(&rcv->child, __ATOMIC_ACQUIRE);
+}
+
+static void lazy_rcv_add_span(struct htrace_rcv *r, struct htrace_span *span)
+{
+    struct htrace_rcv *child = lazy_rcv_get((struct lazy_rcv *)r);
+
+    child->ty->add_span(child, span);
+}
+
+static void lazy_rcv_add_spans(struct htrace_rcv *r,
+                               struct htrace_span **spans, int num_spans)
+{
+    struct htrace_rcv *child = lazy_rcv_get((struct lazy_rcv *)r);
+    int i;
+
+    if (child->ty->add_spans) {
+        child->ty->add_spans(child, spans, num_spans);
+        return;
+    }
+    for (i = 0; i < num_spans; i++) {
+        child->ty->add_span(child, spans[i]);
+    }
+}
+
+static int lazy_rcv_take_span(struct htrace_rcv *r, struct htrace_span *span)
+{
+    struct htrace_rcv *child = lazy_rcv_get((struct lazy_rcv *)r);
+
+    if (!child->ty->take_span) {
+        return 0;
+    }
+    return child->ty->take_span(child, span);
+}
+
+static void lazy_rcv_flush(struct htrace_rcv *r)
+{
+    struct htrace_rcv *child = lazy_rcv_peek((struct lazy_rcv *)r);
+
+    if (child) {
+        child->ty->flush(child);
+    }
+}
+
+static void lazy_rcv_free(struct htrace_rcv *r)
+{
+    struct lazy_rcv *rcv = (struct lazy_rcv *)r;
+
+    if (rcv->child) {
+        rcv->child->ty->free(rcv->child);
+    }
+    htrace_conf_free(rcv->conf);
+    pthread_mutex_destroy(&rcv->lock);
+    htrace_free(rcv);
+}
+
+static void lazy_rcv_get_stats(struct htrace_rcv *r,
+                               struct htrace_stats *stats)
+{
+    struct htrace_rcv *child = lazy_rcv_peek((struct lazy_rcv *)r);
+
+    if (child && child->ty->get_stats) {
+        child->ty->get_stats(child, stats);
+    }
+}
+
+static int lazy_rcv_get_pressure(struct htrace_rcv *r)
+{
+    struct htrace_rcv *child = lazy_rcv_peek((struct lazy_rcv *)r);
+
+    if ((!child) || (!child->ty->get_pressure)) {
+        return 0;
+    }
+    return child->ty->get_pressure(child);
+}
+
+static int lazy_rcv_update_conf(struct htrace_rcv *r,
+                                const struct htrace_conf *conf)
+{
+    struct lazy_rcv *rcv = (struct lazy_rcv *)r;
+    struct htrace_conf *copy;
+    struct htrace_rcv *child;
+
+    pthread_mutex_lock(&rcv->lock);
+    child = rcv->child;
+    if (!child) {
+        copy = htrace_conf_copy(conf);
+        if (!copy) {
+            pthread_mutex_unlock(&rcv->lock);
+            htrace_log(rcv->tracer->lg, "lazy_rcv_update_conf: OOM while "
+                       "copying the configuration.\n");
+            return ENOMEM;
+        }
+        htrace_conf_free(rcv->conf);
+        rcv->conf = copy;
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    if ((!child) || (!child->ty->update_conf)) {
+        return 0;
+    }
+    return child->ty->update_conf(child, conf);
+}
+
+struct htrace_rcv *lazy_rcv_child(struct htrace_rcv *r)
+{
+    return lazy_rcv_peek((struct lazy_rcv *)r);
+}
+
+const struct htrace_rcv_ty g_lazy_rcv_ty = {
+    "lazy",
+    lazy_rcv_create,
+    lazy_rcv_add_span,
+    lazy_rcv_add_spans,
+    lazy_rcv_take_span,
+    lazy_rcv_flush,
+    lazy_rcv_free,
+    lazy_rcv_get_stats,
+    lazy_rcv_get_pressure,
+    NULL,
+    lazy_rcv_update_conf,
+};
+
+// vim:ts=4:sw=4:et
@@ -0,0 +1,480 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "receiver/local_binfile.h"
+#include "receiver/receiver.h"
+#include "util/alloc.h"
+#include "util/log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * The smallest and largest block sizes we allow.
+ */
+#define LOCAL_BINFILE_BLOCK_SIZE_MIN 256
+#define LOCAL_BINFILE_BLOCK_SIZE_MAX (256ULL * 1024ULL * 1024ULL)
+
+/*
+ * A span receiver that writes spans to a local file in blocks of
+ * length-prefixed msgpack records.  See local_binfile.h for the layout.
+ */
+struct local_binfile_rcv {
+    struct htrace_rcv base;
+
+    /**
+     * The htracer object associated with this receiver.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The file descriptor of the local file, or -1.
+     */
+    int fd;
+
+    /**
+     * Path to the local file.  Dynamically allocated.
+     */
+    char *path;
+
+    /**
+     * Lock protecting everything below.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * The block being filled.  It has room for a footer after
+     * block_size bytes of records, or after one larger record.
+     */
+    uint8_t *buf;
+
+    /**
+     * The size of buf, not counting room for the footer.
+     */
+    uint64_t buf_len;
+
+    /**
+     * The target size of the records in a block.
+     */
+    uint64_t block_size;
+
+    /**
+     * The footer of the block being filled.  data_len is the number of
+     * bytes of buf which are in use.
+     */
+    struct local_binfile_footer ftr;
+
+    /**
+     * The number of bytes of span data we wrote.
+     */
+    uint64_t bytes_serialized;
+
+    /**
+     * The number of spans we could not write because we ran out of memory.
+     */
+    uint64_t dropped_oom;
+
+    /**
+     * The number of spans we could not write because of an I/O error.
+     */
+    uint64_t dropped_xmit;
+};
+
+static uint8_t *put_be64(uint8_t *p, uint64_t v)
+{
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        *p++ = (v >> (i * 8)) & 0xff;
+    }
+    return p;
+}
+
+static uint8_t *put_be32(uint8_t *p, uint32_t v)
+{
+    *p++ = (v >> 24) & 0xff;
+    *p++ = (v >> 16) & 0xff;
+    *p++ = (v >> 8) & 0xff;
+    *p++ = v & 0xff;
+    return p;
+}
+
+static uint64_t get_be(const uint8_t *p, int len)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static void local_binfile_footer_encode(const struct local_binfile_footer *ftr,
+                                        uint8_t *p)
+{
+    p = put_be64(p, ftr->data_len);
+    p = put_be64(p, ftr->num_spans);
+    p = put_be64(p, ftr->min_begin_ms);
+    p = put_be64(p, ftr->max_end_ms);
+    p = put_be64(p, ftr->min_trace_id);
+    p = put_be64(p, ftr->max_trace_id);
+    p = put_be32(p, LOCAL_BINFILE_VERSION);
+    put_be32(p, LOCAL_BINFILE_MAGIC);
+}
+
+int local_binfile_footer_decode(const uint8_t *buf,
+                                struct local_binfile_footer *ftr)
+{
+    if (get_be(buf + 52, 4) != LOCAL_BINFILE_MAGIC) {
+        return 0;
+    }
+    ftr->data_len = get_be(buf, 8);
+    ftr->num_spans = get_be(buf + 8, 8);
+    ftr->min_begin_ms = get_be(buf + 16, 8);
+    ftr->max_end_ms = get_be(buf + 24, 8);
+    ftr->min_trace_id = get_be(buf + 32, 8);
+    ftr->max_trace_id = get_be(buf + 40, 8);
+    ftr->version = get_be(buf + 48, 4);
+    return 1;
+}
+
+static void local_binfile_reset_footer(struct local_binfile_rcv *rcv)
+{
+    memset(&rcv->ftr, 0, sizeof(rcv->ftr));
+    rcv->ftr.min_begin_ms = UINT64_MAX;
+    rcv->ftr.min_trace_id = UINT64_MAX;
+}
+
+static uint64_t local_binfile_get_block_size(struct htrace_log *lg,
+                                             const struct htrace_conf *conf)
+{
+    uint64_t size;
+
+    size = htrace_conf_get_u64(lg, conf, HTRACE_LOCAL_BINFILE_BLOCK_SIZE_KEY);
+    if (size < LOCAL_BINFILE_BLOCK_SIZE_MIN) {
+        htrace_log(lg, "local_binfile_rcv_create: can't set %s to %" PRId64
+                   ".  Using minimum value of %" PRId64 " instead.\n",
+                   HTRACE_LOCAL_BINFILE_BLOCK_SIZE_KEY, size,
+                   (uint64_t)LOCAL_BINFILE_BLOCK_SIZE_MIN);
+        size = LOCAL_BINFILE_BLOCK_SIZE_MIN;
+    } else if (size > LOCAL_BINFILE_BLOCK_SIZE_MAX) {
+        htrace_log(lg, "local_binfile_rcv_create: can't set %s to %" PRId64
+                   ".  Using maximum value of %" PRId64 " instead.\n",
+                   HTRACE_LOCAL_BINFILE_BLOCK_SIZE_KEY, size,
+                   (uint64_t)LOCAL_BINFILE_BLOCK_SIZE_MAX);
+        size = LOCAL_BINFILE_BLOCK_SIZE_MAX;
+    }
+    return size;
+}
+
+static void local_binfile_rcv_free(struct htrace_rcv *r);
+
+static struct htrace_rcv *local_binfile_rcv_create(struct htracer *tracer,
+                                             const struct htrace_conf *conf)
+{
+    struct local_binfile_rcv *rcv;
+    const char *path;
+    int ret;
+
+    path = htrace_conf_get(conf, HTRACE_LOCAL_BINFILE_RCV_PATH_KEY);
+    if (!path) {
+        htrace_log(tracer->lg, "local_binfile_rcv_create: no value found for "
+                   "%s. You must set this configuration key to the path you "
+                   "wish to write spans to.\n",
+                   HTRACE_LOCAL_BINFILE_RCV_PATH_KEY);
+        return NULL;
+    }
+    rcv = htrace_calloc(1, sizeof(*rcv));
+    if (!rcv) {
+        htrace_log(tracer->lg, "local_binfile_rcv_create: OOM while "
+                   "allocating local_binfile_rcv.\n");
+        return NULL;
+    }
+    rcv->fd = -1;
+    ret = pthread_mutex_init(&rcv->lock, NULL);
+    if (ret) {
+        htrace_log(tracer->lg, "local_binfile_rcv_create: failed to "
+                   "create mutex while setting up local_binfile_rcv: "
+                   "error %d (%s)\n", ret, terror(ret));
+        htrace_free(rcv);
+        return NULL;
+    }
+    rcv->base.ty = &g_local_binfile_rcv_ty;
+    rcv->tracer = tracer;
+    local_binfile_reset_footer(rcv);
+    rcv->block_size = local_binfile_get_block_size(tracer->lg, conf);
+    rcv->buf_len = rcv->block_size;
+    rcv->buf = htrace_malloc(rcv->buf_len + LOCAL_BINFILE_FOOTER_LEN);
+    rcv->path = htrace_strdup(path);
+    if ((!rcv->buf) || (!rcv->path)) {
+        htrace_log(tracer->lg, "local_binfile_rcv_create: OOM while "
+                   "allocating the block buffer.\n");
+        local_binfile_rcv_free((struct htrace_rcv*)rcv);
+        return NULL;
+    }
+    rcv->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (rcv->fd < 0) {
+        ret = errno;
+        htrace_log(tracer->lg, "local_binfile_rcv_create: failed to "
+                   "open '%s' for write: error %d (%s)\n",
+                   path, ret, terror(ret));
+        local_binfile_rcv_free((struct htrace_rcv*)rcv);
+        return NULL;
+    }
+    htrace_log(tracer->lg, "Initialized local_binfile receiver with path=%s, "
+               "block_size=%" PRId64 ".\n", rcv->path, rcv->block_size);
+    return (struct htrace_rcv*)rcv;
+}
+
+/**
+ * Write out the block being filled, if it has any spans in it.
+ * This function must be called with the lock held.
+ */
+static void local_binfile_write_block(struct local_binfile_rcv *rcv)
+{
+    uint64_t len, off = 0;
+    ssize_t res;
+    int err = 0;
+
+    if (rcv->ftr.num_spans == 0) {
+        return;
+    }
+    local_binfile_footer_encode(&rcv->ftr, rcv->buf + rcv->ftr.data_len);
+    len = rcv->ftr.data_len + LOCAL_BINFILE_FOOTER_LEN;
+    while (off < len) {
+        res = write(rcv->fd, rcv->buf + off, len - off);
+        if (res < 0) {
+            err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            break;
+        }
+        off += res;
+    }
+    if (off < len) {
+        rcv->dropped_xmit += rcv->ftr.num_spans;
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                "local_binfile_write_block(%s): write error: %d (%s)\n",
+                rcv->path, err, terror(err));
+    } else {
+        rcv->bytes_serialized += rcv->ftr.data_len;
+    }
+    local_binfile_reset_footer(rcv);
+}
+
+/**
+ * Make room in the block buffer for a record.
+ * This function must be called with the lock held.
+ *
+ * @return          0 on success; ENOMEM if the record is larger than any
+ *                      block, and we couldn't grow the buffer.
+ */
+static int local_binfile_make_room(struct local_binfile_rcv *rcv,
+                                   uint64_t rec_len)
+{
+    uint8_t *buf;
+
+    if (rcv->ftr.data_len + rec_len <= rcv->buf_len) {
+        return 0;
+    }
+    local_binfile_write_block(rcv);
+    if (rec_len <= rcv->buf_len) {
+        return 0;
+    }
+    // This span is bigger than a block.  It will go in a block of its own.
+    buf = htrace_realloc(rcv->buf, rec_len + LOCAL_BINFILE_FOOTER_LEN);
+    if (!buf) {
+        return ENOMEM;
+    }
+    rcv->buf = buf;
+    rcv->buf_len = rec_len;
+    return 0;
+}
+
+/**
+ * Append a span to the block being filled.
+ * This function must be called with the lock held.
+ *
+ * @param rcv           The local binfile receiver.
+ * @param span          The span.
+ * @param enc           The span in msgpack form, or NULL to serialize it
+ *                          here.
+ * @param len           The length of enc.  Ignored if enc is NULL.
+ */
+static void local_binfile_add_locked(struct local_binfile_rcv *rcv,
+                                     struct htrace_span *span,
+                                     const uint8_t *enc, uint64_t len)
+{
+    struct local_binfile_footer *ftr = &rcv->ftr;
+    uint8_t *p;
+
+    span->trid = rcv->tracer->trid;
+    if (!enc) {
+        len = span_msgpack_size(span);
+    }
+    if (local_binfile_make_room(rcv, LOCAL_BINFILE_REC_HDR_LEN + len)) {
+        rcv->dropped_oom++;
+        span->trid = NULL;
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                "local_binfile_rcv_add_spans: OOM\n");
+        return;
+    }
+    p = put_be32(rcv->buf + ftr->data_len, len);
+    if (enc) {
+        memcpy(p, enc, len);
+    } else {
+        span_msgpack_encode(span, p);
+    }
+    span->trid = NULL;
+    ftr->data_len += LOCAL_BINFILE_REC_HDR_LEN + len;
+    ftr->num_spans++;
+    if (span->begin_ms < ftr->min_begin_ms) {
+        ftr->min_begin_ms = span->begin_ms;
+    }
+    if (span->end_ms > ftr->max_end_ms) {
+        ftr->max_end_ms = span->end_ms;
+    }
+    if (span->span_id.high < ftr->min_trace_id) {
+        ftr->min_trace_id = span->span_id.high;
+    }
+    if (span->span_id.high > ftr->max_trace_id) {
+        ftr->max_trace_id = span->span_id.high;
+    }
+    // Once the block is full, write it, rather than waiting for the next
+    // span.
+    if (ftr->data_len >= rcv->block_size) {
+        local_binfile_write_block(rcv);
+    }
+}
+
+static void local_binfile_rcv_add_spans(struct htrace_rcv *r,
+                                        struct htrace_span **spans,
+                                        int num_spans)
+{
+    struct local_binfile_rcv *rcv = (struct local_binfile_rcv *)r;
+    int i;
+
+    pthread_mutex_lock(&rcv->lock);
+    for (i = 0; i < num_spans; i++) {
+        local_binfile_add_locked(rcv, spans[i], NULL, 0);
+    }
+    pthread_mutex_unlock(&rcv->lock);
+}
+
+static void local_binfile_rcv_add_msgpack(struct htrace_rcv *r,
+                                          struct htrace_span **spans,
+                                          const uint8_t *buf,
+                                          const uint64_t *lens,
+                                          int num_spans)
+{
+    struct local_binfile_rcv *rcv = (struct local_binfile_rcv *)r;
+    int i;
+
+    pthread_mutex_lock(&rcv->lock);
+    for (i = 0; i < num_spans; i++) {
+        local_binfile_add_locked(rcv, spans[i], buf, lens[i]);
+        buf += lens[i];
+    }
+    pthread_mutex_unlock(&rcv->lock);
+}
+
+static void local_binfile_rcv_add_span(struct htrace_rcv *r,
+                                       struct htrace_span *span)
+{
+    local_binfile_rcv_add_spans(r, &span, 1);
+}
+
+static void local_binfile_rcv_flush(struct htrace_rcv *r)
+{
+    struct local_binfile_rcv *rcv = (struct local_binfile_rcv *)r;
+
+    pthread_mutex_lock(&rcv->lock);
+    local_binfile_write_block(rcv);
+    pthread_mutex_unlock(&rcv->lock);
+}
+
+static void local_binfile_rcv_free(struct htrace_rcv *r)
+{
+    struct local_binfile_rcv *rcv = (struct local_binfile_rcv *)r;
+    struct htrace_log *lg;
+    int ret;
+
+    if (!rcv) {
+        return;
+    }
+    lg = rcv->tracer->lg;
+    if (rcv->fd >= 0) {
+        htrace_log(lg, "Shutting down local_binfile receiver with path=%s\n",
+                   rcv->path);
+        local_binfile_write_block(rcv);
+        if (close(rcv->fd)) {
+            ret = errno;
+            htrace_log(lg, "local_binfile_rcv_free: close error "
+                       "%d: %s\n", ret, terror(ret));
+        }
+    }
+    ret = pthread_mutex_destroy(&rcv->lock);
+    if (ret) {
+        htrace_log(lg, "local_binfile_rcv_free: pthread_mutex_destroy "
+                   "error %d: %s\n", ret, terror(ret));
+    }
+    htrace_free(rcv->buf);
+    htrace_free(rcv->path);
+    htrace_free(rcv);
+}
+
+static void local_binfile_rcv_get_stats(struct htrace_rcv *r,
+                                        struct htrace_stats *stats)
+{
+    struct local_binfile_rcv *rcv = (struct local_binfile_rcv *)r;
+
+    pthread_mutex_lock(&rcv->lock);
+    stats->bytes_serialized = rcv->bytes_serialized;
+    stats->dropped_oom += rcv->dropped_oom;
+    stats->dropped_xmit = rcv->dropped_xmit;
+    pthread_mutex_unlock(&rcv->lock);
+}
+
+const struct htrace_rcv_ty g_local_binfile_rcv_ty = {
+    "local.binfile",
+    local_binfile_rcv_create,
+    local_binfile_rcv_add_span,
+    local_binfile_rcv_add_spans,
+    NULL,
+    local_binfile_rcv_flush,
+    local_binfile_rcv_free,
+    local_binfile_rcv_get_stats,
+    NULL,
+    local_binfile_rcv_add_msgpack,
+    NULL,
+};
+
+// vim:ts=4:sw=4:et
@@ -0,0 +1,115 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef APACHE_HTRACE_RECEIVER_LOCAL_BINFILE_H
+#define APACHE_HTRACE_RECEIVER_LOCAL_BINFILE_H
+
+/**
+ * @file local_binfile.h
+ *
+ * The layout of the files written by the local.binfile span receiver.
+ *
+ * A file is a sequence of blocks.  Each block is a run of records followed
+ * by a footer of LOCAL_BINFILE_FOOTER_LEN bytes.  Each record is a 4-byte
+ * length followed by that many bytes of one span, in the same msgpack form
+ * that span_write_msgpack produces.  The footer gives the length of the
+ * records before it, the number of spans, and the range of times and trace
+ * IDs (the high half of the span IDs) of the spans in the block.
+ *
+ * A reader can map the file and walk the footers backwards from the end,
+ * reading only the blocks which overlap the time window or trace IDs it is
+ * looking for.  Each block is written with a single write call, so a block
+ * is only ever torn if the process dies in the middle of it.  If the last
+ * footer's magic number is wrong, the end of the file was torn.
+ *
+ * All integers are big-endian, as in msgpack, so files can be read on any
+ * host.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stdint.h>
+
+/**
+ * The last 4 bytes of every footer.
+ */
+#define LOCAL_BINFILE_MAGIC 0x48544246U
+
+#define LOCAL_BINFILE_VERSION 1
+
+/**
+ * The length of the length prefix of each record.
+ */
+#define LOCAL_BINFILE_REC_HDR_LEN 4
+
+/**
+ * The length of a block footer.
+ */
+#define LOCAL_BINFILE_FOOTER_LEN 56
+
+/**
+ * A decoded block footer.
+ */
+struct local_binfile_footer {
+    /**
+     * The number of bytes of records before the footer.
+     */
+    uint64_t data_len;
+
+    /**
+     * The number of spans in the block.
+     */
+    uint64_t num_spans;
+
+    /**
+     * The smallest begin time of any span in the block, in milliseconds.
+     */
+    uint64_t min_begin_ms;
+
+    /**
+     * The largest end time of any span in the block, in milliseconds.
+     */
+    uint64_t max_end_ms;
+
+    /**
+     * The smallest and largest trace IDs of any span in the block.
+     */
+    uint64_t min_trace_id;
+    uint64_t max_trace_id;
+
+    /**
+     * LOCAL_BINFILE_VERSION.
+     */
+    uint32_t version;
+};
+
+/**
+ * Decode a block footer.
+ *
+ * @param buf       The LOCAL_BINFILE_FOOTER_LEN bytes of the footer.
+ * @param ftr       (out param) The decoded footer.
+ *
+ * @return          1 on success; 0 if the magic number was wrong.
+ */
+int local_binfile_footer_decode(const uint8_t *buf,
+                                struct local_binfile_footer *ftr);
+
+#endif
+
+// vim: ts=4:sw=4:et
@@ -21,14 +21,145 @@
 #include "core/htracer.h"
 #include "core/span.h"
 #include "receiver/receiver.h"
+#include "util/alloc.h"
 #include "util/log.h"
+#include "util/time.h"
+#include "util/tsd.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @file local_file.c
+ *
+ * A span receiver that writes spans to a local file, one JSON object per line.
+ *
+ * By default, application threads format their spans and append them to the
+ * file under a lock.  In async mode, they copy the formatted spans into a
+ * per-thread staging buffer instead, and a background writer thread gathers
+ * the staging buffers into one of two large page-aligned buffers, which it
+ * hands to write() while the other one fills.  Only the writer thread touches
+ * the file in async mode.
+ *
+ * In either mode, the file can be rotated once it reaches a certain size or
+ * age.  The current file is renamed to path.1, path.1 to path.2, and so on,
+ * and the oldest one is deleted.
+ */
+
+/**
+ * The size of the buffer on the stack which spans are formatted into.
+ * Batches which might not fit get a buffer from malloc instead.
+ */
+#define LOCAL_FILE_STACK_BUF_LEN 8192
+
+/**
+ * The alignment of the writer thread's buffers.
+ */
+#define LOCAL_FILE_BUF_ALIGN 4096
+
+#define LOCAL_FILE_BUFFER_SIZE_MIN 65536ULL
+#define LOCAL_FILE_BUFFER_SIZE_MAX (256ULL * 1024ULL * 1024ULL)
+
+/**
+ * The staging buffers are this many times smaller than the writer thread's
+ * buffers, so that a full staging buffer always fits into an empty one.
+ */
+#define LOCAL_FILE_TBUF_DIVISOR 16
+
+/**
+ * The longest time the writer thread will wait between sweeps.
+ */
+#define LOCAL_FILE_FLUSH_INTERVAL_MS_MAX 3600000ULL
+
+/**
+ * When to call fdatasync on the local file.
+ */
+enum local_file_sync_policy {
+    LOCAL_FILE_SYNC_NONE = 0,
+    LOCAL_FILE_SYNC_WRITE = 1,
+    LOCAL_FILE_SYNC_INTERVAL = 2,
+};
+
+static const char * const LOCAL_FILE_SYNC_POLICY_NAMES[] = {
+    "none",
+    "write",
+    "interval",
+};
+
+struct local_file_rcv;
+
+/**
+ * A buffer which the writer thread hands to write().
+ */
+struct local_file_wbuf {
+    /**
+     * The buffer data.  Aligned to LOCAL_FILE_BUF_ALIGN.
+     */
+    char *buf;
+
+    /**
+     * The size of the buffer.
+     */
+    uint64_t len;
+
+    /**
+     * The number of bytes used.
+     */
+    uint64_t off;
+
+    /**
+     * The number of spans in the buffer.
+     */
+    uint64_t num_spans;
+};
+
+/**
+ * A per-thread staging buffer.
+ */
+struct local_file_tbuf {
+    /**
+     * The receiver which owns this staging buffer.
+     */
+    struct local_file_rcv *rcv;
+
+    /**
+     * The next and previous staging buffers in the receiver's list.
+     * Protected by the receiver lock.
+     */
+    struct local_file_tbuf *next;
+    struct local_file_tbuf *prev;
+
+    /**
+     * Lock protecting the buffer contents.  This is normally only taken by the
+     * owning thread, so it is rarely contended.  When both locks are needed,
+     * the receiver lock must be taken first.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * The number of bytes used.
+     */
+    uint64_t off;
+
+    /**
+     * The number of spans in the buffer.
+     */
+    uint64_t num_spans;
+
+    /**
+     * The buffer itself.  Its length is the receiver's tbuf_len.
+     */
+    char buf[0];
+};
 
 /*
  * A span receiver that writes spans to a local file.
@@ -42,23 +173,862 @@ struct local_file_rcv {
     struct htracer *tracer;
 
     /**
-     * The local file.
+     * The local file, or NULL if it couldn't be opened.  Only used in sync
+     * mode; async mode writes straight to fd.
      */
     FILE *fp;
 
+    /**
+     * The local file descriptor, or -1 if the file couldn't be opened.
+     */
+    int fd;
+
     /**
      * Path to the local file.  Dynamically allocated.
      */
     char *path;
 
     /**
-     * Lock protecting the local file from concurrent writes.
+     * Nonzero if we write spans from a background thread.
+     */
+    int async;
+
+    /**
+     * When to call fdatasync, and how often, for LOCAL_FILE_SYNC_INTERVAL.
+     */
+    enum local_file_sync_policy sync_policy;
+    uint64_t sync_interval_ms;
+
+    /**
+     * The size in bytes and age in milliseconds at which we rotate the file,
+     * or 0 if we don't.
+     */
+    uint64_t rotate_size;
+    uint64_t rotate_interval_ms;
+
+    /**
+     * The number of rotated files to keep.
+     */
+    uint64_t rotate_keep;
+
+    /**
+     * The size of the current file, the monotonic time in ms at which we
+     * opened it, and the monotonic time in ms of the last fdatasync.
+     * Nonzero dirty means we wrote data since the last fdatasync.
+     *
+     * Like fd and fp, these are protected by the lock in sync mode, and only
+     * used by the writer thread in async mode.
+     */
+    uint64_t cur_size;
+    uint64_t opened_ms;
+    uint64_t synced_ms;
+    int dirty;
+
+    /**
+     * Lock protecting the local file from concurrent writes in sync mode, and
+     * the buffers and writer thread state in async mode.
      */
     pthread_mutex_t lock;
+
+    /**
+     * The number of bytes of span data we wrote.  Protected by the lock.
+     */
+    uint64_t bytes_serialized;
+
+    /**
+     * The number of spans we could not write because we ran out of memory.
+     * Protected by the lock.
+     */
+    uint64_t dropped_oom;
+
+    /**
+     * The number of spans we could not write because of an I/O error.
+     * Protected by the lock.
+     */
+    uint64_t dropped_xmit;
+
+    /**
+     * The remaining fields are only used in async mode.
+     */
+
+    /**
+     * The longest time the writer thread waits before sweeping the staging
+     * buffers.
+     */
+    uint64_t flush_interval_ms;
+
+    /**
+     * The size of each staging buffer.
+     */
+    uint64_t tbuf_len;
+
+    /**
+     * Each thread's staging buffer.
+     */
+    struct htrace_tsd tbuf_tsd;
+
+    /**
+     * Nonzero if tbuf_tsd was initialized.
+     */
+    int tbuf_tsd_valid;
+
+    /**
+     * All the staging buffers.  Protected by the lock.
+     */
+    struct local_file_tbuf *tbufs;
+
+    /**
+     * The writer thread's buffers.  bufs[active] is filled under the lock,
+     * while the writer thread writes out the other one without it.
+     */
+    struct local_file_wbuf bufs[2];
+    int active;
+
+    /**
+     * The writer thread.
+     */
+    pthread_t writer;
+
+    /**
+     * Nonzero if the writer thread was started.
+     */
+    int writer_started;
+
+    /**
+     * Nonzero once the writer thread has exited.  Protected by the lock.
+     */
+    int writer_exited;
+
+    /**
+     * Signalled to wake up the writer thread.
+     */
+    pthread_cond_t writer_cond;
+
+    /**
+     * Broadcast when the writer thread swaps buffers.
+     */
+    pthread_cond_t room_cond;
+
+    /**
+     * Broadcast when the writer thread finishes a flush.
+     */
+    pthread_cond_t flush_cond;
+
+    /**
+     * Nonzero if someone wants the writer thread to sweep right away.
+     * Protected by the lock.
+     */
+    int kick;
+
+    /**
+     * Nonzero if the writer thread should write out everything and exit.
+     * Protected by the lock.
+     */
+    int shutdown;
+
+    /**
+     * The number of flushes requested so far, and the number that the writer
+     * thread has finished.  Protected by the lock.
+     */
+    uint64_t flush_req;
+    uint64_t flush_done;
 };
 
 static void local_file_rcv_free(struct htrace_rcv *r);
 
+static uint64_t local_file_get_bounded_u64(struct htrace_log *lg,
+                const struct htrace_conf *cnf, const char *prop,
+                uint64_t min, uint64_t max)
+{
+    uint64_t val = htrace_conf_get_u64(lg, cnf, prop);
+    if (val < min) {
+        htrace_log(lg, "local_file_rcv_create: can't set %s to %" PRId64
+                   ".  Using minimum value of %" PRId64 " instead.\n",
+                   prop, val, min);
+        return min;
+    } else if (val > max) {
+        htrace_log(lg, "local_file_rcv_create: can't set %s to %" PRId64
+                   ".  Using maximum value of %" PRId64 " instead.\n",
+                   prop, val, max);
+        return max;
+    }
+    return val;
+}
+
+static enum local_file_sync_policy local_file_get_sync_policy(
+                struct htrace_log *lg, const struct htrace_conf *cnf)
+{
+    const char *val;
+    int i;
+
+    val = htrace_conf_get(cnf, HTRACE_LOCAL_FILE_FDATASYNC_KEY);
+    for (i = 0; i <= LOCAL_FILE_SYNC_INTERVAL; i++) {
+        if (val && !strcmp(val, LOCAL_FILE_SYNC_POLICY_NAMES[i])) {
+            return i;
+        }
+    }
+    htrace_log(lg, "local_file_rcv_create: unknown value for %s: '%s'.  "
+               "Using %s instead.\n", HTRACE_LOCAL_FILE_FDATASYNC_KEY,
+               (val ? val : "(null)"),
+               LOCAL_FILE_SYNC_POLICY_NAMES[LOCAL_FILE_SYNC_NONE]);
+    return LOCAL_FILE_SYNC_NONE;
+}
+
+/**
+ * Open the local file for appending.
+ *
+ * @param rcv           The local file receiver.
+ *
+ * @return              0 on success; the error number otherwise.
+ */
+static int local_file_open(struct local_file_rcv *rcv)
+{
+    struct stat st;
+    int ret;
+
+    rcv->fd = open(rcv->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                   0666);
+    if (rcv->fd < 0) {
+        return errno;
+    }
+    if (fstat(rcv->fd, &st) < 0) {
+        ret = errno;
+        close(rcv->fd);
+        rcv->fd = -1;
+        return ret;
+    }
+    if (!rcv->async) {
+        rcv->fp = fdopen(rcv->fd, "a");
+        if (!rcv->fp) {
+            ret = errno;
+            close(rcv->fd);
+            rcv->fd = -1;
+            return ret;
+        }
+    }
+    rcv->cur_size = st.st_size;
+    rcv->opened_ms = monotonic_now_ms(rcv->tracer->lg);
+    return 0;
+}
+
+/**
+ * Close the local file, if it is open.
+ *
+ * @param rcv           The local file receiver.
+ *
+ * @return              0 on success; the error number otherwise.
+ */
+static int local_file_close(struct local_file_rcv *rcv)
+{
+    int ret = 0;
+
+    if (rcv->fp) {
+        if (fclose(rcv->fp)) {
+            ret = errno;
+        }
+    } else if (rcv->fd >= 0) {
+        if (close(rcv->fd)) {
+            ret = errno;
+        }
+    }
+    rcv->fp = NULL;
+    rcv->fd = -1;
+    return ret;
+}
+
+/**
+ * Write data that we have buffered out to stable storage.
+ *
+ * @param rcv           The local file receiver.
+ * @param now           The monotonic time in ms.
+ */
+static void local_file_sync(struct local_file_rcv *rcv, uint64_t now)
+{
+    int ret;
+
+    if (rcv->fp && fflush(rcv->fp)) {
+        ret = errno;
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                "local_file_sync(%s): fflush error: %d (%s)\n",
+                rcv->path, ret, terror(ret));
+    }
+    if (fdatasync(rcv->fd) < 0) {
+        ret = errno;
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                "local_file_sync(%s): fdatasync error: %d (%s)\n",
+                rcv->path, ret, terror(ret));
+    }
+    rcv->synced_ms = now;
+    rcv->dirty = 0;
+}
+
+/**
+ * Rotate the local file.  The current file becomes path.1, path.1 becomes
+ * path.2, and so on.  Files past the number we keep are deleted.
+ *
+ * @param rcv           The local file receiver.
+ */
+static void local_file_rotate(struct local_file_rcv *rcv)
+{
+    struct htrace_log *lg = rcv->tracer->lg;
+    size_t name_len = strlen(rcv->path) + 24;
+    char *src, *dst;
+    uint64_t i;
+    int ret;
+
+    src = htrace_malloc(name_len);
+    dst = htrace_malloc(name_len);
+    if ((!src) || (!dst)) {
+        HTRACE_LOG_RATELIMITED(lg, HTRACE_LOG_ERROR,
+                "local_file_rotate(%s): OOM\n", rcv->path);
+        goto done;
+    }
+    if (rcv->sync_policy != LOCAL_FILE_SYNC_NONE) {
+        local_file_sync(rcv, monotonic_now_ms(lg));
+    }
+    ret = local_file_close(rcv);
+    if (ret) {
+        HTRACE_LOG_RATELIMITED(lg, HTRACE_LOG_ERROR,
+                "local_file_rotate(%s): close error: %d (%s)\n",
+                rcv->path, ret, terror(ret));
+    }
+    if (rcv->rotate_keep == 0) {
+        if ((unlink(rcv->path) < 0) && (errno != ENOENT)) {
+            ret = errno;
+            HTRACE_LOG_RATELIMITED(lg, HTRACE_LOG_ERROR,
+                    "local_file_rotate(%s): unlink error: %d (%s)\n",
+                    rcv->path, ret, terror(ret));
+        }
+    }
+    for (i = rcv->rotate_keep; i > 0; i--) {
+        if (i == 1) {
+            snprintf(src, name_len, "%s", rcv->path);
+        } else {
+            snprintf(src, name_len, "%s.%" PRId64, rcv->path, i - 1);
+        }
+        snprintf(dst, name_len, "%s.%" PRId64, rcv->path, i);
+        if ((rename(src, dst) < 0) && (errno != ENOENT)) {
+            ret = errno;
+            HTRACE_LOG_RATELIMITED(lg, HTRACE_LOG_ERROR,
+                    "local_file_rotate: failed to rename %s to %s: "
+                    "error %d (%s)\n", src, dst, ret, terror(ret));
+        }
+    }
+    ret = local_file_open(rcv);
+    if (ret) {
+        HTRACE_LOG_RATELIMITED(lg, HTRACE_LOG_ERROR,
+                "local_file_rotate: failed to reopen %s: error %d (%s)\n",
+                rcv->path, ret, terror(ret));
+    }
+done:
+    htrace_free(src);
+    htrace_free(dst);
+}
+
+/**
+ * Sync and rotate the local file as needed after writing to it.
+ * This function must be called by whoever owns the file: a thread holding the
+ * lock in sync mode, or the writer thread in async mode.
+ *
+ * @param rcv           The local file receiver.
+ * @param len           The number of bytes we just wrote.
+ */
+static void local_file_wrote(struct local_file_rcv *rcv, uint64_t len)
+{
+    uint64_t now;
+
+    if (rcv->fd < 0) {
+        return;
+    }
+    rcv->cur_size += len;
+    if (len > 0) {
+        rcv->dirty = 1;
+    }
+    now = monotonic_now_ms(rcv->tracer->lg);
+    switch (rcv->sync_policy) {
+    case LOCAL_FILE_SYNC_WRITE:
+        if (rcv->dirty) {
+            local_file_sync(rcv, now);
+        }
+        break;
+    case LOCAL_FILE_SYNC_INTERVAL:
+        if (rcv->dirty && (now - rcv->synced_ms >= rcv->sync_interval_ms)) {
+            local_file_sync(rcv, now);
+        }
+        break;
+    default:
+        break;
+    }
+    if (rcv->cur_size == 0) {
+        return;
+    }
+    if ((rcv->rotate_size && (rcv->cur_size >= rcv->rotate_size)) ||
+        (rcv->rotate_interval_ms &&
+         (now - rcv->opened_ms >= rcv->rotate_interval_ms))) {
+        local_file_rotate(rcv);
+    }
+}
+
+/**
+ * Write spans to the local file in sync mode.
+ *
+ * @param rcv           The local file receiver.
+ * @param buf           The formatted spans.
+ * @param len           The length of buf.
+ * @param num_spans     The number of spans in buf.
+ */
+static void local_file_write_sync(struct local_file_rcv *rcv,
+                const char *buf, size_t len, int num_spans)
+{
+    size_t res = 0;
+    int err = 0;
+
+    pthread_mutex_lock(&rcv->lock);
+    if (!rcv->fp) {
+        err = local_file_open(rcv);
+    }
+    if (!err) {
+        res = fwrite(buf, 1, len, rcv->fp);
+        err = errno;
+    }
+    if (res < len) {
+        rcv->dropped_xmit += num_spans;
+    } else {
+        rcv->bytes_serialized += len;
+        local_file_wrote(rcv, len);
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    if (res < len) {
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                "local_file_rcv_add_spans(%s): fwrite error: %d (%s)\n",
+                rcv->path, err, terror(err));
+    }
+}
+
+/**
+ * Ask the writer thread to run, and wait until it hands us an empty buffer.
+ * This function must be called with the lock held.
+ *
+ * @param rcv           The local file receiver.
+ *
+ * @return              1 if the writer thread ran; 0 if it has exited.
+ */
+static int local_file_wait_for_room(struct local_file_rcv *rcv)
+{
+    if (rcv->writer_exited) {
+        return 0;
+    }
+    rcv->kick = 1;
+    pthread_cond_signal(&rcv->writer_cond);
+    pthread_cond_wait(&rcv->room_cond, &rcv->lock);
+    return 1;
+}
+
+/**
+ * Copy data into the active writer buffer.
+ * This function must be called with the lock held.
+ *
+ * @param rcv           The local file receiver.
+ * @param buf           The data to copy.
+ * @param len           The length of the data.
+ * @param num_spans     The number of spans in the data.
+ */
+static void local_file_wbuf_append(struct local_file_rcv *rcv,
+                const char *buf, uint64_t len, uint64_t num_spans)
+{
+    struct local_file_wbuf *wb;
+    uint64_t new_len;
+    void *nbuf;
+
+    while (1) {
+        wb = &rcv->bufs[rcv->active];
+        if (wb->len - wb->off >= len) {
+            break;
+        }
+        if (wb->off == 0) {
+            // This is bigger than a whole buffer.  Grow the empty one.
+            new_len = (len + LOCAL_FILE_BUF_ALIGN - 1) &
+                ~((uint64_t)LOCAL_FILE_BUF_ALIGN - 1);
+            if (htrace_memalign(&nbuf, LOCAL_FILE_BUF_ALIGN, new_len)) {
+                rcv->dropped_oom += num_spans;
+                HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                        "local_file_wbuf_append: OOM\n");
+                return;
+            }
+            htrace_free(wb->buf);
+            wb->buf = nbuf;
+            wb->len = new_len;
+            break;
+        }
+        if (!local_file_wait_for_room(rcv)) {
+            rcv->dropped_xmit += num_spans;
+            return;
+        }
+    }
+    memcpy(wb->buf + wb->off, buf, len);
+    wb->off += len;
+    wb->num_spans += num_spans;
+    if (wb->off >= wb->len / 2) {
+        rcv->kick = 1;
+        pthread_cond_signal(&rcv->writer_cond);
+    }
+}
+
+/**
+ * Copy the contents of a staging buffer into the active writer buffer.
+ * This function must be called with both the receiver lock and the staging
+ * buffer lock held.
+ *
+ * @param rcv           The local file receiver.
+ * @param tbuf          The staging buffer.
+ *
+ * @return              1 if the staging buffer is now empty; 0 if there was
+ *                          not enough space in the active writer buffer.
+ */
+static int local_file_tbuf_drain(struct local_file_rcv *rcv,
+                                 struct local_file_tbuf *tbuf)
+{
+    struct local_file_wbuf *wb = &rcv->bufs[rcv->active];
+
+    if (tbuf->off == 0) {
+        return 1;
+    }
+    if (wb->len - wb->off < tbuf->off) {
+        return 0;
+    }
+    memcpy(wb->buf + wb->off, tbuf->buf, tbuf->off);
+    wb->off += tbuf->off;
+    wb->num_spans += tbuf->num_spans;
+    tbuf->off = 0;
+    tbuf->num_spans = 0;
+    return 1;
+}
+
+/**
+ * Copy the contents of all staging buffers into the active writer buffer.
+ * This function must be called with the lock held.
+ *
+ * @param rcv           The local file receiver.
+ *
+ * @return              1 if all staging buffers are now empty; 0 otherwise.
+ */
+static int local_file_tbufs_sweep(struct local_file_rcv *rcv)
+{
+    struct local_file_tbuf *tbuf;
+    int drained = 1;
+
+    for (tbuf = rcv->tbufs; tbuf; tbuf = tbuf->next) {
+        pthread_mutex_lock(&tbuf->lock);
+        if (!local_file_tbuf_drain(rcv, tbuf)) {
+            drained = 0;
+        }
+        pthread_mutex_unlock(&tbuf->lock);
+    }
+    return drained;
+}
+
+/**
+ * Move the contents of the current thread's staging buffer into the active
+ * writer buffer, waiting for room if needed.
+ * This function must be called with the receiver lock held, and without the
+ * staging buffer lock held.
+ *
+ * @param rcv           The local file receiver.
+ * @param tbuf          The current thread's staging buffer.
+ */
+static void local_file_tbuf_flush(struct local_file_rcv *rcv,
+                                  struct local_file_tbuf *tbuf)
+{
+    while (1) {
+        pthread_mutex_lock(&tbuf->lock);
+        if (local_file_tbuf_drain(rcv, tbuf)) {
+            pthread_mutex_unlock(&tbuf->lock);
+            return;
+        }
+        pthread_mutex_unlock(&tbuf->lock);
+        // We can't hold the staging buffer lock here, since the writer thread
+        // may need it to make progress while we wait.  Only the current
+        // thread adds to the staging buffer, so it can only get emptier in
+        // the meantime.
+        if (!local_file_wait_for_room(rcv)) {
+            break;
+        }
+    }
+    pthread_mutex_lock(&tbuf->lock);
+    rcv->dropped_xmit += tbuf->num_spans;
+    tbuf->off = 0;
+    tbuf->num_spans = 0;
+    pthread_mutex_unlock(&tbuf->lock);
+}
+
+/**
+ * Called when a thread with a staging buffer exits.
+ */
+static void local_file_tbuf_retire(void *data)
+{
+    struct local_file_tbuf *tbuf = data;
+    struct local_file_rcv *rcv = tbuf->rcv;
+
+    pthread_mutex_lock(&rcv->lock);
+    local_file_tbuf_flush(rcv, tbuf);
+    if (tbuf->prev) {
+        tbuf->prev->next = tbuf->next;
+    } else {
+        rcv->tbufs = tbuf->next;
+    }
+    if (tbuf->next) {
+        tbuf->next->prev = tbuf->prev;
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    pthread_mutex_destroy(&tbuf->lock);
+    htrace_free(tbuf);
+}
+
+/**
+ * Get the current thread's staging buffer, creating it if needed.
+ *
+ * @param rcv           The local file receiver.
+ *
+ * @return              The staging buffer, or NULL on error.
+ */
+static struct local_file_tbuf *local_file_tbuf_get(struct local_file_rcv *rcv)
+{
+    struct local_file_tbuf *tbuf;
+
+    tbuf = htrace_tsd_get(&rcv->tbuf_tsd);
+    if (tbuf) {
+        return tbuf;
+    }
+    tbuf = htrace_malloc(offsetof(struct local_file_tbuf, buf) +
+                         rcv->tbuf_len);
+    if (!tbuf) {
+        return NULL;
+    }
+    if (pthread_mutex_init(&tbuf->lock, NULL)) {
+        htrace_free(tbuf);
+        return NULL;
+    }
+    tbuf->rcv = rcv;
+    tbuf->off = 0;
+    tbuf->num_spans = 0;
+    tbuf->prev = NULL;
+    if (htrace_tsd_set(&rcv->tbuf_tsd, tbuf)) {
+        pthread_mutex_destroy(&tbuf->lock);
+        htrace_free(tbuf);
+        return NULL;
+    }
+    pthread_mutex_lock(&rcv->lock);
+    tbuf->next = rcv->tbufs;
+    if (rcv->tbufs) {
+        rcv->tbufs->prev = tbuf;
+    }
+    rcv->tbufs = tbuf;
+    pthread_mutex_unlock(&rcv->lock);
+    return tbuf;
+}
+
+/**
+ * Stage spans for the writer thread in async mode.
+ *
+ * @param rcv           The local file receiver.
+ * @param buf           The formatted spans.
+ * @param len           The length of buf.
+ * @param num_spans     The number of spans in buf.
+ */
+static void local_file_stage(struct local_file_rcv *rcv,
+                const char *buf, size_t len, int num_spans)
+{
+    struct local_file_tbuf *tbuf;
+
+    tbuf = local_file_tbuf_get(rcv);
+    if (tbuf) {
+        pthread_mutex_lock(&tbuf->lock);
+        if (rcv->tbuf_len - tbuf->off >= len) {
+            memcpy(tbuf->buf + tbuf->off, buf, len);
+            tbuf->off += len;
+            tbuf->num_spans += num_spans;
+            pthread_mutex_unlock(&tbuf->lock);
+            return;
+        }
+        pthread_mutex_unlock(&tbuf->lock);
+    }
+    // The staging buffer is full, or we don't have one.  Move what we have
+    // staged along first, so that the spans stay in order.
+    pthread_mutex_lock(&rcv->lock);
+    if (tbuf) {
+        local_file_tbuf_flush(rcv, tbuf);
+    }
+    local_file_wbuf_append(rcv, buf, len, num_spans);
+    pthread_mutex_unlock(&rcv->lock);
+}
+
+/**
+ * Write a whole buffer to a file descriptor.
+ *
+ * @return              0 on success; the error number otherwise.
+ */
+static int local_file_write_fully(int fd, const char *buf, uint64_t len)
+{
+    ssize_t res;
+
+    while (len > 0) {
+        res = write(fd, buf, len);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/**
+ * Wait until the writer thread has something to do, or until it is time for
+ * it to sweep the staging buffers.
+ * This function must be called with the lock held.
+ *
+ * @param rcv           The local file receiver.
+ */
+static void local_file_writer_wait(struct local_file_rcv *rcv)
+{
+    struct timespec deadline;
+    int ret;
+
+    // Note that pthread_cond_timedwait uses the realtime clock.
+    ms_to_timespec(now_ms(rcv->tracer->lg) + rcv->flush_interval_ms,
+                   &deadline);
+    while ((!rcv->kick) && (!rcv->shutdown) &&
+           (rcv->flush_req == rcv->flush_done)) {
+        ret = pthread_cond_timedwait(&rcv->writer_cond, &rcv->lock,
+                                     &deadline);
+        if (ret == ETIMEDOUT) {
+            break;
+        } else if (ret) {
+            htrace_log(rcv->tracer->lg, "local_file_writer: "
+                       "pthread_cond_timedwait error: %d (%s)\n",
+                       ret, terror(ret));
+            break;
+        }
+    }
+    rcv->kick = 0;
+}
+
+/**
+ * The writer thread.  It takes turns sweeping the staging buffers into one
+ * writer buffer while it writes out the other.
+ */
+static void *local_file_writer(void *data)
+{
+    struct local_file_rcv *rcv = data;
+    struct local_file_wbuf *wb;
+    uint64_t target;
+    int drained = 1, shutdown, ret;
+
+    pthread_mutex_lock(&rcv->lock);
+    while (1) {
+        if (drained) {
+            local_file_writer_wait(rcv);
+        }
+        target = rcv->flush_req;
+        shutdown = rcv->shutdown;
+        drained = local_file_tbufs_sweep(rcv);
+        wb = &rcv->bufs[rcv->active];
+        rcv->active = !rcv->active;
+        pthread_cond_broadcast(&rcv->room_cond);
+        pthread_mutex_unlock(&rcv->lock);
+
+        ret = 0;
+        if (wb->off > 0) {
+            if (rcv->fd < 0) {
+                ret = local_file_open(rcv);
+            }
+            if (!ret) {
+                ret = local_file_write_fully(rcv->fd, wb->buf, wb->off);
+            }
+            if (ret) {
+                HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                        "local_file_writer(%s): write error: %d (%s)\n",
+                        rcv->path, ret, terror(ret));
+            }
+        }
+        local_file_wrote(rcv, ret ? 0 : wb->off);
+
+        pthread_mutex_lock(&rcv->lock);
+        if (ret) {
+            rcv->dropped_xmit += wb->num_spans;
+        } else {
+            rcv->bytes_serialized += wb->off;
+        }
+        wb->off = 0;
+        wb->num_spans = 0;
+        if (drained) {
+            rcv->flush_done = target;
+            pthread_cond_broadcast(&rcv->flush_cond);
+            if (shutdown) {
+                break;
+            }
+        }
+    }
+    rcv->writer_exited = 1;
+    pthread_cond_broadcast(&rcv->room_cond);
+    pthread_mutex_unlock(&rcv->lock);
+    return NULL;
+}
+
+/**
+ * Set up the staging buffers and start the writer thread.
+ *
+ * @param rcv           The local file receiver.
+ * @param conf          The configuration.
+ *
+ * @return              0 on success; nonzero otherwise.
+ */
+static int local_file_async_init(struct local_file_rcv *rcv,
+                                 const struct htrace_conf *conf)
+{
+    struct htrace_log *lg = rcv->tracer->lg;
+    uint64_t buf_len;
+    void *buf;
+    int i, ret;
+
+    buf_len = local_file_get_bounded_u64(lg, conf,
+                HTRACE_LOCAL_FILE_BUFFER_SIZE_KEY,
+                LOCAL_FILE_BUFFER_SIZE_MIN, LOCAL_FILE_BUFFER_SIZE_MAX);
+    buf_len = (buf_len + LOCAL_FILE_BUF_ALIGN - 1) &
+        ~((uint64_t)LOCAL_FILE_BUF_ALIGN - 1);
+    rcv->tbuf_len = buf_len / LOCAL_FILE_TBUF_DIVISOR;
+    rcv->flush_interval_ms = local_file_get_bounded_u64(lg, conf,
+                HTRACE_LOCAL_FILE_FLUSH_INTERVAL_MS_KEY,
+                1, LOCAL_FILE_FLUSH_INTERVAL_MS_MAX);
+    for (i = 0; i < 2; i++) {
+        if (htrace_memalign(&buf, LOCAL_FILE_BUF_ALIGN, buf_len)) {
+            htrace_log(lg, "local_file_rcv_create: OOM while allocating "
+                       "a %" PRId64 "-byte write buffer.\n", buf_len);
+            return ENOMEM;
+        }
+        rcv->bufs[i].buf = buf;
+        rcv->bufs[i].len = buf_len;
+    }
+    ret = htrace_tsd_init(&rcv->tbuf_tsd, local_file_tbuf_retire);
+    if (ret) {
+        htrace_log(lg, "local_file_rcv_create: htrace_tsd_init "
+                   "error %d: %s\n", ret, terror(ret));
+        return ret;
+    }
+    rcv->tbuf_tsd_valid = 1;
+    ret = pthread_create(&rcv->writer, NULL, local_file_writer, rcv);
+    if (ret) {
+        htrace_log(lg, "local_file_rcv_create: failed to create writer "
+                   "thread: error %d: %s\n", ret, terror(ret));
+        return ret;
+    }
+    rcv->writer_started = 1;
+    return 0;
+}
+
 static struct htrace_rcv *local_file_rcv_create(struct htracer *tracer,
                                              const struct htrace_conf *conf)
 {
@@ -73,83 +1043,136 @@ static struct htrace_rcv *local_file_rcv_create(struct htracer *tracer,
                    "to write spans to.\n", HTRACE_LOCAL_FILE_RCV_PATH_KEY);
         return NULL;
     }
-    rcv = calloc(1, sizeof(*rcv));
+    rcv = htrace_calloc(1, sizeof(*rcv));
     if (!rcv) {
         htrace_log(tracer->lg, "local_file_rcv_create: OOM while "
                    "allocating local_file_rcv.\n");
         return NULL;
     }
+    rcv->fd = -1;
     ret = pthread_mutex_init(&rcv->lock, NULL);
     if (ret) {
         htrace_log(tracer->lg, "local_file_rcv_create: failed to "
                    "create mutex while setting up local_file_rcv: "
                    "error %d (%s)\n", ret, terror(ret));
-        free(rcv);
+        htrace_free(rcv);
         return NULL;
     }
+    pthread_cond_init(&rcv->writer_cond, NULL);
+    pthread_cond_init(&rcv->room_cond, NULL);
+    pthread_cond_init(&rcv->flush_cond, NULL);
     rcv->base.ty = &g_local_file_rcv_ty;
-    rcv->path = strdup(path);
+    rcv->tracer = tracer;
+    rcv->path = htrace_strdup(path);
     if (!rcv->path) {
         local_file_rcv_free((struct htrace_rcv*)rcv);
         return NULL;
     }
-    rcv->tracer = tracer;
-    rcv->fp = fopen(path, "a");
-    if (!rcv->fp) {
-        ret = errno;
+    rcv->async = htrace_conf_get_bool(tracer->lg, conf,
+                                      HTRACE_LOCAL_FILE_ASYNC_KEY);
+    rcv->sync_policy = local_file_get_sync_policy(tracer->lg, conf);
+    rcv->sync_interval_ms = htrace_conf_get_u64(tracer->lg, conf,
+                HTRACE_LOCAL_FILE_FDATASYNC_INTERVAL_MS_KEY);
+    rcv->rotate_size = htrace_conf_get_u64(tracer->lg, conf,
+                HTRACE_LOCAL_FILE_ROTATE_SIZE_KEY);
+    rcv->rotate_interval_ms = htrace_conf_get_u64(tracer->lg, conf,
+                HTRACE_LOCAL_FILE_ROTATE_INTERVAL_MS_KEY);
+    rcv->rotate_keep = htrace_conf_get_u64(tracer->lg, conf,
+                HTRACE_LOCAL_FILE_ROTATE_KEEP_KEY);
+    ret = local_file_open(rcv);
+    if (ret) {
         htrace_log(tracer->lg, "local_file_rcv_create: failed to "
                    "open '%s' for write: error %d (%s)\n",
                    path, ret, terror(ret));
         local_file_rcv_free((struct htrace_rcv*)rcv);
+        return NULL;
     }
-    htrace_log(tracer->lg, "Initialized local_file receiver with path=%s.\n",
-               rcv->path);
+    rcv->synced_ms = rcv->opened_ms;
+    if (rcv->async && local_file_async_init(rcv, conf)) {
+        local_file_rcv_free((struct htrace_rcv*)rcv);
+        return NULL;
+    }
+    htrace_log(tracer->lg, "Initialized local_file receiver with path=%s, "
+               "async=%d.\n", rcv->path, rcv->async);
     return (struct htrace_rcv*)rcv;
 }
 
-static void local_file_rcv_add_span(struct htrace_rcv *r,
-                                    struct htrace_span *span)
+static void local_file_rcv_add_spans(struct htrace_rcv *r,
+                                     struct htrace_span **spans,
+                                     int num_spans)
 {
-    int len, res, err;
-    char *buf;
+    int i;
+    size_t max = 0, off = 0;
+    char stack_buf[LOCAL_FILE_STACK_BUF_LEN], *buf = stack_buf;
     struct local_file_rcv *rcv = (struct local_file_rcv *)r;
 
-    span->trid = rcv->tracer->trid;
-    len = span_json_size(span);
-    buf = malloc(len + 1);
-    if (!buf) {
-        span->trid = NULL;
-        htrace_log(rcv->tracer->lg, "local_file_rcv_add_span: OOM\n");
-        return;
+    // Serialize the whole batch into one buffer, so that we only take the
+    // lock and call fwrite once.  The buffer is on the stack unless the
+    // batch is large.
+    for (i = 0; i < num_spans; i++) {
+        spans[i]->trid = rcv->tracer->trid;
+        max += span_json_max_size(spans[i]) + 1;
     }
-    span_json_sprintf(span, len, buf);
-    span->trid = NULL;
-    buf[len - 1] = '\n';
-    buf[len] = '\0';
-    pthread_mutex_lock(&rcv->lock);
-    res = fwrite(buf, 1, len, rcv->fp);
-    err = errno;
-    pthread_mutex_unlock(&rcv->lock);
-    if (res < len) {
-        htrace_log(rcv->tracer->lg, "local_file_rcv_add_span(%s): fwrite error: "
-                   "%d (%s)\n", rcv->path, err, terror(err));
+    if (max > sizeof(stack_buf)) {
+        buf = htrace_malloc(max);
+        if (!buf) {
+            for (i = 0; i < num_spans; i++) {
+                spans[i]->trid = NULL;
+            }
+            HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                                   "local_file_rcv_add_spans: OOM\n");
+            pthread_mutex_lock(&rcv->lock);
+            rcv->dropped_oom += num_spans;
+            pthread_mutex_unlock(&rcv->lock);
+            return;
+        }
+    }
+    for (i = 0; i < num_spans; i++) {
+        off += span_json_write(spans[i], buf + off);
+        spans[i]->trid = NULL;
+        buf[off++] = '\n';
+    }
+    if (rcv->async) {
+        local_file_stage(rcv, buf, off, num_spans);
+    } else {
+        local_file_write_sync(rcv, buf, off, num_spans);
+    }
+    if (buf != stack_buf) {
+        htrace_free(buf);
     }
-    free(buf);
+}
+
+static void local_file_rcv_add_span(struct htrace_rcv *r,
+                                    struct htrace_span *span)
+{
+    local_file_rcv_add_spans(r, &span, 1);
 }
 
 static void local_file_rcv_flush(struct htrace_rcv *r)
 {
     struct local_file_rcv *rcv = (struct local_file_rcv *)r;
-    if (fflush(rcv->fp) < 0) {
+    uint64_t req;
+
+    pthread_mutex_lock(&rcv->lock);
+    if (rcv->async) {
+        // Wait for the writer thread to sweep every staging buffer.
+        req = ++rcv->flush_req;
+        pthread_cond_signal(&rcv->writer_cond);
+        while ((rcv->flush_done < req) && (!rcv->writer_exited)) {
+            pthread_cond_wait(&rcv->flush_cond, &rcv->lock);
+        }
+    } else if (rcv->fp && (fflush(rcv->fp) < 0)) {
         int e = errno;
         htrace_log(rcv->tracer->lg, "local_file_rcv_flush(path=%s): fflush "
                    "error: %s\n", rcv->path, terror(e));
     }
+    pthread_mutex_unlock(&rcv->lock);
 }
 
 static void local_file_rcv_free(struct htrace_rcv *r)
 {
     struct local_file_rcv *rcv = (struct local_file_rcv *)r;
+    struct local_file_tbuf *tbuf;
     int ret;
     struct htrace_log *lg;
 
@@ -159,26 +1182,76 @@ static void local_file_rcv_free(struct htrace_rcv *r)
     lg = rcv->tracer->lg;
     htrace_log(lg, "Shutting down local_file receiver with path=%s\n",
                rcv->path);
+    // An exiting thread may be waiting in local_file_tbuf_retire for the
+    // writer thread to make room, so wait for those before stopping it.
+    if (rcv->tbuf_tsd_valid) {
+        htrace_tsd_destroy(&rcv->tbuf_tsd);
+    }
+    if (rcv->writer_started) {
+        pthread_mutex_lock(&rcv->lock);
+        rcv->shutdown = 1;
+        pthread_cond_signal(&rcv->writer_cond);
+        pthread_mutex_unlock(&rcv->lock);
+        ret = pthread_join(rcv->writer, NULL);
+        if (ret) {
+            htrace_log(lg, "local_file_rcv_free: pthread_join "
+                       "error %d: %s\n", ret, terror(ret));
+        }
+    }
+    // The writer thread swept the staging buffers of the threads which are
+    // still running before it exited.
+    while ((tbuf = rcv->tbufs)) {
+        rcv->tbufs = tbuf->next;
+        pthread_mutex_destroy(&tbuf->lock);
+        htrace_free(tbuf);
+    }
+    htrace_free(rcv->bufs[0].buf);
+    htrace_free(rcv->bufs[1].buf);
+    if ((rcv->fd >= 0) && rcv->dirty &&
+            (rcv->sync_policy != LOCAL_FILE_SYNC_NONE)) {
+        local_file_sync(rcv, 0);
+    }
+    ret = local_file_close(rcv);
+    if (ret) {
+        htrace_log(lg, "local_file_rcv_free: close error "
+                   "%d: %s\n", ret, terror(ret));
+    }
+    pthread_cond_destroy(&rcv->writer_cond);
+    pthread_cond_destroy(&rcv->room_cond);
+    pthread_cond_destroy(&rcv->flush_cond);
     ret = pthread_mutex_destroy(&rcv->lock);
     if (ret) {
         htrace_log(lg, "local_file_rcv_free: pthread_mutex_destroy "
                    "error %d: %s\n", ret, terror(ret));
     }
-    ret = fclose(rcv->fp);
-    if (ret) {
-        htrace_log(lg, "local_file_rcv_free: fclose error "
-                   "%d: %s\n", ret, terror(ret));
-    }
-    free(rcv->path);
-    free(rcv);
+    htrace_free(rcv->path);
+    htrace_free(rcv);
+}
+
+static void local_file_rcv_get_stats(struct htrace_rcv *r,
+                                     struct htrace_stats *stats)
+{
+    struct local_file_rcv *rcv = (struct local_file_rcv *)r;
+
+    pthread_mutex_lock(&rcv->lock);
+    stats->bytes_serialized = rcv->bytes_serialized;
+    stats->dropped_oom += rcv->dropped_oom;
+    stats->dropped_xmit = rcv->dropped_xmit;
+    pthread_mutex_unlock(&rcv->lock);
 }
 
 const struct htrace_rcv_ty g_local_file_rcv_ty = {
     "local.file",
     local_file_rcv_create,
     local_file_rcv_add_span,
+    local_file_rcv_add_spans,
+    NULL,
     local_file_rcv_flush,
     local_file_rcv_free,
+    local_file_rcv_get_stats,
+    NULL,
+    NULL,
+    NULL,
 };
 
 // vim:ts=4:sw=4:et
@@ -0,0 +1,565 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "receiver/local_mmap.h"
+#include "receiver/receiver.h"
+#include "util/alloc.h"
+#include "util/log.h"
+#include "util/tsd.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * @file local_mmap.c
+ *
+ * A span receiver that writes spans into per-thread regions of a
+ * preallocated, memory-mapped file.  Adding spans takes no locks and no
+ * system calls, except when a thread claims its first region.  See
+ * local_mmap.h for the file layout.
+ */
+
+#define LOCAL_MMAP_REGION_SIZE_MIN 4096ULL
+#define LOCAL_MMAP_REGION_SIZE_MAX (1024ULL * 1024ULL * 1024ULL)
+#define LOCAL_MMAP_SIZE_MAX (1024ULL * 1024ULL * 1024ULL * 1024ULL)
+
+struct local_mmap_rcv;
+
+/**
+ * A thread's current region.
+ */
+struct local_mmap_tregion {
+    /**
+     * The next and previous entries in the receiver's list.  Protected by
+     * the receiver lock.
+     */
+    struct local_mmap_tregion *next;
+    struct local_mmap_tregion *prev;
+
+    /**
+     * The receiver which owns this entry.
+     */
+    struct local_mmap_rcv *rcv;
+
+    /**
+     * The header of the region, or NULL if this thread has no region.
+     */
+    struct local_mmap_region_header *hdr;
+
+    /**
+     * The number of bytes of spans in the region.  Only used by the owning
+     * thread.
+     */
+    uint64_t off;
+};
+
+struct local_mmap_rcv {
+    struct htrace_rcv base;
+
+    /**
+     * The htracer object associated with this receiver.
+     */
+    struct htracer *tracer;
+
+    /**
+     * Path to the file.  Dynamically allocated.
+     */
+    char *path;
+
+    /**
+     * The file descriptor, which we keep so that we can truncate the file
+     * when we are done.
+     */
+    int fd;
+
+    /**
+     * The file header, at the start of the mapping.
+     */
+    struct local_mmap_header *hdr;
+
+    /**
+     * The length of the mapping.
+     */
+    uint64_t map_len;
+
+    /**
+     * The length of each region, and the number of bytes of spans that fit
+     * in one.
+     */
+    uint64_t region_len;
+    uint64_t region_cap;
+
+    /**
+     * The number of regions.
+     */
+    uint64_t num_regions;
+
+    /**
+     * Each thread's region entry.
+     */
+    struct htrace_tsd tsd;
+
+    /**
+     * Lock protecting the list of per-thread regions.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * All the per-thread regions.  Protected by the lock.
+     */
+    struct local_mmap_tregion *tregions;
+
+    /**
+     * Statistics.  These are updated with relaxed atomic operations.
+     */
+    uint64_t buffered;
+    uint64_t dropped_full;
+    uint64_t dropped_too_large;
+    uint64_t dropped_oom;
+    uint64_t bytes_serialized;
+};
+
+static uint64_t local_mmap_get_bounded_u64(struct htrace_log *lg,
+                const struct htrace_conf *cnf, const char *prop,
+                uint64_t min, uint64_t max)
+{
+    uint64_t val = htrace_conf_get_u64(lg, cnf, prop);
+    if (val < min) {
+        htrace_log(lg, "local_mmap_rcv_create: can't set %s to %" PRId64
+                   ".  Using minimum value of %" PRId64 " instead.\n",
+                   prop, val, min);
+        return min;
+    } else if (val > max) {
+        htrace_log(lg, "local_mmap_rcv_create: can't set %s to %" PRId64
+                   ".  Using maximum value of %" PRId64 " instead.\n",
+                   prop, val, max);
+        return max;
+    }
+    return val;
+}
+
+/**
+ * Create the file, preallocate it, and map it.
+ */
+static int local_mmap_rcv_map(struct local_mmap_rcv *rcv)
+{
+    struct htrace_log *lg = rcv->tracer->lg;
+    void *base;
+    int e;
+
+    if ((unlink(rcv->path) < 0) && (errno != ENOENT)) {
+        e = errno;
+        htrace_log(lg, "local_mmap_rcv_map: unlink(%s) failed: error %d "
+                   "(%s)\n", rcv->path, e, terror(e));
+        return 0;
+    }
+    rcv->fd = open(rcv->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (rcv->fd < 0) {
+        e = errno;
+        htrace_log(lg, "local_mmap_rcv_map: open(%s) failed: error %d "
+                   "(%s)\n", rcv->path, e, terror(e));
+        return 0;
+    }
+    // Allocate the blocks up front, so that we don't take SIGBUS when the
+    // disk fills up.  posix_fallocate returns the error number.
+    e = posix_fallocate(rcv->fd, 0, rcv->map_len);
+    if (e) {
+        htrace_log(lg, "local_mmap_rcv_map: posix_fallocate(%s, %" PRId64
+                   ") failed: error %d (%s)\n", rcv->path, rcv->map_len,
+                   e, terror(e));
+        goto error_unlink;
+    }
+    base = mmap(NULL, rcv->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                rcv->fd, 0);
+    if (base == MAP_FAILED) {
+        e = errno;
+        htrace_log(lg, "local_mmap_rcv_map: mmap(%s) failed: error %d "
+                   "(%s)\n", rcv->path, e, terror(e));
+        goto error_unlink;
+    }
+    rcv->hdr = base;
+    rcv->hdr->version = LOCAL_MMAP_VERSION;
+    rcv->hdr->region_len = rcv->region_len;
+    rcv->hdr->num_regions = rcv->num_regions;
+    __atomic_store_n(&rcv->hdr->magic, LOCAL_MMAP_MAGIC, __ATOMIC_RELEASE);
+    return 1;
+
+error_unlink:
+    close(rcv->fd);
+    rcv->fd = -1;
+    unlink(rcv->path);
+    return 0;
+}
+
+/**
+ * Called when a thread with a region exits.  The spans in the region are
+ * already committed, so there is nothing to write.
+ */
+static void local_mmap_tregion_retire(void *data)
+{
+    struct local_mmap_tregion *treg = data;
+    struct local_mmap_rcv *rcv = treg->rcv;
+
+    pthread_mutex_lock(&rcv->lock);
+    if (treg->prev) {
+        treg->prev->next = treg->next;
+    } else {
+        rcv->tregions = treg->next;
+    }
+    if (treg->next) {
+        treg->next->prev = treg->prev;
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    htrace_free(treg);
+}
+
+static void local_mmap_rcv_free(struct htrace_rcv *r);
+
+static struct htrace_rcv *local_mmap_rcv_create(struct htracer *tracer,
+                                            const struct htrace_conf *conf)
+{
+    struct local_mmap_rcv *rcv;
+    const char *path;
+    uint64_t size;
+    int ret;
+
+    path = htrace_conf_get(conf, HTRACE_LOCAL_MMAP_RCV_PATH_KEY);
+    if (!path) {
+        htrace_log(tracer->lg, "local_mmap_rcv_create: no value found for "
+                   "%s. You must set this configuration key to the path you "
+                   "wish to write spans to.\n",
+                   HTRACE_LOCAL_MMAP_RCV_PATH_KEY);
+        return NULL;
+    }
+    rcv = htrace_calloc(1, sizeof(*rcv));
+    if (!rcv) {
+        htrace_log(tracer->lg, "local_mmap_rcv_create: OOM while "
+                   "allocating local_mmap_rcv.\n");
+        return NULL;
+    }
+    rcv->base.ty = &g_local_mmap_rcv_ty;
+    rcv->tracer = tracer;
+    rcv->fd = -1;
+    rcv->region_len = local_mmap_get_bounded_u64(tracer->lg, conf,
+                HTRACE_LOCAL_MMAP_REGION_SIZE_KEY,
+                LOCAL_MMAP_REGION_SIZE_MIN, LOCAL_MMAP_REGION_SIZE_MAX);
+    rcv->region_len &= ~(LOCAL_MMAP_REGION_SIZE_MIN - 1);
+    rcv->region_cap = rcv->region_len -
+        sizeof(struct local_mmap_region_header);
+    size = local_mmap_get_bounded_u64(tracer->lg, conf,
+                HTRACE_LOCAL_MMAP_SIZE_KEY,
+                rcv->region_len, LOCAL_MMAP_SIZE_MAX);
+    rcv->num_regions = size / rcv->region_len;
+    rcv->map_len = LOCAL_MMAP_HEADER_LEN +
+        (rcv->num_regions * rcv->region_len);
+    rcv->path = htrace_strdup(path);
+    if (!rcv->path) {
+        htrace_log(tracer->lg, "local_mmap_rcv_create: OOM while "
+                   "copying the path.\n");
+        htrace_free(rcv);
+        return NULL;
+    }
+    ret = pthread_mutex_init(&rcv->lock, NULL);
+    if (ret) {
+        htrace_log(tracer->lg, "local_mmap_rcv_create: pthread_mutex_init "
+                   "error %d: %s\n", ret, terror(ret));
+        htrace_free(rcv->path);
+        htrace_free(rcv);
+        return NULL;
+    }
+    ret = htrace_tsd_init(&rcv->tsd, local_mmap_tregion_retire);
+    if (ret) {
+        htrace_log(tracer->lg, "local_mmap_rcv_create: htrace_tsd_init "
+                   "error %d: %s\n", ret, terror(ret));
+        pthread_mutex_destroy(&rcv->lock);
+        htrace_free(rcv->path);
+        htrace_free(rcv);
+        return NULL;
+    }
+    if (!local_mmap_rcv_map(rcv)) {
+        local_mmap_rcv_free((struct htrace_rcv*)rcv);
+        return NULL;
+    }
+    htrace_log(tracer->lg, "Initialized local_mmap receiver with path=%s, "
+               "regions=%" PRId64 ", region_len=%" PRId64 ".\n",
+               rcv->path, rcv->num_regions, rcv->region_len);
+    return (struct htrace_rcv*)rcv;
+}
+
+/**
+ * Get the current thread's region entry, creating it if needed.
+ *
+ * @param rcv           The local mmap receiver.
+ *
+ * @return              The entry, or NULL on OOM.
+ */
+static struct local_mmap_tregion *local_mmap_tregion_get(
+                struct local_mmap_rcv *rcv)
+{
+    struct local_mmap_tregion *treg;
+
+    treg = htrace_tsd_get(&rcv->tsd);
+    if (treg) {
+        return treg;
+    }
+    treg = htrace_calloc(1, sizeof(*treg));
+    if (!treg) {
+        return NULL;
+    }
+    treg->rcv = rcv;
+    if (htrace_tsd_set(&rcv->tsd, treg)) {
+        htrace_free(treg);
+        return NULL;
+    }
+    pthread_mutex_lock(&rcv->lock);
+    treg->next = rcv->tregions;
+    if (rcv->tregions) {
+        rcv->tregions->prev = treg;
+    }
+    rcv->tregions = treg;
+    pthread_mutex_unlock(&rcv->lock);
+    return treg;
+}
+
+/**
+ * Claim a new region for the current thread.
+ *
+ * @param rcv           The local mmap receiver.
+ * @param treg          The current thread's region entry.
+ *
+ * @return              1 on success; 0 if the file is full.
+ */
+static int local_mmap_claim(struct local_mmap_rcv *rcv,
+                            struct local_mmap_tregion *treg)
+{
+    uint64_t idx;
+
+    idx = __atomic_fetch_add(&rcv->hdr->next_region, 1, __ATOMIC_RELAXED);
+    if (idx >= rcv->num_regions) {
+        treg->hdr = NULL;
+        return 0;
+    }
+    treg->hdr = (struct local_mmap_region_header *)
+        (((uint8_t *)rcv->hdr) + LOCAL_MMAP_HEADER_LEN +
+         (idx * rcv->region_len));
+    treg->off = 0;
+    treg->hdr->reserved = 0;
+    treg->hdr->committed = 0;
+    __atomic_store_n(&treg->hdr->magic, LOCAL_MMAP_REGION_MAGIC,
+                     __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Add several spans to the current thread's region.
+ *
+ * @param rcv           The local mmap receiver.
+ * @param spans         The spans.
+ * @param buf           The spans in msgpack form, one after another, or NULL
+ *                          to serialize them here.
+ * @param lens          The serialized length of each span.  Ignored if buf
+ *                          is NULL.
+ * @param num_spans     The number of spans.
+ */
+static void local_mmap_add_batch(struct local_mmap_rcv *rcv,
+                                 struct htrace_span **spans,
+                                 const uint8_t *buf, const uint64_t *lens,
+                                 int num_spans)
+{
+    struct local_mmap_tregion *treg;
+    uint64_t len, bytes = 0, added = 0, full = 0, too_large = 0;
+    uint8_t *data;
+    int i;
+
+    treg = local_mmap_tregion_get(rcv);
+    if (!treg) {
+        __atomic_fetch_add(&rcv->dropped_oom, num_spans, __ATOMIC_RELAXED);
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_ERROR,
+                               "local_mmap_rcv_add_spans: OOM\n");
+        return;
+    }
+    for (i = 0; i < num_spans; i++) {
+        spans[i]->trid = rcv->tracer->trid;
+        len = buf ? lens[i] : span_msgpack_size(spans[i]);
+        if (len > rcv->region_cap) {
+            too_large++;
+        } else if ((!treg->hdr) || (treg->off + len > rcv->region_cap)) {
+            // Publish what we have before moving on to a new region.
+            if (treg->hdr) {
+                __atomic_store_n(&treg->hdr->committed, treg->off,
+                                 __ATOMIC_RELEASE);
+            }
+            if (!local_mmap_claim(rcv, treg)) {
+                full++;
+            }
+        }
+        if ((len <= rcv->region_cap) && treg->hdr &&
+                (treg->off + len <= rcv->region_cap)) {
+            data = ((uint8_t *)(treg->hdr + 1)) + treg->off;
+            if (buf) {
+                memcpy(data, buf, len);
+            } else {
+                span_msgpack_encode(spans[i], data);
+            }
+            treg->off += len;
+            bytes += len;
+            added++;
+        }
+        spans[i]->trid = NULL;
+        if (buf) {
+            buf += len;
+        }
+    }
+    if (treg->hdr) {
+        __atomic_store_n(&treg->hdr->committed, treg->off, __ATOMIC_RELEASE);
+    }
+    __atomic_fetch_add(&rcv->buffered, added, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&rcv->bytes_serialized, bytes, __ATOMIC_RELAXED);
+    if (full) {
+        __atomic_fetch_add(&rcv->dropped_full, full, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&rcv->hdr->dropped, full, __ATOMIC_RELAXED);
+    }
+    if (too_large) {
+        __atomic_fetch_add(&rcv->dropped_too_large, too_large,
+                           __ATOMIC_RELAXED);
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_WARN,
+                "local_mmap_rcv_add_spans: a span does not fit in a region "
+                "of %" PRId64 " bytes.  Dropping it.\n", rcv->region_len);
+    }
+}
+
+static void local_mmap_rcv_add_spans(struct htrace_rcv *r,
+                                     struct htrace_span **spans,
+                                     int num_spans)
+{
+    local_mmap_add_batch((struct local_mmap_rcv *)r, spans, NULL, NULL,
+                         num_spans);
+}
+
+static void local_mmap_rcv_add_msgpack(struct htrace_rcv *r,
+                                       struct htrace_span **spans,
+                                       const uint8_t *buf,
+                                       const uint64_t *lens, int num_spans)
+{
+    local_mmap_add_batch((struct local_mmap_rcv *)r, spans, buf, lens,
+                         num_spans);
+}
+
+static void local_mmap_rcv_add_span(struct htrace_rcv *r,
+                                    struct htrace_span *span)
+{
+    local_mmap_rcv_add_spans(r, &span, 1);
+}
+
+static void local_mmap_rcv_flush(struct htrace_rcv *r)
+{
+    // Spans are in the page cache as soon as they are added.
+}
+
+static void local_mmap_rcv_free(struct htrace_rcv *r)
+{
+    struct local_mmap_rcv *rcv = (struct local_mmap_rcv *)r;
+    struct local_mmap_tregion *treg;
+    struct htrace_log *lg;
+    uint64_t used;
+    int ret;
+
+    if (!rcv) {
+        return;
+    }
+    lg = rcv->tracer->lg;
+    // An exiting thread unlinks its entry from tregions under the lock.
+    // Wait for those before freeing the entries and destroying the lock.
+    htrace_tsd_destroy(&rcv->tsd);
+    htrace_log(lg, "Shutting down local_mmap receiver with path=%s: "
+               "buffered=%" PRId64 ", dropped_full=%" PRId64 "\n",
+               rcv->path, rcv->buffered, rcv->dropped_full);
+    // The entries which are left belong to threads which are still running.
+    while ((treg = rcv->tregions)) {
+        rcv->tregions = treg->next;
+        htrace_free(treg);
+    }
+    if (rcv->hdr) {
+        used = rcv->hdr->next_region;
+        if (used > rcv->num_regions) {
+            used = rcv->num_regions;
+        }
+        munmap(rcv->hdr, rcv->map_len);
+        // Give back the space of the regions we never used.
+        if (ftruncate(rcv->fd, LOCAL_MMAP_HEADER_LEN +
+                      (used * rcv->region_len)) < 0) {
+            ret = errno;
+            htrace_log(lg, "local_mmap_rcv_free: ftruncate(%s) failed: "
+                       "error %d (%s)\n", rcv->path, ret, terror(ret));
+        }
+    }
+    if (rcv->fd >= 0) {
+        close(rcv->fd);
+    }
+    ret = pthread_mutex_destroy(&rcv->lock);
+    if (ret) {
+        htrace_log(lg, "local_mmap_rcv_free: pthread_mutex_destroy "
+                   "error %d: %s\n", ret, terror(ret));
+    }
+    htrace_free(rcv->path);
+    htrace_free(rcv);
+}
+
+static void local_mmap_rcv_get_stats(struct htrace_rcv *r,
+                                     struct htrace_stats *stats)
+{
+    struct local_mmap_rcv *rcv = (struct local_mmap_rcv *)r;
+
+    stats->buffered = __atomic_load_n(&rcv->buffered, __ATOMIC_RELAXED);
+    stats->dropped_newest =
+        __atomic_load_n(&rcv->dropped_full, __ATOMIC_RELAXED);
+    stats->dropped_too_large =
+        __atomic_load_n(&rcv->dropped_too_large, __ATOMIC_RELAXED);
+    stats->dropped_oom +=
+        __atomic_load_n(&rcv->dropped_oom, __ATOMIC_RELAXED);
+    stats->bytes_serialized =
+        __atomic_load_n(&rcv->bytes_serialized, __ATOMIC_RELAXED);
+}
+
+const struct htrace_rcv_ty g_local_mmap_rcv_ty = {
+    "local.mmap",
+    local_mmap_rcv_create,
+    local_mmap_rcv_add_span,
+    local_mmap_rcv_add_spans,
+    NULL,
+    local_mmap_rcv_flush,
+    local_mmap_rcv_free,
+    local_mmap_rcv_get_stats,
+    NULL,
+    local_mmap_rcv_add_msgpack,
+    NULL,
+};
+
+// vim:ts=4:sw=4:et
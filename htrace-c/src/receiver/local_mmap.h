@@ -0,0 +1,125 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef APACHE_HTRACE_RECEIVER_LOCAL_MMAP_H
+#define APACHE_HTRACE_RECEIVER_LOCAL_MMAP_H
+
+/**
+ * @file local_mmap.h
+ *
+ * The layout of the files written by the local.mmap span receiver.
+ *
+ * The file is preallocated when the receiver is created.  It starts with a
+ * struct local_mmap_header, padded to LOCAL_MMAP_HEADER_LEN bytes, followed
+ * by num_regions regions of region_len bytes each.  Region i starts at
+ * LOCAL_MMAP_HEADER_LEN + (i * region_len).
+ *
+ * Each thread which adds spans claims a region of its own by incrementing
+ * next_region, and appends spans to it with plain stores, in the same msgpack
+ * form that span_write_msgpack produces, one after another.  When a region
+ * is full, the thread claims another.  Once the file is full, spans are
+ * dropped.
+ *
+ * Each region starts with a struct local_mmap_region_header.  committed is
+ * the number of bytes of whole spans after the region header.  It is only
+ * advanced, with a release store, after the spans are written, so a reader
+ * never sees a partial span, even in the file of a process which crashed.
+ * Regions at or past next_region, and regions whose magic number is not
+ * LOCAL_MMAP_REGION_MAGIC, hold no spans.  When the receiver is shut down
+ * cleanly, the file is truncated after the last region which was claimed.
+ *
+ * Everything is in host byte order, since the point of this format is to
+ * write spans with as little work as possible.  A reader on a host of the
+ * other byte order will find that the magic numbers do not match.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stdint.h>
+
+/**
+ * The value of local_mmap_header#magic, once the file is ready to use.
+ */
+#define LOCAL_MMAP_MAGIC 0x48544d4dU
+
+/**
+ * The value of local_mmap_region_header#magic, once the region is claimed.
+ */
+#define LOCAL_MMAP_REGION_MAGIC 0x48545247U
+
+#define LOCAL_MMAP_VERSION 1
+
+/**
+ * The length of the file header, including padding.  Regions start here.
+ */
+#define LOCAL_MMAP_HEADER_LEN 4096
+
+struct local_mmap_header {
+    /**
+     * LOCAL_MMAP_MAGIC.  This is written last, when the file is created.
+     */
+    uint32_t magic;
+
+    /**
+     * LOCAL_MMAP_VERSION.
+     */
+    uint32_t version;
+
+    /**
+     * The length of each region, including its header.
+     */
+    uint64_t region_len;
+
+    /**
+     * The number of regions in the file.
+     */
+    uint64_t num_regions;
+
+    /**
+     * The number of spans which were dropped because the file was full.
+     */
+    uint64_t dropped;
+
+    /**
+     * The number of regions which have been claimed.  This can be larger
+     * than num_regions, once the file is full.
+     */
+    uint64_t next_region __attribute__((aligned(64)));
+};
+
+struct local_mmap_region_header {
+    /**
+     * LOCAL_MMAP_REGION_MAGIC.
+     */
+    uint32_t magic;
+
+    /**
+     * Reserved.  Always 0.
+     */
+    uint32_t reserved;
+
+    /**
+     * The number of bytes of whole spans after this header.
+     */
+    uint64_t committed;
+} __attribute__((aligned(64)));
+
+#endif
+
+// vim: ts=4:sw=4:et
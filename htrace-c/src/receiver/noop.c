@@ -20,6 +20,8 @@
 #include "receiver/receiver.h"
 #include "util/log.h"
 
+#include <stddef.h>
+
 /**
  * A span receiver that does nothing but discard all spans.
  */
@@ -58,8 +60,14 @@ const struct htrace_rcv_ty g_noop_rcv_ty = {
     "noop",
     noop_rcv_create,
     noop_rcv_add_span,
+    NULL,
+    NULL,
     noop_rcv_flush,
     noop_rcv_free,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
 };
 
 // vim:ts=4:sw=4:et
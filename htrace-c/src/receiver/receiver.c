@@ -28,13 +28,31 @@
 const struct htrace_rcv_ty * const g_rcv_tys[] = {
     &g_noop_rcv_ty,
     &g_local_file_rcv_ty,
+    &g_local_binfile_rcv_ty,
+    &g_local_mmap_rcv_ty,
     &g_htraced_rcv_ty,
+    &g_shm_rcv_ty,
+    &g_flight_rcv_ty,
+    &g_histogram_rcv_ty,
     NULL,
 };
 
+const struct htrace_rcv_ty *htrace_rcv_ty_find(const char *name)
+{
+    size_t i;
+
+    for (i = 0; g_rcv_tys[i]; i++) {
+        if (strcmp(g_rcv_tys[i]->name, name) == 0) {
+            return g_rcv_tys[i];
+        }
+    }
+    return NULL;
+}
+
 static const struct htrace_rcv_ty *select_rcv_ty(struct htracer *tracer,
                                              const struct htrace_conf *conf)
 {
+    const struct htrace_rcv_ty *ty;
     const char *tstr;
     const char *prefix = "";
     size_t i;
@@ -45,10 +63,13 @@ static const struct htrace_rcv_ty *select_rcv_ty(struct htracer *tracer,
         htrace_log(tracer->lg, "No %s configured.\n", HTRACE_SPAN_RECEIVER_KEY);
         return &g_noop_rcv_ty;
     }
-    for (i = 0; g_rcv_tys[i]; i++) {
-        if (strcmp(g_rcv_tys[i]->name, tstr) == 0) {
-            return g_rcv_tys[i];
-        }
+    if (strchr(tstr, ',')) {
+        // A list of span receivers.
+        return &g_fanout_rcv_ty;
+    }
+    ty = htrace_rcv_ty_find(tstr);
+    if (ty) {
+        return ty;
     }
     for (i = 0; g_rcv_tys[i]; i++) {
         if ((strlen(buf) + strlen(prefix) +
@@ -63,8 +84,8 @@ static const struct htrace_rcv_ty *select_rcv_ty(struct htracer *tracer,
     return &g_noop_rcv_ty;
 }
 
-struct htrace_rcv *htrace_rcv_create(struct htracer *tracer,
-                                     const struct htrace_conf *conf)
+struct htrace_rcv *htrace_rcv_create_eager(struct htracer *tracer,
+                                           const struct htrace_conf *conf)
 {
     const struct htrace_rcv_ty *ty;
 
@@ -72,4 +93,14 @@ struct htrace_rcv *htrace_rcv_create(struct htracer *tracer,
     return ty->create(tracer, conf);
 }
 
+struct htrace_rcv *htrace_rcv_create(struct htracer *tracer,
+                                     const struct htrace_conf *conf)
+{
+    if (htrace_conf_get_bool(tracer->lg, conf,
+                             HTRACE_SPAN_RECEIVER_LAZY_KEY)) {
+        return g_lazy_rcv_ty.create(tracer, conf);
+    }
+    return htrace_rcv_create_eager(tracer, conf);
+}
+
 // vim:ts=4:sw=4:et
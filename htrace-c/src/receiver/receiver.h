@@ -27,8 +27,11 @@
  * This is an internal header, not intended for external use.
  */
 
+#include <stdint.h> /* for uint64_t */
+
 struct htrace_conf;
 struct htrace_span;
+struct htrace_stats;
 struct htracer;
 
 /**
@@ -73,6 +76,38 @@ struct htrace_rcv_ty {
      */
     void (*add_span)(struct htrace_rcv *rcv, struct htrace_span *span);
 
+    /**
+     * Callback to add several spans at once.  May be NULL if the receiver
+     * does not support it, in which case spans are always given to add_span
+     * one at a time.
+     *
+     * When this is set, the tracer collects closed spans in small
+     * per-thread batches and hands each batch over in one call, so that the
+     * receiver can take its locks and wake its threads once per batch.
+     *
+     * @param rcv           The HTrace span receiver.
+     * @param spans         The trace spans to add.  The receiver must not
+     *                          hold on to them after returning.
+     * @param num_spans     The number of spans.
+     */
+    void (*add_spans)(struct htrace_rcv *rcv, struct htrace_span **spans,
+                      int num_spans);
+
+    /**
+     * Callback to take ownership of a closed span.  May be NULL.
+     *
+     * This lets a receiver defer all work on the span to one of its own
+     * threads.  It is tried before add_span and add_spans.
+     *
+     * @param rcv           The HTrace span receiver.
+     * @param span          The trace span.
+     *
+     * @return              1 if the receiver took the span, and will free it
+     *                          with htrace_span_free when it is done; 0 if
+     *                          the span should be added as usual.
+     */
+    int (*take_span)(struct htrace_rcv *rcv, struct htrace_span *span);
+
     /**
      * Flush all buffered spans to the backing store used by this receiver.
      *
@@ -86,8 +121,73 @@ struct htrace_rcv_ty {
      * @param rcv           The HTrace span receiver.
      */
     void (*free)(struct htrace_rcv *rcv);
+
+    /**
+     * Fill in the receiver's statistics.  May be NULL if the receiver does
+     * not keep any.
+     *
+     * @param rcv           The HTrace span receiver.
+     * @param stats         The statistics to fill in.  The tracer counters
+     *                          have already been filled in; everything else
+     *                          is 0.
+     */
+    void (*get_stats)(struct htrace_rcv *rcv, struct htrace_stats *stats);
+
+    /**
+     * Report how close the receiver is to falling behind.  May be NULL if the
+     * receiver can always keep up.
+     *
+     * This is polled by the adaptive sampler, at most a few times a second.
+     *
+     * @param rcv           The HTrace span receiver.
+     *
+     * @return              A number from 0, meaning no pressure, to
+     *                          HTRACE_RCV_PRESSURE_MAX, meaning that the
+     *                          receiver is dropping spans.
+     */
+    int (*get_pressure)(struct htrace_rcv *rcv);
+
+    /**
+     * Callback to add several spans which have already been serialized.
+     * May be NULL, in which case the receiver serializes spans itself.
+     *
+     * The fanout receiver uses this to serialize each span once for all of
+     * its children.  The serialized form is what span_msgpack_encode
+     * produces with the span's trid set to the tracer ID.
+     *
+     * @param rcv           The HTrace span receiver.
+     * @param spans         The trace spans.  The receiver must not hold on
+     *                          to them after returning.
+     * @param buf           The serialized spans, one after another.
+     * @param lens          The serialized length of each span.
+     * @param num_spans     The number of spans.
+     */
+    void (*add_msgpack)(struct htrace_rcv *rcv, struct htrace_span **spans,
+                        const uint8_t *buf, const uint64_t *lens,
+                        int num_spans);
+
+    /**
+     * Apply a new configuration to the span receiver.  May be NULL, in which
+     * case the receiver keeps the configuration it was created with.
+     *
+     * This may be called while other threads are adding spans.  Keys which
+     * can't be changed without re-creating the receiver are ignored.
+     *
+     * @param rcv           The HTrace span receiver.
+     * @param conf          The new HTrace configuration.  The receiver must
+     *                          not hold on to this pointer.
+     *
+     * @return              0 on success; an error number otherwise.
+     */
+    int (*update_conf)(struct htrace_rcv *rcv,
+                       const struct htrace_conf *conf);
 };
 
+/**
+ * The highest pressure a span receiver can report.
+ */
+#define HTRACE_RCV_PRESSURE_MAX 100
+
 /**
  * Create an HTrace span receiver.
  *
@@ -102,12 +202,72 @@ struct htrace_rcv_ty {
 struct htrace_rcv *htrace_rcv_create(struct htracer *tracer,
                                      const struct htrace_conf *conf);
 
+/**
+ * Create an HTrace span receiver right away, ignoring
+ * HTRACE_SPAN_RECEIVER_LAZY_KEY.
+ *
+ * The parameters are the same as for htrace_rcv_create.
+ */
+struct htrace_rcv *htrace_rcv_create_eager(struct htracer *tracer,
+                                           const struct htrace_conf *conf);
+
+/**
+ * Find a span receiver type by name.
+ *
+ * @param name          The name of the span receiver type.
+ *
+ * @return              The span receiver type, or NULL if there is none by
+ *                          that name.
+ */
+const struct htrace_rcv_ty *htrace_rcv_ty_find(const char *name);
+
+/**
+ * Find a span receiver of a given type, looking inside fanouts.
+ *
+ * @param rcv           The span receiver.
+ * @param ty            The span receiver type to look for.
+ *
+ * @return              rcv if it has the type, the first child of rcv with
+ *                          the type if rcv is a fanout, or NULL.  The
+ *                          receiver behind a lazy receiver is only found
+ *                          once it has been created.
+ */
+struct htrace_rcv *htrace_rcv_find(struct htrace_rcv *rcv,
+                                   const struct htrace_rcv_ty *ty);
+
+/**
+ * Write the spans held by a flight recorder to a file.
+ *
+ * @param rcv           The flight recorder.
+ * @param path          The path to write to, or NULL to use flight.path.
+ *
+ * @return              0 on success; the error number otherwise.
+ */
+int flight_rcv_dump(struct htrace_rcv *rcv, const char *path);
+
+/**
+ * Get the span receiver behind a lazy span receiver.
+ *
+ * @param rcv           The lazy span receiver.
+ *
+ * @return              The span receiver, or NULL if it hasn't been created
+ *                          yet.
+ */
+struct htrace_rcv *lazy_rcv_child(struct htrace_rcv *rcv);
+
 /*
  * HTrace span receiver types.
  */
-const struct htrace_rcv_ty g_noop_rcv_ty;
-const struct htrace_rcv_ty g_local_file_rcv_ty;
-const struct htrace_rcv_ty g_htraced_rcv_ty;
+extern const struct htrace_rcv_ty g_noop_rcv_ty;
+extern const struct htrace_rcv_ty g_local_file_rcv_ty;
+extern const struct htrace_rcv_ty g_local_binfile_rcv_ty;
+extern const struct htrace_rcv_ty g_local_mmap_rcv_ty;
+extern const struct htrace_rcv_ty g_htraced_rcv_ty;
+extern const struct htrace_rcv_ty g_shm_rcv_ty;
+extern const struct htrace_rcv_ty g_fanout_rcv_ty;
+extern const struct htrace_rcv_ty g_flight_rcv_ty;
+extern const struct htrace_rcv_ty g_histogram_rcv_ty;
+extern const struct htrace_rcv_ty g_lazy_rcv_ty;
 
 #endif
 
@@ -0,0 +1,511 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "receiver/receiver.h"
+#include "receiver/shm.h"
+#include "util/alloc.h"
+#include "util/log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/**
+ * @file shm.c
+ *
+ * A span receiver that writes spans into a shared memory ring, for a
+ * collector on the same host to read.  See shm.h for the ring layout.
+ */
+
+/**
+ * The minimum data area size to allow.
+ */
+#define SHM_RCV_SIZE_MIN 4096ULL
+
+/**
+ * The maximum data area size to allow.
+ */
+#define SHM_RCV_SIZE_MAX 0x100000000ULL
+
+struct shm_rcv {
+    struct htrace_rcv base;
+
+    /**
+     * The htracer object associated with this receiver.
+     */
+    struct htracer *tracer;
+
+    /**
+     * Path to the ring file.  Dynamically allocated.
+     */
+    char *path;
+
+    /**
+     * The ring header, at the start of the mapping.
+     */
+    struct shm_ring_header *hdr;
+
+    /**
+     * The data area of the ring.
+     */
+    uint8_t *data;
+
+    /**
+     * The length of the data area.
+     */
+    uint64_t data_len;
+
+    /**
+     * Lock which serializes the threads writing spans.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Our copy of the ring's head.  Protected by the lock.
+     */
+    uint64_t head;
+
+    /**
+     * The number of spans we added to the ring.  Protected by the lock.
+     */
+    uint64_t buffered;
+
+    /**
+     * The number of spans we dropped because the ring was full.  Protected by
+     * the lock.
+     */
+    uint64_t dropped_full;
+
+    /**
+     * The number of spans we dropped because they would not fit in an empty
+     * ring.  Protected by the lock.
+     */
+    uint64_t dropped_too_large;
+
+    /**
+     * The number of bytes of span data we wrote.  Protected by the lock.
+     */
+    uint64_t bytes_serialized;
+
+    /**
+     * The largest number of bytes of the data area in use at once.
+     * Protected by the lock.
+     */
+    uint64_t bytes_max;
+
+    /**
+     * The number of dropped spans the last time get_pressure was called.
+     * Protected by the lock.
+     */
+    uint64_t pressure_dropped;
+};
+
+static uint64_t shm_rcv_get_size(struct htrace_log *lg,
+                                 const struct htrace_conf *conf)
+{
+    uint64_t size;
+
+    size = htrace_conf_get_u64(lg, conf, HTRACE_SHM_RCV_SIZE_KEY);
+    if (size < SHM_RCV_SIZE_MIN) {
+        htrace_log(lg, "shm_rcv_create: can't set %s to %" PRId64
+                   ".  Using minimum value of %" PRId64 " instead.\n",
+                   HTRACE_SHM_RCV_SIZE_KEY, size,
+                   (uint64_t)SHM_RCV_SIZE_MIN);
+        size = SHM_RCV_SIZE_MIN;
+    } else if (size > SHM_RCV_SIZE_MAX) {
+        htrace_log(lg, "shm_rcv_create: can't set %s to %" PRId64
+                   ".  Using maximum value of %" PRId64 " instead.\n",
+                   HTRACE_SHM_RCV_SIZE_KEY, size,
+                   (uint64_t)SHM_RCV_SIZE_MAX);
+        size = SHM_RCV_SIZE_MAX;
+    }
+    return size & ~(uint64_t)(SHM_RING_ALIGN - 1);
+}
+
+/**
+ * Create the ring file and map it.
+ *
+ * The file is created anew, rather than truncated, so that a collector which
+ * still has an old ring mapped is not disturbed.
+ */
+static int shm_rcv_map(struct shm_rcv *rcv)
+{
+    struct htrace_log *lg = rcv->tracer->lg;
+    uint64_t map_len = sizeof(struct shm_ring_header) + rcv->data_len;
+    void *base;
+    int e, fd;
+
+    if ((unlink(rcv->path) < 0) && (errno != ENOENT)) {
+        e = errno;
+        htrace_log(lg, "shm_rcv_map: unlink(%s) failed: error %d (%s)\n",
+                   rcv->path, e, terror(e));
+        return 0;
+    }
+    fd = open(rcv->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        e = errno;
+        htrace_log(lg, "shm_rcv_map: open(%s) failed: error %d (%s)\n",
+                   rcv->path, e, terror(e));
+        return 0;
+    }
+    if (ftruncate(fd, map_len) < 0) {
+        e = errno;
+        htrace_log(lg, "shm_rcv_map: ftruncate(%s) failed: error %d (%s)\n",
+                   rcv->path, e, terror(e));
+        goto error_unlink;
+    }
+    base = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        e = errno;
+        htrace_log(lg, "shm_rcv_map: mmap(%s) failed: error %d (%s)\n",
+                   rcv->path, e, terror(e));
+        goto error_unlink;
+    }
+    // The mapping stays valid after the file is closed.
+    close(fd);
+    rcv->hdr = base;
+    rcv->data = ((uint8_t *)base) + sizeof(struct shm_ring_header);
+    rcv->hdr->version = SHM_RING_VERSION;
+    rcv->hdr->data_len = rcv->data_len;
+    __atomic_store_n(&rcv->hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+    return 1;
+
+error_unlink:
+    close(fd);
+    unlink(rcv->path);
+    return 0;
+}
+
+static struct htrace_rcv *shm_rcv_create(struct htracer *tracer,
+                                         const struct htrace_conf *conf)
+{
+    struct shm_rcv *rcv;
+    const char *path;
+    int ret;
+
+    path = htrace_conf_get(conf, HTRACE_SHM_RCV_PATH_KEY);
+    if (!path) {
+        htrace_log(tracer->lg, "shm_rcv_create: no value found for %s. "
+                   "You must set this configuration key to the path of the "
+                   "shared memory ring to write spans to.\n",
+                   HTRACE_SHM_RCV_PATH_KEY);
+        goto error;
+    }
+    rcv = htrace_calloc(1, sizeof(*rcv));
+    if (!rcv) {
+        htrace_log(tracer->lg, "shm_rcv_create: OOM while "
+                   "allocating shm_rcv.\n");
+        goto error;
+    }
+    rcv->base.ty = &g_shm_rcv_ty;
+    rcv->tracer = tracer;
+    rcv->data_len = shm_rcv_get_size(tracer->lg, conf);
+    rcv->path = htrace_strdup(path);
+    if (!rcv->path) {
+        htrace_log(tracer->lg, "shm_rcv_create: OOM while "
+                   "copying the path.\n");
+        goto error_free_rcv;
+    }
+    ret = pthread_mutex_init(&rcv->lock, NULL);
+    if (ret) {
+        htrace_log(tracer->lg, "shm_rcv_create: pthread_mutex_init "
+                   "error %d: %s\n", ret, terror(ret));
+        goto error_free_path;
+    }
+    if (!shm_rcv_map(rcv)) {
+        goto error_free_lock;
+    }
+    htrace_log(tracer->lg, "Initialized shm receiver with path=%s, "
+               "size=%" PRId64 ".\n", rcv->path, rcv->data_len);
+    return (struct htrace_rcv*)rcv;
+
+error_free_lock:
+    pthread_mutex_destroy(&rcv->lock);
+error_free_path:
+    htrace_free(rcv->path);
+error_free_rcv:
+    htrace_free(rcv);
+error:
+    return NULL;
+}
+
+/**
+ * Wake up the consumer, if it is asleep.
+ * This function must be called after publishing the new head.
+ */
+static void shm_rcv_wake(struct shm_rcv *rcv)
+{
+    if (!__atomic_load_n(&rcv->hdr->consumer_waiting, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    __atomic_store_n(&rcv->hdr->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+    // The ring is shared between processes, so this can't be a private
+    // futex.
+    syscall(SYS_futex, &rcv->hdr->consumer_waiting, FUTEX_WAKE, INT_MAX,
+            NULL, NULL, 0);
+#endif
+}
+
+/**
+ * Copy a span into the ring.
+ * This function must be called with the lock held.  The caller must publish
+ * the new head afterwards.
+ *
+ * @param rcv           The shm receiver.
+ * @param span          The span.  Its trid must already be set.
+ * @param enc           The span in msgpack form, or NULL to serialize it
+ *                          here.
+ * @param len           The serialized length of the span.
+ *
+ * @return              0 on success; ENOSPC if the ring is full; EFBIG if
+ *                          the span will never fit.
+ */
+static int shm_rcv_write_locked(struct shm_rcv *rcv, struct htrace_span *span,
+                                const uint8_t *enc, uint64_t len)
+{
+    struct shm_rec_header *rec;
+    uint64_t rec_len, off, contig, used;
+
+    rec_len = SHM_REC_SIZE(len);
+    if (rec_len > rcv->data_len) {
+        rcv->dropped_too_large++;
+        return EFBIG;
+    }
+    off = rcv->head % rcv->data_len;
+    contig = rcv->data_len - off;
+    used = rcv->head - __atomic_load_n(&rcv->hdr->tail, __ATOMIC_ACQUIRE);
+    if (contig < rec_len) {
+        // We will have to skip the end of the data area.
+        used += contig;
+    }
+    if (used + rec_len > rcv->data_len) {
+        rcv->dropped_full++;
+        __atomic_fetch_add(&rcv->hdr->dropped, 1, __ATOMIC_RELAXED);
+        return ENOSPC;
+    }
+    if (contig < rec_len) {
+        rec = (struct shm_rec_header *)(rcv->data + off);
+        rec->len = contig - sizeof(*rec);
+        rec->type = SHM_REC_PAD;
+        rcv->head += contig;
+        off = 0;
+    }
+    rec = (struct shm_rec_header *)(rcv->data + off);
+    if (enc) {
+        memcpy(rec + 1, enc, len);
+    } else {
+        span_msgpack_encode(span, (uint8_t *)(rec + 1));
+    }
+    rec->len = len;
+    rec->type = SHM_REC_SPAN;
+    rcv->head += rec_len;
+    rcv->buffered++;
+    rcv->bytes_serialized += len;
+    if (used + rec_len > rcv->bytes_max) {
+        rcv->bytes_max = used + rec_len;
+    }
+    return 0;
+}
+
+static void shm_rcv_add_span(struct htrace_rcv *r, struct htrace_span *span)
+{
+    struct shm_rcv *rcv = (struct shm_rcv *)r;
+    uint64_t len;
+    int ret;
+
+    span->trid = rcv->tracer->trid;
+    len = span_msgpack_size(span);
+    pthread_mutex_lock(&rcv->lock);
+    ret = shm_rcv_write_locked(rcv, span, NULL, len);
+    if (ret == 0) {
+        __atomic_store_n(&rcv->hdr->head, rcv->head, __ATOMIC_SEQ_CST);
+        shm_rcv_wake(rcv);
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    span->trid = NULL;
+    if (ret == EFBIG) {
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_WARN,
+                "shm_rcv_add_span: a span of %" PRId64 " bytes does not "
+                "fit in the ring.  Dropping it.\n", len);
+    }
+}
+
+/**
+ * Add several spans to the ring.
+ *
+ * @param rcv           The shm receiver.
+ * @param spans         The spans.
+ * @param buf           The spans in msgpack form, one after another, or NULL
+ *                          to serialize them here.
+ * @param lens          The serialized length of each span.  Ignored if buf
+ *                          is NULL.
+ * @param num_spans     The number of spans.
+ */
+static void shm_rcv_add_batch(struct shm_rcv *rcv, struct htrace_span **spans,
+                              const uint8_t *buf, const uint64_t *lens,
+                              int num_spans)
+{
+    uint64_t len, too_large = 0;
+    int i, added = 0;
+
+    pthread_mutex_lock(&rcv->lock);
+    for (i = 0; i < num_spans; i++) {
+        spans[i]->trid = rcv->tracer->trid;
+        len = buf ? lens[i] : span_msgpack_size(spans[i]);
+        switch (shm_rcv_write_locked(rcv, spans[i], buf, len)) {
+        case 0:
+            added = 1;
+            break;
+        case EFBIG:
+            too_large = len;
+            break;
+        default:
+            break;
+        }
+        spans[i]->trid = NULL;
+        if (buf) {
+            buf += len;
+        }
+    }
+    // Publish the whole batch at once, so that the consumer is woken at most
+    // once.
+    if (added) {
+        __atomic_store_n(&rcv->hdr->head, rcv->head, __ATOMIC_SEQ_CST);
+        shm_rcv_wake(rcv);
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    if (too_large) {
+        HTRACE_LOG_RATELIMITED(rcv->tracer->lg, HTRACE_LOG_WARN,
+                "shm_rcv_add_spans: a span of %" PRId64 " bytes does not "
+                "fit in the ring.  Dropping it.\n", too_large);
+    }
+}
+
+static void shm_rcv_add_spans(struct htrace_rcv *r, struct htrace_span **spans,
+                              int num_spans)
+{
+    shm_rcv_add_batch((struct shm_rcv *)r, spans, NULL, NULL, num_spans);
+}
+
+static void shm_rcv_add_msgpack(struct htrace_rcv *r,
+                                struct htrace_span **spans,
+                                const uint8_t *buf, const uint64_t *lens,
+                                int num_spans)
+{
+    shm_rcv_add_batch((struct shm_rcv *)r, spans, buf, lens, num_spans);
+}
+
+static void shm_rcv_flush(struct htrace_rcv *r)
+{
+    // Spans are visible to the consumer as soon as they are added.
+}
+
+static void shm_rcv_free(struct htrace_rcv *r)
+{
+    struct shm_rcv *rcv = (struct shm_rcv *)r;
+    struct htrace_log *lg;
+    int ret;
+
+    if (!rcv) {
+        return;
+    }
+    lg = rcv->tracer->lg;
+    htrace_log(lg, "Shutting down shm receiver with path=%s: buffered=%"
+               PRId64 ", dropped_full=%" PRId64 ", dropped_too_large=%"
+               PRId64 "\n", rcv->path, rcv->buffered, rcv->dropped_full,
+               rcv->dropped_too_large);
+    // Leave the file in place, so that the consumer can read whatever is
+    // left in the ring.
+    munmap(rcv->hdr, sizeof(struct shm_ring_header) + rcv->data_len);
+    ret = pthread_mutex_destroy(&rcv->lock);
+    if (ret) {
+        htrace_log(lg, "shm_rcv_free: pthread_mutex_destroy "
+                   "error %d: %s\n", ret, terror(ret));
+    }
+    htrace_free(rcv->path);
+    htrace_free(rcv);
+}
+
+static void shm_rcv_get_stats(struct htrace_rcv *r,
+                              struct htrace_stats *stats)
+{
+    struct shm_rcv *rcv = (struct shm_rcv *)r;
+
+    pthread_mutex_lock(&rcv->lock);
+    stats->buffered = rcv->buffered;
+    stats->dropped_newest = rcv->dropped_full;
+    stats->dropped_too_large = rcv->dropped_too_large;
+    stats->bytes_serialized = rcv->bytes_serialized;
+    stats->buffer_bytes_max = rcv->bytes_max;
+    pthread_mutex_unlock(&rcv->lock);
+}
+
+/**
+ * The pressure on the shm receiver is how full the ring is, or the maximum if
+ * spans were dropped for lack of room since the last time we were asked.
+ */
+static int shm_rcv_get_pressure(struct htrace_rcv *r)
+{
+    struct shm_rcv *rcv = (struct shm_rcv *)r;
+    uint64_t used, dropped;
+    int pressure;
+
+    pthread_mutex_lock(&rcv->lock);
+    used = rcv->head - __atomic_load_n(&rcv->hdr->tail, __ATOMIC_ACQUIRE);
+    pressure = (used * HTRACE_RCV_PRESSURE_MAX) / rcv->data_len;
+    dropped = rcv->dropped_full;
+    if (dropped != rcv->pressure_dropped) {
+        rcv->pressure_dropped = dropped;
+        pressure = HTRACE_RCV_PRESSURE_MAX;
+    }
+    pthread_mutex_unlock(&rcv->lock);
+    return pressure;
+}
+
+const struct htrace_rcv_ty g_shm_rcv_ty = {
+    "shm",
+    shm_rcv_create,
+    shm_rcv_add_span,
+    shm_rcv_add_spans,
+    NULL,
+    shm_rcv_flush,
+    shm_rcv_free,
+    shm_rcv_get_stats,
+    shm_rcv_get_pressure,
+    shm_rcv_add_msgpack,
+    NULL,
+};
+
+// vim:ts=4:sw=4:et
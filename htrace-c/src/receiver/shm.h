@@ -0,0 +1,141 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_RECEIVER_SHM_H
+#define APACHE_HTRACE_RECEIVER_SHM_H
+
+/**
+ * @file shm.h
+ *
+ * The layout of the shared memory ring written by the shm span receiver.
+ *
+ * The ring is a file, normally in /dev/shm, which the tracing process and a
+ * local collector both map.  It starts with a struct shm_ring_header,
+ * followed by data_len bytes of data.  The tracing process is the only
+ * producer.  It appends records to the data area, and advances head.  The
+ * collector reads records between tail and head, and advances tail when it is
+ * done with them.  head and tail count bytes since the ring was created; the
+ * offset of a record in the data area is its position modulo data_len.
+ *
+ * Each record is a struct shm_rec_header followed by len bytes, padded to a
+ * multiple of SHM_RING_ALIGN.  SHM_REC_SPAN records hold one span, in the
+ * same msgpack form that span_write_msgpack produces.  A record never wraps
+ * around the end of the data area; when one would, the producer fills the
+ * rest of the data area with a SHM_REC_PAD record instead.
+ *
+ * Everything is in host byte order, since producer and consumer share a host.
+ *
+ * Delivering spans takes no system calls, unless the consumer is asleep.  A
+ * consumer which finds the ring empty may set consumer_waiting to 1, check
+ * head again, and then wait on consumer_waiting with FUTEX_WAIT.  The
+ * producer clears consumer_waiting and does a FUTEX_WAKE after appending a
+ * record, if consumer_waiting was set.  On platforms without futexes, the
+ * consumer must poll.  All of these accesses must be sequentially consistent
+ * atomics.
+ *
+ * There is one consumer.  Several collector threads can share a ring, but
+ * they must agree among themselves on who advances tail.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stdint.h>
+
+/**
+ * The value of shm_ring_header#magic, once the ring is ready to use.
+ */
+#define SHM_RING_MAGIC 0x52535448U
+
+#define SHM_RING_VERSION 1
+
+/**
+ * The alignment of records in the data area.
+ */
+#define SHM_RING_ALIGN 8
+
+/**
+ * The number of bytes a record with len bytes of payload takes up.
+ */
+#define SHM_REC_SIZE(len) \
+    (sizeof(struct shm_rec_header) + \
+     (((len) + SHM_RING_ALIGN - 1) & ~(uint64_t)(SHM_RING_ALIGN - 1)))
+
+/**
+ * A record holding one msgpack-encoded span.
+ */
+#define SHM_REC_SPAN 1
+
+/**
+ * A record which should be skipped.
+ */
+#define SHM_REC_PAD 2
+
+struct shm_ring_header {
+    /**
+     * SHM_RING_MAGIC.  This is written last, when the ring is created.
+     */
+    uint32_t magic;
+
+    /**
+     * SHM_RING_VERSION.
+     */
+    uint32_t version;
+
+    /**
+     * The length of the data area which follows this header.
+     */
+    uint64_t data_len;
+
+    /**
+     * The number of spans the producer dropped because the ring was full.
+     */
+    uint64_t dropped;
+
+    /**
+     * The position after the last record the producer has written.  Only
+     * written by the producer.
+     */
+    uint64_t head __attribute__((aligned(64)));
+
+    /**
+     * The position after the last record the consumer has finished with.
+     * Only written by the consumer.
+     */
+    uint64_t tail __attribute__((aligned(64)));
+
+    /**
+     * Nonzero if the consumer is asleep, or about to go to sleep.
+     */
+    uint32_t consumer_waiting;
+} __attribute__((aligned(64)));
+
+struct shm_rec_header {
+    /**
+     * The length of the record payload, not counting this header or padding.
+     */
+    uint32_t len;
+
+    /**
+     * The type of record: SHM_REC_SPAN or SHM_REC_PAD.
+     */
+    uint32_t type;
+};
+
+#endif
+
+// vim: ts=4:sw=4:et
@@ -0,0 +1,341 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "receiver/spill.h"
+#include "util/alloc.h"
+#include "util/log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/**
+ * @file spill.c
+ *
+ * Implements the on-disk spill queue.
+ *
+ * Each batch is stored as a spill_rec_hdr, followed by the batch data, padded
+ * out to a multiple of 8 bytes.  A batch never spans two segments.
+ */
+
+#define SPILL_REC_MAGIC 0x4c495053U
+
+#define SPILL_ALIGN(x) (((x) + 7ULL) & ~7ULL)
+
+struct spill_rec_hdr {
+    uint32_t magic;
+    uint32_t len;
+    uint64_t num_spans;
+};
+
+struct spill_seg {
+    /**
+     * The next newest segment, or NULL.
+     */
+    struct spill_seg *next;
+
+    /**
+     * The path of the segment file.  Malloced.
+     */
+    char *path;
+
+    /**
+     * The memory-mapped segment file.
+     */
+    char *base;
+
+    /**
+     * The offset at which the next batch will be written.
+     */
+    uint64_t woff;
+
+    /**
+     * The offset of the oldest batch which has not been consumed.
+     */
+    uint64_t roff;
+};
+
+struct spill_log {
+    /**
+     * The log to use.
+     */
+    struct htrace_log *lg;
+
+    /**
+     * The directory to put segment files in.  Malloced.
+     */
+    char *dir;
+
+    /**
+     * The size of each segment file.
+     */
+    uint64_t seg_size;
+
+    /**
+     * The maximum number of segment files.
+     */
+    uint64_t max_segs;
+
+    /**
+     * The current number of segment files.
+     */
+    uint64_t num_segs;
+
+    /**
+     * The ID to use for the next segment file.
+     */
+    uint64_t next_id;
+
+    /**
+     * The number of batches in the queue.
+     */
+    uint64_t count;
+
+    /**
+     * The oldest segment, which batches are read from, or NULL.
+     */
+    struct spill_seg *head;
+
+    /**
+     * The newest segment, which batches are written to, or NULL.
+     */
+    struct spill_seg *tail;
+};
+
+static struct spill_seg *spill_seg_create(struct spill_log *sp)
+{
+    struct spill_seg *seg;
+    int e, fd;
+
+    seg = htrace_calloc(1, sizeof(*seg));
+    if (!seg) {
+        htrace_log(sp->lg, "spill_seg_create: OOM\n");
+        return NULL;
+    }
+    if (htrace_asprintf(&seg->path, "%s/htrace-spill.%lld.%" PRId64,
+                        sp->dir, (long long)getpid(), sp->next_id) < 0) {
+        htrace_log(sp->lg, "spill_seg_create: OOM\n");
+        seg->path = NULL;
+        goto error_free_seg;
+    }
+    fd = open(seg->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        e = errno;
+        htrace_log(sp->lg, "spill_seg_create: open(%s) failed: error %d "
+                   "(%s)\n", seg->path, e, terror(e));
+        goto error_free_path;
+    }
+    if (ftruncate(fd, sp->seg_size) < 0) {
+        e = errno;
+        htrace_log(sp->lg, "spill_seg_create: ftruncate(%s) failed: error %d "
+                   "(%s)\n", seg->path, e, terror(e));
+        goto error_unlink;
+    }
+    seg->base = mmap(NULL, sp->seg_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    if (seg->base == MAP_FAILED) {
+        e = errno;
+        htrace_log(sp->lg, "spill_seg_create: mmap(%s) failed: error %d "
+                   "(%s)\n", seg->path, e, terror(e));
+        goto error_unlink;
+    }
+    // The mapping stays valid after the file is closed.
+    close(fd);
+    sp->next_id++;
+    sp->num_segs++;
+    return seg;
+
+error_unlink:
+    close(fd);
+    unlink(seg->path);
+error_free_path:
+    htrace_free(seg->path);
+error_free_seg:
+    htrace_free(seg);
+    return NULL;
+}
+
+static void spill_seg_free(struct spill_log *sp, struct spill_seg *seg)
+{
+    munmap(seg->base, sp->seg_size);
+    if (unlink(seg->path) < 0) {
+        int e = errno;
+        htrace_log(sp->lg, "spill_seg_free: unlink(%s) failed: error %d "
+                   "(%s)\n", seg->path, e, terror(e));
+    }
+    htrace_free(seg->path);
+    htrace_free(seg);
+    sp->num_segs--;
+}
+
+struct spill_log *spill_log_open(struct htrace_log *lg, const char *dir,
+                                 uint64_t seg_size, uint64_t max_size)
+{
+    struct spill_log *sp;
+    int e;
+
+    if ((mkdir(dir, 0700) < 0) && (errno != EEXIST)) {
+        e = errno;
+        htrace_log(lg, "spill_log_open: mkdir(%s) failed: error %d (%s)\n",
+                   dir, e, terror(e));
+        return NULL;
+    }
+    sp = htrace_calloc(1, sizeof(*sp));
+    if (!sp) {
+        htrace_log(lg, "spill_log_open: OOM\n");
+        return NULL;
+    }
+    sp->dir = htrace_strdup(dir);
+    if (!sp->dir) {
+        htrace_log(lg, "spill_log_open: OOM\n");
+        htrace_free(sp);
+        return NULL;
+    }
+    sp->lg = lg;
+    sp->seg_size = SPILL_ALIGN(seg_size);
+    sp->max_segs = max_size / sp->seg_size;
+    if (sp->max_segs < 1) {
+        sp->max_segs = 1;
+    }
+    return sp;
+}
+
+int spill_log_append(struct spill_log *sp, const void *data, uint64_t len,
+                     uint64_t num_spans)
+{
+    struct spill_rec_hdr *hdr;
+    struct spill_seg *seg;
+    uint64_t need;
+
+    need = sizeof(struct spill_rec_hdr) + SPILL_ALIGN(len);
+    if ((need > sp->seg_size) || (len > UINT32_MAX)) {
+        htrace_log(sp->lg, "spill_log_append: a batch of %" PRId64 " bytes "
+                   "is too big for a segment of %" PRId64 " bytes.\n",
+                   len, sp->seg_size);
+        return 0;
+    }
+    seg = sp->tail;
+    if ((!seg) || (seg->woff + need > sp->seg_size)) {
+        if (sp->num_segs >= sp->max_segs) {
+            return 0;
+        }
+        seg = spill_seg_create(sp);
+        if (!seg) {
+            return 0;
+        }
+        if (sp->tail) {
+            sp->tail->next = seg;
+        } else {
+            sp->head = seg;
+        }
+        sp->tail = seg;
+    }
+    hdr = (struct spill_rec_hdr *)(seg->base + seg->woff);
+    hdr->magic = SPILL_REC_MAGIC;
+    hdr->len = len;
+    hdr->num_spans = num_spans;
+    memcpy(hdr + 1, data, len);
+    seg->woff += need;
+    sp->count++;
+    return 1;
+}
+
+int spill_log_peek(struct spill_log *sp, const void **data, uint64_t *len,
+                   uint64_t *num_spans)
+{
+    struct spill_rec_hdr *hdr;
+    struct spill_seg *seg = sp->head;
+
+    if (sp->count == 0) {
+        return 0;
+    }
+    hdr = (struct spill_rec_hdr *)(seg->base + seg->roff);
+    *data = hdr + 1;
+    *len = hdr->len;
+    *num_spans = hdr->num_spans;
+    return 1;
+}
+
+void spill_log_pop(struct spill_log *sp)
+{
+    struct spill_rec_hdr *hdr;
+    struct spill_seg *seg = sp->head;
+
+    hdr = (struct spill_rec_hdr *)(seg->base + seg->roff);
+    seg->roff += sizeof(struct spill_rec_hdr) + SPILL_ALIGN(hdr->len);
+    sp->count--;
+    if (seg->roff < seg->woff) {
+        return;
+    }
+    if (seg->next) {
+        // Every batch in this segment has been consumed.
+        sp->head = seg->next;
+        spill_seg_free(sp, seg);
+    } else {
+        // Reuse the last segment from the start.
+        seg->roff = 0;
+        seg->woff = 0;
+    }
+}
+
+uint64_t spill_log_count(const struct spill_log *sp)
+{
+    return sp->count;
+}
+
+void spill_log_close(struct spill_log *sp)
+{
+    struct spill_seg *seg;
+
+    if (!sp) {
+        return;
+    }
+    while ((seg = sp->head)) {
+        sp->head = seg->next;
+        spill_seg_free(sp, seg);
+    }
+    htrace_free(sp->dir);
+    htrace_free(sp);
+}
+
+void spill_log_abandon(struct spill_log *sp)
+{
+    struct spill_seg *seg;
+
+    if (!sp) {
+        return;
+    }
+    while ((seg = sp->head)) {
+        sp->head = seg->next;
+        munmap(seg->base, sp->seg_size);
+        htrace_free(seg->path);
+        htrace_free(seg);
+    }
+    htrace_free(sp->dir);
+    htrace_free(sp);
+}
+
+// vim: ts=4:sw=4:et
@@ -0,0 +1,127 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_RECEIVER_SPILL
+#define APACHE_HTRACE_RECEIVER_SPILL
+
+/**
+ * @file spill.h
+ *
+ * An on-disk queue of span batches.
+ *
+ * The htraced receiver spills batches here when it can't send them, and
+ * replays them later.  The queue is made up of fixed-size segment files which
+ * are memory-mapped.  New batches are appended to the newest segment, and a
+ * new segment is created when it fills up.  Segments are deleted once every
+ * batch in them has been consumed.  The total size of the segments is capped.
+ *
+ * The segment files belong to the process that created them, and are deleted
+ * when the queue is closed.  Nothing is recovered from segment files left
+ * over from a previous process.
+ *
+ * The queue does no locking of its own.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stdint.h>
+
+struct htrace_log;
+struct spill_log;
+
+/**
+ * The number of bytes of overhead in each segment for a batch, not counting
+ * padding.
+ */
+#define SPILL_RECORD_OVERHEAD 16
+
+/**
+ * Open a new spill queue.
+ *
+ * @param lg            The log to use.
+ * @param dir           The directory to put segment files in.  It will be
+ *                          created if it doesn't exist.
+ * @param seg_size      The size of each segment file.
+ * @param max_size      The maximum total size of the segment files.
+ *
+ * @return              The spill queue, or NULL on error.
+ */
+struct spill_log *spill_log_open(struct htrace_log *lg, const char *dir,
+                                 uint64_t seg_size, uint64_t max_size);
+
+/**
+ * Append a batch to the spill queue.
+ *
+ * @param sp            The spill queue.
+ * @param data          The batch data.
+ * @param len           The length of the batch data.
+ * @param num_spans     The number of spans in the batch.
+ *
+ * @return              1 on success; 0 if the queue is full, or on error.
+ */
+int spill_log_append(struct spill_log *sp, const void *data, uint64_t len,
+                     uint64_t num_spans);
+
+/**
+ * Get the oldest batch in the spill queue, without removing it.
+ *
+ * @param sp            The spill queue.
+ * @param data          (out param) The batch data.  This stays valid until
+ *                          the batch is removed with spill_log_pop.
+ * @param len           (out param) The length of the batch data.
+ * @param num_spans     (out param) The number of spans in the batch.
+ *
+ * @return              1 if there was a batch; 0 if the queue is empty.
+ */
+int spill_log_peek(struct spill_log *sp, const void **data, uint64_t *len,
+                   uint64_t *num_spans);
+
+/**
+ * Remove the oldest batch from the spill queue.
+ *
+ * @param sp            The spill queue.  Must not be empty.
+ */
+void spill_log_pop(struct spill_log *sp);
+
+/**
+ * Get the number of batches in the spill queue.
+ *
+ * @param sp            The spill queue.
+ *
+ * @return              The number of batches.
+ */
+uint64_t spill_log_count(const struct spill_log *sp);
+
+/**
+ * Close the spill queue, and delete its segment files.
+ *
+ * @param sp            The spill queue.  May be NULL.
+ */
+void spill_log_close(struct spill_log *sp);
+
+/**
+ * Free a spill queue which was inherited across fork, leaving its segment
+ * files to the parent process.
+ *
+ * @param sp            The spill queue.  May be NULL.
+ */
+void spill_log_abandon(struct spill_log *sp);
+
+#endif
+
+// vim: ts=4:sw=4:et
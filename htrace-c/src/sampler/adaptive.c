@@ -0,0 +1,268 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "receiver/receiver.h"
+#include "sampler/sampler.h"
+#include "util/alloc.h"
+#include "util/log.h"
+#include "util/rand.h"
+#include "util/time.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file adaptive.c
+ *
+ * A probability sampler which backs off when the span receiver is under
+ * pressure.
+ *
+ * Every interval_ms, one of the threads calling next() asks the span
+ * receiver how much pressure it is under.  Above the target pressure, we
+ * halve the sampling fraction, down to min_fraction.  Below half the
+ * target, we raise it by a quarter, up to max_fraction.  In between, we
+ * leave it alone, so that the fraction doesn't flap around the target.
+ *
+ * With a span receiver which can't report pressure, this behaves like the
+ * probability sampler with a fraction of max_fraction.
+ */
+
+/**
+ * How much we multiply the fraction by when the pressure is high.
+ */
+#define ADAPTIVE_SAMPLER_DECREASE 0.5
+
+/**
+ * How much we multiply the fraction by when the pressure is low.
+ */
+#define ADAPTIVE_SAMPLER_INCREASE 1.25
+
+struct adaptive_sampler {
+    struct htrace_sampler base;
+
+    /**
+     * The tracer whose span receiver we poll.
+     */
+    struct htracer *tracer;
+
+    /**
+     * A random source.
+     */
+    struct random_src *rnd;
+
+    /**
+     * The name of this sampler.
+     */
+    char *name;
+
+    /**
+     * The lowest and highest fractions we will use.
+     */
+    double min_fraction;
+    double max_fraction;
+
+    /**
+     * The pressure above which we sample less.
+     */
+    int target_pressure;
+
+    /**
+     * How often to poll the span receiver, in milliseconds.
+     */
+    uint64_t interval_ms;
+
+    /**
+     * The monotonic time at which to poll the span receiver next.  Whichever
+     * thread advances this gets to do the poll.
+     */
+    uint64_t next_poll_ms;
+
+    /**
+     * The threshold at which we should sample.  This is the current fraction
+     * scaled to 32 bits.
+     */
+    uint32_t threshold;
+};
+
+static struct htrace_sampler *adaptive_sampler_create(struct htracer *tracer,
+                                          const struct htrace_conf *conf);
+static const char *adaptive_sampler_to_str(struct htrace_sampler *s);
+static int adaptive_sampler_next(struct htrace_sampler *s);
+static void adaptive_sampler_free(struct htrace_sampler *s);
+
+const struct htrace_sampler_ty g_adaptive_sampler_ty = {
+    "adaptive",
+    adaptive_sampler_create,
+    adaptive_sampler_to_str,
+    adaptive_sampler_next,
+    NULL,
+    NULL,
+    adaptive_sampler_free,
+    NULL,
+};
+
+/**
+ * Get a fraction from the configuration, clamped to [0, 1].
+ */
+static double get_adaptive_fraction(struct htrace_log *lg,
+                        const struct htrace_conf *conf, const char *key)
+{
+    double fraction = htrace_conf_get_double(lg, conf, key);
+
+    if (fraction < 0) {
+        htrace_log(lg, "adaptive_sampler_create: can't set %s to less "
+                   "than 0.  Setting it to 0.\n", key);
+        fraction = 0.0;
+    } else if (fraction > 1.0) {
+        htrace_log(lg, "adaptive_sampler_create: can't set %s to more "
+                   "than 1.  Setting it to 1.\n", key);
+        fraction = 1.0;
+    }
+    return fraction;
+}
+
+static struct htrace_sampler *adaptive_sampler_create(struct htracer *tracer,
+                                          const struct htrace_conf *conf)
+{
+    struct adaptive_sampler *smp;
+    uint64_t target;
+
+    smp = htrace_calloc(1, sizeof(*smp));
+    if (!smp) {
+        htrace_log(tracer->lg, "adaptive_sampler_create: OOM\n");
+        return NULL;
+    }
+    smp->base.ty = &g_adaptive_sampler_ty;
+    smp->tracer = tracer;
+    smp->rnd = random_src_alloc(tracer->lg);
+    if (!smp->rnd) {
+        htrace_log(tracer->lg, "random_src_alloc failed.\n");
+        htrace_free(smp);
+        return NULL;
+    }
+    smp->max_fraction = get_adaptive_fraction(tracer->lg, conf,
+                            HTRACE_ADAPTIVE_SAMPLER_MAX_FRACTION_KEY);
+    smp->min_fraction = get_adaptive_fraction(tracer->lg, conf,
+                            HTRACE_ADAPTIVE_SAMPLER_MIN_FRACTION_KEY);
+    if (smp->min_fraction > smp->max_fraction) {
+        htrace_log(tracer->lg, "adaptive_sampler_create: %s is greater than "
+                   "%s.  Using %g for both.\n",
+                   HTRACE_ADAPTIVE_SAMPLER_MIN_FRACTION_KEY,
+                   HTRACE_ADAPTIVE_SAMPLER_MAX_FRACTION_KEY,
+                   smp->max_fraction);
+        smp->min_fraction = smp->max_fraction;
+    }
+    target = htrace_conf_get_u64(tracer->lg, conf,
+                                 HTRACE_ADAPTIVE_SAMPLER_TARGET_PRESSURE_KEY);
+    if ((target < 1) || (target > HTRACE_RCV_PRESSURE_MAX)) {
+        htrace_log(tracer->lg, "adaptive_sampler_create: %s must be between "
+                   "1 and %d.  Using %d.\n",
+                   HTRACE_ADAPTIVE_SAMPLER_TARGET_PRESSURE_KEY,
+                   HTRACE_RCV_PRESSURE_MAX, HTRACE_RCV_PRESSURE_MAX / 2);
+        target = HTRACE_RCV_PRESSURE_MAX / 2;
+    }
+    smp->target_pressure = target;
+    smp->interval_ms = htrace_conf_get_u64(tracer->lg, conf,
+                                HTRACE_ADAPTIVE_SAMPLER_INTERVAL_MS_KEY);
+    if (smp->interval_ms < 1) {
+        smp->interval_ms = 1;
+    }
+    smp->next_poll_ms = monotonic_now_ms(tracer->lg) + smp->interval_ms;
+    smp->threshold = 0xffffffffLU * smp->max_fraction;
+    if (htrace_asprintf(&smp->name, "AdaptiveSampler(min_fraction=%.03g, "
+                        "max_fraction=%.03g, target_pressure=%d)",
+                        smp->min_fraction, smp->max_fraction,
+                        smp->target_pressure) < 0) {
+        smp->name = NULL;
+        random_src_free(smp->rnd);
+        htrace_free(smp);
+        return NULL;
+    }
+    return (struct htrace_sampler *)smp;
+}
+
+static const char *adaptive_sampler_to_str(struct htrace_sampler *s)
+{
+    struct adaptive_sampler *smp = (struct adaptive_sampler *)s;
+    return smp->name;
+}
+
+/**
+ * Poll the span receiver and adjust the sampling fraction.
+ */
+static void adaptive_sampler_adjust(struct adaptive_sampler *smp)
+{
+    struct htrace_rcv *rcv = smp->tracer->rcv;
+    uint32_t threshold;
+    double fraction;
+    int pressure;
+
+    if ((!rcv) || (!rcv->ty->get_pressure)) {
+        return;
+    }
+    threshold = __atomic_load_n(&smp->threshold, __ATOMIC_RELAXED);
+    fraction = threshold / (double)0xffffffffLU;
+    pressure = rcv->ty->get_pressure(rcv);
+    if (pressure > smp->target_pressure) {
+        fraction *= ADAPTIVE_SAMPLER_DECREASE;
+        if (fraction < smp->min_fraction) {
+            fraction = smp->min_fraction;
+        }
+    } else if (pressure < (smp->target_pressure / 2)) {
+        fraction *= ADAPTIVE_SAMPLER_INCREASE;
+        if (fraction > smp->max_fraction) {
+            fraction = smp->max_fraction;
+        }
+    }
+    __atomic_store_n(&smp->threshold, (uint32_t)(0xffffffffLU * fraction),
+                     __ATOMIC_RELAXED);
+}
+
+static int adaptive_sampler_next(struct htrace_sampler *s)
+{
+    struct adaptive_sampler *smp = (struct adaptive_sampler *)s;
+    uint64_t now, next;
+
+    now = monotonic_now_ms(NULL);
+    next = __atomic_load_n(&smp->next_poll_ms, __ATOMIC_RELAXED);
+    if ((now >= next) &&
+            __atomic_compare_exchange_n(&smp->next_poll_ms, &next,
+                                        now + smp->interval_ms, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        adaptive_sampler_adjust(smp);
+    }
+    return random_u32(smp->rnd) <
+        __atomic_load_n(&smp->threshold, __ATOMIC_RELAXED);
+}
+
+static void adaptive_sampler_free(struct htrace_sampler *s)
+{
+    struct adaptive_sampler *smp = (struct adaptive_sampler *)s;
+    random_src_free(smp->rnd);
+    htrace_free(smp->name);
+    htrace_free(smp);
+}
+
+// vim: ts=4:sw=4:tw=79:et
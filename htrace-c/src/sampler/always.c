@@ -40,7 +40,10 @@ const struct htrace_sampler_ty g_always_sampler_ty = {
     always_sampler_create,
     always_sampler_to_str,
     always_sampler_next,
+    NULL,
+    NULL,
     always_sampler_free,
+    NULL,
 };
 
 const struct always_sampler g_always_sampler = {
@@ -0,0 +1,203 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "sampler/sampler.h"
+#include "util/alloc.h"
+#include "util/log.h"
+#include "util/rand.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file hash.c
+ *
+ * A sampler which decides from a hash of the trace ID.
+ *
+ * Every process which uses this sampler with the same fraction makes the
+ * same decision about a given trace, so traces which cross process
+ * boundaries are either kept whole or not at all.  A process with a lower
+ * fraction samples a subset of the traces that a process with a higher
+ * fraction does.
+ *
+ * The hash is the 64-bit finalizer from MurmurHash3.  It must not change,
+ * since that would break the agreement between processes running different
+ * versions of the library.
+ */
+
+struct hash_sampler {
+    struct htrace_sampler base;
+
+    /**
+     * A random source, for callers which don't have a trace ID.
+     */
+    struct random_src *rnd;
+
+    /**
+     * The name of this sampler.  Replaced when the configuration is updated;
+     * see htrace_sampler_replace_str.
+     */
+    char *name;
+
+    /**
+     * The threshold at which we should sample.  Accessed atomically, since
+     * the configuration may be updated while we are sampling.
+     */
+    uint32_t threshold;
+};
+
+static struct htrace_sampler *hash_sampler_create(struct htracer *tracer,
+                                          const struct htrace_conf *conf);
+static const char *hash_sampler_to_str(struct htrace_sampler *s);
+static int hash_sampler_next(struct htrace_sampler *s);
+static int hash_sampler_next_trace(struct htrace_sampler *s,
+                                   uint64_t trace_id);
+static void hash_sampler_free(struct htrace_sampler *s);
+static void hash_sampler_update_conf(struct htrace_sampler *s,
+                                     const struct htrace_conf *conf);
+
+const struct htrace_sampler_ty g_hash_sampler_ty = {
+    "hash",
+    hash_sampler_create,
+    hash_sampler_to_str,
+    hash_sampler_next,
+    hash_sampler_next_trace,
+    NULL,
+    hash_sampler_free,
+    hash_sampler_update_conf,
+};
+
+/**
+ * Get the configured fraction for the hash sampler.
+ */
+static double hash_sampler_get_fraction(struct htrace_log *lg,
+                                        const struct htrace_conf *conf)
+{
+    double fraction;
+
+    fraction = htrace_conf_get_double(lg, conf,
+                                      HTRACE_HASH_SAMPLER_FRACTION_KEY);
+    if (fraction < 0) {
+        htrace_log(lg, "hash_sampler_create: can't have a sampling "
+                   "fraction less than 0.  Setting fraction to 0.\n");
+        fraction = 0.0;
+    } else if (fraction > 1.0) {
+        htrace_log(lg, "hash_sampler_create: can't have a sampling "
+                   "fraction greater than 1.  Setting fraction to 1.\n");
+        fraction = 1.0;
+    }
+    return fraction;
+}
+
+static struct htrace_sampler *hash_sampler_create(struct htracer *tracer,
+                                          const struct htrace_conf *conf)
+{
+    struct hash_sampler *smp;
+    double fraction;
+
+    smp = htrace_calloc(1, sizeof(*smp));
+    if (!smp) {
+        htrace_log(tracer->lg, "hash_sampler_create: OOM\n");
+        return NULL;
+    }
+    smp->base.ty = &g_hash_sampler_ty;
+    smp->rnd = random_src_alloc(tracer->lg);
+    if (!smp->rnd) {
+        htrace_log(tracer->lg, "random_src_alloc failed.\n");
+        htrace_free(smp);
+        return NULL;
+    }
+    fraction = hash_sampler_get_fraction(tracer->lg, conf);
+    smp->threshold = 0xffffffffLU * fraction;
+    if (htrace_asprintf(&smp->name, "HashSampler(fraction=%.03g)",
+                        fraction) < 0) {
+        smp->name = NULL;
+        random_src_free(smp->rnd);
+        htrace_free(smp);
+        return NULL;
+    }
+    return (struct htrace_sampler *)smp;
+}
+
+static const char *hash_sampler_to_str(struct htrace_sampler *s)
+{
+    struct hash_sampler *smp = (struct hash_sampler *)s;
+    return __atomic_load_n(&smp->name, __ATOMIC_ACQUIRE);
+}
+
+static int hash_sampler_next(struct htrace_sampler *s)
+{
+    struct hash_sampler *smp = (struct hash_sampler *)s;
+    return random_u32(smp->rnd) <
+        __atomic_load_n(&smp->threshold, __ATOMIC_RELAXED);
+}
+
+static int hash_sampler_next_trace(struct htrace_sampler *s,
+                                   uint64_t trace_id)
+{
+    struct hash_sampler *smp = (struct hash_sampler *)s;
+    uint64_t h = trace_id;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t)(h >> 32) <
+        __atomic_load_n(&smp->threshold, __ATOMIC_RELAXED);
+}
+
+static void hash_sampler_free(struct htrace_sampler *s)
+{
+    struct hash_sampler *smp = (struct hash_sampler *)s;
+    random_src_free(smp->rnd);
+    htrace_free(smp->name);
+    htrace_free(smp);
+}
+
+static void hash_sampler_update_conf(struct htrace_sampler *s,
+                                     const struct htrace_conf *conf)
+{
+    struct hash_sampler *smp = (struct hash_sampler *)s;
+    double fraction;
+    uint32_t threshold;
+    char *name;
+
+    fraction = hash_sampler_get_fraction(s->tracer->lg, conf);
+    threshold = 0xffffffffLU * fraction;
+    if (threshold == __atomic_load_n(&smp->threshold, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_store_n(&smp->threshold, threshold, __ATOMIC_RELAXED);
+    if (htrace_asprintf(&name, "HashSampler(fraction=%.03g)",
+                        fraction) < 0) {
+        htrace_log(s->tracer->lg, "hash_sampler_update_conf: OOM while "
+                   "renaming the sampler.\n");
+        return;
+    }
+    htrace_sampler_replace_str(s, &smp->name, name);
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -40,7 +40,10 @@ const struct htrace_sampler_ty g_never_sampler_ty = {
     never_sampler_create,
     never_sampler_to_str,
     never_sampler_next,
+    NULL,
+    NULL,
     never_sampler_free,
+    NULL,
 };
 
 struct never_sampler g_never_sampler = {
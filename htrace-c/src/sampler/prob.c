@@ -20,6 +20,7 @@
 #include "core/htrace.h"
 #include "core/htracer.h"
 #include "sampler/sampler.h"
+#include "util/alloc.h"
 #include "util/log.h"
 #include "util/rand.h"
 
@@ -42,12 +43,14 @@ struct prob_sampler {
     struct random_src *rnd;
 
     /**
-     * The name of this probability sampler.
+     * The name of this probability sampler.  Replaced when the configuration
+     * is updated; see htrace_sampler_replace_str.
      */
     char *name;
 
     /**
-     * The threshold at which we should sample.
+     * The threshold at which we should sample.  Accessed atomically, since
+     * the configuration may be updated while we are sampling.
      */
     uint32_t threshold;
 };
@@ -59,13 +62,18 @@ static struct htrace_sampler *prob_sampler_create(struct htracer *tracer,
 static const char *prob_sampler_to_str(struct htrace_sampler *s);
 static int prob_sampler_next(struct htrace_sampler *s);
 static void prob_sampler_free(struct htrace_sampler *s);
+static void prob_sampler_update_conf(struct htrace_sampler *s,
+                                     const struct htrace_conf *conf);
 
 const struct htrace_sampler_ty g_prob_sampler_ty = {
     "prob",
     prob_sampler_create,
     prob_sampler_to_str,
     prob_sampler_next,
+    NULL,
+    NULL,
     prob_sampler_free,
+    prob_sampler_update_conf,
 };
 
 static double get_prob_sampler_threshold(struct htrace_log *lg,
@@ -91,7 +99,7 @@ static struct htrace_sampler *prob_sampler_create(struct htracer *tracer,
     struct prob_sampler *smp;
     double fraction;
 
-    smp = calloc(1, sizeof(*smp));
+    smp = htrace_calloc(1, sizeof(*smp));
     if (!smp) {
         htrace_log(tracer->lg, "prob_sampler_create: OOM\n");
         return NULL;
@@ -100,16 +108,17 @@ static struct htrace_sampler *prob_sampler_create(struct htracer *tracer,
     smp->rnd = random_src_alloc(tracer->lg);
     if (!smp->rnd) {
         htrace_log(tracer->lg, "random_src_alloc failed.\n");
-        free(smp);
+        htrace_free(smp);
         return NULL;
     }
     fraction = get_prob_sampler_threshold(tracer->lg, conf);
     smp->threshold = 0xffffffffLU * fraction;
-    if (asprintf(&smp->name, "ProbabilitySampler(fraction=%.03g)",
-                 fraction) < 0) {
+    if (htrace_asprintf(&smp->name, "ProbabilitySampler(fraction=%.03g)",
+                        fraction) < 0) {
         smp->name = NULL;
         random_src_free(smp->rnd);
-        free(smp);
+        htrace_free(smp);
+        return NULL;
     }
     return (struct htrace_sampler *)smp;
 }
@@ -117,21 +126,45 @@ static struct htrace_sampler *prob_sampler_create(struct htracer *tracer,
 static const char *prob_sampler_to_str(struct htrace_sampler *s)
 {
     struct prob_sampler *smp = (struct prob_sampler *)s;
-    return smp->name;
+    return __atomic_load_n(&smp->name, __ATOMIC_ACQUIRE);
 }
 
 static int prob_sampler_next(struct htrace_sampler *s)
 {
     struct prob_sampler *smp = (struct prob_sampler *)s;
-    return random_u32(smp->rnd) < smp->threshold;
+    return random_u32(smp->rnd) <
+        __atomic_load_n(&smp->threshold, __ATOMIC_RELAXED);
 }
 
 static void prob_sampler_free(struct htrace_sampler *s)
 {
     struct prob_sampler *smp = (struct prob_sampler *)s;
     random_src_free(smp->rnd);
-    free(smp->name);
-    free(smp);
+    htrace_free(smp->name);
+    htrace_free(smp);
+}
+
+static void prob_sampler_update_conf(struct htrace_sampler *s,
+                                     const struct htrace_conf *conf)
+{
+    struct prob_sampler *smp = (struct prob_sampler *)s;
+    double fraction;
+    uint32_t threshold;
+    char *name;
+
+    fraction = get_prob_sampler_threshold(s->tracer->lg, conf);
+    threshold = 0xffffffffLU * fraction;
+    if (threshold == __atomic_load_n(&smp->threshold, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_store_n(&smp->threshold, threshold, __ATOMIC_RELAXED);
+    if (htrace_asprintf(&name, "ProbabilitySampler(fraction=%.03g)",
+                        fraction) < 0) {
+        htrace_log(s->tracer->lg, "prob_sampler_update_conf: OOM while "
+                   "renaming the sampler.\n");
+        return;
+    }
+    htrace_sampler_replace_str(s, &smp->name, name);
 }
 
 // vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,376 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "sampler/sampler.h"
+#include "util/alloc.h"
+#include "util/log.h"
+#include "util/time.h"
+#include "util/tsd.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file ratelimit.c
+ *
+ * A sampler which fires at most a fixed number of times per second.
+ *
+ * The sampler is a token bucket which holds up to one second's worth of
+ * tokens.  The bucket is refilled lazily from the monotonic clock by
+ * whichever thread finds it empty, using compare-and-swap rather than a lock.
+ *
+ * So that threads don't all write the bucket's cache line on every call,
+ * each thread takes a handful of tokens at a time into a cache of its own,
+ * found through a pthread key, and spends those first.  A thread can hold
+ * on to at most cache_chunk unspent tokens, so over any interval the sampler
+ * can fire that many times per thread more than the rate alone allows.
+ */
+
+/**
+ * The most tokens a thread takes from the bucket at once.
+ */
+#define RATELIMIT_MAX_CACHE_CHUNK 64
+
+/**
+ * One thread's cache of tokens.
+ */
+struct ratelimit_cache {
+    /**
+     * The sampler which owns this cache.
+     */
+    struct ratelimit_sampler *smp;
+
+    /**
+     * The next and previous caches in the sampler's list.  Protected by the
+     * sampler lock.
+     */
+    struct ratelimit_cache *next;
+    struct ratelimit_cache *prev;
+
+    /**
+     * The number of unspent tokens.  Only used by the owning thread.
+     */
+    int64_t tokens;
+};
+
+struct ratelimit_sampler {
+    struct htrace_sampler base;
+
+    /**
+     * The log to use.
+     */
+    struct htrace_log *lg;
+
+    /**
+     * The name of this sampler.
+     */
+    char *name;
+
+    /**
+     * The number of nanoseconds it takes to earn one token.
+     */
+    uint64_t ns_per_token;
+
+    /**
+     * The most tokens the bucket can hold.
+     */
+    int64_t burst;
+
+    /**
+     * How many tokens a thread takes from the bucket at once.
+     */
+    int64_t cache_chunk;
+
+    /**
+     * Each thread's struct ratelimit_cache.
+     */
+    struct htrace_tsd tsd;
+
+    /**
+     * Protects caches.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * All the per-thread caches.
+     */
+    struct ratelimit_cache *caches;
+
+    /**
+     * The monotonic time up to which tokens have been added to the bucket.
+     * Kept on its own cache line, together with tokens, since every thread
+     * writes these.
+     */
+    uint64_t refill_ns __attribute__((aligned(64)));
+
+    /**
+     * The number of tokens in the bucket.
+     */
+    int64_t tokens;
+} __attribute__((aligned(64)));
+
+static struct htrace_sampler *ratelimit_sampler_create(struct htracer *tracer,
+                                          const struct htrace_conf *conf);
+static const char *ratelimit_sampler_to_str(struct htrace_sampler *s);
+static int ratelimit_sampler_next(struct htrace_sampler *s);
+static void ratelimit_sampler_free(struct htrace_sampler *s);
+
+const struct htrace_sampler_ty g_ratelimit_sampler_ty = {
+    "ratelimit",
+    ratelimit_sampler_create,
+    ratelimit_sampler_to_str,
+    ratelimit_sampler_next,
+    NULL,
+    NULL,
+    ratelimit_sampler_free,
+    NULL,
+};
+
+/**
+ * Called when a thread with a token cache exits.
+ */
+static void ratelimit_cache_retire(void *data)
+{
+    struct ratelimit_cache *cache = data;
+    struct ratelimit_sampler *smp = cache->smp;
+
+    pthread_mutex_lock(&smp->lock);
+    if (cache->prev) {
+        cache->prev->next = cache->next;
+    } else {
+        smp->caches = cache->next;
+    }
+    if (cache->next) {
+        cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&smp->lock);
+    htrace_free(cache);
+}
+
+/**
+ * Get the current thread's token cache, creating it if needed.
+ *
+ * @return              The cache, or NULL on error.
+ */
+static struct ratelimit_cache *ratelimit_cache_get(
+                    struct ratelimit_sampler *smp)
+{
+    struct ratelimit_cache *cache;
+    int ret;
+
+    cache = htrace_tsd_get(&smp->tsd);
+    if (cache) {
+        return cache;
+    }
+    cache = htrace_calloc(1, sizeof(*cache));
+    if (!cache) {
+        htrace_log(smp->lg, "ratelimit_cache_get: OOM\n");
+        return NULL;
+    }
+    cache->smp = smp;
+    ret = htrace_tsd_set(&smp->tsd, cache);
+    if (ret) {
+        htrace_log(smp->lg, "ratelimit_cache_get: htrace_tsd_set "
+                   "error %d: %s\n", ret, terror(ret));
+        htrace_free(cache);
+        return NULL;
+    }
+    pthread_mutex_lock(&smp->lock);
+    cache->next = smp->caches;
+    if (smp->caches) {
+        smp->caches->prev = cache;
+    }
+    smp->caches = cache;
+    pthread_mutex_unlock(&smp->lock);
+    return cache;
+}
+
+static struct htrace_sampler *ratelimit_sampler_create(struct htracer *tracer,
+                                          const struct htrace_conf *conf)
+{
+    struct ratelimit_sampler *smp;
+    uint64_t rate;
+    int ret;
+
+    ret = htrace_memalign((void**)&smp, 64, sizeof(*smp));
+    if (ret) {
+        htrace_log(tracer->lg, "ratelimit_sampler_create: OOM\n");
+        return NULL;
+    }
+    memset(smp, 0, sizeof(*smp));
+    smp->base.ty = &g_ratelimit_sampler_ty;
+    smp->lg = tracer->lg;
+    rate = htrace_conf_get_u64(tracer->lg, conf,
+                               HTRACE_RATELIMIT_SAMPLER_RATE_KEY);
+    if (rate > 1000000000ULL) {
+        htrace_log(tracer->lg, "ratelimit_sampler_create: can't set %s to "
+                   "%" PRIu64 ".  Using maximum value of 1000000000 "
+                   "instead.\n", HTRACE_RATELIMIT_SAMPLER_RATE_KEY, rate);
+        rate = 1000000000ULL;
+    }
+    // A rate of 0 leaves the bucket empty forever, so that we never fire.
+    smp->ns_per_token = rate ? (1000000000ULL / rate) : UINT64_MAX;
+    smp->burst = rate;
+    smp->cache_chunk = rate / 100;
+    if (smp->cache_chunk < 1) {
+        smp->cache_chunk = 1;
+    } else if (smp->cache_chunk > RATELIMIT_MAX_CACHE_CHUNK) {
+        smp->cache_chunk = RATELIMIT_MAX_CACHE_CHUNK;
+    }
+    smp->refill_ns = monotonic_now_ns(tracer->lg);
+    smp->tokens = smp->burst;
+    ret = htrace_tsd_init(&smp->tsd, ratelimit_cache_retire);
+    if (ret) {
+        htrace_log(tracer->lg, "ratelimit_sampler_create: htrace_tsd_init "
+                   "error %d: %s\n", ret, terror(ret));
+        htrace_free(smp);
+        return NULL;
+    }
+    ret = pthread_mutex_init(&smp->lock, NULL);
+    if (ret) {
+        htrace_log(tracer->lg, "ratelimit_sampler_create: pthread_mutex_init "
+                   "error %d: %s\n", ret, terror(ret));
+        htrace_tsd_destroy(&smp->tsd);
+        htrace_free(smp);
+        return NULL;
+    }
+    if (htrace_asprintf(&smp->name,
+                        "RateLimitSampler(spans_per_sec=%" PRIu64 ")",
+                        rate) < 0) {
+        smp->name = NULL;
+        pthread_mutex_destroy(&smp->lock);
+        htrace_tsd_destroy(&smp->tsd);
+        htrace_free(smp);
+        return NULL;
+    }
+    return (struct htrace_sampler *)smp;
+}
+
+static const char *ratelimit_sampler_to_str(struct htrace_sampler *s)
+{
+    struct ratelimit_sampler *smp = (struct ratelimit_sampler *)s;
+    return smp->name;
+}
+
+/**
+ * Add the tokens earned since the bucket was last refilled.
+ */
+static void ratelimit_refill(struct ratelimit_sampler *smp)
+{
+    uint64_t now, last, next, earned;
+    int64_t cur, nval;
+
+    now = monotonic_now_ns(smp->lg);
+    last = __atomic_load_n(&smp->refill_ns, __ATOMIC_RELAXED);
+    if ((now < last) || (now - last < smp->ns_per_token)) {
+        return;
+    }
+    earned = (now - last) / smp->ns_per_token;
+    if (earned >= (uint64_t)smp->burst) {
+        earned = smp->burst;
+        next = now;
+    } else {
+        next = last + (earned * smp->ns_per_token);
+    }
+    // Only the thread which advances refill_ns gets to add the tokens for
+    // that interval.
+    if (!__atomic_compare_exchange_n(&smp->refill_ns, &last, next, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    cur = __atomic_load_n(&smp->tokens, __ATOMIC_RELAXED);
+    do {
+        nval = cur + earned;
+        if (nval > smp->burst) {
+            nval = smp->burst;
+        }
+    } while (!__atomic_compare_exchange_n(&smp->tokens, &cur, nval, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Take up to max tokens from the bucket.
+ *
+ * @return              The number of tokens taken.
+ */
+static int64_t ratelimit_take(struct ratelimit_sampler *smp, int64_t max)
+{
+    int64_t cur, got;
+
+    cur = __atomic_load_n(&smp->tokens, __ATOMIC_RELAXED);
+    do {
+        if (cur <= 0) {
+            return 0;
+        }
+        got = (cur < max) ? cur : max;
+    } while (!__atomic_compare_exchange_n(&smp->tokens, &cur, cur - got, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return got;
+}
+
+static int ratelimit_sampler_next(struct htrace_sampler *s)
+{
+    struct ratelimit_sampler *smp = (struct ratelimit_sampler *)s;
+    struct ratelimit_cache *cache;
+    int64_t got;
+
+    cache = ratelimit_cache_get(smp);
+    if (cache && (cache->tokens > 0)) {
+        cache->tokens--;
+        return 1;
+    }
+    got = ratelimit_take(smp, cache ? smp->cache_chunk : 1);
+    if (got == 0) {
+        ratelimit_refill(smp);
+        got = ratelimit_take(smp, cache ? smp->cache_chunk : 1);
+        if (got == 0) {
+            return 0;
+        }
+    }
+    if (cache) {
+        cache->tokens = got - 1;
+    }
+    return 1;
+}
+
+static void ratelimit_sampler_free(struct htrace_sampler *s)
+{
+    struct ratelimit_sampler *smp = (struct ratelimit_sampler *)s;
+    struct ratelimit_cache *cache;
+
+    // After this, no thread can be unlinking its cache under smp->lock, and
+    // the caches left on the list belong to threads which are still running.
+    htrace_tsd_destroy(&smp->tsd);
+    while ((cache = smp->caches)) {
+        smp->caches = cache->next;
+        htrace_free(cache);
+    }
+    pthread_mutex_destroy(&smp->lock);
+    htrace_free(smp->name);
+    htrace_free(smp);
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,394 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/desc.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "sampler/sampler.h"
+#include "util/alloc.h"
+#include "util/htable.h"
+#include "util/log.h"
+#include "util/rand.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file rules.c
+ *
+ * A sampler which picks a sampling fraction from the span description.
+ *
+ * The rules are a comma-separated list of prefix:fraction pairs.  A new
+ * trace is sampled with the fraction of the longest prefix which its
+ * description starts with, or with the default fraction if none does.
+ *
+ * The rules are compiled into a hash table keyed on the prefixes, along with
+ * the set of distinct prefix lengths.  Matching a description takes one
+ * lookup per distinct length, longest first.  For interned descriptions the
+ * answer is cached by description ID, so the usual cost is one array load.
+ */
+
+/**
+ * The longest prefix a rule can have.
+ */
+#define RULES_SAMPLER_MAX_PREFIX_LEN 255
+
+/**
+ * How many interned descriptions we cache the fraction of.  Descriptions with
+ * higher IDs are matched every time.
+ */
+#define RULES_SAMPLER_DESC_CACHE_SIZE 1024
+
+/**
+ * The flag in a description cache slot which says that the slot is filled
+ * in.  The low 32 bits hold the threshold.
+ */
+#define RULES_SAMPLER_CACHED (1ULL << 32)
+
+struct rules_rule {
+    /**
+     * The description prefix.  Dynamically allocated.
+     */
+    char *prefix;
+
+    /**
+     * The threshold at which we should sample spans which match.
+     */
+    uint32_t threshold;
+};
+
+struct rules_sampler {
+    struct htrace_sampler base;
+
+    /**
+     * A random source.
+     */
+    struct random_src *rnd;
+
+    /**
+     * The name of this sampler.
+     */
+    char *name;
+
+    /**
+     * The rules.
+     */
+    struct rules_rule *rules;
+
+    /**
+     * The number of rules.
+     */
+    int num_rules;
+
+    /**
+     * Maps prefix strings to rules.
+     */
+    struct htable *table;
+
+    /**
+     * The distinct prefix lengths, longest first.
+     */
+    uint32_t *lens;
+
+    /**
+     * The number of distinct prefix lengths.
+     */
+    int num_lens;
+
+    /**
+     * The threshold for spans which match no rule.
+     */
+    uint32_t default_threshold;
+
+    /**
+     * The cached thresholds of interned descriptions, indexed by
+     * description ID.  See RULES_SAMPLER_CACHED.
+     */
+    uint64_t desc_cache[RULES_SAMPLER_DESC_CACHE_SIZE];
+};
+
+static struct htrace_sampler *rules_sampler_create(struct htracer *tracer,
+                                          const struct htrace_conf *conf);
+static const char *rules_sampler_to_str(struct htrace_sampler *s);
+static int rules_sampler_next(struct htrace_sampler *s);
+static int rules_sampler_next_desc(struct htrace_sampler *s,
+                        const char *desc, size_t desc_len,
+                        const struct htrace_desc *idesc);
+static void rules_sampler_free(struct htrace_sampler *s);
+
+const struct htrace_sampler_ty g_rules_sampler_ty = {
+    "rules",
+    rules_sampler_create,
+    rules_sampler_to_str,
+    rules_sampler_next,
+    NULL,
+    rules_sampler_next_desc,
+    rules_sampler_free,
+    NULL,
+};
+
+/**
+ * Parse a sampling fraction.
+ *
+ * @return              1 on success; 0 if the string was not a number
+ *                          between 0 and 1.
+ */
+static int rules_parse_fraction(const char *str, uint32_t *threshold)
+{
+    char *endptr = NULL;
+    double fraction;
+
+    errno = 0;
+    fraction = strtod(str, &endptr);
+    if (errno || (endptr == str) || (*endptr != '\0') ||
+            (fraction < 0) || (fraction > 1.0)) {
+        return 0;
+    }
+    *threshold = 0xffffffffLU * fraction;
+    return 1;
+}
+
+/**
+ * Add a prefix length to the sorted list of distinct lengths, if it isn't
+ * there already.
+ */
+static void rules_add_len(struct rules_sampler *smp, uint32_t len)
+{
+    int i, j;
+
+    for (i = 0; i < smp->num_lens; i++) {
+        if (smp->lens[i] == len) {
+            return;
+        }
+        if (smp->lens[i] < len) {
+            break;
+        }
+    }
+    for (j = smp->num_lens; j > i; j--) {
+        smp->lens[j] = smp->lens[j - 1];
+    }
+    smp->lens[i] = len;
+    smp->num_lens++;
+}
+
+/**
+ * Compile the rules string.
+ *
+ * @return              0 on success; ENOMEM on OOM.  Rules which can't be
+ *                          parsed are logged and skipped.
+ */
+static int rules_compile(struct rules_sampler *smp, struct htrace_log *lg,
+                         const char *str)
+{
+    char *cstr, *tok, *saveptr = NULL, *colon;
+    struct rules_rule *rule;
+    uint32_t threshold;
+    int max_rules = 1;
+    size_t len;
+    const char *c;
+
+    for (c = str; *c; c++) {
+        if (*c == ',') {
+            max_rules++;
+        }
+    }
+    smp->rules = htrace_calloc(max_rules, sizeof(smp->rules[0]));
+    smp->lens = htrace_calloc(max_rules, sizeof(smp->lens[0]));
+    smp->table = htable_alloc(max_rules * 2, ht_hash_string,
+                              ht_compare_string);
+    cstr = htrace_strdup(str);
+    if ((!smp->rules) || (!smp->lens) || (!smp->table) || (!cstr)) {
+        htrace_free(cstr);
+        return ENOMEM;
+    }
+    for (tok = strtok_r(cstr, ",", &saveptr); tok;
+             tok = strtok_r(NULL, ",", &saveptr)) {
+        colon = strrchr(tok, ':');
+        if ((!colon) || (!rules_parse_fraction(colon + 1, &threshold))) {
+            htrace_log(lg, "rules_sampler_create: ignoring rule '%s'.  "
+                       "Rules must be of the form prefix:fraction, with a "
+                       "fraction between 0 and 1.\n", tok);
+            continue;
+        }
+        *colon = '\0';
+        len = strlen(tok);
+        if (len == 0) {
+            smp->default_threshold = threshold;
+            continue;
+        }
+        if (len > RULES_SAMPLER_MAX_PREFIX_LEN) {
+            htrace_log(lg, "rules_sampler_create: ignoring rule for '%s'.  "
+                       "Prefixes can be at most %d characters long.\n",
+                       tok, RULES_SAMPLER_MAX_PREFIX_LEN);
+            continue;
+        }
+        rule = htable_get(smp->table, tok);
+        if (rule) {
+            // A later rule for the same prefix overrides an earlier one.
+            rule->threshold = threshold;
+            continue;
+        }
+        rule = &smp->rules[smp->num_rules];
+        rule->prefix = htrace_strdup(tok);
+        if (!rule->prefix) {
+            htrace_free(cstr);
+            return ENOMEM;
+        }
+        rule->threshold = threshold;
+        if (htable_put(smp->table, rule->prefix, rule)) {
+            htrace_free(rule->prefix);
+            htrace_free(cstr);
+            return ENOMEM;
+        }
+        smp->num_rules++;
+        rules_add_len(smp, len);
+    }
+    htrace_free(cstr);
+    return 0;
+}
+
+static struct htrace_sampler *rules_sampler_create(struct htracer *tracer,
+                                          const struct htrace_conf *conf)
+{
+    struct rules_sampler *smp;
+    const char *rules;
+    double fraction;
+
+    smp = htrace_calloc(1, sizeof(*smp));
+    if (!smp) {
+        htrace_log(tracer->lg, "rules_sampler_create: OOM\n");
+        return NULL;
+    }
+    smp->base.ty = &g_rules_sampler_ty;
+    smp->rnd = random_src_alloc(tracer->lg);
+    if (!smp->rnd) {
+        htrace_log(tracer->lg, "random_src_alloc failed.\n");
+        htrace_free(smp);
+        return NULL;
+    }
+    fraction = htrace_conf_get_double(tracer->lg, conf,
+                    HTRACE_RULES_SAMPLER_DEFAULT_FRACTION_KEY);
+    if ((fraction < 0) || (fraction > 1.0)) {
+        htrace_log(tracer->lg, "rules_sampler_create: %s must be between 0 "
+                   "and 1.  Using 0.\n",
+                   HTRACE_RULES_SAMPLER_DEFAULT_FRACTION_KEY);
+        fraction = 0;
+    }
+    smp->default_threshold = 0xffffffffLU * fraction;
+    rules = htrace_conf_get(conf, HTRACE_RULES_SAMPLER_RULES_KEY);
+    if (rules_compile(smp, tracer->lg, rules ? rules : "")) {
+        htrace_log(tracer->lg, "rules_sampler_create: OOM\n");
+        rules_sampler_free((struct htrace_sampler *)smp);
+        return NULL;
+    }
+    if (htrace_asprintf(&smp->name,
+                        "RulesSampler(rules=%d, default_fraction=%.03g)",
+                        smp->num_rules,
+                        smp->default_threshold / (double)0xffffffffLU) < 0) {
+        smp->name = NULL;
+        rules_sampler_free((struct htrace_sampler *)smp);
+        return NULL;
+    }
+    return (struct htrace_sampler *)smp;
+}
+
+static const char *rules_sampler_to_str(struct htrace_sampler *s)
+{
+    struct rules_sampler *smp = (struct rules_sampler *)s;
+    return smp->name;
+}
+
+/**
+ * Find the threshold for a description by matching it against the rules.
+ */
+static uint32_t rules_match(struct rules_sampler *smp, const char *desc,
+                            size_t desc_len)
+{
+    char buf[RULES_SAMPLER_MAX_PREFIX_LEN + 1];
+    struct rules_rule *rule;
+    uint32_t len;
+    int i;
+
+    for (i = 0; i < smp->num_lens; i++) {
+        len = smp->lens[i];
+        if (len > desc_len) {
+            continue;
+        }
+        memcpy(buf, desc, len);
+        buf[len] = '\0';
+        rule = htable_get(smp->table, buf);
+        if (rule) {
+            return rule->threshold;
+        }
+    }
+    return smp->default_threshold;
+}
+
+static int rules_sampler_next(struct htrace_sampler *s)
+{
+    struct rules_sampler *smp = (struct rules_sampler *)s;
+    return random_u32(smp->rnd) < smp->default_threshold;
+}
+
+static int rules_sampler_next_desc(struct htrace_sampler *s,
+                        const char *desc, size_t desc_len,
+                        const struct htrace_desc *idesc)
+{
+    struct rules_sampler *smp = (struct rules_sampler *)s;
+    uint32_t threshold;
+    uint64_t slot;
+
+    if (idesc && (idesc->id < RULES_SAMPLER_DESC_CACHE_SIZE)) {
+        slot = __atomic_load_n(&smp->desc_cache[idesc->id],
+                               __ATOMIC_RELAXED);
+        if (slot & RULES_SAMPLER_CACHED) {
+            threshold = (uint32_t)slot;
+        } else {
+            threshold = rules_match(smp, idesc->str, idesc->len);
+            __atomic_store_n(&smp->desc_cache[idesc->id],
+                             RULES_SAMPLER_CACHED | threshold,
+                             __ATOMIC_RELAXED);
+        }
+    } else {
+        threshold = rules_match(smp, desc, desc_len);
+    }
+    return random_u32(smp->rnd) < threshold;
+}
+
+static void rules_sampler_free(struct htrace_sampler *s)
+{
+    struct rules_sampler *smp = (struct rules_sampler *)s;
+    int i;
+
+    for (i = 0; i < smp->num_rules; i++) {
+        htrace_free(smp->rules[i].prefix);
+    }
+    htrace_free(smp->rules);
+    htrace_free(smp->lens);
+    htable_free(smp->table);
+    random_src_free(smp->rnd);
+    htrace_free(smp->name);
+    htrace_free(smp);
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -20,18 +20,26 @@
 #include "core/htrace.h"
 #include "core/htracer.h"
 #include "sampler/sampler.h"
+#include "util/alloc.h"
 #include "util/log.h"
 
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+int htrace_g_enabled;
+
 const struct htrace_sampler_ty * const g_sampler_tys[] = {
     &g_never_sampler_ty,
     &g_always_sampler_ty,
     &g_prob_sampler_ty,
+    &g_ratelimit_sampler_ty,
+    &g_adaptive_sampler_ty,
+    &g_hash_sampler_ty,
+    &g_rules_sampler_ty,
     NULL,
 };
 
@@ -70,9 +78,77 @@ struct htrace_sampler *htrace_sampler_create(struct htracer *tracer,
                                              struct htrace_conf *cnf)
 {
     const struct htrace_sampler_ty *ty;
+    struct htrace_sampler *smp;
 
     ty = select_sampler_ty(tracer, cnf);
-    return ty->create(tracer, cnf);
+    smp = ty->create(tracer, cnf);
+    if (smp && (ty != &g_never_sampler_ty)) {
+        __atomic_store_n(&htrace_g_enabled, 1, __ATOMIC_RELAXED);
+    }
+    if (smp && ty->update_conf) {
+        smp->tracer = tracer;
+        pthread_mutex_lock(&tracer->smp_lock);
+        smp->next = tracer->samplers;
+        tracer->samplers = smp;
+        pthread_mutex_unlock(&tracer->smp_lock);
+    }
+    return smp;
+}
+
+void htrace_sampler_replace_str(struct htrace_sampler *smp, char **str,
+                                char *nstr)
+{
+    char **old_strs;
+
+    old_strs = htrace_realloc(smp->old_strs,
+                        (smp->num_old_strs + 1) * sizeof(smp->old_strs[0]));
+    if (!old_strs) {
+        // We can't free the old string while someone may be using it, and we
+        // have nowhere to keep the new one.  Keep the old one.
+        htrace_log(smp->tracer->lg, "htrace_sampler_replace_str: OOM.\n");
+        htrace_free(nstr);
+        return;
+    }
+    old_strs[smp->num_old_strs++] = *str;
+    smp->old_strs = old_strs;
+    __atomic_store_n(str, nstr, __ATOMIC_RELEASE);
+}
+
+void htrace_samplers_update_conf(struct htracer *tracer,
+                                 const struct htrace_conf *conf)
+{
+    const struct htrace_sampler_ty *ty = NULL;
+    struct htrace_sampler *smp;
+    const char *tstr;
+    size_t i;
+
+    tstr = htrace_conf_get(conf, HTRACE_SAMPLER_KEY);
+    for (i = 0; tstr && g_sampler_tys[i]; i++) {
+        if (strcmp(g_sampler_tys[i]->name, tstr) == 0) {
+            ty = g_sampler_tys[i];
+        }
+    }
+    pthread_mutex_lock(&tracer->smp_lock);
+    for (smp = tracer->samplers; smp; smp = smp->next) {
+        if (smp->ty != ty) {
+            htrace_log(tracer->lg, "htrace_samplers_update_conf: can't "
+                       "change the type of sampler %s to %s without "
+                       "creating a new sampler.\n", smp->ty->to_str(smp),
+                       (tstr ? tstr : "(none)"));
+            continue;
+        }
+        smp->ty->update_conf(smp, conf);
+    }
+    pthread_mutex_unlock(&tracer->smp_lock);
+}
+
+int htrace_sampler_next_trace(struct htrace_sampler *smp,
+                              const struct htrace_span_id *id)
+{
+    if (smp->ty->next_trace) {
+        return smp->ty->next_trace(smp, id->high);
+    }
+    return smp->ty->next(smp);
 }
 
 const char *htrace_sampler_to_str(struct htrace_sampler *smp)
@@ -82,7 +158,23 @@ const char *htrace_sampler_to_str(struct htrace_sampler *smp)
 
 void htrace_sampler_free(struct htrace_sampler *smp)
 {
-    return smp->ty->free(smp);
+    struct htrace_sampler **prev;
+    int i;
+
+    if (smp->tracer) {
+        pthread_mutex_lock(&smp->tracer->smp_lock);
+        for (prev = &smp->tracer->samplers; *prev != smp;
+                prev = &(*prev)->next) {
+            ;
+        }
+        *prev = smp->next;
+        pthread_mutex_unlock(&smp->tracer->smp_lock);
+    }
+    for (i = 0; i < smp->num_old_strs; i++) {
+        htrace_free(smp->old_strs[i]);
+    }
+    htrace_free(smp->old_strs);
+    smp->ty->free(smp);
 }
 
 // vim: ts=4:sw=4:tw=79:et
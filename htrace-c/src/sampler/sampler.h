@@ -27,9 +27,11 @@
  * This is an internal header, not intended for external use.
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 struct htrace_conf;
+struct htrace_desc;
 struct htrace_log;
 struct htracer;
 
@@ -43,6 +45,25 @@ struct htrace_sampler {
      * The type of the sampler.
      */
     const struct htrace_sampler_ty *ty;
+
+    /**
+     * The HTrace context this sampler was created for.  Only set for samplers
+     * whose type has an update_conf callback.
+     */
+    struct htracer *tracer;
+
+    /**
+     * The next sampler on the tracer's list of samplers to update.  Protected
+     * by the tracer's smp_lock.
+     */
+    struct htrace_sampler *next;
+
+    /**
+     * Strings which to_str used to return, before the configuration was
+     * updated.  They are kept until the sampler is freed.
+     */
+    char **old_strs;
+    int num_old_strs;
 };
 
 /**
@@ -92,12 +113,63 @@ struct htrace_sampler_ty {
      */
     int (*next)(struct htrace_sampler *smp);
 
+    /**
+     * Sampler callback for a trace whose ID is already known.  May be NULL,
+     * in which case next is used instead.
+     *
+     * Samplers which set this decide from the trace ID alone, so that every
+     * process seeing the same trace makes the same decision.  When this is
+     * set, new traces get their trace ID before the sampler is consulted.
+     *
+     * This callback must be able to be safely called by multiple threads
+     * simultaneously.
+     *
+     * @param smp           The HTrace sampler.
+     * @param trace_id      The trace ID: the upper 64 bits of the span IDs
+     *                          in the trace.
+     *
+     * @return              1 to begin a new span; 0 otherwise.
+     */
+    int (*next_trace)(struct htrace_sampler *smp, uint64_t trace_id);
+
+    /**
+     * Sampler callback which is given the description of the span.  May be
+     * NULL, in which case next_trace or next is used instead.
+     *
+     * This callback must be able to be safely called by multiple threads
+     * simultaneously.
+     *
+     * @param smp           The HTrace sampler.
+     * @param desc          The description of the span to start.  This
+     *                          need not be NUL-terminated.
+     * @param desc_len      The length of desc in bytes.
+     * @param idesc         The interned description, or NULL if the
+     *                          description is not interned.
+     *
+     * @return              1 to begin a new span; 0 otherwise.
+     */
+    int (*next_desc)(struct htrace_sampler *smp, const char *desc,
+                     size_t desc_len, const struct htrace_desc *idesc);
+
     /**
      * Frees this HTrace sampler.
      *
      * @param rcv           The HTrace sampler.
      */
     void (*free)(struct htrace_sampler *smp);
+
+    /**
+     * Apply a new configuration to this HTrace sampler.  May be NULL, in
+     * which case the sampler keeps the configuration it was created with.
+     *
+     * This may be called while other threads are using the sampler.
+     *
+     * @param smp           The HTrace sampler.
+     * @param conf          The new HTrace configuration.  The sampler must
+     *                          not hold on to this pointer.
+     */
+    void (*update_conf)(struct htrace_sampler *smp,
+                        const struct htrace_conf *conf);
 };
 
 /**
@@ -111,9 +183,38 @@ struct htrace_sampler_ty {
 double get_prob_sampler_fraction(struct htrace_log *lg,
                                  struct htrace_conf *conf);
 
+/**
+ * Replace the string which a sampler's to_str callback returns.
+ *
+ * The old string is kept until the sampler is freed, since callers may still
+ * be using it.
+ *
+ * @param smp           The sampler.
+ * @param str           The location of the string which to_str returns.
+ *                          This is read with acquire semantics by to_str.
+ * @param nstr          The new string, allocated with htrace_malloc.  We
+ *                          take ownership of it.
+ */
+void htrace_sampler_replace_str(struct htrace_sampler *smp, char **str,
+                                char *nstr);
+
+/**
+ * Apply a new configuration to all of the samplers of a tracer which can be
+ * updated.
+ *
+ * @param tracer        The HTrace context.
+ * @param conf          The new configuration.
+ */
+void htrace_samplers_update_conf(struct htracer *tracer,
+                                 const struct htrace_conf *conf);
+
 extern const struct htrace_sampler_ty g_never_sampler_ty;
 extern const struct htrace_sampler_ty g_always_sampler_ty;
 extern const struct htrace_sampler_ty g_prob_sampler_ty;
+extern const struct htrace_sampler_ty g_ratelimit_sampler_ty;
+extern const struct htrace_sampler_ty g_adaptive_sampler_ty;
+extern const struct htrace_sampler_ty g_hash_sampler_ty;
+extern const struct htrace_sampler_ty g_rules_sampler_ty;
 extern const struct always_sampler g_always_sampler;
 
 #endif
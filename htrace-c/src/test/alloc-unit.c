@@ -0,0 +1,244 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "receiver/receiver.h"
+#include "test/fake_hrpc.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+#include "util/alloc.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ALLOC_TEST_MAGIC 0x68747261636561ULL
+
+#define ALLOC_TEST_SPANS 1000
+
+/**
+ * The header which the test allocator puts in front of each allocation, so
+ * that it can tell whether the library frees memory it didn't allocate.
+ */
+struct alloc_test_hdr {
+    uint64_t magic;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t pad;
+};
+
+struct alloc_test_ctrs {
+    uint64_t allocs;
+    uint64_t aligned;
+    uint64_t frees;
+    uint64_t bad_frees;
+};
+
+static struct alloc_test_ctrs g_ctrs;
+
+static void *alloc_test_aligned(size_t align, size_t size, void *ctx)
+{
+    struct alloc_test_ctrs *ctrs = ctx;
+    struct alloc_test_hdr *hdr;
+    uintptr_t raw, ptr;
+
+    raw = (uintptr_t)malloc(size + align + sizeof(*hdr));
+    if (!raw) {
+        return NULL;
+    }
+    ptr = (raw + sizeof(*hdr) + align - 1) & ~((uintptr_t)align - 1);
+    hdr = (struct alloc_test_hdr *)(ptr - sizeof(*hdr));
+    hdr->magic = ALLOC_TEST_MAGIC;
+    hdr->offset = ptr - raw;
+    hdr->size = size;
+    __atomic_fetch_add(&ctrs->allocs, 1, __ATOMIC_RELAXED);
+    return (void *)ptr;
+}
+
+static void *alloc_test_malloc(size_t size, void *ctx)
+{
+    return alloc_test_aligned(sizeof(struct alloc_test_hdr), size, ctx);
+}
+
+static void alloc_test_free(void *ptr, void *ctx)
+{
+    struct alloc_test_ctrs *ctrs = ctx;
+    struct alloc_test_hdr *hdr;
+
+    if (!ptr) {
+        return;
+    }
+    hdr = (struct alloc_test_hdr *)ptr - 1;
+    if (hdr->magic != ALLOC_TEST_MAGIC) {
+        __atomic_fetch_add(&ctrs->bad_frees, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    hdr->magic = 0;
+    __atomic_fetch_add(&ctrs->frees, 1, __ATOMIC_RELAXED);
+    free((char *)ptr - hdr->offset);
+}
+
+static void *alloc_test_realloc(void *ptr, size_t size, void *ctx)
+{
+    struct alloc_test_hdr *hdr;
+    void *nptr;
+
+    nptr = alloc_test_malloc(size, ctx);
+    if ((!nptr) || (!ptr)) {
+        return nptr;
+    }
+    hdr = (struct alloc_test_hdr *)ptr - 1;
+    memcpy(nptr, ptr, (hdr->size < size) ? hdr->size : size);
+    alloc_test_free(ptr, ctx);
+    return nptr;
+}
+
+static void *alloc_test_aligned_counted(size_t align, size_t size, void *ctx)
+{
+    struct alloc_test_ctrs *ctrs = ctx;
+
+    __atomic_fetch_add(&ctrs->aligned, 1, __ATOMIC_RELAXED);
+    return alloc_test_aligned(align, size, ctx);
+}
+
+/**
+ * Create a tracer with the given configuration, send some spans through it,
+ * and free everything again.
+ *
+ * This runs in its own thread, since the per-thread object pools are only
+ * freed when the thread which filled them exits.  Without
+ * HAVE_IMPROVED_TLS, the thread's random generator is freed by a
+ * pthread key destructor too.  This test only catches a destructor which
+ * hands our memory to libc free in such builds.
+ */
+static void *alloc_test_run_thread(void *data)
+{
+    const char *conf_str = data;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    int i;
+
+    cnf = htrace_conf_from_str(conf_str);
+    tracer = htracer_create("alloc-unit", cnf);
+    smp = htrace_sampler_create(tracer, cnf);
+    if ((!cnf) || (!tracer) || (!smp)) {
+        return (void *)"failed to create the tracer";
+    }
+    for (i = 0; i < ALLOC_TEST_SPANS; i++) {
+        struct htrace_scope *scope = htrace_start_span(tracer, smp, "outer");
+        htrace_scope_add_kv(scope, "i", "value");
+        htrace_scope_close(htrace_start_span(tracer, smp, "inner"));
+        htrace_scope_close(scope);
+    }
+    tracer->rcv->ty->flush(tracer->rcv);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    return NULL;
+}
+
+static int alloc_test_run(const char *conf_str)
+{
+    pthread_t thread;
+    void *ret;
+
+    EXPECT_INT_ZERO(pthread_create(&thread, NULL, alloc_test_run_thread,
+                                   (void *)conf_str));
+    EXPECT_INT_ZERO(pthread_join(thread, &ret));
+    EXPECT_NULL(ret);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Everything which the library allocated with the test allocator must have
+ * been freed with it, and nothing else.
+ */
+static int alloc_test_check(void)
+{
+    EXPECT_INT_EQ(1, (g_ctrs.allocs > 0));
+    EXPECT_UINT64_EQ(g_ctrs.allocs, g_ctrs.frees);
+    EXPECT_UINT64_EQ((uint64_t)0, g_ctrs.bad_frees);
+    return EXIT_SUCCESS;
+}
+
+static int alloc_test_local_file(void)
+{
+    char err[512], *tdir, *conf_str;
+
+    tdir = create_tempdir("alloc-unit", 0777, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s/spans.json;%s=%s",
+                HTRACE_SPAN_RECEIVER_KEY, "local.file",
+                HTRACE_LOCAL_FILE_RCV_PATH_KEY, tdir,
+                HTRACE_SAMPLER_KEY, "ratelimit"));
+    EXPECT_INT_ZERO(alloc_test_run(conf_str));
+    free(conf_str);
+    free(tdir);
+    // The rate limiting sampler is cache line aligned.
+    EXPECT_INT_EQ(1, (g_ctrs.aligned > 0));
+    return alloc_test_check();
+}
+
+static int alloc_test_htraced(void)
+{
+    struct fake_hrpc_opts opts;
+    struct fake_hrpc *fh;
+    char err[512], *conf_str;
+
+    memset(&opts, 0, sizeof(opts));
+    fake_hrpc_start(&opts, &fh, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s;%s=%s",
+                HTRACE_SPAN_RECEIVER_KEY, "htraced",
+                HTRACED_ADDRESS_KEY, fake_hrpc_get_addr(fh),
+                HTRACED_COMPRESSION_KEY, "zlib",
+                HTRACE_SAMPLER_KEY, "always"));
+    EXPECT_INT_ZERO(alloc_test_run(conf_str));
+    free(conf_str);
+    fake_hrpc_free(fh);
+    return alloc_test_check();
+}
+
+int main(void)
+{
+    struct htrace_allocator alloc;
+
+    memset(&alloc, 0, sizeof(alloc));
+    alloc.malloc_fn = alloc_test_malloc;
+    EXPECT_INT_EQ(EINVAL, htrace_set_allocator(&alloc));
+    alloc.realloc_fn = alloc_test_realloc;
+    alloc.aligned_fn = alloc_test_aligned_counted;
+    alloc.free_fn = alloc_test_free;
+    alloc.ctx = &g_ctrs;
+    EXPECT_INT_ZERO(htrace_set_allocator(&alloc));
+
+    EXPECT_INT_ZERO(alloc_test_local_file());
+    EXPECT_INT_ZERO(alloc_test_htraced());
+
+    EXPECT_INT_ZERO(htrace_set_allocator(NULL));
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -27,9 +27,26 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define NUM_TEST_SPANS 3
+#define NUM_TEST_SPANS 4
 #define TEST_BUF_LENGTH (8UL * 1024UL * 1024UL)
 
+static int add_test_span_extras(struct htrace_span *span)
+{
+    struct htrace_span_id id;
+    int i;
+
+    for (i = 1; i <= 6; i++) {
+        id.high = 0xface;
+        id.low = i;
+        EXPECT_INT_ZERO(htrace_span_add_parent(span, &id));
+    }
+    EXPECT_INT_ZERO(htrace_span_add_kv(span, "region", "us-west"));
+    EXPECT_INT_ZERO(htrace_span_add_event(span, 2003, "cache miss"));
+    EXPECT_INT_ZERO(htrace_span_add_kv(span, "attempt", "2"));
+    EXPECT_INT_ZERO(htrace_span_add_event(span, 2009, "done"));
+    return EXIT_SUCCESS;
+}
+
 static struct htrace_span **setup_test_spans(void)
 {
     struct htrace_span **spans =
@@ -52,20 +69,42 @@ static struct htrace_span **setup_test_spans(void)
     spans[1]->num_parents = 1;
     spans[1]->parent.single.high = 0xface;
     spans[1]->parent.single.low = 1;
+    spans[1]->ts_precision = HTRACE_TS_PRECISION_NS;
+    spans[1]->begin_sub_ns = 123456;
+    spans[1]->end_sub_ns = 999999;
+    spans[1]->cpu = HTRACE_SPAN_CPU_RUSAGE;
+    spans[1]->cpu_ns = 48000;
+    spans[1]->vol_csw = 3;
+    spans[1]->invol_csw = 1;
 
     spans[2] = xcalloc(sizeof(struct htrace_span));
     spans[2]->desc = xstrdup("ThirdSpan");
     spans[2]->begin_ms = 1969;
     spans[2]->end_ms = 1997;
+    spans[2]->ts_precision = HTRACE_TS_PRECISION_US;
+    spans[2]->begin_sub_ns = 7000;
+    spans[2]->cpu = HTRACE_SPAN_CPU_TIME;
+    spans[2]->cpu_ns = 1234567;
     spans[1]->span_id.high = 0xface;
     spans[1]->span_id.low = 0xcfcfcfcfcfcfcfcfULL;
     spans[2]->trid = xstrdup("ThirdSpanProc");
     spans[2]->num_parents = 2;
-    spans[2]->parent.list = xcalloc(sizeof(struct htrace_span_id) * 2);
-    spans[2]->parent.list[0].high = 0xface;
-    spans[2]->parent.list[0].low = 1;
-    spans[2]->parent.list[1].high = 0xface;
-    spans[2]->parent.list[1].low = 2;
+    spans[2]->parent.inl[0].high = 0xface;
+    spans[2]->parent.inl[0].low = 1;
+    spans[2]->parent.inl[1].high = 0xface;
+    spans[2]->parent.inl[1].low = 2;
+
+    // A span with annotations, events, and parents which aren't inline.
+    spans[3] = xcalloc(sizeof(struct htrace_span));
+    spans[3]->desc = xstrdup("FourthSpan");
+    spans[3]->begin_ms = 2001;
+    spans[3]->end_ms = 2010;
+    spans[3]->span_id.high = 0xface;
+    spans[3]->span_id.low = 4;
+    spans[3]->trid = xstrdup("FourthSpanProc");
+    if (add_test_span_extras(spans[3])) {
+        return NULL;
+    }
 
     return spans;
 }
@@ -111,6 +150,66 @@ static int test_serialize_spans(struct htrace_span **test_spans)
     return EXIT_SUCCESS;
 }
 
+static int test_skip_spans(struct htrace_span **test_spans)
+{
+    int i;
+    struct cmp_bcopy_ctx bctx;
+    uint64_t ends[NUM_TEST_SPANS], len;
+    char *buf;
+
+    buf = xcalloc(TEST_BUF_LENGTH);
+    cmp_bcopy_ctx_init(&bctx, buf, TEST_BUF_LENGTH);
+    for (i = 0; i < NUM_TEST_SPANS; i++) {
+        EXPECT_INT_EQ(1, span_write_msgpack(test_spans[i],
+                                            (cmp_ctx_t *)&bctx));
+        ends[i] = bctx.off;
+    }
+    len = bctx.off;
+
+    // Skipping each span should land exactly on the start of the next.
+    cmp_bcopy_ctx_init(&bctx, buf, len);
+    for (i = 0; i < NUM_TEST_SPANS; i++) {
+        EXPECT_INT_EQ(1, cmp_bcopy_skip_object(&bctx));
+        EXPECT_UINT64_EQ(ends[i], bctx.off);
+    }
+    EXPECT_INT_ZERO(cmp_bcopy_skip_object(&bctx));
+
+    // A truncated span can't be skipped.
+    cmp_bcopy_ctx_init(&bctx, buf, ends[0] - 1);
+    EXPECT_INT_ZERO(cmp_bcopy_skip_object(&bctx));
+
+    free(buf);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Test that span_msgpack_encode writes the same bytes as span_write_msgpack,
+ * and that span_msgpack_size predicts how many.
+ */
+static int test_direct_encoder(struct htrace_span **test_spans)
+{
+    int i;
+    struct cmp_bcopy_ctx bctx;
+    uint8_t *buf;
+    uint64_t len;
+
+    buf = xcalloc(TEST_BUF_LENGTH);
+    for (i = 0; i < NUM_TEST_SPANS; i++) {
+        cmp_bcopy_ctx_init(&bctx, buf, TEST_BUF_LENGTH);
+        EXPECT_INT_EQ(1, span_write_msgpack(test_spans[i],
+                                            (cmp_ctx_t *)&bctx));
+        EXPECT_UINT64_EQ(bctx.off, span_msgpack_size(test_spans[i]));
+        memset(buf + bctx.off, 0xff, bctx.off + 1);
+        len = span_msgpack_encode(test_spans[i], buf + bctx.off);
+        EXPECT_UINT64_EQ(bctx.off, len);
+        EXPECT_INT_ZERO(memcmp(buf, buf + len, len));
+        // Nothing was written past the end.
+        EXPECT_INT_EQ(0xff, buf[2 * len]);
+    }
+    free(buf);
+    return EXIT_SUCCESS;
+}
+
 int main(void)
 {
     int i;
@@ -119,6 +218,8 @@ int main(void)
     test_spans = setup_test_spans();
     EXPECT_NONNULL(test_spans);
     EXPECT_INT_ZERO(test_serialize_spans(test_spans));
+    EXPECT_INT_ZERO(test_skip_spans(test_spans));
+    EXPECT_INT_ZERO(test_direct_encoder(test_spans));
     for (i = 0; i < NUM_TEST_SPANS; i++) {
         htrace_span_free(test_spans[i]);
     }
@@ -102,10 +102,88 @@ static int test_double_conf(void)
     return EXIT_SUCCESS;
 }
 
+static int test_bool_conf(void)
+{
+    struct htrace_conf *conf;
+    struct htrace_log *lg;
+
+    conf = htrace_conf_from_strs("yes=true;no=FALSE;bare;bozo=maybe",
+                                 "bozo=true;dflt=true");
+    EXPECT_NONNULL(conf);
+    lg = htrace_log_alloc(conf);
+    EXPECT_INT_EQ(1, htrace_conf_get_bool(lg, conf, "yes"));
+    EXPECT_INT_EQ(0, htrace_conf_get_bool(lg, conf, "no"));
+    EXPECT_INT_EQ(1, htrace_conf_get_bool(lg, conf, "bare"));
+    // 'bozo' should fall back on the default, since the configured value
+    // cannot be parsed.
+    EXPECT_INT_EQ(1, htrace_conf_get_bool(lg, conf, "bozo"));
+    EXPECT_INT_EQ(1, htrace_conf_get_bool(lg, conf, "dflt"));
+    EXPECT_INT_EQ(0, htrace_conf_get_bool(lg, conf, "unknown"));
+
+    htrace_log_free(lg);
+    htrace_conf_free(conf);
+    return EXIT_SUCCESS;
+}
+
+static int test_typed_conf(void)
+{
+    struct htrace_conf *conf;
+    struct htrace_log *lg;
+    int i;
+
+    conf = htrace_conf_from_strs("num=42;num=43;bare;bad.dflt=7",
+                                 "num=1;bad.dflt=xyz;only.dflt=false");
+    EXPECT_NONNULL(conf);
+    lg = htrace_log_alloc(conf);
+    // Reading a key several times, as different types, gives the same
+    // answers each time.
+    for (i = 0; i < 3; i++) {
+        EXPECT_STR_EQ("42", htrace_conf_get(conf, "num"));
+        EXPECT_UINT64_EQ((uint64_t)42, htrace_conf_get_u64(lg, conf, "num"));
+        EXPECT_INT_EQ(42, (int)htrace_conf_get_double(lg, conf, "num"));
+        EXPECT_INT_EQ(0, htrace_conf_get_bool(lg, conf, "num"));
+        EXPECT_INT_EQ(1, htrace_conf_get_bool(lg, conf, "bare"));
+        EXPECT_UINT64_EQ((uint64_t)0, htrace_conf_get_u64(lg, conf, "bare"));
+        EXPECT_UINT64_EQ((uint64_t)7,
+                         htrace_conf_get_u64(lg, conf, "bad.dflt"));
+        EXPECT_STR_EQ("false", htrace_conf_get(conf, "only.dflt"));
+        EXPECT_INT_EQ(0, htrace_conf_get_bool(lg, conf, "only.dflt"));
+    }
+
+    htrace_log_free(lg);
+    htrace_conf_free(conf);
+    return EXIT_SUCCESS;
+}
+
+static int test_copy_conf(void)
+{
+    struct htrace_conf *conf, *copy;
+    struct htrace_log *lg;
+
+    conf = htrace_conf_from_strs("num=42;bare;str=abc", "num=1;dflt=7");
+    EXPECT_NONNULL(conf);
+    copy = htrace_conf_copy(conf);
+    EXPECT_NONNULL(copy);
+    htrace_conf_free(conf);
+    lg = htrace_log_alloc(copy);
+    EXPECT_UINT64_EQ((uint64_t)42, htrace_conf_get_u64(lg, copy, "num"));
+    EXPECT_INT_EQ(1, htrace_conf_get_bool(lg, copy, "bare"));
+    EXPECT_STR_EQ("abc", htrace_conf_get(copy, "str"));
+    EXPECT_UINT64_EQ((uint64_t)7, htrace_conf_get_u64(lg, copy, "dflt"));
+    EXPECT_NULL(htrace_conf_get(copy, "unknown"));
+
+    htrace_log_free(lg);
+    htrace_conf_free(copy);
+    return EXIT_SUCCESS;
+}
+
 int main(void)
 {
     test_simple_conf();
     test_double_conf();
+    test_bool_conf();
+    EXPECT_INT_ZERO(test_typed_conf());
+    EXPECT_INT_ZERO(test_copy_conf());
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,806 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "receiver/hrpc.h"
+#include "receiver/receiver.h"
+#include "test/fake_hrpc.h"
+#include "test/test.h"
+#include "util/cmp_util.h"
+#include "util/log.h"
+#include "util/time.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define FAKE_HRPC_TEST_SPANS 20
+
+#define FAKE_HRPC_TEST_ROUNDS 4
+
+#define FAKE_HRPC_TEST_MAX_THREADS 16
+
+/**
+ * Retry quickly, so that the tests which inject faults don't take long.
+ */
+#define FAKE_HRPC_TEST_CONF \
+    HTRACE_SAMPLER_KEY "=always;" \
+    HTRACED_RETRY_BACKOFF_MIN_MS_KEY "=1;" \
+    HTRACED_RETRY_BACKOFF_MAX_MS_KEY "=10"
+
+struct fake_hrpc_test_methods {
+    pthread_mutex_t lock;
+    uint64_t write_spans;
+    uint64_t other;
+};
+
+static void fake_hrpc_test_count(void *data, uint32_t method_id,
+                                 const void *body, size_t len)
+{
+    struct fake_hrpc_test_methods *ms = data;
+
+    pthread_mutex_lock(&ms->lock);
+    if ((method_id == METHOD_ID_WRITE_SPANS) && (len > 0)) {
+        ms->write_spans++;
+    } else {
+        ms->other++;
+    }
+    pthread_mutex_unlock(&ms->lock);
+}
+
+struct fake_hrpc_test_thread {
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+};
+
+static void *fake_hrpc_test_thread_run(void *data)
+{
+    struct fake_hrpc_test_thread *ft = data;
+    int i;
+
+    for (i = 0; i < FAKE_HRPC_TEST_SPANS; i++) {
+        htrace_scope_close(htrace_start_span(ft->tracer, ft->smp,
+                                             "fake_hrpc"));
+    }
+    return NULL;
+}
+
+/**
+ * Send FAKE_HRPC_TEST_ROUNDS rounds of spans to the fake HRPC server,
+ * flushing after each round, and get the receiver's statistics.  Each round
+ * is sent by num_threads threads at once, or by the calling thread if
+ * num_threads is 0.
+ */
+static int fake_hrpc_test_send(struct fake_hrpc *fh, const char *extra_conf,
+                               int num_threads, struct htrace_stats *stats)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct fake_hrpc_test_thread ft;
+    pthread_t threads[FAKE_HRPC_TEST_MAX_THREADS];
+    char *conf_str;
+    int i, j;
+
+    EXPECT_INT_EQ(1, (num_threads <= FAKE_HRPC_TEST_MAX_THREADS));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s;%s",
+                HTRACE_SPAN_RECEIVER_KEY, "htraced",
+                HTRACED_ADDRESS_KEY, fake_hrpc_get_addr(fh),
+                extra_conf, FAKE_HRPC_TEST_CONF));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("fake_hrpc-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    ft.tracer = tracer;
+    ft.smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(ft.smp);
+    for (i = 0; i < FAKE_HRPC_TEST_ROUNDS; i++) {
+        if (!num_threads) {
+            fake_hrpc_test_thread_run(&ft);
+        }
+        for (j = 0; j < num_threads; j++) {
+            EXPECT_INT_ZERO(pthread_create(&threads[j], NULL,
+                                           fake_hrpc_test_thread_run, &ft));
+        }
+        for (j = 0; j < num_threads; j++) {
+            EXPECT_INT_ZERO(pthread_join(threads[j], NULL));
+        }
+        tracer->rcv->ty->flush(tracer->rcv);
+    }
+    htracer_get_stats(tracer, stats);
+    htrace_sampler_free(ft.smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(conf_str);
+    return EXIT_SUCCESS;
+}
+
+static int fake_hrpc_start_test(const struct fake_hrpc_opts *opts,
+                                struct fake_hrpc **fh)
+{
+    char err[512];
+
+    *fh = NULL;
+    fake_hrpc_start(opts, fh, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    EXPECT_NONNULL(*fh);
+    return EXIT_SUCCESS;
+}
+
+static int fake_hrpc_basic_test(void)
+{
+    struct fake_hrpc_opts opts;
+    struct fake_hrpc_test_methods ms;
+    struct fake_hrpc_stats fstats;
+    struct htrace_stats stats;
+    struct fake_hrpc *fh;
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&ms, 0, sizeof(ms));
+    pthread_mutex_init(&ms.lock, NULL);
+    EXPECT_INT_ZERO(fake_hrpc_start_test(&opts, &fh));
+    fake_hrpc_set_req_fn(fh, fake_hrpc_test_count, &ms);
+    EXPECT_INT_ZERO(fake_hrpc_test_send(fh, "", 0, &stats));
+    fake_hrpc_get_stats(fh, &fstats);
+    fake_hrpc_free(fh);
+
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_xmit);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.rpc_errors);
+    EXPECT_INT_EQ(1, (stats.rpcs >= FAKE_HRPC_TEST_ROUNDS));
+    EXPECT_UINT64_EQ(stats.rpcs, fstats.reqs);
+    EXPECT_UINT64_EQ(stats.rpcs, ms.write_spans);
+    EXPECT_UINT64_EQ((uint64_t)0, ms.other);
+    EXPECT_UINT64_EQ((uint64_t)1, fstats.conns);
+    EXPECT_UINT64_EQ((uint64_t)0, fstats.errors);
+    EXPECT_UINT64_EQ((uint64_t)0, fstats.bad_reqs);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.self_start_span_ns);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.self_scope_close_ns);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.self_add_span_ns);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.self_xmit_wait_ns);
+    pthread_mutex_destroy(&ms.lock);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * If the server returns an error every time, the spans are dropped after
+ * the last try.
+ */
+static int fake_hrpc_error_test(void)
+{
+    struct fake_hrpc_opts opts;
+    struct fake_hrpc_stats fstats;
+    struct htrace_stats stats;
+    struct fake_hrpc *fh;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.error_every = 1;
+    EXPECT_INT_ZERO(fake_hrpc_start_test(&opts, &fh));
+    EXPECT_INT_ZERO(fake_hrpc_test_send(fh, "", 0, &stats));
+    fake_hrpc_get_stats(fh, &fstats);
+    fake_hrpc_free(fh);
+
+    EXPECT_UINT64_EQ((uint64_t)(FAKE_HRPC_TEST_ROUNDS *
+                                FAKE_HRPC_TEST_SPANS), stats.dropped_xmit);
+    EXPECT_UINT64_EQ(stats.rpcs, stats.rpc_errors);
+    EXPECT_UINT64_EQ(fstats.reqs, fstats.errors);
+    EXPECT_INT_EQ(1, (fstats.errors >= 2 * FAKE_HRPC_TEST_ROUNDS));
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * A request with a method ID which the server doesn't know gets an error
+ * response, and the connection stays usable.
+ */
+static int fake_hrpc_unknown_method_test(void)
+{
+    struct fake_hrpc_opts opts;
+    struct hrpc_client_opts hopts;
+    struct fake_hrpc_stats fstats;
+    struct htrace_conf *cnf;
+    struct htrace_log *lg;
+    struct hrpc_client *hcli;
+    struct fake_hrpc *fh;
+    const char *err;
+    const void *resp;
+    size_t resp_len;
+
+    memset(&opts, 0, sizeof(opts));
+    EXPECT_INT_ZERO(fake_hrpc_start_test(&opts, &fh));
+    cnf = htrace_conf_from_str("");
+    EXPECT_NONNULL(cnf);
+    lg = htrace_log_alloc(cnf);
+    EXPECT_NONNULL(lg);
+    memset(&hopts, 0, sizeof(hopts));
+    hopts.write_timeo_ms = 10000;
+    hopts.read_timeo_ms = 10000;
+    hcli = hrpc_client_alloc(lg, &hopts, fake_hrpc_get_addr(fh));
+    EXPECT_NONNULL(hcli);
+    EXPECT_INT_EQ(1, hrpc_client_call(hcli, 0x7f, "x", 1, NULL, 0,
+                                      &err, &resp, &resp_len));
+    EXPECT_STR_EQ("fake_hrpc: unknown method ID", err);
+    EXPECT_INT_EQ(1, hrpc_client_call(hcli, METHOD_ID_WRITE_SPANS, "x", 1,
+                                      NULL, 0, &err, &resp, &resp_len));
+    EXPECT_NULL(err);
+    hrpc_client_free(hcli);
+    fake_hrpc_get_stats(fh, &fstats);
+    fake_hrpc_free(fh);
+    htrace_log_free(lg);
+    htrace_conf_free(cnf);
+
+    EXPECT_UINT64_EQ((uint64_t)2, fstats.reqs);
+    EXPECT_UINT64_EQ((uint64_t)1, fstats.errors);
+    EXPECT_UINT64_EQ((uint64_t)1, fstats.conns);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Dictionary-encoded batches have their own method ID, so a server which
+ * doesn't understand the tables refuses them, rather than taking the spans
+ * without their descriptions.
+ */
+static int fake_hrpc_dictionary_test(void)
+{
+    struct fake_hrpc_opts opts;
+    struct fake_hrpc_test_methods ms;
+    struct fake_hrpc_stats fstats;
+    struct htrace_stats stats;
+    struct fake_hrpc *fh;
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&ms, 0, sizeof(ms));
+    pthread_mutex_init(&ms.lock, NULL);
+    EXPECT_INT_ZERO(fake_hrpc_start_test(&opts, &fh));
+    fake_hrpc_set_req_fn(fh, fake_hrpc_test_count, &ms);
+    EXPECT_INT_ZERO(fake_hrpc_test_send(fh,
+                HTRACED_DICTIONARY_KEY "=true", 0, &stats));
+    fake_hrpc_get_stats(fh, &fstats);
+    fake_hrpc_free(fh);
+
+    EXPECT_UINT64_EQ((uint64_t)(FAKE_HRPC_TEST_ROUNDS *
+                                FAKE_HRPC_TEST_SPANS), stats.dropped_xmit);
+    EXPECT_UINT64_EQ(stats.rpcs, stats.rpc_errors);
+    EXPECT_UINT64_EQ(fstats.reqs, fstats.errors);
+    EXPECT_UINT64_EQ((uint64_t)0, ms.write_spans);
+    EXPECT_UINT64_EQ(fstats.reqs, ms.other);
+    pthread_mutex_destroy(&ms.lock);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * If the server drops every other connection, the receiver reconnects and
+ * sends the spans again.
+ */
+static int fake_hrpc_drop_test(void)
+{
+    struct fake_hrpc_opts opts;
+    struct fake_hrpc_stats fstats;
+    struct htrace_stats stats;
+    struct fake_hrpc *fh;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.drop_every = 2;
+    EXPECT_INT_ZERO(fake_hrpc_start_test(&opts, &fh));
+    EXPECT_INT_ZERO(fake_hrpc_test_send(fh, "", 0, &stats));
+    fake_hrpc_get_stats(fh, &fstats);
+    fake_hrpc_free(fh);
+
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_xmit);
+    EXPECT_INT_EQ(1, (stats.rpc_errors >= 1));
+    EXPECT_INT_EQ(1, (fstats.drops >= 1));
+    EXPECT_INT_EQ(1, (fstats.conns >= fstats.drops + 1));
+    EXPECT_UINT64_EQ((uint64_t)0, fstats.errors);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * A slow server slows down the flush, but loses nothing.
+ */
+static int fake_hrpc_delay_test(void)
+{
+    struct fake_hrpc_opts opts;
+    struct htrace_stats stats;
+    struct fake_hrpc *fh;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.delay_ms = 20;
+    EXPECT_INT_ZERO(fake_hrpc_start_test(&opts, &fh));
+    EXPECT_INT_ZERO(fake_hrpc_test_send(fh, "", 0, &stats));
+    EXPECT_INT_EQ(1, fake_hrpc_wait_reqs(fh, stats.rpcs, 0));
+    fake_hrpc_free(fh);
+
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_xmit);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.rpc_errors);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * With self.stats set, we measure our own calls.  Since the server waits
+ * before responding, the transmitter thread must have spent about that long
+ * waiting for it.  The server's deadlines are in whole milliseconds, so each
+ * wait may be up to a millisecond short.
+ */
+static int fake_hrpc_self_stats_test(void)
+{
+    struct fake_hrpc_opts opts;
+    struct htrace_stats stats;
+    struct fake_hrpc *fh;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.delay_ms = 5;
+    EXPECT_INT_ZERO(fake_hrpc_start_test(&opts, &fh));
+    EXPECT_INT_ZERO(fake_hrpc_test_send(fh, HTRACE_SELF_STATS_KEY "=true", 0,
+                                        &stats));
+    fake_hrpc_free(fh);
+
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_xmit);
+    EXPECT_INT_EQ(1, (stats.self_start_span_ns > 0));
+    EXPECT_INT_EQ(1, (stats.self_scope_close_ns > 0));
+    EXPECT_INT_EQ(1, (stats.self_add_span_ns > 0));
+    EXPECT_INT_EQ(1, (stats.self_xmit_wait_ns >=
+            FAKE_HRPC_TEST_ROUNDS * (opts.delay_ms - 1) * 1000000ULL));
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * With per-CPU staging buffers, spans from many threads all get through.
+ */
+static int fake_hrpc_cpu_sharding_test(void)
+{
+    struct fake_hrpc_opts opts;
+    struct htrace_stats stats;
+    struct fake_hrpc *fh;
+
+    memset(&opts, 0, sizeof(opts));
+    EXPECT_INT_ZERO(fake_hrpc_start_test(&opts, &fh));
+    EXPECT_INT_ZERO(fake_hrpc_test_send(fh,
+                HTRACED_THREAD_BUFFER_SIZE_KEY "=4096;"
+                HTRACED_THREAD_BUFFER_SHARDING_KEY "=cpu",
+                FAKE_HRPC_TEST_MAX_THREADS, &stats));
+    fake_hrpc_free(fh);
+
+    EXPECT_UINT64_EQ((uint64_t)(FAKE_HRPC_TEST_ROUNDS *
+                FAKE_HRPC_TEST_MAX_THREADS * FAKE_HRPC_TEST_SPANS),
+                stats.buffered);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_newest);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_xmit);
+    EXPECT_INT_EQ(1, (stats.rpcs >= FAKE_HRPC_TEST_ROUNDS));
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Once the buffer space which is kept for high-priority spans is all that is
+ * left, normal-priority spans are dropped, but high-priority ones, slow ones,
+ * and failed ones still get in.
+ */
+static int fake_hrpc_priority_test(void)
+{
+    struct fake_hrpc_opts opts;
+    struct htrace_stats stats;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *scope;
+    struct fake_hrpc *fh;
+    uint64_t buffered, dropped;
+    char *conf_str;
+    int i;
+
+    memset(&opts, 0, sizeof(opts));
+    EXPECT_INT_ZERO(fake_hrpc_start_test(&opts, &fh));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%d;%s=%s;%s=%d;%s",
+                HTRACE_SPAN_RECEIVER_KEY, "htraced",
+                HTRACED_ADDRESS_KEY, fake_hrpc_get_addr(fh),
+                HTRACED_BUFFER_SIZE_KEY, 4 * 1024 * 1024,
+                HTRACED_BUFFER_PRIORITY_RESERVE_KEY, "0.9",
+                HTRACE_PRIORITY_MIN_DURATION_MS_KEY, 10,
+                FAKE_HRPC_TEST_CONF));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("fake_hrpc-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    memset(&stats, 0, sizeof(stats));
+    for (i = 0; (i < 1000000) && (stats.dropped_low_priority == 0); i++) {
+        htrace_scope_close(htrace_start_span(tracer, smp, "normal"));
+        if ((i % 1000) == 0) {
+            htracer_get_stats(tracer, &stats);
+        }
+    }
+    EXPECT_INT_EQ(1, (stats.dropped_low_priority > 0));
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_newest);
+    buffered = stats.buffered;
+    dropped = stats.dropped_low_priority;
+
+    htrace_scope_close(htrace_start_span(tracer, smp, "normal"));
+    scope = htrace_start_span(tracer, smp, "high");
+    htrace_scope_set_priority(scope, HTRACE_PRIORITY_HIGH);
+    htrace_scope_close(scope);
+    scope = htrace_start_span(tracer, smp, "failed");
+    EXPECT_INT_ZERO(htrace_scope_add_kv(scope, "error", "timed out"));
+    htrace_scope_close(scope);
+    scope = htrace_start_span(tracer, smp, "slow");
+    sleep_ms(20);
+    htrace_scope_close(scope);
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ(buffered + 3, stats.buffered);
+    EXPECT_UINT64_EQ(dropped + 1, stats.dropped_low_priority);
+
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(conf_str);
+    fake_hrpc_free(fh);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Create a configuration for fake_hrpc_update_conf_test.
+ */
+static struct htrace_conf *fake_hrpc_update_conf(struct fake_hrpc *fh,
+                                                 const char *fraction,
+                                                 int buf_size)
+{
+    struct htrace_conf *cnf;
+    char *conf_str;
+
+    if (asprintf(&conf_str, "%s=%s;%s=%s;%s=%s;%s=%s;%s=%d;%s=1;%s=10",
+                HTRACE_SPAN_RECEIVER_KEY, "htraced",
+                HTRACED_ADDRESS_KEY, fake_hrpc_get_addr(fh),
+                HTRACE_SAMPLER_KEY, "prob",
+                HTRACE_PROB_SAMPLER_FRACTION_KEY, fraction,
+                HTRACED_BUFFER_SIZE_KEY, buf_size,
+                HTRACED_RETRY_BACKOFF_MIN_MS_KEY,
+                HTRACED_RETRY_BACKOFF_MAX_MS_KEY) < 0) {
+        return NULL;
+    }
+    cnf = htrace_conf_from_str(conf_str);
+    free(conf_str);
+    return cnf;
+}
+
+/**
+ * htracer_update_conf changes the sampling fraction and the buffer size of a
+ * tracer which is in use.
+ */
+static int fake_hrpc_update_conf_test(void)
+{
+    struct fake_hrpc_opts opts;
+    struct htrace_stats stats;
+    struct htrace_conf *cnf, *ncnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct fake_hrpc *fh;
+    const char *old_name;
+    int i;
+
+    memset(&opts, 0, sizeof(opts));
+    EXPECT_INT_ZERO(fake_hrpc_start_test(&opts, &fh));
+    cnf = fake_hrpc_update_conf(fh, "0", 8 * 1024 * 1024);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("fake_hrpc-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    old_name = htrace_sampler_to_str(smp);
+    EXPECT_STR_EQ("ProbabilitySampler(fraction=0)", old_name);
+    for (i = 0; i < 100; i++) {
+        htrace_scope_close(htrace_start_span(tracer, smp, "before"));
+    }
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.spans_sampled);
+
+    ncnf = fake_hrpc_update_conf(fh, "1", 4 * 1024 * 1024);
+    EXPECT_NONNULL(ncnf);
+    EXPECT_INT_ZERO(htracer_update_conf(tracer, ncnf));
+    htrace_conf_free(ncnf);
+    EXPECT_STR_EQ("ProbabilitySampler(fraction=1)",
+                  htrace_sampler_to_str(smp));
+    // The old name stays valid until the sampler is freed.
+    EXPECT_STR_EQ("ProbabilitySampler(fraction=0)", old_name);
+    for (i = 0; i < 100; i++) {
+        htrace_scope_close(htrace_start_span(tracer, smp, "after"));
+    }
+    tracer->rcv->ty->flush(tracer->rcv);
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ((uint64_t)100, stats.spans_sampled);
+    EXPECT_UINT64_EQ((uint64_t)100, stats.buffered);
+    EXPECT_INT_EQ(1, (stats.rpcs > 0));
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_xmit);
+
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    fake_hrpc_free(fh);
+    return EXIT_SUCCESS;
+}
+
+#define FAKE_HRPC_GROUP_TRACES 3
+
+#define FAKE_HRPC_GROUP_ROUNDS 10
+
+/**
+ * The span IDs which the fake HRPC server received, in order.
+ */
+struct fake_hrpc_group_ids {
+    pthread_mutex_t lock;
+    uint64_t reqs;
+    int num;
+    struct htrace_span_id ids[FAKE_HRPC_GROUP_TRACES *
+                              FAKE_HRPC_GROUP_ROUNDS];
+};
+
+static void fake_hrpc_group_record(void *data, uint32_t method_id,
+                                   const void *body, size_t len)
+{
+    struct fake_hrpc_group_ids *gi = data;
+    struct htrace_span_reader *rd;
+    struct htrace_span_view view;
+    struct cmp_bcopy_ctx bctx;
+
+    if ((method_id != METHOD_ID_WRITE_SPANS) || (len == 0)) {
+        return;
+    }
+    // Skip the prequel.
+    cmp_bcopy_ctx_init(&bctx, (void *)body, len);
+    if (!cmp_bcopy_skip_object(&bctx)) {
+        return;
+    }
+    rd = htrace_span_reader_alloc((const char *)body + bctx.off,
+                                  len - bctx.off);
+    if (!rd) {
+        return;
+    }
+    pthread_mutex_lock(&gi->lock);
+    gi->reqs++;
+    while ((htrace_span_reader_next(rd, &view) > 0) &&
+           (gi->num < FAKE_HRPC_GROUP_TRACES * FAKE_HRPC_GROUP_ROUNDS)) {
+        gi->ids[gi->num++] = view.span_id;
+    }
+    pthread_mutex_unlock(&gi->lock);
+    htrace_span_reader_free(rd);
+}
+
+/**
+ * Send spans from a few traces, interleaved, and count how many times the
+ * trace ID changes between one span and the next at the server.
+ */
+static int fake_hrpc_group_run(const char *group, int *changes,
+                               uint64_t *reqs)
+{
+    struct fake_hrpc_opts opts;
+    struct fake_hrpc_group_ids gi;
+    struct htrace_span_id parent;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct fake_hrpc *fh;
+    char *conf_str;
+    int i, j;
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&gi, 0, sizeof(gi));
+    pthread_mutex_init(&gi.lock, NULL);
+    EXPECT_INT_ZERO(fake_hrpc_start_test(&opts, &fh));
+    fake_hrpc_set_req_fn(fh, fake_hrpc_group_record, &gi);
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s;%s",
+                HTRACE_SPAN_RECEIVER_KEY, "htraced",
+                HTRACED_ADDRESS_KEY, fake_hrpc_get_addr(fh),
+                HTRACED_GROUP_BY_TRACE_KEY, group,
+                FAKE_HRPC_TEST_CONF));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("fake_hrpc-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    for (i = 0; i < FAKE_HRPC_GROUP_ROUNDS; i++) {
+        for (j = 0; j < FAKE_HRPC_GROUP_TRACES; j++) {
+            parent.high = j + 1;
+            parent.low = i + 1;
+            htrace_scope_close(htrace_start_span_from(NULL, tracer,
+                                                      &parent, 0, "group"));
+        }
+    }
+    tracer->rcv->ty->flush(tracer->rcv);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(conf_str);
+    fake_hrpc_free(fh);
+
+    EXPECT_INT_EQ(FAKE_HRPC_GROUP_TRACES * FAKE_HRPC_GROUP_ROUNDS, gi.num);
+    *changes = 0;
+    for (i = 1; i < gi.num; i++) {
+        if (gi.ids[i].high != gi.ids[i - 1].high) {
+            (*changes)++;
+        }
+    }
+    *reqs = gi.reqs;
+    pthread_mutex_destroy(&gi.lock);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * With htraced.group.by.trace, the spans of each trace are sent together.
+ */
+static int fake_hrpc_group_by_trace_test(void)
+{
+    uint64_t reqs;
+    int changes;
+
+    EXPECT_INT_ZERO(fake_hrpc_group_run("false", &changes, &reqs));
+    EXPECT_INT_EQ(FAKE_HRPC_GROUP_TRACES * FAKE_HRPC_GROUP_ROUNDS - 1,
+                  changes);
+    EXPECT_INT_ZERO(fake_hrpc_group_run("true", &changes, &reqs));
+    EXPECT_INT_EQ(1, (reqs > 0));
+    EXPECT_INT_EQ(1, ((uint64_t)changes < FAKE_HRPC_GROUP_TRACES * reqs));
+    return EXIT_SUCCESS;
+}
+
+/**
+ * With a shutdown timeout, freeing the receiver doesn't wait for a server
+ * which is too slow to answer.
+ */
+static int fake_hrpc_shutdown_timeo_test(void)
+{
+    struct fake_hrpc_opts opts;
+    struct fake_hrpc_test_thread ft;
+    struct htrace_conf *cnf;
+    struct fake_hrpc *fh;
+    uint64_t start_ms;
+    char *conf_str;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.delay_ms = 30000;
+    EXPECT_INT_ZERO(fake_hrpc_start_test(&opts, &fh));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%d;%s",
+                HTRACE_SPAN_RECEIVER_KEY, "htraced",
+                HTRACED_ADDRESS_KEY, fake_hrpc_get_addr(fh),
+                HTRACED_SHUTDOWN_TIMEO_MS_KEY, 100, FAKE_HRPC_TEST_CONF));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    ft.tracer = htracer_create("fake_hrpc-unit", cnf);
+    EXPECT_NONNULL(ft.tracer);
+    ft.smp = htrace_sampler_create(ft.tracer, cnf);
+    EXPECT_NONNULL(ft.smp);
+    fake_hrpc_test_thread_run(&ft);
+    start_ms = monotonic_now_ms(NULL);
+    htrace_sampler_free(ft.smp);
+    htracer_free(ft.tracer);
+    EXPECT_INT_EQ(1, (monotonic_now_ms(NULL) - start_ms < 10000));
+    EXPECT_INT_EQ(1, fake_hrpc_wait_reqs(fh, 1, 0));
+    htrace_conf_free(cnf);
+    free(conf_str);
+    fake_hrpc_free(fh);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Send spans from a forked child, which inherited some unsent spans from its
+ * parent.  The child must restart the receiver and send only its own spans.
+ */
+static int fake_hrpc_fork_child(struct htracer *tracer,
+                                struct htrace_sampler *smp)
+{
+    struct fake_hrpc_test_thread ft;
+    struct htrace_stats stats;
+
+    ft.tracer = tracer;
+    ft.smp = smp;
+    fake_hrpc_test_thread_run(&ft);
+    tracer->rcv->ty->flush(tracer->rcv);
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ((uint64_t)FAKE_HRPC_TEST_SPANS, stats.buffered);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_xmit);
+    EXPECT_INT_EQ(1, (stats.rpcs >= 1));
+    EXPECT_UINT64_EQ((uint64_t)0, stats.rpc_errors);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    return EXIT_SUCCESS;
+}
+
+static int fake_hrpc_fork_test(const char *extra_conf)
+{
+    struct fake_hrpc_opts opts;
+    struct fake_hrpc_stats fstats;
+    struct htrace_stats stats;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct fake_hrpc_test_thread ft;
+    struct fake_hrpc *fh;
+    char *conf_str;
+    pid_t pid;
+    int status;
+
+    memset(&opts, 0, sizeof(opts));
+    EXPECT_INT_ZERO(fake_hrpc_start_test(&opts, &fh));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s;%s",
+                HTRACE_SPAN_RECEIVER_KEY, "htraced",
+                HTRACED_ADDRESS_KEY, fake_hrpc_get_addr(fh),
+                extra_conf, FAKE_HRPC_TEST_CONF));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("fake_hrpc-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    ft.tracer = tracer;
+    ft.smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(ft.smp);
+    fake_hrpc_test_thread_run(&ft);
+    tracer->rcv->ty->flush(tracer->rcv);
+    // Leave some spans unsent when we fork.
+    fake_hrpc_test_thread_run(&ft);
+    pid = fork();
+    EXPECT_INT_GE(0, pid);
+    if (pid == 0) {
+        _exit(fake_hrpc_fork_child(tracer, ft.smp));
+    }
+    EXPECT_INT_EQ(pid, waitpid(pid, &status, 0));
+    EXPECT_INT_EQ(1, WIFEXITED(status));
+    EXPECT_INT_ZERO(WEXITSTATUS(status));
+    tracer->rcv->ty->flush(tracer->rcv);
+    htracer_get_stats(tracer, &stats);
+    htrace_sampler_free(ft.smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(conf_str);
+    fake_hrpc_get_stats(fh, &fstats);
+    fake_hrpc_free(fh);
+
+    EXPECT_UINT64_EQ((uint64_t)(2 * FAKE_HRPC_TEST_SPANS), stats.buffered);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_xmit);
+    EXPECT_INT_EQ(1, (fstats.reqs > stats.rpcs));
+    EXPECT_INT_EQ(1, (fstats.conns >= 2));
+
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    EXPECT_INT_ZERO(fake_hrpc_basic_test());
+    EXPECT_INT_ZERO(fake_hrpc_error_test());
+    EXPECT_INT_ZERO(fake_hrpc_unknown_method_test());
+    EXPECT_INT_ZERO(fake_hrpc_dictionary_test());
+    EXPECT_INT_ZERO(fake_hrpc_drop_test());
+    EXPECT_INT_ZERO(fake_hrpc_delay_test());
+    EXPECT_INT_ZERO(fake_hrpc_self_stats_test());
+    EXPECT_INT_ZERO(fake_hrpc_cpu_sharding_test());
+    EXPECT_INT_ZERO(fake_hrpc_priority_test());
+    EXPECT_INT_ZERO(fake_hrpc_update_conf_test());
+    EXPECT_INT_ZERO(fake_hrpc_shutdown_timeo_test());
+    EXPECT_INT_ZERO(fake_hrpc_group_by_trace_test());
+    EXPECT_INT_ZERO(fake_hrpc_fork_test(""));
+    EXPECT_INT_ZERO(fake_hrpc_fork_test(
+                HTRACED_THREAD_BUFFER_SIZE_KEY "=4096;"
+                HTRACED_ASYNC_SERIALIZE_KEY "=true"));
+
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
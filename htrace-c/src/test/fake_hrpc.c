@@ -0,0 +1,565 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "receiver/hrpc.h"
+#include "test/fake_hrpc.h"
+#include "util/log.h"
+#include "util/time.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__OpenBSD__)
+#include <sys/types.h>
+#define le32toh(x) letoh32(x)
+#define le64toh(x) letoh64(x)
+#elif defined(__NetBSD__) || defined(__FreeBSD__)
+#include <sys/endian.h>
+#else
+#include <endian.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/**
+ * The magic number at the start of each request.  This must match
+ * receiver/hrpc.c.
+ */
+#define FAKE_HRPC_MAGIC 0x43525448U
+
+/**
+ * The largest request body we will read.
+ */
+#define FAKE_HRPC_MAX_BODY (64 * 1024 * 1024)
+
+/**
+ * The most connections we serve at once.  Connections beyond this are closed
+ * as soon as they are accepted.
+ */
+#define FAKE_HRPC_MAX_CONNS 64
+
+/**
+ * How often the accepting thread checks whether it should exit.
+ */
+#define FAKE_HRPC_POLL_MS 50
+
+#define FAKE_HRPC_INJECTED_ERROR "fake_hrpc: injected error"
+
+#define FAKE_HRPC_UNKNOWN_METHOD "fake_hrpc: unknown method ID"
+
+/**
+ * The request and response headers.  These must match receiver/hrpc.c.
+ */
+struct fake_hrpc_req_header {
+    uint32_t magic;
+    uint32_t method_id;
+    uint64_t seq;
+    uint32_t length;
+} __attribute__((packed,aligned(4)));
+
+struct fake_hrpc_resp_header {
+    uint64_t seq;
+    uint32_t method_id;
+    uint32_t err_length;
+    uint32_t length;
+} __attribute__((packed,aligned(4)));
+
+struct fake_hrpc_conn {
+    /**
+     * The fake HRPC server.
+     */
+    struct fake_hrpc *fh;
+
+    /**
+     * The connection's socket.
+     */
+    int fd;
+
+    /**
+     * The thread serving the connection.
+     */
+    pthread_t thread;
+
+    /**
+     * Nonzero if this slot holds a connection.
+     */
+    int in_use;
+
+    /**
+     * Nonzero once the thread serving the connection is about to exit.
+     * Protected by the server lock.
+     */
+    int done;
+};
+
+struct fake_hrpc {
+    /**
+     * The listening socket.
+     */
+    int listen_fd;
+
+    /**
+     * The host:port we are listening on.
+     */
+    char addr[64];
+
+    /**
+     * The thread which accepts connections.
+     */
+    pthread_t accept_thread;
+
+    /**
+     * Lock protecting everything below.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * Signalled when a request arrives, or when we are shutting down.
+     */
+    pthread_cond_t cond;
+
+    /**
+     * Nonzero when we are shutting down.
+     */
+    int shutdown;
+
+    /**
+     * The faults to inject.
+     */
+    struct fake_hrpc_opts opts;
+
+    /**
+     * The function to call with each request, or NULL.
+     */
+    fake_hrpc_req_fn_t req_fn;
+
+    /**
+     * The data to pass to req_fn.
+     */
+    void *req_data;
+
+    /**
+     * Our statistics.
+     */
+    struct fake_hrpc_stats stats;
+
+    /**
+     * The connections.  Only the accepting thread changes these slots, until
+     * it has exited.
+     */
+    struct fake_hrpc_conn conns[FAKE_HRPC_MAX_CONNS];
+};
+
+static int fake_hrpc_read_full(int fd, void *buf, size_t len)
+{
+    char *b = buf;
+    ssize_t res;
+
+    while (len > 0) {
+        res = recv(fd, b, len, 0);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        if (res == 0) {
+            return 0;
+        }
+        b += res;
+        len -= res;
+    }
+    return 1;
+}
+
+static int fake_hrpc_write_full(int fd, const void *buf, size_t len)
+{
+    const char *b = buf;
+    ssize_t res;
+
+    while (len > 0) {
+        res = send(fd, b, len, MSG_NOSIGNAL);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        b += res;
+        len -= res;
+    }
+    return 1;
+}
+
+/**
+ * Wait for a while, unless the server is shutting down.
+ * This function must be called with the lock held.
+ */
+static void fake_hrpc_delay(struct fake_hrpc *fh, uint64_t delay_ms)
+{
+    struct timespec ts;
+    uint64_t deadline_ms;
+
+    deadline_ms = now_ms(NULL) + delay_ms;
+    ms_to_timespec(deadline_ms, &ts);
+    while ((!fh->shutdown) && (now_ms(NULL) < deadline_ms)) {
+        pthread_cond_timedwait(&fh->cond, &fh->lock, &ts);
+    }
+}
+
+/**
+ * Read one request, and respond to it.
+ *
+ * @return      1 if the connection should stay open; 0 otherwise.
+ */
+static int fake_hrpc_handle_req(struct fake_hrpc_conn *conn, char **body,
+                                size_t *body_cap)
+{
+    struct fake_hrpc *fh = conn->fh;
+    struct fake_hrpc_req_header hdr;
+    struct fake_hrpc_resp_header resp;
+    struct fake_hrpc_opts opts;
+    fake_hrpc_req_fn_t req_fn;
+    void *req_data;
+    const char *err = NULL;
+    uint32_t method_id, length;
+    uint64_t n;
+    char *nbody;
+
+    if (!fake_hrpc_read_full(conn->fd, &hdr, sizeof(hdr))) {
+        return 0;
+    }
+    method_id = le32toh(hdr.method_id);
+    length = le32toh(hdr.length);
+    if ((le32toh(hdr.magic) != FAKE_HRPC_MAGIC) ||
+            (length > FAKE_HRPC_MAX_BODY)) {
+        pthread_mutex_lock(&fh->lock);
+        fh->stats.bad_reqs++;
+        pthread_mutex_unlock(&fh->lock);
+        return 0;
+    }
+    if (length > *body_cap) {
+        nbody = realloc(*body, length);
+        if (!nbody) {
+            return 0;
+        }
+        *body = nbody;
+        *body_cap = length;
+    }
+    if (!fake_hrpc_read_full(conn->fd, *body, length)) {
+        return 0;
+    }
+    pthread_mutex_lock(&fh->lock);
+    n = ++fh->stats.reqs;
+    fh->stats.req_bytes += length;
+    opts = fh->opts;
+    req_fn = fh->req_fn;
+    req_data = fh->req_data;
+    pthread_cond_broadcast(&fh->cond);
+    pthread_mutex_unlock(&fh->lock);
+
+    if (req_fn) {
+        req_fn(req_data, method_id, *body, length);
+    }
+    pthread_mutex_lock(&fh->lock);
+    if (opts.drop_every && ((n % opts.drop_every) == 0)) {
+        fh->stats.drops++;
+        pthread_mutex_unlock(&fh->lock);
+        return 0;
+    }
+    if (opts.delay_ms) {
+        fake_hrpc_delay(fh, opts.delay_ms);
+    }
+    if (fh->shutdown) {
+        pthread_mutex_unlock(&fh->lock);
+        return 0;
+    }
+    if ((method_id != METHOD_ID_WRITE_SPANS) &&
+            (method_id != METHOD_ID_WRITE_SPANS_ZLIB)) {
+        err = FAKE_HRPC_UNKNOWN_METHOD;
+    } else if (opts.error_every && ((n % opts.error_every) == 0)) {
+        err = FAKE_HRPC_INJECTED_ERROR;
+    }
+    if (err) {
+        fh->stats.errors++;
+    }
+    pthread_mutex_unlock(&fh->lock);
+
+    // Compressed WriteSpans requests get the same response as plain ones.
+    if (method_id == METHOD_ID_WRITE_SPANS_ZLIB) {
+        method_id = METHOD_ID_WRITE_SPANS;
+    }
+    resp.seq = hdr.seq;
+    resp.method_id = htole32(method_id);
+    resp.err_length = htole32(err ? strlen(err) : 0);
+    resp.length = 0;
+    if (!fake_hrpc_write_full(conn->fd, &resp, sizeof(resp))) {
+        return 0;
+    }
+    if (err && (!fake_hrpc_write_full(conn->fd, err, strlen(err)))) {
+        return 0;
+    }
+    return 1;
+}
+
+static void *fake_hrpc_conn_run(void *data)
+{
+    struct fake_hrpc_conn *conn = data;
+    struct fake_hrpc *fh = conn->fh;
+    char *body = NULL;
+    size_t body_cap = 0;
+
+    while (fake_hrpc_handle_req(conn, &body, &body_cap)) {
+        ;
+    }
+    free(body);
+    // Let the client see EOF now.  The accepting thread closes the socket
+    // when it reaps us.
+    shutdown(conn->fd, SHUT_RDWR);
+    pthread_mutex_lock(&fh->lock);
+    conn->done = 1;
+    pthread_mutex_unlock(&fh->lock);
+    return NULL;
+}
+
+static void fake_hrpc_conn_reap(struct fake_hrpc_conn *conn)
+{
+    pthread_join(conn->thread, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+    conn->in_use = 0;
+    conn->done = 0;
+}
+
+static void fake_hrpc_reap_done(struct fake_hrpc *fh)
+{
+    int i, done;
+
+    for (i = 0; i < FAKE_HRPC_MAX_CONNS; i++) {
+        if (!fh->conns[i].in_use) {
+            continue;
+        }
+        pthread_mutex_lock(&fh->lock);
+        done = fh->conns[i].done;
+        pthread_mutex_unlock(&fh->lock);
+        if (done) {
+            fake_hrpc_conn_reap(&fh->conns[i]);
+        }
+    }
+}
+
+static void fake_hrpc_accept(struct fake_hrpc *fh)
+{
+    struct fake_hrpc_conn *conn = NULL;
+    int i, fd, one = 1;
+
+    fd = accept(fh->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    // Responses are small, and we don't want Nagle's algorithm to hold them
+    // back.
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    pthread_mutex_lock(&fh->lock);
+    fh->stats.conns++;
+    pthread_mutex_unlock(&fh->lock);
+    for (i = 0; i < FAKE_HRPC_MAX_CONNS; i++) {
+        if (!fh->conns[i].in_use) {
+            conn = &fh->conns[i];
+            break;
+        }
+    }
+    if (!conn) {
+        close(fd);
+        return;
+    }
+    conn->fh = fh;
+    conn->fd = fd;
+    conn->done = 0;
+    if (pthread_create(&conn->thread, NULL, fake_hrpc_conn_run, conn)) {
+        close(fd);
+        conn->fd = -1;
+        return;
+    }
+    conn->in_use = 1;
+}
+
+static void *fake_hrpc_accept_run(void *data)
+{
+    struct fake_hrpc *fh = data;
+    struct pollfd pfd;
+    int done;
+
+    while (1) {
+        pthread_mutex_lock(&fh->lock);
+        done = fh->shutdown;
+        pthread_mutex_unlock(&fh->lock);
+        if (done) {
+            break;
+        }
+        fake_hrpc_reap_done(fh);
+        pfd.fd = fh->listen_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, FAKE_HRPC_POLL_MS) > 0) {
+            fake_hrpc_accept(fh);
+        }
+    }
+    return NULL;
+}
+
+void fake_hrpc_start(const struct fake_hrpc_opts *opts,
+                     struct fake_hrpc **out, char *err, size_t err_len)
+{
+    struct fake_hrpc *fh;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int i, ret;
+
+    err[0] = '\0';
+    fh = calloc(1, sizeof(*fh));
+    if (!fh) {
+        snprintf(err, err_len, "out of memory allocating fake_hrpc object");
+        return;
+    }
+    fh->opts = *opts;
+    for (i = 0; i < FAKE_HRPC_MAX_CONNS; i++) {
+        fh->conns[i].fd = -1;
+    }
+    fh->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fh->listen_fd < 0) {
+        ret = errno;
+        snprintf(err, err_len, "socket failed: %s", terror(ret));
+        free(fh);
+        return;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((bind(fh->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+            (listen(fh->listen_fd, 16) < 0) ||
+            (getsockname(fh->listen_fd, (struct sockaddr *)&addr,
+                         &addr_len) < 0)) {
+        ret = errno;
+        snprintf(err, err_len, "failed to listen on a loopback port: %s",
+                 terror(ret));
+        goto error;
+    }
+    snprintf(fh->addr, sizeof(fh->addr), "127.0.0.1:%d",
+             ntohs(addr.sin_port));
+    pthread_mutex_init(&fh->lock, NULL);
+    pthread_cond_init(&fh->cond, NULL);
+    ret = pthread_create(&fh->accept_thread, NULL, fake_hrpc_accept_run, fh);
+    if (ret) {
+        snprintf(err, err_len, "pthread_create failed: %s", terror(ret));
+        pthread_cond_destroy(&fh->cond);
+        pthread_mutex_destroy(&fh->lock);
+        goto error;
+    }
+    *out = fh;
+    return;
+
+error:
+    close(fh->listen_fd);
+    free(fh);
+}
+
+const char *fake_hrpc_get_addr(const struct fake_hrpc *fh)
+{
+    return fh->addr;
+}
+
+void fake_hrpc_set_opts(struct fake_hrpc *fh,
+                        const struct fake_hrpc_opts *opts)
+{
+    pthread_mutex_lock(&fh->lock);
+    fh->opts = *opts;
+    pthread_mutex_unlock(&fh->lock);
+}
+
+void fake_hrpc_set_req_fn(struct fake_hrpc *fh, fake_hrpc_req_fn_t fn,
+                          void *data)
+{
+    pthread_mutex_lock(&fh->lock);
+    fh->req_fn = fn;
+    fh->req_data = data;
+    pthread_mutex_unlock(&fh->lock);
+}
+
+void fake_hrpc_get_stats(struct fake_hrpc *fh, struct fake_hrpc_stats *stats)
+{
+    pthread_mutex_lock(&fh->lock);
+    *stats = fh->stats;
+    pthread_mutex_unlock(&fh->lock);
+}
+
+int fake_hrpc_wait_reqs(struct fake_hrpc *fh, uint64_t reqs,
+                        uint64_t timeo_ms)
+{
+    struct timespec ts;
+    uint64_t deadline_ms;
+    int ret;
+
+    deadline_ms = now_ms(NULL) + timeo_ms;
+    ms_to_timespec(deadline_ms, &ts);
+    pthread_mutex_lock(&fh->lock);
+    while ((fh->stats.reqs < reqs) && (now_ms(NULL) < deadline_ms)) {
+        pthread_cond_timedwait(&fh->cond, &fh->lock, &ts);
+    }
+    ret = (fh->stats.reqs >= reqs);
+    pthread_mutex_unlock(&fh->lock);
+    return ret;
+}
+
+void fake_hrpc_free(struct fake_hrpc *fh)
+{
+    int i;
+
+    pthread_mutex_lock(&fh->lock);
+    fh->shutdown = 1;
+    pthread_cond_broadcast(&fh->cond);
+    pthread_mutex_unlock(&fh->lock);
+    pthread_join(fh->accept_thread, NULL);
+    close(fh->listen_fd);
+    for (i = 0; i < FAKE_HRPC_MAX_CONNS; i++) {
+        if (fh->conns[i].in_use) {
+            // Wake up the thread if it is blocked reading.
+            shutdown(fh->conns[i].fd, SHUT_RDWR);
+            fake_hrpc_conn_reap(&fh->conns[i]);
+        }
+    }
+    pthread_cond_destroy(&fh->cond);
+    pthread_mutex_destroy(&fh->lock);
+    free(fh);
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,186 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_TEST_FAKE_HRPC_H
+#define APACHE_HTRACE_TEST_FAKE_HRPC_H
+
+/**
+ * @file fake_hrpc.h
+ *
+ * Implements an in-process HRPC server which can be used in unit tests and
+ * benchmarks.
+ *
+ * Unlike mini_htraced, this does not need the htraced binary.  It reads
+ * requests and sends back empty responses, without decoding the spans.  It
+ * can be told to inject faults: to wait before responding, to return errors,
+ * or to drop connections.  This lets us test how the htraced receiver
+ * pipelines, retries, and applies backpressure, apart from the real server.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <stdint.h> /* for uint64_t, etc. */
+#include <unistd.h> /* for size_t */
+
+/**
+ * The faults which the fake HRPC server injects.
+ */
+struct fake_hrpc_opts {
+    /**
+     * How long to wait before responding to each request.
+     */
+    uint64_t delay_ms;
+
+    /**
+     * Return an error for every error_every-th request, or 0 to never return
+     * errors.
+     */
+    int error_every;
+
+    /**
+     * Close the connection instead of responding to every drop_every-th
+     * request, or 0 to never drop connections.
+     */
+    int drop_every;
+};
+
+/**
+ * Statistics about what the fake HRPC server has seen.
+ */
+struct fake_hrpc_stats {
+    /**
+     * The number of connections accepted.
+     */
+    uint64_t conns;
+
+    /**
+     * The number of whole requests read.
+     */
+    uint64_t reqs;
+
+    /**
+     * The number of bytes in the bodies of those requests.
+     */
+    uint64_t req_bytes;
+
+    /**
+     * The number of error responses sent.
+     */
+    uint64_t errors;
+
+    /**
+     * The number of connections we closed on purpose.
+     */
+    uint64_t drops;
+
+    /**
+     * The number of connections closed because of a malformed request.
+     */
+    uint64_t bad_reqs;
+};
+
+/**
+ * A function which is called with the body of each request the fake HRPC
+ * server reads, before it responds.  It may be called from several threads at
+ * once.
+ *
+ * @param data              The data passed to fake_hrpc_set_req_fn.
+ * @param method_id         The method ID of the request.
+ * @param body              The request body.
+ * @param len               The length of the request body.
+ */
+typedef void (*fake_hrpc_req_fn_t)(void *data, uint32_t method_id,
+                                   const void *body, size_t len);
+
+struct fake_hrpc;
+
+/**
+ * Start a fake HRPC server listening on a loopback port.
+ *
+ * @param opts              The faults to inject.  They will be copied.
+ * @param out               (out param) The fake HRPC server on success.
+ * @param err               (out param) The error message if there was an
+ *                              error.
+ * @param err_len           The length of the error buffer provided by the
+ *                              caller.
+ */
+void fake_hrpc_start(const struct fake_hrpc_opts *opts,
+                     struct fake_hrpc **out, char *err, size_t err_len);
+
+/**
+ * Get the address the fake HRPC server is listening on.
+ *
+ * @param fh                The fake HRPC server.
+ *
+ * @return                  The address, in host:port form, suitable for
+ *                              htraced.address.  This string will be valid
+ *                              for the lifetime of the fake HRPC server.
+ */
+const char *fake_hrpc_get_addr(const struct fake_hrpc *fh);
+
+/**
+ * Change the faults which the fake HRPC server injects.  Requests which are
+ * being waited on keep the delay they started with.
+ *
+ * @param fh                The fake HRPC server.
+ * @param opts              The faults to inject.  They will be copied.
+ */
+void fake_hrpc_set_opts(struct fake_hrpc *fh,
+                        const struct fake_hrpc_opts *opts);
+
+/**
+ * Set the function which is called with each request.
+ *
+ * @param fh                The fake HRPC server.
+ * @param fn                The function, or NULL for none.
+ * @param data              The data to pass to the function.
+ */
+void fake_hrpc_set_req_fn(struct fake_hrpc *fh, fake_hrpc_req_fn_t fn,
+                          void *data);
+
+/**
+ * Get the fake HRPC server's statistics.
+ *
+ * @param fh                The fake HRPC server.
+ * @param stats             (out param) The statistics.
+ */
+void fake_hrpc_get_stats(struct fake_hrpc *fh, struct fake_hrpc_stats *stats);
+
+/**
+ * Wait until the fake HRPC server has read at least a given number of
+ * requests.
+ *
+ * @param fh                The fake HRPC server.
+ * @param reqs              The number of requests.
+ * @param timeo_ms          The longest time to wait.
+ *
+ * @return                  1 if the requests arrived; 0 on timeout.
+ */
+int fake_hrpc_wait_reqs(struct fake_hrpc *fh, uint64_t reqs,
+                        uint64_t timeo_ms);
+
+/**
+ * Stop the fake HRPC server, close all of its connections, and free it.
+ *
+ * @param fh                The fake HRPC server.
+ */
+void fake_hrpc_free(struct fake_hrpc *fh);
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
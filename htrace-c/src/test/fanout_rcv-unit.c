@@ -0,0 +1,203 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "receiver/local_mmap.h"
+#include "test/rtest.h"
+#include "test/span_table.h"
+#include "test/span_util.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/**
+ * Count the spans in a local.mmap file with the public span reader.
+ */
+static int fanout_count_mmap_spans(const char *path)
+{
+    struct htrace_span_reader *rd;
+    struct htrace_span_view view;
+    const struct local_mmap_header *hdr;
+    const struct local_mmap_region_header *rh;
+    struct stat st;
+    uint8_t *buf;
+    uint64_t i;
+    FILE *fp;
+    int ret, num_spans = 0;
+
+    EXPECT_INT_ZERO(stat(path, &st));
+    buf = xcalloc(st.st_size + 1);
+    fp = fopen(path, "r");
+    EXPECT_NONNULL(fp);
+    EXPECT_UINT64_EQ((uint64_t)st.st_size,
+                     (uint64_t)fread(buf, 1, st.st_size, fp));
+    EXPECT_INT_ZERO(fclose(fp));
+    hdr = (const struct local_mmap_header *)buf;
+    EXPECT_UINT64_EQ((uint64_t)LOCAL_MMAP_MAGIC, (uint64_t)hdr->magic);
+    for (i = 0; (i < hdr->next_region) && (i < hdr->num_regions); i++) {
+        rh = (const struct local_mmap_region_header *)
+            (buf + LOCAL_MMAP_HEADER_LEN + (i * hdr->region_len));
+        rd = htrace_span_reader_alloc(rh + 1, rh->committed);
+        EXPECT_NONNULL(rd);
+        while ((ret = htrace_span_reader_next(rd, &view)) == 1) {
+            num_spans++;
+        }
+        EXPECT_INT_ZERO(ret);
+        htrace_span_reader_free(rd);
+    }
+    free(buf);
+    return num_spans;
+}
+
+/**
+ * Run an rtest with spans going to a local file, a local binary file, and a
+ * local mmap file at once.  The last two share one encoding of each span.
+ */
+static int fanout_rcv_test(struct rtest *rt)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *json_path, *bin_path, *mmap_path, *tdir, *conf_str = NULL;
+    struct span_table *st;
+    struct stat sb;
+
+    st = span_table_alloc();
+    tdir = create_tempdir("fanout_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&json_path, "%s/%s", tdir, "spans.json"));
+    EXPECT_INT_GE(0, asprintf(&bin_path, "%s/%s", tdir, "spans.bin"));
+    EXPECT_INT_GE(0, asprintf(&mmap_path, "%s/%s", tdir, "spans.mmap"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s;%s=%s;%s=%d",
+                HTRACE_SPAN_RECEIVER_KEY,
+                "local.file, local.binfile, local.mmap",
+                HTRACE_LOCAL_FILE_RCV_PATH_KEY, json_path,
+                HTRACE_LOCAL_BINFILE_RCV_PATH_KEY, bin_path,
+                HTRACE_LOCAL_MMAP_RCV_PATH_KEY, mmap_path,
+                HTRACE_LOCAL_MMAP_SIZE_KEY, 16 * 1024 * 1024));
+    EXPECT_INT_ZERO(rt->run(rt, conf_str));
+    EXPECT_INT_GE(0, load_trace_span_file(json_path, st));
+    EXPECT_INT_ZERO(rt->verify(rt, st));
+    EXPECT_INT_EQ(rt->spans_created, fanout_count_mmap_spans(mmap_path));
+    EXPECT_INT_ZERO(stat(bin_path, &sb));
+    EXPECT_INT_EQ(rt->spans_created > 0, sb.st_size > 0);
+    free(conf_str);
+    free(mmap_path);
+    free(bin_path);
+    free(json_path);
+    free(tdir);
+    span_table_free(st);
+
+    return EXIT_SUCCESS;
+}
+
+#define FANOUT_NUM_SPANS 100
+
+static int fanout_rcv_stats_test(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *json_path, *mmap_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_stats stats;
+    struct stat sb;
+    int i;
+
+    tdir = create_tempdir("fanout_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&json_path, "%s/%s", tdir, "stats.json"));
+    EXPECT_INT_GE(0, asprintf(&mmap_path, "%s/%s", tdir, "stats.mmap"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s;%s=%s;%s=%d;"
+                "%s=%d",
+                HTRACE_SPAN_RECEIVER_KEY, "local.mmap,local.file",
+                HTRACE_LOCAL_FILE_RCV_PATH_KEY, json_path,
+                HTRACE_LOCAL_MMAP_RCV_PATH_KEY, mmap_path,
+                HTRACE_SAMPLER_KEY, "always",
+                HTRACE_LOCAL_MMAP_SIZE_KEY, 1024 * 1024,
+                HTRACE_BATCH_SIZE_KEY, 8));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("fanout_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    for (i = 0; i < FANOUT_NUM_SPANS; i++) {
+        htrace_scope_close(htrace_start_span(tracer, smp, "fanout"));
+    }
+    // Only the full batches of 8 have reached the children so far.  The
+    // bytes serialized are the sum of both children's, so they are more than
+    // the JSON file alone will hold.
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ((uint64_t)((FANOUT_NUM_SPANS / 8) * 8), stats.buffered);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_xmit);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_newest);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    EXPECT_INT_ZERO(stat(json_path, &sb));
+    EXPECT_INT_EQ(1, (uint64_t)sb.st_size < stats.bytes_serialized);
+    EXPECT_INT_EQ(FANOUT_NUM_SPANS, fanout_count_mmap_spans(mmap_path));
+    free(conf_str);
+    free(mmap_path);
+    free(json_path);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
+static int fanout_rcv_unknown_test(void)
+{
+    struct htrace_conf *cnf;
+
+    cnf = htrace_conf_from_str(HTRACE_SPAN_RECEIVER_KEY "=noop,bogus");
+    EXPECT_NONNULL(cnf);
+    EXPECT_NULL(htracer_create("fanout_rcv-unit", cnf));
+    htrace_conf_free(cnf);
+
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    int i;
+
+    for (i = 0; g_rtests[i]; i++) {
+        struct rtest *rtest = g_rtests[i];
+        if (fanout_rcv_test(rtest) != EXIT_SUCCESS) {
+            fprintf(stderr, "rtest %s failed\n", rtest->name);
+            return EXIT_FAILURE;
+        }
+    }
+    EXPECT_INT_ZERO(fanout_rcv_stats_test());
+    EXPECT_INT_ZERO(fanout_rcv_unknown_test());
+
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
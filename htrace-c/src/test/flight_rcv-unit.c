@@ -0,0 +1,391 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/span.h"
+#include "test/rtest.h"
+#include "test/span_table.h"
+#include "test/span_util.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+#include "util/cmp.h"
+#include "util/cmp_util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * Load the spans in a flight recorder dump.
+ *
+ * @param path          The path of the dump.
+ * @param st            The span table to put the spans in, or NULL to free
+ *                          them instead.
+ * @param desc          If this is non-NULL, only count spans with this
+ *                          description.
+ * @param num_spans     (out param) The number of spans counted.
+ */
+static int flight_load(const char *path, struct span_table *st,
+                       const char *desc, int *num_spans)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    struct cmp_bcopy_ctx bctx;
+    struct htrace_span *span;
+    struct stat sb;
+    uint8_t *buf;
+    FILE *fp;
+
+    *num_spans = 0;
+    EXPECT_INT_ZERO(stat(path, &sb));
+    buf = xcalloc(sb.st_size + 1);
+    fp = fopen(path, "r");
+    EXPECT_NONNULL(fp);
+    EXPECT_UINT64_EQ((uint64_t)sb.st_size,
+                     (uint64_t)fread(buf, 1, sb.st_size, fp));
+    EXPECT_INT_ZERO(fclose(fp));
+    cmp_bcopy_ctx_init(&bctx, buf, sb.st_size);
+    while (bctx.off < (uint64_t)sb.st_size) {
+        err[0] = '\0';
+        span = span_read_msgpack((cmp_ctx_t*)&bctx, err, err_len);
+        EXPECT_STR_EQ("", err);
+        EXPECT_NONNULL(span);
+        if ((!desc) || (strcmp(desc, span->desc) == 0)) {
+            (*num_spans)++;
+        }
+        if (st) {
+            EXPECT_INT_ZERO(span_table_put(st, span));
+        } else {
+            htrace_span_free(span);
+        }
+    }
+    free(buf);
+    return EXIT_SUCCESS;
+}
+
+static int flight_rcv_test(struct rtest *rt)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *dump_path, *tdir, *conf_str = NULL;
+    struct span_table *st;
+    int num_spans;
+
+    st = span_table_alloc();
+    tdir = create_tempdir("flight_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&dump_path, "%s/%s", tdir, "flight.dump"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s",
+                HTRACE_SPAN_RECEIVER_KEY, "flight",
+                HTRACE_FLIGHT_RCV_PATH_KEY, dump_path,
+                HTRACE_FLIGHT_RCV_DUMP_ON_FREE_KEY, "true"));
+    EXPECT_INT_ZERO(rt->run(rt, conf_str));
+    EXPECT_INT_ZERO(flight_load(dump_path, st, NULL, &num_spans));
+    EXPECT_INT_EQ(rt->spans_created, num_spans);
+    EXPECT_INT_ZERO(rt->verify(rt, st));
+    free(conf_str);
+    free(dump_path);
+    free(tdir);
+    span_table_free(st);
+
+    return EXIT_SUCCESS;
+}
+
+#define FLIGHT_NUM_THREADS 4
+
+#define FLIGHT_SPANS_PER_THREAD 10000
+
+struct flight_thread {
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    const char *desc;
+    int num_spans;
+};
+
+static void *flight_thread_run(void *data)
+{
+    struct flight_thread *ft = data;
+    char desc[32];
+    int i;
+
+    for (i = 0; i < ft->num_spans; i++) {
+        snprintf(desc, sizeof(desc), "%s%d", ft->desc, i);
+        htrace_scope_close(htrace_start_span(ft->tracer, ft->smp, desc));
+    }
+    return NULL;
+}
+
+/**
+ * Fill a small ring from several threads, dumping it while they run, and
+ * check that the dumps only hold whole spans and that older spans were
+ * overwritten.
+ */
+static int flight_rcv_overwrite_test(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *dump_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_stats stats;
+    struct flight_thread ft;
+    pthread_t threads[FLIGHT_NUM_THREADS];
+    int i, num_spans;
+
+    tdir = create_tempdir("flight_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&dump_path, "%s/%s", tdir, "overwrite.dump"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%d",
+                HTRACE_SPAN_RECEIVER_KEY, "flight",
+                HTRACE_SAMPLER_KEY, "always",
+                HTRACE_FLIGHT_RCV_SIZE_KEY, 1048576));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("flight_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    ft.tracer = tracer;
+    ft.smp = smp;
+    // A thread holds on to its block until the block is full or the thread
+    // exits, so add the oldest span from a thread which exits.
+    ft.desc = "oldest";
+    ft.num_spans = 1;
+    EXPECT_INT_ZERO(pthread_create(&threads[0], NULL, flight_thread_run,
+                                   &ft));
+    EXPECT_INT_ZERO(pthread_join(threads[0], NULL));
+    ft.desc = "span";
+    ft.num_spans = FLIGHT_SPANS_PER_THREAD;
+    for (i = 0; i < FLIGHT_NUM_THREADS; i++) {
+        EXPECT_INT_ZERO(pthread_create(&threads[i], NULL,
+                                       flight_thread_run, &ft));
+    }
+    for (i = 0; i < 10; i++) {
+        EXPECT_INT_ZERO(htracer_dump_flight_recorder(tracer, dump_path));
+        EXPECT_INT_ZERO(flight_load(dump_path, NULL, NULL, &num_spans));
+    }
+    for (i = 0; i < FLIGHT_NUM_THREADS; i++) {
+        EXPECT_INT_ZERO(pthread_join(threads[i], NULL));
+    }
+    htrace_scope_close(htrace_start_span(tracer, smp, "newest"));
+    EXPECT_INT_ZERO(htracer_dump_flight_recorder(tracer, dump_path));
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ((uint64_t)(FLIGHT_NUM_THREADS *
+                                FLIGHT_SPANS_PER_THREAD + 2),
+                     stats.buffered);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_newest);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_too_large);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+
+    EXPECT_INT_ZERO(flight_load(dump_path, NULL, NULL, &num_spans));
+    EXPECT_INT_EQ(1, num_spans > 0);
+    EXPECT_INT_EQ(1, num_spans < FLIGHT_NUM_THREADS *
+                                 FLIGHT_SPANS_PER_THREAD);
+    EXPECT_INT_ZERO(flight_load(dump_path, NULL, "newest", &num_spans));
+    EXPECT_INT_EQ(1, num_spans);
+    // The oldest span was overwritten long ago.
+    EXPECT_INT_ZERO(flight_load(dump_path, NULL, "oldest0", &num_spans));
+    EXPECT_INT_ZERO(num_spans);
+    free(conf_str);
+    free(dump_path);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Check that flight.signal makes the flight recorder dump, and that only
+ * one flight recorder can handle signals at a time.
+ */
+static int flight_rcv_signal_test(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *dump_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer, *tracer2;
+    struct htrace_sampler *smp;
+    int num_spans;
+
+    tdir = create_tempdir("flight_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&dump_path, "%s/%s", tdir, "signal.dump"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s;%s=%d",
+                HTRACE_SPAN_RECEIVER_KEY, "flight",
+                HTRACE_SAMPLER_KEY, "always",
+                HTRACE_FLIGHT_RCV_PATH_KEY, dump_path,
+                HTRACE_FLIGHT_RCV_SIGNAL_KEY, SIGUSR2));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("flight_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    tracer2 = htracer_create("flight_rcv-unit", cnf);
+    EXPECT_NULL(tracer2);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    htrace_scope_close(htrace_start_span(tracer, smp, "signalled"));
+    EXPECT_INT_ZERO(raise(SIGUSR2));
+    EXPECT_INT_ZERO(flight_load(dump_path, NULL, NULL, &num_spans));
+    EXPECT_INT_EQ(1, num_spans);
+    EXPECT_INT_ZERO(flight_load(dump_path, NULL, "signalled", &num_spans));
+    EXPECT_INT_EQ(1, num_spans);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+
+    // Once the first tracer is gone, another one can handle signals.
+    tracer = htracer_create("flight_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(conf_str);
+    free(dump_path);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Check that flight.dump.on.crash dumps the spans when the process aborts,
+ * and that the process still dies of the signal.
+ */
+static int flight_rcv_crash_test(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *dump_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    int num_spans, status;
+    pid_t pid;
+
+    tdir = create_tempdir("flight_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&dump_path, "%s/%s", tdir, "crash.dump"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s;%s=%s",
+                HTRACE_SPAN_RECEIVER_KEY, "flight",
+                HTRACE_SAMPLER_KEY, "always",
+                HTRACE_FLIGHT_RCV_PATH_KEY, dump_path,
+                HTRACE_FLIGHT_RCV_DUMP_ON_CRASH_KEY, "true"));
+    pid = fork();
+    EXPECT_INT_GE(0, pid);
+    if (pid == 0) {
+        cnf = htrace_conf_from_str(conf_str);
+        tracer = htracer_create("flight_rcv-unit", cnf);
+        if (!tracer) {
+            _exit(1);
+        }
+        smp = htrace_sampler_create(tracer, cnf);
+        htrace_scope_close(htrace_start_span(tracer, smp, "crashed"));
+        abort();
+    }
+    EXPECT_INT_EQ(pid, waitpid(pid, &status, 0));
+    EXPECT_INT_EQ(1, WIFSIGNALED(status));
+    EXPECT_INT_EQ(SIGABRT, WTERMSIG(status));
+    EXPECT_INT_ZERO(flight_load(dump_path, NULL, NULL, &num_spans));
+    EXPECT_INT_EQ(1, num_spans);
+    EXPECT_INT_ZERO(flight_load(dump_path, NULL, "crashed", &num_spans));
+    EXPECT_INT_EQ(1, num_spans);
+    free(conf_str);
+    free(dump_path);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Check htracer_dump_flight_recorder on a tracer without a flight recorder,
+ * and on one with a flight recorder inside a fanout.
+ */
+static int flight_rcv_find_test(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *dump_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    int num_spans;
+
+    tdir = create_tempdir("flight_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&dump_path, "%s/%s", tdir, "find.dump"));
+    cnf = htrace_conf_from_str(HTRACE_SPAN_RECEIVER_KEY "=noop");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("flight_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    EXPECT_INT_EQ(ENOENT, htracer_dump_flight_recorder(tracer, dump_path));
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s",
+                HTRACE_SPAN_RECEIVER_KEY, "noop,flight",
+                HTRACE_FLIGHT_RCV_PATH_KEY, dump_path));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("flight_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    EXPECT_INT_ZERO(htracer_dump_flight_recorder(tracer, NULL));
+    EXPECT_INT_ZERO(flight_load(dump_path, NULL, NULL, &num_spans));
+    EXPECT_INT_ZERO(num_spans);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(conf_str);
+    free(dump_path);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    int i;
+
+    for (i = 0; g_rtests[i]; i++) {
+        struct rtest *rtest = g_rtests[i];
+        if (flight_rcv_test(rtest) != EXIT_SUCCESS) {
+            fprintf(stderr, "rtest %s failed\n", rtest->name);
+            return EXIT_FAILURE;
+        }
+    }
+    EXPECT_INT_ZERO(flight_rcv_overwrite_test());
+    EXPECT_INT_ZERO(flight_rcv_signal_test());
+    EXPECT_INT_ZERO(flight_rcv_crash_test());
+    EXPECT_INT_ZERO(flight_rcv_find_test());
+
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
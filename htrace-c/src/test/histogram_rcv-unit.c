@@ -0,0 +1,263 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "core/span_id.h"
+#include "receiver/receiver.h"
+#include "test/span_table.h"
+#include "test/span_util.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HISTOGRAM_TEST_SPANS 100
+
+struct histogram_test_thread {
+    struct htracer *tracer;
+    const char *desc;
+    uint64_t dur_us;
+    int num_spans;
+};
+
+/**
+ * Give the span receiver spans with the given description, lasting dur_us,
+ * 2 * dur_us, and so on.
+ */
+static void *histogram_test_add(void *data)
+{
+    struct histogram_test_thread *tt = data;
+    struct htracer *tracer = tt->tracer;
+    struct htrace_span_id span_id;
+    struct htrace_span *span;
+    uint64_t begin_ns = 1400000000000000000ULL;
+    int i;
+
+    for (i = 1; i <= tt->num_spans; i++) {
+        htrace_span_id_generate(&span_id, tracer->rnd, NULL);
+        span = htrace_span_alloc(tt->desc, 0, &span_id);
+        if (!span) {
+            abort();
+        }
+        htrace_span_set_begin_ns(span, begin_ns);
+        htrace_span_set_end_ns(span, begin_ns + (i * tt->dur_us * 1000));
+        tracer->rcv->ty->add_span(tracer->rcv, span);
+        htrace_span_free(span);
+    }
+    return NULL;
+}
+
+static int expect_kv_u64(const struct htrace_span *span, const char *key,
+                         uint64_t min, uint64_t max)
+{
+    const char *val;
+    uint64_t v;
+
+    val = htrace_span_get_kv(span, key);
+    EXPECT_NONNULL(val);
+    v = strtoull(val, NULL, 10);
+    if ((v < min) || (v > max)) {
+        fprintf(stderr, "%s: %s=%" PRIu64 " is not in [%" PRIu64 ", %"
+                PRIu64 "]\n", span->desc, key, v, min, max);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Check that the counts in a histogram.buckets annotation add up.
+ */
+static int expect_bucket_total(const struct htrace_span *span,
+                               uint64_t total)
+{
+    const char *val;
+    char *end;
+    uint64_t low, prev = 0, sum = 0;
+
+    val = htrace_span_get_kv(span, "histogram.buckets");
+    EXPECT_NONNULL(val);
+    while (*val) {
+        low = strtoull(val, &end, 10);
+        EXPECT_INT_EQ(':', *end);
+        EXPECT_INT_EQ(1, (sum == 0) || (low > prev));
+        prev = low;
+        sum += strtoull(end + 1, &end, 10);
+        EXPECT_INT_EQ(1, (*end == ',') || (*end == '\0'));
+        val = (*end == ',') ? end + 1 : end;
+    }
+    EXPECT_UINT64_EQ(total, sum);
+    return EXIT_SUCCESS;
+}
+
+static int histogram_rcv_summary_test(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *local_path, *tdir, *conf_str = NULL, *trid;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_stats stats;
+    struct histogram_test_thread tt;
+    struct span_table *st;
+    struct htrace_span *span;
+    pthread_t thread;
+
+    tdir = create_tempdir("histogram_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&local_path, "%s/%s", tdir, "summary.json"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s",
+                HTRACE_SPAN_RECEIVER_KEY, "histogram",
+                HTRACE_HISTOGRAM_RCV_RECEIVER_KEY, "local.file",
+                HTRACE_LOCAL_FILE_RCV_PATH_KEY, local_path));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("histogram_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    trid = strdup(tracer->trid);
+    EXPECT_NONNULL(trid);
+
+    // 1ms, 2ms, ... 100ms from this thread, and the same again from a
+    // thread which exits before the flush.
+    tt.tracer = tracer;
+    tt.desc = "op.a";
+    tt.dur_us = 1000;
+    tt.num_spans = HISTOGRAM_TEST_SPANS;
+    histogram_test_add(&tt);
+    EXPECT_INT_ZERO(pthread_create(&thread, NULL, histogram_test_add, &tt));
+    EXPECT_INT_ZERO(pthread_join(thread, NULL));
+    tt.desc = "op.b";
+    tt.dur_us = 5;
+    tt.num_spans = 1;
+    histogram_test_add(&tt);
+    tracer->rcv->ty->flush(tracer->rcv);
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ((uint64_t)(2 * HISTOGRAM_TEST_SPANS + 1),
+                     stats.buffered);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+
+    st = span_table_alloc();
+    EXPECT_NONNULL(st);
+    EXPECT_INT_EQ(2, load_trace_span_file(local_path, st));
+    EXPECT_INT_ZERO(span_table_get(st, &span, "op.a", trid));
+    EXPECT_INT_ZERO(expect_kv_u64(span, "histogram.count", 200, 200));
+    EXPECT_INT_ZERO(expect_kv_u64(span, "histogram.min.us", 1000, 1000));
+    EXPECT_INT_ZERO(expect_kv_u64(span, "histogram.max.us", 100000, 100000));
+    EXPECT_INT_ZERO(expect_kv_u64(span, "histogram.mean.us", 50500, 50500));
+    EXPECT_INT_ZERO(expect_kv_u64(span, "histogram.p50.us", 50000, 53125));
+    EXPECT_INT_ZERO(expect_kv_u64(span, "histogram.p90.us", 90000, 95625));
+    EXPECT_INT_ZERO(expect_kv_u64(span, "histogram.p99.us", 99000, 100000));
+    EXPECT_INT_ZERO(expect_kv_u64(span, "histogram.p99.9.us",
+                                  100000, 100000));
+    EXPECT_INT_ZERO(expect_bucket_total(span, 200));
+    EXPECT_INT_ZERO(span_table_get(st, &span, "op.b", trid));
+    EXPECT_INT_ZERO(expect_kv_u64(span, "histogram.count", 1, 1));
+    EXPECT_INT_ZERO(expect_kv_u64(span, "histogram.p50.us", 5, 5));
+    EXPECT_STR_EQ("5:1", htrace_span_get_kv(span, "histogram.buckets"));
+    span_table_free(st);
+    free(trid);
+    free(conf_str);
+    free(local_path);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Check that the summaries are sent every histogram.interval.ms without a
+ * flush.
+ */
+static int histogram_rcv_interval_test(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *local_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct histogram_test_thread tt;
+    struct span_table *st;
+    int i, num_spans = 0;
+
+    tdir = create_tempdir("histogram_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&local_path, "%s/%s", tdir, "interval.json"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s;%s=%d",
+                HTRACE_SPAN_RECEIVER_KEY, "histogram",
+                HTRACE_HISTOGRAM_RCV_RECEIVER_KEY, "local.file",
+                HTRACE_LOCAL_FILE_RCV_PATH_KEY, local_path,
+                HTRACE_HISTOGRAM_RCV_INTERVAL_MS_KEY, 100));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("histogram_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    tt.tracer = tracer;
+    tt.desc = "op.c";
+    tt.dur_us = 10;
+    tt.num_spans = HISTOGRAM_TEST_SPANS;
+    histogram_test_add(&tt);
+    for (i = 0; (i < 1000) && (num_spans <= 0); i++) {
+        usleep(10000);
+        st = span_table_alloc();
+        EXPECT_NONNULL(st);
+        num_spans = load_trace_span_file(local_path, st);
+        span_table_free(st);
+    }
+    EXPECT_INT_EQ(1, num_spans);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(conf_str);
+    free(local_path);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
+static int histogram_rcv_bad_child_test(void)
+{
+    struct htrace_conf *cnf;
+
+    cnf = htrace_conf_from_str(HTRACE_SPAN_RECEIVER_KEY "=histogram;"
+                               HTRACE_HISTOGRAM_RCV_RECEIVER_KEY "=histogram");
+    EXPECT_NONNULL(cnf);
+    EXPECT_NULL(htracer_create("histogram_rcv-unit", cnf));
+    htrace_conf_free(cnf);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    EXPECT_INT_ZERO(histogram_rcv_summary_test());
+    EXPECT_INT_ZERO(histogram_rcv_interval_test());
+    EXPECT_INT_ZERO(histogram_rcv_bad_child_test());
+
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -57,6 +57,88 @@ static void *htable_pop_val(struct htable *ht, void *key)
     return old_val;
 }
 
+static uint32_t collide_hash(const void *key, uint32_t size)
+{
+    return size - 1;
+}
+
+/**
+ * Test that removing an entry doesn't hide entries for other keys which
+ * were displaced past it.
+ */
+static int test_pop_collisions(void)
+{
+    struct htable *ht;
+    uintptr_t i;
+
+    ht = htable_alloc(16, collide_hash, simple_compare);
+    EXPECT_NONNULL(ht);
+    for (i = 1; i <= 5; i++) {
+        EXPECT_INT_ZERO(htable_put(ht, (void*)i, (void*)(100 + i)));
+    }
+    EXPECT_UINTPTR_EQ(101L, (uintptr_t)htable_pop_val(ht, (void*)1));
+    EXPECT_UINTPTR_EQ(103L, (uintptr_t)htable_pop_val(ht, (void*)3));
+    EXPECT_UINTPTR_EQ(102L, (uintptr_t)htable_get(ht, (void*)2));
+    EXPECT_UINTPTR_EQ(104L, (uintptr_t)htable_get(ht, (void*)4));
+    EXPECT_UINTPTR_EQ(105L, (uintptr_t)htable_get(ht, (void*)5));
+    EXPECT_INT_EQ(3, htable_used(ht));
+    htable_free(ht);
+    return EXIT_SUCCESS;
+}
+
+#define NUM_CHURN_KEYS 2000
+
+/**
+ * Test many puts and pops, with keys whose hashes are badly spread, against
+ * what we expect to be in the table.
+ */
+static int test_churn(void)
+{
+    struct htable *ht;
+    uintptr_t i, round;
+
+    ht = htable_alloc(4, simple_hash, simple_compare);
+    EXPECT_NONNULL(ht);
+    for (i = 1; i <= NUM_CHURN_KEYS; i++) {
+        EXPECT_INT_ZERO(htable_put(ht, (void*)(i << 16), (void*)i));
+    }
+    EXPECT_INT_EQ(NUM_CHURN_KEYS, htable_used(ht));
+    for (round = 2; round <= 5; round++) {
+        // Remove every key which is a multiple of this round's number, and
+        // check that everything else can still be found.
+        for (i = round; i <= NUM_CHURN_KEYS; i += round) {
+            htable_pop_val(ht, (void*)(i << 16));
+        }
+        for (i = 1; i <= NUM_CHURN_KEYS; i++) {
+            void *val = htable_get(ht, (void*)(i << 16));
+            int removed = 0;
+            uintptr_t r;
+            for (r = 2; r <= round; r++) {
+                if ((i % r) == 0) {
+                    removed = 1;
+                }
+            }
+            if (removed) {
+                EXPECT_NULL(val);
+            } else {
+                EXPECT_UINTPTR_EQ(i, (uintptr_t)val);
+            }
+        }
+    }
+    // Put the removed keys back.
+    for (i = 1; i <= NUM_CHURN_KEYS; i++) {
+        if (!htable_get(ht, (void*)(i << 16))) {
+            EXPECT_INT_ZERO(htable_put(ht, (void*)(i << 16), (void*)i));
+        }
+    }
+    EXPECT_INT_EQ(NUM_CHURN_KEYS, htable_used(ht));
+    for (i = 1; i <= NUM_CHURN_KEYS; i++) {
+        EXPECT_UINTPTR_EQ(i, (uintptr_t)htable_get(ht, (void*)(i << 16)));
+    }
+    htable_free(ht);
+    return EXIT_SUCCESS;
+}
+
 int main(void)
 {
     struct htable *ht;
@@ -85,6 +167,8 @@ int main(void)
     htable_visit(ht, expect_102, &found_102);
     EXPECT_INT_EQ(1, found_102);
     htable_free(ht);
+    EXPECT_INT_ZERO(test_pop_collisions());
+    EXPECT_INT_ZERO(test_churn());
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,781 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "receiver/receiver.h"
+#include "test/fake_hrpc.h"
+#include "util/cmp.h"
+#include "util/cmp_util.h"
+#include "util/htable.h"
+#include "util/log.h"
+#include "util/rand.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @file htrace-bench.c
+ *
+ * Microbenchmarks for the hot paths of the native client.
+ *
+ * Each benchmark is run with 1, 2, 4, ... threads, up to the number of CPUs
+ * or the -t argument, unless it is single-threaded by nature.  We report the
+ * wall-clock nanoseconds each thread spent per operation, and the number of
+ * heap allocations per operation across all threads.
+ *
+ * Allocations are counted by wrapping malloc and friends at link time, so
+ * only calls made from libhtrace itself and from this file are seen.  Where
+ * the linker can't do that, the allocation column is left out.
+ */
+
+/**
+ * The number of operations each thread does in a normal run.
+ */
+#define BENCH_DEFAULT_ITERS 1000000ULL
+
+/**
+ * The number of operations each thread does with -q, which is used by the
+ * smoke test to check that the benchmarks still run.
+ */
+#define BENCH_QUICK_ITERS 1000ULL
+
+#define BENCH_HTABLE_KEYS 1024
+
+#ifdef HTRACE_BENCH_WRAP_MALLOC
+static __thread uint64_t t_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *str);
+int __real_posix_memalign(void **ptr, size_t align, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    t_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    t_allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    t_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *str)
+{
+    t_allocs++;
+    return __real_strdup(str);
+}
+
+int __wrap_posix_memalign(void **ptr, size_t align, size_t size)
+{
+    t_allocs++;
+    return __real_posix_memalign(ptr, align, size);
+}
+
+#define BENCH_ALLOCS() t_allocs
+#else
+#define BENCH_ALLOCS() 0
+#endif
+
+/**
+ * An operation to measure.
+ *
+ * @param arg       The benchmark's state.
+ * @param idx       The index of the calling thread.
+ * @param iters     The number of times to do the operation.
+ */
+typedef void (*bench_op_fn_t)(void *arg, int idx, uint64_t iters);
+
+struct bench_thread {
+    pthread_t thread;
+    pthread_barrier_t *barrier;
+    bench_op_fn_t op;
+    void *arg;
+    int idx;
+    uint64_t iters;
+    uint64_t elapsed_ns;
+    uint64_t allocs;
+};
+
+static uint64_t g_iters = BENCH_DEFAULT_ITERS;
+
+static int g_max_threads;
+
+static const char *g_filter;
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (((uint64_t)ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void *bench_thread_run(void *data)
+{
+    struct bench_thread *bt = data;
+    uint64_t begin_ns, allocs;
+
+    pthread_barrier_wait(bt->barrier);
+    allocs = BENCH_ALLOCS();
+    begin_ns = bench_now_ns();
+    bt->op(bt->arg, bt->idx, bt->iters);
+    bt->elapsed_ns = bench_now_ns() - begin_ns;
+    bt->allocs = BENCH_ALLOCS() - allocs;
+    return NULL;
+}
+
+/**
+ * Run an operation on some number of threads at once, and print how long it
+ * took.
+ *
+ * @return          0 on success; an error code otherwise.
+ */
+static int bench_run(const char *name, bench_op_fn_t op, void *arg,
+                     int num_threads)
+{
+    struct bench_thread *bts;
+    pthread_barrier_t barrier;
+    uint64_t max_ns = 0, allocs = 0;
+    int i, ret;
+
+    bts = calloc(num_threads, sizeof(*bts));
+    if (!bts) {
+        return ENOMEM;
+    }
+    ret = pthread_barrier_init(&barrier, NULL, num_threads);
+    if (ret) {
+        free(bts);
+        return ret;
+    }
+    for (i = 0; i < num_threads; i++) {
+        bts[i].barrier = &barrier;
+        bts[i].op = op;
+        bts[i].arg = arg;
+        bts[i].idx = i;
+        bts[i].iters = g_iters;
+    }
+    // The first thread is the calling thread, so that single-threaded runs
+    // don't pay for thread creation.
+    for (i = 1; i < num_threads; i++) {
+        ret = pthread_create(&bts[i].thread, NULL, bench_thread_run, &bts[i]);
+        if (ret) {
+            fprintf(stderr, "%s: pthread_create failed: %s\n",
+                    name, strerror(ret));
+            abort();
+        }
+    }
+    bench_thread_run(&bts[0]);
+    for (i = 0; i < num_threads; i++) {
+        if (i > 0) {
+            pthread_join(bts[i].thread, NULL);
+        }
+        if (bts[i].elapsed_ns > max_ns) {
+            max_ns = bts[i].elapsed_ns;
+        }
+        allocs += bts[i].allocs;
+    }
+    pthread_barrier_destroy(&barrier);
+#ifdef HTRACE_BENCH_WRAP_MALLOC
+    printf("%-32s %3d thread(s) %12.1f ns/op %10.3f allocs/op\n",
+           name, num_threads, ((double)max_ns) / g_iters,
+           ((double)allocs) / (g_iters * num_threads));
+#else
+    printf("%-32s %3d thread(s) %12.1f ns/op\n",
+           name, num_threads, ((double)max_ns) / g_iters);
+#endif
+    fflush(stdout);
+    free(bts);
+    return 0;
+}
+
+/**
+ * Run an operation with 1, 2, 4, ... threads.
+ */
+static int bench_run_scaling(const char *name, bench_op_fn_t op, void *arg)
+{
+    int num_threads, ret;
+
+    for (num_threads = 1; ; num_threads *= 2) {
+        if (num_threads > g_max_threads) {
+            num_threads = g_max_threads;
+        }
+        ret = bench_run(name, op, arg, num_threads);
+        if (ret) {
+            return ret;
+        }
+        if (num_threads == g_max_threads) {
+            return 0;
+        }
+    }
+}
+
+static struct htracer *bench_tracer_create(const char *conf_str)
+{
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+
+    cnf = htrace_conf_from_str(conf_str);
+    if (!cnf) {
+        fprintf(stderr, "htrace_conf_from_str(%s) failed.\n", conf_str);
+        return NULL;
+    }
+    tracer = htracer_create("htrace-bench", cnf);
+    htrace_conf_free(cnf);
+    if (!tracer) {
+        fprintf(stderr, "htracer_create(%s) failed.\n", conf_str);
+    }
+    return tracer;
+}
+
+struct bench_start_close {
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+};
+
+static void bench_start_close_op(void *arg, int idx, uint64_t iters)
+{
+    struct bench_start_close *bsc = arg;
+    struct htrace_scope *scope;
+    uint64_t i;
+
+    for (i = 0; i < iters; i++) {
+        scope = htrace_start_span(bsc->tracer, bsc->smp, "bench");
+        htrace_scope_close(scope);
+    }
+}
+
+static int bench_start_close(const char *name, const char *sampler)
+{
+    struct bench_start_close bsc;
+    struct htrace_conf *cnf;
+    char conf_str[128];
+    int ret;
+
+    snprintf(conf_str, sizeof(conf_str), HTRACE_SPAN_RECEIVER_KEY "=noop;"
+             HTRACE_SAMPLER_KEY "=%s", sampler);
+    bsc.tracer = bench_tracer_create(conf_str);
+    if (!bsc.tracer) {
+        return EINVAL;
+    }
+    cnf = htrace_conf_from_str(conf_str);
+    if (!cnf) {
+        htracer_free(bsc.tracer);
+        return ENOMEM;
+    }
+    bsc.smp = htrace_sampler_create(bsc.tracer, cnf);
+    htrace_conf_free(cnf);
+    if (!bsc.smp) {
+        htracer_free(bsc.tracer);
+        return ENOMEM;
+    }
+    ret = bench_run_scaling(name, bench_start_close_op, &bsc);
+    htrace_sampler_free(bsc.smp);
+    htracer_free(bsc.tracer);
+    return ret;
+}
+
+static int bench_start_close_always(void)
+{
+    return bench_start_close("start_close/always", "always");
+}
+
+static int bench_start_close_never(void)
+{
+    return bench_start_close("start_close/never", "never");
+}
+
+/**
+ * Make a span which looks like a typical one, with a parent, a couple of
+ * annotations and an event.
+ */
+static struct htrace_span *bench_span_alloc(void)
+{
+    struct htrace_span *span;
+    struct htrace_span_id id, pid;
+
+    id.high = 0xfeedface12345678ULL;
+    id.low = 0x0123456789abcdefULL;
+    span = htrace_span_alloc("DFSOutputStream#writeChunk", 1456789012345ULL,
+                             &id);
+    if (!span) {
+        return NULL;
+    }
+    pid = id;
+    pid.low++;
+    htrace_span_add_parent(span, &pid);
+    span->end_ms = span->begin_ms + 12;
+    span->trid = strdup("htrace-bench/127.0.0.1");
+    if ((!span->trid) ||
+            htrace_span_add_kv(span, "path", "/user/hdfs/data/part-00000") ||
+            htrace_span_add_kv(span, "bytes", "65536") ||
+            htrace_span_add_event(span, span->begin_ms + 3, "packet sent")) {
+        htrace_span_free(span);
+        return NULL;
+    }
+    return span;
+}
+
+struct bench_serialize {
+    struct htrace_span *span;
+    char *buf;
+    size_t len;
+};
+
+static void bench_msgpack_op(void *arg, int idx, uint64_t iters)
+{
+    struct bench_serialize *bs = arg;
+    struct cmp_bcopy_ctx bctx;
+    uint64_t i;
+
+    for (i = 0; i < iters; i++) {
+        cmp_bcopy_ctx_init(&bctx, bs->buf, bs->len);
+        if (!span_write_msgpack(bs->span, (cmp_ctx_t *)&bctx)) {
+            abort();
+        }
+    }
+}
+
+static void bench_json_op(void *arg, int idx, uint64_t iters)
+{
+    struct bench_serialize *bs = arg;
+    uint64_t i;
+
+    for (i = 0; i < iters; i++) {
+        span_json_sprintf(bs->span, (int)bs->len, bs->buf);
+    }
+}
+
+static int bench_serialize(const char *name, bench_op_fn_t op)
+{
+    struct bench_serialize bs;
+    int ret;
+
+    bs.span = bench_span_alloc();
+    if (!bs.span) {
+        return ENOMEM;
+    }
+    bs.len = span_json_size(bs.span);
+    if (bs.len < span_msgpack_size(bs.span)) {
+        bs.len = span_msgpack_size(bs.span);
+    }
+    bs.buf = malloc(bs.len);
+    if (!bs.buf) {
+        htrace_span_free(bs.span);
+        return ENOMEM;
+    }
+    ret = bench_run(name, op, &bs, 1);
+    free(bs.buf);
+    htrace_span_free(bs.span);
+    return ret;
+}
+
+static int bench_span_write_msgpack(void)
+{
+    return bench_serialize("span_write_msgpack", bench_msgpack_op);
+}
+
+static int bench_span_json_sprintf(void)
+{
+    return bench_serialize("span_json_sprintf", bench_json_op);
+}
+
+struct bench_htable {
+    struct htable *ht;
+    char *keys[BENCH_HTABLE_KEYS];
+};
+
+static void bench_htable_get_op(void *arg, int idx, uint64_t iters)
+{
+    struct bench_htable *bh = arg;
+    uint64_t i;
+
+    for (i = 0; i < iters; i++) {
+        if (!htable_get(bh->ht, bh->keys[i % BENCH_HTABLE_KEYS])) {
+            abort();
+        }
+    }
+}
+
+static void bench_htable_put_pop_op(void *arg, int idx, uint64_t iters)
+{
+    struct bench_htable *bh = arg;
+    void *key, *val;
+    uint64_t i;
+
+    for (i = 0; i < iters; i++) {
+        key = bh->keys[i % BENCH_HTABLE_KEYS];
+        htable_pop(bh->ht, key, &key, &val);
+        if (htable_put(bh->ht, key, val)) {
+            abort();
+        }
+    }
+}
+
+static int bench_htable(const char *name, bench_op_fn_t op)
+{
+    struct bench_htable bh;
+    char key[32];
+    int i, ret = ENOMEM;
+
+    memset(&bh, 0, sizeof(bh));
+    bh.ht = htable_alloc(BENCH_HTABLE_KEYS * 2, ht_hash_string,
+                         ht_compare_string);
+    if (!bh.ht) {
+        return ENOMEM;
+    }
+    for (i = 0; i < BENCH_HTABLE_KEYS; i++) {
+        snprintf(key, sizeof(key), "description.%d", i);
+        bh.keys[i] = strdup(key);
+        if (!bh.keys[i]) {
+            goto done;
+        }
+        if (htable_put(bh.ht, bh.keys[i], bh.keys[i])) {
+            goto done;
+        }
+    }
+    // The hash table is not thread-safe, so this is single-threaded.
+    ret = bench_run(name, op, &bh, 1);
+done:
+    htable_free(bh.ht);
+    for (i = 0; i < BENCH_HTABLE_KEYS; i++) {
+        free(bh.keys[i]);
+    }
+    return ret;
+}
+
+static int bench_htable_get(void)
+{
+    return bench_htable("htable_get", bench_htable_get_op);
+}
+
+static int bench_htable_put_pop(void)
+{
+    return bench_htable("htable_pop_put", bench_htable_put_pop_op);
+}
+
+static volatile uint64_t g_bench_sink;
+
+static void bench_random_u64_op(void *arg, int idx, uint64_t iters)
+{
+    struct random_src *rnd = arg;
+    uint64_t i, total = 0;
+
+    for (i = 0; i < iters; i++) {
+        total += random_u64(rnd);
+    }
+    g_bench_sink += total;
+}
+
+static int bench_random_u64(void)
+{
+    struct htrace_conf *cnf;
+    struct htrace_log *lg;
+    struct random_src *rnd;
+    int ret;
+
+    cnf = htrace_conf_from_str("");
+    if (!cnf) {
+        return ENOMEM;
+    }
+    lg = htrace_log_alloc(cnf);
+    htrace_conf_free(cnf);
+    if (!lg) {
+        return ENOMEM;
+    }
+    rnd = random_src_alloc(lg);
+    if (!rnd) {
+        htrace_log_free(lg);
+        return ENOMEM;
+    }
+    ret = bench_run_scaling("random_u64", bench_random_u64_op, rnd);
+    random_src_free(rnd);
+    htrace_log_free(lg);
+    return ret;
+}
+
+/**
+ * A UDP socket which stands in for htraced, and a thread which throws away
+ * whatever is sent to it.
+ */
+struct bench_sink {
+    int fd;
+    int port;
+    pthread_t thread;
+};
+
+static void *bench_sink_run(void *data)
+{
+    struct bench_sink *sink = data;
+    char buf[65536];
+
+    while (recv(sink->fd, buf, sizeof(buf), 0) > 0) {
+        ;
+    }
+    return NULL;
+}
+
+static int bench_sink_start(struct bench_sink *sink)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int ret;
+
+    sink->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sink->fd < 0) {
+        return errno;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((bind(sink->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+            (getsockname(sink->fd, (struct sockaddr *)&addr,
+                         &addr_len) < 0)) {
+        ret = errno;
+        close(sink->fd);
+        return ret;
+    }
+    sink->port = ntohs(addr.sin_port);
+    ret = pthread_create(&sink->thread, NULL, bench_sink_run, sink);
+    if (ret) {
+        close(sink->fd);
+        return ret;
+    }
+    return 0;
+}
+
+static void bench_sink_stop(struct bench_sink *sink)
+{
+    // Shutting down the socket wakes up the thread blocked in recv.
+    shutdown(sink->fd, SHUT_RDWR);
+    pthread_join(sink->thread, NULL);
+    close(sink->fd);
+}
+
+struct bench_htraced {
+    struct htrace_rcv *rcv;
+    struct htrace_span **spans;
+};
+
+static void bench_htraced_op(void *arg, int idx, uint64_t iters)
+{
+    struct bench_htraced *bh = arg;
+    struct htrace_span *span = bh->spans[idx];
+    uint64_t i;
+
+    for (i = 0; i < iters; i++) {
+        bh->rcv->ty->add_span(bh->rcv, span);
+    }
+}
+
+/**
+ * Add spans to an htraced receiver with the given configuration, from as
+ * many threads as we are scaling to.
+ */
+static int bench_htraced(const char *name, const char *conf_str)
+{
+    struct bench_htraced bh;
+    struct htracer *tracer;
+    int i, ret;
+
+    tracer = bench_tracer_create(conf_str);
+    if (!tracer) {
+        return EINVAL;
+    }
+    bh.rcv = tracer->rcv;
+    bh.spans = calloc(g_max_threads, sizeof(bh.spans[0]));
+    ret = ENOMEM;
+    if (!bh.spans) {
+        goto done;
+    }
+    for (i = 0; i < g_max_threads; i++) {
+        bh.spans[i] = bench_span_alloc();
+        if (!bh.spans[i]) {
+            goto done;
+        }
+    }
+    ret = bench_run_scaling(name, bench_htraced_op, &bh);
+done:
+    htracer_free(tracer);
+    if (bh.spans) {
+        for (i = 0; i < g_max_threads; i++) {
+            htrace_span_free(bh.spans[i]);
+        }
+        free(bh.spans);
+    }
+    return ret;
+}
+
+static int bench_htraced_add_span(void)
+{
+    struct bench_sink sink;
+    char conf_str[256];
+    int ret;
+
+    ret = bench_sink_start(&sink);
+    if (ret) {
+        fprintf(stderr, "htraced_add_span: failed to start the sink: %s\n",
+                strerror(ret));
+        return ret;
+    }
+    snprintf(conf_str, sizeof(conf_str),
+             HTRACE_SPAN_RECEIVER_KEY "=htraced;"
+             HTRACED_ADDRESS_KEY "=127.0.0.1:%d;"
+             HTRACED_TRANSPORT_KEY "=datagram;"
+             HTRACE_LOG_LEVEL_KEY "=error", sink.port);
+    ret = bench_htraced("htraced_add_span/datagram", conf_str);
+    bench_sink_stop(&sink);
+    return ret;
+}
+
+/**
+ * Add spans to an htraced receiver which sends them over HRPC to an
+ * in-process fake server, so that we measure only the client.
+ */
+static int bench_htraced_add_span_hrpc(void)
+{
+    struct fake_hrpc_opts opts;
+    struct fake_hrpc *fh = NULL;
+    char conf_str[256], err[512];
+    int ret;
+
+    memset(&opts, 0, sizeof(opts));
+    fake_hrpc_start(&opts, &fh, err, sizeof(err));
+    if (err[0]) {
+        fprintf(stderr, "htraced_add_span: failed to start the fake HRPC "
+                "server: %s\n", err);
+        return EIO;
+    }
+    snprintf(conf_str, sizeof(conf_str),
+             HTRACE_SPAN_RECEIVER_KEY "=htraced;"
+             HTRACED_ADDRESS_KEY "=%s;"
+             HTRACE_LOG_LEVEL_KEY "=error", fake_hrpc_get_addr(fh));
+    ret = bench_htraced("htraced_add_span/hrpc", conf_str);
+    fake_hrpc_free(fh);
+    return ret;
+}
+
+struct bench {
+    const char *name;
+    int (*run)(void);
+};
+
+static const struct bench g_benches[] = {
+    { "start_close/always", bench_start_close_always },
+    { "start_close/never", bench_start_close_never },
+    { "span_write_msgpack", bench_span_write_msgpack },
+    { "span_json_sprintf", bench_span_json_sprintf },
+    { "htable_get", bench_htable_get },
+    { "htable_pop_put", bench_htable_put_pop },
+    { "random_u64", bench_random_u64 },
+    { "htraced_add_span/datagram", bench_htraced_add_span },
+    { "htraced_add_span/hrpc", bench_htraced_add_span_hrpc },
+};
+
+static void usage(void)
+{
+    fprintf(stderr,
+"htrace-bench: microbenchmarks for the HTrace native client.\n"
+"\n"
+"Usage: htrace-bench [options] [filter]\n"
+"\n"
+"Runs the benchmarks whose names contain the filter string, or all of them\n"
+"if there is no filter.\n"
+"\n"
+"Options:\n"
+"    -h             Show this help message.\n"
+"    -n <iters>     The number of operations each thread does.  The default\n"
+"                       is %llu.\n"
+"    -q             Do only %llu operations per thread, to check that the\n"
+"                       benchmarks run.\n"
+"    -t <threads>   The most threads to use.  The default is the number of\n"
+"                       CPUs.\n",
+            BENCH_DEFAULT_ITERS, BENCH_QUICK_ITERS);
+}
+
+int main(int argc, char **argv)
+{
+    size_t i;
+    int c, ret;
+    long ncpus;
+
+    while ((c = getopt(argc, argv, "hn:qt:")) != -1) {
+        switch (c) {
+        case 'n':
+            g_iters = strtoull(optarg, NULL, 10);
+            break;
+        case 'q':
+            g_iters = BENCH_QUICK_ITERS;
+            break;
+        case 't':
+            g_max_threads = atoi(optarg);
+            break;
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc) {
+        g_filter = argv[optind];
+    }
+    if (g_iters == 0) {
+        fprintf(stderr, "The number of operations must be positive.\n");
+        return EXIT_FAILURE;
+    }
+    if (g_max_threads <= 0) {
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        g_max_threads = (ncpus > 0) ? (int)ncpus : 1;
+    }
+    for (i = 0; i < sizeof(g_benches) / sizeof(g_benches[0]); i++) {
+        if (g_filter && (!strstr(g_benches[i].name, g_filter))) {
+            continue;
+        }
+        ret = g_benches[i].run();
+        if (ret) {
+            fprintf(stderr, "%s failed: %s\n", g_benches[i].name,
+                    strerror(ret));
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
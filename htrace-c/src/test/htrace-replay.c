@@ -0,0 +1,902 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/span.h"
+#include "receiver/hrpc.h"
+#include "receiver/local_binfile.h"
+#include "test/fake_hrpc.h"
+#include "test/span_util.h"
+#include "util/cmp_util.h"
+#include "util/log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @file htrace-replay.c
+ *
+ * Replays captured spans to an htraced server, to find out how much load it
+ * can take.
+ *
+ * The spans are read from files written by the local.file receiver (one JSON
+ * span per line), or by the local.binfile receiver.  They are sorted by begin
+ * time, cut into WriteSpans requests, and sent over HRPC from several
+ * connections at once, each with several requests in flight.  The requests
+ * can be paced to follow the begin times of the spans, sped up or slowed down
+ * by a multiplier, or sent as fast as the server will take them.
+ *
+ * Afterwards we report the throughput which the server acknowledged, and the
+ * latency of its responses.
+ */
+
+#define REPLAY_DEFAULT_BATCH 1000
+
+#define REPLAY_DEFAULT_WINDOW 4
+
+#define REPLAY_DEFAULT_TRID "htrace-replay"
+
+#define REPLAY_TIMEO_MS 60000
+
+/**
+ * A loaded span.  The serialized span is in the load buffer.
+ */
+struct replay_span {
+    uint64_t begin_ms;
+    uint64_t off;
+    uint64_t len;
+};
+
+/**
+ * A WriteSpans request's worth of spans.
+ */
+struct replay_batch {
+    const uint8_t *buf;
+    uint64_t len;
+    uint64_t num_spans;
+
+    /**
+     * When to send the batch, relative to the start of the replay.
+     */
+    uint64_t due_ns;
+};
+
+struct replay_opts {
+    const char *addr;
+    int fake;
+    uint64_t batch_size;
+    int num_conns;
+    int window;
+    double rate_mult;
+    uint64_t loops;
+    const char *trid;
+};
+
+struct replay {
+    struct replay_opts opts;
+    struct htrace_log *lg;
+
+    /**
+     * The serialized spans, in the order we loaded them.  Malloced.
+     */
+    uint8_t *load_buf;
+    uint64_t load_len;
+    uint64_t load_cap;
+
+    /**
+     * The spans we loaded.  Malloced.
+     */
+    struct replay_span *spans;
+    uint64_t num_spans;
+    uint64_t spans_cap;
+
+    /**
+     * The serialized spans, sorted by begin time.  Malloced.
+     */
+    uint8_t *buf;
+
+    /**
+     * The batches to send.  Malloced.
+     */
+    struct replay_batch *batches;
+    uint64_t num_batches;
+
+    /**
+     * How long one pass over the batches lasts, when pacing.
+     */
+    uint64_t loop_ns;
+
+    /**
+     * The monotonic time at which the replay started.
+     */
+    uint64_t begin_ns;
+
+    /**
+     * The index of the next batch to send, counting every loop.  Shared by
+     * all of the connection threads.
+     */
+    uint64_t next;
+};
+
+/**
+ * A request which is waiting for its response.
+ */
+struct replay_inflight {
+    uint64_t seq;
+    uint64_t send_ns;
+    uint64_t num_spans;
+    uint64_t len;
+};
+
+struct replay_thread {
+    pthread_t thread;
+    struct replay *rp;
+    struct hrpc_client *hcli;
+
+    /**
+     * The latencies of the requests which got a response.  Malloced.
+     */
+    uint64_t *lat_ns;
+    uint64_t num_lat;
+    uint64_t lat_cap;
+
+    uint64_t reqs;
+    uint64_t acked_spans;
+    uint64_t acked_bytes;
+    uint64_t errors;
+    uint64_t failed;
+    int oom;
+};
+
+static uint64_t replay_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (((uint64_t)ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void replay_sleep_until(uint64_t when_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = when_ns / 1000000000ULL;
+    ts.tv_nsec = when_ns % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR) {
+        ;
+    }
+}
+
+/**
+ * Add a serialized span to the load buffer.
+ *
+ * @return      0 on success; 1 if the span could not be parsed; ENOMEM on
+ *                  OOM.
+ */
+static int replay_add_span(struct replay *rp, const uint8_t *span,
+                           uint64_t len)
+{
+    struct htrace_span_reader *rd;
+    struct htrace_span_view view;
+    struct replay_span *spans;
+    uint8_t *buf;
+    uint64_t cap;
+    int res;
+
+    rd = htrace_span_reader_alloc(span, len);
+    if (!rd) {
+        return ENOMEM;
+    }
+    res = htrace_span_reader_next(rd, &view);
+    if ((res == 1) && (htrace_span_reader_offset(rd) != len)) {
+        res = 0;
+    }
+    htrace_span_reader_free(rd);
+    if (res != 1) {
+        return 1;
+    }
+    if (rp->load_len + len > rp->load_cap) {
+        cap = rp->load_cap ? (rp->load_cap * 2) : (1024 * 1024);
+        while (cap < rp->load_len + len) {
+            cap *= 2;
+        }
+        buf = realloc(rp->load_buf, cap);
+        if (!buf) {
+            return ENOMEM;
+        }
+        rp->load_buf = buf;
+        rp->load_cap = cap;
+    }
+    if (rp->num_spans == rp->spans_cap) {
+        cap = rp->spans_cap ? (rp->spans_cap * 2) : 1024;
+        spans = realloc(rp->spans, cap * sizeof(rp->spans[0]));
+        if (!spans) {
+            return ENOMEM;
+        }
+        rp->spans = spans;
+        rp->spans_cap = cap;
+    }
+    memcpy(rp->load_buf + rp->load_len, span, len);
+    rp->spans[rp->num_spans].begin_ms = view.begin_ms;
+    rp->spans[rp->num_spans].off = rp->load_len;
+    rp->spans[rp->num_spans].len = len;
+    rp->num_spans++;
+    rp->load_len += len;
+    return 0;
+}
+
+static uint64_t replay_get_be32(const uint8_t *buf)
+{
+    return (((uint64_t)buf[0]) << 24) | (((uint64_t)buf[1]) << 16) |
+        (((uint64_t)buf[2]) << 8) | buf[3];
+}
+
+/**
+ * Load the spans in a file written by the local.binfile receiver.  We walk
+ * the block footers backwards from the end of the file.
+ */
+static int replay_load_binfile(struct replay *rp, const char *path,
+                               const uint8_t *buf, uint64_t len)
+{
+    struct local_binfile_footer ftr;
+    uint64_t end = len, start, off, rec_len;
+    int res;
+
+    while (end > 0) {
+        if ((end < LOCAL_BINFILE_FOOTER_LEN) ||
+                (!local_binfile_footer_decode(buf + end -
+                        LOCAL_BINFILE_FOOTER_LEN, &ftr)) ||
+                (ftr.data_len > end - LOCAL_BINFILE_FOOTER_LEN)) {
+            fprintf(stderr, "%s: bad block footer ending at offset %" PRIu64
+                    ".\n", path, end);
+            return EINVAL;
+        }
+        start = end - LOCAL_BINFILE_FOOTER_LEN - ftr.data_len;
+        off = start;
+        while (off < start + ftr.data_len) {
+            if (off + LOCAL_BINFILE_REC_HDR_LEN > start + ftr.data_len) {
+                fprintf(stderr, "%s: torn record at offset %" PRIu64 ".\n",
+                        path, off);
+                return EINVAL;
+            }
+            rec_len = replay_get_be32(buf + off);
+            off += LOCAL_BINFILE_REC_HDR_LEN;
+            if (rec_len > start + ftr.data_len - off) {
+                fprintf(stderr, "%s: torn record at offset %" PRIu64 ".\n",
+                        path, off);
+                return EINVAL;
+            }
+            res = replay_add_span(rp, buf + off, rec_len);
+            if (res == ENOMEM) {
+                return res;
+            } else if (res) {
+                fprintf(stderr, "%s: bad span at offset %" PRIu64 ".\n",
+                        path, off);
+                return EINVAL;
+            }
+            off += rec_len;
+        }
+        end = start;
+    }
+    return 0;
+}
+
+/**
+ * Load the spans in a file written by the local.file receiver.  Each line
+ * is one span, in JSON.  We serialize each one to msgpack.
+ */
+static int replay_load_json(struct replay *rp, const char *path)
+{
+    char *line = NULL, err[512];
+    size_t line_cap = 0;
+    struct htrace_span *span;
+    struct cmp_bcopy_ctx bctx;
+    uint8_t *mbuf = NULL;
+    uint64_t mlen, mcap = 0;
+    int lineno = 0, ret = 0;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        ret = errno;
+        fprintf(stderr, "failed to open %s: %s\n", path, terror(ret));
+        return ret;
+    }
+    while (getline(&line, &line_cap, fp) > 0) {
+        lineno++;
+        if (line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        span_json_parse(line, &span, err, sizeof(err));
+        if (err[0]) {
+            fprintf(stderr, "%s:%d: failed to parse span: %s\n",
+                    path, lineno, err);
+            ret = EINVAL;
+            break;
+        }
+        mlen = span_msgpack_size(span);
+        if (mlen > mcap) {
+            free(mbuf);
+            mcap = mlen;
+            mbuf = malloc(mcap);
+            if (!mbuf) {
+                htrace_span_free(span);
+                ret = ENOMEM;
+                break;
+            }
+        }
+        cmp_bcopy_ctx_init(&bctx, mbuf, mlen);
+        if (!span_write_msgpack(span, (struct cmp_ctx_s *)&bctx)) {
+            fprintf(stderr, "%s:%d: failed to serialize span.\n",
+                    path, lineno);
+            htrace_span_free(span);
+            ret = EINVAL;
+            break;
+        }
+        htrace_span_free(span);
+        ret = replay_add_span(rp, mbuf, bctx.off);
+        if (ret) {
+            if (ret != ENOMEM) {
+                fprintf(stderr, "%s:%d: failed to read back span.\n",
+                        path, lineno);
+                ret = EINVAL;
+            }
+            break;
+        }
+    }
+    if ((!ret) && ferror(fp)) {
+        ret = errno;
+        fprintf(stderr, "error reading from %s: %s\n", path, terror(ret));
+    }
+    fclose(fp);
+    free(mbuf);
+    free(line);
+    return ret;
+}
+
+/**
+ * Load the spans in a file.  JSON files start with a brace; anything else
+ * is taken to be a local.binfile file.
+ */
+static int replay_load(struct replay *rp, const char *path)
+{
+    struct stat st;
+    uint8_t *buf;
+    size_t ws;
+    int fd, ret;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        ret = errno;
+        fprintf(stderr, "failed to open %s: %s\n", path, terror(ret));
+        return ret;
+    }
+    if (fstat(fd, &st) < 0) {
+        ret = errno;
+        fprintf(stderr, "failed to stat %s: %s\n", path, terror(ret));
+        close(fd);
+        return ret;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        ret = errno;
+        fprintf(stderr, "failed to mmap %s: %s\n", path, terror(ret));
+        return ret;
+    }
+    for (ws = 0; (ws < (size_t)st.st_size) && strchr(" \t\r\n", buf[ws]) &&
+            buf[ws]; ws++) {
+        ;
+    }
+    if ((ws < (size_t)st.st_size) && (buf[ws] == '{')) {
+        munmap(buf, st.st_size);
+        return replay_load_json(rp, path);
+    }
+    ret = replay_load_binfile(rp, path, buf, st.st_size);
+    munmap(buf, st.st_size);
+    return ret;
+}
+
+static int replay_span_compare(const void *a, const void *b)
+{
+    const struct replay_span *sa = a, *sb = b;
+
+    if (sa->begin_ms != sb->begin_ms) {
+        return (sa->begin_ms < sb->begin_ms) ? -1 : 1;
+    }
+    // Keep spans which began in the same millisecond in file order.
+    if (sa->off != sb->off) {
+        return (sa->off < sb->off) ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Sort the spans by begin time, and cut them into batches.
+ */
+static int replay_build_batches(struct replay *rp)
+{
+    struct replay_batch *b;
+    uint64_t i, off = 0, first_ms, last_ms;
+    double mult = rp->opts.rate_mult;
+
+    qsort(rp->spans, rp->num_spans, sizeof(rp->spans[0]),
+          replay_span_compare);
+    rp->buf = malloc(rp->load_len);
+    rp->num_batches = (rp->num_spans + rp->opts.batch_size - 1) /
+        rp->opts.batch_size;
+    rp->batches = calloc(rp->num_batches, sizeof(rp->batches[0]));
+    if ((!rp->buf) || (!rp->batches)) {
+        return ENOMEM;
+    }
+    first_ms = rp->spans[0].begin_ms;
+    last_ms = rp->spans[rp->num_spans - 1].begin_ms;
+    for (i = 0; i < rp->num_spans; i++) {
+        b = &rp->batches[i / rp->opts.batch_size];
+        if (b->num_spans == 0) {
+            b->buf = rp->buf + off;
+            if (mult > 0) {
+                b->due_ns = (uint64_t)(((rp->spans[i].begin_ms - first_ms) *
+                                        1000000.0) / mult);
+            }
+        }
+        memcpy(rp->buf + off, rp->load_buf + rp->spans[i].off,
+               rp->spans[i].len);
+        off += rp->spans[i].len;
+        b->len += rp->spans[i].len;
+        b->num_spans++;
+    }
+    if (mult > 0) {
+        rp->loop_ns = (uint64_t)(((last_ms - first_ms + 1) * 1000000.0) /
+                                 mult);
+    }
+    free(rp->load_buf);
+    rp->load_buf = NULL;
+    return 0;
+}
+
+static void replay_count_latency(struct replay_thread *rt, uint64_t lat_ns)
+{
+    uint64_t *lat, cap;
+
+    if (rt->num_lat == rt->lat_cap) {
+        cap = rt->lat_cap ? (rt->lat_cap * 2) : 1024;
+        lat = realloc(rt->lat_ns, cap * sizeof(rt->lat_ns[0]));
+        if (!lat) {
+            rt->oom = 1;
+            return;
+        }
+        rt->lat_ns = lat;
+        rt->lat_cap = cap;
+    }
+    rt->lat_ns[rt->num_lat++] = lat_ns;
+}
+
+/**
+ * Handle the next response on a connection.
+ *
+ * @return      1 if we got a response; 0 if the connection failed;
+ *                  HRPC_RECV_AGAIN if only part of the response has arrived.
+ */
+static int replay_recv(struct replay_thread *rt,
+                       struct replay_inflight *win, int *num_out)
+{
+    const char *err = NULL;
+    const void *resp;
+    size_t resp_len;
+    uint64_t seq = 0;
+    int i, res;
+
+    res = hrpc_client_recv(rt->hcli, METHOD_ID_WRITE_SPANS, &seq, &err,
+                           &resp, &resp_len);
+    if (res != 1) {
+        return res;
+    }
+    for (i = 0; i < *num_out; i++) {
+        if (win[i].seq == seq) {
+            break;
+        }
+    }
+    if (i == *num_out) {
+        fprintf(stderr, "%s: got a response for unknown sequence ID "
+                "%" PRIu64 ".\n", hrpc_client_get_endpoint(rt->hcli), seq);
+        hrpc_client_close(rt->hcli);
+        return 0;
+    }
+    replay_count_latency(rt, replay_now_ns() - win[i].send_ns);
+    if (err) {
+        rt->errors++;
+    } else {
+        rt->acked_spans += win[i].num_spans;
+        rt->acked_bytes += win[i].len;
+    }
+    win[i] = win[--(*num_out)];
+    return 1;
+}
+
+static void *replay_thread_run(void *data)
+{
+    struct replay_thread *rt = data;
+    struct replay *rp = rt->rp;
+    struct replay_inflight *win;
+    struct replay_batch *b = NULL;
+    uint8_t prequel[MAX_WRITESPANS_PREQUEL_LEN];
+    uint64_t total, idx, due_ns = 0, now_ns, timeo_ms, seq;
+    int num_out = 0, prequel_len, ready, res, waiting, done = 0;
+
+    win = calloc(rp->opts.window, sizeof(win[0]));
+    if (!win) {
+        rt->oom = 1;
+        return NULL;
+    }
+    total = rp->num_batches * rp->opts.loops;
+    while (1) {
+        // Send batches until the window is full, or the next one isn't due
+        // yet.
+        while ((num_out < rp->opts.window) && (!done)) {
+            if (!b) {
+                idx = __atomic_fetch_add(&rp->next, 1, __ATOMIC_RELAXED);
+                if (idx >= total) {
+                    done = 1;
+                    break;
+                }
+                b = &rp->batches[idx % rp->num_batches];
+                due_ns = rp->begin_ns + b->due_ns +
+                    ((idx / rp->num_batches) * rp->loop_ns);
+            }
+            now_ns = replay_now_ns();
+            if (due_ns > now_ns) {
+                if (num_out > 0) {
+                    break;
+                }
+                replay_sleep_until(due_ns);
+            }
+            prequel_len = hrpc_write_spans_prequel(rp->opts.trid,
+                                                   b->num_spans, prequel);
+            if (prequel_len < 0) {
+                rt->failed++;
+                b = NULL;
+                continue;
+            }
+            rt->reqs++;
+            if (!hrpc_client_send(rt->hcli, METHOD_ID_WRITE_SPANS,
+                                  prequel, prequel_len, b->buf, b->len,
+                                  &seq)) {
+                // The connection was closed, and the requests in flight on
+                // it are lost.  The next send reconnects.
+                rt->failed += num_out + 1;
+                num_out = 0;
+                b = NULL;
+                continue;
+            }
+            win[num_out].seq = seq;
+            win[num_out].send_ns = replay_now_ns();
+            win[num_out].num_spans = b->num_spans;
+            win[num_out].len = prequel_len + b->len;
+            num_out++;
+            b = NULL;
+        }
+        if (num_out == 0) {
+            if (done) {
+                break;
+            }
+            continue;
+        }
+        // Wait for a response, or for the next batch to be due.
+        waiting = (b && (num_out < rp->opts.window));
+        timeo_ms = REPLAY_TIMEO_MS;
+        if (waiting) {
+            now_ns = replay_now_ns();
+            timeo_ms = (due_ns > now_ns) ?
+                (((due_ns - now_ns) / 1000000ULL) + 1) : 0;
+        }
+        res = hrpc_client_poll(&rt->hcli, &ready, 1, -1, timeo_ms);
+        if ((res == 0) && waiting) {
+            continue;
+        }
+        if (res > 0) {
+            res = replay_recv(rt, win, &num_out);
+            if (res != 0) {
+                continue;
+            }
+        } else {
+            fprintf(stderr, "%s: timed out waiting for a response.\n",
+                    hrpc_client_get_endpoint(rt->hcli));
+            hrpc_client_close(rt->hcli);
+        }
+        rt->failed += num_out;
+        num_out = 0;
+    }
+    free(win);
+    return NULL;
+}
+
+static int replay_u64_compare(const void *a, const void *b)
+{
+    uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+
+    return (ua < ub) ? -1 : ((ua > ub) ? 1 : 0);
+}
+
+static double replay_percentile_ms(const uint64_t *lat, uint64_t num,
+                                   double pct)
+{
+    uint64_t i;
+
+    if (num == 0) {
+        return 0;
+    }
+    i = (uint64_t)(num * pct);
+    if (i >= num) {
+        i = num - 1;
+    }
+    return lat[i] / 1000000.0;
+}
+
+static int replay_report(struct replay *rp, struct replay_thread *rts,
+                         uint64_t elapsed_ns)
+{
+    uint64_t reqs = 0, spans = 0, bytes = 0, errors = 0, failed = 0;
+    uint64_t num_lat = 0, *lat, off = 0;
+    double secs = elapsed_ns / 1e9;
+    int i;
+
+    for (i = 0; i < rp->opts.num_conns; i++) {
+        reqs += rts[i].reqs;
+        spans += rts[i].acked_spans;
+        bytes += rts[i].acked_bytes;
+        errors += rts[i].errors;
+        failed += rts[i].failed;
+        num_lat += rts[i].num_lat;
+    }
+    lat = malloc((num_lat ? num_lat : 1) * sizeof(lat[0]));
+    if (!lat) {
+        fprintf(stderr, "OOM\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < rp->opts.num_conns; i++) {
+        memcpy(lat + off, rts[i].lat_ns, rts[i].num_lat * sizeof(lat[0]));
+        off += rts[i].num_lat;
+    }
+    qsort(lat, num_lat, sizeof(lat[0]), replay_u64_compare);
+    printf("connections:          %d\n", rp->opts.num_conns);
+    printf("duration:             %.3f s\n", secs);
+    printf("requests:             %" PRIu64 "\n", reqs);
+    printf("  server errors:      %" PRIu64 "\n", errors);
+    printf("  failed:             %" PRIu64 "\n", failed);
+    printf("spans acked:          %" PRIu64 " of %" PRIu64 "\n", spans,
+           rp->num_spans * rp->opts.loops);
+    printf("spans/sec:            %.1f\n", spans / secs);
+    printf("requests/sec:         %.1f\n", num_lat / secs);
+    printf("MB/sec:               %.3f\n", bytes / secs / (1024 * 1024));
+    printf("latency p50:          %.3f ms\n",
+           replay_percentile_ms(lat, num_lat, 0.50));
+    printf("latency p99:          %.3f ms\n",
+           replay_percentile_ms(lat, num_lat, 0.99));
+    printf("latency p999:         %.3f ms\n",
+           replay_percentile_ms(lat, num_lat, 0.999));
+    printf("latency max:          %.3f ms\n",
+           replay_percentile_ms(lat, num_lat, 1.0));
+    free(lat);
+    return (errors || failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int replay_run(struct replay *rp)
+{
+    struct hrpc_client_opts hopts;
+    struct replay_thread *rts;
+    struct fake_hrpc_opts fopts;
+    struct fake_hrpc *fh = NULL;
+    char err[512];
+    const char *addr = rp->opts.addr;
+    int i, res, ret = EXIT_FAILURE;
+
+    if (rp->opts.fake) {
+        memset(&fopts, 0, sizeof(fopts));
+        fake_hrpc_start(&fopts, &fh, err, sizeof(err));
+        if (err[0]) {
+            fprintf(stderr, "failed to start the fake HRPC server: %s\n",
+                    err);
+            return EXIT_FAILURE;
+        }
+        addr = fake_hrpc_get_addr(fh);
+    }
+    memset(&hopts, 0, sizeof(hopts));
+    hopts.write_timeo_ms = REPLAY_TIMEO_MS;
+    hopts.read_timeo_ms = REPLAY_TIMEO_MS;
+    hopts.tcp_nodelay = 1;
+    rts = calloc(rp->opts.num_conns, sizeof(rts[0]));
+    if (!rts) {
+        fprintf(stderr, "OOM\n");
+        goto done;
+    }
+    for (i = 0; i < rp->opts.num_conns; i++) {
+        rts[i].rp = rp;
+        rts[i].hcli = hrpc_client_alloc(rp->lg, &hopts, addr);
+        if (!rts[i].hcli) {
+            fprintf(stderr, "failed to create an HRPC client for %s\n", addr);
+            goto done;
+        }
+    }
+    rp->begin_ns = replay_now_ns();
+    for (i = 0; i < rp->opts.num_conns; i++) {
+        res = pthread_create(&rts[i].thread, NULL, replay_thread_run,
+                             &rts[i]);
+        if (res) {
+            fprintf(stderr, "pthread_create failed: %s\n", terror(res));
+            abort();
+        }
+    }
+    for (i = 0; i < rp->opts.num_conns; i++) {
+        pthread_join(rts[i].thread, NULL);
+        if (rts[i].oom) {
+            fprintf(stderr, "OOM\n");
+            goto done;
+        }
+    }
+    ret = replay_report(rp, rts, replay_now_ns() - rp->begin_ns);
+
+done:
+    if (rts) {
+        for (i = 0; i < rp->opts.num_conns; i++) {
+            hrpc_client_free(rts[i].hcli);
+            free(rts[i].lat_ns);
+        }
+        free(rts);
+    }
+    if (fh) {
+        fake_hrpc_free(fh);
+    }
+    return ret;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+"htrace-replay: replays captured spans to an htraced server.\n"
+"\n"
+"Usage: htrace-replay [options] <-a address | -F> <span file>...\n"
+"\n"
+"The span files are written by the local.file or local.binfile span\n"
+"receivers.  Spans are sent in order of their begin times.\n"
+"\n"
+"Options:\n"
+"    -a <address>   The htraced HRPC address, as host:port.\n"
+"    -F             Send to an in-process fake HRPC server instead, to\n"
+"                       measure only the client.\n"
+"    -b <spans>     How many spans to put in each request.  The default is\n"
+"                       %d.\n"
+"    -c <conns>     How many connections to send from at once.  The\n"
+"                       default is 1.\n"
+"    -w <reqs>      How many requests each connection may have in flight.\n"
+"                       The default is %d.\n"
+"    -x <mult>      Follow the begin times of the spans, sped up by this\n"
+"                       factor.  The default is 0, which sends as fast as\n"
+"                       the server will take them.\n"
+"    -n <loops>     How many times to replay the spans.  The default is 1.\n"
+"    -T <trid>      The default tracer ID to send.  The default is %s.\n"
+"    -h             Show this help message.\n",
+    REPLAY_DEFAULT_BATCH, REPLAY_DEFAULT_WINDOW, REPLAY_DEFAULT_TRID);
+}
+
+int main(int argc, char **argv)
+{
+    struct replay rp;
+    struct htrace_conf *cnf;
+    int c, i, ret = EXIT_FAILURE;
+
+    memset(&rp, 0, sizeof(rp));
+    rp.opts.batch_size = REPLAY_DEFAULT_BATCH;
+    rp.opts.num_conns = 1;
+    rp.opts.window = REPLAY_DEFAULT_WINDOW;
+    rp.opts.loops = 1;
+    rp.opts.trid = REPLAY_DEFAULT_TRID;
+    while ((c = getopt(argc, argv, "a:Fb:c:w:x:n:T:h")) != -1) {
+        switch (c) {
+        case 'a':
+            rp.opts.addr = optarg;
+            break;
+        case 'F':
+            rp.opts.fake = 1;
+            break;
+        case 'b':
+            rp.opts.batch_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            rp.opts.num_conns = atoi(optarg);
+            break;
+        case 'w':
+            rp.opts.window = atoi(optarg);
+            break;
+        case 'x':
+            rp.opts.rate_mult = strtod(optarg, NULL);
+            break;
+        case 'n':
+            rp.opts.loops = strtoull(optarg, NULL, 10);
+            break;
+        case 'T':
+            rp.opts.trid = optarg;
+            break;
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (((!rp.opts.addr) == (!rp.opts.fake)) || (optind >= argc) ||
+            (rp.opts.batch_size < 1) || (rp.opts.num_conns < 1) ||
+            (rp.opts.window < 1) || (rp.opts.rate_mult < 0) ||
+            (rp.opts.loops < 1)) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    cnf = htrace_conf_from_str("");
+    if (!cnf) {
+        fprintf(stderr, "OOM\n");
+        return EXIT_FAILURE;
+    }
+    rp.lg = htrace_log_alloc(cnf);
+    htrace_conf_free(cnf);
+    if (!rp.lg) {
+        fprintf(stderr, "OOM\n");
+        return EXIT_FAILURE;
+    }
+    for (i = optind; i < argc; i++) {
+        if (replay_load(&rp, argv[i])) {
+            goto done;
+        }
+    }
+    if (rp.num_spans == 0) {
+        fprintf(stderr, "No spans to replay.\n");
+        goto done;
+    }
+    if (replay_build_batches(&rp)) {
+        fprintf(stderr, "OOM\n");
+        goto done;
+    }
+    printf("spans loaded:         %" PRIu64 " in %" PRIu64 " requests\n",
+           rp.num_spans, rp.num_batches);
+    ret = replay_run(&rp);
+
+done:
+    free(rp.load_buf);
+    free(rp.spans);
+    free(rp.buf);
+    free(rp.batches);
+    htrace_log_free(rp.lg);
+    return ret;
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,413 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/htrace.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @file htrace-stress.c
+ *
+ * An end-to-end stress test of a span receiver.
+ *
+ * Some number of threads start and close spans at a target rate for a
+ * fixed time, going through the whole pipeline: sampler, tracer, and
+ * whichever span receiver the configuration names.  Afterwards we wait for
+ * the receiver to settle, and then report the rate we achieved, how long
+ * htrace_scope_close took, how many spans were dropped, and how many bytes
+ * were written.
+ *
+ * This uses only the public API, and links against the production library.
+ */
+
+/**
+ * The latency histogram has HISTO_SUB_BUCKETS buckets for each power of two
+ * nanoseconds, so that percentiles are accurate to about 6%.
+ */
+#define HISTO_SUB_BITS 4
+#define HISTO_SUB_BUCKETS (1 << HISTO_SUB_BITS)
+#define HISTO_NUM_BUCKETS (64 * HISTO_SUB_BUCKETS)
+
+/**
+ * How often we look at the receiver's statistics while waiting for it to
+ * settle.
+ */
+#define STRESS_SETTLE_POLL_MS 100
+
+struct stress_opts {
+    char **confs;
+    int num_confs;
+    int num_threads;
+    uint64_t rate;
+    uint64_t duration_ms;
+    uint64_t settle_ms;
+    int num_kvs;
+};
+
+struct stress_thread {
+    pthread_t thread;
+    const struct stress_opts *opts;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    uint64_t begin_ns;
+    uint64_t spans;
+    uint64_t max_close_ns;
+    uint64_t histo[HISTO_NUM_BUCKETS];
+};
+
+static uint64_t stress_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (((uint64_t)ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+static int histo_bucket(uint64_t ns)
+{
+    int msb;
+
+    if (ns < HISTO_SUB_BUCKETS) {
+        return (int)ns;
+    }
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - HISTO_SUB_BITS + 1) * HISTO_SUB_BUCKETS) +
+        (int)((ns >> (msb - HISTO_SUB_BITS)) & (HISTO_SUB_BUCKETS - 1));
+}
+
+/**
+ * Get the smallest value which falls into a histogram bucket.
+ */
+static uint64_t histo_bucket_min(int bucket)
+{
+    int shift;
+
+    if (bucket < HISTO_SUB_BUCKETS) {
+        return bucket;
+    }
+    shift = (bucket / HISTO_SUB_BUCKETS) - 1;
+    return ((uint64_t)(HISTO_SUB_BUCKETS + (bucket % HISTO_SUB_BUCKETS)))
+        << shift;
+}
+
+static uint64_t histo_percentile(const uint64_t *histo, uint64_t total,
+                                 double pct)
+{
+    uint64_t target, seen = 0;
+    int i;
+
+    if (total == 0) {
+        return 0;
+    }
+    target = (uint64_t)(total * pct);
+    for (i = 0; i < HISTO_NUM_BUCKETS; i++) {
+        seen += histo[i];
+        if (seen > target) {
+            return histo_bucket_min(i);
+        }
+    }
+    return histo_bucket_min(HISTO_NUM_BUCKETS - 1);
+}
+
+static void stress_sleep_until(uint64_t when_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = when_ns / 1000000000ULL;
+    ts.tv_nsec = when_ns % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR) {
+        ;
+    }
+}
+
+static void *stress_thread_run(void *data)
+{
+    struct stress_thread *st = data;
+    const struct stress_opts *opts = st->opts;
+    struct htrace_scope *scope;
+    uint64_t end_ns, now_ns, close_ns, interval_ns = 0;
+    char val[32];
+    int i;
+
+    end_ns = st->begin_ns + (opts->duration_ms * 1000000ULL);
+    if (opts->rate) {
+        interval_ns = 1000000000ULL / opts->rate;
+    }
+    while (1) {
+        if (interval_ns) {
+            // Pace from the start time, so that a slow span doesn't lower
+            // the rate we are aiming for.
+            stress_sleep_until(st->begin_ns + (st->spans * interval_ns));
+        }
+        now_ns = stress_now_ns();
+        if (now_ns >= end_ns) {
+            break;
+        }
+        scope = htrace_start_span(st->tracer, st->smp, "stress");
+        for (i = 0; i < opts->num_kvs; i++) {
+            snprintf(val, sizeof(val), "%" PRId64, st->spans + i);
+            htrace_scope_add_kv(scope, "stress.kv", val);
+        }
+        now_ns = stress_now_ns();
+        htrace_scope_close(scope);
+        close_ns = stress_now_ns() - now_ns;
+        st->histo[histo_bucket(close_ns)]++;
+        if (close_ns > st->max_close_ns) {
+            st->max_close_ns = close_ns;
+        }
+        st->spans++;
+    }
+    return NULL;
+}
+
+/**
+ * Wait until the receiver's statistics stop changing, or for at most
+ * settle_ms.
+ */
+static void stress_settle(struct htracer *tracer, uint64_t settle_ms,
+                          struct htrace_stats *stats)
+{
+    struct htrace_stats prev;
+    uint64_t waited_ms;
+
+    htracer_get_stats(tracer, stats);
+    for (waited_ms = 0; waited_ms < settle_ms;
+            waited_ms += STRESS_SETTLE_POLL_MS) {
+        prev = *stats;
+        usleep(STRESS_SETTLE_POLL_MS * 1000);
+        htracer_get_stats(tracer, stats);
+        if (!memcmp(&prev, stats, sizeof(prev))) {
+            break;
+        }
+    }
+}
+
+static void stress_report(const struct stress_opts *opts,
+                          struct stress_thread *sts, uint64_t elapsed_ns,
+                          const struct htrace_stats *stats)
+{
+    uint64_t histo[HISTO_NUM_BUCKETS];
+    uint64_t spans = 0, dropped, max_close_ns = 0;
+    int i, j;
+
+    memset(histo, 0, sizeof(histo));
+    for (i = 0; i < opts->num_threads; i++) {
+        spans += sts[i].spans;
+        if (sts[i].max_close_ns > max_close_ns) {
+            max_close_ns = sts[i].max_close_ns;
+        }
+        for (j = 0; j < HISTO_NUM_BUCKETS; j++) {
+            histo[j] += sts[i].histo[j];
+        }
+    }
+    dropped = stats->dropped_invalid + stats->dropped_oom +
+        stats->dropped_newest + stats->dropped_oldest +
+        stats->dropped_timeout + stats->dropped_too_large +
+        stats->dropped_xmit + stats->dropped_low_priority +
+        stats->tail_dropped;
+    printf("threads:              %d\n", opts->num_threads);
+    printf("duration:             %.3f s\n", elapsed_ns / 1e9);
+    printf("spans:                %" PRIu64 "\n", spans);
+    printf("spans/sec:            %.1f\n", spans / (elapsed_ns / 1e9));
+    printf("close latency p50:    %" PRIu64 " ns\n",
+           histo_percentile(histo, spans, 0.50));
+    printf("close latency p99:    %" PRIu64 " ns\n",
+           histo_percentile(histo, spans, 0.99));
+    printf("close latency p999:   %" PRIu64 " ns\n",
+           histo_percentile(histo, spans, 0.999));
+    printf("close latency max:    %" PRIu64 " ns\n", max_close_ns);
+    printf("dropped:              %" PRIu64 " (%.4f%%)\n", dropped,
+           spans ? (100.0 * dropped) / spans : 0.0);
+    printf("  newest:             %" PRIu64 "\n", stats->dropped_newest);
+    printf("  oldest:             %" PRIu64 "\n", stats->dropped_oldest);
+    printf("  timeout:            %" PRIu64 "\n", stats->dropped_timeout);
+    printf("  too large:          %" PRIu64 "\n", stats->dropped_too_large);
+    printf("  xmit:               %" PRIu64 "\n", stats->dropped_xmit);
+    printf("  low priority:       %" PRIu64 "\n",
+           stats->dropped_low_priority);
+    printf("  oom:                %" PRIu64 "\n", stats->dropped_oom);
+    printf("  tail:               %" PRIu64 "\n", stats->tail_dropped);
+    printf("blocked:              %" PRIu64 "\n", stats->blocked);
+    printf("bytes serialized:     %" PRIu64 "\n", stats->bytes_serialized);
+    printf("bytes sent:           %" PRIu64 "\n", stats->xmit_bytes);
+    printf("bytes on the wire:    %" PRIu64 "\n", stats->xmit_wire_bytes);
+    printf("rpcs:                 %" PRIu64 " (%" PRIu64 " failed)\n",
+           stats->rpcs, stats->rpc_errors);
+}
+
+static int stress_run(const struct stress_opts *opts)
+{
+    struct stress_thread *sts = NULL;
+    struct htrace_conf *cnf = NULL;
+    struct htracer *tracer = NULL;
+    struct htrace_sampler *smp = NULL;
+    struct htrace_stats stats;
+    uint64_t begin_ns, elapsed_ns;
+    char *conf_str = NULL, *next;
+    int i, ret = EXIT_FAILURE;
+
+    conf_str = strdup(HTRACE_SAMPLER_KEY "=always");
+    for (i = 0; conf_str && (i < opts->num_confs); i++) {
+        if (asprintf(&next, "%s;%s", conf_str, opts->confs[i]) < 0) {
+            next = NULL;
+        }
+        free(conf_str);
+        conf_str = next;
+    }
+    if (!conf_str) {
+        fprintf(stderr, "OOM\n");
+        goto done;
+    }
+    cnf = htrace_conf_from_str(conf_str);
+    if (!cnf) {
+        fprintf(stderr, "htrace_conf_from_str(%s) failed.\n", conf_str);
+        goto done;
+    }
+    tracer = htracer_create("htrace-stress", cnf);
+    if (!tracer) {
+        fprintf(stderr, "htracer_create(%s) failed.\n", conf_str);
+        goto done;
+    }
+    smp = htrace_sampler_create(tracer, cnf);
+    if (!smp) {
+        fprintf(stderr, "htrace_sampler_create(%s) failed.\n", conf_str);
+        goto done;
+    }
+    sts = calloc(opts->num_threads, sizeof(*sts));
+    if (!sts) {
+        fprintf(stderr, "OOM\n");
+        goto done;
+    }
+    begin_ns = stress_now_ns();
+    for (i = 0; i < opts->num_threads; i++) {
+        sts[i].opts = opts;
+        sts[i].tracer = tracer;
+        sts[i].smp = smp;
+        sts[i].begin_ns = begin_ns;
+        ret = pthread_create(&sts[i].thread, NULL, stress_thread_run, &sts[i]);
+        if (ret) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(ret));
+            abort();
+        }
+    }
+    for (i = 0; i < opts->num_threads; i++) {
+        pthread_join(sts[i].thread, NULL);
+    }
+    elapsed_ns = stress_now_ns() - begin_ns;
+    stress_settle(tracer, opts->settle_ms, &stats);
+    stress_report(opts, sts, elapsed_ns, &stats);
+    ret = EXIT_SUCCESS;
+
+done:
+    free(sts);
+    if (smp) {
+        htrace_sampler_free(smp);
+    }
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(conf_str);
+    return ret;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+"htrace-stress: an end-to-end stress test of an HTrace span receiver.\n"
+"\n"
+"Usage: htrace-stress [options] <key=value> [<key=value>...]\n"
+"\n"
+"The key=value arguments are the HTrace configuration, which names the\n"
+"span receiver to test.  For example:\n"
+"\n"
+"    htrace-stress span.receiver=htraced htraced.address=example.com:9075\n"
+"    htrace-stress -m 8 span.receiver=local.file local.file.path=/tmp/x\n"
+"\n"
+"The sampler is always the always sampler.\n"
+"\n"
+"Options:\n"
+"    -d <ms>        How long to create spans for.  The default is 10000.\n"
+"    -h             Show this help message.\n"
+"    -k <num>       The number of annotations to give each span.  The\n"
+"                       default is 1.\n"
+"    -m <threads>   The number of threads creating spans.  The default\n"
+"                       is 4.\n"
+"    -r <rate>      The number of spans each thread should create per\n"
+"                       second, or 0 to go as fast as possible.  The\n"
+"                       default is 0.\n"
+"    -w <ms>        The longest to wait for the span receiver to settle\n"
+"                       before reporting.  The default is 5000.\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct stress_opts opts;
+    int c;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.num_threads = 4;
+    opts.duration_ms = 10000;
+    opts.settle_ms = 5000;
+    opts.num_kvs = 1;
+    while ((c = getopt(argc, argv, "d:hk:m:r:w:")) != -1) {
+        switch (c) {
+        case 'd':
+            opts.duration_ms = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            opts.num_kvs = atoi(optarg);
+            break;
+        case 'm':
+            opts.num_threads = atoi(optarg);
+            break;
+        case 'r':
+            opts.rate = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            opts.settle_ms = strtoull(optarg, NULL, 10);
+            break;
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    opts.confs = argv + optind;
+    opts.num_confs = argc - optind;
+    if ((opts.num_threads <= 0) || (opts.num_kvs < 0)) {
+        fprintf(stderr, "The number of threads must be positive, and the "
+                "number of annotations must not be negative.\n");
+        return EXIT_FAILURE;
+    }
+    return stress_run(&opts);
+}
+
+// vim: ts=4:sw=4:tw=79:et
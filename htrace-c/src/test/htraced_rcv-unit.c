@@ -33,7 +33,8 @@
 #include <string.h>
 #include <unistd.h>
 
-static int htraced_rcv_test(struct rtest *rt)
+static int htraced_rcv_test(struct rtest *rt, int num_addrs,
+                            const char *extra_conf)
 {
     char err[512], *conf_str, *json_path;
     size_t err_len = sizeof(err);
@@ -49,9 +50,11 @@ static int htraced_rcv_test(struct rtest *rt)
 
     EXPECT_INT_GE(0, asprintf(&json_path, "%s/%s",
                 ht->root_dir, "spans.json"));
-    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s",
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s%s%s;%s",
                 HTRACE_SPAN_RECEIVER_KEY, "htraced",
-                HTRACED_ADDRESS_KEY, ht->htraced_hrpc_addr));
+                HTRACED_ADDRESS_KEY, ht->htraced_hrpc_addr,
+                ((num_addrs > 1) ? "," : ""),
+                ((num_addrs > 1) ? ht->htraced_hrpc_addr : ""), extra_conf));
     EXPECT_INT_ZERO(rt->run(rt, conf_str));
     start_ms = monotonic_now_ms(NULL);
     //
@@ -98,10 +101,60 @@ int main(void)
 
     for (i = 0; g_rtests[i]; i++) {
         struct rtest *rtest = g_rtests[i];
-        if (htraced_rcv_test(rtest) != EXIT_SUCCESS) {
+        if (htraced_rcv_test(rtest, 1, "") != EXIT_SUCCESS) {
             fprintf(stderr, "rtest %s failed\n", rtest->name);
             return EXIT_FAILURE;
         }
+        if (htraced_rcv_test(rtest, 1, HTRACED_THREAD_BUFFER_SIZE_KEY "=65536")
+                != EXIT_SUCCESS) {
+            fprintf(stderr, "rtest %s failed with per-thread buffers\n",
+                    rtest->name);
+            return EXIT_FAILURE;
+        }
+        if (htraced_rcv_test(rtest, 1, HTRACED_BUFFER_COUNT_KEY "=4;"
+                    HTRACED_BUFFER_FULL_POLICY_KEY "=block;"
+                    HTRACED_INFLIGHT_WINDOW_KEY "=3") != EXIT_SUCCESS) {
+            fprintf(stderr, "rtest %s failed with a buffer ring\n",
+                    rtest->name);
+            return EXIT_FAILURE;
+        }
+        if (htraced_rcv_test(rtest, 2, HTRACED_INFLIGHT_WINDOW_KEY "=2")
+                != EXIT_SUCCESS) {
+            fprintf(stderr, "rtest %s failed with two connections\n",
+                    rtest->name);
+            return EXIT_FAILURE;
+        }
+        if (htraced_rcv_test(rtest, 1, HTRACED_COMPRESSION_KEY "=zlib")
+                != EXIT_SUCCESS) {
+            fprintf(stderr, "rtest %s failed with compression\n",
+                    rtest->name);
+            return EXIT_FAILURE;
+        }
+        if (htraced_rcv_test(rtest, 1, HTRACED_BATCH_MAX_LATENCY_MS_KEY
+                    "=100") != EXIT_SUCCESS) {
+            fprintf(stderr, "rtest %s failed with adaptive batching\n",
+                    rtest->name);
+            return EXIT_FAILURE;
+        }
+        if (htraced_rcv_test(rtest, 1, HTRACED_ASYNC_SERIALIZE_KEY "=true")
+                != EXIT_SUCCESS) {
+            fprintf(stderr, "rtest %s failed with async serialization\n",
+                    rtest->name);
+            return EXIT_FAILURE;
+        }
+        if (htraced_rcv_test(rtest, 1, HTRACED_DICTIONARY_KEY "=true;"
+                    HTRACED_COMPRESSION_KEY "=zlib") != EXIT_SUCCESS) {
+            fprintf(stderr, "rtest %s failed with dictionary encoding\n",
+                    rtest->name);
+            return EXIT_FAILURE;
+        }
+        if (htraced_rcv_test(rtest, 1, HTRACED_SHARED_KEY "=true;"
+                    HTRACED_SHARED_MEMORY_MAX_KEY "=4194304")
+                != EXIT_SUCCESS) {
+            fprintf(stderr, "rtest %s failed with a shared receiver\n",
+                    rtest->name);
+            return EXIT_FAILURE;
+        }
     }
 
     return EXIT_SUCCESS;
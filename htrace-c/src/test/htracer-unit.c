@@ -0,0 +1,190 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/scope.h"
+#include "core/span.h"
+#include "test/test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * More tracers than there are __thread current scope slots, so that some of
+ * them have to fall back on pthread keys.
+ */
+#define NUM_TEST_TRACERS 20
+
+/**
+ * Test that each tracer keeps its own current scope, whether it is stored in
+ * a __thread slot or a pthread key.
+ */
+static int test_tracer_scopes(void)
+{
+    struct htrace_conf *cnf;
+    struct htrace_sampler *smp[NUM_TEST_TRACERS];
+    struct htracer *tracer[NUM_TEST_TRACERS];
+    struct htrace_scope *outer[NUM_TEST_TRACERS], *inner[NUM_TEST_TRACERS];
+    struct htrace_span_id outer_id;
+    char tname[32];
+    int i;
+
+    cnf = htrace_conf_from_str("span.receiver=noop;sampler=always");
+    EXPECT_NONNULL(cnf);
+    for (i = 0; i < NUM_TEST_TRACERS; i++) {
+        snprintf(tname, sizeof(tname), "htracer-unit%d", i);
+        tracer[i] = htracer_create(tname, cnf);
+        EXPECT_NONNULL(tracer[i]);
+        smp[i] = htrace_sampler_create(tracer[i], cnf);
+        EXPECT_NONNULL(smp[i]);
+    }
+    for (i = 0; i < NUM_TEST_TRACERS; i++) {
+        EXPECT_NULL(htracer_cur_scope(tracer[i]));
+        outer[i] = htrace_start_span(tracer[i], smp[i], "outer");
+        EXPECT_NONNULL(outer[i]);
+        EXPECT_TRUE((outer[i] == htracer_cur_scope(tracer[i])));
+    }
+    for (i = 0; i < NUM_TEST_TRACERS; i++) {
+        inner[i] = htrace_start_span(tracer[i], smp[i], "inner");
+        EXPECT_NONNULL(inner[i]);
+        EXPECT_TRUE((inner[i] == htracer_cur_scope(tracer[i])));
+        EXPECT_TRUE((outer[i] == inner[i]->parent));
+        EXPECT_INT_EQ(1, inner[i]->span->num_parents);
+        htrace_scope_get_span_id(outer[i], &outer_id);
+        EXPECT_INT_ZERO(htrace_span_id_compare(&outer_id,
+                            &inner[i]->span->parent.single));
+    }
+    for (i = 0; i < NUM_TEST_TRACERS; i++) {
+        htrace_scope_close(inner[i]);
+        EXPECT_TRUE((outer[i] == htracer_cur_scope(tracer[i])));
+        htrace_scope_close(outer[i]);
+        EXPECT_NULL(htracer_cur_scope(tracer[i]));
+    }
+    for (i = 0; i < NUM_TEST_TRACERS; i++) {
+        htrace_sampler_free(smp[i]);
+        htracer_free(tracer[i]);
+    }
+    htrace_conf_free(cnf);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Test mixing scopes in caller-provided storage with pooled scopes.
+ */
+static int test_inplace_scopes(void)
+{
+    struct htrace_conf *cnf;
+    struct htrace_sampler *smp;
+    struct htracer *tracer;
+    struct htrace_scope_storage storage[2];
+    struct htrace_scope *outer, *middle, *inner;
+
+    cnf = htrace_conf_from_str("span.receiver=noop;sampler=always");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("htracer-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+
+    // Without a sampler or a current span, nothing is traced.
+    EXPECT_NULL(htrace_start_span_inplace(&storage[0], tracer, NULL, "none"));
+
+    outer = htrace_start_span_inplace(&storage[0], tracer, smp, "outer");
+    EXPECT_TRUE((outer == (struct htrace_scope *)&storage[0]));
+    middle = htrace_start_span(tracer, NULL, "middle");
+    EXPECT_NONNULL(middle);
+    EXPECT_TRUE((outer == middle->parent));
+    inner = htrace_start_span_inplace(&storage[1], tracer, NULL, "inner");
+    EXPECT_TRUE((inner == (struct htrace_scope *)&storage[1]));
+    EXPECT_TRUE((middle == inner->parent));
+    htrace_scope_close(inner);
+    htrace_scope_close(middle);
+    EXPECT_TRUE((outer == htracer_cur_scope(tracer)));
+    htrace_scope_close(outer);
+    EXPECT_NULL(htracer_cur_scope(tracer));
+
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Test that nothing is traced until a sampler which can fire is created, and
+ * that HTRACE_SCOPE closes its scope at the end of the block.  This has to
+ * run before anything else in this process creates a sampler.
+ */
+static int test_enabled_fast_path(void)
+{
+    struct htrace_conf *cnf;
+    struct htrace_sampler *smp;
+    struct htracer *tracer;
+
+    cnf = htrace_conf_from_str("span.receiver=noop;sampler=never");
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("htracer-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    EXPECT_INT_ZERO(htrace_enabled());
+    {
+        HTRACE_SCOPE(scope, tracer, smp, "disabled");
+        EXPECT_NULL(scope);
+        EXPECT_INT_ZERO(htrace_scope_add_kv(scope, "k", "v"));
+    }
+    htrace_sampler_free(smp);
+    htrace_conf_free(cnf);
+
+    cnf = htrace_conf_from_str("sampler=always");
+    EXPECT_NONNULL(cnf);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    EXPECT_INT_EQ(1, htrace_enabled());
+    {
+        HTRACE_SCOPE(outer, tracer, smp, "outer");
+        EXPECT_NONNULL(outer);
+        EXPECT_TRUE((outer == htracer_cur_scope(tracer)));
+        {
+            HTRACE_SCOPE(inner, tracer, NULL, "inner");
+            EXPECT_NONNULL(inner);
+            EXPECT_TRUE((outer == inner->parent));
+        }
+        EXPECT_TRUE((outer == htracer_cur_scope(tracer)));
+    }
+    EXPECT_NULL(htracer_cur_scope(tracer));
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    EXPECT_INT_ZERO(test_enabled_fast_path());
+    EXPECT_INT_ZERO(test_tracer_scopes());
+    // Run again, so that the tracers reuse the slots freed by the first run.
+    EXPECT_INT_ZERO(test_tracer_scopes());
+    EXPECT_INT_ZERO(test_inplace_scopes());
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
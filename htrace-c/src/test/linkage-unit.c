@@ -39,22 +39,57 @@
 static const char * const PUBLIC_SYMS[] = {
     "htrace_conf_free",
     "htrace_conf_from_str",
+    "htrace_context_extract",
+    "htrace_context_extract_base64",
+    "htrace_context_inject",
+    "htrace_context_inject_base64",
+    "htrace_desc_register",
+    "htrace_g_enabled",
     "htrace_restart_span",
     "htrace_sampler_create",
     "htrace_sampler_free",
+    "htrace_sampler_next_trace",
     "htrace_sampler_to_str",
+    "htrace_scope_add_event",
+    "htrace_scope_add_event_len",
+    "htrace_scope_add_kv",
+    "htrace_scope_add_kv_len",
+    "htrace_scope_add_parent",
     "htrace_scope_close",
     "htrace_scope_detach",
+    "htrace_scope_move_inplace",
+    "htrace_set_allocator",
     "htrace_start_span",
+    "htrace_start_span_desc",
+    "htrace_start_span_from",
+    "htrace_start_span_inplace",
+    "htrace_start_span_inplace_len",
+    "htrace_start_span_name_inplace",
     "htracer_create",
+    "htracer_dump_flight_recorder",
     "htracer_free",
+    "htracer_get_stats",
     "htracer_tname",
+    "htracer_update_conf",
     "htrace_span_id_clear",
     "htrace_span_id_compare",
     "htrace_span_id_parse",
     "htrace_span_id_to_str",
     "htrace_span_id_copy",
     "htrace_scope_get_span_id",
+    "htrace_scope_set_priority",
+    "htrace_span_reader_alloc",
+    "htrace_span_reader_error",
+    "htrace_span_reader_free",
+    "htrace_span_reader_next",
+    "htrace_span_reader_offset",
+    "htrace_span_reader_open",
+    "htrace_span_view_events",
+    "htrace_span_view_kvs",
+    "htrace_span_view_next_event",
+    "htrace_span_view_next_kv",
+    "htrace_span_view_next_parent",
+    "htrace_span_view_parents",
 };
 
 #define PUBLIC_SYMS_SIZE (sizeof(PUBLIC_SYMS) / sizeof(PUBLIC_SYMS[0]))
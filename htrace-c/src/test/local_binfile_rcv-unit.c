@@ -0,0 +1,233 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/htracer.h"
+#include "core/span.h"
+#include "receiver/local_binfile.h"
+#include "receiver/receiver.h"
+#include "test/rtest.h"
+#include "test/span_table.h"
+#include "test/span_util.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+#include "util/cmp.h"
+#include "util/cmp_util.h"
+#include "util/log.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/**
+ * The contents of a local.binfile file.
+ */
+struct binfile_contents {
+    uint8_t *buf;
+    uint64_t len;
+    int num_blocks;
+    int num_spans;
+};
+
+static int binfile_read(const char *path, struct binfile_contents *bc)
+{
+    struct stat st;
+    FILE *fp;
+
+    memset(bc, 0, sizeof(*bc));
+    EXPECT_INT_ZERO(stat(path, &st));
+    bc->len = st.st_size;
+    bc->buf = xcalloc(bc->len + 1);
+    fp = fopen(path, "r");
+    EXPECT_NONNULL(fp);
+    EXPECT_UINT64_EQ(bc->len, (uint64_t)fread(bc->buf, 1, bc->len, fp));
+    EXPECT_INT_ZERO(fclose(fp));
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Check the records of one block against its footer, and put its spans in
+ * the span table.
+ */
+static int binfile_load_block(const uint8_t *block,
+                              const struct local_binfile_footer *ftr,
+                              struct span_table *st)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    struct cmp_bcopy_ctx bctx;
+    struct htrace_span *span;
+    uint64_t off = 0, len, num_spans = 0;
+
+    while (off < ftr->data_len) {
+        EXPECT_INT_EQ(1, off + LOCAL_BINFILE_REC_HDR_LEN <= ftr->data_len);
+        len = ((uint64_t)block[off] << 24) | ((uint64_t)block[off + 1] << 16) |
+              ((uint64_t)block[off + 2] << 8) | block[off + 3];
+        off += LOCAL_BINFILE_REC_HDR_LEN;
+        EXPECT_INT_EQ(1, off + len <= ftr->data_len);
+        err[0] = '\0';
+        cmp_bcopy_ctx_init(&bctx, (void *)(block + off), len);
+        span = span_read_msgpack((cmp_ctx_t*)&bctx, err, err_len);
+        EXPECT_STR_EQ("", err);
+        EXPECT_NONNULL(span);
+        EXPECT_UINT64_EQ(len, bctx.off);
+        EXPECT_INT_EQ(1, span->begin_ms >= ftr->min_begin_ms);
+        EXPECT_INT_EQ(1, span->end_ms <= ftr->max_end_ms);
+        EXPECT_INT_EQ(1, span->span_id.high >= ftr->min_trace_id);
+        EXPECT_INT_EQ(1, span->span_id.high <= ftr->max_trace_id);
+        EXPECT_INT_ZERO(span_table_put(st, span));
+        off += len;
+        num_spans++;
+    }
+    EXPECT_UINT64_EQ(ftr->num_spans, num_spans);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Walk the blocks of a file backwards from the end, the way a reader
+ * looking for a time window would.
+ */
+static int binfile_load(struct binfile_contents *bc, struct span_table *st)
+{
+    struct local_binfile_footer ftr;
+    uint64_t end = bc->len;
+
+    while (end > 0) {
+        EXPECT_INT_EQ(1, end >= LOCAL_BINFILE_FOOTER_LEN);
+        end -= LOCAL_BINFILE_FOOTER_LEN;
+        EXPECT_INT_EQ(1, local_binfile_footer_decode(bc->buf + end, &ftr));
+        EXPECT_INT_EQ(LOCAL_BINFILE_VERSION, ftr.version);
+        EXPECT_INT_EQ(1, ftr.data_len <= end);
+        end -= ftr.data_len;
+        EXPECT_INT_ZERO(binfile_load_block(bc->buf + end, &ftr, st));
+        bc->num_blocks++;
+        bc->num_spans += ftr.num_spans;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int local_binfile_rcv_test(struct rtest *rt, int block_size)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *local_path, *tdir, *conf_str = NULL;
+    struct binfile_contents bc;
+    struct span_table *st;
+
+    st = span_table_alloc();
+    tdir = create_tempdir("local_binfile_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&local_path, "%s/%s", tdir, "spans.bin"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%d",
+                HTRACE_SPAN_RECEIVER_KEY, "local.binfile",
+                HTRACE_LOCAL_BINFILE_RCV_PATH_KEY, local_path,
+                HTRACE_LOCAL_BINFILE_BLOCK_SIZE_KEY, block_size));
+    EXPECT_INT_ZERO(rt->run(rt, conf_str));
+    EXPECT_INT_ZERO(binfile_read(local_path, &bc));
+    EXPECT_INT_ZERO(binfile_load(&bc, st));
+    EXPECT_INT_EQ(rt->spans_created, bc.num_spans);
+    EXPECT_INT_ZERO(rt->verify(rt, st));
+    free(bc.buf);
+    free(conf_str);
+    free(local_path);
+    free(tdir);
+    span_table_free(st);
+
+    return EXIT_SUCCESS;
+}
+
+static int local_binfile_rcv_stats_test(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *local_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_stats stats;
+    struct binfile_contents bc;
+    struct span_table *st;
+    int i;
+
+    tdir = create_tempdir("local_binfile_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&local_path, "%s/%s", tdir, "stats.bin"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s;%s=%d",
+                HTRACE_SPAN_RECEIVER_KEY, "local.binfile",
+                HTRACE_LOCAL_BINFILE_RCV_PATH_KEY, local_path,
+                HTRACE_SAMPLER_KEY, "always",
+                HTRACE_LOCAL_BINFILE_BLOCK_SIZE_KEY, 256));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("local_binfile_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    for (i = 0; i < 20; i++) {
+        htrace_scope_close(htrace_start_span(tracer, smp, "span"));
+    }
+    // A flush writes out the partially filled block.
+    tracer->rcv->ty->flush(tracer->rcv);
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ((uint64_t)20, stats.spans_closed);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_xmit);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_oom);
+    EXPECT_INT_ZERO(binfile_read(local_path, &bc));
+    st = span_table_alloc();
+    EXPECT_INT_ZERO(binfile_load(&bc, st));
+    EXPECT_INT_EQ(20, bc.num_spans);
+    EXPECT_INT_EQ(1, bc.num_blocks > 1);
+    EXPECT_UINT64_EQ(bc.len, stats.bytes_serialized +
+                     bc.num_blocks * LOCAL_BINFILE_FOOTER_LEN);
+    span_table_free(st);
+    free(bc.buf);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(conf_str);
+    free(local_path);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    int i;
+
+    for (i = 0; g_rtests[i]; i++) {
+        struct rtest *rtest = g_rtests[i];
+        if ((local_binfile_rcv_test(rtest, 1048576) != EXIT_SUCCESS) ||
+                (local_binfile_rcv_test(rtest, 256) != EXIT_SUCCESS)) {
+            fprintf(stderr, "rtest %s failed\n", rtest->name);
+            return EXIT_FAILURE;
+        }
+    }
+    EXPECT_INT_ZERO(local_binfile_rcv_stats_test());
+
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -18,6 +18,8 @@
 
 #include "core/conf.h"
 #include "core/htrace.h"
+#include "core/htracer.h"
+#include "receiver/receiver.h"
 #include "test/rtest.h"
 #include "test/span_table.h"
 #include "test/span_util.h"
@@ -26,11 +28,13 @@
 #include "util/log.h"
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
-static int local_file_rcv_test(struct rtest *rt)
+static int local_file_rcv_test(struct rtest *rt, const char *extra_conf)
 {
     char err[512];
     size_t err_len = sizeof(err);
@@ -42,9 +46,9 @@ static int local_file_rcv_test(struct rtest *rt)
     EXPECT_STR_EQ("", err);
     register_tempdir_for_cleanup(tdir);
     EXPECT_INT_GE(0, asprintf(&local_path, "%s/%s", tdir, "spans.json"));
-    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s",
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s",
                 HTRACE_SPAN_RECEIVER_KEY, "local.file",
-                HTRACE_LOCAL_FILE_RCV_PATH_KEY, local_path));
+                HTRACE_LOCAL_FILE_RCV_PATH_KEY, local_path, extra_conf));
     EXPECT_INT_ZERO(rt->run(rt, conf_str));
     EXPECT_INT_GE(0, load_trace_span_file(local_path, st));
     EXPECT_INT_ZERO(rt->verify(rt, st));
@@ -56,17 +60,405 @@ static int local_file_rcv_test(struct rtest *rt)
     return EXIT_SUCCESS;
 }
 
+static int local_file_rcv_stats_test(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *local_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *outer, *inner;
+    struct htrace_stats stats;
+    struct stat st;
+
+    tdir = create_tempdir("local_file_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&local_path, "%s/%s", tdir, "stats.json"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s",
+                HTRACE_SPAN_RECEIVER_KEY, "local.file",
+                HTRACE_LOCAL_FILE_RCV_PATH_KEY, local_path,
+                HTRACE_SAMPLER_KEY, "always"));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("local_file_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    outer = htrace_start_span(tracer, smp, "outer");
+    EXPECT_NONNULL(outer);
+    inner = htrace_start_span(tracer, smp, "inner");
+    EXPECT_NONNULL(inner);
+    EXPECT_NULL(htrace_start_span(tracer, smp, "bad\"desc"));
+    htrace_scope_close(inner);
+    htrace_scope_close(outer);
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ((uint64_t)3, stats.spans_started);
+    EXPECT_UINT64_EQ((uint64_t)2, stats.spans_sampled);
+    EXPECT_UINT64_EQ((uint64_t)2, stats.spans_closed);
+    EXPECT_UINT64_EQ((uint64_t)1, stats.dropped_invalid);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_xmit);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.rpcs);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    EXPECT_INT_ZERO(stat(local_path, &st));
+    EXPECT_UINT64_EQ((uint64_t)st.st_size, stats.bytes_serialized);
+    free(conf_str);
+    free(local_path);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
+#define LOCAL_FILE_BATCH_SIZE 4
+
+struct local_file_batch_thread {
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    int num_spans;
+};
+
+static void *local_file_batch_thread_run(void *data)
+{
+    struct local_file_batch_thread *bt = data;
+    int i;
+
+    for (i = 0; i < bt->num_spans; i++) {
+        htrace_scope_close(htrace_start_span(bt->tracer, bt->smp, "thread"));
+    }
+    return NULL;
+}
+
+static int local_file_rcv_batch_test(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *local_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_stats stats;
+    struct local_file_batch_thread bt;
+    struct span_table *st;
+    uint64_t bytes;
+    pthread_t thread;
+    int i;
+
+    tdir = create_tempdir("local_file_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&local_path, "%s/%s", tdir, "batch.json"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s;%s=%d;%s=%d",
+                HTRACE_SPAN_RECEIVER_KEY, "local.file",
+                HTRACE_LOCAL_FILE_RCV_PATH_KEY, local_path,
+                HTRACE_SAMPLER_KEY, "always",
+                HTRACE_BATCH_SIZE_KEY, LOCAL_FILE_BATCH_SIZE,
+                HTRACE_BATCH_MAX_AGE_MS_KEY, 1000000));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("local_file_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+
+    // Nothing reaches the receiver until a batch fills up.
+    for (i = 0; i < LOCAL_FILE_BATCH_SIZE - 1; i++) {
+        htrace_scope_close(htrace_start_span(tracer, smp, "main"));
+    }
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.bytes_serialized);
+    htrace_scope_close(htrace_start_span(tracer, smp, "main"));
+    htracer_get_stats(tracer, &stats);
+    EXPECT_INT_EQ(1, stats.bytes_serialized > 0);
+    bytes = stats.bytes_serialized;
+
+    // A partial batch is handed over when its thread exits.
+    bt.tracer = tracer;
+    bt.smp = smp;
+    bt.num_spans = LOCAL_FILE_BATCH_SIZE - 1;
+    EXPECT_INT_ZERO(pthread_create(&thread, NULL,
+                                   local_file_batch_thread_run, &bt));
+    EXPECT_INT_ZERO(pthread_join(thread, NULL));
+    htracer_get_stats(tracer, &stats);
+    EXPECT_INT_EQ(1, stats.bytes_serialized > bytes);
+
+    // ...and so is the main thread's, when the tracer is freed.
+    htrace_scope_close(htrace_start_span(tracer, smp, "main"));
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+
+    st = span_table_alloc();
+    EXPECT_NONNULL(st);
+    EXPECT_INT_EQ((LOCAL_FILE_BATCH_SIZE * 2),
+                  load_trace_span_file(local_path, st));
+    span_table_free(st);
+    free(conf_str);
+    free(local_path);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
+#define LOCAL_FILE_ROTATE_KEEP 3
+
+#define LOCAL_FILE_ROTATE_NUM_SPANS 5
+
+static int local_file_rcv_rotate_test(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *local_path, *rot_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct span_table *st;
+    struct stat sb;
+    int i;
+
+    tdir = create_tempdir("local_file_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&local_path, "%s/%s", tdir, "rotate.json"));
+    // Rotate after every span.
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s;%s=%d;%s=%d;"
+                "%s=%s",
+                HTRACE_SPAN_RECEIVER_KEY, "local.file",
+                HTRACE_LOCAL_FILE_RCV_PATH_KEY, local_path,
+                HTRACE_SAMPLER_KEY, "always",
+                HTRACE_LOCAL_FILE_ROTATE_SIZE_KEY, 1,
+                HTRACE_LOCAL_FILE_ROTATE_KEEP_KEY, LOCAL_FILE_ROTATE_KEEP,
+                HTRACE_LOCAL_FILE_FDATASYNC_KEY, "write"));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("local_file_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    for (i = 0; i < LOCAL_FILE_ROTATE_NUM_SPANS; i++) {
+        htrace_scope_close(htrace_start_span(tracer, smp, "rotate"));
+    }
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+
+    // The current file is empty, and only the newest rotated files are left.
+    EXPECT_INT_ZERO(stat(local_path, &sb));
+    EXPECT_UINT64_EQ((uint64_t)0, (uint64_t)sb.st_size);
+    for (i = 1; i <= LOCAL_FILE_ROTATE_KEEP + 1; i++) {
+        EXPECT_INT_GE(0, asprintf(&rot_path, "%s.%d", local_path, i));
+        if (i > LOCAL_FILE_ROTATE_KEEP) {
+            EXPECT_INT_EQ(-1, stat(rot_path, &sb));
+        } else {
+            st = span_table_alloc();
+            EXPECT_NONNULL(st);
+            EXPECT_INT_EQ(1, load_trace_span_file(rot_path, st));
+            span_table_free(st);
+        }
+        free(rot_path);
+    }
+    free(conf_str);
+    free(local_path);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
+#define LOCAL_FILE_ASYNC_NUM_THREADS 4
+
+#define LOCAL_FILE_ASYNC_SPANS_PER_THREAD 2000
+
+/**
+ * Count the spans in a local file and all of its rotated copies.
+ */
+static int local_file_count_rotated(const char *local_path)
+{
+    char *rot_path;
+    struct span_table *st;
+    struct stat sb;
+    int i, num, total = 0;
+
+    for (i = 0; ; i++) {
+        if (i == 0) {
+            rot_path = strdup(local_path);
+        } else if (asprintf(&rot_path, "%s.%d", local_path, i) < 0) {
+            rot_path = NULL;
+        }
+        EXPECT_NONNULL(rot_path);
+        if (stat(rot_path, &sb) < 0) {
+            free(rot_path);
+            break;
+        }
+        st = span_table_alloc();
+        EXPECT_NONNULL(st);
+        num = load_trace_span_file(rot_path, st);
+        EXPECT_INT_GE(0, num);
+        total += num;
+        span_table_free(st);
+        free(rot_path);
+    }
+    return total;
+}
+
+static int local_file_rcv_async_test(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *local_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_stats stats;
+    struct local_file_batch_thread bt;
+    pthread_t threads[LOCAL_FILE_ASYNC_NUM_THREADS];
+    int i;
+
+    tdir = create_tempdir("local_file_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&local_path, "%s/%s", tdir, "async.json"));
+    // Use the smallest buffers, so that the staging buffers fill up, and
+    // rotate often, keeping every file.
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s;%s=%s;%s=%d;"
+                "%s=%d;%s=%d;%s=%s",
+                HTRACE_SPAN_RECEIVER_KEY, "local.file",
+                HTRACE_LOCAL_FILE_RCV_PATH_KEY, local_path,
+                HTRACE_SAMPLER_KEY, "always",
+                HTRACE_LOCAL_FILE_ASYNC_KEY, "true",
+                HTRACE_LOCAL_FILE_BUFFER_SIZE_KEY, 65536,
+                HTRACE_LOCAL_FILE_ROTATE_SIZE_KEY, 65536,
+                HTRACE_LOCAL_FILE_ROTATE_KEEP_KEY, 1000,
+                HTRACE_LOCAL_FILE_FDATASYNC_KEY, "interval"));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("local_file_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+
+    // Flushing makes the writer thread sweep the staging buffers.
+    htrace_scope_close(htrace_start_span(tracer, smp, "main"));
+    tracer->rcv->ty->flush(tracer->rcv);
+    htracer_get_stats(tracer, &stats);
+    EXPECT_INT_EQ(1, stats.bytes_serialized > 0);
+    EXPECT_INT_EQ(1, local_file_count_rotated(local_path));
+
+    bt.tracer = tracer;
+    bt.smp = smp;
+    bt.num_spans = LOCAL_FILE_ASYNC_SPANS_PER_THREAD;
+    for (i = 0; i < LOCAL_FILE_ASYNC_NUM_THREADS; i++) {
+        EXPECT_INT_ZERO(pthread_create(&threads[i], NULL,
+                                       local_file_batch_thread_run, &bt));
+    }
+    for (i = 0; i < LOCAL_FILE_ASYNC_NUM_THREADS; i++) {
+        EXPECT_INT_ZERO(pthread_join(threads[i], NULL));
+    }
+    htrace_sampler_free(smp);
+    htracer_get_stats(tracer, &stats);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_xmit);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.dropped_oom);
+    EXPECT_INT_EQ(1 + (LOCAL_FILE_ASYNC_NUM_THREADS *
+                       LOCAL_FILE_ASYNC_SPANS_PER_THREAD),
+                  local_file_count_rotated(local_path));
+    free(conf_str);
+    free(local_path);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * In lazy mode, the file isn't created until the first sampled span is
+ * closed, and never created if no span is sampled.
+ */
+static int local_file_rcv_lazy_test(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *local_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *never, *always;
+    struct htrace_stats stats;
+    struct htrace_span *span;
+    struct span_table *st;
+    struct stat sb;
+
+    tdir = create_tempdir("local_file_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&local_path, "%s/%s", tdir, "lazy.json"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s",
+                HTRACE_SPAN_RECEIVER_KEY, "local.file",
+                HTRACE_LOCAL_FILE_RCV_PATH_KEY, local_path,
+                HTRACE_SPAN_RECEIVER_LAZY_KEY, "true"));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("local_file_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    EXPECT_INT_ZERO(strcmp("lazy", tracer->rcv->ty->name));
+    never = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(never);
+    htrace_conf_free(cnf);
+    cnf = htrace_conf_from_str(HTRACE_SAMPLER_KEY "=always");
+    EXPECT_NONNULL(cnf);
+    always = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(always);
+    htrace_conf_free(cnf);
+
+    // The receiver must work from its own copy of the configuration.
+    htrace_scope_close(htrace_start_span(tracer, never, "unsampled"));
+    tracer->rcv->ty->flush(tracer->rcv);
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ((uint64_t)0, stats.bytes_serialized);
+    EXPECT_INT_EQ(-1, stat(local_path, &sb));
+    EXPECT_NULL(htrace_rcv_find(tracer->rcv, &g_local_file_rcv_ty));
+
+    htrace_scope_close(htrace_start_span(tracer, always, "sampled"));
+    tracer->rcv->ty->flush(tracer->rcv);
+    EXPECT_INT_ZERO(stat(local_path, &sb));
+    EXPECT_NONNULL(htrace_rcv_find(tracer->rcv, &g_local_file_rcv_ty));
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ((uint64_t)sb.st_size, stats.bytes_serialized);
+    st = span_table_alloc();
+    EXPECT_INT_EQ(1, load_trace_span_file(local_path, st));
+    EXPECT_INT_ZERO(span_table_get(st, &span, "sampled", tracer->trid));
+    span_table_free(st);
+    htrace_sampler_free(never);
+    htrace_sampler_free(always);
+    htracer_free(tracer);
+    free(conf_str);
+    free(local_path);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
 int main(void)
 {
     int i;
 
     for (i = 0; g_rtests[i]; i++) {
         struct rtest *rtest = g_rtests[i];
-        if (local_file_rcv_test(rtest) != EXIT_SUCCESS) {
+        if (local_file_rcv_test(rtest, "") != EXIT_SUCCESS) {
             fprintf(stderr, "rtest %s failed\n", rtest->name);
             return EXIT_FAILURE;
         }
+        if (local_file_rcv_test(rtest, HTRACE_LOCAL_FILE_ASYNC_KEY "=true")
+                != EXIT_SUCCESS) {
+            fprintf(stderr, "rtest %s failed in async mode\n", rtest->name);
+            return EXIT_FAILURE;
+        }
     }
+    EXPECT_INT_ZERO(local_file_rcv_stats_test());
+    EXPECT_INT_ZERO(local_file_rcv_batch_test());
+    EXPECT_INT_ZERO(local_file_rcv_rotate_test());
+    EXPECT_INT_ZERO(local_file_rcv_async_test());
+    EXPECT_INT_ZERO(local_file_rcv_lazy_test());
 
     return EXIT_SUCCESS;
 }
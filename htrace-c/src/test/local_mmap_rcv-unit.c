@@ -0,0 +1,262 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/span.h"
+#include "receiver/local_mmap.h"
+#include "test/rtest.h"
+#include "test/span_table.h"
+#include "test/span_util.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+#include "util/cmp.h"
+#include "util/cmp_util.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/**
+ * What we found in a local.mmap file.
+ */
+struct mmap_contents {
+    uint8_t *buf;
+    uint64_t len;
+    uint64_t num_regions;
+    uint64_t committed;
+    int num_spans;
+};
+
+static int mmap_read(const char *path, struct mmap_contents *mc)
+{
+    struct stat st;
+    FILE *fp;
+
+    memset(mc, 0, sizeof(*mc));
+    EXPECT_INT_ZERO(stat(path, &st));
+    mc->len = st.st_size;
+    mc->buf = xcalloc(mc->len + 1);
+    fp = fopen(path, "r");
+    EXPECT_NONNULL(fp);
+    EXPECT_UINT64_EQ(mc->len, (uint64_t)fread(mc->buf, 1, mc->len, fp));
+    EXPECT_INT_ZERO(fclose(fp));
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Put the committed spans of every claimed region in the span table.
+ */
+static int mmap_load(struct mmap_contents *mc, struct span_table *st)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    const struct local_mmap_header *hdr;
+    const struct local_mmap_region_header *rh;
+    struct cmp_bcopy_ctx bctx;
+    struct htrace_span *span;
+    uint64_t i, used;
+
+    EXPECT_INT_EQ(1, mc->len >= LOCAL_MMAP_HEADER_LEN);
+    hdr = (const struct local_mmap_header *)mc->buf;
+    EXPECT_UINT64_EQ((uint64_t)LOCAL_MMAP_MAGIC, (uint64_t)hdr->magic);
+    EXPECT_INT_EQ(LOCAL_MMAP_VERSION, hdr->version);
+    used = hdr->next_region;
+    if (used > hdr->num_regions) {
+        used = hdr->num_regions;
+    }
+    // The file is truncated after the last claimed region.
+    EXPECT_UINT64_EQ(LOCAL_MMAP_HEADER_LEN + (used * hdr->region_len),
+                     mc->len);
+    for (i = 0; i < used; i++) {
+        rh = (const struct local_mmap_region_header *)
+            (mc->buf + LOCAL_MMAP_HEADER_LEN + (i * hdr->region_len));
+        if (rh->magic != LOCAL_MMAP_REGION_MAGIC) {
+            continue;
+        }
+        EXPECT_INT_EQ(1, rh->committed + sizeof(*rh) <= hdr->region_len);
+        mc->num_regions++;
+        mc->committed += rh->committed;
+        cmp_bcopy_ctx_init(&bctx, (void *)(rh + 1), rh->committed);
+        while (bctx.off < rh->committed) {
+            err[0] = '\0';
+            span = span_read_msgpack((cmp_ctx_t*)&bctx, err, err_len);
+            EXPECT_STR_EQ("", err);
+            EXPECT_NONNULL(span);
+            EXPECT_INT_ZERO(span_table_put(st, span));
+            mc->num_spans++;
+        }
+        EXPECT_UINT64_EQ(rh->committed, (uint64_t)bctx.off);
+    }
+    return EXIT_SUCCESS;
+}
+
+static int local_mmap_rcv_test(struct rtest *rt, int region_size)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *local_path, *tdir, *conf_str = NULL;
+    struct mmap_contents mc;
+    struct span_table *st;
+
+    st = span_table_alloc();
+    tdir = create_tempdir("local_mmap_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&local_path, "%s/%s", tdir, "spans.mmap"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%d;%s=%d",
+                HTRACE_SPAN_RECEIVER_KEY, "local.mmap",
+                HTRACE_LOCAL_MMAP_RCV_PATH_KEY, local_path,
+                HTRACE_LOCAL_MMAP_SIZE_KEY, 16 * 1024 * 1024,
+                HTRACE_LOCAL_MMAP_REGION_SIZE_KEY, region_size));
+    EXPECT_INT_ZERO(rt->run(rt, conf_str));
+    EXPECT_INT_ZERO(mmap_read(local_path, &mc));
+    EXPECT_INT_ZERO(mmap_load(&mc, st));
+    EXPECT_INT_EQ(rt->spans_created, mc.num_spans);
+    EXPECT_INT_ZERO(rt->verify(rt, st));
+    free(mc.buf);
+    free(conf_str);
+    free(local_path);
+    free(tdir);
+    span_table_free(st);
+
+    return EXIT_SUCCESS;
+}
+
+#define LOCAL_MMAP_NUM_THREADS 4
+
+#define LOCAL_MMAP_SPANS_PER_THREAD 500
+
+struct local_mmap_thread {
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    int num_spans;
+};
+
+static void *local_mmap_thread_run(void *data)
+{
+    struct local_mmap_thread *mt = data;
+    int i;
+
+    for (i = 0; i < mt->num_spans; i++) {
+        htrace_scope_close(htrace_start_span(mt->tracer, mt->smp, "thread"));
+    }
+    return NULL;
+}
+
+/**
+ * Add spans from several threads to a file with room for size bytes of
+ * regions, and check what was written.
+ */
+static int local_mmap_rcv_threads_test(int size, int expect_full)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *local_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_stats stats;
+    struct local_mmap_thread mt;
+    struct mmap_contents mc;
+    struct span_table *st;
+    pthread_t threads[LOCAL_MMAP_NUM_THREADS];
+    int i;
+
+    tdir = create_tempdir("local_mmap_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&local_path, "%s/%s", tdir, "threads.mmap"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s;%s=%d;%s=%d",
+                HTRACE_SPAN_RECEIVER_KEY, "local.mmap",
+                HTRACE_LOCAL_MMAP_RCV_PATH_KEY, local_path,
+                HTRACE_SAMPLER_KEY, "always",
+                HTRACE_LOCAL_MMAP_SIZE_KEY, size,
+                HTRACE_LOCAL_MMAP_REGION_SIZE_KEY, 4096));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("local_mmap_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    mt.tracer = tracer;
+    mt.smp = smp;
+    mt.num_spans = LOCAL_MMAP_SPANS_PER_THREAD;
+    for (i = 0; i < LOCAL_MMAP_NUM_THREADS; i++) {
+        EXPECT_INT_ZERO(pthread_create(&threads[i], NULL,
+                                       local_mmap_thread_run, &mt));
+    }
+    for (i = 0; i < LOCAL_MMAP_NUM_THREADS; i++) {
+        EXPECT_INT_ZERO(pthread_join(threads[i], NULL));
+    }
+    htracer_get_stats(tracer, &stats);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+
+    EXPECT_UINT64_EQ((uint64_t)(LOCAL_MMAP_NUM_THREADS *
+                                LOCAL_MMAP_SPANS_PER_THREAD),
+                     stats.buffered + stats.dropped_newest);
+    EXPECT_INT_EQ(expect_full, stats.dropped_newest > 0);
+    EXPECT_INT_ZERO(mmap_read(local_path, &mc));
+    st = span_table_alloc();
+    EXPECT_NONNULL(st);
+    EXPECT_INT_ZERO(mmap_load(&mc, st));
+    EXPECT_UINT64_EQ(stats.buffered, (uint64_t)mc.num_spans);
+    EXPECT_UINT64_EQ(stats.bytes_serialized, mc.committed);
+    if (!expect_full) {
+        // Every thread got at least one region of its own.
+        EXPECT_INT_EQ(1, mc.num_regions >= LOCAL_MMAP_NUM_THREADS);
+    }
+    span_table_free(st);
+    free(mc.buf);
+    free(conf_str);
+    free(local_path);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    int i;
+
+    for (i = 0; g_rtests[i]; i++) {
+        struct rtest *rtest = g_rtests[i];
+        if (local_mmap_rcv_test(rtest, 1048576) != EXIT_SUCCESS) {
+            fprintf(stderr, "rtest %s failed\n", rtest->name);
+            return EXIT_FAILURE;
+        }
+        if (local_mmap_rcv_test(rtest, 4096) != EXIT_SUCCESS) {
+            fprintf(stderr, "rtest %s failed with small regions\n",
+                    rtest->name);
+            return EXIT_FAILURE;
+        }
+    }
+    EXPECT_INT_ZERO(local_mmap_rcv_threads_test(16 * 1024 * 1024, 0));
+    EXPECT_INT_ZERO(local_mmap_rcv_threads_test(2 * 4096, 1));
+
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
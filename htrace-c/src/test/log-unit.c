@@ -17,6 +17,7 @@
  */
 
 #include "core/conf.h"
+#include "core/htrace.h"
 #include "test/temp_dir.h"
 #include "test/test.h"
 #include "util/log.h"
@@ -26,14 +27,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-static int verify_log_file(const char *path)
+static int verify_log_file(const char *path, const char *expected_contents)
 {
     FILE *fp;
     char contents[4096];
     size_t res;
-    const char * const expected_contents =
-        "foo 2, bar, and baz.\nquux as well.\n";
 
     fp = fopen(path, "r");
     if (!fp) {
@@ -80,7 +80,52 @@ static int verify_log_to_file(void)
     htrace_log(lg, "foo %d, bar, and baz.\n", 2);
     htrace_log(lg, "quux as well.\n");
     htrace_log_free(lg);
-    EXPECT_INT_ZERO(verify_log_file(log_path));
+    EXPECT_INT_ZERO(verify_log_file(log_path,
+                "foo 2, bar, and baz.\nquux as well.\n"));
+    htrace_conf_free(conf);
+    free(tdir);
+
+    return EXIT_SUCCESS;
+}
+
+static void log_limited(struct htrace_log *lg, int i)
+{
+    HTRACE_LOG_RATELIMITED(lg, HTRACE_LOG_WARN, "limited %d\n", i);
+}
+
+static int verify_async_log(void)
+{
+    struct htrace_conf *conf;
+    struct htrace_log *lg;
+    char *tdir, log_path[PATH_MAX], *conf_str;
+    char err[128];
+    size_t err_len = sizeof(err);
+    struct timespec ts;
+
+    tdir = create_tempdir("verify_async_log", 0775, err, err_len);
+    EXPECT_NONNULL(tdir);
+    EXPECT_INT_ZERO(register_tempdir_for_cleanup(tdir));
+    snprintf(log_path, sizeof(log_path), "%s/log.txt", tdir);
+    EXPECT_INT_GE(0, asprintf(&conf_str, "log.path=%s;log.level=warn;"
+                              "log.ratelimit.ms=200", log_path));
+    conf = htrace_conf_from_str(conf_str);
+    free(conf_str);
+    EXPECT_NONNULL(conf);
+    lg = htrace_log_alloc(conf);
+    EXPECT_NONNULL(lg);
+    htrace_log_at(lg, HTRACE_LOG_ERROR, "an error\n");
+    htrace_log_at(lg, HTRACE_LOG_DEBUG, "too verbose\n");
+    htrace_log(lg, "also too verbose\n");
+    log_limited(lg, 1);
+    log_limited(lg, 2);
+    log_limited(lg, 3);
+    ts.tv_sec = 0;
+    ts.tv_nsec = 300000000;
+    nanosleep(&ts, NULL);
+    log_limited(lg, 4);
+    htrace_log_free(lg);
+    EXPECT_INT_ZERO(verify_log_file(log_path, "an error\nlimited 1\n"
+                "[2 similar message(s) suppressed] limited 4\n"));
     htrace_conf_free(conf);
     free(tdir);
 
@@ -90,6 +135,7 @@ static int verify_log_to_file(void)
 int main(void)
 {
     EXPECT_INT_ZERO(verify_log_to_file());
+    EXPECT_INT_ZERO(verify_async_log());
 
     return EXIT_SUCCESS;
 }
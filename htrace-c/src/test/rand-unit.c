@@ -22,10 +22,14 @@
 #include "util/rand.h"
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 struct htrace_log *g_rand_unit_lg;
 
@@ -75,6 +79,97 @@ static int test_u32_uniqueness(void)
     return EXIT_SUCCESS;
 }
 
+#define NUM_FORK_VALS 16
+
+/**
+ * Test that a forked child doesn't repeat the numbers its parent will get.
+ */
+static int test_fork_reseeds(void)
+{
+    struct random_src *rnd = random_src_alloc(g_rand_unit_lg);
+    uint64_t parent[NUM_FORK_VALS], child[NUM_FORK_VALS];
+    int i, fds[2], status;
+    size_t total = 0;
+    pid_t pid;
+
+    EXPECT_NONNULL(rnd);
+    // Make sure this thread's generator is seeded before we fork.
+    random_u64(rnd);
+    EXPECT_INT_ZERO(pipe(fds));
+    pid = fork();
+    EXPECT_INT_EQ(1, pid >= 0);
+    if (pid == 0) {
+        for (i = 0; i < NUM_FORK_VALS; i++) {
+            child[i] = random_u64(rnd);
+        }
+        _exit(write(fds[1], child, sizeof(child)) == sizeof(child) ? 0 : 1);
+    }
+    close(fds[1]);
+    for (i = 0; i < NUM_FORK_VALS; i++) {
+        parent[i] = random_u64(rnd);
+    }
+    while (total < sizeof(child)) {
+        ssize_t res = read(fds[0], ((char*)child) + total,
+                           sizeof(child) - total);
+        EXPECT_INT_EQ(1, res > 0);
+        total += res;
+    }
+    close(fds[0]);
+    EXPECT_INT_EQ(pid, waitpid(pid, &status, 0));
+    EXPECT_INT_EQ(1, WIFEXITED(status));
+    EXPECT_INT_ZERO(WEXITSTATUS(status));
+    EXPECT_INT_EQ(1, memcmp(parent, child, sizeof(child)) != 0);
+    random_src_free(rnd);
+    return EXIT_SUCCESS;
+}
+
+#define NUM_THREADS 4
+
+struct thread_vals {
+    struct random_src *rnd;
+    uint64_t vals[NUM_FORK_VALS];
+};
+
+static void *fill_thread_vals(void *data)
+{
+    struct thread_vals *tv = data;
+    int i;
+
+    for (i = 0; i < NUM_FORK_VALS; i++) {
+        tv->vals[i] = random_u64(tv->rnd);
+    }
+    return NULL;
+}
+
+/**
+ * Test that each thread gets its own sequence of numbers.
+ */
+static int test_threads_differ(void)
+{
+    struct random_src *rnd = random_src_alloc(g_rand_unit_lg);
+    struct thread_vals tv[NUM_THREADS];
+    pthread_t threads[NUM_THREADS];
+    int i, j;
+
+    EXPECT_NONNULL(rnd);
+    for (i = 0; i < NUM_THREADS; i++) {
+        tv[i].rnd = rnd;
+        EXPECT_INT_ZERO(pthread_create(&threads[i], NULL,
+                                       fill_thread_vals, &tv[i]));
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        EXPECT_INT_ZERO(pthread_join(threads[i], NULL));
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        for (j = i + 1; j < NUM_THREADS; j++) {
+            EXPECT_INT_EQ(1, memcmp(tv[i].vals, tv[j].vals,
+                                    sizeof(tv[i].vals)) != 0);
+        }
+    }
+    random_src_free(rnd);
+    return EXIT_SUCCESS;
+}
+
 int main(void)
 {
     struct htrace_conf *conf;
@@ -84,6 +179,8 @@ int main(void)
     g_rand_unit_lg = htrace_log_alloc(conf);
     EXPECT_NONNULL(g_rand_unit_lg);
     EXPECT_INT_ZERO(test_u32_uniqueness());
+    EXPECT_INT_ZERO(test_fork_reseeds());
+    EXPECT_INT_ZERO(test_threads_differ());
     htrace_log_free(g_rand_unit_lg);
     htrace_conf_free(conf);
 
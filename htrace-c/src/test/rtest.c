@@ -159,8 +159,90 @@ static struct rtest g_rtest_simple = {
     rtest_simple_verify,
 };
 
+#define RTEST_INTERNED_LONG_DESC \
+    "interned_child_with_a_description_too_long_for_the_inline_buffer"
+
+/**
+ * Start a span with a struct htrace_name.
+ */
+static int rtest_interned_named(struct rtest_data *rdata)
+{
+    HTRACE_SCOPE_NAME(scope, rdata->tracer, NULL, "interned_named");
+    EXPECT_NONNULL(scope);
+    return EXIT_SUCCESS;
+}
+
+static int rtest_interned_run(struct rtest *rt, const char *conf_str)
+{
+    const struct htrace_desc *parent_desc, *child_desc;
+    struct htrace_scope *scope0, *scope1;
+    struct rtest_data *rdata = NULL;
+    struct htrace_name bad = HTRACE_NAME_INIT("bad\"name");
+    struct htrace_scope_storage storage;
+
+    EXPECT_INT_ZERO(rtest_data_init(conf_str, &rdata));
+    EXPECT_NONNULL(rdata);
+    parent_desc = htrace_desc_register(rdata->tracer, "interned_parent");
+    EXPECT_NONNULL(parent_desc);
+    EXPECT_TRUE((parent_desc ==
+        htrace_desc_register(rdata->tracer, "interned_parent")));
+    child_desc = htrace_desc_register(rdata->tracer,
+                                      RTEST_INTERNED_LONG_DESC);
+    EXPECT_NONNULL(child_desc);
+    EXPECT_TRUE((parent_desc != child_desc));
+    EXPECT_NULL(htrace_desc_register(rdata->tracer, "bad\"desc"));
+    EXPECT_NULL(htrace_start_span_desc(rdata->tracer, rdata->always, NULL));
+
+    scope0 = htrace_start_span_desc(rdata->tracer, rdata->always,
+                                    parent_desc);
+    EXPECT_NONNULL(scope0);
+    scope1 = htrace_start_span_desc(rdata->tracer, NULL, child_desc);
+    EXPECT_NONNULL(scope1);
+    EXPECT_INT_ZERO(rtest_interned_named(rdata));
+    htrace_scope_close(scope1);
+    EXPECT_NULL(htrace_start_span_name_inplace(&storage, rdata->tracer,
+                                               rdata->always, &bad));
+    EXPECT_NULL(htrace_start_span_name_inplace(&storage, rdata->tracer,
+                                               rdata->always, &bad));
+    htrace_scope_close(scope0);
+    rt->spans_created = 3;
+    rtest_data_free(rdata);
+    return EXIT_SUCCESS;
+}
+
+static int rtest_interned_verify(struct rtest *rt, struct span_table *st)
+{
+    struct htrace_span *span;
+    struct htrace_span_id parent_id;
+    char trid[128];
+
+    EXPECT_INT_ZERO(rtest_verify_table_size(rt, st));
+    get_receiver_test_trid(trid, sizeof(trid));
+    EXPECT_INT_ZERO(span_table_get(st, &span, "interned_parent", trid));
+    htrace_span_id_copy(&parent_id, &span->span_id);
+    EXPECT_INT_ZERO(span->num_parents);
+
+    EXPECT_INT_ZERO(span_table_get(st, &span, RTEST_INTERNED_LONG_DESC, trid));
+    EXPECT_INT_EQ(1, span->num_parents);
+    EXPECT_INT_ZERO(htrace_span_id_compare(&parent_id, &span->parent.single));
+    htrace_span_id_copy(&parent_id, &span->span_id);
+
+    EXPECT_INT_ZERO(span_table_get(st, &span, "interned_named", trid));
+    EXPECT_INT_EQ(1, span->num_parents);
+    EXPECT_INT_ZERO(htrace_span_id_compare(&parent_id, &span->parent.single));
+
+    return EXIT_SUCCESS;
+}
+
+static struct rtest g_rtest_interned = {
+    "rtest_interned",
+    rtest_interned_run,
+    rtest_interned_verify,
+};
+
 struct rtest * const g_rtests[] = {
     &g_rtest_simple,
+    &g_rtest_interned,
     NULL
 };
 
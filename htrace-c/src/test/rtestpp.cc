@@ -31,11 +31,14 @@ extern "C" {
 
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 }
 
+#include <vector>
+
 /**
  * @file rtestpp.cc
  *
@@ -143,8 +146,242 @@ struct rtest g_rtestpp_simple = {
     rtestpp_simple_verify,
 };
 
+#if __cplusplus >= 201103L
+static htrace::Scope start_scope(RTestData &tdata, const char *name)
+{
+    return htrace::Scope(tdata.tracer_, tdata.always_, name);
+}
+
+int rtestpp_move_run(struct rtest *rt, const char *conf_str)
+{
+    RTestData tdata(rt, conf_str);
+    EXPECT_INT_ZERO(tdata.TestInit());
+
+    htrace::Scope outer(start_scope(tdata, "outer"));
+    {
+        // Only the first five bytes are the description.
+        htrace::Scope len(tdata.tracer_, "inner-not-part-of-it", 5);
+        EXPECT_INT_ZERO(len.AddKv("keyXX", 3, "valXX", 3));
+        EXPECT_INT_ZERO(len.AddEvent("evtXX", 3));
+        EXPECT_INT_EQ(EINVAL, len.AddEvent("a\0b", 3));
+        htrace::Scope moved(static_cast<htrace::Scope&&>(len));
+        EXPECT_INT_ZERO(len.AddEvent("dropped"));
+    }
+    {
+        std::vector<htrace::Scope> scopes;
+        char name[32];
+        int i;
+
+        // Growing the vector moves the scopes which are already open.
+        for (i = 0; i < 10; i++) {
+            snprintf(name, sizeof(name), "vec%d", i);
+            scopes.push_back(htrace::Scope(tdata.tracer_, std::string(name)));
+        }
+        while (!scopes.empty()) {
+            scopes.pop_back();
+        }
+    }
+#if __cplusplus >= 201703L
+    {
+        std::string_view view("view-and-then-some", 4);
+        htrace::Scope scope(tdata.tracer_, view);
+        EXPECT_INT_ZERO(scope.AddKv(std::string_view("k"), view));
+    }
+#endif
+    rt->spans_created = 12;
+#if __cplusplus >= 201703L
+    rt->spans_created++;
+#endif
+    return EXIT_SUCCESS;
+}
+
+int rtestpp_move_verify(struct rtest *rt, struct span_table *st)
+{
+    struct htrace_span *span, *prev;
+    struct htrace_span_id outer_id;
+    char trid[128], name[32];
+    int i;
+
+    EXPECT_INT_ZERO(rtest_generic_verify(rt, st));
+    get_receiver_test_trid(trid, sizeof(trid));
+    EXPECT_INT_ZERO(span_table_get(st, &span, "outer", trid));
+    EXPECT_INT_ZERO(span->num_parents);
+    htrace_span_id_copy(&outer_id, &span->span_id);
+
+    EXPECT_INT_ZERO(span_table_get(st, &span, "inner", trid));
+    EXPECT_INT_EQ(1, span->num_parents);
+    EXPECT_TRUE(0 == htrace_span_id_compare(&outer_id, &span->parent.single));
+    EXPECT_STR_EQ("val", htrace_span_get_kv(span, "key"));
+    EXPECT_NONNULL(span->extra);
+    EXPECT_INT_EQ(1, span->extra->num_kvs);
+    EXPECT_INT_EQ(1, span->extra->num_events);
+
+    // Each vector scope is the child of the one before it, even though they
+    // were all moved while open.
+    prev = NULL;
+    for (i = 0; i < 10; i++) {
+        snprintf(name, sizeof(name), "vec%d", i);
+        EXPECT_INT_ZERO(span_table_get(st, &span, name, trid));
+        EXPECT_INT_EQ(1, span->num_parents);
+        EXPECT_TRUE(0 == htrace_span_id_compare(
+            (prev ? &prev->span_id : &outer_id), &span->parent.single));
+        prev = span;
+    }
+#if __cplusplus >= 201703L
+    EXPECT_INT_ZERO(span_table_get(st, &span, "view", trid));
+    EXPECT_STR_EQ("view", htrace_span_get_kv(span, "k"));
+#endif
+    return EXIT_SUCCESS;
+}
+
+struct rtest g_rtestpp_move = {
+    "rtestpp_move",
+    rtestpp_move_run,
+    rtestpp_move_verify,
+};
+
+static_assert(htrace::SpanName::Valid("caf\xc3\xa9\xe2\x82\xac", 8),
+              "UTF-8 should be accepted");
+static_assert(!htrace::SpanName::Valid("a\"b", 3), "quotes are invalid");
+static_assert(!htrace::SpanName::Valid("a\\b", 3), "backslashes are invalid");
+static_assert(!htrace::SpanName::Valid("a\nb", 3), "newlines are invalid");
+static_assert(!htrace::SpanName::Valid("\xc3", 1), "truncated UTF-8");
+
+static void start_named(RTestData &tdata)
+{
+    htrace::Scope scope(tdata.tracer_, HTRACE_NAME("named_child"));
+}
+
+int rtestpp_name_run(struct rtest *rt, const char *conf_str)
+{
+    RTestData tdata(rt, conf_str);
+    EXPECT_INT_ZERO(tdata.TestInit());
+
+    htrace::Scope scope(tdata.tracer_, tdata.always_,
+                        HTRACE_NAME("named_parent"));
+    start_named(tdata);
+    rt->spans_created = 2;
+    return EXIT_SUCCESS;
+}
+
+int rtestpp_name_verify(struct rtest *rt, struct span_table *st)
+{
+    struct htrace_span *span;
+    struct htrace_span_id parent_id;
+    char trid[128];
+
+    EXPECT_INT_ZERO(rtest_generic_verify(rt, st));
+    get_receiver_test_trid(trid, sizeof(trid));
+    EXPECT_INT_ZERO(span_table_get(st, &span, "named_parent", trid));
+    EXPECT_INT_ZERO(span->num_parents);
+    htrace_span_id_copy(&parent_id, &span->span_id);
+    EXPECT_INT_ZERO(span_table_get(st, &span, "named_child", trid));
+    EXPECT_INT_EQ(1, span->num_parents);
+    EXPECT_TRUE(0 == htrace_span_id_compare(&parent_id, &span->parent.single));
+    return EXIT_SUCCESS;
+}
+
+struct rtest g_rtestpp_name = {
+    "rtestpp_name",
+    rtestpp_name_run,
+    rtestpp_name_verify,
+};
+#endif
+
+struct ContextTask {
+    RTestData *tdata;
+    htrace::Context ctx;
+    htrace::Scope *scope;
+};
+
+/**
+ * Start a span from a Context on one thread, and close it on another.
+ */
+static void *context_task_start(void *data)
+{
+    ContextTask *task = static_cast<ContextTask*>(data);
+    task->scope = new htrace::Scope(task->tdata->tracer_, task->ctx,
+                                    "async_child");
+    task->scope->AddKv("thread", "worker");
+    return NULL;
+}
+
+int rtestpp_context_run(struct rtest *rt, const char *conf_str)
+{
+    RTestData tdata(rt, conf_str);
+    ContextTask task;
+    pthread_t thread;
+    EXPECT_INT_ZERO(tdata.TestInit());
+
+    htrace::Scope outer(tdata.tracer_, tdata.always_, "async_outer");
+    task.tdata = &tdata;
+    task.ctx = outer.GetContext();
+    task.scope = NULL;
+    EXPECT_TRUE(task.ctx.IsSampled());
+    EXPECT_TRUE((task.ctx.GetSpanId() == outer.GetSpanId()));
+    {
+        // The context survives a trip through its wire forms.
+        htrace::Context wire;
+        uint8_t buf[HTRACE_CONTEXT_LEN];
+        EXPECT_TRUE(wire.ExtractBase64(task.ctx.InjectBase64()));
+        EXPECT_TRUE((wire.GetSpanId() == outer.GetSpanId()));
+        task.ctx.Inject(buf);
+        EXPECT_TRUE(wire.Extract(buf, sizeof(buf)));
+        EXPECT_TRUE((wire.GetSpanId() == outer.GetSpanId()));
+        EXPECT_TRUE(!wire.ExtractBase64("not a context"));
+        EXPECT_TRUE(!wire.IsSampled());
+    }
+    EXPECT_INT_ZERO(pthread_create(&thread, NULL, context_task_start, &task));
+    EXPECT_INT_ZERO(pthread_join(thread, NULL));
+    EXPECT_NONNULL(task.scope);
+    {
+        // The async child is not this thread's current scope.
+        htrace::Scope sibling(tdata.tracer_, "async_sibling");
+    }
+    delete task.scope;
+    {
+        htrace::Context empty;
+        EXPECT_TRUE(!empty.IsSampled());
+        htrace::Scope none(tdata.tracer_, empty, "not_traced");
+        EXPECT_TRUE((none.GetSpanId() == htrace::SpanId()));
+    }
+    rt->spans_created = 3;
+    return EXIT_SUCCESS;
+}
+
+int rtestpp_context_verify(struct rtest *rt, struct span_table *st)
+{
+    struct htrace_span *span;
+    struct htrace_span_id outer_id;
+    char trid[128];
+
+    EXPECT_INT_ZERO(rtest_generic_verify(rt, st));
+    get_receiver_test_trid(trid, sizeof(trid));
+    EXPECT_INT_ZERO(span_table_get(st, &span, "async_outer", trid));
+    htrace_span_id_copy(&outer_id, &span->span_id);
+    EXPECT_INT_ZERO(span_table_get(st, &span, "async_child", trid));
+    EXPECT_INT_EQ(1, span->num_parents);
+    EXPECT_TRUE(0 == htrace_span_id_compare(&outer_id, &span->parent.single));
+    EXPECT_STR_EQ("worker", htrace_span_get_kv(span, "thread"));
+    EXPECT_INT_ZERO(span_table_get(st, &span, "async_sibling", trid));
+    EXPECT_INT_EQ(1, span->num_parents);
+    EXPECT_TRUE(0 == htrace_span_id_compare(&outer_id, &span->parent.single));
+    return EXIT_SUCCESS;
+}
+
+struct rtest g_rtestpp_context = {
+    "rtestpp_context",
+    rtestpp_context_run,
+    rtestpp_context_verify,
+};
+
 struct rtest * const g_rtests[] = {
     &g_rtestpp_simple,
+    &g_rtestpp_context,
+#if __cplusplus >= 201103L
+    &g_rtestpp_move,
+    &g_rtestpp_name,
+#endif
     NULL
 };
 
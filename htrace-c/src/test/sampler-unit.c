@@ -17,11 +17,16 @@
  */
 
 #include "core/conf.h"
+#include "core/desc.h"
 #include "core/htrace.h"
+#include "core/htracer.h"
+#include "receiver/receiver.h"
 #include "sampler/sampler.h"
 #include "test/test.h"
 #include "util/log.h"
+#include "util/time.h"
 
+#include <inttypes.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -113,6 +118,332 @@ static int test_prob_sampler(double target, double slop)
     return EXIT_SUCCESS;
 }
 
+/**
+ * Count how many times a sampler fires in a loop of calls.
+ */
+static int count_fires(struct htrace_sampler *smp, int calls)
+{
+    int i, total = 0;
+
+    for (i = 0; i < calls; i++) {
+        total += smp->ty->next(smp);
+    }
+    return total;
+}
+
+static int test_ratelimit_sampler(void)
+{
+    struct htrace_conf *conf;
+    struct htrace_sampler *smp;
+    uint64_t begin_ms, elapsed_ms;
+    int fired;
+
+    conf = htrace_conf_from_strs("sampler=ratelimit;"
+            HTRACE_RATELIMIT_SAMPLER_RATE_KEY "=1000", "");
+    EXPECT_NONNULL(conf);
+    smp = htrace_sampler_create(g_test_tracer, conf);
+    EXPECT_NONNULL(smp);
+    EXPECT_STR_EQ("RateLimitSampler(spans_per_sec=1000)",
+                  htrace_sampler_to_str(smp));
+
+    // The bucket starts out holding a second's worth of tokens.
+    begin_ms = monotonic_now_ms(g_test_lg);
+    fired = count_fires(smp, 100000);
+    elapsed_ms = monotonic_now_ms(g_test_lg) - begin_ms;
+    htrace_log(g_test_lg, "ratelimit sampler fired %d times in %" PRId64
+               " ms.\n", fired, elapsed_ms);
+    EXPECT_INT_EQ(1, fired >= 1000);
+    EXPECT_INT_EQ(1, fired <= 1000 + 10 + (int)elapsed_ms);
+
+    // It refills at the configured rate.
+    sleep_ms(100);
+    begin_ms = monotonic_now_ms(g_test_lg);
+    fired = count_fires(smp, 100000);
+    elapsed_ms = monotonic_now_ms(g_test_lg) - begin_ms;
+    EXPECT_INT_EQ(1, fired >= 50);
+    EXPECT_INT_EQ(1, fired <= 200 + 10 + (int)elapsed_ms);
+    htrace_sampler_free(smp);
+    htrace_conf_free(conf);
+
+    // A rate of 0 never fires.
+    conf = htrace_conf_from_strs("sampler=ratelimit;"
+            HTRACE_RATELIMIT_SAMPLER_RATE_KEY "=0", "");
+    EXPECT_NONNULL(conf);
+    smp = htrace_sampler_create(g_test_tracer, conf);
+    EXPECT_NONNULL(smp);
+    EXPECT_INT_ZERO(count_fires(smp, 1000));
+    htrace_sampler_free(smp);
+    htrace_conf_free(conf);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * The pressure reported by the fake span receiver below.
+ */
+static int g_fake_pressure;
+
+static int fake_rcv_get_pressure(struct htrace_rcv *rcv)
+{
+    return g_fake_pressure;
+}
+
+static const struct htrace_rcv_ty g_fake_rcv_ty = {
+    "fake",
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    fake_rcv_get_pressure,
+    NULL,
+    NULL,
+};
+
+#define ADAPTIVE_TEST_INTERVAL_MS 50
+
+#define NUM_ADAPTIVE_TEST_SAMPLES 50000
+
+/**
+ * Wait for the adaptive sampler to poll the span receiver, and return the
+ * fraction of the time it fires afterwards.  The samples take much less
+ * than the poll interval, so there is only one poll each time.
+ */
+static double adaptive_poll(struct htrace_sampler *smp)
+{
+    sleep_ms(ADAPTIVE_TEST_INTERVAL_MS + 10);
+    return ((double)count_fires(smp, NUM_ADAPTIVE_TEST_SAMPLES)) /
+        NUM_ADAPTIVE_TEST_SAMPLES;
+}
+
+static int test_adaptive_sampler(void)
+{
+    struct htrace_conf *conf;
+    struct htrace_sampler *smp;
+    struct htrace_rcv fake_rcv = { &g_fake_rcv_ty }, *saved_rcv;
+    double frac, prev;
+    int i;
+
+    saved_rcv = g_test_tracer->rcv;
+    g_test_tracer->rcv = &fake_rcv;
+    conf = htrace_conf_from_strs("sampler=adaptive;"
+            HTRACE_ADAPTIVE_SAMPLER_MAX_FRACTION_KEY "=0.5;"
+            HTRACE_ADAPTIVE_SAMPLER_MIN_FRACTION_KEY "=0.01;"
+            HTRACE_ADAPTIVE_SAMPLER_TARGET_PRESSURE_KEY "=50;"
+            HTRACE_ADAPTIVE_SAMPLER_INTERVAL_MS_KEY "=50", "");
+    EXPECT_NONNULL(conf);
+    smp = htrace_sampler_create(g_test_tracer, conf);
+    EXPECT_NONNULL(smp);
+
+    // With no pressure, we stay at the maximum fraction.
+    g_fake_pressure = 0;
+    frac = adaptive_poll(smp);
+    EXPECT_INT_EQ(1, fabs(frac - 0.5) < 0.01);
+
+    // Pressure in the dead band between half the target and the target
+    // doesn't change anything.
+    g_fake_pressure = 40;
+    frac = adaptive_poll(smp);
+    EXPECT_INT_EQ(1, fabs(frac - 0.5) < 0.01);
+
+    // High pressure makes us back off, down to the minimum.
+    g_fake_pressure = HTRACE_RCV_PRESSURE_MAX;
+    prev = frac;
+    frac = adaptive_poll(smp);
+    EXPECT_INT_EQ(1, frac < prev * 0.6);
+    for (i = 0; i < 10; i++) {
+        frac = adaptive_poll(smp);
+    }
+    EXPECT_INT_EQ(1, fabs(frac - 0.01) < 0.002);
+
+    // Once the pressure goes away, we gradually go back up.
+    g_fake_pressure = 0;
+    prev = frac;
+    frac = adaptive_poll(smp);
+    EXPECT_INT_EQ(1, frac > prev);
+    EXPECT_INT_EQ(1, frac < 0.1);
+    for (i = 0; i < 30; i++) {
+        frac = adaptive_poll(smp);
+    }
+    EXPECT_INT_EQ(1, fabs(frac - 0.5) < 0.01);
+
+    htrace_sampler_free(smp);
+    htrace_conf_free(conf);
+    g_test_tracer->rcv = saved_rcv;
+    return EXIT_SUCCESS;
+}
+
+static struct htrace_sampler *create_hash_sampler(double fraction)
+{
+    struct htrace_conf *conf;
+    struct htrace_sampler *smp;
+    char confstr[256] = { 0 };
+
+    snprintf(confstr, sizeof(confstr), "sampler=hash;"
+             HTRACE_HASH_SAMPLER_FRACTION_KEY "=%g", fraction);
+    conf = htrace_conf_from_strs(confstr, "");
+    if (!conf) {
+        return NULL;
+    }
+    smp = htrace_sampler_create(g_test_tracer, conf);
+    htrace_conf_free(conf);
+    return smp;
+}
+
+#define NUM_HASH_TEST_TRACES 100000
+
+/**
+ * Test that separate hash samplers agree about every trace, that a lower
+ * fraction picks a subset of the traces a higher one does, and that the
+ * fraction of traces picked is about right.
+ */
+static int test_hash_sampler(void)
+{
+    struct htrace_sampler *half, *half2, *tenth, *none, *always;
+    struct htrace_conf *conf;
+    struct htrace_scope *scope;
+    struct htrace_span_id id;
+    uint64_t i, num_half = 0, num_tenth = 0;
+    int a, b;
+
+    half = create_hash_sampler(0.5);
+    EXPECT_NONNULL(half);
+    EXPECT_STR_EQ("HashSampler(fraction=0.5)", htrace_sampler_to_str(half));
+    half2 = create_hash_sampler(0.5);
+    EXPECT_NONNULL(half2);
+    tenth = create_hash_sampler(0.1);
+    EXPECT_NONNULL(tenth);
+    none = create_hash_sampler(0);
+    EXPECT_NONNULL(none);
+    id.low = 0x1234;
+    for (i = 0; i < NUM_HASH_TEST_TRACES; i++) {
+        // Sequential trace IDs are the hardest case for the hash.
+        id.high = i + 1;
+        a = htrace_sampler_next_trace(half, &id);
+        EXPECT_INT_EQ(a, htrace_sampler_next_trace(half2, &id));
+        b = htrace_sampler_next_trace(tenth, &id);
+        if (b) {
+            EXPECT_INT_EQ(1, a);
+        }
+        EXPECT_INT_ZERO(htrace_sampler_next_trace(none, &id));
+        num_half += a;
+        num_tenth += b;
+    }
+    EXPECT_INT_EQ(1, fabs((num_half / (double)NUM_HASH_TEST_TRACES) - 0.5)
+                  < 0.01);
+    EXPECT_INT_EQ(1, fabs((num_tenth / (double)NUM_HASH_TEST_TRACES) - 0.1)
+                  < 0.01);
+    htrace_sampler_free(none);
+    htrace_sampler_free(tenth);
+    htrace_sampler_free(half2);
+
+    // New traces get trace IDs which the sampler accepts.
+    for (i = 0; i < 100; i++) {
+        scope = htrace_start_span(g_test_tracer, half, "hashSpan");
+        if (scope) {
+            htrace_scope_get_span_id(scope, &id);
+            EXPECT_INT_EQ(1, htrace_sampler_next_trace(half, &id));
+            htrace_scope_close(scope);
+        }
+    }
+    htrace_sampler_free(half);
+
+    // Samplers which don't look at the trace ID fall back to next().
+    conf = htrace_conf_from_strs("sampler=always", "");
+    EXPECT_NONNULL(conf);
+    always = htrace_sampler_create(g_test_tracer, conf);
+    EXPECT_NONNULL(always);
+    EXPECT_INT_EQ(1, htrace_sampler_next_trace(always, &id));
+    htrace_sampler_free(always);
+    htrace_conf_free(conf);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Count how many times the rules sampler fires for a description.
+ */
+static int count_desc_fires(struct htrace_sampler *smp, const char *desc,
+                            const struct htrace_desc *idesc, int calls)
+{
+    int i, total = 0;
+
+    for (i = 0; i < calls; i++) {
+        total += smp->ty->next_desc(smp, desc, strlen(desc), idesc);
+    }
+    return total;
+}
+
+static int test_rules_sampler(void)
+{
+    struct htrace_conf *conf;
+    struct htrace_sampler *smp;
+    struct htrace_scope *scope;
+    const struct htrace_desc *idesc;
+    int fired;
+
+    conf = htrace_conf_from_strs("sampler=rules;"
+            HTRACE_RULES_SAMPLER_RULES_KEY "=Heartbeat:0,Write:1,"
+            "WriteSlow:0,Bogus,Bogus2:2.0,Write:1,:0.5", "");
+    EXPECT_NONNULL(conf);
+    smp = htrace_sampler_create(g_test_tracer, conf);
+    EXPECT_NONNULL(smp);
+    EXPECT_STR_EQ("RulesSampler(rules=3, default_fraction=0.5)",
+                  htrace_sampler_to_str(smp));
+    EXPECT_INT_ZERO(count_desc_fires(smp, "Heartbeat", NULL, 1000));
+    EXPECT_INT_ZERO(count_desc_fires(smp, "HeartbeatPing", NULL, 1000));
+    EXPECT_INT_EQ(1000, count_desc_fires(smp, "WriteBlock", NULL, 1000));
+    EXPECT_INT_ZERO(count_desc_fires(smp, "WriteSlowBlock", NULL, 1000));
+    fired = count_desc_fires(smp, "Read", NULL, 10000);
+    EXPECT_INT_EQ(1, (fired > 4000) && (fired < 6000));
+    fired = count_desc_fires(smp, "Bogus", NULL, 10000);
+    EXPECT_INT_EQ(1, (fired > 4000) && (fired < 6000));
+
+    // Interned descriptions are matched once, then cached.
+    idesc = htrace_desc_register(g_test_tracer, "WriteInterned");
+    EXPECT_NONNULL(idesc);
+    EXPECT_INT_EQ(1000, count_desc_fires(smp, idesc->str, idesc, 1000));
+    idesc = htrace_desc_register(g_test_tracer, "HeartbeatInterned");
+    EXPECT_NONNULL(idesc);
+    EXPECT_INT_ZERO(count_desc_fires(smp, idesc->str, idesc, 1000));
+
+    // htrace_start_span consults the rules.
+    EXPECT_NULL(htrace_start_span(g_test_tracer, smp, "HeartbeatSpan"));
+    EXPECT_NULL(htrace_start_span_desc(g_test_tracer, smp, idesc));
+    scope = htrace_start_span(g_test_tracer, smp, "WriteSpan");
+    EXPECT_NONNULL(scope);
+    htrace_scope_close(scope);
+    htrace_sampler_free(smp);
+    htrace_conf_free(conf);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * A new configuration for a different type of sampler leaves an existing
+ * sampler alone.
+ */
+static int test_update_conf_type_mismatch(void)
+{
+    struct htrace_conf *conf, *nconf;
+    struct htrace_sampler *smp;
+
+    conf = htrace_conf_from_strs("sampler=prob;prob.sampler.fraction=0", "");
+    EXPECT_NONNULL(conf);
+    smp = htrace_sampler_create(g_test_tracer, conf);
+    EXPECT_NONNULL(smp);
+    nconf = htrace_conf_from_strs("sampler=hash;prob.sampler.fraction=1",
+                                  "");
+    EXPECT_NONNULL(nconf);
+    htrace_samplers_update_conf(g_test_tracer, nconf);
+    EXPECT_STR_EQ("ProbabilitySampler(fraction=0)",
+                  htrace_sampler_to_str(smp));
+    EXPECT_INT_ZERO(count_fires(smp, 1000));
+    htrace_conf_free(nconf);
+    htrace_sampler_free(smp);
+    htrace_conf_free(conf);
+    return EXIT_SUCCESS;
+}
+
 int main(void)
 {
     g_test_conf = htrace_conf_from_strs("", HTRACE_TRACER_ID"=sampler-unit");
@@ -128,6 +459,11 @@ int main(void)
     EXPECT_INT_ZERO(test_prob_sampler(0.5, 0.001));
     EXPECT_INT_ZERO(test_prob_sampler(0.01, 0.001));
     EXPECT_INT_ZERO(test_prob_sampler(0.1, 0.001));
+    EXPECT_INT_ZERO(test_ratelimit_sampler());
+    EXPECT_INT_ZERO(test_adaptive_sampler());
+    EXPECT_INT_ZERO(test_hash_sampler());
+    EXPECT_INT_ZERO(test_rules_sampler());
+    EXPECT_INT_ZERO(test_update_conf_type_mismatch());
 
     htracer_free(g_test_tracer);
     htrace_log_free(g_test_lg);
@@ -0,0 +1,250 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "core/span.h"
+#include "receiver/shm.h"
+#include "test/rtest.h"
+#include "test/span_table.h"
+#include "test/span_util.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+#include "util/cmp_util.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_TEST_SMALL_SIZE 4096
+
+/**
+ * A consumer's view of a shared memory ring.
+ */
+struct shm_test_ring {
+    void *base;
+    size_t map_len;
+    struct shm_ring_header *hdr;
+    uint8_t *data;
+};
+
+static int shm_test_ring_open(const char *path, struct shm_test_ring *ring)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    EXPECT_INT_GE(0, fd);
+    EXPECT_INT_ZERO(fstat(fd, &st));
+    ring->map_len = st.st_size;
+    ring->base = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    EXPECT_INT_EQ(1, ring->base != MAP_FAILED);
+    close(fd);
+    ring->hdr = ring->base;
+    ring->data = ((uint8_t *)ring->base) + sizeof(struct shm_ring_header);
+    EXPECT_UINT64_EQ((uint64_t)SHM_RING_MAGIC,
+        (uint64_t)__atomic_load_n(&ring->hdr->magic, __ATOMIC_ACQUIRE));
+    EXPECT_INT_EQ(SHM_RING_VERSION, ring->hdr->version);
+    EXPECT_UINT64_EQ((uint64_t)(ring->map_len -
+                     sizeof(struct shm_ring_header)), ring->hdr->data_len);
+    return EXIT_SUCCESS;
+}
+
+static void shm_test_ring_close(struct shm_test_ring *ring)
+{
+    munmap(ring->base, ring->map_len);
+}
+
+/**
+ * Read every span in the ring, and put it in the span table.
+ */
+static int shm_test_ring_drain(struct shm_test_ring *ring,
+                               struct span_table *st, int *num_spans)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    uint64_t head, tail;
+    struct shm_rec_header *rec;
+    struct cmp_bcopy_ctx bctx;
+    struct htrace_span *span;
+
+    head = __atomic_load_n(&ring->hdr->head, __ATOMIC_SEQ_CST);
+    tail = ring->hdr->tail;
+    while (tail < head) {
+        rec = (struct shm_rec_header *)
+            (ring->data + (tail % ring->hdr->data_len));
+        if (rec->type == SHM_REC_SPAN) {
+            err[0] = '\0';
+            cmp_bcopy_ctx_init(&bctx, rec + 1, rec->len);
+            span = span_read_msgpack((cmp_ctx_t*)&bctx, err, err_len);
+            EXPECT_STR_EQ("", err);
+            EXPECT_NONNULL(span);
+            EXPECT_UINT64_EQ((uint64_t)rec->len, bctx.off);
+            EXPECT_INT_ZERO(span_table_put(st, span));
+            (*num_spans)++;
+        } else {
+            EXPECT_INT_EQ(SHM_REC_PAD, rec->type);
+            // A pad record always runs to the end of the data area.
+            EXPECT_UINT64_EQ(ring->hdr->data_len,
+                             (tail % ring->hdr->data_len) +
+                             SHM_REC_SIZE(rec->len));
+        }
+        tail += SHM_REC_SIZE(rec->len);
+    }
+    EXPECT_UINT64_EQ(head, tail);
+    __atomic_store_n(&ring->hdr->tail, tail, __ATOMIC_SEQ_CST);
+    return EXIT_SUCCESS;
+}
+
+static int shm_rcv_test(struct rtest *rt)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *shm_path, *tdir, *conf_str = NULL;
+    struct span_table *st;
+    struct shm_test_ring ring;
+    int num_spans = 0;
+
+    st = span_table_alloc();
+    tdir = create_tempdir("shm_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&shm_path, "%s/%s", tdir, "ring"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s",
+                HTRACE_SPAN_RECEIVER_KEY, "shm",
+                HTRACE_SHM_RCV_PATH_KEY, shm_path));
+    EXPECT_INT_ZERO(rt->run(rt, conf_str));
+    EXPECT_INT_ZERO(shm_test_ring_open(shm_path, &ring));
+    EXPECT_INT_ZERO(shm_test_ring_drain(&ring, st, &num_spans));
+    EXPECT_INT_EQ(rt->spans_created, num_spans);
+    EXPECT_UINT64_EQ((uint64_t)0, ring.hdr->dropped);
+    shm_test_ring_close(&ring);
+    EXPECT_INT_ZERO(rt->verify(rt, st));
+    free(conf_str);
+    free(shm_path);
+    free(tdir);
+    span_table_free(st);
+
+    return EXIT_SUCCESS;
+}
+
+static int shm_test_make_spans(struct htracer *tracer,
+                               struct htrace_sampler *smp, int num)
+{
+    struct htrace_scope *scope;
+    char desc[32];
+    int i;
+
+    for (i = 0; i < num; i++) {
+        snprintf(desc, sizeof(desc), "span%d", i);
+        scope = htrace_start_span(tracer, smp, desc);
+        EXPECT_NONNULL(scope);
+        htrace_scope_close(scope);
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Test that a small ring drops new spans when it is full, and wraps around
+ * once the consumer catches up.
+ */
+static int shm_rcv_full_test(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *shm_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_stats stats;
+    struct span_table *st;
+    struct shm_test_ring ring;
+    int i, num_spans = 0;
+
+    st = span_table_alloc();
+    tdir = create_tempdir("shm_rcv-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&shm_path, "%s/%s", tdir, "small"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%d;%s=%s",
+                HTRACE_SPAN_RECEIVER_KEY, "shm",
+                HTRACE_SHM_RCV_PATH_KEY, shm_path,
+                HTRACE_SHM_RCV_SIZE_KEY, SHM_TEST_SMALL_SIZE,
+                HTRACE_SAMPLER_KEY, "always"));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("shm_rcv-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+    EXPECT_INT_ZERO(shm_test_ring_open(shm_path, &ring));
+
+    // Nobody is reading, so the ring fills up.
+    EXPECT_INT_ZERO(shm_test_make_spans(tracer, smp, 200));
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ((uint64_t)200, stats.buffered + stats.dropped_newest);
+    EXPECT_INT_EQ(1, stats.dropped_newest > 0);
+    EXPECT_UINT64_EQ(stats.dropped_newest, ring.hdr->dropped);
+    EXPECT_INT_ZERO(shm_test_ring_drain(&ring, st, &num_spans));
+    EXPECT_UINT64_EQ(stats.buffered, (uint64_t)num_spans);
+
+    // If we keep up, nothing more is dropped, even as the ring wraps.
+    for (i = 0; i < 20; i++) {
+        EXPECT_INT_ZERO(shm_test_make_spans(tracer, smp, 10));
+        EXPECT_INT_ZERO(shm_test_ring_drain(&ring, st, &num_spans));
+    }
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ(stats.buffered, (uint64_t)num_spans);
+    EXPECT_UINT64_EQ(stats.dropped_newest, ring.hdr->dropped);
+    EXPECT_INT_EQ(1, ring.hdr->head > SHM_TEST_SMALL_SIZE);
+    EXPECT_INT_EQ(1, stats.buffer_bytes_max <= SHM_TEST_SMALL_SIZE);
+    shm_test_ring_close(&ring);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+    free(conf_str);
+    free(shm_path);
+    free(tdir);
+    span_table_free(st);
+
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    int i;
+
+    for (i = 0; g_rtests[i]; i++) {
+        struct rtest *rtest = g_rtests[i];
+        if (shm_rcv_test(rtest) != EXIT_SUCCESS) {
+            fprintf(stderr, "rtest %s failed\n", rtest->name);
+            return EXIT_FAILURE;
+        }
+    }
+    EXPECT_INT_ZERO(shm_rcv_full_test());
+
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -22,7 +22,9 @@
 #include "core/span.h"
 #include "test/span_util.h"
 #include "test/test.h"
+#include "util/cmp_util.h"
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,6 +36,7 @@ static int test_span_round_trip(const char *str)
     size_t err_len = sizeof(err);
     struct htrace_span *span = NULL;
     int json_size;
+    size_t max, len;
 
     err[0] = '\0';
     span_json_parse(str, &span, err, err_len);
@@ -44,11 +47,225 @@ static int test_span_round_trip(const char *str)
     span_json_sprintf(span, json_size, json);
     EXPECT_STR_EQ(str, json);
     free(json);
+    // The streaming writer must produce the same text, within its bound.
+    max = span_json_max_size(span);
+    json = malloc(max + 1);
+    EXPECT_NONNULL(json);
+    len = span_json_write(span, json);
+    EXPECT_INT_EQ(1, len <= max);
+    json[len] = '\0';
+    EXPECT_STR_EQ(str, json);
+    free(json);
+    htrace_span_free(span);
+
+    return 0;
+}
+
+/**
+ * Test that serializing a span into a bounded buffer fails cleanly when the
+ * buffer is too small, and produces the expected bytes when it is not.  The
+ * htraced receiver relies on this to serialize each span only once.
+ */
+static int test_span_write_msgpack_bounded(const char *str)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    struct htrace_span *span = NULL;
+    struct cmp_counter_ctx cctx;
+    struct cmp_bcopy_ctx bctx;
+    uint8_t *expected, *buf;
+    uint64_t len, i;
+
+    err[0] = '\0';
+    span_json_parse(str, &span, err, err_len);
+    EXPECT_STR_EQ("", err);
+    cmp_counter_ctx_init(&cctx);
+    EXPECT_INT_EQ(1, span_write_msgpack(span, (cmp_ctx_t*)&cctx));
+    len = cctx.count;
+    expected = malloc(len);
+    EXPECT_NONNULL(expected);
+    cmp_bcopy_ctx_init(&bctx, expected, len);
+    bctx.base.write = cmp_bcopy_write_nocheck_fn;
+    EXPECT_INT_EQ(1, span_write_msgpack(span, (cmp_ctx_t*)&bctx));
+    buf = malloc(len + 1);
+    EXPECT_NONNULL(buf);
+    for (i = 0; i < len; i++) {
+        cmp_bcopy_ctx_init(&bctx, buf, i);
+        EXPECT_INT_EQ(0, span_write_msgpack(span, (cmp_ctx_t*)&bctx));
+    }
+    cmp_bcopy_ctx_init(&bctx, buf, len + 1);
+    EXPECT_INT_EQ(1, span_write_msgpack(span, (cmp_ctx_t*)&bctx));
+    EXPECT_UINT64_EQ(len, bctx.off);
+    EXPECT_INT_ZERO(memcmp(expected, buf, len));
+    free(buf);
+    free(expected);
+    htrace_span_free(span);
+
+    return 0;
+}
+
+/**
+ * Test that short descriptions are stored inline in the span, long ones are
+ * allocated separately, and that freed spans are reused by the next
+ * allocation on the same thread.
+ */
+static int test_span_alloc_desc(void)
+{
+    struct htrace_span_id id;
+    struct htrace_span *span, *span2;
+    char err[512], long_desc[HTRACE_SPAN_DESC_BUF_LEN + 1];
+
+    err[0] = '\0';
+    htrace_span_id_parse(&id, "ba85631c2ce111e5b345feff819cdc9f",
+                         err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    span = htrace_span_alloc("shortSpan", 123, &id);
+    EXPECT_NONNULL(span);
+    EXPECT_STR_EQ("shortSpan", span->desc);
+    EXPECT_INT_EQ(1, span->desc == span->desc_buf);
+    EXPECT_UINT64_EQ((uint64_t)123, span->begin_ms);
     htrace_span_free(span);
+    span2 = htrace_span_alloc("anotherShortSpan", 456, &id);
+    EXPECT_NONNULL(span2);
+    EXPECT_INT_EQ(1, span == span2);
+    htrace_span_free(span2);
 
+    memset(long_desc, 'x', sizeof(long_desc) - 1);
+    long_desc[sizeof(long_desc) - 1] = '\0';
+    span = htrace_span_alloc(long_desc, 789, &id);
+    EXPECT_NONNULL(span);
+    EXPECT_STR_EQ(long_desc, span->desc);
+    EXPECT_INT_EQ(0, span->desc == span->desc_buf);
+    htrace_span_free(span);
     return 0;
 }
 
+/**
+ * Test that a span stops accepting annotations once its buffer is full, and
+ * that a later key overrides an earlier one.
+ */
+static int test_span_extra_full(void)
+{
+    struct htrace_span *span;
+    char val[1024];
+    int i, res = 0;
+
+    span = calloc(1, sizeof(*span));
+    EXPECT_NONNULL(span);
+    span->desc = strdup("fullSpan");
+    EXPECT_NONNULL(span->desc);
+    EXPECT_NULL(htrace_span_get_kv(span, "k"));
+    EXPECT_INT_ZERO(htrace_span_add_kv(span, "k", "first"));
+    EXPECT_INT_ZERO(htrace_span_add_event(span, 123, "ev"));
+    EXPECT_INT_ZERO(htrace_span_add_kv(span, "k", "second"));
+    EXPECT_STR_EQ("second", htrace_span_get_kv(span, "k"));
+    memset(val, 'v', sizeof(val) - 1);
+    val[sizeof(val) - 1] = '\0';
+    for (i = 0; i < 100; i++) {
+        res = htrace_span_add_kv(span, "big", val);
+        if (res) {
+            break;
+        }
+    }
+    EXPECT_INT_EQ(ENOSPC, res);
+    EXPECT_INT_EQ(1, i > 50);
+    EXPECT_INT_EQ(1, span->extra->len <= HTRACE_SPAN_EXTRA_MAX_LEN);
+    EXPECT_INT_EQ(i + 2, span->extra->num_kvs);
+    EXPECT_INT_EQ(1, span->extra->num_events);
+    htrace_span_free(span);
+    return 0;
+}
+
+/**
+ * Test adding, sorting, and deduplicating parents, both in the span's inline
+ * storage and after they have spilled into a separate allocation.
+ */
+static int test_span_parents(void)
+{
+    struct htrace_span_id id, pid;
+    struct htrace_span *span;
+    const struct htrace_span_id *ids;
+    int i;
+
+    id.high = 0xface;
+    id.low = 100;
+    span = htrace_span_alloc("joinSpan", 123, &id);
+    EXPECT_NONNULL(span);
+    pid.high = 0xface;
+    for (i = HTRACE_SPAN_INLINE_PARENTS; i > 0; i--) {
+        pid.low = i;
+        EXPECT_INT_ZERO(htrace_span_add_parent(span, &pid));
+        EXPECT_INT_ZERO(htrace_span_add_parent(span, &pid));
+    }
+    EXPECT_INT_EQ(HTRACE_SPAN_INLINE_PARENTS, span->num_parents);
+    htrace_span_sort_and_dedupe_parents(span);
+    EXPECT_INT_EQ(HTRACE_SPAN_INLINE_PARENTS, span->num_parents);
+    ids = HTRACE_SPAN_PARENTS(span);
+    EXPECT_INT_EQ(1, ids == span->parent.inl);
+    for (i = 0; i < HTRACE_SPAN_INLINE_PARENTS; i++) {
+        EXPECT_UINT64_EQ((uint64_t)(i + 1), ids[i].low);
+    }
+
+    // Spill into a separate allocation.
+    pid.low = 0;
+    EXPECT_INT_ZERO(htrace_span_add_parent(span, &pid));
+    pid.low = 50;
+    EXPECT_INT_ZERO(htrace_span_add_parent(span, &pid));
+    EXPECT_INT_EQ(HTRACE_SPAN_INLINE_PARENTS + 2, span->num_parents);
+    ids = HTRACE_SPAN_PARENTS(span);
+    EXPECT_INT_EQ(1, ids == span->parent.list);
+    htrace_span_sort_and_dedupe_parents(span);
+    ids = HTRACE_SPAN_PARENTS(span);
+    for (i = 0; i < span->num_parents; i++) {
+        EXPECT_UINT64_EQ((uint64_t)(i + 1 < span->num_parents ? i : 50),
+                         ids[i].low);
+    }
+
+    // Duplicates which only come in through deserialization are removed,
+    // and the survivors move back into the span.
+    span->parent.list[1] = span->parent.list[0];
+    span->parent.list[2] = span->parent.list[0];
+    htrace_span_sort_and_dedupe_parents(span);
+    EXPECT_INT_EQ(HTRACE_SPAN_INLINE_PARENTS, span->num_parents);
+    ids = HTRACE_SPAN_PARENTS(span);
+    EXPECT_INT_EQ(1, ids == span->parent.inl);
+    EXPECT_UINT64_EQ((uint64_t)0, ids[0].low);
+    EXPECT_UINT64_EQ((uint64_t)3, ids[1].low);
+    EXPECT_UINT64_EQ((uint64_t)4, ids[2].low);
+    EXPECT_UINT64_EQ((uint64_t)50, ids[3].low);
+    htrace_span_free(span);
+    return 0;
+}
+
+/**
+ * Test that a span measures the CPU time the calling thread uses while it is
+ * open.
+ */
+static int test_span_cpu(int cpu)
+{
+    struct htrace_span_id id;
+    struct htrace_span *span;
+    volatile uint64_t sum = 0;
+    uint64_t i;
+
+    htrace_span_id_clear(&id);
+    span = htrace_span_alloc("cpuSpan", 100, &id);
+    EXPECT_NONNULL(span);
+    EXPECT_INT_EQ(HTRACE_SPAN_CPU_OFF, span->cpu);
+    htrace_span_cpu_begin(span, cpu);
+    EXPECT_INT_EQ(cpu, span->cpu);
+    for (i = 0; i < 20000000ULL; i++) {
+        sum += i;
+    }
+    htrace_span_cpu_end(span);
+    EXPECT_INT_EQ(cpu, span->cpu);
+    EXPECT_INT_EQ(1, (span->cpu_ns > 0));
+    // Busy looping shouldn't take anywhere near a minute.
+    EXPECT_INT_EQ(1, (span->cpu_ns < 60000000000ULL));
+    htrace_span_free(span);
+    return EXIT_SUCCESS;
+}
+
 int main(void)
 {
     EXPECT_INT_ZERO(test_span_round_trip(
@@ -65,6 +282,74 @@ int main(void)
         "{\"a\":\"6baba3842ce411e5b345feff819cdc9f\",\"b\":999,"
         "\"e\":1000,\"d\":\"thirdSpan\",\"r\":\"other-tracerid\","
         "\"p\":[\"000000002ce111e5b345feff819cdc9f\"]}"));
+    EXPECT_INT_ZERO(test_span_write_msgpack_bounded(
+        "{\"a\":\"ba85631c2ce111e5b345feff819cdc9f\",\"b\":34359738368,"
+        "\"e\":34359739368,\"d\":\"myspan\",\"r\":\"span-unit2\","
+        "\"p\":[\"1549e8d42ce411e5b345feff819cdc9f\","
+        "\"25ab73822ce411e5b345feff819cdc9f\"]}"));
+    EXPECT_INT_ZERO(test_span_write_msgpack_bounded(
+        "{\"a\":\"6baba3842ce411e5b345feff819cdc9f\",\"b\":999,"
+        "\"e\":1000,\"d\":\"thirdSpan\",\"r\":\"other-tracerid\","
+        "\"p\":[\"000000002ce111e5b345feff819cdc9f\"]}"));
+    EXPECT_INT_ZERO(test_span_round_trip(
+        "{\"a\":\"6baba3842ce411e5b345feff819cdc9f\",\"b\":999,"
+        "\"e\":1000,\"bu\":999123,\"eu\":1000004,\"d\":\"usSpan\","
+        "\"r\":\"other-tracerid\",\"p\":[]}"));
+    EXPECT_INT_ZERO(test_span_round_trip(
+        "{\"a\":\"6baba3842ce411e5b345feff819cdc9f\",\"b\":999,"
+        "\"e\":1000,\"bn\":999123456,\"en\":1000000007,"
+        "\"d\":\"nsSpan\",\"r\":\"other-tracerid\",\"p\":[]}"));
+    EXPECT_INT_ZERO(test_span_write_msgpack_bounded(
+        "{\"a\":\"6baba3842ce411e5b345feff819cdc9f\",\"b\":999,"
+        "\"e\":1000,\"bn\":999123456,\"en\":1000000007,"
+        "\"d\":\"nsSpan\",\"r\":\"other-tracerid\",\"p\":[]}"));
+    EXPECT_INT_ZERO(test_span_round_trip(
+        "{\"a\":\"6baba3842ce411e5b345feff819cdc9f\",\"b\":999,"
+        "\"e\":1000,\"bn\":999123456,\"en\":1000000007,"
+        "\"cn\":402113,\"d\":\"cpuSpan\",\"r\":\"other-tracerid\","
+        "\"p\":[]}"));
+    EXPECT_INT_ZERO(test_span_round_trip(
+        "{\"a\":\"6baba3842ce411e5b345feff819cdc9f\",\"b\":999,"
+        "\"e\":1000,\"cn\":402000,\"cv\":2,\"ci\":0,"
+        "\"d\":\"rusageSpan\",\"r\":\"other-tracerid\",\"p\":[]}"));
+    EXPECT_INT_ZERO(test_span_write_msgpack_bounded(
+        "{\"a\":\"6baba3842ce411e5b345feff819cdc9f\",\"b\":999,"
+        "\"e\":1000,\"cn\":402000,\"cv\":2,\"ci\":0,"
+        "\"d\":\"rusageSpan\",\"r\":\"other-tracerid\",\"p\":[]}"));
+    EXPECT_INT_ZERO(test_span_round_trip(
+        "{\"a\":\"ba85631c2ce111e5b345feff819cdc9f\",\"b\":100,"
+        "\"e\":200,\"d\":\"kvSpan\",\"r\":\"span-unit2\","
+        "\"p\":[\"1549e8d42ce411e5b345feff819cdc9f\"],"
+        "\"n\":{\"path\":\"/foo/bar\",\"len\":\"4096\"},"
+        "\"t\":[{\"t\":150,\"m\":\"sent\"},"
+        "{\"t\":190,\"m\":\"received\"}]}"));
+    EXPECT_INT_ZERO(test_span_write_msgpack_bounded(
+        "{\"a\":\"ba85631c2ce111e5b345feff819cdc9f\",\"b\":100,"
+        "\"e\":200,\"d\":\"kvSpan\",\"r\":\"span-unit2\","
+        "\"p\":[],\"n\":{\"path\":\"/foo/bar\"},"
+        "\"t\":[{\"t\":150,\"m\":\"sent\"}]}"));
+    EXPECT_INT_ZERO(test_span_round_trip(
+        "{\"a\":\"ba85631c2ce111e5b345feff819cdc9f\",\"b\":100,"
+        "\"e\":200,\"d\":\"fanInSpan\",\"r\":\"span-unit2\","
+        "\"p\":[\"00000000000000000000000000000001\","
+        "\"00000000000000000000000000000002\","
+        "\"00000000000000000000000000000003\","
+        "\"00000000000000000000000000000004\","
+        "\"00000000000000000000000000000005\","
+        "\"00000000000000000000000000000006\"]}"));
+    EXPECT_INT_ZERO(test_span_write_msgpack_bounded(
+        "{\"a\":\"ba85631c2ce111e5b345feff819cdc9f\",\"b\":100,"
+        "\"e\":200,\"d\":\"fanInSpan\",\"r\":\"span-unit2\","
+        "\"p\":[\"00000000000000000000000000000001\","
+        "\"00000000000000000000000000000002\","
+        "\"00000000000000000000000000000003\","
+        "\"00000000000000000000000000000004\","
+        "\"00000000000000000000000000000005\"]}"));
+    EXPECT_INT_ZERO(test_span_extra_full());
+    EXPECT_INT_ZERO(test_span_alloc_desc());
+    EXPECT_INT_ZERO(test_span_parents());
+    EXPECT_INT_ZERO(test_span_cpu(HTRACE_SPAN_CPU_TIME));
+    EXPECT_INT_ZERO(test_span_cpu(HTRACE_SPAN_CPU_RUSAGE));
     return EXIT_SUCCESS;
 }
 
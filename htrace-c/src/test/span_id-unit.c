@@ -21,6 +21,7 @@
 #include "test/span_util.h"
 #include "test/test.h"
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -82,6 +83,118 @@ static int test_span_id_eq(const char *sa, const char *sb)
     return test_span_id_compare(0, sa, sb);
 }
 
+static int test_span_id_parse_error(const char *str)
+{
+    struct htrace_span_id id;
+    char err[512];
+
+    err[0] = '\0';
+    htrace_span_id_parse(&id, str, err, sizeof(err));
+    EXPECT_INT_EQ(1, err[0] != '\0');
+    return 0;
+}
+
+/**
+ * Test that the table-driven encoder and parser match printf and strtoull.
+ */
+static int test_span_id_matches_printf(void)
+{
+    struct htrace_span_id id, id2;
+    char str[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    char expected[HTRACE_SPAN_ID_STRING_LENGTH + 1];
+    char err[512];
+    uint64_t x = 0x0123456789abcdefULL;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        // A simple LCG gives us a spread of digits in every position.
+        x = (x * 6364136223846793005ULL) + 1442695040888963407ULL;
+        id.high = x;
+        x = (x * 6364136223846793005ULL) + 1442695040888963407ULL;
+        id.low = x >> (i % 64);
+        snprintf(expected, sizeof(expected), "%016" PRIx64 "%016" PRIx64,
+                 id.high, id.low);
+        EXPECT_INT_EQ(1, htrace_span_id_to_str(&id, str, sizeof(str)));
+        EXPECT_STR_EQ(expected, str);
+        err[0] = '\0';
+        htrace_span_id_parse(&id2, str, err, sizeof(err));
+        EXPECT_STR_EQ("", err);
+        EXPECT_INT_ZERO(htrace_span_id_compare(&id, &id2));
+    }
+    // The buffer must have room for the terminating NUL.
+    EXPECT_INT_ZERO(htrace_span_id_to_str(&id, str, sizeof(str) - 1));
+    EXPECT_STR_EQ("", str);
+    return 0;
+}
+
+/**
+ * Test that a span ID survives the binary and base64 context forms, and that
+ * the base64 form matches a reference encoder.
+ */
+static int test_context_round_trip(const char *id_str, int sampled,
+                                   const char *expected)
+{
+    struct htrace_span_id id, id2;
+    uint8_t buf[HTRACE_CONTEXT_LEN];
+    char str[HTRACE_CONTEXT_BASE64_LEN + 1];
+    char err[512];
+    int sampled2;
+
+    err[0] = '\0';
+    htrace_span_id_parse(&id, id_str, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    htrace_context_inject(&id, sampled, buf);
+    EXPECT_INT_EQ(HTRACE_CONTEXT_VERSION, buf[0]);
+    EXPECT_INT_ZERO(htrace_context_extract(buf, sizeof(buf), &id2,
+                                           &sampled2));
+    EXPECT_INT_ZERO(htrace_span_id_compare(&id, &id2));
+    EXPECT_INT_EQ(sampled, sampled2);
+
+    htrace_context_inject_base64(&id, sampled, str);
+    EXPECT_STR_EQ(expected, str);
+    htrace_span_id_clear(&id2);
+    EXPECT_INT_ZERO(htrace_context_extract_base64(str, strlen(str), &id2,
+                                                  &sampled2));
+    EXPECT_INT_ZERO(htrace_span_id_compare(&id, &id2));
+    EXPECT_INT_EQ(sampled, sampled2);
+    return 0;
+}
+
+static int test_context_errors(void)
+{
+    struct htrace_span_id id, zero;
+    uint8_t buf[HTRACE_CONTEXT_LEN];
+    char str[HTRACE_CONTEXT_BASE64_LEN + 1];
+    int sampled;
+
+    htrace_span_id_clear(&zero);
+    id.high = 1;
+    id.low = 2;
+    htrace_context_inject(&id, 1, buf);
+    EXPECT_INT_EQ(EINVAL, htrace_context_extract(buf, sizeof(buf) - 1, &id,
+                                                 &sampled));
+    EXPECT_INT_ZERO(htrace_span_id_compare(&zero, &id));
+    EXPECT_INT_ZERO(sampled);
+
+    // Unknown versions are rejected, but unknown flags are ignored.
+    buf[0] = HTRACE_CONTEXT_VERSION + 1;
+    EXPECT_INT_EQ(EINVAL, htrace_context_extract(buf, sizeof(buf), &id,
+                                                 &sampled));
+    buf[0] = HTRACE_CONTEXT_VERSION;
+    buf[HTRACE_CONTEXT_LEN - 1] = 0x80;
+    EXPECT_INT_ZERO(htrace_context_extract(buf, sizeof(buf), &id, &sampled));
+    EXPECT_INT_ZERO(sampled);
+
+    htrace_context_inject_base64(&id, 1, str);
+    EXPECT_INT_EQ(EINVAL, htrace_context_extract_base64(str, strlen(str) - 1,
+                                                        &id, &sampled));
+    str[5] = '-';
+    EXPECT_INT_EQ(EINVAL, htrace_context_extract_base64(str, strlen(str),
+                                                        &id, &sampled));
+    EXPECT_INT_ZERO(htrace_span_id_compare(&zero, &id));
+    return 0;
+}
+
 int main(void)
 {
     EXPECT_INT_ZERO(test_span_id_round_trip("0123456789abcdef0011223344556677"));
@@ -99,6 +212,25 @@ int main(void)
                                     "ffffffff2ce111e5b345feff819cdc9f"));
     EXPECT_INT_ZERO(test_span_id_less("1919f3d62ce111e5b345feff819cdc9f",
                                       "f919f3d62ce111e5b345feff81900000"));
+
+    EXPECT_INT_ZERO(test_span_id_eq("A919F3D62CE111E5B345FEFF819CDC9F",
+                                    "a919f3d62ce111e5b345feff819cdc9f"));
+    EXPECT_INT_ZERO(test_span_id_parse_error(
+                        "a919f3d62ce111e5b345feff819cdc9"));
+    EXPECT_INT_ZERO(test_span_id_parse_error(
+                        "0x19f3d62ce111e5b345feff819cdc9f"));
+    EXPECT_INT_ZERO(test_span_id_parse_error(
+                        "a919f3d62ce111e5b345feff819cdc9g"));
+    EXPECT_INT_ZERO(test_span_id_parse_error(
+                        " 919f3d62ce111e5b345feff819cdc9f"));
+    EXPECT_INT_ZERO(test_span_id_matches_printf());
+    EXPECT_INT_ZERO(test_context_round_trip(
+                        "0123456789abcdef0011223344556677", 1,
+                        "AAEjRWeJq83vABEiM0RVZncB"));
+    EXPECT_INT_ZERO(test_context_round_trip(
+                        "ffffffffffffffffffffffffffffffff", 0,
+                        "AP////////////////////8A"));
+    EXPECT_INT_ZERO(test_context_errors());
     return EXIT_SUCCESS;
 }
 
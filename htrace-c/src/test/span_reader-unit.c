@@ -0,0 +1,321 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/htrace.h"
+#include "core/span.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+#include "util/cmp.h"
+#include "util/cmp_util.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_TEST_SPANS 3
+#define TEST_BUF_LENGTH (64UL * 1024UL)
+
+static struct htrace_span **setup_test_spans(void)
+{
+    struct htrace_span **spans;
+    struct htrace_span_id id;
+    int i;
+
+    spans = xcalloc(sizeof(struct htrace_span*) * NUM_TEST_SPANS);
+    htrace_span_id_clear(&id);
+    spans[0] = htrace_span_alloc("FirstSpan", 1927, &id);
+    spans[0]->end_ms = 2000;
+    spans[0]->span_id.high = 0xface;
+    spans[0]->span_id.low = 1;
+
+    spans[1] = htrace_span_alloc("SecondSpan", 1950, &id);
+    spans[1]->end_ms = 2000;
+    spans[1]->span_id.high = 0xface;
+    spans[1]->span_id.low = 2;
+    spans[1]->trid = "SecondSpanProc";
+    spans[1]->num_parents = 1;
+    spans[1]->parent.single.high = 0xface;
+    spans[1]->parent.single.low = 1;
+    spans[1]->ts_precision = HTRACE_TS_PRECISION_NS;
+    spans[1]->begin_sub_ns = 123456;
+    spans[1]->end_sub_ns = 999999;
+    spans[1]->cpu = HTRACE_SPAN_CPU_RUSAGE;
+    spans[1]->cpu_ns = 48000;
+    spans[1]->vol_csw = 3;
+    spans[1]->invol_csw = 1;
+
+    // A span with annotations, events, and parents which aren't inline.
+    spans[2] = htrace_span_alloc("ThirdSpan", 2001, &id);
+    spans[2]->end_ms = 2010;
+    spans[2]->span_id.high = 0xface;
+    spans[2]->span_id.low = 3;
+    spans[2]->trid = "ThirdSpanProc";
+    spans[2]->cpu = HTRACE_SPAN_CPU_TIME;
+    spans[2]->cpu_ns = 1234567;
+    for (i = 1; i <= 5; i++) {
+        id.high = 0xface;
+        id.low = i;
+        htrace_span_add_parent(spans[2], &id);
+    }
+    htrace_span_add_kv(spans[2], "region", "us-west");
+    htrace_span_add_event(spans[2], 2003, "cache miss");
+    htrace_span_add_kv(spans[2], "attempt", "2");
+    return spans;
+}
+
+static void free_test_spans(struct htrace_span **spans)
+{
+    int i;
+
+    for (i = 0; i < NUM_TEST_SPANS; i++) {
+        spans[i]->trid = NULL;
+        htrace_span_free(spans[i]);
+    }
+    free(spans);
+}
+
+static int expect_view_str(const char *expected, const char *str,
+                           uint32_t len)
+{
+    EXPECT_INT_EQ((int)strlen(expected), (int)len);
+    EXPECT_INT_ZERO(memcmp(expected, str, len));
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Check that a span view matches the span it was serialized from.
+ */
+static int expect_view_matches(const struct htrace_span *span,
+                               const struct htrace_span_view *view)
+{
+    const struct htrace_span_id *parents = HTRACE_SPAN_PARENTS(span);
+    struct htrace_span_view_iter it;
+    struct htrace_span_id id;
+    const char *key, *val;
+    uint32_t key_len, val_len, i;
+    uint64_t time_ms;
+
+    EXPECT_INT_ZERO(htrace_span_id_compare(&span->span_id, &view->span_id));
+    EXPECT_INT_ZERO(expect_view_str(span->desc, view->desc, view->desc_len));
+    if (span->trid) {
+        EXPECT_INT_ZERO(expect_view_str(span->trid, view->trid,
+                                        view->trid_len));
+    } else {
+        EXPECT_NULL(view->trid);
+    }
+    EXPECT_UINT64_EQ(span->begin_ms, view->begin_ms);
+    EXPECT_UINT64_EQ(span->end_ms, view->end_ms);
+    EXPECT_INT_EQ(span->ts_precision, view->ts_precision);
+    if (span->ts_precision == HTRACE_TS_PRECISION_NS) {
+        EXPECT_UINT64_EQ((uint64_t)(span->begin_ms * 1000000ULL +
+                            span->begin_sub_ns), view->begin_precise);
+        EXPECT_UINT64_EQ((uint64_t)(span->end_ms * 1000000ULL +
+                            span->end_sub_ns), view->end_precise);
+    }
+    EXPECT_INT_EQ(span->cpu, view->cpu);
+    if (span->cpu != HTRACE_SPAN_CPU_OFF) {
+        EXPECT_UINT64_EQ(span->cpu_ns, view->cpu_ns);
+    }
+    if (span->cpu == HTRACE_SPAN_CPU_RUSAGE) {
+        EXPECT_UINT64_EQ((uint64_t)span->vol_csw, view->vol_csw);
+        EXPECT_UINT64_EQ((uint64_t)span->invol_csw, view->invol_csw);
+    }
+    EXPECT_INT_EQ(span->num_parents, (int)view->num_parents);
+    htrace_span_view_parents(view, &it);
+    for (i = 0; i < view->num_parents; i++) {
+        EXPECT_INT_EQ(1, htrace_span_view_next_parent(&it, &id));
+        EXPECT_INT_ZERO(htrace_span_id_compare(parents + i, &id));
+    }
+    EXPECT_INT_ZERO(htrace_span_view_next_parent(&it, &id));
+    htrace_span_view_kvs(view, &it);
+    for (i = 0; i < view->num_kvs; i++) {
+        EXPECT_INT_EQ(1, htrace_span_view_next_kv(&it, &key, &key_len,
+                                                  &val, &val_len));
+        EXPECT_INT_ZERO(expect_view_str(
+            htrace_span_get_kv(span, i == 0 ? "region" : "attempt"),
+            val, val_len));
+    }
+    EXPECT_INT_ZERO(htrace_span_view_next_kv(&it, &key, &key_len,
+                                             &val, &val_len));
+    EXPECT_INT_EQ(span->extra ? span->extra->num_kvs : 0,
+                  (int)view->num_kvs);
+    htrace_span_view_events(view, &it);
+    for (i = 0; i < view->num_events; i++) {
+        EXPECT_INT_EQ(1, htrace_span_view_next_event(&it, &time_ms,
+                                                     &val, &val_len));
+        EXPECT_UINT64_EQ((uint64_t)2003, time_ms);
+        EXPECT_INT_ZERO(expect_view_str("cache miss", val, val_len));
+    }
+    EXPECT_INT_EQ(span->extra ? span->extra->num_events : 0,
+                  (int)view->num_events);
+    return EXIT_SUCCESS;
+}
+
+static int expect_spans_read(struct htrace_span **spans, const void *buf,
+                             size_t len)
+{
+    struct htrace_span_reader *rd;
+    struct htrace_span_view view;
+    int i;
+
+    rd = htrace_span_reader_alloc(buf, len);
+    EXPECT_NONNULL(rd);
+    for (i = 0; i < NUM_TEST_SPANS; i++) {
+        EXPECT_INT_EQ(1, htrace_span_reader_next(rd, &view));
+        EXPECT_STR_EQ("", htrace_span_reader_error(rd));
+        EXPECT_INT_ZERO(expect_view_matches(spans[i], &view));
+    }
+    EXPECT_INT_ZERO(htrace_span_reader_next(rd, &view));
+    EXPECT_UINT64_EQ((uint64_t)len, (uint64_t)htrace_span_reader_offset(rd));
+    htrace_span_reader_free(rd);
+    return EXIT_SUCCESS;
+}
+
+static int test_read_encoded(struct htrace_span **spans, uint8_t *buf,
+                             size_t *len)
+{
+    int i;
+
+    *len = 0;
+    for (i = 0; i < NUM_TEST_SPANS; i++) {
+        *len += span_msgpack_encode(spans[i], buf + *len);
+    }
+    return expect_spans_read(spans, buf, *len);
+}
+
+static int test_read_cmp_written(struct htrace_span **spans)
+{
+    struct cmp_bcopy_ctx bctx;
+    char *buf;
+    int i;
+
+    buf = xcalloc(TEST_BUF_LENGTH);
+    cmp_bcopy_ctx_init(&bctx, buf, TEST_BUF_LENGTH);
+    for (i = 0; i < NUM_TEST_SPANS; i++) {
+        EXPECT_INT_EQ(1, span_write_msgpack(spans[i], (cmp_ctx_t *)&bctx));
+    }
+    EXPECT_INT_ZERO(expect_spans_read(spans, buf, bctx.off));
+    free(buf);
+    return EXIT_SUCCESS;
+}
+
+static int test_read_truncated(const uint8_t *buf, size_t len)
+{
+    struct htrace_span_reader *rd;
+    struct htrace_span_view view;
+    size_t off;
+    int i;
+
+    rd = htrace_span_reader_alloc(buf, len - 1);
+    EXPECT_NONNULL(rd);
+    for (i = 0; i < NUM_TEST_SPANS - 1; i++) {
+        EXPECT_INT_EQ(1, htrace_span_reader_next(rd, &view));
+    }
+    off = htrace_span_reader_offset(rd);
+    EXPECT_INT_EQ(-1, htrace_span_reader_next(rd, &view));
+    EXPECT_INT_EQ(1, htrace_span_reader_error(rd)[0] != '\0');
+    // We stay at the bad span.
+    EXPECT_UINT64_EQ((uint64_t)off, (uint64_t)htrace_span_reader_offset(rd));
+    EXPECT_INT_EQ(-1, htrace_span_reader_next(rd, &view));
+    htrace_span_reader_free(rd);
+    return EXIT_SUCCESS;
+}
+
+static int test_skip_unknown_keys(void)
+{
+    // {"zz": [1, {"q": -1}], "a": <span id 0x1:0x2>, "d": "x"}
+    static const uint8_t buf[] = {
+        0x83,
+        0xa2, 'z', 'z', 0x92, 0x01, 0x81, 0xa1, 'q', 0xff,
+        0xa1, 'a', 0xc4, 0x10,
+            0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 2,
+        0xa1, 'd', 0xa1, 'x',
+    };
+    struct htrace_span_reader *rd;
+    struct htrace_span_view view;
+
+    rd = htrace_span_reader_alloc(buf, sizeof(buf));
+    EXPECT_NONNULL(rd);
+    EXPECT_INT_EQ(1, htrace_span_reader_next(rd, &view));
+    EXPECT_UINT64_EQ((uint64_t)1, view.span_id.high);
+    EXPECT_UINT64_EQ((uint64_t)2, view.span_id.low);
+    EXPECT_INT_ZERO(expect_view_str("x", view.desc, view.desc_len));
+    EXPECT_NULL(view.trid);
+    EXPECT_INT_ZERO(view.num_parents);
+    EXPECT_INT_ZERO(htrace_span_reader_next(rd, &view));
+    htrace_span_reader_free(rd);
+    return EXIT_SUCCESS;
+}
+
+static int test_read_file(struct htrace_span **spans, const uint8_t *buf,
+                          size_t len)
+{
+    struct htrace_span_reader *rd;
+    struct htrace_span_view view;
+    char *tdir, path[PATH_MAX], err[512];
+    FILE *fp;
+    int i;
+
+    err[0] = '\0';
+    tdir = create_tempdir("test_read_file", 0775, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    EXPECT_INT_ZERO(register_tempdir_for_cleanup(tdir));
+    snprintf(path, sizeof(path), "%s/spans", tdir);
+    fp = fopen(path, "w");
+    EXPECT_NONNULL(fp);
+    EXPECT_UINT64_EQ((uint64_t)len, (uint64_t)fwrite(buf, 1, len, fp));
+    EXPECT_INT_ZERO(fclose(fp));
+    rd = htrace_span_reader_open(path, err, sizeof(err));
+    EXPECT_STR_EQ("", err);
+    EXPECT_NONNULL(rd);
+    for (i = 0; i < NUM_TEST_SPANS; i++) {
+        EXPECT_INT_EQ(1, htrace_span_reader_next(rd, &view));
+        EXPECT_INT_ZERO(expect_view_matches(spans[i], &view));
+    }
+    EXPECT_INT_ZERO(htrace_span_reader_next(rd, &view));
+    htrace_span_reader_free(rd);
+    snprintf(path, sizeof(path), "%s/nonexistent", tdir);
+    EXPECT_NULL(htrace_span_reader_open(path, err, sizeof(err)));
+    EXPECT_INT_EQ(1, err[0] != '\0');
+    free(tdir);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    struct htrace_span **spans;
+    uint8_t *buf;
+    size_t len;
+
+    spans = setup_test_spans();
+    buf = xcalloc(TEST_BUF_LENGTH);
+    EXPECT_INT_ZERO(test_read_encoded(spans, buf, &len));
+    EXPECT_INT_ZERO(test_read_cmp_written(spans));
+    EXPECT_INT_ZERO(test_read_truncated(buf, len));
+    EXPECT_INT_ZERO(test_skip_unknown_keys());
+    EXPECT_INT_ZERO(test_read_file(spans, buf, len));
+    free(buf);
+    free_test_spans(spans);
+
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
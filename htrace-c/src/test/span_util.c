@@ -29,12 +29,34 @@
 #include <stdlib.h>
 #include <string.h>
 
+/**
+ * Make room for the parents of a span which has none yet.
+ *
+ * @param span          The span.
+ * @param num           The number of parents.  Must be at least 1.
+ *
+ * @return              The parent array to fill in, or NULL on OOM.
+ */
+static struct htrace_span_id *span_alloc_parents(struct htrace_span *span,
+                                                 int num)
+{
+    if (num > HTRACE_SPAN_INLINE_PARENTS) {
+        span->parent.list = malloc(sizeof(struct htrace_span_id) * num);
+        if (!span->parent.list) {
+            return NULL;
+        }
+    }
+    span->num_parents = num;
+    return HTRACE_SPAN_PARENTS(span);
+}
+
 static void span_json_parse_parents(struct json_object *root,
                     struct htrace_span *span, char *err, size_t err_len)
 {
     char err2[128];
     size_t err2_len = sizeof(err2);
     struct json_object *p = NULL, *e = NULL;
+    struct htrace_span_id *ids;
     int i, np;
 
     err2[0] = '\0';
@@ -46,30 +68,107 @@ static void span_json_parse_parents(struct json_object *root,
         return;
     }
     np = json_object_array_length(p);
-    if (np == 1) {
-        span->num_parents = 1;
-        e = json_object_array_get_idx(p, 0);
-        htrace_span_id_parse(&span->parent.single,
-                             json_object_get_string(e), err2, err2_len);
+    if (np <= 0) {
+        return;
+    }
+    ids = span_alloc_parents(span, np);
+    if (!ids) {
+        snprintf(err, err_len, "failed to allocate parent ID array of "
+                 "%d elements", np);
+        return;
+    }
+    for (i = 0; i < np; i++) {
+        e = json_object_array_get_idx(p, i);
+        htrace_span_id_parse(ids + i, json_object_get_string(e),
+                             err2, err2_len);
         if (err2[0]) {
-            snprintf(err, err_len, "failed to parse parent ID 1/1: %s.", err2);
+            snprintf(err, err_len, "failed to parse parent ID %d/%d: %s",
+                     i + 1, np, err2);
             return;
         }
-    } else if (np > 1) {
-        span->parent.list = malloc(sizeof(struct htrace_span_id) * np);
-        if (!span->parent.list) {
-            snprintf(err, err_len, "failed to allocate parent ID array of "
-                     "%d elements", np);
-            return;
+    }
+}
+
+/**
+ * Parse the precise timestamps of a span, if it has them.
+ */
+static void span_json_parse_precise(struct json_object *root,
+                    struct htrace_span *span, char *err, size_t err_len)
+{
+    struct json_object *b = NULL, *e = NULL;
+    uint64_t scale;
+
+    if (json_object_object_get_ex(root, "bn", &b) &&
+            json_object_object_get_ex(root, "en", &e)) {
+        span->ts_precision = HTRACE_TS_PRECISION_NS;
+        scale = 1;
+    } else if (json_object_object_get_ex(root, "bu", &b) &&
+            json_object_object_get_ex(root, "eu", &e)) {
+        span->ts_precision = HTRACE_TS_PRECISION_US;
+        scale = 1000;
+    } else {
+        return;
+    }
+    span->begin_sub_ns =
+        ((uint64_t)json_object_get_int64(b) * scale) % 1000000ULL;
+    span->end_sub_ns =
+        ((uint64_t)json_object_get_int64(e) * scale) % 1000000ULL;
+}
+
+/**
+ * Parse the CPU use fields of a span, if it has them.
+ */
+static void span_json_parse_cpu(struct json_object *root,
+                                struct htrace_span *span)
+{
+    struct json_object *n = NULL, *v = NULL, *i = NULL;
+
+    if (!json_object_object_get_ex(root, "cn", &n)) {
+        return;
+    }
+    span->cpu = HTRACE_SPAN_CPU_TIME;
+    span->cpu_ns = json_object_get_int64(n);
+    if (json_object_object_get_ex(root, "cv", &v) &&
+            json_object_object_get_ex(root, "ci", &i)) {
+        span->cpu = HTRACE_SPAN_CPU_RUSAGE;
+        span->vol_csw = json_object_get_int64(v);
+        span->invol_csw = json_object_get_int64(i);
+    }
+}
+
+/**
+ * Parse the key/value annotations and timeline events of a span.
+ */
+static void span_json_parse_extra(struct json_object *root,
+                    struct htrace_span *span, char *err, size_t err_len)
+{
+    struct json_object *n = NULL, *t = NULL, *ev, *et, *em;
+    int i, res;
+
+    if (json_object_object_get_ex(root, "n", &n)) {
+        json_object_object_foreach(n, key, val) {
+            res = htrace_span_add_kv(span, key, json_object_get_string(val));
+            if (res) {
+                snprintf(err, err_len, "failed to add key/value annotation "
+                         "%s: %s", key, terror(res));
+                return;
+            }
         }
-        span->num_parents = np;
-        for (i = 0; i < np; i++) {
-            e = json_object_array_get_idx(p, i);
-            htrace_span_id_parse(span->parent.list + i,
-                                 json_object_get_string(e), err2, err2_len);
-            if (err2[0]) {
-                snprintf(err, err_len, "failed to parse parent ID %d/%d: %s",
-                         i + 1, np, err2);
+    }
+    if (json_object_object_get_ex(root, "t", &t)) {
+        for (i = 0; i < json_object_array_length(t); i++) {
+            ev = json_object_array_get_idx(t, i);
+            if ((!json_object_object_get_ex(ev, "t", &et)) ||
+                    (!json_object_object_get_ex(ev, "m", &em))) {
+                snprintf(err, err_len, "timeline event %d is missing "
+                         "\"t\" or \"m\"", i);
+                return;
+            }
+            res = htrace_span_add_event(span, json_object_get_int64(et),
+                                        json_object_get_string(em));
+            if (res) {
+                snprintf(err, err_len, "failed to add timeline event "
+                         "%d: %s", i, terror(res));
                 return;
             }
         }
@@ -111,6 +210,8 @@ static void span_json_parse_impl(struct json_object *root,
             return;
         }
     }
+    span_json_parse_precise(root, span, err, err_len);
+    span_json_parse_cpu(root, span);
     if (json_object_object_get_ex(root, "a", &s)) {
         htrace_span_id_parse(&span->span_id, json_object_get_string(s),
                                      err2, sizeof(err2));
@@ -132,6 +233,10 @@ static void span_json_parse_impl(struct json_object *root,
     if (err[0]) {
         return;
     }
+    span_json_parse_extra(root, span, err, err_len);
+    if (err[0]) {
+        return;
+    }
 }
 
 void span_json_parse(const char *in, struct htrace_span **rspan,
@@ -215,16 +320,8 @@ static int compare_parents(struct htrace_span *a, struct htrace_span *b)
         } else if (i >= nb) {
             return 1;
         }
-        if ((i == 0) && (na == 1)) {
-            htrace_span_id_copy(&sa, &a->parent.single);
-        } else {
-            htrace_span_id_copy(&sa, a->parent.list + i);
-        }
-        if ((i == 0) && (nb == 1)) {
-            htrace_span_id_copy(&sb, &b->parent.single);
-        } else {
-            htrace_span_id_copy(&sb, b->parent.list + i);
-        }
+        htrace_span_id_copy(&sa, HTRACE_SPAN_PARENTS(a) + i);
+        htrace_span_id_copy(&sb, HTRACE_SPAN_PARENTS(b) + i);
         cmp = htrace_span_id_compare(&sa, &sb);
         if (cmp) {
             return cmp;
@@ -232,6 +329,37 @@ static int compare_parents(struct htrace_span *a, struct htrace_span *b)
     }
 }
 
+/**
+ * Compare the key/value annotations and timeline events of two spans.
+ *
+ * The order of annotations relative to events isn't preserved when a span is
+ * serialized, so we compare the serialized forms.
+ */
+static int compare_extra(struct htrace_span *a, struct htrace_span *b)
+{
+    char *ja, *jb;
+    int c, la, lb;
+
+    if ((!a->extra) && (!b->extra)) {
+        return 0;
+    }
+    la = span_json_size(a);
+    lb = span_json_size(b);
+    ja = malloc(la);
+    jb = malloc(lb);
+    if ((!ja) || (!jb)) {
+        free(ja);
+        free(jb);
+        return (!ja) ? -1 : 1;
+    }
+    span_json_sprintf(a, la, ja);
+    span_json_sprintf(b, lb, jb);
+    c = strcmp(ja, jb);
+    free(ja);
+    free(jb);
+    return c;
+}
+
 int span_compare(struct htrace_span *a, struct htrace_span *b)
 {
     int c;
@@ -252,11 +380,47 @@ int span_compare(struct htrace_span *a, struct htrace_span *b)
     if (c) {
         return c;
     }
+    c = uint64_cmp(a->ts_precision, b->ts_precision);
+    if (c) {
+        return c;
+    }
+    c = uint64_cmp(a->begin_sub_ns, b->begin_sub_ns);
+    if (c) {
+        return c;
+    }
+    c = uint64_cmp(a->end_sub_ns, b->end_sub_ns);
+    if (c) {
+        return c;
+    }
+    c = uint64_cmp(a->cpu, b->cpu);
+    if (c) {
+        return c;
+    }
+    if (a->cpu != HTRACE_SPAN_CPU_OFF) {
+        c = uint64_cmp(a->cpu_ns, b->cpu_ns);
+        if (c) {
+            return c;
+        }
+    }
+    if (a->cpu == HTRACE_SPAN_CPU_RUSAGE) {
+        c = uint64_cmp(a->vol_csw, b->vol_csw);
+        if (c) {
+            return c;
+        }
+        c = uint64_cmp(a->invol_csw, b->invol_csw);
+        if (c) {
+            return c;
+        }
+    }
     c = strcmp_handle_null(a->trid, b->trid);
     if (c) {
         return c;
     }
-    return compare_parents(a, b);
+    c = compare_parents(a, b);
+    if (c) {
+        return c;
+    }
+    return compare_extra(a, b);
 }
 
 static int span_read_key_str(struct cmp_ctx_s *ctx, char *out,
@@ -316,11 +480,11 @@ static void span_parse_msgpack_parents(struct cmp_ctx_s *ctx,
                 struct htrace_span *span, char *err, size_t err_len)
 {
     uint32_t i, size;
+    struct htrace_span_id *ids;
 
     err[0] = '\0';
-    if (span->num_parents > 1) {
+    if (span->num_parents > HTRACE_SPAN_INLINE_PARENTS) {
         free(span->parent.list);
-        span->parent.list = NULL;
     }
     htrace_span_id_clear(&span->parent.single);
     span->num_parents = 0;
@@ -329,30 +493,126 @@ static void span_parse_msgpack_parents(struct cmp_ctx_s *ctx,
                  "failed.");
         return;
     }
-    if (size == 1) {
-        if (!htrace_span_id_read_msgpack(&span->parent.single, ctx)) {
-            snprintf(err, err_len, "span_parse_msgpack_parents: cmp_read_u64 "
-                     "for single child ID failed");
+    if (size == 0) {
+        return;
+    }
+    ids = span_alloc_parents(span, size);
+    if (!ids) {
+        snprintf(err, err_len, "span_parse_msgpack_parents: failed to "
+                 "malloc %"PRId32"-entry parent array.", size);
+        return;
+    }
+    for (i = 0; i < size; i++) {
+        if (!htrace_span_id_read_msgpack(ids + i, ctx)) {
+            snprintf(err, err_len, "span_parse_msgpack_parents: "
+                "htrace_span_id_read_msgpack for child %d ID failed", i);
             return;
         }
-    } else if (size > 1) {
-        span->parent.list = malloc(sizeof(struct htrace_span_id) * size);
-        if (!span->parent.list) {
-            snprintf(err, err_len, "span_parse_msgpack_parents: failed to "
-                     "malloc %"PRId32"-entry parent array.", size);
+    }
+}
+
+static void span_parse_msgpack_kvs(struct cmp_ctx_s *ctx,
+                struct htrace_span *span, char *err, size_t err_len)
+{
+    uint32_t i, size;
+    char *key, *val;
+    int res;
+
+    if (!cmp_read_map(ctx, &size)) {
+        snprintf(err, err_len, "span_parse_msgpack_kvs: cmp_read_map "
+                 "failed.");
+        return;
+    }
+    for (i = 0; i < size; i++) {
+        key = cmp_read_malloced_string(ctx, "key", err, err_len);
+        if (err[0]) {
+            return;
+        }
+        val = cmp_read_malloced_string(ctx, "value", err, err_len);
+        if (err[0]) {
+            free(key);
+            return;
+        }
+        res = htrace_span_add_kv(span, key, val);
+        free(key);
+        free(val);
+        if (res) {
+            snprintf(err, err_len, "span_parse_msgpack_kvs: "
+                     "htrace_span_add_kv failed: %s", terror(res));
+            return;
+        }
+    }
+}
+
+static void span_parse_msgpack_events(struct cmp_ctx_s *ctx,
+                struct htrace_span *span, char *err, size_t err_len)
+{
+    uint32_t i, j, size, map_size;
+    uint64_t time_ms;
+    char key[8], *msg;
+    int res;
+
+    if (!cmp_read_array(ctx, &size)) {
+        snprintf(err, err_len, "span_parse_msgpack_events: cmp_read_array "
+                 "failed.");
+        return;
+    }
+    for (i = 0; i < size; i++) {
+        if (!cmp_read_map(ctx, &map_size)) {
+            snprintf(err, err_len, "span_parse_msgpack_events: cmp_read_map "
+                     "failed for event %"PRId32".", i);
             return;
         }
-        for (i = 0; i < size; i++) {
-            if (!htrace_span_id_read_msgpack(span->parent.list + i, ctx)) {
-                snprintf(err, err_len, "span_parse_msgpack_parents: "
-                    "htrace_span_id_read_msgpack for child %d ID failed", i);
-                free(span->parent.list);
-                span->parent.list = NULL;
+        time_ms = 0;
+        msg = NULL;
+        for (j = 0; j < map_size; j++) {
+            if (!span_read_key_str(ctx, key, sizeof(key), err, err_len)) {
+                free(msg);
+                return;
+            }
+            if (!strcmp(key, "t")) {
+                if (!cmp_read_u64(ctx, &time_ms)) {
+                    snprintf(err, err_len, "span_parse_msgpack_events: "
+                             "cmp_read_u64 failed for event %"PRId32".", i);
+                    free(msg);
+                    return;
+                }
+            } else if (!strcmp(key, "m")) {
+                free(msg);
+                msg = cmp_read_malloced_string(ctx, "message", err, err_len);
+                if (err[0]) {
+                    return;
+                }
+            } else {
+                snprintf(err, err_len, "span_parse_msgpack_events: can't "
+                         "understand key '%s'.", key);
+                free(msg);
                 return;
             }
         }
+        res = htrace_span_add_event(span, time_ms, msg ? msg : "");
+        free(msg);
+        if (res) {
+            snprintf(err, err_len, "span_parse_msgpack_events: "
+                     "htrace_span_add_event failed: %s", terror(res));
+            return;
+        }
+    }
+}
+
+/**
+ * Handle a precise timestamp, such as "bu" or "en".
+ */
+static void span_read_precise_ts(struct htrace_span *span, const char *key,
+                                 uint64_t ts, uint32_t *sub_ns)
+{
+    if (key[1] == 'u') {
+        span->ts_precision = HTRACE_TS_PRECISION_US;
+        *sub_ns = (ts * 1000ULL) % 1000000ULL;
+    } else {
+        span->ts_precision = HTRACE_TS_PRECISION_NS;
+        *sub_ns = ts % 1000000ULL;
     }
-    span->num_parents = size;
 }
 
 struct htrace_span *span_read_msgpack(struct cmp_ctx_s *ctx,
@@ -360,6 +620,7 @@ struct htrace_span *span_read_msgpack(struct cmp_ctx_s *ctx,
 {
     struct htrace_span *span = NULL;
     uint32_t map_size = 0;
+    uint64_t ts;
     char key[8];
 
     err[0] = '\0';
@@ -397,6 +658,15 @@ struct htrace_span *span_read_msgpack(struct cmp_ctx_s *ctx,
             }
             break;
         case 'b':
+            if (key[1]) {
+                if (!cmp_read_u64(ctx, &ts)) {
+                    snprintf(err, err_len, "span_read_msgpack: cmp_read_u64 "
+                             "failed for precise begin time.");
+                    goto error;
+                }
+                span_read_precise_ts(span, key, ts, &span->begin_sub_ns);
+                break;
+            }
             if (!cmp_read_u64(ctx, &span->begin_ms)) {
                 snprintf(err, err_len, "span_read_msgpack: cmp_read_u64 "
                          "failed for span->begin_ms.");
@@ -404,12 +674,41 @@ struct htrace_span *span_read_msgpack(struct cmp_ctx_s *ctx,
             }
             break;
         case 'e':
+            if (key[1]) {
+                if (!cmp_read_u64(ctx, &ts)) {
+                    snprintf(err, err_len, "span_read_msgpack: cmp_read_u64 "
+                             "failed for precise end time.");
+                    goto error;
+                }
+                span_read_precise_ts(span, key, ts, &span->end_sub_ns);
+                break;
+            }
             if (!cmp_read_u64(ctx, &span->end_ms)) {
                 snprintf(err, err_len, "span_read_msgpack: cmp_read_u64 "
                          "failed for span->end_ms.");
                 goto error;
             }
             break;
+        case 'c':
+            if (!cmp_read_u64(ctx, &ts)) {
+                snprintf(err, err_len, "span_read_msgpack: cmp_read_u64 "
+                         "failed for CPU use field '%s'.", key);
+                goto error;
+            }
+            if (key[1] == 'n') {
+                if (span->cpu == HTRACE_SPAN_CPU_OFF) {
+                    span->cpu = HTRACE_SPAN_CPU_TIME;
+                }
+                span->cpu_ns = ts;
+            } else {
+                span->cpu = HTRACE_SPAN_CPU_RUSAGE;
+                if (key[1] == 'v') {
+                    span->vol_csw = ts;
+                } else {
+                    span->invol_csw = ts;
+                }
+            }
+            break;
         case 'r':
             if (span->trid) {
                 free(span->trid);
@@ -426,6 +725,18 @@ struct htrace_span *span_read_msgpack(struct cmp_ctx_s *ctx,
                 goto error;
             }
             break;
+        case 'n':
+            span_parse_msgpack_kvs(ctx, span, err, err_len);
+            if (err[0]) {
+                goto error;
+            }
+            break;
+        case 't':
+            span_parse_msgpack_events(ctx, span, err, err_len);
+            if (err[0]) {
+                goto error;
+            }
+            break;
         default:
             snprintf(err, err_len, "span_read_msgpack: can't understand key "
                      "'%s'.\n", key);
@@ -0,0 +1,153 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/conf.h"
+#include "receiver/spill.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+#include "util/log.h"
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_SEG_SIZE 1024
+
+static struct htrace_log *g_spill_unit_lg;
+
+static int count_files(const char *path)
+{
+    DIR *dp;
+    struct dirent *de;
+    int count = 0;
+
+    dp = opendir(path);
+    if (!dp) {
+        return -1;
+    }
+    while ((de = readdir(dp))) {
+        if (de->d_name[0] != '.') {
+            count++;
+        }
+    }
+    closedir(dp);
+    return count;
+}
+
+static void fill_batch(char *buf, size_t len, int id)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = (char)(id + i);
+    }
+}
+
+static int expect_batch(struct spill_log *sp, uint64_t expected_len, int id)
+{
+    char expected[TEST_SEG_SIZE];
+    const void *data;
+    uint64_t len, num_spans;
+
+    EXPECT_INT_EQ(1, spill_log_peek(sp, &data, &len, &num_spans));
+    EXPECT_UINT64_EQ(expected_len, len);
+    EXPECT_UINT64_EQ((uint64_t)id, num_spans);
+    fill_batch(expected, len, id);
+    EXPECT_INT_ZERO(memcmp(expected, data, len));
+    return EXIT_SUCCESS;
+}
+
+static int test_spill_fifo(const char *dir)
+{
+    char buf[TEST_SEG_SIZE];
+    struct spill_log *sp;
+    const void *data;
+    uint64_t len, num_spans;
+    int i;
+
+    sp = spill_log_open(g_spill_unit_lg, dir, TEST_SEG_SIZE,
+                        TEST_SEG_SIZE * 3);
+    EXPECT_NONNULL(sp);
+    EXPECT_UINT64_EQ((uint64_t)0, spill_log_count(sp));
+    EXPECT_INT_ZERO(spill_log_peek(sp, &data, &len, &num_spans));
+    // Three batches of 301 bytes fit into one segment.  Ten batches need four
+    // segments, which is more than we are allowed.
+    for (i = 1; i <= 9; i++) {
+        fill_batch(buf, 301, i);
+        EXPECT_INT_EQ(1, spill_log_append(sp, buf, 301, i));
+    }
+    EXPECT_INT_EQ(3, count_files(dir));
+    EXPECT_INT_ZERO(spill_log_append(sp, buf, 301, 10));
+    EXPECT_UINT64_EQ((uint64_t)9, spill_log_count(sp));
+    // A batch which can't fit in a segment is rejected.
+    EXPECT_INT_ZERO(spill_log_append(sp, buf, TEST_SEG_SIZE, 11));
+
+    // Batches come out in order, and segments are deleted once they are
+    // consumed.
+    for (i = 1; i <= 4; i++) {
+        EXPECT_INT_ZERO(expect_batch(sp, 301, i));
+        spill_log_pop(sp);
+    }
+    EXPECT_INT_EQ(2, count_files(dir));
+    fill_batch(buf, 17, 10);
+    EXPECT_INT_EQ(1, spill_log_append(sp, buf, 17, 10));
+    for (i = 5; i <= 9; i++) {
+        EXPECT_INT_ZERO(expect_batch(sp, 301, i));
+        spill_log_pop(sp);
+    }
+    EXPECT_INT_ZERO(expect_batch(sp, 17, 10));
+    spill_log_pop(sp);
+    EXPECT_UINT64_EQ((uint64_t)0, spill_log_count(sp));
+
+    // The last segment is reused once it is empty.
+    EXPECT_INT_EQ(1, count_files(dir));
+    fill_batch(buf, 500, 12);
+    EXPECT_INT_EQ(1, spill_log_append(sp, buf, 500, 12));
+    EXPECT_INT_EQ(1, count_files(dir));
+    EXPECT_INT_ZERO(expect_batch(sp, 500, 12));
+
+    // Closing the queue deletes the segment files.
+    spill_log_close(sp);
+    EXPECT_INT_ZERO(count_files(dir));
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    struct htrace_conf *conf;
+    char err[128];
+    size_t err_len = sizeof(err);
+    char *tdir;
+
+    conf = htrace_conf_from_strs("", "");
+    EXPECT_NONNULL(conf);
+    g_spill_unit_lg = htrace_log_alloc(conf);
+    EXPECT_NONNULL(g_spill_unit_lg);
+    tdir = create_tempdir("spill-unit", 0755, err, err_len);
+    EXPECT_NONNULL(tdir);
+    EXPECT_INT_ZERO(register_tempdir_for_cleanup(tdir));
+    EXPECT_INT_ZERO(test_spill_fifo(tdir));
+    free(tdir);
+    htrace_log_free(g_spill_unit_lg);
+    htrace_conf_free(conf);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
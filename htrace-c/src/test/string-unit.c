@@ -66,6 +66,76 @@ static int test_validate_json_string(void)
     return EXIT_SUCCESS;
 }
 
+/**
+ * Test validate_json_string on strings long enough to use the vectorized
+ * path, with every byte value at every position relative to a 16-byte
+ * boundary.
+ */
+static int test_validate_json_string_long(void)
+{
+    char buf[128] __attribute__((aligned(16)));
+    int start, pos, c, expected;
+
+    for (start = 0; start < 16; start++) {
+        for (pos = start; pos < start + 40; pos++) {
+            for (c = 1; c < 256; c++) {
+                memset(buf, 'a', sizeof(buf));
+                buf[start + 60] = '\0';
+                buf[pos] = c;
+                expected = ((0x20 <= c) && (c <= 0x7e) &&
+                            (c != '"') && (c != '\\'));
+                EXPECT_INT_EQ(expected,
+                              validate_json_string(NULL, buf + start));
+            }
+            // A 2-byte UTF-8 sequence is fine; a truncated one is not.
+            memset(buf, 'a', sizeof(buf));
+            buf[start + 60] = '\0';
+            memcpy(buf + pos, "\xc3\xa9", 2);
+            EXPECT_INT_EQ(1, validate_json_string(NULL, buf + start));
+            buf[pos + 1] = 'a';
+            EXPECT_INT_EQ(0, validate_json_string(NULL, buf + start));
+            // So is a 3-byte one.
+            memcpy(buf + pos, "\xe2\x82\xac", 3);
+            EXPECT_INT_EQ(1, validate_json_string(NULL, buf + start));
+        }
+        // The terminator can fall anywhere in a chunk.
+        for (pos = start; pos < start + 40; pos++) {
+            memset(buf, 'a', sizeof(buf));
+            buf[pos] = '\0';
+            buf[pos + 1] = '"';
+            EXPECT_INT_EQ(1, validate_json_string(NULL, buf + start));
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Test validate_json_string_len, which must stop at the given length and not
+ * at a NUL.
+ */
+static int test_validate_json_string_len(void)
+{
+    char buf[64];
+    int len;
+
+    EXPECT_INT_EQ(1, validate_json_string_len(NULL, "", 0));
+    EXPECT_INT_EQ(1, validate_json_string_len(NULL, "abc\"", 3));
+    EXPECT_INT_EQ(0, validate_json_string_len(NULL, "abc\"", 4));
+    EXPECT_INT_EQ(0, validate_json_string_len(NULL, "a\0b", 3));
+    // A multi-byte sequence cut off by the length is not valid.
+    EXPECT_INT_EQ(1, validate_json_string_len(NULL, "\xe2\x82\xac", 3));
+    EXPECT_INT_EQ(0, validate_json_string_len(NULL, "\xe2\x82\xac", 2));
+    EXPECT_INT_EQ(0, validate_json_string_len(NULL, "\xc3\xa9", 1));
+    // The buffer has no terminator at all, and a bad byte just past the end.
+    for (len = 0; len < (int)sizeof(buf); len++) {
+        memset(buf, 'a', sizeof(buf));
+        buf[len] = '\\';
+        EXPECT_INT_EQ(1, validate_json_string_len(NULL, buf, len));
+        EXPECT_INT_EQ(0, validate_json_string_len(NULL, buf, len + 1));
+    }
+    return EXIT_SUCCESS;
+}
+
 static int test_parse_endpoint(struct htrace_log *lg, const char *eremote,
                                int eport, const char *endpoint)
 {
@@ -111,6 +181,8 @@ int main(void)
 {
     EXPECT_INT_ZERO(test_fwdprintf());
     EXPECT_INT_ZERO(test_validate_json_string());
+    EXPECT_INT_ZERO(test_validate_json_string_long());
+    EXPECT_INT_ZERO(test_validate_json_string_len());
     EXPECT_INT_ZERO(test_parse_endpoints());
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,139 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/htrace.h"
+#include "test/span_table.h"
+#include "test/temp_dir.h"
+#include "test/test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TAIL_UNIT_TRID "tail-unit/1"
+
+static int expect_span(struct span_table *st, const char *desc)
+{
+    struct htrace_span *span;
+
+    EXPECT_INT_ZERO(span_table_get(st, &span, desc, TAIL_UNIT_TRID));
+    return EXIT_SUCCESS;
+}
+
+static int test_tail_sampling(void)
+{
+    char err[512];
+    size_t err_len = sizeof(err);
+    char *local_path, *tdir, *conf_str = NULL;
+    struct htrace_conf *cnf;
+    struct htracer *tracer;
+    struct htrace_sampler *smp;
+    struct htrace_scope *root, *child;
+    struct htrace_span *fast_late, *slow_late;
+    struct htrace_stats stats;
+    struct span_table *st;
+
+    tdir = create_tempdir("tail-unit", 0777, err, err_len);
+    EXPECT_STR_EQ("", err);
+    register_tempdir_for_cleanup(tdir);
+    EXPECT_INT_GE(0, asprintf(&local_path, "%s/%s", tdir, "spans.json"));
+    EXPECT_INT_GE(0, asprintf(&conf_str, "%s=%s;%s=%s;%s=%s;%s=%s;"
+                "%s=true;%s=50;%s=2",
+                HTRACE_SPAN_RECEIVER_KEY, "local.file",
+                HTRACE_LOCAL_FILE_RCV_PATH_KEY, local_path,
+                HTRACE_SAMPLER_KEY, "always",
+                HTRACE_TRACER_ID, TAIL_UNIT_TRID,
+                HTRACE_TAIL_SAMPLING_KEY,
+                HTRACE_TAIL_MIN_DURATION_MS_KEY,
+                HTRACE_TAIL_MAX_TRACE_SPANS_KEY));
+    cnf = htrace_conf_from_str(conf_str);
+    EXPECT_NONNULL(cnf);
+    tracer = htracer_create("tail-unit", cnf);
+    EXPECT_NONNULL(tracer);
+    smp = htrace_sampler_create(tracer, cnf);
+    EXPECT_NONNULL(smp);
+
+    // A fast trace is dropped, along with a span which closes after its root.
+    root = htrace_start_span(tracer, smp, "fast_root");
+    EXPECT_NONNULL(root);
+    child = htrace_start_span(tracer, smp, "fast_child");
+    htrace_scope_close(child);
+    child = htrace_start_span(tracer, smp, "fast_late");
+    fast_late = htrace_scope_detach(child);
+    EXPECT_NONNULL(fast_late);
+    htrace_scope_close(child);
+    htrace_scope_close(root);
+    htrace_scope_close(htrace_restart_span(tracer, fast_late));
+
+    // A fast trace with an error annotation is kept.
+    root = htrace_start_span(tracer, smp, "err_root");
+    EXPECT_NONNULL(root);
+    child = htrace_start_span(tracer, smp, "err_child");
+    EXPECT_INT_ZERO(htrace_scope_add_kv(child, "error", "boom"));
+    htrace_scope_close(child);
+    htrace_scope_close(root);
+
+    // A slow trace is kept, except for the span that didn't fit while we
+    // waited for the root to close.
+    root = htrace_start_span(tracer, smp, "slow_root");
+    EXPECT_NONNULL(root);
+    htrace_scope_close(htrace_start_span(tracer, smp, "slow_child1"));
+    htrace_scope_close(htrace_start_span(tracer, smp, "slow_child2"));
+    htrace_scope_close(htrace_start_span(tracer, smp, "slow_child3"));
+    child = htrace_start_span(tracer, smp, "slow_late");
+    slow_late = htrace_scope_detach(child);
+    EXPECT_NONNULL(slow_late);
+    htrace_scope_close(child);
+    usleep(60000);
+    htrace_scope_close(root);
+    htrace_scope_close(htrace_restart_span(tracer, slow_late));
+
+    htracer_get_stats(tracer, &stats);
+    EXPECT_UINT64_EQ((uint64_t)10, stats.spans_closed);
+    EXPECT_UINT64_EQ((uint64_t)6, stats.tail_kept);
+    EXPECT_UINT64_EQ((uint64_t)4, stats.tail_dropped);
+    htrace_sampler_free(smp);
+    htracer_free(tracer);
+    htrace_conf_free(cnf);
+
+    st = span_table_alloc();
+    EXPECT_NONNULL(st);
+    EXPECT_INT_GE(0, load_trace_span_file(local_path, st));
+    EXPECT_INT_EQ(6, span_table_size(st));
+    EXPECT_INT_ZERO(expect_span(st, "err_root"));
+    EXPECT_INT_ZERO(expect_span(st, "err_child"));
+    EXPECT_INT_ZERO(expect_span(st, "slow_root"));
+    EXPECT_INT_ZERO(expect_span(st, "slow_child1"));
+    EXPECT_INT_ZERO(expect_span(st, "slow_child2"));
+    EXPECT_INT_ZERO(expect_span(st, "slow_late"));
+    span_table_free(st);
+    free(conf_str);
+    free(local_path);
+    free(tdir);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    EXPECT_INT_ZERO(test_tail_sampling());
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
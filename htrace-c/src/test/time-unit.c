@@ -17,6 +17,7 @@
  */
 
 #include "core/conf.h"
+#include "core/htrace.h"
 #include "test/test.h"
 #include "util/log.h"
 #include "util/time.h"
@@ -66,6 +67,46 @@ static int test_now_increases(int monotonic)
     return EXIT_SUCCESS;
 }
 
+/**
+ * The most we expect an htrace_clock to differ from CLOCK_REALTIME.
+ */
+#define TEST_CLOCK_SLOP_NS 50000000ULL
+
+static int test_clock(const char *name, enum htrace_clock_type ty)
+{
+    struct htrace_conf *cnf;
+    struct htrace_clock *clk;
+    char confstr[128];
+    uint64_t first, prev, next, real;
+    int i;
+
+    snprintf(confstr, sizeof(confstr), "%s=%s", HTRACE_CLOCK_KEY, name);
+    cnf = htrace_conf_from_str(confstr);
+    EXPECT_NONNULL(cnf);
+    clk = htrace_clock_alloc(g_test_lg, cnf);
+    EXPECT_NONNULL(clk);
+    // The TSC clock isn't available everywhere.
+    if (ty != HTRACE_CLOCK_TSC) {
+        EXPECT_INT_EQ(ty, htrace_clock_get_type(clk));
+    }
+    first = prev = htrace_clock_now_ns(clk);
+    for (i = 0; i < 10; i++) {
+        sleep_ms(2);
+        next = htrace_clock_now_ns(clk);
+        // The coarse clock may not tick every 2 ms.
+        EXPECT_INT_EQ(1, next >= prev);
+        real = now_ms(g_test_lg) * 1000000ULL;
+        EXPECT_INT_EQ(1, next + TEST_CLOCK_SLOP_NS > real);
+        EXPECT_INT_EQ(1, next < real + TEST_CLOCK_SLOP_NS);
+        EXPECT_INT_EQ(1, htrace_clock_now_ms(clk) >= next / 1000000ULL);
+        prev = next;
+    }
+    EXPECT_INT_EQ(1, prev > first);
+    htrace_clock_free(clk);
+    htrace_conf_free(cnf);
+    return EXIT_SUCCESS;
+}
+
 int main(void)
 {
     g_test_conf = htrace_conf_from_strs("", "");
@@ -76,6 +117,12 @@ int main(void)
     test_now_increases(0);
     test_now_increases(1);
 
+    EXPECT_INT_ZERO(test_clock("realtime", HTRACE_CLOCK_REALTIME));
+    EXPECT_INT_ZERO(test_clock("realtime-coarse",
+                               HTRACE_CLOCK_REALTIME_COARSE));
+    EXPECT_INT_ZERO(test_clock("tsc", HTRACE_CLOCK_TSC));
+    EXPECT_INT_ZERO(test_clock("bogus", HTRACE_CLOCK_REALTIME));
+
     htrace_log_free(g_test_lg);
     htrace_conf_free(g_test_conf);
     return EXIT_SUCCESS;
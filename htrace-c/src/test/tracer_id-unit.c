@@ -46,7 +46,7 @@ static int test_calculate_tracer_id(const char *expected, const char *fmt)
 
 static int test_calculate_tracer_ids(void)
 {
-    char buf[128];
+    char buf[128], short_buf[4];
 
     EXPECT_INT_ZERO(test_calculate_tracer_id("my.name", "my.name"));
     EXPECT_INT_ZERO(test_calculate_tracer_id("my.fooproc", "my.%{tname}"));
@@ -58,7 +58,12 @@ static int test_calculate_tracer_ids(void)
     snprintf(buf, sizeof(buf), "me.%lld", (long long)getpid());
     EXPECT_INT_ZERO(test_calculate_tracer_id(buf, "me.%{pid}"));
 
+    // A short buffer gets a truncated address, without truncating the
+    // address which is cached for later callers.
+    get_best_ip(g_lg, short_buf, sizeof(short_buf));
     get_best_ip(g_lg, buf, sizeof(buf));
+    EXPECT_INT_ZERO(strncmp(buf, short_buf, sizeof(short_buf) - 1));
+    EXPECT_INT_EQ(1, (strlen(buf) >= 7));
     EXPECT_INT_ZERO(test_calculate_tracer_id(buf, "%{ip}"));
 
     return EXIT_SUCCESS;
@@ -0,0 +1,293 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "test/test.h"
+#include "util/tsd.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TSD_TEST_THREADS 8
+
+#define TSD_TEST_ROUNDS 50
+
+struct tsd_test_owner {
+    struct htrace_tsd tsd;
+    pthread_mutex_t lock;
+    int retired;
+
+    /**
+     * Nonzero if the retire callback should take its time.
+     */
+    int slow;
+
+    /**
+     * Set once a retire callback has started.
+     */
+    int started;
+
+    /**
+     * If non-NULL, the retire callback sets a value for this owner too, the
+     * way a batch hands its spans to a receiver with staging buffers.
+     */
+    struct tsd_test_owner *next;
+};
+
+struct tsd_test_val {
+    struct tsd_test_owner *owner;
+    int retired;
+};
+
+/**
+ * The values of the current test's threads.
+ */
+static struct tsd_test_val g_vals[TSD_TEST_THREADS];
+
+/**
+ * If non-NULL, each thread waits here after setting its value.
+ */
+static pthread_barrier_t *g_barrier;
+
+static void tsd_test_set(struct tsd_test_owner *owner,
+                         struct tsd_test_val *val);
+
+static void tsd_test_retire(void *data)
+{
+    struct tsd_test_val *val = data;
+    struct tsd_test_owner *owner = val->owner;
+
+    __atomic_store_n(&owner->started, 1, __ATOMIC_RELEASE);
+    if (owner->slow) {
+        usleep(100000);
+    }
+    pthread_mutex_lock(&owner->lock);
+    owner->retired++;
+    pthread_mutex_unlock(&owner->lock);
+    val->retired++;
+    if (owner->next) {
+        tsd_test_set(owner->next, val + 1);
+    }
+}
+
+static void tsd_test_set(struct tsd_test_owner *owner,
+                         struct tsd_test_val *val)
+{
+    val->owner = owner;
+    if ((htrace_tsd_get(&owner->tsd) != NULL) ||
+            htrace_tsd_set(&owner->tsd, val) ||
+            (htrace_tsd_get(&owner->tsd) != val)) {
+        abort();
+    }
+}
+
+static struct tsd_test_owner *tsd_test_owner_alloc(int slow)
+{
+    struct tsd_test_owner *owner;
+
+    owner = calloc(1, sizeof(*owner));
+    if ((!owner) || pthread_mutex_init(&owner->lock, NULL) ||
+            htrace_tsd_init(&owner->tsd, tsd_test_retire)) {
+        abort();
+    }
+    owner->slow = slow;
+    return owner;
+}
+
+static void tsd_test_owner_free(struct tsd_test_owner *owner)
+{
+    pthread_mutex_destroy(&owner->lock);
+    memset(owner, 0xff, sizeof(*owner));
+    free(owner);
+}
+
+static void *tsd_test_run_thread(void *data)
+{
+    struct tsd_test_val *val = data;
+
+    tsd_test_set(val->owner, val);
+    if (g_barrier) {
+        pthread_barrier_wait(g_barrier);
+    }
+    return NULL;
+}
+
+/**
+ * Start one thread per value.  Each sets its value for the value's owner,
+ * and exits.
+ */
+static int tsd_test_start(pthread_t *threads, struct tsd_test_val *vals,
+                          int num)
+{
+    int i;
+
+    for (i = 0; i < num; i++) {
+        EXPECT_INT_ZERO(pthread_create(&threads[i], NULL,
+                                       tsd_test_run_thread, &vals[i]));
+    }
+    return EXIT_SUCCESS;
+}
+
+static int tsd_test_join(pthread_t *threads, int num)
+{
+    int i;
+
+    for (i = 0; i < num; i++) {
+        EXPECT_INT_ZERO(pthread_join(threads[i], NULL));
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Each thread's value is retired when it exits.
+ */
+static int test_tsd_retire(void)
+{
+    struct tsd_test_owner *owner = tsd_test_owner_alloc(0);
+    pthread_t threads[TSD_TEST_THREADS];
+    int i;
+
+    memset(g_vals, 0, sizeof(g_vals));
+    for (i = 0; i < TSD_TEST_THREADS; i++) {
+        g_vals[i].owner = owner;
+    }
+    EXPECT_INT_ZERO(tsd_test_start(threads, g_vals, TSD_TEST_THREADS));
+    EXPECT_INT_ZERO(tsd_test_join(threads, TSD_TEST_THREADS));
+    EXPECT_INT_EQ(TSD_TEST_THREADS, owner->retired);
+    for (i = 0; i < TSD_TEST_THREADS; i++) {
+        EXPECT_INT_EQ(1, g_vals[i].retired);
+    }
+    htrace_tsd_destroy(&owner->tsd);
+    tsd_test_owner_free(owner);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * A value set by a retire callback is retired too.
+ */
+static int test_tsd_retire_sets(void)
+{
+    struct tsd_test_owner *first = tsd_test_owner_alloc(0);
+    struct tsd_test_owner *second = tsd_test_owner_alloc(0);
+    pthread_t thread;
+
+    memset(g_vals, 0, sizeof(g_vals));
+    first->next = second;
+    g_vals[0].owner = first;
+    EXPECT_INT_ZERO(tsd_test_start(&thread, g_vals, 1));
+    EXPECT_INT_ZERO(tsd_test_join(&thread, 1));
+    EXPECT_INT_EQ(1, first->retired);
+    EXPECT_INT_EQ(1, second->retired);
+    EXPECT_INT_EQ(1, g_vals[1].retired);
+    htrace_tsd_destroy(&second->tsd);
+    htrace_tsd_destroy(&first->tsd);
+    tsd_test_owner_free(second);
+    tsd_test_owner_free(first);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * The current thread's value is not retired once its owner is destroyed.
+ */
+static int test_tsd_destroy_own(void)
+{
+    struct tsd_test_owner *owner = tsd_test_owner_alloc(0);
+    struct tsd_test_val val;
+
+    memset(&val, 0, sizeof(val));
+    tsd_test_set(owner, &val);
+    htrace_tsd_destroy(&owner->tsd);
+    tsd_test_owner_free(owner);
+    owner = tsd_test_owner_alloc(0);
+    EXPECT_NULL(htrace_tsd_get(&owner->tsd));
+    htrace_tsd_destroy(&owner->tsd);
+    tsd_test_owner_free(owner);
+    EXPECT_INT_ZERO(val.retired);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Destroying the owner waits for a retire callback which has started.
+ */
+static int test_tsd_destroy_waits(void)
+{
+    struct tsd_test_owner *owner = tsd_test_owner_alloc(1);
+    pthread_t thread;
+
+    memset(g_vals, 0, sizeof(g_vals));
+    g_vals[0].owner = owner;
+    EXPECT_INT_ZERO(tsd_test_start(&thread, g_vals, 1));
+    while (!__atomic_load_n(&owner->started, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+    htrace_tsd_destroy(&owner->tsd);
+    EXPECT_INT_EQ(1, owner->retired);
+    tsd_test_owner_free(owner);
+    EXPECT_INT_ZERO(tsd_test_join(&thread, 1));
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Threads may exit while their values' owner is destroyed and freed.  Each
+ * value is retired at most once, and never after the owner is gone.
+ */
+static int test_tsd_destroy_races_exit(void)
+{
+    struct tsd_test_owner *owner;
+    pthread_t threads[TSD_TEST_THREADS];
+    pthread_barrier_t barrier;
+    int i, round;
+
+    EXPECT_INT_ZERO(pthread_barrier_init(&barrier, NULL,
+                                         TSD_TEST_THREADS + 1));
+    g_barrier = &barrier;
+    for (round = 0; round < TSD_TEST_ROUNDS; round++) {
+        owner = tsd_test_owner_alloc(0);
+        memset(g_vals, 0, sizeof(g_vals));
+        for (i = 0; i < TSD_TEST_THREADS; i++) {
+            g_vals[i].owner = owner;
+        }
+        EXPECT_INT_ZERO(tsd_test_start(threads, g_vals, TSD_TEST_THREADS));
+        pthread_barrier_wait(&barrier);
+        usleep(round * 10);
+        htrace_tsd_destroy(&owner->tsd);
+        tsd_test_owner_free(owner);
+        EXPECT_INT_ZERO(tsd_test_join(threads, TSD_TEST_THREADS));
+        for (i = 0; i < TSD_TEST_THREADS; i++) {
+            EXPECT_INT_GE(0, g_vals[i].retired);
+            EXPECT_INT_GE(g_vals[i].retired, 1);
+        }
+    }
+    g_barrier = NULL;
+    pthread_barrier_destroy(&barrier);
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    EXPECT_INT_ZERO(test_tsd_retire());
+    EXPECT_INT_ZERO(test_tsd_retire_sets());
+    EXPECT_INT_ZERO(test_tsd_destroy_own());
+    EXPECT_INT_ZERO(test_tsd_destroy_waits());
+    EXPECT_INT_ZERO(test_tsd_destroy_races_exit());
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
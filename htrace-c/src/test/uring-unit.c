@@ -0,0 +1,143 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "core/conf.h"
+#include "test/test.h"
+#include "util/log.h"
+#include "util/uring.h"
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static struct htrace_log *g_lg;
+
+static void prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                         struct msghdr *msg, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+static int test_uring_sendmsg(struct uring *ring)
+{
+    char buf[32];
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct io_uring_sqe *sqe;
+    uint64_t user_data = 0;
+    int32_t res = 0;
+    int fds[2];
+
+    EXPECT_INT_ZERO(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    EXPECT_INT_ZERO(uring_peek_cqe(ring, &user_data, &res));
+    iov[0].iov_base = "hello, ";
+    iov[0].iov_len = strlen("hello, ");
+    iov[1].iov_base = "uring";
+    iov[1].iov_len = strlen("uring");
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    sqe = uring_get_sqe(ring);
+    EXPECT_NONNULL(sqe);
+    prep_sendmsg(sqe, fds[0], &msg, 123);
+    EXPECT_INT_ZERO(uring_submit(ring, 1));
+    EXPECT_INT_EQ(1, uring_peek_cqe(ring, &user_data, &res));
+    EXPECT_UINT64_EQ((uint64_t)123, user_data);
+    EXPECT_INT_EQ(12, res);
+    EXPECT_INT_ZERO(uring_peek_cqe(ring, &user_data, &res));
+    memset(buf, 0, sizeof(buf));
+    EXPECT_INT_EQ(12, (int)read(fds[1], buf, sizeof(buf)));
+    EXPECT_STR_EQ("hello, uring", buf);
+
+    // Errors come back in the completion.
+    close(fds[1]);
+    sqe = uring_get_sqe(ring);
+    EXPECT_NONNULL(sqe);
+    prep_sendmsg(sqe, fds[0], &msg, 456);
+    EXPECT_INT_ZERO(uring_submit(ring, 1));
+    EXPECT_INT_EQ(1, uring_peek_cqe(ring, &user_data, &res));
+    EXPECT_UINT64_EQ((uint64_t)456, user_data);
+    EXPECT_INT_EQ(1, res < 0);
+    close(fds[0]);
+    return EXIT_SUCCESS;
+}
+
+static int test_uring_full(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    uint64_t user_data = 0;
+    int32_t res = 0;
+    int i;
+
+    // Fill the submission queue with no-ops.  We asked for 4 entries, which
+    // is already a power of two, so the kernel gave us exactly that many.
+    for (i = 0; i < 4; i++) {
+        sqe = uring_get_sqe(ring);
+        EXPECT_NONNULL(sqe);
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = i;
+    }
+    EXPECT_NULL(uring_get_sqe(ring));
+    EXPECT_INT_ZERO(uring_submit(ring, 4));
+    for (i = 0; i < 4; i++) {
+        EXPECT_INT_EQ(1, uring_peek_cqe(ring, &user_data, &res));
+        EXPECT_UINT64_EQ((uint64_t)i, user_data);
+        EXPECT_INT_ZERO(res);
+    }
+    EXPECT_INT_ZERO(uring_peek_cqe(ring, &user_data, &res));
+    EXPECT_NONNULL(uring_get_sqe(ring));
+    EXPECT_INT_ZERO(uring_submit(ring, 1));
+    EXPECT_INT_EQ(1, uring_peek_cqe(ring, &user_data, &res));
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    struct htrace_conf *cnf;
+    struct uring *ring;
+
+    cnf = htrace_conf_from_strs("", "");
+    EXPECT_NONNULL(cnf);
+    g_lg = htrace_log_alloc(cnf);
+    EXPECT_NONNULL(g_lg);
+    ring = uring_create(g_lg, 4);
+    if (!ring) {
+        // The kernel may not have io_uring, or it may be switched off.
+        fprintf(stderr, "io_uring is not available.  Skipping.\n");
+    } else {
+        EXPECT_INT_ZERO(test_uring_sendmsg(ring));
+        EXPECT_INT_ZERO(test_uring_full(ring));
+        uring_free(ring);
+    }
+    htrace_log_free(g_lg);
+    htrace_conf_free(cnf);
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=79:et
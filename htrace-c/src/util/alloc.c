@@ -0,0 +1,102 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/htrace.h"
+#include "util/alloc.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @file alloc.c
+ *
+ * Implements the pluggable allocator.
+ */
+
+const struct htrace_allocator *htrace_g_alloc;
+
+/**
+ * The copy of the allocator which htrace_g_alloc points to.
+ */
+static struct htrace_allocator g_alloc;
+
+int htrace_set_allocator(const struct htrace_allocator *alloc)
+{
+    if (!alloc) {
+        htrace_g_alloc = NULL;
+        return 0;
+    }
+    if ((!alloc->malloc_fn) || (!alloc->realloc_fn) ||
+            (!alloc->aligned_fn) || (!alloc->free_fn)) {
+        return EINVAL;
+    }
+    g_alloc = *alloc;
+    htrace_g_alloc = &g_alloc;
+    return 0;
+}
+
+int htrace_memalign(void **out, size_t align, size_t size)
+{
+    const struct htrace_allocator *a = htrace_g_alloc;
+
+    if (!a) {
+        return posix_memalign(out, align, size) ? ENOMEM : 0;
+    }
+    *out = a->aligned_fn(align, size, a->ctx);
+    return *out ? 0 : ENOMEM;
+}
+
+char *htrace_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *dup;
+
+    dup = htrace_malloc(len);
+    if (dup) {
+        memcpy(dup, str, len);
+    }
+    return dup;
+}
+
+int htrace_asprintf(char **out, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+    char *str;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        return -1;
+    }
+    str = htrace_malloc(len + 1);
+    if (!str) {
+        return -1;
+    }
+    va_start(ap, fmt);
+    vsnprintf(str, len + 1, fmt, ap);
+    va_end(ap);
+    *out = str;
+    return len;
+}
+
+// vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,123 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_UTIL_ALLOC_H
+#define APACHE_HTRACE_UTIL_ALLOC_H
+
+#include "core/htrace.h"
+
+#include <stdint.h> /* for SIZE_MAX */
+#include <stdlib.h> /* for malloc, etc. */
+#include <string.h> /* for memset */
+
+/**
+ * @file alloc.h
+ *
+ * Memory allocation functions which go through the allocator set with
+ * htrace_set_allocator.  All library code must use these instead of calling
+ * malloc, free, and friends directly.  Memory which libc or another library
+ * allocates for us must still be released by the function it documents.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+/**
+ * The allocator set with htrace_set_allocator, or NULL to use libc.
+ */
+extern const struct htrace_allocator *htrace_g_alloc;
+
+static inline void *htrace_malloc(size_t size)
+{
+    const struct htrace_allocator *a = htrace_g_alloc;
+
+    if (!a) {
+        return malloc(size);
+    }
+    return a->malloc_fn(size, a->ctx);
+}
+
+static inline void *htrace_calloc(size_t nmemb, size_t size)
+{
+    const struct htrace_allocator *a = htrace_g_alloc;
+    void *ptr;
+
+    if (!a) {
+        return calloc(nmemb, size);
+    }
+    if (size && (nmemb > SIZE_MAX / size)) {
+        return NULL;
+    }
+    ptr = a->malloc_fn(nmemb * size, a->ctx);
+    if (ptr) {
+        memset(ptr, 0, nmemb * size);
+    }
+    return ptr;
+}
+
+static inline void *htrace_realloc(void *ptr, size_t size)
+{
+    const struct htrace_allocator *a = htrace_g_alloc;
+
+    if (!a) {
+        return realloc(ptr, size);
+    }
+    return a->realloc_fn(ptr, size, a->ctx);
+}
+
+static inline void htrace_free(void *ptr)
+{
+    const struct htrace_allocator *a = htrace_g_alloc;
+
+    if (!a) {
+        free(ptr);
+        return;
+    }
+    a->free_fn(ptr, a->ctx);
+}
+
+/**
+ * Allocate aligned memory, like posix_memalign.
+ *
+ * @param out           (out param) The memory on success.
+ * @param align         The alignment.  A power of two, and a multiple of
+ *                          sizeof(void*).
+ * @param size          The number of bytes to allocate.
+ *
+ * @return              0 on success; ENOMEM if we ran out of memory.
+ */
+int htrace_memalign(void **out, size_t align, size_t size);
+
+/**
+ * Duplicate a string, like strdup.
+ */
+char *htrace_strdup(const char *str);
+
+/**
+ * Print to a newly allocated string, like asprintf.
+ *
+ * @param out           (out param) The string on success.
+ * @param fmt           Printf-style format string.
+ *
+ * @return              The length of the string on success; -1 on error.
+ */
+int htrace_asprintf(char **out, const char *fmt, ...)
+      __attribute__((format(printf, 2, 3)));
+
+#endif
+
+// vim: ts=4:sw=4:tw=79:et
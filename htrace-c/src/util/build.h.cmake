@@ -20,4 +20,16 @@
 
 #cmakedefine HAVE_IMPROVED_TLS
 
+#cmakedefine HAVE_SENDMMSG
+
+#cmakedefine HAVE_IO_URING
+
+#cmakedefine HAVE_GETRANDOM
+
+#cmakedefine HAVE_SCHED_GETCPU
+
+#cmakedefine HAVE_ZLIB
+
+#cmakedefine HAVE_USDT
+
 #endif
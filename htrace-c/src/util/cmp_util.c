@@ -49,7 +49,9 @@ static size_t cmp_bcopy_write_fn(struct cmp_ctx_s *c, const void *data,
 
     rem = ctx->len - o;
     if (rem < count) {
-        count = rem;
+        // CMP treats any nonzero return as success, so we can't do a short
+        // write here.  Fail without writing anything.
+        return 0;
     }
     memcpy(((uint8_t*)ctx->base.buf) + o, data, count);
     ctx->off = o + count;
@@ -69,15 +71,16 @@ size_t cmp_bcopy_write_nocheck_fn(struct cmp_ctx_s *c, const void *data,
 static int cmp_bcopy_reader(struct cmp_ctx_s *c, void *data, size_t limit)
 {
     struct cmp_bcopy_ctx *ctx = (struct cmp_bcopy_ctx *)c;
-    size_t count, o = ctx->off;
+    size_t o = ctx->off;
 
-    count = ctx->len - o;
-    if (count > limit) {
-        count = limit;
+    if (ctx->len - o < limit) {
+        // CMP always asks for exactly what it needs, and treats any nonzero
+        // return as success, so a short read must fail.
+        return 0;
     }
-    memcpy(data, ((uint8_t*)ctx->base.buf) + o, count);
-    ctx->off = o + count;
-    return count;
+    memcpy(data, ((uint8_t*)ctx->base.buf) + o, limit);
+    ctx->off = o + limit;
+    return limit;
 }
 
 void cmp_bcopy_ctx_init(struct cmp_bcopy_ctx *ctx, void *buf, uint64_t len)
@@ -87,4 +90,60 @@ void cmp_bcopy_ctx_init(struct cmp_bcopy_ctx *ctx, void *buf, uint64_t len)
     ctx->len = len;
 }
 
+int cmp_bcopy_skip_object(struct cmp_bcopy_ctx *ctx)
+{
+    cmp_object_t obj;
+    uint64_t payload, remaining = 1;
+
+    // Rather than recursing into maps and arrays, keep count of how many
+    // objects are left to skip.
+    while (remaining > 0) {
+        remaining--;
+        if (!cmp_read_object(&ctx->base, &obj)) {
+            return 0;
+        }
+        payload = 0;
+        switch (obj.type) {
+        case CMP_TYPE_FIXMAP:
+        case CMP_TYPE_MAP16:
+        case CMP_TYPE_MAP32:
+            remaining += 2ULL * obj.as.map_size;
+            break;
+        case CMP_TYPE_FIXARRAY:
+        case CMP_TYPE_ARRAY16:
+        case CMP_TYPE_ARRAY32:
+            remaining += obj.as.array_size;
+            break;
+        case CMP_TYPE_FIXSTR:
+        case CMP_TYPE_STR8:
+        case CMP_TYPE_STR16:
+        case CMP_TYPE_STR32:
+            payload = obj.as.str_size;
+            break;
+        case CMP_TYPE_BIN8:
+        case CMP_TYPE_BIN16:
+        case CMP_TYPE_BIN32:
+            payload = obj.as.bin_size;
+            break;
+        case CMP_TYPE_EXT8:
+        case CMP_TYPE_EXT16:
+        case CMP_TYPE_EXT32:
+        case CMP_TYPE_FIXEXT1:
+        case CMP_TYPE_FIXEXT2:
+        case CMP_TYPE_FIXEXT4:
+        case CMP_TYPE_FIXEXT8:
+        case CMP_TYPE_FIXEXT16:
+            payload = obj.as.ext.size;
+            break;
+        default:
+            break;
+        }
+        if (payload > ctx->len - ctx->off) {
+            return 0;
+        }
+        ctx->off += payload;
+    }
+    return 1;
+}
+
 // vim:ts=4:sw=4:et
@@ -71,6 +71,17 @@ void cmp_bcopy_ctx_init(struct cmp_bcopy_ctx *ctx, void *buf, uint64_t len);
 size_t cmp_bcopy_write_nocheck_fn(struct cmp_ctx_s *c, const void *data,
                                   size_t count);
 
+/**
+ * Skip over the next msgpack object in a CMP bcopy ctx, including everything
+ * nested inside it.
+ *
+ * @param ctx           The context to read from.
+ *
+ * @return              1 on success; 0 if the object is malformed, or runs
+ *                          past the end of the buffer.
+ */
+int cmp_bcopy_skip_object(struct cmp_bcopy_ctx *ctx);
+
 #endif
 
 // vim: ts=4:sw=4:tw=79:et
@@ -0,0 +1,122 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/fork.h"
+
+#include <pthread.h>
+#include <stddef.h>
+
+static pthread_once_t g_fork_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Protects g_fork_hooks.  Held from the prepare handler until the parent or
+ * child handler, so hooks can't come or go while we are forking.
+ */
+static pthread_mutex_t g_fork_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The registered hooks, most recently registered first.
+ */
+static struct htrace_fork_hook *g_fork_hooks;
+
+static void htrace_fork_prepare(void)
+{
+    struct htrace_fork_hook *hook;
+
+    pthread_mutex_lock(&g_fork_lock);
+    for (hook = g_fork_hooks; hook; hook = hook->next) {
+        if (hook->prepare) {
+            hook->prepare(hook->data);
+        }
+    }
+}
+
+/**
+ * Find the oldest hook, so that we can undo the prepare callbacks in the
+ * opposite order.
+ */
+static struct htrace_fork_hook *htrace_fork_oldest(void)
+{
+    struct htrace_fork_hook *hook = g_fork_hooks;
+
+    while (hook && hook->next) {
+        hook = hook->next;
+    }
+    return hook;
+}
+
+static void htrace_fork_parent(void)
+{
+    struct htrace_fork_hook *hook;
+
+    for (hook = htrace_fork_oldest(); hook; hook = hook->prev) {
+        if (hook->parent) {
+            hook->parent(hook->data);
+        }
+    }
+    pthread_mutex_unlock(&g_fork_lock);
+}
+
+static void htrace_fork_child(void)
+{
+    struct htrace_fork_hook *hook;
+
+    for (hook = htrace_fork_oldest(); hook; hook = hook->prev) {
+        if (hook->child) {
+            hook->child(hook->data);
+        }
+    }
+    pthread_mutex_unlock(&g_fork_lock);
+}
+
+static void htrace_fork_init(void)
+{
+    pthread_atfork(htrace_fork_prepare, htrace_fork_parent,
+                   htrace_fork_child);
+}
+
+void htrace_fork_hook_register(struct htrace_fork_hook *hook)
+{
+    pthread_once(&g_fork_once, htrace_fork_init);
+    pthread_mutex_lock(&g_fork_lock);
+    hook->prev = NULL;
+    hook->next = g_fork_hooks;
+    if (g_fork_hooks) {
+        g_fork_hooks->prev = hook;
+    }
+    g_fork_hooks = hook;
+    pthread_mutex_unlock(&g_fork_lock);
+}
+
+void htrace_fork_hook_unregister(struct htrace_fork_hook *hook)
+{
+    pthread_mutex_lock(&g_fork_lock);
+    if (hook->prev) {
+        hook->prev->next = hook->next;
+    } else {
+        g_fork_hooks = hook->next;
+    }
+    if (hook->next) {
+        hook->next->prev = hook->prev;
+    }
+    hook->next = NULL;
+    hook->prev = NULL;
+    pthread_mutex_unlock(&g_fork_lock);
+}
+
+// vim: ts=4:sw=4:tw=79:et
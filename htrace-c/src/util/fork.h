@@ -0,0 +1,90 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_UTIL_FORK_H
+#define APACHE_HTRACE_UTIL_FORK_H
+
+/**
+ * @file fork.h
+ *
+ * Hooks which keep our locks and threads consistent across fork.
+ *
+ * Only the thread which called fork exists in the child.  Any lock held by
+ * another thread at the time stays locked forever, and any background
+ * thread is simply gone.  Objects which own locks or threads register a hook
+ * here.  The prepare callback takes their locks before fork, and the parent
+ * and child callbacks release them afterwards.  The child callback runs
+ * before any other thread exists in the child, so it can reset state
+ * without locking, but it should leave slow work, such as starting threads,
+ * until the object is next used.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+/**
+ * A fork hook.  The callbacks may be NULL.
+ */
+struct htrace_fork_hook {
+    /**
+     * Called in the parent before fork.  Hooks are prepared in the reverse
+     * of the order they were registered in, so that an object created after
+     * another one may hold its own lock while taking the other's.
+     */
+    void (*prepare)(void *data);
+
+    /**
+     * Called in the parent after fork.
+     */
+    void (*parent)(void *data);
+
+    /**
+     * Called in the child after fork.
+     */
+    void (*child)(void *data);
+
+    /**
+     * The argument to pass to the callbacks.
+     */
+    void *data;
+
+    /**
+     * The next and previous hooks.  Protected by the fork hook lock.
+     */
+    struct htrace_fork_hook *next;
+    struct htrace_fork_hook *prev;
+};
+
+/**
+ * Register a fork hook.
+ *
+ * @param hook          The hook.  It must stay valid until it is
+ *                          unregistered.
+ */
+void htrace_fork_hook_register(struct htrace_fork_hook *hook);
+
+/**
+ * Unregister a fork hook.  Once this returns, the callbacks won't be called
+ * again.
+ *
+ * @param hook          The hook.
+ */
+void htrace_fork_hook_unregister(struct htrace_fork_hook *hook);
+
+#endif
+
+// vim: ts=4:sw=4:et
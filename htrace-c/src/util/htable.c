@@ -16,6 +16,7 @@
  * limitations under the License.
  */
 
+#include "util/alloc.h"
 #include "util/htable.h"
 
 #include <errno.h>
@@ -27,76 +28,158 @@
 /**
  * @file htable.c
  *
- * Implements a hash table that uses probing.
+ * Implements a hash table that uses Robin Hood probing.
+ *
+ * Each entry's hash is kept in an array of its own, so that a lookup scans
+ * 4-byte hashes and only calls the equality function, and touches the key,
+ * when a whole hash matches.  Robin Hood insertion keeps every entry close
+ * to its home slot: an entry being inserted takes the place of any entry
+ * which is nearer to its own home, which then moves on instead.  So a lookup
+ * can stop as soon as it reaches an entry nearer to home than it would be
+ * itself.  Removal shifts the rest of the run back by one slot, so there are
+ * no tombstones and nothing is rehashed.
  */
 
+/**
+ * Set in every stored hash, so that 0 means an empty slot.
+ */
+#define HTABLE_OCCUPIED 0x80000000U
+
 struct htable_pair {
     void *key;
     void *val;
 };
 
 /**
- * A hash table which uses linear probing.
+ * A hash table which uses Robin Hood probing.
  */
 struct htable {
     uint32_t capacity;
     uint32_t used;
+
+    /**
+     * 32 minus the base 2 log of the capacity.
+     */
+    uint32_t shift;
     htable_hash_fn_t hash_fun;
     htable_eq_fn_t eq_fun;
+
+    /**
+     * The hash of each slot's entry or'ed with HTABLE_OCCUPIED, or 0 if the
+     * slot is empty.
+     */
+    uint32_t *hashes;
     struct htable_pair *elem;
 };
 
+/**
+ * Get the stored form of a key's hash.
+ */
+static inline uint32_t htable_hash(const struct htable *htable,
+                                   const void *key)
+{
+    return htable->hash_fun(key, HTABLE_HASH_RANGE) | HTABLE_OCCUPIED;
+}
+
+/**
+ * Get the home slot of a stored hash.
+ *
+ * Multiplying by 2^32 divided by the golden ratio, and keeping the top
+ * bits, spreads out hashes which only differ in their upper bits.
+ */
+static inline uint32_t htable_home(uint32_t shift, uint32_t hash)
+{
+    return (uint32_t)(hash * 0x9e3779b9U) >> shift;
+}
+
+/**
+ * Get how far an entry with the given stored hash is from its home slot.
+ */
+static inline uint32_t htable_dist(uint32_t shift, uint32_t capacity,
+                                   uint32_t hash, uint32_t idx)
+{
+    return (idx - htable_home(shift, hash)) & (capacity - 1);
+}
+
 /**
  * An internal function for inserting a value into the hash table.
  *
  * Note: this function assumes that you have made enough space in the table.
  *
- * @param nelem         The new element to insert.
+ * @param hashes        The stored hashes of the hash table.
+ * @param elem          The slots of the hash table.
  * @param capacity      The capacity of the hash table.
- * @param hash_fun      The hash function to use.
+ * @param shift         The shift for the capacity.
+ * @param hash          The stored hash of the key.
  * @param key           The key to insert.
  * @param val           The value to insert.
  */
-static void htable_insert_internal(struct htable_pair *nelem,
-        uint32_t capacity, htable_hash_fn_t hash_fun, void *key,
-        void *val)
+static void htable_insert_internal(uint32_t *hashes,
+        struct htable_pair *elem, uint32_t capacity, uint32_t shift,
+        uint32_t hash, void *key, void *val)
 {
-    uint32_t i;
+    uint32_t i, dist, edist, thash;
+    void *tkey, *tval;
 
-    i = hash_fun(key, capacity);
+    i = htable_home(shift, hash);
+    dist = 0;
     while (1) {
-        if (!nelem[i].key) {
-            nelem[i].key = key;
-            nelem[i].val = val;
+        if (!hashes[i]) {
+            hashes[i] = hash;
+            elem[i].key = key;
+            elem[i].val = val;
             return;
         }
-        i++;
-        if (i == capacity) {
-            i = 0;
+        edist = htable_dist(shift, capacity, hashes[i], i);
+        if (edist < dist) {
+            // Take the slot from an entry which is nearer its home, and
+            // carry on inserting that entry instead.
+            thash = hashes[i];
+            tkey = elem[i].key;
+            tval = elem[i].val;
+            hashes[i] = hash;
+            elem[i].key = key;
+            elem[i].val = val;
+            hash = thash;
+            key = tkey;
+            val = tval;
+            dist = edist;
         }
+        i = (i + 1) & (capacity - 1);
+        dist++;
     }
 }
 
 static int htable_realloc(struct htable *htable, uint32_t new_capacity)
 {
     struct htable_pair *nelem;
-    uint32_t i, old_capacity = htable->capacity;
-    htable_hash_fn_t hash_fun = htable->hash_fun;
+    uint32_t *nhashes;
+    uint32_t i, nshift, old_capacity = htable->capacity;
 
-    nelem = calloc(new_capacity, sizeof(struct htable_pair));
+    nhashes = htrace_calloc(new_capacity, sizeof(uint32_t));
+    if (!nhashes) {
+        return ENOMEM;
+    }
+    nelem = htrace_calloc(new_capacity, sizeof(struct htable_pair));
     if (!nelem) {
+        htrace_free(nhashes);
         return ENOMEM;
     }
+    nshift = 32 - __builtin_ctz(new_capacity);
+    // The hashes are stored, so nothing needs to be rehashed.
     for (i = 0; i < old_capacity; i++) {
-        struct htable_pair *pair = htable->elem + i;
-        if (pair->key) {
-            htable_insert_internal(nelem, new_capacity, hash_fun,
-                                   pair->key, pair->val);
+        if (htable->hashes[i]) {
+            htable_insert_internal(nhashes, nelem, new_capacity, nshift,
+                                   htable->hashes[i], htable->elem[i].key,
+                                   htable->elem[i].val);
         }
     }
-    free(htable->elem);
+    htrace_free(htable->hashes);
+    htrace_free(htable->elem);
+    htable->hashes = nhashes;
     htable->elem = nelem;
     htable->capacity = new_capacity;
+    htable->shift = nshift;
     return 0;
 }
 
@@ -117,10 +200,13 @@ struct htable *htable_alloc(uint32_t size,
 {
     struct htable *htable;
 
-    htable = calloc(1, sizeof(*htable));
+    htable = htrace_calloc(1, sizeof(*htable));
     if (!htable) {
         return NULL;
     }
+    if (size > HTABLE_HASH_RANGE) {
+        size = HTABLE_HASH_RANGE;
+    }
     size = round_up_to_power_of_2(size);
     if (size < HTABLE_MIN_SIZE) {
         size = HTABLE_MIN_SIZE;
@@ -129,7 +215,7 @@ struct htable *htable_alloc(uint32_t size,
     htable->eq_fun = eq_fun;
     htable->used = 0;
     if (htable_realloc(htable, size)) {
-        free(htable);
+        htrace_free(htable);
         return NULL;
     }
     return htable;
@@ -140,8 +226,8 @@ void htable_visit(struct htable *htable, visitor_fn_t fun, void *ctx)
     uint32_t i;
 
     for (i = 0; i != htable->capacity; ++i) {
-        struct htable_pair *elem = htable->elem + i;
-        if (elem->key) {
+        if (htable->hashes[i]) {
+            struct htable_pair *elem = htable->elem + i;
             fun(ctx, elem->key, elem->val);
         }
     }
@@ -150,8 +236,9 @@ void htable_visit(struct htable *htable, visitor_fn_t fun, void *ctx)
 void htable_free(struct htable *htable)
 {
     if (htable) {
-        free(htable->elem);
-        free(htable);
+        htrace_free(htable->hashes);
+        htrace_free(htable->elem);
+        htrace_free(htable);
     }
 }
 
@@ -161,8 +248,6 @@ int htable_put(struct htable *htable, void *key, void *val)
     uint32_t nused;
 
     // NULL is not a valid key value.
-    // This helps us implement htable_get_internal efficiently, since we know
-    // that we can stop when we encounter the first NULL key.
     if (!key) {
         return EINVAL;
     }
@@ -175,12 +260,15 @@ int htable_put(struct htable *htable, void *key, void *val)
     // Re-hash if we have used more than half of the hash table
     nused = htable->used + 1;
     if (nused >= (htable->capacity / 2)) {
+        if (htable->capacity >= HTABLE_HASH_RANGE) {
+            return EFBIG;
+        }
         ret = htable_realloc(htable, htable->capacity * 2);
         if (ret)
             return ret;
     }
-    htable_insert_internal(htable->elem, htable->capacity,
-                                htable->hash_fun, key, val);
+    htable_insert_internal(htable->hashes, htable->elem, htable->capacity,
+                           htable->shift, htable_hash(htable, key), key, val);
     htable->used++;
     return 0;
 }
@@ -188,28 +276,23 @@ int htable_put(struct htable *htable, void *key, void *val)
 static int htable_get_internal(const struct htable *htable,
                                const void *key, uint32_t *out)
 {
-    uint32_t start_idx, idx;
+    uint32_t hash, idx, dist, shash;
+    uint32_t capacity = htable->capacity, shift = htable->shift;
 
-    start_idx = htable->hash_fun(key, htable->capacity);
-    idx = start_idx;
-    while (1) {
-        struct htable_pair *pair = htable->elem + idx;
-        if (!pair->key) {
-            // We always maintain the invariant that the entries corresponding
-            // to a given key are stored in a contiguous block, not separated
-            // by any NULLs.  So if we encounter a NULL, our search is over.
+    hash = htable_hash(htable, key);
+    idx = htable_home(shift, hash);
+    for (dist = 0; ; dist++) {
+        shash = htable->hashes[idx];
+        // An entry for this key would have displaced any entry nearer to
+        // its home, so if we reach one, or an empty slot, we are done.
+        if ((!shash) || (htable_dist(shift, capacity, shash, idx) < dist)) {
             return ENOENT;
-        } else if (htable->eq_fun(pair->key, key)) {
+        }
+        if ((shash == hash) && htable->eq_fun(htable->elem[idx].key, key)) {
             *out = idx;
             return 0;
         }
-        idx++;
-        if (idx == htable->capacity) {
-            idx = 0;
-        }
-        if (idx == start_idx) {
-            return ENOENT;
-        }
+        idx = (idx + 1) & (capacity - 1);
     }
 }
 
@@ -226,38 +309,31 @@ void *htable_get(const struct htable *htable, const void *key)
 void htable_pop(struct htable *htable, const void *key,
                 void **found_key, void **found_val)
 {
-    uint32_t hole, i;
-    const void *nkey;
+    uint32_t hole, i, shash;
+    uint32_t capacity = htable->capacity, shift = htable->shift;
 
     if (htable_get_internal(htable, key, &hole)) {
         *found_key = NULL;
         *found_val = NULL;
         return;
     }
-    i = hole;
     htable->used--;
-    // We need to maintain the compactness invariant used in
-    // htable_get_internal.  This invariant specifies that the entries for any
-    // given key are never separated by NULLs (although they may be separated
-    // by entries for other keys.)
+    *found_key = htable->elem[hole].key;
+    *found_val = htable->elem[hole].val;
+    // Shift back every later entry in the run which isn't in its home slot.
     while (1) {
-        i++;
-        if (i == htable->capacity) {
-            i = 0;
-        }
-        nkey = htable->elem[i].key;
-        if (!nkey) {
-            *found_key = htable->elem[hole].key;
-            *found_val = htable->elem[hole].val;
-            htable->elem[hole].key = NULL;
-            htable->elem[hole].val = NULL;
-            return;
-        } else if (htable->eq_fun(key, nkey)) {
-            htable->elem[hole].key = htable->elem[i].key;
-            htable->elem[hole].val = htable->elem[i].val;
-            hole = i;
+        i = (hole + 1) & (capacity - 1);
+        shash = htable->hashes[i];
+        if ((!shash) || (htable_dist(shift, capacity, shash, i) == 0)) {
+            break;
         }
+        htable->hashes[hole] = shash;
+        htable->elem[hole] = htable->elem[i];
+        hole = i;
     }
+    htable->hashes[hole] = 0;
+    htable->elem[hole].key = NULL;
+    htable->elem[hole].val = NULL;
 }
 
 uint32_t htable_used(const struct htable *htable)
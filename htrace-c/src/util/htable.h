@@ -22,7 +22,7 @@
 /**
  * @file htable.h
  *
- * Interfaces for a hash table that uses probing.
+ * Interfaces for a hash table that uses Robin Hood probing.
  *
  * This is an internal header, not intended for external use.
  */
@@ -33,15 +33,25 @@
 
 #define HTABLE_MIN_SIZE 4
 
+/**
+ * The range of hash values which the hash table asks for.
+ */
+#define HTABLE_HASH_RANGE 0x80000000U
+
 struct htable;
 
 /**
  * An HTable hash function.
  *
+ * The hash table calls this once per operation, always with a capacity of
+ * HTABLE_HASH_RANGE, and keeps the result next to the entry.  It then picks
+ * the slot itself, so the hash doesn't need to be well mixed, and it is
+ * never called again for an entry which is already in the table.
+ *
  * @param key       The key.
- * @param capacity  The total capacity.
+ * @param capacity  The number of hash values.
  *
- * @return          The hash slot.  Must be less than the capacity.
+ * @return          The hash.  Must be less than the capacity.
  */
 typedef uint32_t (*htable_hash_fn_t)(const void *key, uint32_t capacity);
 
@@ -18,21 +18,99 @@
 
 #include "core/conf.h"
 #include "core/htrace.h"
+#include "util/alloc.h"
+#include "util/fork.h"
 #include "util/log.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+/**
+ * @file log.c
+ *
+ * The htrace client log.
+ *
+ * An asynchronous log has a bounded multi-producer, single-consumer queue of
+ * formatted messages, and a writer thread which takes them off the queue
+ * and writes them out.  Producers never take a lock: they format the message
+ * into a heap buffer, claim a slot with a compare-and-swap, and wake the
+ * writer with a trylock if it is sleeping.  If the trylock fails, the
+ * writer will notice the message within HTRACE_LOG_WRITER_POLL_MS anyway.
+ *
+ * A forked child has no writer thread, so it forgets the queue and starts a
+ * new writer the first time it logs something.
+ */
+
+/**
+ * The number of slots in an asynchronous log's queue.  Must be a power of 2.
+ */
+#define HTRACE_LOG_QUEUE_LEN 1024
+
+/**
+ * The longest that the writer thread sleeps before looking at the queue
+ * again.
+ */
+#define HTRACE_LOG_WRITER_POLL_MS 100
+
+/**
+ * The states of a log.
+ */
+enum htrace_log_state {
+    /**
+     * Messages are written by the threads which log them.
+     */
+    HTRACE_LOG_STATE_SYNC = 0,
+
+    /**
+     * The log is asynchronous, but nothing has been logged yet, so the
+     * writer thread has not been started.
+     */
+    HTRACE_LOG_STATE_IDLE,
+
+    /**
+     * Some thread is starting the writer thread.
+     */
+    HTRACE_LOG_STATE_STARTING,
+
+    /**
+     * The writer thread is running.
+     */
+    HTRACE_LOG_STATE_RUNNING,
+};
+
+struct htrace_log_slot {
+    /**
+     * The sequence number of this slot.  The slot holds a message when this
+     * is one more than the queue position it was claimed at.
+     */
+    uint64_t seq;
+
+    /**
+     * The message, which the consumer frees.
+     */
+    char *msg;
+};
 
 struct htrace_log {
     /**
-     * The lock which protects this log from concurrent writes.
+     * The lock which protects this log from concurrent writes.  The writer
+     * thread also sleeps on cond with it.
      */
     pthread_mutex_t lock;
 
+    /**
+     * Condition variable used to wake the writer thread.
+     */
+    pthread_cond_t cond;
+
     /**
      * The log file.
      */
@@ -42,21 +120,183 @@ struct htrace_log {
      * Nonzero if we should close this file when closing the log.
      */
     int should_close;
+
+    /**
+     * The least severe enum htrace_log_level to write.
+     */
+    int level;
+
+    /**
+     * See HTRACE_LOG_RATELIMIT_MS_KEY.
+     */
+    uint64_t ratelimit_ms;
+
+    /**
+     * An enum htrace_log_state.  Accessed atomically.
+     */
+    int state;
+
+    /**
+     * Nonzero while the writer thread is waiting on cond.  Accessed
+     * atomically.
+     */
+    int sleeping;
+
+    /**
+     * Nonzero when the writer thread should exit.  Protected by lock.
+     */
+    int shutdown;
+
+    /**
+     * The writer thread.  Valid in HTRACE_LOG_STATE_RUNNING.
+     */
+    pthread_t thread;
+
+    /**
+     * The next queue position to be claimed by a producer.
+     */
+    uint64_t head;
+
+    /**
+     * The next queue position to be consumed.  Only used by the consumer.
+     */
+    uint64_t tail;
+
+    /**
+     * The number of messages dropped because the queue was full, or because
+     * we couldn't allocate memory for them.
+     */
+    uint64_t dropped;
+
+    /**
+     * Resets the queue and the writer thread in a forked child.
+     */
+    struct htrace_fork_hook fork_hook;
+
+    struct htrace_log_slot slots[HTRACE_LOG_QUEUE_LEN];
+};
+
+static const char * const HTRACE_LOG_LEVEL_NAMES[] = {
+    "error",
+    "warn",
+    "info",
+    "debug",
 };
 
+#define HTRACE_LOG_NUM_LEVELS \
+    (sizeof(HTRACE_LOG_LEVEL_NAMES) / sizeof(HTRACE_LOG_LEVEL_NAMES[0]))
+
+/**
+ * Configure a log.  We can't use the typed conf getters here, since they
+ * log their parse errors.
+ */
+static void htrace_log_configure(struct htrace_log *lg,
+                                 const struct htrace_conf *conf)
+{
+    const char *val;
+    char *endptr = NULL;
+    size_t i;
+
+    lg->level = HTRACE_LOG_INFO;
+    val = htrace_conf_get(conf, HTRACE_LOG_LEVEL_KEY);
+    if (val) {
+        for (i = 0; i < HTRACE_LOG_NUM_LEVELS; i++) {
+            if (strcasecmp(val, HTRACE_LOG_LEVEL_NAMES[i]) == 0) {
+                lg->level = i;
+                break;
+            }
+        }
+        if (i == HTRACE_LOG_NUM_LEVELS) {
+            fprintf(lg->fp, "htrace_log_alloc: unknown value for %s: '%s'.  "
+                    "Using info.\n", HTRACE_LOG_LEVEL_KEY, val);
+        }
+    }
+    lg->ratelimit_ms = 0;
+    val = htrace_conf_get(conf, HTRACE_LOG_RATELIMIT_MS_KEY);
+    if (val) {
+        lg->ratelimit_ms = strtoull(val, &endptr, 10);
+        if (*endptr) {
+            fprintf(lg->fp, "htrace_log_alloc: invalid value for %s: '%s'.  "
+                    "Not rate-limiting.\n", HTRACE_LOG_RATELIMIT_MS_KEY, val);
+            lg->ratelimit_ms = 0;
+        }
+    }
+    lg->state = HTRACE_LOG_STATE_SYNC;
+    val = htrace_conf_get(conf, HTRACE_LOG_ASYNC_KEY);
+    if (val && (strcasecmp(val, "true") == 0)) {
+        lg->state = HTRACE_LOG_STATE_IDLE;
+    }
+}
+
+static void htrace_log_fork_prepare(void *data)
+{
+    struct htrace_log *lg = data;
+
+    pthread_mutex_lock(&lg->lock);
+}
+
+static void htrace_log_fork_parent(void *data)
+{
+    struct htrace_log *lg = data;
+
+    pthread_mutex_unlock(&lg->lock);
+}
+
+static void htrace_log_fork_child(void *data)
+{
+    struct htrace_log *lg = data;
+    uint64_t pos;
+
+    pthread_mutex_unlock(&lg->lock);
+    pthread_cond_init(&lg->cond, NULL);
+    if (lg->state == HTRACE_LOG_STATE_SYNC) {
+        return;
+    }
+    // The parent will write out whatever is queued, so we just free it.  A
+    // producer may have claimed a slot without filling it, and it will never
+    // do so now, so we start again with an empty queue.
+    for (pos = lg->tail; pos != lg->head; pos++) {
+        struct htrace_log_slot *slot =
+            &lg->slots[pos & (HTRACE_LOG_QUEUE_LEN - 1)];
+        if (slot->seq == pos + 1) {
+            htrace_free(slot->msg);
+        }
+    }
+    for (pos = 0; pos < HTRACE_LOG_QUEUE_LEN; pos++) {
+        lg->slots[pos].seq = pos;
+    }
+    lg->head = 0;
+    lg->tail = 0;
+    lg->sleeping = 0;
+    lg->shutdown = 0;
+    lg->state = HTRACE_LOG_STATE_IDLE;
+}
+
 struct htrace_log *htrace_log_alloc(const struct htrace_conf *conf)
 {
     struct htrace_log *lg;
     const char *path;
+    uint64_t i;
 
-    lg = calloc(1, sizeof(*lg));
+    lg = htrace_calloc(1, sizeof(*lg));
     if (!lg) {
         fprintf(stderr, "htrace_log_alloc: out of memory.\n");
         return NULL;
     }
+    pthread_mutex_init(&lg->lock, NULL);
+    pthread_cond_init(&lg->cond, NULL);
+    for (i = 0; i < HTRACE_LOG_QUEUE_LEN; i++) {
+        lg->slots[i].seq = i;
+    }
+    lg->fork_hook.prepare = htrace_log_fork_prepare;
+    lg->fork_hook.parent = htrace_log_fork_parent;
+    lg->fork_hook.child = htrace_log_fork_child;
+    lg->fork_hook.data = lg;
+    htrace_fork_hook_register(&lg->fork_hook);
     path = htrace_conf_get(conf, HTRACE_LOG_PATH_KEY);
     if (!path) {
         lg->fp = stderr;
+        htrace_log_configure(lg, conf);
         return lg;
     }
     lg->fp = fopen(path, "a");
@@ -66,39 +306,334 @@ struct htrace_log *htrace_log_alloc(const struct htrace_conf *conf)
                 "append: %d (%s).\n",
                 path, err, terror(err));
         lg->fp = stderr;
+        htrace_log_configure(lg, conf);
         return lg;
     }
     // If we're logging to a file, we need to close the file when we close the
     // log.
     lg->should_close = 1;
+    htrace_log_configure(lg, conf);
     return lg;
 }
 
+/**
+ * Put a message on the queue.
+ *
+ * @return              0 on success; EAGAIN if the queue was full.
+ */
+static int htrace_log_enqueue(struct htrace_log *lg, char *msg)
+{
+    struct htrace_log_slot *slot;
+    uint64_t pos, seq;
+
+    pos = __atomic_load_n(&lg->head, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &lg->slots[pos & (HTRACE_LOG_QUEUE_LEN - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&lg->head, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (seq < pos) {
+            return EAGAIN;
+        } else {
+            pos = __atomic_load_n(&lg->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->msg = msg;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Take a message off the queue.  Only one thread may call this at a time.
+ *
+ * @return              The message, or NULL if the queue was empty.
+ */
+static char *htrace_log_dequeue(struct htrace_log *lg)
+{
+    struct htrace_log_slot *slot;
+    char *msg;
+
+    slot = &lg->slots[lg->tail & (HTRACE_LOG_QUEUE_LEN - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != lg->tail + 1) {
+        return NULL;
+    }
+    msg = slot->msg;
+    __atomic_store_n(&slot->seq, lg->tail + HTRACE_LOG_QUEUE_LEN,
+                     __ATOMIC_RELEASE);
+    lg->tail++;
+    return msg;
+}
+
+static int htrace_log_queue_empty(struct htrace_log *lg)
+{
+    struct htrace_log_slot *slot;
+
+    slot = &lg->slots[lg->tail & (HTRACE_LOG_QUEUE_LEN - 1)];
+    return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != lg->tail + 1;
+}
+
+/**
+ * Write out everything on the queue.  Only one thread may call this at a
+ * time.
+ */
+static void htrace_log_drain(struct htrace_log *lg)
+{
+    uint64_t dropped;
+    char *msg;
+
+    pthread_mutex_lock(&lg->lock);
+    while ((msg = htrace_log_dequeue(lg))) {
+        fputs(msg, lg->fp);
+        htrace_free(msg);
+    }
+    dropped = __atomic_exchange_n(&lg->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        fprintf(lg->fp, "htrace_log: dropped %" PRIu64 " message(s) "
+                "because the log queue was full.\n", dropped);
+    }
+    fflush(lg->fp);
+    pthread_mutex_unlock(&lg->lock);
+}
+
+static void htrace_log_deadline(struct timespec *ts, uint64_t ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000LL;
+    if (ts->tv_nsec >= 1000000000LL) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000LL;
+    }
+}
+
+static void *htrace_log_writer(void *data)
+{
+    struct htrace_log *lg = data;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&lg->lock);
+    while (!lg->shutdown) {
+        pthread_mutex_unlock(&lg->lock);
+        htrace_log_drain(lg);
+        pthread_mutex_lock(&lg->lock);
+        if (lg->shutdown) {
+            break;
+        }
+        // Pairs with the fence in htrace_log_put: either the producer sees
+        // that we are sleeping, or we see its message here.
+        __atomic_store_n(&lg->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (htrace_log_queue_empty(lg)) {
+            htrace_log_deadline(&deadline, HTRACE_LOG_WRITER_POLL_MS);
+            pthread_cond_timedwait(&lg->cond, &lg->lock, &deadline);
+        }
+        __atomic_store_n(&lg->sleeping, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&lg->lock);
+    htrace_log_drain(lg);
+    return NULL;
+}
+
+/**
+ * Start the writer thread, if nobody has yet.
+ */
+static void htrace_log_start_writer(struct htrace_log *lg)
+{
+    int state = HTRACE_LOG_STATE_IDLE;
+
+    if (!__atomic_compare_exchange_n(&lg->state, &state,
+                HTRACE_LOG_STATE_STARTING, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if (pthread_create(&lg->thread, NULL, htrace_log_writer, lg)) {
+        // Fall back on writing messages ourselves.  Write out anything which
+        // was queued while we were trying.
+        __atomic_store_n(&lg->state, HTRACE_LOG_STATE_SYNC,
+                         __ATOMIC_RELEASE);
+        fprintf(lg->fp, "htrace_log: failed to start the writer thread.  "
+                "Logging synchronously.\n");
+        htrace_log_drain(lg);
+        return;
+    }
+    __atomic_store_n(&lg->state, HTRACE_LOG_STATE_RUNNING, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write a message, or queue it to be written.  Takes ownership of msg.
+ */
+static void htrace_log_put(struct htrace_log *lg, char *msg)
+{
+    int state;
+
+    if (!msg) {
+        __atomic_fetch_add(&lg->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    state = __atomic_load_n(&lg->state, __ATOMIC_ACQUIRE);
+    if (state == HTRACE_LOG_STATE_SYNC) {
+        pthread_mutex_lock(&lg->lock);
+        fputs(msg, lg->fp);
+        pthread_mutex_unlock(&lg->lock);
+        htrace_free(msg);
+        return;
+    }
+    if (state == HTRACE_LOG_STATE_IDLE) {
+        htrace_log_start_writer(lg);
+    }
+    if (htrace_log_enqueue(lg, msg)) {
+        htrace_free(msg);
+        __atomic_fetch_add(&lg->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&lg->sleeping, __ATOMIC_RELAXED)) {
+        if (pthread_mutex_trylock(&lg->lock) == 0) {
+            pthread_cond_signal(&lg->cond);
+            pthread_mutex_unlock(&lg->lock);
+        }
+    }
+}
+
 void htrace_log_free(struct htrace_log *lg)
 {
     if (!lg) {
         return;
     }
+    htrace_fork_hook_unregister(&lg->fork_hook);
+    if (__atomic_load_n(&lg->state, __ATOMIC_ACQUIRE) ==
+            HTRACE_LOG_STATE_RUNNING) {
+        pthread_mutex_lock(&lg->lock);
+        lg->shutdown = 1;
+        pthread_cond_signal(&lg->cond);
+        pthread_mutex_unlock(&lg->lock);
+        pthread_join(lg->thread, NULL);
+    }
+    htrace_log_drain(lg);
+    pthread_cond_destroy(&lg->cond);
     pthread_mutex_destroy(&lg->lock);
     if (lg->should_close) {
         fclose(lg->fp);
     }
-    free(lg);
+    htrace_free(lg);
 }
 
-static void htrace_logv(struct htrace_log *lg, const char *fmt, va_list ap)
+/**
+ * Format a message into a new heap buffer.
+ *
+ * @return              The message, or NULL on OOM.
+ */
+static char *htrace_log_vformat(const char *fmt, va_list ap)
 {
-    pthread_mutex_lock(&lg->lock);
-    vfprintf(lg->fp, fmt, ap);
-    pthread_mutex_unlock(&lg->lock);
+    char buf[512], *msg;
+    va_list ap2;
+    int len;
+
+    va_copy(ap2, ap);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap2);
+    va_end(ap2);
+    if (len < 0) {
+        return NULL;
+    }
+    msg = htrace_malloc(len + 1);
+    if (!msg) {
+        return NULL;
+    }
+    if ((size_t)len < sizeof(buf)) {
+        memcpy(msg, buf, len + 1);
+    } else {
+        vsnprintf(msg, len + 1, fmt, ap);
+    }
+    return msg;
+}
+
+static void htrace_logv(struct htrace_log *lg, int level,
+                        const char *fmt, va_list ap)
+{
+    if (level > lg->level) {
+        return;
+    }
+    htrace_log_put(lg, htrace_log_vformat(fmt, ap));
 }
 
 void htrace_log(struct htrace_log *lg, const char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
-    htrace_logv(lg, fmt, ap);
+    htrace_logv(lg, HTRACE_LOG_INFO, fmt, ap);
+    va_end(ap);
+}
+
+void htrace_log_at(struct htrace_log *lg, int level, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    htrace_logv(lg, level, fmt, ap);
+    va_end(ap);
+}
+
+/**
+ * Decide whether a rate-limited site may log now.
+ *
+ * @return              0 if the message should be suppressed; otherwise,
+ *                          1 plus the number of messages which were
+ *                          suppressed since the last one.
+ */
+static uint64_t htrace_log_site_admit(struct htrace_log *lg,
+                                      struct htrace_log_site *site)
+{
+    struct timespec ts;
+    uint64_t now, next;
+
+    if (lg->ratelimit_ms == 0) {
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (((uint64_t)ts.tv_sec) * 1000) + (ts.tv_nsec / 1000000);
+    next = __atomic_load_n(&site->next_ms, __ATOMIC_RELAXED);
+    if ((now < next) ||
+            (!__atomic_compare_exchange_n(&site->next_ms, &next,
+                now + lg->ratelimit_ms, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))) {
+        __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1 + __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+}
+
+void htrace_log_site(struct htrace_log *lg, struct htrace_log_site *site,
+                     int level, const char *fmt, ...)
+{
+    va_list ap;
+    uint64_t admit;
+    char *msg, *full;
+    int len;
+
+    if (level > lg->level) {
+        return;
+    }
+    admit = htrace_log_site_admit(lg, site);
+    if (!admit) {
+        return;
+    }
+    va_start(ap, fmt);
+    msg = htrace_log_vformat(fmt, ap);
     va_end(ap);
+    if (msg && (admit > 1)) {
+        len = snprintf(NULL, 0, "[%" PRIu64 " similar message(s) "
+                       "suppressed] %s", admit - 1, msg);
+        full = htrace_malloc(len + 1);
+        if (full) {
+            snprintf(full, len + 1, "[%" PRIu64 " similar message(s) "
+                     "suppressed] %s", admit - 1, msg);
+        }
+        htrace_free(msg);
+        msg = full;
+    }
+    htrace_log_put(lg, msg);
 }
 
 // vim: ts=4:sw=4:et
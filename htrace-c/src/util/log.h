@@ -27,8 +27,37 @@
  * This is an internal header, not intended for external use.
  */
 
+#include <stdint.h> /* for uint64_t */
+
 struct htrace_conf;
 
+/**
+ * Log message severities, from most to least severe.
+ */
+enum htrace_log_level {
+    HTRACE_LOG_ERROR = 0,
+    HTRACE_LOG_WARN,
+    HTRACE_LOG_INFO,
+    HTRACE_LOG_DEBUG,
+};
+
+/**
+ * The rate-limiting state of one place in the code that logs.  Must be
+ * zero-initialized; see HTRACE_LOG_RATELIMITED.
+ */
+struct htrace_log_site {
+    /**
+     * The monotonic time in milliseconds before which messages from this
+     * site are suppressed.
+     */
+    uint64_t next_ms;
+
+    /**
+     * The number of messages suppressed since the last one we wrote.
+     */
+    uint64_t suppressed;
+};
+
 /**
  * Allocate a new htrace_log.
  *
@@ -55,7 +84,9 @@ const char *terror(int err);
 void htrace_log_free(struct htrace_log *lg);
 
 /**
- * Create an htrace log message.
+ * Create an htrace log message at HTRACE_LOG_INFO.
+ *
+ * This never blocks when the log is asynchronous.
  *
  * @param lg            The log to use.
  * @param fmt           The format string to use.
@@ -64,6 +95,44 @@ void htrace_log_free(struct htrace_log *lg);
 void htrace_log(struct htrace_log *lg, const char *fmt, ...)
       __attribute__((format(printf, 2, 3)));
 
+/**
+ * Create an htrace log message with the given severity.
+ *
+ * @param lg            The log to use.
+ * @param level         An enum htrace_log_level.
+ * @param fmt           The format string to use.
+ * @param ...           Printf-style variable length arguments.
+ */
+void htrace_log_at(struct htrace_log *lg, int level, const char *fmt, ...)
+      __attribute__((format(printf, 3, 4)));
+
+/**
+ * Create an htrace log message, unless another message from the same site
+ * was written too recently.
+ *
+ * Use HTRACE_LOG_RATELIMITED rather than calling this directly.
+ *
+ * @param lg            The log to use.
+ * @param site          The rate-limiting state of the calling site.
+ * @param level         An enum htrace_log_level.
+ * @param fmt           The format string to use.
+ * @param ...           Printf-style variable length arguments.
+ */
+void htrace_log_site(struct htrace_log *lg, struct htrace_log_site *site,
+                     int level, const char *fmt, ...)
+      __attribute__((format(printf, 4, 5)));
+
+/**
+ * Log a message from a place in the code which might run on every span, such
+ * as an allocation failure on the span path.  At most one message per
+ * log.ratelimit.ms is written from each such place.
+ */
+#define HTRACE_LOG_RATELIMITED(lg, level, ...) \
+    do { \
+        static struct htrace_log_site htrace_log_site_; \
+        htrace_log_site(lg, &htrace_log_site_, level, __VA_ARGS__); \
+    } while (0)
+
 #endif
 
 // vim: ts=4:sw=4:et
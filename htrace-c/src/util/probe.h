@@ -0,0 +1,78 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_UTIL_PROBE_H
+#define APACHE_HTRACE_UTIL_PROBE_H
+
+/**
+ * @file probe.h
+ *
+ * USDT probe points, which let perf, bpftrace, or SystemTap attach to the
+ * library without rebuilding it.
+ *
+ * The probes are only compiled in when CMake is run with -DHTRACE_USDT=ON,
+ * which needs sys/sdt.h.  Each probe is then a single nop, plus a note in the
+ * .note.stapsdt section which tells a tracer where it is and where to find
+ * its arguments.  The arguments are still computed when nothing is
+ * attached, so only pass values which are already at hand.  Without
+ * HTRACE_USDT, the probes compile to nothing.
+ *
+ * The probes, all in the "htrace" provider, are:
+ *
+ *   span__start(desc, id_high, id_low)
+ *       A span was started.  desc is its NUL-terminated description.
+ *   span__unsampled(desc, desc_len)
+ *       The sampler decided not to start a new trace.  desc need not be
+ *       NUL-terminated.
+ *   span__close(desc, id_high, id_low, duration_ns)
+ *       A span was closed.
+ *   htraced__add__span(desc, id_high, id_low)
+ *       The htraced receiver was given a span.
+ *   htraced__xmit(num_spans, len)
+ *       The htraced receiver is about to send a buffer of len bytes.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include "util/build.h"
+
+#ifdef HAVE_USDT
+
+#include <sys/sdt.h>
+
+#define HTRACE_PROBE2(name, a, b) \
+    DTRACE_PROBE2(htrace, name, a, b)
+#define HTRACE_PROBE3(name, a, b, c) \
+    DTRACE_PROBE3(htrace, name, a, b, c)
+#define HTRACE_PROBE4(name, a, b, c, d) \
+    DTRACE_PROBE4(htrace, name, a, b, c, d)
+
+#else
+
+#define HTRACE_PROBE2(name, a, b) \
+    do { (void)(a); (void)(b); } while (0)
+#define HTRACE_PROBE3(name, a, b, c) \
+    do { (void)(a); (void)(b); (void)(c); } while (0)
+#define HTRACE_PROBE4(name, a, b, c, d) \
+    do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+
+#endif
+
+#endif
+
+// vim: ts=4:sw=4:et
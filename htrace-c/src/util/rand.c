@@ -0,0 +1,254 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "util/alloc.h"
+#include "util/build.h"
+#include "util/log.h"
+#include "util/rand.h"
+#include "util/time.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @file rand.c
+ *
+ * A random number source shared by all platforms.
+ *
+ * Each thread has its own xoshiro256** generator, seeded from the operating
+ * system the first time the thread needs random numbers, so that making a
+ * span ID is only arithmetic.  This is not a cryptographic generator.  Span
+ * IDs only need to be unlikely to collide, not hard to predict.
+ *
+ * A forked child would otherwise produce the same numbers as its parent, so
+ * we count forks with pthread_atfork and reseed any generator which was
+ * seeded before the latest fork.
+ *
+ * The generator state is found through a thread-local variable when the
+ * compiler supports __thread, and through a pthread key otherwise.
+ */
+
+struct random_src {
+    /**
+     * The HTrace log.
+     */
+    struct htrace_log *lg;
+};
+
+/**
+ * One thread's generator.
+ */
+struct random_state {
+    /**
+     * The xoshiro256** state.
+     */
+    uint64_t s[4];
+
+    /**
+     * The value of g_rand_forks when this generator was seeded, or 0 if it
+     * has not been seeded yet.
+     */
+    uint64_t forks;
+};
+
+static pthread_once_t g_rand_once = PTHREAD_ONCE_INIT;
+
+/**
+ * One more than the number of times this process has forked, since it
+ * started or since libhtrace was loaded.
+ */
+static uint64_t g_rand_forks = 1;
+
+#ifdef HAVE_IMPROVED_TLS
+static __thread struct random_state t_rand;
+#else
+/**
+ * Nonzero if g_rand_key was created.
+ */
+static int g_rand_key_valid;
+
+static pthread_key_t g_rand_key;
+
+/**
+ * The generator used by threads which couldn't get their own.  Sharing it
+ * is racy, but the worst that can happen is a repeated span ID.
+ */
+static struct random_state g_rand_fallback;
+#endif
+
+static void random_atfork_child(void)
+{
+    __atomic_fetch_add(&g_rand_forks, 1, __ATOMIC_RELAXED);
+}
+
+#ifndef HAVE_IMPROVED_TLS
+/**
+ * Free an exiting thread's generator.  It came from htrace_calloc, so it
+ * must go back through htrace_free, not libc free.
+ */
+static void random_state_free(void *data)
+{
+    htrace_free(data);
+}
+#endif
+
+static void random_init(void)
+{
+    pthread_atfork(NULL, NULL, random_atfork_child);
+#ifndef HAVE_IMPROVED_TLS
+    g_rand_key_valid =
+        (pthread_key_create(&g_rand_key, random_state_free) == 0);
+#endif
+}
+
+#ifndef HAVE_IMPROVED_TLS
+/**
+ * Delete the key when libhtrace is unloaded, so that exiting threads don't
+ * call back into unmapped code.  Their generators are leaked.
+ */
+static void __attribute__((destructor)) random_key_fini(void)
+{
+    if (g_rand_key_valid) {
+        pthread_key_delete(g_rand_key);
+        g_rand_key_valid = 0;
+    }
+}
+#endif
+
+/**
+ * The splitmix64 generator, which we use to spread seed material over the
+ * xoshiro256** state.
+ */
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void random_state_seed(struct random_src *rnd,
+                              struct random_state *st, uint64_t forks)
+{
+    uint64_t seed[4], x;
+    int i;
+
+    if (random_seed(rnd->lg, seed, sizeof(seed))) {
+        // Fall back on things which differ between threads and processes.
+        // This is enough to keep span IDs apart, if not much more.
+        htrace_log(rnd->lg, "random_state_seed: falling back on a weak "
+                   "seed.\n");
+        seed[0] = monotonic_now_ns(NULL);
+        seed[1] = now_ms(NULL);
+        seed[2] = (uint64_t)getpid();
+        seed[3] = (uint64_t)(uintptr_t)st;
+    }
+    x = seed[0] ^ seed[1] ^ seed[2] ^ seed[3];
+    for (i = 0; i < 4; i++) {
+        st->s[i] = seed[i] ^ splitmix64(&x);
+    }
+    // The all-zero state is the one state xoshiro256** can't leave.
+    if (!(st->s[0] | st->s[1] | st->s[2] | st->s[3])) {
+        st->s[0] = 1;
+    }
+    st->forks = forks;
+}
+
+/**
+ * Get the current thread's generator, seeding it if needed.
+ *
+ * @return              The generator.  Never NULL.
+ */
+static struct random_state *random_state_get(struct random_src *rnd)
+{
+    struct random_state *st;
+    uint64_t forks;
+
+#ifdef HAVE_IMPROVED_TLS
+    st = &t_rand;
+#else
+    pthread_once(&g_rand_once, random_init);
+    st = g_rand_key_valid ? pthread_getspecific(g_rand_key) : NULL;
+    if (!st) {
+        st = htrace_calloc(1, sizeof(*st));
+        if ((!st) || (!g_rand_key_valid) ||
+                pthread_setspecific(g_rand_key, st)) {
+            htrace_free(st);
+            st = &g_rand_fallback;
+        }
+    }
+#endif
+    forks = __atomic_load_n(&g_rand_forks, __ATOMIC_RELAXED);
+    if (st->forks != forks) {
+        random_state_seed(rnd, st, forks);
+    }
+    return st;
+}
+
+struct random_src *random_src_alloc(struct htrace_log *lg)
+{
+    struct random_src *rnd;
+
+    pthread_once(&g_rand_once, random_init);
+    rnd = htrace_calloc(1, sizeof(*rnd));
+    if (!rnd) {
+        htrace_log(lg, "random_src_alloc: OOM\n");
+        return NULL;
+    }
+    rnd->lg = lg;
+    return rnd;
+}
+
+void random_src_free(struct random_src *rnd)
+{
+    htrace_free(rnd);
+}
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+uint64_t random_u64(struct random_src *rnd)
+{
+    struct random_state *st = random_state_get(rnd);
+    uint64_t *s = st->s;
+    uint64_t result, t;
+
+    result = rotl(s[1] * 5, 7) * 9;
+    t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+uint32_t random_u32(struct random_src *rnd)
+{
+    // The high bits of xoshiro256** are the best ones.
+    return random_u64(rnd) >> 32;
+}
+
+// vim: ts=4:sw=4:tw=79:et
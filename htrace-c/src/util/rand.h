@@ -27,6 +27,7 @@
  * This is an internal header, not intended for external use.
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 struct htrace_log;
@@ -58,6 +59,21 @@ uint32_t random_u32(struct random_src *rnd);
  */
 uint64_t random_u64(struct random_src *rnd);
 
+/**
+ * Fill a buffer with random bytes from the operating system, for seeding.
+ *
+ * This is implemented separately for each platform.  It may make system
+ * calls, so it should only be used when a thread first needs random numbers,
+ * and after fork.
+ *
+ * @param lg      The log to use for error messages.
+ * @param buf     The buffer to fill.
+ * @param len     The length of the buffer.
+ *
+ * @return        0 on success; an error code otherwise.
+ */
+int random_seed(struct htrace_log *lg, void *buf, size_t len);
+
 #endif
 
 // vim: ts=4:sw=4:et
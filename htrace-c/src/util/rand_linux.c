@@ -16,128 +16,93 @@
  * limitations under the License.
  */
 
+
+#include "util/build.h"
 #include "util/log.h"
 #include "util/rand.h"
 
 #include <errno.h>
 #include <fcntl.h>
-#include <inttypes.h>
-#include <stdlib.h>
-#include <string.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#define URANDOM_PATH "/dev/urandom"
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
 
-#define PSAMP_THREAD_LOCAL_BUF_LEN 256
+#define URANDOM_PATH "/dev/urandom"
 
 /**
  * @file rand_linux.c
  *
- * A Linux implementation of a random number source.  This implementation reads
- * random numbers from /dev/urandom.  To avoid reading from /dev/urandom too
- * often, we have a thread-local cache of random data.  This is done using ELF
- * TLS.
- */
-
-struct random_src {
-    /**
-     * The HTrace log.
-     */
-    struct htrace_log *lg;
-
-    /**
-     * File descriptor for /dev/urandom.
-     */
-    int urandom_fd;
-};
-
-/**
- * A thread-local cache of random bits.
- */
-static __thread uint32_t g_rnd_cache[PSAMP_THREAD_LOCAL_BUF_LEN];
-
-/**
- * An index into our thread-local cache of random bits.
+ * Seeding for the random number source on Linux.  We use the getrandom system
+ * call when we have it, since it doesn't need a file descriptor and works
+ * inside a chroot.  Otherwise, or if the kernel is too old to have it, we read
+ * from /dev/urandom.
  */
-static __thread int g_rnd_cache_idx = PSAMP_THREAD_LOCAL_BUF_LEN;
 
-static void refill_rand_cache(struct random_src *rnd)
+static int random_seed_urandom(struct htrace_log *lg, void *buf, size_t len)
 {
     size_t total = 0;
+    int fd, err;
 
-    while (1) {
-        ssize_t res;
-        ssize_t rem = (PSAMP_THREAD_LOCAL_BUF_LEN * sizeof(uint32_t)) - total;
-        if (rem == 0) {
-            break;
-        }
-        res = read(rnd->urandom_fd, ((uint8_t*)&g_rnd_cache) + total, rem);
+    fd = open(URANDOM_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        err = errno;
+        htrace_log(lg, "random_seed: failed to open " URANDOM_PATH
+                   ": error %d (%s)\n", err, terror(err));
+        return err;
+    }
+    while (total < len) {
+        ssize_t res = read(fd, ((uint8_t*)buf) + total, len - total);
         if (res < 0) {
-            int err = errno;
+            err = errno;
             if (err == EINTR) {
                 continue;
             }
-            htrace_log(rnd->lg, "refill_rand_cache: error refilling "
-                       "random cache: %d (%s)\n", err,
-                       terror(err));
-            return;
+            htrace_log(lg, "random_seed: error reading " URANDOM_PATH
+                       ": %d (%s)\n", err, terror(err));
+            close(fd);
+            return err;
+        } else if (res == 0) {
+            htrace_log(lg, "random_seed: unexpected EOF reading "
+                       URANDOM_PATH "\n");
+            close(fd);
+            return EIO;
         }
         total += res;
     }
-    g_rnd_cache_idx = 0;
+    close(fd);
+    return 0;
 }
 
-struct random_src *random_src_alloc(struct htrace_log *lg)
+int random_seed(struct htrace_log *lg, void *buf, size_t len)
 {
-    struct random_src *rnd;
-    int err;
-
-    rnd = calloc(1, sizeof(*rnd));
-    if (!rnd) {
-        htrace_log(lg, "random_src_alloc: OOM\n");
-        return NULL;
-    }
-    rnd->urandom_fd = open(URANDOM_PATH, O_RDONLY);
-    if (rnd->urandom_fd < 0) {
-        err = errno;
-        htrace_log(lg, "random_src_alloc: failed to open "
-                   URANDOM_PATH ": error %d (%s)\n", err,
-                   terror(err));
-        free(rnd);
-        return NULL;
-    }
-    rnd->lg = lg;
-    return rnd;
-}
+#ifdef HAVE_GETRANDOM
+    size_t total = 0;
 
-void random_src_free(struct random_src *rnd)
-{
-    if (!rnd) {
-        return;
-    }
-    if (close(rnd->urandom_fd)) {
-        int err = errno;
-        htrace_log(rnd->lg, "linux_prob_sampler_free: close error: "
-                   "%d (%s)\n", err, terror(err));
+    while (total < len) {
+        ssize_t res = getrandom(((uint8_t*)buf) + total, len - total, 0);
+        if (res < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            if (err != ENOSYS) {
+                htrace_log(lg, "random_seed: getrandom error %d (%s)\n",
+                           err, terror(err));
+            }
+            break;
+        }
+        total += res;
     }
-    free(rnd);
-}
-
-uint32_t random_u32(struct random_src *rnd)
-{
-    if (g_rnd_cache_idx >= PSAMP_THREAD_LOCAL_BUF_LEN) {
-        refill_rand_cache(rnd);
+    if (total == len) {
+        return 0;
     }
-    return g_rnd_cache[g_rnd_cache_idx++];
-}
-
-uint64_t random_u64(struct random_src *rnd)
-{
-    uint64_t val = random_u32(rnd);
-    val <<= 32;
-    return val | random_u32(rnd);
+#endif
+    return random_seed_urandom(lg, buf, len);
 }
 
 // vim: ts=4:sw=4:tw=79:et
@@ -16,105 +16,58 @@
  * limitations under the License.
  */
 
+
 #include "util/log.h"
 #include "util/rand.h"
 
 #include <errno.h>
-#include <inttypes.h>
-#include <pthread.h>
-#include <stdlib.h>
-#include <string.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <unistd.h>
 
+#define URANDOM_PATH "/dev/urandom"
+
 /**
  * @file rand_posix.c
  *
- * A POSIX implementation of random number source.  We have to use a mutex here
- * to protect the rand_r() state.  If we used rand() instead, we would also
- * need to use a mutex.  The standard POSIX functions for getting random
- * numbers are actually really unfortunate in many ways.  Hopefully we can
- * provide platform-specific implementatinos of the probability sampler for all
- * the major platforms.
- */
-
-/**
- * A sampler that fires with a certain probability.
+ * Seeding for the random number source on other POSIX systems.  POSIX doesn't
+ * have a standard call for this, but every system we care about has
+ * /dev/urandom.
  */
-struct random_src {
-    /**
-     * Mutex protecting rand_r.
-     */
-    pthread_mutex_t lock;
-
-    /**
-     * State used with rand_r.
-     */
-    unsigned int rand_state;
-};
 
-struct random_src *random_src_alloc(struct htrace_log *lg)
+int random_seed(struct htrace_log *lg, void *buf, size_t len)
 {
-    struct random_src *rnd;
-    int ret;
+    size_t total = 0;
+    int fd, err;
 
-    rnd = calloc(1, sizeof(*rnd));
-    if (!rnd) {
-        htrace_log(lg, "random_src_alloc: OOM\n");
-        return NULL;
+    fd = open(URANDOM_PATH, O_RDONLY);
+    if (fd < 0) {
+        err = errno;
+        htrace_log(lg, "random_seed: failed to open " URANDOM_PATH
+                   ": error %d (%s)\n", err, terror(err));
+        return err;
     }
-    ret = pthread_mutex_init(&rnd->lock, NULL);
-    if (ret) {
-        htrace_log(lg, "random_src_alloc: pthread_mutex_create "
-                   "failed: error %d (%s)\n", ret, terror(ret));
-        free(rnd);
-        return NULL;
-    }
-    return rnd;
-}
-
-void random_src_free(struct random_src *rnd)
-{
-    if (!rnd) {
-        return;
+    while (total < len) {
+        ssize_t res = read(fd, ((uint8_t*)buf) + total, len - total);
+        if (res < 0) {
+            err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            htrace_log(lg, "random_seed: error reading " URANDOM_PATH
+                       ": %d (%s)\n", err, terror(err));
+            close(fd);
+            return err;
+        } else if (res == 0) {
+            htrace_log(lg, "random_seed: unexpected EOF reading "
+                       URANDOM_PATH "\n");
+            close(fd);
+            return EIO;
+        }
+        total += res;
     }
-    pthread_mutex_destroy(&rnd->lock);
-    free(rnd);
-}
-
-uint32_t random_u32(struct random_src *rnd)
-{
-    uint32_t val = 0;
-    pthread_mutex_lock(&rnd->lock);
-    // rand_r gives at least 15 bits of randomness.
-    // So we need to xor it 3 times to get 32 bits' worth.
-    val ^= rand_r(&rnd->rand_state);
-    val <<= 15;
-    val ^= rand_r(&rnd->rand_state);
-    val <<= 15;
-    val ^= rand_r(&rnd->rand_state);
-    val <<= 15;
-    pthread_mutex_unlock(&rnd->lock);
-    return val;
-}
-
-uint64_t random_u64(struct random_src *rnd)
-{
-    uint64_t val = 0;
-    pthread_mutex_lock(&rnd->lock);
-    // rand_r gives at least 15 bits of randomness.
-    // So we need to xor it 5 times to get 64 bits' worth.
-    val ^= rand_r(&rnd->rand_state);
-    val <<= 15;
-    val ^= rand_r(&rnd->rand_state);
-    val <<= 15;
-    val ^= rand_r(&rnd->rand_state);
-    val <<= 15;
-    val ^= rand_r(&rnd->rand_state);
-    val <<= 15;
-    val ^= rand_r(&rnd->rand_state);
-    val <<= 15;
-    pthread_mutex_unlock(&rnd->lock);
-    return val;
+    close(fd);
+    return 0;
 }
 
 // vim: ts=4:sw=4:tw=79:et
@@ -16,14 +16,24 @@
  * limitations under the License.
  */
 
+#include "util/alloc.h"
 #include "util/log.h"
 #include "util/string.h"
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_SKIP_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define JSON_SKIP_NEON
+#endif
+
 int fwdprintf(char **buf, int* rem, const char *fmt, ...)
 {
     int amt, res;
@@ -55,50 +65,240 @@ int fwdprintf(char **buf, int* rem, const char *fmt, ...)
     return res;
 }
 
+/**
+ * Nonzero for the bytes which can appear in a JSON string without escaping
+ * and without being part of a multi-byte UTF-8 sequence: printable ASCII,
+ * other than double quote and backslash.
+ *
+ * Note: we don't allow newline (0x0a), tab (0x09), or carriage return (0x0d)
+ * because they cause problems down the line.
+ */
+static const uint8_t JSON_PLAIN_BYTE[256] = {
+    /* 0x00 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 0x10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 0x20 */ 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x30 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x40 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x50 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1,
+    /* 0x60 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 0x70 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0,
+    /* 0x80 and up are all 0 */
+};
+
+#define JSON_SKIP_CHUNK 16
+
+/**
+ * Skip over the plain bytes at the start of a string.
+ *
+ * Once the pointer is aligned, we look at 16 bytes at a time with SSE2 or
+ * NEON when we have them.  Aligned loads never cross a page boundary, so we
+ * can't fault by reading past the terminating NUL, although we may read a
+ * few bytes beyond it.  That is why this function is excluded from
+ * AddressSanitizer.
+ *
+ * @param b         The string.
+ *
+ * @return          A pointer to the first byte which is not plain.  This
+ *                      may be the terminating NUL.
+ */
+__attribute__((no_sanitize_address))
+static const unsigned char *json_skip_plain(const unsigned char *b)
+{
+    while (((uintptr_t)b) & (JSON_SKIP_CHUNK - 1)) {
+        if (!JSON_PLAIN_BYTE[b[0]]) {
+            return b;
+        }
+        b++;
+    }
+#if defined(JSON_SKIP_SSE2)
+    {
+        // Bytes below 0x20 and at or above 0x80 are both less than 0x20 when
+        // compared as signed bytes.
+        const __m128i space = _mm_set1_epi8(0x20);
+        const __m128i del = _mm_set1_epi8(0x7f);
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i bslash = _mm_set1_epi8('\\');
+        while (1) {
+            __m128i v = _mm_load_si128((const __m128i *)b);
+            __m128i bad = _mm_or_si128(
+                _mm_or_si128(_mm_cmplt_epi8(v, space),
+                             _mm_cmpeq_epi8(v, del)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                             _mm_cmpeq_epi8(v, bslash)));
+            int mask = _mm_movemask_epi8(bad);
+            if (mask) {
+                return b + __builtin_ctz(mask);
+            }
+            b += JSON_SKIP_CHUNK;
+        }
+    }
+#elif defined(JSON_SKIP_NEON)
+    {
+        const uint8x16_t space = vdupq_n_u8(0x20);
+        const uint8x16_t tilde = vdupq_n_u8(0x7e);
+        const uint8x16_t quote = vdupq_n_u8('"');
+        const uint8x16_t bslash = vdupq_n_u8('\\');
+        while (1) {
+            uint8x16_t v = vld1q_u8(b);
+            uint8x16_t bad = vorrq_u8(
+                vorrq_u8(vcltq_u8(v, space), vcgtq_u8(v, tilde)),
+                vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, bslash)));
+            if (vmaxvq_u8(bad)) {
+                break;
+            }
+            b += JSON_SKIP_CHUNK;
+        }
+    }
+#endif
+    while (JSON_PLAIN_BYTE[b[0]]) {
+        b++;
+    }
+    return b;
+}
+
+/**
+ * Skip over the plain bytes at the start of a buffer of known length.
+ *
+ * Unlike json_skip_plain, this never reads past the end of the buffer, so
+ * it uses unaligned loads and finishes the last partial chunk a byte at a
+ * time.
+ *
+ * @param b         The start of the buffer.
+ * @param end       The end of the buffer.
+ *
+ * @return          A pointer to the first byte which is not plain, or end.
+ */
+static const unsigned char *json_skip_plain_len(const unsigned char *b,
+                                                const unsigned char *end)
+{
+#if defined(JSON_SKIP_SSE2)
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    while (end - b >= JSON_SKIP_CHUNK) {
+        __m128i v = _mm_loadu_si128((const __m128i *)b);
+        __m128i bad = _mm_or_si128(
+            _mm_or_si128(_mm_cmplt_epi8(v, space),
+                         _mm_cmpeq_epi8(v, del)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                         _mm_cmpeq_epi8(v, bslash)));
+        int mask = _mm_movemask_epi8(bad);
+        if (mask) {
+            return b + __builtin_ctz(mask);
+        }
+        b += JSON_SKIP_CHUNK;
+    }
+#elif defined(JSON_SKIP_NEON)
+    const uint8x16_t space = vdupq_n_u8(0x20);
+    const uint8x16_t tilde = vdupq_n_u8(0x7e);
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t bslash = vdupq_n_u8('\\');
+    while (end - b >= JSON_SKIP_CHUNK) {
+        uint8x16_t v = vld1q_u8(b);
+        uint8x16_t bad = vorrq_u8(
+            vorrq_u8(vcltq_u8(v, space), vcgtq_u8(v, tilde)),
+            vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, bslash)));
+        if (vmaxvq_u8(bad)) {
+            break;
+        }
+        b += JSON_SKIP_CHUNK;
+    }
+#endif
+    while ((b < end) && JSON_PLAIN_BYTE[b[0]]) {
+        b++;
+    }
+    return b;
+}
+
+/**
+ * Find the length of the multi-byte UTF-8 sequence at the start of a string.
+ *
+ * The bytes are only looked at until one of them fails to match, so a NUL
+ * terminator stops the search as surely as the end of the buffer does.
+ *
+ * @param b         The start of the sequence.
+ * @param avail     The most bytes the sequence may have.
+ *
+ * @return          The length of the sequence, or 0 if it is not one we
+ *                      accept.
+ */
+static size_t json_utf8_len(const unsigned char *b, size_t avail)
+{
+    if ((avail >= 2) && (0xC2 <= b[0] && b[0] <= 0xDF) &&
+            (0x80 <= b[1] && b[1] <= 0xBF)) {
+        return 2; // 2-byte UTF-8, U+0080 to U+07FF
+    }
+    if ((avail >= 3) && ((b[0] == 0xe0 &&
+                (0xa0 <= b[1] && b[1] <= 0xbf) &&
+                (0x80 <= b[2] && b[2] <= 0xbf)
+            ) || (
+                ((0xe1 <= b[0] && b[0] <= 0xec) ||
+                    b[0] == 0xee ||
+                    b[0] == 0xef) &&
+                (0x80 <= b[1] && b[1] <= 0xbf) &&
+                (0x80 <= b[2] && b[2] <= 0xbf)
+            ) || (
+                b[0] == 0xed &&
+                (0x80 <= b[1] && b[1] <= 0x9f) &&
+                (0x80 <= b[2] && b[2] <= 0xbf)
+            ))) {
+        return 3; // 3-byte UTF-8, U+0800 U+FFFF
+    }
+    // Note: we don't allow code points outside the basic multilingual plane
+    // (BMP) at the moment.  The problem with them is that Javascript
+    // doesn't support them directly (they have to be encoded with UCS-2
+    // surrogate pairs).  TODO: teach htraced to do that encoding.
+    return 0;
+}
+
 int validate_json_string(struct htrace_log *lg, const char *str)
 {
     const unsigned char *b = (const unsigned char *)str;
-    int off = 0;
-
-    while(*b) {
-        // Note: we don't allow newline (0x0a), tab (0x09), or carriage return
-        // (0x0d) because they cause problems down the line.
-        if (((0x20 <= b[0] && b[0] <= 0x7E)) &&
-                ((b[0] != '"') && (b[0] != '\\'))) {
-            b++;
-            off++;
-            continue;
+    size_t len;
+
+    while (1) {
+        b = json_skip_plain(b);
+        if (!b[0]) {
+            break;
         }
-        if((0xC2 <= b[0] && b[0] <= 0xDF) && (0x80 <= b[1] && b[1] <= 0xBF)) {
-            b += 2; // 2-byte UTF-8, U+0080 to U+07FF
-            off += 2;
+        len = json_utf8_len(b, 3);
+        if (len) {
+            b += len;
             continue;
         }
-        if ((b[0] == 0xe0 &&
-                    (0xa0 <= b[1] && b[1] <= 0xbf) &&
-                    (0x80 <= b[2] && b[2] <= 0xbf)
-                ) || (
-                    ((0xe1 <= b[0] && b[0] <= 0xec) ||
-                        b[0] == 0xee ||
-                        b[0] == 0xef) &&
-                    (0x80 <= b[1] && b[1] <= 0xbf) &&
-                    (0x80 <= b[2] && b[2] <= 0xbf)
-                ) || (
-                    b[0] == 0xed &&
-                    (0x80 <= b[1] && b[1] <= 0x9f) &&
-                    (0x80 <= b[2] && b[2] <= 0xbf)
-                )) {
-            b += 3; // 3-byte UTF-8, U+0800 U+FFFF
-            off += 3;
+        if (lg) {
+            HTRACE_LOG_RATELIMITED(lg, HTRACE_LOG_WARN,
+                    "validate_json_string(%s): byte %d (0x%02x) "
+                    "was problematic.\n", str,
+                    (int)(b - (const unsigned char *)str), b[0]);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+int validate_json_string_len(struct htrace_log *lg, const char *str,
+                             size_t len)
+{
+    const unsigned char *b = (const unsigned char *)str, *end = b + len;
+    size_t seq_len;
+
+    while (1) {
+        b = json_skip_plain_len(b, end);
+        if (b == end) {
+            break;
+        }
+        seq_len = json_utf8_len(b, end - b);
+        if (seq_len) {
+            b += seq_len;
             continue;
         }
-        // Note: we don't allow code points outside the basic multilingual plane
-        // (BMP) at the moment.  The problem with them is that Javascript
-        // doesn't support them directly (they have to be encoded with UCS-2
-        // surrogate pairs).  TODO: teach htraced to do that encoding.
         if (lg) {
-            htrace_log(lg, "validate_json_string(%s): byte %d (0x%02x) "
-                       "was problematic.\n", str, off, b[0]);
+            HTRACE_LOG_RATELIMITED(lg, HTRACE_LOG_WARN,
+                    "validate_json_string(%.*s): byte %d (0x%02x) "
+                    "was problematic.\n", (int)len, str,
+                    (int)(b - (const unsigned char *)str), b[0]);
         }
         return 0;
     }
@@ -135,7 +335,7 @@ int parse_endpoint(struct htrace_log *lg, const char *endpoint,
             portstr = NULL;
         }
     }
-    remote = malloc(remote_len + 1);
+    remote = htrace_malloc(remote_len + 1);
     if (!remote) {
         htrace_log(lg, "parse_hostport: unable to allocate %d-byte string.\n",
                    remote_len);
@@ -148,7 +348,7 @@ int parse_endpoint(struct htrace_log *lg, const char *endpoint,
     } else {
         int p = atoi(portstr);
         if ((p <= 0) || (p > 0xffff)) {
-            free(remote);
+            htrace_free(remote);
             htrace_log(lg, "parse_hostport: parse port string '%s'\n",
                        portstr);
             return 0;
@@ -19,6 +19,8 @@
 #ifndef APACHE_HTRACE_UTIL_STRING_H
 #define APACHE_HTRACE_UTIL_STRING_H
 
+#include <stddef.h> /* for size_t */
+
 /**
  * @file string.h
  *
@@ -59,6 +61,19 @@ int fwdprintf(char **buf, int* rem, const char *fmt, ...)
  */
 int validate_json_string(struct htrace_log *lg, const char *str);
 
+/**
+ * Validate a string which is not NUL-terminated, as validate_json_string
+ * does.  A NUL byte within the string is problematic.
+ *
+ * @param lg            The log to print messages about invalid strings to.
+ * @param str           The string.
+ * @param len           The length of the string.
+ *
+ * @return              0 if the string is problematic; 1 if it's safe.
+ */
+int validate_json_string_len(struct htrace_log *lg, const char *str,
+                             size_t len);
+
 /**
  * Parse an endpoint string.
  *
@@ -16,16 +16,27 @@
  * limitations under the License.
  */
 
+#include "core/conf.h"
+#include "core/htrace.h"
+#include "util/alloc.h"
 #include "util/log.h"
 #include "util/time.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HTRACE_HAVE_TSC
+#endif
+
 uint64_t timespec_to_ms(const struct timespec *ts)
 {
     uint64_t seconds_ms, microseconds_ms;
@@ -84,6 +95,320 @@ uint64_t monotonic_now_ms(struct htrace_log *lg)
     return timespec_to_ms(&ts);
 }
 
+uint64_t monotonic_now_ns(struct htrace_log *lg)
+{
+    struct timespec ts;
+    int err;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        err = errno;
+        if (lg) {
+            htrace_log(lg, "clock_gettime(CLOCK_MONOTONIC) error: %d (%s)\n",
+                       err, terror(err));
+        }
+        return 0;
+    }
+    return (((uint64_t)ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+static const char * const HTRACE_CLOCK_NAMES[] = {
+    "realtime",
+    "realtime-coarse",
+    "tsc",
+};
+
+/**
+ * How long to wait between the two readings used to calibrate the TSC
+ * clock.
+ */
+#define HTRACE_TSC_CALIBRATION_MS 5
+
+/**
+ * How often the TSC clock is re-anchored to CLOCK_REALTIME, in nanoseconds.
+ */
+#define HTRACE_TSC_REANCHOR_NS 1000000000ULL
+
+/**
+ * When re-anchoring, a newly measured TSC rate which differs from the old one
+ * by more than 1 part in this many is assumed to be caused by the wall clock
+ * being stepped, and is ignored.
+ */
+#define HTRACE_TSC_MAX_RATE_CHANGE 100
+
+struct htrace_clock {
+    enum htrace_clock_type ty;
+
+    struct htrace_log *lg;
+
+#ifdef HTRACE_HAVE_TSC
+    /**
+     * The TSC clock's anchor is protected by a sequence lock.  The sequence
+     * number is odd while the anchor is being changed.  Readers retry if it
+     * changed while they were reading.
+     */
+    uint64_t seq;
+
+    /**
+     * A TSC reading.
+     */
+    uint64_t anchor_tsc;
+
+    /**
+     * The CLOCK_REALTIME time, in nanoseconds, at anchor_tsc.
+     */
+    uint64_t anchor_ns;
+
+    /**
+     * Nanoseconds per TSC tick, as a 32.32 fixed point number.
+     */
+    uint64_t mult;
+
+    /**
+     * The number of TSC ticks after which we re-anchor.
+     */
+    uint64_t reanchor_ticks;
+
+    /**
+     * Held by the thread which is re-anchoring the clock.
+     */
+    pthread_mutex_t lock;
+#endif
+};
+
+static enum htrace_clock_type htrace_clock_get_conf_type(
+                struct htrace_log *lg, const struct htrace_conf *cnf)
+{
+    const char *val;
+    int i;
+
+    val = htrace_conf_get(cnf, HTRACE_CLOCK_KEY);
+    for (i = 0; i <= HTRACE_CLOCK_TSC; i++) {
+        if (val && !strcmp(val, HTRACE_CLOCK_NAMES[i])) {
+            return i;
+        }
+    }
+    htrace_log(lg, "htrace_clock_alloc: unknown value for %s: '%s'.  "
+               "Using %s instead.\n", HTRACE_CLOCK_KEY,
+               (val ? val : "(null)"),
+               HTRACE_CLOCK_NAMES[HTRACE_CLOCK_REALTIME]);
+    return HTRACE_CLOCK_REALTIME;
+}
+
+static uint64_t clock_ns(struct htrace_log *lg, clockid_t id,
+                         const char *id_name)
+{
+    struct timespec ts;
+    int err;
+
+    if (clock_gettime(id, &ts)) {
+        err = errno;
+        if (lg) {
+            htrace_log(lg, "clock_gettime(%s) error: %d (%s)\n",
+                       id_name, err, terror(err));
+        }
+        return 0;
+    }
+    return (((uint64_t)ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+#ifdef HTRACE_HAVE_TSC
+/**
+ * Compute the 32.32 fixed point number of nanoseconds per TSC tick.
+ */
+static uint64_t tsc_mult(uint64_t ns, uint64_t ticks)
+{
+    return (uint64_t)((((unsigned __int128)ns) << 32) / ticks);
+}
+
+static uint64_t tsc_ticks_to_ns(uint64_t ticks, uint64_t mult)
+{
+    return (uint64_t)((((unsigned __int128)ticks) * mult) >> 32);
+}
+
+/**
+ * Calibrate the TSC clock.
+ *
+ * @return          1 if the TSC can be used as a clock; 0 otherwise.
+ */
+static int tsc_calibrate(struct htrace_clock *clk)
+{
+    unsigned int eax, ebx, ecx, edx;
+    uint64_t tsc0, ns0, tsc1, ns1;
+
+    // Only use the TSC if it is invariant, that is, if it runs at a constant
+    // rate regardless of frequency scaling and sleep states.
+    if ((!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) ||
+            (!(edx & (1U << 8)))) {
+        htrace_log(clk->lg, "htrace_clock_alloc: the TSC is not "
+                   "invariant on this CPU.\n");
+        return 0;
+    }
+    ns0 = clock_ns(clk->lg, CLOCK_REALTIME, "CLOCK_REALTIME");
+    tsc0 = __rdtsc();
+    sleep_ms(HTRACE_TSC_CALIBRATION_MS);
+    ns1 = clock_ns(clk->lg, CLOCK_REALTIME, "CLOCK_REALTIME");
+    tsc1 = __rdtsc();
+    if ((tsc1 <= tsc0) || (ns1 <= ns0)) {
+        htrace_log(clk->lg, "htrace_clock_alloc: failed to calibrate the "
+                   "TSC.\n");
+        return 0;
+    }
+    clk->seq = 0;
+    clk->anchor_tsc = tsc1;
+    clk->anchor_ns = ns1;
+    clk->mult = tsc_mult(ns1 - ns0, tsc1 - tsc0);
+    clk->reanchor_ticks = (uint64_t)(((((unsigned __int128)
+                HTRACE_TSC_REANCHOR_NS) << 32) / clk->mult));
+    return 1;
+}
+
+/**
+ * Re-anchor the TSC clock to CLOCK_REALTIME, and refine its rate using the
+ * time since it was last anchored.  If another thread is already doing this,
+ * we don't wait for it.
+ */
+static void tsc_reanchor(struct htrace_clock *clk)
+{
+    uint64_t seq, tsc, ns, mult, new_mult, diff;
+
+    if (pthread_mutex_trylock(&clk->lock)) {
+        return;
+    }
+    ns = clock_ns(clk->lg, CLOCK_REALTIME, "CLOCK_REALTIME");
+    tsc = __rdtsc();
+    if ((tsc - clk->anchor_tsc <= clk->reanchor_ticks) ||
+            (ns <= clk->anchor_ns)) {
+        // Someone else re-anchored while we were waiting, or the wall clock
+        // went backwards.
+        pthread_mutex_unlock(&clk->lock);
+        return;
+    }
+    mult = clk->mult;
+    new_mult = tsc_mult(ns - clk->anchor_ns, tsc - clk->anchor_tsc);
+    diff = (new_mult > mult) ? (new_mult - mult) : (mult - new_mult);
+    if (diff <= (mult / HTRACE_TSC_MAX_RATE_CHANGE)) {
+        mult = new_mult;
+    }
+    seq = clk->seq;
+    __atomic_store_n(&clk->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&clk->anchor_tsc, tsc, __ATOMIC_RELAXED);
+    __atomic_store_n(&clk->anchor_ns, ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&clk->mult, mult, __ATOMIC_RELAXED);
+    __atomic_store_n(&clk->seq, seq + 2, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&clk->lock);
+}
+
+static uint64_t tsc_now_ns(struct htrace_clock *clk)
+{
+    uint64_t seq, anchor_tsc, anchor_ns, mult, delta;
+
+    while (1) {
+        seq = __atomic_load_n(&clk->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        anchor_tsc = __atomic_load_n(&clk->anchor_tsc, __ATOMIC_RELAXED);
+        anchor_ns = __atomic_load_n(&clk->anchor_ns, __ATOMIC_RELAXED);
+        mult = __atomic_load_n(&clk->mult, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&clk->seq, __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+    delta = __rdtsc() - anchor_tsc;
+    if (((int64_t)delta) < 0) {
+        // This CPU's counter is slightly behind the one which set the anchor.
+        delta = 0;
+    } else if (delta > clk->reanchor_ticks) {
+        tsc_reanchor(clk);
+    }
+    return anchor_ns + tsc_ticks_to_ns(delta, mult);
+}
+#endif
+
+struct htrace_clock *htrace_clock_alloc(struct htrace_log *lg,
+                                        const struct htrace_conf *cnf)
+{
+    struct htrace_clock *clk;
+
+    clk = htrace_calloc(1, sizeof(*clk));
+    if (!clk) {
+        return NULL;
+    }
+    clk->lg = lg;
+    clk->ty = htrace_clock_get_conf_type(lg, cnf);
+    switch (clk->ty) {
+    case HTRACE_CLOCK_REALTIME_COARSE:
+#ifndef CLOCK_REALTIME_COARSE
+        htrace_log(lg, "htrace_clock_alloc: CLOCK_REALTIME_COARSE is not "
+                   "available on this platform.  Using %s instead.\n",
+                   HTRACE_CLOCK_NAMES[HTRACE_CLOCK_REALTIME]);
+        clk->ty = HTRACE_CLOCK_REALTIME;
+#endif
+        break;
+    case HTRACE_CLOCK_TSC:
+#ifdef HTRACE_HAVE_TSC
+        if (pthread_mutex_init(&clk->lock, NULL)) {
+            htrace_free(clk);
+            return NULL;
+        }
+        if (tsc_calibrate(clk)) {
+            break;
+        }
+        pthread_mutex_destroy(&clk->lock);
+#endif
+        htrace_log(lg, "htrace_clock_alloc: the TSC clock is not available.  "
+                   "Using %s instead.\n",
+                   HTRACE_CLOCK_NAMES[HTRACE_CLOCK_REALTIME]);
+        clk->ty = HTRACE_CLOCK_REALTIME;
+        break;
+    default:
+        break;
+    }
+    return clk;
+}
+
+void htrace_clock_free(struct htrace_clock *clk)
+{
+    if (!clk) {
+        return;
+    }
+#ifdef HTRACE_HAVE_TSC
+    if (clk->ty == HTRACE_CLOCK_TSC) {
+        pthread_mutex_destroy(&clk->lock);
+    }
+#endif
+    htrace_free(clk);
+}
+
+enum htrace_clock_type htrace_clock_get_type(const struct htrace_clock *clk)
+{
+    return clk->ty;
+}
+
+uint64_t htrace_clock_now_ns(struct htrace_clock *clk)
+{
+    switch (clk->ty) {
+#ifdef CLOCK_REALTIME_COARSE
+    case HTRACE_CLOCK_REALTIME_COARSE:
+        return clock_ns(clk->lg, CLOCK_REALTIME_COARSE,
+                        "CLOCK_REALTIME_COARSE");
+#endif
+#ifdef HTRACE_HAVE_TSC
+    case HTRACE_CLOCK_TSC:
+        return tsc_now_ns(clk);
+#endif
+    default:
+        return clock_ns(clk->lg, CLOCK_REALTIME, "CLOCK_REALTIME");
+    }
+}
+
+uint64_t htrace_clock_now_ms(struct htrace_clock *clk)
+{
+    return htrace_clock_now_ns(clk) / 1000000ULL;
+}
+
 void sleep_ms(uint64_t ms)
 {
     struct timespec req, rem;
@@ -29,10 +29,38 @@
 
 #include <stdint.h>
 
+struct htrace_conf;
 struct htrace_log;
 struct timespec;
 struct timeval;
 
+/**
+ * The sources of wall-clock time which an htrace_clock can use.
+ */
+enum htrace_clock_type {
+    /**
+     * clock_gettime(CLOCK_REALTIME).
+     */
+    HTRACE_CLOCK_REALTIME = 0,
+
+    /**
+     * clock_gettime(CLOCK_REALTIME_COARSE).  Cheaper than CLOCK_REALTIME, but
+     * only as precise as the kernel tick.
+     */
+    HTRACE_CLOCK_REALTIME_COARSE,
+
+    /**
+     * The CPU timestamp counter, calibrated against CLOCK_REALTIME and
+     * re-anchored to it about once a second.
+     */
+    HTRACE_CLOCK_TSC,
+};
+
+/**
+ * A source of wall-clock time for span timestamps.
+ */
+struct htrace_clock;
+
 /**
  * Convert a timespec into a time in milliseconds.
  *
@@ -76,6 +104,64 @@ uint64_t now_ms(struct htrace_log *log);
  */
 uint64_t monotonic_now_ms(struct htrace_log *log);
 
+/**
+ * Get the current monotonic time in nanoseconds.
+ *
+ * @param log           The log to use for error messsages.
+ *
+ * @return              The current monotonic clock time in nanoseconds.
+ */
+uint64_t monotonic_now_ns(struct htrace_log *log);
+
+/**
+ * Create a clock.
+ *
+ * @param lg            The log to use for error messages.  Must remain valid
+ *                          for as long as the clock does.
+ * @param cnf           The configuration.  The clock type is taken from
+ *                          HTRACE_CLOCK_KEY.  If the requested clock is not
+ *                          available on this platform, we use
+ *                          HTRACE_CLOCK_REALTIME instead.
+ *
+ * @return              NULL on OOM; the clock otherwise.
+ */
+struct htrace_clock *htrace_clock_alloc(struct htrace_log *lg,
+                                        const struct htrace_conf *cnf);
+
+/**
+ * Free a clock.
+ *
+ * @param clk           The clock, or NULL.
+ */
+void htrace_clock_free(struct htrace_clock *clk);
+
+/**
+ * Get the type of a clock.
+ *
+ * @param clk           The clock.
+ *
+ * @return              The clock type which is actually in use.
+ */
+enum htrace_clock_type htrace_clock_get_type(const struct htrace_clock *clk);
+
+/**
+ * Get the current wall-clock time in nanoseconds.
+ *
+ * @param clk           The clock.
+ *
+ * @return              The current wall-clock time in nanoseconds.
+ */
+uint64_t htrace_clock_now_ns(struct htrace_clock *clk);
+
+/**
+ * Get the current wall-clock time in milliseconds.
+ *
+ * @param clk           The clock.
+ *
+ * @return              The current wall-clock time in milliseconds.
+ */
+uint64_t htrace_clock_now_ms(struct htrace_clock *clk);
+
 /**
  * Sleep for at least a given number of milliseconds.
  *
@@ -16,12 +16,14 @@
  * limitations under the License.
  */
 
+#include "util/alloc.h"
 #include "util/log.h"
 #include "util/tracer_id.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
 #include <ifaddrs.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -60,7 +62,7 @@ enum ip_addr_type get_ipv6_addr_type(const struct sockaddr_in6 *ip);
 
 static int append_char(char **out, int *j, char c)
 {
-    char *nout = realloc(*out, *j + 2); // leave space for NULL
+    char *nout = htrace_realloc(*out, *j + 2); // leave space for NULL
     if (!nout) {
         return 0;
     }
@@ -77,7 +79,7 @@ char *calculate_tracer_id(struct htrace_log *lg, const char *fmt,
     int i = 0, j = 0, escaping = 0, v = 0;
     char *out = NULL, *var = NULL;
 
-    out = strdup("");
+    out = htrace_strdup("");
     if (!out) {
         goto oom;
     }
@@ -125,7 +127,7 @@ char *calculate_tracer_id(struct htrace_log *lg, const char *fmt,
                     if (!handle_process_subst_var(lg, &out, var, tname)) {
                         goto oom;
                     }
-                    free(var);
+                    htrace_free(var);
                     var = NULL;
                     j = strlen(out);
                     v = 0;
@@ -150,13 +152,13 @@ char *calculate_tracer_id(struct htrace_log *lg, const char *fmt,
                  "substitution variable at the end of the format string.",
                  fmt);
     }
-    free(var);
+    htrace_free(var);
     return out;
 
 oom:
     htrace_log(lg, "calculate_tracer_id(tname=%s): OOM\n", tname);
-    free(out);
-    free(var);
+    htrace_free(out);
+    htrace_free(var);
     return NULL;
 }
 
@@ -166,31 +168,31 @@ static int handle_process_subst_var(struct htrace_log *lg, char **out,
     char *nout = NULL;
 
     if (strcmp(var, "%{tname}") == 0) {
-        if (asprintf(&nout, "%s%s", *out, tname) < 0) {
+        if (htrace_asprintf(&nout, "%s%s", *out, tname) < 0) {
             htrace_log(lg, "handle_process_subst_var(var=%s): OOM", var);
             return 0;
         }
-        free(*out);
+        htrace_free(*out);
         *out = nout;
     } else if (strcmp(var, "%{ip}") == 0) {
         char ip_str[256];
         get_best_ip(lg, ip_str, sizeof(ip_str));
-        if (asprintf(&nout, "%s%s", *out, ip_str) < 0) {
+        if (htrace_asprintf(&nout, "%s%s", *out, ip_str) < 0) {
             htrace_log(lg, "handle_process_subst_var(var=%s): OOM", var);
             return 0;
         }
-        free(*out);
+        htrace_free(*out);
         *out = nout;
     } else if (strcmp(var, "%{pid}") == 0) {
         char pid_str[64];
         pid_t pid = getpid();
 
         snprintf(pid_str, sizeof(pid_str), "%lld", (long long)pid);
-        if (asprintf(&nout, "%s%s", *out, pid_str) < 0) {
+        if (htrace_asprintf(&nout, "%s%s", *out, pid_str) < 0) {
             htrace_log(lg, "handle_process_subst_var(var=%s): OOM", var);
             return 0;
         }
-        free(*out);
+        htrace_free(*out);
         *out = nout;
     } else {
         htrace_log(lg, "handle_process_subst_var(var=%s): unknown process "
@@ -210,8 +212,12 @@ static int handle_process_subst_var(struct htrace_log *lg, char **out,
  * to choose from, we select the one which comes first in textual sort
  * order.  This should ensure that we at least consistently call each node
  * by a single name.
+ *
+ * @return          1 on success; 0 if we could not list the interfaces, and
+ *                      fell back on the IPv4 loopback address.
  */
-void get_best_ip(struct htrace_log *lg, char *ip_str, size_t ip_str_len)
+static int get_best_ip_impl(struct htrace_log *lg, char *ip_str,
+                            size_t ip_str_len)
 {
     struct ifaddrs *head, *ifa;
     enum ip_addr_type ty = ADDR_TYPE_IPV4_LOOPBACK, nty;
@@ -221,7 +227,7 @@ void get_best_ip(struct htrace_log *lg, char *ip_str, size_t ip_str_len)
     if (getifaddrs(&head) < 0) {
         int res = errno;
         htrace_log(lg, "get_best_ip: getifaddrs failed: %s\n", terror(res));
-        return;
+        return 0;
     }
     for (ifa = head; ifa; ifa = ifa->ifa_next){
         if (!ifa->ifa_addr) {
@@ -266,6 +272,35 @@ void get_best_ip(struct htrace_log *lg, char *ip_str, size_t ip_str_len)
         }
     }
     freeifaddrs(head);
+    return 1;
+}
+
+/**
+ * Protects g_best_ip.
+ */
+static pthread_mutex_t g_best_ip_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The best IP address, once get_best_ip_impl has found it, or the empty
+ * string before then.
+ */
+static char g_best_ip[128];
+
+void get_best_ip(struct htrace_log *lg, char *ip_str, size_t ip_str_len)
+{
+    char temp_ip_str[sizeof(g_best_ip)];
+
+    pthread_mutex_lock(&g_best_ip_lock);
+    if (g_best_ip[0]) {
+        snprintf(ip_str, ip_str_len, "%s", g_best_ip);
+    } else if (get_best_ip_impl(lg, temp_ip_str, sizeof(temp_ip_str))) {
+        snprintf(g_best_ip, sizeof(g_best_ip), "%s", temp_ip_str);
+        snprintf(ip_str, ip_str_len, "%s", g_best_ip);
+    } else {
+        // Don't cache the fallback address, so that we try again next time.
+        snprintf(ip_str, ip_str_len, "%s", temp_ip_str);
+    }
+    pthread_mutex_unlock(&g_best_ip_lock);
 }
 
 enum ip_addr_type get_ipv4_addr_type(const struct sockaddr_in *ip)
@@ -47,6 +47,9 @@ char *calculate_tracer_id(struct htrace_log *lg, const char *fmt,
 /**
  * Get the best IP address representing this host.
  *
+ * Listing the network interfaces can be slow on hosts with many of them, so
+ * the address is only looked up once per process, and shared by all tracers.
+ *
  * @param lg                A log object which will be used to report warnings.
  * @param ip_str            (out param) output string
  * @param ip_str_len        Length of output string
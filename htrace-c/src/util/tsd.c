@@ -0,0 +1,313 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/alloc.h"
+#include "util/fork.h"
+#include "util/tsd.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+
+/**
+ * @file tsd.c
+ *
+ * Implements thread-specific data which is retired when the thread exits.
+ *
+ * Each thread keeps a list of its entries, whose head is the thread's value
+ * of g_tsd_key.  Only the thread itself changes that list, except in a
+ * forked child, where the other threads are gone.
+ */
+
+struct htrace_tsd_ent {
+    /**
+     * The owner, or NULL once the owner has been destroyed.  Protected by
+     * g_tsd_lock.
+     */
+    struct htrace_tsd *tsd;
+
+    /**
+     * The thread's value.
+     */
+    void *data;
+
+    /**
+     * The next entry of the same thread.
+     */
+    struct htrace_tsd_ent *tnext;
+
+    /**
+     * The next and previous entries of the same owner.  Protected by
+     * g_tsd_lock.
+     */
+    struct htrace_tsd_ent *next;
+    struct htrace_tsd_ent *prev;
+};
+
+static pthread_once_t g_tsd_once = PTHREAD_ONCE_INIT;
+
+/**
+ * The error from creating g_tsd_key, or 0.
+ */
+static int g_tsd_init_ret;
+
+/**
+ * Holds the head of each thread's list of entries.  Never deleted.
+ */
+static pthread_key_t g_tsd_key;
+
+/**
+ * Protects the owners and their entries.  Never held while calling a retire
+ * callback.
+ */
+static pthread_mutex_t g_tsd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Signalled when an owner's last running retire callback returns.
+ */
+static pthread_cond_t g_tsd_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * All the owners which haven't been destroyed.  Protected by g_tsd_lock.
+ */
+static struct htrace_tsd *g_tsds;
+
+static struct htrace_fork_hook g_tsd_fork_hook;
+
+/**
+ * Take an entry off its owner's list.
+ * This function must be called with the lock held.
+ */
+static void htrace_tsd_unlink(struct htrace_tsd_ent *ent)
+{
+    if (ent->prev) {
+        ent->prev->next = ent->next;
+    } else {
+        ent->tsd->ents = ent->next;
+    }
+    if (ent->next) {
+        ent->next->prev = ent->prev;
+    }
+}
+
+/**
+ * Free the entries of a thread's list whose owners have been destroyed.
+ * This function must be called with the lock held.
+ *
+ * @param head          The head of the list.
+ *
+ * @return              The new head of the list.
+ */
+static struct htrace_tsd_ent *htrace_tsd_prune(struct htrace_tsd_ent *head)
+{
+    struct htrace_tsd_ent **prev = &head, *ent;
+
+    while ((ent = *prev)) {
+        if (ent->tsd) {
+            prev = &ent->tnext;
+            continue;
+        }
+        *prev = ent->tnext;
+        htrace_free(ent);
+    }
+    return head;
+}
+
+/**
+ * The destructor of g_tsd_key.  Retires each of the exiting thread's
+ * entries whose owner still exists.
+ */
+static void htrace_tsd_thread_exit(void *data)
+{
+    struct htrace_tsd_ent *ent = data, *tnext;
+    struct htrace_tsd *tsd;
+
+    pthread_mutex_lock(&g_tsd_lock);
+    for (; ent; ent = tnext) {
+        tnext = ent->tnext;
+        tsd = ent->tsd;
+        if (tsd) {
+            // Keep the owner from being destroyed until the callback is
+            // done, without holding the lock across it.
+            htrace_tsd_unlink(ent);
+            tsd->busy++;
+            pthread_mutex_unlock(&g_tsd_lock);
+            pthread_setspecific(tsd->key, NULL);
+            tsd->retire(ent->data);
+            pthread_mutex_lock(&g_tsd_lock);
+            if (--tsd->busy == 0) {
+                pthread_cond_broadcast(&g_tsd_cond);
+            }
+        }
+        htrace_free(ent);
+    }
+    pthread_mutex_unlock(&g_tsd_lock);
+}
+
+static void htrace_tsd_fork_prepare(void *data)
+{
+    pthread_mutex_lock(&g_tsd_lock);
+}
+
+static void htrace_tsd_fork_parent(void *data)
+{
+    pthread_mutex_unlock(&g_tsd_lock);
+}
+
+/**
+ * In a forked child, only the forking thread's entries can ever be retired.
+ * Free everyone else's.
+ */
+static void htrace_tsd_fork_child(void *data)
+{
+    struct htrace_tsd_ent *mine, *ent;
+    struct htrace_tsd *tsd;
+
+    pthread_mutex_unlock(&g_tsd_lock);
+    pthread_cond_init(&g_tsd_cond, NULL);
+    mine = pthread_getspecific(g_tsd_key);
+    for (ent = mine; ent; ent = ent->tnext) {
+        if (ent->tsd) {
+            htrace_tsd_unlink(ent);
+        }
+    }
+    for (tsd = g_tsds; tsd; tsd = tsd->next) {
+        tsd->busy = 0;
+        while ((ent = tsd->ents)) {
+            tsd->ents = ent->next;
+            htrace_free(ent);
+        }
+    }
+    for (ent = mine; ent; ent = ent->tnext) {
+        if (ent->tsd) {
+            ent->prev = NULL;
+            ent->next = ent->tsd->ents;
+            if (ent->next) {
+                ent->next->prev = ent;
+            }
+            ent->tsd->ents = ent;
+        }
+    }
+}
+
+static void htrace_tsd_global_init(void)
+{
+    g_tsd_init_ret = pthread_key_create(&g_tsd_key, htrace_tsd_thread_exit);
+    if (g_tsd_init_ret) {
+        return;
+    }
+    g_tsd_fork_hook.prepare = htrace_tsd_fork_prepare;
+    g_tsd_fork_hook.parent = htrace_tsd_fork_parent;
+    g_tsd_fork_hook.child = htrace_tsd_fork_child;
+    g_tsd_fork_hook.data = NULL;
+    htrace_fork_hook_register(&g_tsd_fork_hook);
+}
+
+int htrace_tsd_init(struct htrace_tsd *tsd, void (*retire)(void *data))
+{
+    int ret;
+
+    pthread_once(&g_tsd_once, htrace_tsd_global_init);
+    if (g_tsd_init_ret) {
+        return g_tsd_init_ret;
+    }
+    ret = pthread_key_create(&tsd->key, NULL);
+    if (ret) {
+        return ret;
+    }
+    tsd->retire = retire;
+    tsd->ents = NULL;
+    tsd->busy = 0;
+    tsd->prev = NULL;
+    pthread_mutex_lock(&g_tsd_lock);
+    tsd->next = g_tsds;
+    if (g_tsds) {
+        g_tsds->prev = tsd;
+    }
+    g_tsds = tsd;
+    pthread_mutex_unlock(&g_tsd_lock);
+    return 0;
+}
+
+int htrace_tsd_set(struct htrace_tsd *tsd, void *data)
+{
+    struct htrace_tsd_ent *ent;
+    int ret;
+
+    ent = htrace_malloc(sizeof(*ent));
+    if (!ent) {
+        return ENOMEM;
+    }
+    ret = pthread_setspecific(tsd->key, data);
+    if (ret) {
+        htrace_free(ent);
+        return ret;
+    }
+    ent->tsd = tsd;
+    ent->data = data;
+    ent->tnext = pthread_getspecific(g_tsd_key);
+    ret = pthread_setspecific(g_tsd_key, ent);
+    if (ret) {
+        pthread_setspecific(tsd->key, NULL);
+        htrace_free(ent);
+        return ret;
+    }
+    pthread_mutex_lock(&g_tsd_lock);
+    ent->prev = NULL;
+    ent->next = tsd->ents;
+    if (tsd->ents) {
+        tsd->ents->prev = ent;
+    }
+    tsd->ents = ent;
+    ent->tnext = htrace_tsd_prune(ent->tnext);
+    pthread_mutex_unlock(&g_tsd_lock);
+    return 0;
+}
+
+void htrace_tsd_destroy(struct htrace_tsd *tsd)
+{
+    struct htrace_tsd_ent *ent, *head;
+
+    pthread_mutex_lock(&g_tsd_lock);
+    while (tsd->busy) {
+        pthread_cond_wait(&g_tsd_cond, &g_tsd_lock);
+    }
+    // The other threads free their orphaned entries the next time they set
+    // a value, or when they exit.
+    for (ent = tsd->ents; ent; ent = ent->next) {
+        ent->tsd = NULL;
+    }
+    tsd->ents = NULL;
+    if (tsd->prev) {
+        tsd->prev->next = tsd->next;
+    } else {
+        g_tsds = tsd->next;
+    }
+    if (tsd->next) {
+        tsd->next->prev = tsd->prev;
+    }
+    head = pthread_getspecific(g_tsd_key);
+    ent = htrace_tsd_prune(head);
+    if (ent != head) {
+        pthread_setspecific(g_tsd_key, ent);
+    }
+    pthread_mutex_unlock(&g_tsd_lock);
+    pthread_key_delete(tsd->key);
+}
+
+// vim: ts=4:sw=4:et
@@ -0,0 +1,127 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef APACHE_HTRACE_UTIL_TSD_H
+#define APACHE_HTRACE_UTIL_TSD_H
+
+/**
+ * @file tsd.h
+ *
+ * Thread-specific data which is handed back to its owner when the thread
+ * exits, and which the owner can safely be freed out from under.
+ *
+ * A plain pthread key destructor can't be used for this.  A thread which is
+ * exiting may already be inside the destructor when the owner deletes the
+ * key and frees itself, and there is no way to wait for that thread.  So
+ * the owner's key has no destructor.  Instead, every value is also recorded
+ * in an entry on a list belonging to the thread, under a single process-wide
+ * key which is never deleted.  When a thread exits, its entries are handed
+ * to their owners' retire callbacks.  htrace_tsd_destroy waits for any
+ * retire callback which is running, and orphans the owner's remaining
+ * entries, so that no retire callback can start afterwards.
+ *
+ * This is an internal header, not intended for external use.
+ */
+
+#include <pthread.h>
+
+struct htrace_tsd_ent;
+
+/**
+ * Thread-specific data belonging to one owner.
+ */
+struct htrace_tsd {
+    /**
+     * The key which holds each thread's value.  It has no destructor.
+     */
+    pthread_key_t key;
+
+    /**
+     * Called with a thread's value when the thread exits.  The owner can't
+     * be destroyed while this is running.  By the time it is called, the
+     * thread's value has been cleared.
+     */
+    void (*retire)(void *data);
+
+    /**
+     * The entries of the threads which have a value.  Protected by the tsd
+     * lock.
+     */
+    struct htrace_tsd_ent *ents;
+
+    /**
+     * The number of retire callbacks running.  Protected by the tsd lock.
+     */
+    int busy;
+
+    /**
+     * The next and previous thread-specific data.  Protected by the tsd
+     * lock.
+     */
+    struct htrace_tsd *next;
+    struct htrace_tsd *prev;
+};
+
+/**
+ * Initialize thread-specific data.
+ *
+ * @param tsd           The thread-specific data.
+ * @param retire        The retire callback.
+ *
+ * @return              0 on success; an error number otherwise.
+ */
+int htrace_tsd_init(struct htrace_tsd *tsd, void (*retire)(void *data));
+
+/**
+ * Get the current thread's value.
+ *
+ * @param tsd           The thread-specific data.
+ *
+ * @return              The value, or NULL if the thread has none.
+ */
+static inline void *htrace_tsd_get(const struct htrace_tsd *tsd)
+{
+    return pthread_getspecific(tsd->key);
+}
+
+/**
+ * Set the current thread's value.  The thread must not have a value yet.
+ * Don't call this with any other lock held.
+ *
+ * @param tsd           The thread-specific data.
+ * @param data          The value.  Must not be NULL.
+ *
+ * @return              0 on success; an error number otherwise.
+ */
+int htrace_tsd_set(struct htrace_tsd *tsd, void *data);
+
+/**
+ * Destroy thread-specific data.
+ *
+ * This waits for the retire callbacks which are running.  Once this returns,
+ * the retire callback won't be called again, and the values of the threads
+ * which are still running belong to the caller.  Don't call this with any
+ * lock held which the retire callback takes.
+ *
+ * @param tsd           The thread-specific data.
+ */
+void htrace_tsd_destroy(struct htrace_tsd *tsd);
+
+#endif
+
+// vim: ts=4:sw=4:et
@@ -0,0 +1,261 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "util/alloc.h"
+#include "util/log.h"
+#include "util/uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * @file uring.c
+ *
+ * A small wrapper around the io_uring system calls.
+ *
+ * The kernel shares three regions with us: the submission queue ring, the
+ * completion queue ring, and the array of submission queue entries.  We own
+ * the submission queue tail and the completion queue head; the kernel owns
+ * the other two.  Each side publishes its index with a release store, and
+ * reads the other side's index with an acquire load.
+ */
+
+struct uring {
+    /**
+     * The io_uring file descriptor.
+     */
+    int fd;
+
+    /**
+     * The mapped submission queue ring.
+     */
+    void *sq_ptr;
+    size_t sq_len;
+
+    /**
+     * The mapped completion queue ring.  This is the same mapping as sq_ptr
+     * on kernels which support IORING_FEAT_SINGLE_MMAP.
+     */
+    void *cq_ptr;
+    size_t cq_len;
+
+    /**
+     * The mapped submission queue entries.
+     */
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+
+    /**
+     * The tail of the submission queue, including the entries which have
+     * been filled in, but not submitted yet.
+     */
+    unsigned sqe_tail;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+struct uring *uring_create(struct htrace_log *lg, unsigned entries)
+{
+    struct io_uring_params p;
+    struct uring *ring;
+    int e;
+
+    ring = htrace_calloc(1, sizeof(*ring));
+    if (!ring) {
+        htrace_log(lg, "uring_create: OOM\n");
+        return NULL;
+    }
+    ring->sq_ptr = MAP_FAILED;
+    ring->cq_ptr = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+    memset(&p, 0, sizeof(p));
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd < 0) {
+        e = errno;
+        htrace_log(lg, "uring_create: io_uring_setup failed: error %d: %s\n",
+                   e, terror(e));
+        goto error;
+    }
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len) {
+            ring->sq_len = ring->cq_len;
+        }
+        ring->cq_len = ring->sq_len;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        e = errno;
+        htrace_log(lg, "uring_create: failed to map the submission queue: "
+                   "error %d: %s\n", e, terror(e));
+        goto error;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            e = errno;
+            htrace_log(lg, "uring_create: failed to map the completion "
+                       "queue: error %d: %s\n", e, terror(e));
+            goto error;
+        }
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        e = errno;
+        htrace_log(lg, "uring_create: failed to map the submission queue "
+                   "entries: error %d: %s\n", e, terror(e));
+        goto error;
+    }
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)
+        ((char *)ring->cq_ptr + p.cq_off.cqes);
+    return ring;
+
+error:
+    uring_free(ring);
+    return NULL;
+}
+
+void uring_free(struct uring *ring)
+{
+    if (!ring) {
+        return;
+    }
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if ((ring->cq_ptr != MAP_FAILED) && (ring->cq_ptr != ring->sq_ptr)) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    if (ring->sq_ptr != MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    htrace_free(ring);
+}
+
+int uring_fd(const struct uring *ring)
+{
+    return ring->fd;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head, idx;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+    idx = ring->sqe_tail & ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+int uring_submit(struct uring *ring, unsigned wait_nr)
+{
+    unsigned to_submit;
+    int ret;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    to_submit = ring->sqe_tail -
+        __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    while (1) {
+        ret = sys_io_uring_enter(ring->fd, to_submit, wait_nr,
+                                 wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        if (ret >= 0) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            return errno;
+        }
+        // Anything we submitted before the interruption went in.
+        to_submit = ring->sqe_tail -
+            __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+}
+
+int uring_peek_cqe(struct uring *ring, uint64_t *user_data, int32_t *res)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head;
+
+    head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    cqe = &ring->cqes[head & ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// vim:ts=4:sw=4:et
@@ -0,0 +1,105 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef APACHE_HTRACE_UTIL_URING_H
+#define APACHE_HTRACE_UTIL_URING_H
+
+/**
+ * @file uring.h
+ *
+ * A small wrapper around the io_uring system calls.
+ *
+ * We talk to the kernel directly, rather than through liburing, so that
+ * libhtrace doesn't pick up another dependency.  Only the features HRPC needs
+ * are here.  A ring must only be used by one thread at a time.
+ *
+ * This is an internal header, not intended for external use.  It is only
+ * built when HAVE_IO_URING is defined.
+ */
+
+#include <stdint.h>
+
+struct htrace_log;
+struct io_uring_sqe;
+struct uring;
+
+/**
+ * Create an io_uring.
+ *
+ * @param lg            The log to use for error messages.
+ * @param entries       The number of submission queue entries to ask for.
+ *
+ * @return              NULL on failure, for example because the kernel
+ *                          doesn't support io_uring; the ring otherwise.
+ */
+struct uring *uring_create(struct htrace_log *lg, unsigned entries);
+
+/**
+ * Free an io_uring.  The kernel cancels whatever is still outstanding.
+ *
+ * @param ring          The ring, or NULL.
+ */
+void uring_free(struct uring *ring);
+
+/**
+ * Get the file descriptor of an io_uring.  It polls readable when there are
+ * completions to reap.
+ *
+ * @param ring          The ring.
+ *
+ * @return              The file descriptor.
+ */
+int uring_fd(const struct uring *ring);
+
+/**
+ * Get a zeroed submission queue entry to fill in.  The entry is not
+ * submitted until uring_submit is called.
+ *
+ * @param ring          The ring.
+ *
+ * @return              NULL if the submission queue is full; the entry
+ *                          otherwise.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/**
+ * Submit all the entries we have filled in.
+ *
+ * @param ring          The ring.
+ * @param wait_nr       The number of completions to wait for, or 0 to
+ *                          return straight away.
+ *
+ * @return              0 on success; the error number otherwise.
+ */
+int uring_submit(struct uring *ring, unsigned wait_nr);
+
+/**
+ * Reap the next completion, if there is one, without blocking.
+ *
+ * @param ring          The ring.
+ * @param user_data     (out param) The user data of the completed entry.
+ * @param res           (out param) The result of the completed entry.
+ *
+ * @return              1 if we reaped a completion; 0 otherwise.
+ */
+int uring_peek_cqe(struct uring *ring, uint64_t *user_data, int32_t *res);
+
+#endif
+
+// vim: ts=4:sw=4:et
@@ -19,6 +19,11 @@
 
 package common
 
+import (
+	"encoding/binary"
+	"fmt"
+)
+
 // The 4-byte magic number which is sent first in the HRPC header
 const HRPC_MAGIC = 0x43525448
 
@@ -26,6 +31,17 @@ const HRPC_MAGIC = 0x43525448
 const (
 	METHOD_ID_NONE        = 0
 	METHOD_ID_WRITE_SPANS = iota
+
+	// A WriteSpans request whose body is compressed with zlib.  The response
+	// is an ordinary WriteSpans response.
+	METHOD_ID_WRITE_SPANS_ZLIB
+
+	// A WriteSpans request with Descs and TraceIds tables, whose spans are
+	// TableSpans.  The response is an ordinary WriteSpans response.
+	METHOD_ID_WRITE_SPANS_DICT
+
+	// A METHOD_ID_WRITE_SPANS_DICT request whose body is compressed with zlib.
+	METHOD_ID_WRITE_SPANS_DICT_ZLIB
 )
 
 const METHOD_NAME_WRITE_SPANS = "HrpcHandler.WriteSpans"
@@ -38,9 +54,48 @@ const MAX_HRPC_BODY_LENGTH = 32 * 1024 * 1024
 
 // A request to write spans to htraced.
 // This request is followed by a sequence of spans.
+//
+// In a METHOD_ID_WRITE_SPANS_DICT request, the spans are TableSpans, which
+// may refer to Descs and TraceIds instead of repeating their descriptions and
+// trace IDs.
 type WriteSpansReq struct {
 	DefaultTrid string `json:",omitempty"`
 	NumSpans    int
+	Descs       []string `json:",omitempty"`
+	TraceIds    []uint64 `json:",omitempty"`
+}
+
+// A span in a WriteSpans request which has tables.  DescIdx, if set, is the
+// index of the span's description in WriteSpansReq.Descs.  TraceIdx, if set,
+// is the index in WriteSpansReq.TraceIds of the high word of the span ID, and
+// IdLow is its low word.
+type TableSpan struct {
+	Span
+	DescIdx  *uint64 `json:"D,omitempty"`
+	TraceIdx *uint64 `json:"T,omitempty"`
+	IdLow    uint64  `json:"L,omitempty"`
+}
+
+// Fill in the fields of a span which refer to the WriteSpans tables.
+func (tspan *TableSpan) Resolve(req *WriteSpansReq) (*Span, error) {
+	if tspan.DescIdx != nil {
+		if *tspan.DescIdx >= uint64(len(req.Descs)) {
+			return nil, fmt.Errorf("description index %d is out of range",
+				*tspan.DescIdx)
+		}
+		tspan.Description = req.Descs[*tspan.DescIdx]
+	}
+	if tspan.TraceIdx != nil {
+		if *tspan.TraceIdx >= uint64(len(req.TraceIds)) {
+			return nil, fmt.Errorf("trace ID index %d is out of range",
+				*tspan.TraceIdx)
+		}
+		id := make(SpanId, 16)
+		binary.BigEndian.PutUint64(id[0:8], req.TraceIds[*tspan.TraceIdx])
+		binary.BigEndian.PutUint64(id[8:16], tspan.IdLow)
+		tspan.Id = id
+	}
+	return &tspan.Span, nil
 }
 
 // Info returned by /server/version
@@ -74,7 +129,8 @@ type HrpcResponseHeader struct {
 
 func HrpcMethodIdToMethodName(id uint32) string {
 	switch id {
-	case METHOD_ID_WRITE_SPANS:
+	case METHOD_ID_WRITE_SPANS, METHOD_ID_WRITE_SPANS_ZLIB,
+		METHOD_ID_WRITE_SPANS_DICT, METHOD_ID_WRITE_SPANS_DICT_ZLIB:
 		return METHOD_NAME_WRITE_SPANS
 	default:
 		return ""
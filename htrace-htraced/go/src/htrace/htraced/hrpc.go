@@ -22,6 +22,7 @@ package main
 import (
 	"bufio"
 	"bytes"
+	"compress/zlib"
 	"encoding/binary"
 	"encoding/json"
 	"errors"
@@ -98,6 +99,13 @@ type HrpcServerCodec struct {
 	// The message length we read from the header.
 	length uint32
 
+	// True if the message body we are about to read is compressed.
+	compressed bool
+
+	// True if the spans in the message body we are about to read are
+	// TableSpans.
+	tables bool
+
 	// The number of messages this connection has handled.
 	numHandled int
 
@@ -166,6 +174,10 @@ func (cdc *HrpcServerCodec) ReadRequestHeader(req *rpc.Request) error {
 	}
 	req.Seq = hdr.Seq
 	cdc.length = hdr.Length
+	cdc.compressed = (hdr.MethodId == common.METHOD_ID_WRITE_SPANS_ZLIB) ||
+		(hdr.MethodId == common.METHOD_ID_WRITE_SPANS_DICT_ZLIB)
+	cdc.tables = (hdr.MethodId == common.METHOD_ID_WRITE_SPANS_DICT) ||
+		(hdr.MethodId == common.METHOD_ID_WRITE_SPANS_DICT_ZLIB)
 	return nil
 }
 
@@ -189,7 +201,21 @@ func (cdc *HrpcServerCodec) ReadRequestBody(body interface{}) error {
 	var zeroTime time.Time
 	cdc.conn.SetDeadline(zeroTime)
 
-	dec := codec.NewDecoderBytes(cdc.buf[:cdc.length], &cdc.msgpackHandle)
+	var dec *codec.Decoder
+	if cdc.compressed {
+		zr, err := zlib.NewReader(bytes.NewReader(cdc.buf[:cdc.length]))
+		if err != nil {
+			return newIoErrorWarn(cdc, fmt.Sprintf("Failed to decompress "+
+				"%d-byte request body: %s", cdc.length, err.Error()))
+		}
+		defer zr.Close()
+		// Don't let a small compressed message expand into more than we would
+		// accept uncompressed.
+		dec = codec.NewDecoder(bufio.NewReader(io.LimitReader(zr,
+			common.MAX_HRPC_BODY_LENGTH)), &cdc.msgpackHandle)
+	} else {
+		dec = codec.NewDecoderBytes(cdc.buf[:cdc.length], &cdc.msgpackHandle)
+	}
 	err = dec.Decode(body)
 	if cdc.lg.TraceEnabled() {
 		cdc.lg.Tracef("%s: read HRPC message: %s\n",
@@ -211,7 +237,15 @@ func (cdc *HrpcServerCodec) ReadRequestBody(body interface{}) error {
 	ing := hand.store.NewSpanIngestor(hand.lg, client, req.DefaultTrid)
 	for spanIdx := 0; spanIdx < req.NumSpans; spanIdx++ {
 		var span *common.Span
-		err := dec.Decode(&span)
+		if cdc.tables {
+			var tspan common.TableSpan
+			err = dec.Decode(&tspan)
+			if err == nil {
+				span, err = tspan.Resolve(req)
+			}
+		} else {
+			err = dec.Decode(&span)
+		}
 		if err != nil {
 			return newIoErrorWarn(cdc, fmt.Sprintf("Failed to decode span %d "+
 				"out of %d: %s\n", spanIdx, req.NumSpans, err.Error()))